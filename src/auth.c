@@ -19,6 +19,10 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +36,8 @@
 #include "proto.h"
 #include "context.h"
 #include "mem.h"
+#include "protocols.h"
+#include "pubkeycache.h"
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -95,6 +101,8 @@ void otrl_auth_new(struct context *context)
     auth->secure_session_id_len = 0;
     auth->lastauthmsg = NULL;
     auth->commit_sent_time = 0;
+    auth->dh_keypool = NULL;
+    otrl_auth_prepared_init(&(auth->prepared));
     auth->context = context;
 }
 
@@ -137,66 +145,135 @@ void otrl_auth_clear(OtrlAuthInfo *auth)
 }
 
 /*
- * Start a fresh AKE (version 2 or 3) using the given OtrlAuthInfo.  Generate
- * a fresh DH keypair to use.  If no error is returned, the message to
- * transmit will be contained in auth->lastauthmsg.
+ * Initialize the fields of an OtrlAuthPrepared (already allocated) to
+ * hold nothing.
  */
-gcry_error_t otrl_auth_start_v23(OtrlAuthInfo *auth, int version)
+void otrl_auth_prepared_init(OtrlAuthPrepared *prep)
+{
+    otrl_dh_keypair_init(&(prep->our_dh));
+    memset(prep->r, 0, 16);
+    prep->encgx = NULL;
+    prep->encgx_len = 0;
+    memset(prep->hashgx, 0, 32);
+    prep->expires = 0;
+}
+
+/*
+ * Free whatever the given OtrlAuthPrepared holds, and set it back to
+ * holding nothing.
+ */
+void otrl_auth_prepared_free(OtrlAuthPrepared *prep)
+{
+    otrl_dh_keypair_free(&(prep->our_dh));
+    free(prep->encgx);
+    otrl_auth_prepared_init(prep);
+}
+
+/*
+ * Work out the D-H keypair, r, encrypted g^x and SHA256(g^x) of a D-H
+ * Commit Message into prep, which must hold nothing, taking the
+ * keypair from pool if there's one in it (pool may be NULL).  The
+ * material can be used by otrl_auth_start_v23 until the time expires.
+ */
+gcry_error_t otrl_auth_prepare_commit(OtrlAuthPrepared *prep,
+	DH_keypool *pool, time_t expires)
 {
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
-    const enum gcry_mpi_format format = GCRYMPI_FMT_USG;
-    size_t npub;
+    const unsigned char *pubwire;
+    size_t pubwirelen;
     gcry_cipher_hd_t enc = NULL;
     unsigned char ctr[16];
-    unsigned char *buf, *bufp;
-    size_t buflen, lenp;
 
-    /* Clear out this OtrlAuthInfo and start over */
-    otrl_auth_clear(auth);
-    auth->initiated = 1;
-    auth->protocol_version = version;
-    auth->context->protocol_version = version;
-
-    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
-    auth->our_keyid = 1;
+    otrl_dh_gen_keypair_pooled(pool, DH1536_GROUP_ID, &(prep->our_dh));
 
     /* Pick an encryption key */
-    gcry_randomize(auth->r, 16, GCRY_STRONG_RANDOM);
-
-    /* Allocate space for the encrypted g^x */
-    gcry_mpi_print(format, NULL, 0, &npub, auth->our_dh.pub);
-    auth->encgx = malloc(4+npub);
-    if (auth->encgx == NULL) goto memerr;
-    auth->encgx_len = 4+npub;
-    bufp = auth->encgx;
-    lenp = auth->encgx_len;
-    write_mpi(auth->our_dh.pub, npub, "g^x");
-    assert(lenp == 0);
+    gcry_randomize(prep->r, 16, GCRY_STRONG_RANDOM);
+
+    /* Copy g^x into the space for the encrypted g^x */
+    pubwire = otrl_dh_keypair_pubwire(&(prep->our_dh), &pubwirelen);
+    if (pubwire == NULL) goto memerr;
+    prep->encgx = malloc(pubwirelen);
+    if (prep->encgx == NULL) goto memerr;
+    prep->encgx_len = pubwirelen;
+    memmove(prep->encgx, pubwire, pubwirelen);
+    debug_data("g^x", prep->encgx + 4, pubwirelen - 4);
 
     /* Hash g^x */
-    gcry_md_hash_buffer(GCRY_MD_SHA256, auth->hashgx, auth->encgx,
-	    auth->encgx_len);
+    gcry_md_hash_buffer(GCRY_MD_SHA256, prep->hashgx, prep->encgx,
+	    prep->encgx_len);
 
     /* Encrypt g^x using the key r */
     err = gcry_cipher_open(&enc, GCRY_CIPHER_AES, GCRY_CIPHER_MODE_CTR,
 	    GCRY_CIPHER_SECURE);
     if (err) goto err;
 
-    err = gcry_cipher_setkey(enc, auth->r, 16);
+    err = gcry_cipher_setkey(enc, prep->r, 16);
     if (err) goto err;
 
     memset(ctr, 0, 16);
     err = gcry_cipher_setctr(enc, ctr, 16);
     if (err) goto err;
 
-    err = gcry_cipher_encrypt(enc, auth->encgx, auth->encgx_len, NULL, 0);
+    err = gcry_cipher_encrypt(enc, prep->encgx, prep->encgx_len, NULL, 0);
     if (err) goto err;
 
     gcry_cipher_close(enc);
-    enc = NULL;
+    prep->expires = expires;
+    return err;
+
+memerr:
+    err = gcry_error(GPG_ERR_ENOMEM);
+err:
+    otrl_auth_prepared_free(prep);
+    gcry_cipher_close(enc);
+    return err;
+}
+
+/*
+ * Start a fresh AKE (version 2 or 3) using the given OtrlAuthInfo.  Use
+ * the material in auth->prepared if it hasn't expired, or else
+ * generate a fresh DH keypair to use.  If no error is returned, the
+ * message to transmit will be contained in auth->lastauthmsg.
+ */
+gcry_error_t otrl_auth_start_v23(OtrlAuthInfo *auth, int version)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    OtrlAuthPrepared *prep = &(auth->prepared);
+    unsigned char *buf, *bufp;
+    size_t buflen, lenp;
+
+    if (version < 2 || !otrl_version_built(version)) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    /* Clear out this OtrlAuthInfo and start over */
+    otrl_auth_clear(auth);
+    auth->initiated = 1;
+    auth->protocol_version = version;
+    auth->context->protocol_version = version;
+
+    /* Use what was prepared ahead of time, if it's still good, and
+     * only once either way */
+    if (prep->encgx && prep->expires <= time(NULL)) {
+	otrl_auth_prepared_free(prep);
+    }
+    if (prep->encgx == NULL) {
+	err = otrl_auth_prepare_commit(prep, auth->dh_keypool, 0);
+	if (err) goto err;
+    }
+    auth->our_dh = prep->our_dh;
+    auth->our_keyid = 1;
+    memmove(auth->r, prep->r, 16);
+    auth->encgx = prep->encgx;
+    auth->encgx_len = prep->encgx_len;
+    memmove(auth->hashgx, prep->hashgx, 32);
+    otrl_dh_keypair_init(&(prep->our_dh));
+    prep->encgx = NULL;
+    otrl_auth_prepared_free(prep);
 
     /* Now serialize the message */
-    lenp = OTRL_HEADER_LEN + (auth->protocol_version == 3 ? 8 : 0) + 4
+    lenp = OTRL_HEADER_LEN
+	    + (otrl_version_is(auth->protocol_version, 3) ? 8 : 0) + 4
 	    + auth->encgx_len + 4 + 32;
     bufp = malloc(lenp);
     if (bufp == NULL) goto memerr;
@@ -205,7 +282,7 @@ gcry_error_t otrl_auth_start_v23(OtrlAuthInfo *auth, int version)
 
     /* Header */
     write_header(auth->protocol_version, '\x02');
-    if (auth->protocol_version == 3) {
+    if (otrl_version_is(auth->protocol_version, 3)) {
 	/* instance tags */
 	write_int(auth->context->our_instance);
 	debug_int("Sender instag", bufp-4);
@@ -240,7 +317,6 @@ memerr:
     err = gcry_error(GPG_ERR_ENOMEM);
 err:
     otrl_auth_clear(auth);
-    gcry_cipher_close(enc);
     return err;
 }
 
@@ -251,13 +327,15 @@ err:
 static gcry_error_t create_key_message(OtrlAuthInfo *auth)
 {
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
-    const enum gcry_mpi_format format = GCRYMPI_FMT_USG;
     unsigned char *buf, *bufp;
     size_t buflen, lenp;
-    size_t npub;
+    const unsigned char *pubwire;
+    size_t pubwirelen;
 
-    gcry_mpi_print(format, NULL, 0, &npub, auth->our_dh.pub);
-    buflen = OTRL_HEADER_LEN + (auth->protocol_version == 3 ? 8 : 0) + 4 + npub;
+    pubwire = otrl_dh_keypair_pubwire(&(auth->our_dh), &pubwirelen);
+    if (pubwire == NULL) goto memerr;
+    buflen = OTRL_HEADER_LEN
+	+ (otrl_version_is(auth->protocol_version, 3) ? 8 : 0) + pubwirelen;
     buf = malloc(buflen);
     if (buf == NULL) goto memerr;
     bufp = buf;
@@ -265,7 +343,7 @@ static gcry_error_t create_key_message(OtrlAuthInfo *auth)
 
     /* header */
     write_header(auth->protocol_version, '\x0a');
-    if (auth->protocol_version == 3) {
+    if (otrl_version_is(auth->protocol_version, 3)) {
 	/* instance tags */
 	write_int(auth->context->our_instance);
 	debug_int("Sender instag", bufp-4);
@@ -274,7 +352,9 @@ static gcry_error_t create_key_message(OtrlAuthInfo *auth)
     }
 
     /* g^y */
-    write_mpi(auth->our_dh.pub, npub, "g^y");
+    memmove(bufp, pubwire, pubwirelen);
+    debug_data("g^y", bufp + 4, pubwirelen - 4);
+    bufp += pubwirelen; lenp -= pubwirelen;
 
     assert(lenp == 0);
 
@@ -290,6 +370,148 @@ memerr:
     return err;
 }
 
+/*
+ * Decode the AKE message otrmsg, which must be a D-H Commit, D-H Key,
+ * Reveal Signature or Signature Message, into msg and check that its
+ * fields are all there.  Return GPG_ERR_INV_VALUE if they aren't.
+ * Whatever is returned, free msg with otrl_auth_message_free.
+ */
+gcry_error_t otrl_auth_message_parse(OtrlAuthMessage *msg,
+	const char *otrmsg)
+{
+    const char *otrtag, *endtag;
+    unsigned char *bufp;
+    size_t b64len, lenp, len;
+
+    msg->buf = NULL;
+    msg->buflen = 0;
+    msg->version = 0;
+    msg->msgtype = 0;
+    msg->instance_from = 0;
+    msg->instance_to = 0;
+    msg->encgx = NULL;
+    msg->encgx_len = 0;
+    msg->hashgx = NULL;
+    msg->gy = NULL;
+    msg->gy_len = 0;
+    msg->r = NULL;
+    msg->encsig = NULL;
+    msg->encsig_len = 0;
+    msg->mac = NULL;
+
+    /* Find the base64 part, as otrl_base64_otr_decode does, but decode
+     * it into msg->space when it fits */
+    otrtag = strstr(otrmsg, "?OTR:");
+    if (!otrtag) goto invval;
+    endtag = strchr(otrtag, '.');
+    if (!endtag) goto invval;
+    otrtag += 5;
+    b64len = endtag - otrtag;
+
+    if (OTRL_B64_MAX_DECODED_SIZE(b64len) <= sizeof(msg->space)) {
+	msg->buf = msg->space;
+    } else {
+	msg->buf = malloc(OTRL_B64_MAX_DECODED_SIZE(b64len));
+	if (msg->buf == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    }
+    msg->buflen = otrl_base64_decode(msg->buf, otrtag, b64len);
+
+    bufp = msg->buf;
+    lenp = msg->buflen;
+
+    /* Header */
+    require_len(3);
+    msg->version = bufp[1];
+    msg->msgtype = bufp[2];
+    if (!otrl_version_built(msg->version)) goto invval;
+    skip_header(msg->msgtype);
+
+    if (otrl_version_is(msg->version, 3)) {
+	read_int(msg->instance_from);
+	read_int(msg->instance_to);
+    }
+
+    switch(msg->msgtype) {
+	case '\x02':
+	    /* D-H Commit: encrypted g^x, and hashed g^x */
+	    read_int(msg->encgx_len);
+	    require_len(msg->encgx_len);
+	    msg->encgx = bufp;
+	    bufp += msg->encgx_len; lenp -= msg->encgx_len;
+	    read_int(len);
+	    if (len != 32) goto invval;
+	    require_len(32);
+	    msg->hashgx = bufp;
+	    bufp += 32; lenp -= 32;
+	    break;
+
+	case '\x0a':
+	    /* D-H Key: g^y */
+	    read_int(msg->gy_len);
+	    require_len(msg->gy_len);
+	    msg->gy = bufp;
+	    bufp += msg->gy_len; lenp -= msg->gy_len;
+	    break;
+
+	case '\x11':
+	    /* Reveal Signature: r, then the same as a Signature */
+	    read_int(len);
+	    if (len != 16) goto invval;
+	    require_len(16);
+	    msg->r = bufp;
+	    bufp += 16; lenp -= 16;
+	    /* FALLTHROUGH */
+
+	case '\x12':
+	    /* Signature: the encrypted signature, and its MAC */
+	    read_int(msg->encsig_len);
+	    require_len(msg->encsig_len);
+	    msg->encsig = bufp;
+	    bufp += msg->encsig_len; lenp -= msg->encsig_len;
+	    require_len(20);
+	    msg->mac = bufp;
+	    bufp += 20; lenp -= 20;
+	    break;
+
+	default:
+	    goto invval;
+    }
+
+    if (lenp != 0) goto invval;
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+invval:
+    return gcry_error(GPG_ERR_INV_VALUE);
+}
+
+/*
+ * Free what otrl_auth_message_parse allocated for msg, if anything.
+ */
+void otrl_auth_message_free(OtrlAuthMessage *msg)
+{
+    if (msg->buf != msg->space) free(msg->buf);
+    msg->buf = NULL;
+}
+
+/*
+ * Keep the encrypted and hashed g^x of the D-H Commit msg in auth.
+ */
+static gcry_error_t store_commit(OtrlAuthInfo *auth,
+	const OtrlAuthMessage *msg)
+{
+    unsigned char *encbuf = malloc(msg->encgx_len);
+
+    if (encbuf == NULL && msg->encgx_len > 0) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    memmove(encbuf, msg->encgx, msg->encgx_len);
+    free(auth->encgx);
+    auth->encgx = encbuf;
+    auth->encgx_len = msg->encgx_len;
+    memmove(auth->hashgx, msg->hashgx, 32);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
 /*
  * Handle an incoming D-H Commit Message.  If no error is returned, the
  * message to send will be left in auth->lastauthmsg.  Generate a fresh
@@ -297,51 +519,39 @@ memerr:
  */
 gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
 	const char *commitmsg, int version)
+{
+    gcry_error_t err;
+    OtrlAuthMessage msg;
+
+    if (version < 2 || !otrl_version_built(version)) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    err = otrl_auth_message_parse(&msg, commitmsg);
+    if (!err) err = otrl_auth_handle_commit_parsed(auth, &msg);
+    otrl_auth_message_free(&msg);
+    return err;
+}
+
+/*
+ * Handle an incoming D-H Commit Message, already parsed by
+ * otrl_auth_message_parse, as otrl_auth_handle_commit does.
+ */
+gcry_error_t otrl_auth_handle_commit_parsed(OtrlAuthInfo *auth,
+	const OtrlAuthMessage *msg)
 {
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
-    unsigned char *buf = NULL, *bufp = NULL, *encbuf = NULL;
-    unsigned char hashbuf[32];
-    size_t buflen, lenp, enclen, hashlen;
-    int res;
+    unsigned int version = msg->version;
 
     /* Are we the auth for the master context? */
     int is_master = (auth->context->m_context == auth->context);
 
-    res = otrl_base64_otr_decode(commitmsg, &buf, &buflen);
-    if (res == -1) goto memerr;
-    if (res == -2) goto invval;
-
-    bufp = buf;
-    lenp = buflen;
+    if (msg->msgtype != '\x02' || version < 2) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
 
-    /* Header */
     auth->protocol_version = version;
     auth->context->protocol_version = version;
-    skip_header('\x02');
-
-    if (version == 3) {
-	require_len(8);
-	bufp += 8; lenp -= 8;
-    }
-
-    /* Encrypted g^x */
-    read_int(enclen);
-    require_len(enclen);
-    encbuf = malloc(enclen);
-    if (encbuf == NULL && enclen > 0) goto memerr;
-    memmove(encbuf, bufp, enclen);
-    bufp += enclen; lenp -= enclen;
-
-    /* Hashed g^x */
-    read_int(hashlen);
-    if (hashlen != 32) goto invval;
-    require_len(32);
-    memmove(hashbuf, bufp, 32);
-    bufp += 32; lenp -= 32;
-
-    if (lenp != 0) goto invval;
-    free(buf);
-    buf = NULL;
 
     switch(auth->authstate) {
 	case OTRL_AUTHSTATE_NONE:
@@ -351,17 +561,16 @@ gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
 	    otrl_auth_clear(auth);
 	    auth->protocol_version = version;
 
-	    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
+	    otrl_dh_gen_keypair_pooled(auth->dh_keypool, DH1536_GROUP_ID,
+		    &(auth->our_dh));
 
 	    auth->our_keyid = 1;
-	    auth->encgx = encbuf;
-	    encbuf = NULL;
-	    auth->encgx_len = enclen;
-	    memmove(auth->hashgx, hashbuf, 32);
+	    err = store_commit(auth, msg);
+	    if (err) return err;
 
 	    /* Create a D-H Key Message */
 	    err = create_key_message(auth);
-	    if (err) goto err;
+	    if (err) return err;
 	    auth->authstate = OTRL_AUTHSTATE_AWAITING_REVEALSIG;
 	    break;
 
@@ -377,78 +586,63 @@ gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
 	     * This does NOT use constant time comparison because these
 	     * are two public values thus don't need it. Also, this checks
 	     * which pubkey is larger and not if they are the same. */
-	    if (!is_master && memcmp(auth->hashgx, hashbuf, 32) > 0) {
+	    if (!is_master && memcmp(auth->hashgx, msg->hashgx, 32) > 0) {
 		/* Ours wins.  Ignore the message we received, and just
 		 * resend the same D-H Commit message again. */
-		free(encbuf);
-		encbuf = NULL;
-	    } else {
-		/* Ours loses.  Use the incoming parameters instead. */
-		otrl_auth_clear(auth);
-		auth->protocol_version = version;
-		otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
-		auth->our_keyid = 1;
-		auth->encgx = encbuf;
-		encbuf = NULL;
-		auth->encgx_len = enclen;
-		memmove(auth->hashgx, hashbuf, 32);
-
-		/* Create a D-H Key Message */
-		err = create_key_message(auth);
-		if (err) goto err;
-		auth->authstate = OTRL_AUTHSTATE_AWAITING_REVEALSIG;
+		break;
 	    }
+
+	    /* Ours loses.  Use the incoming parameters instead. */
+	    otrl_auth_clear(auth);
+	    auth->protocol_version = version;
+	    otrl_dh_gen_keypair_pooled(auth->dh_keypool,
+		    DH1536_GROUP_ID, &(auth->our_dh));
+	    auth->our_keyid = 1;
+	    err = store_commit(auth, msg);
+	    if (err) return err;
+
+	    /* Create a D-H Key Message */
+	    err = create_key_message(auth);
+	    if (err) return err;
+	    auth->authstate = OTRL_AUTHSTATE_AWAITING_REVEALSIG;
 	    break;
 	case OTRL_AUTHSTATE_AWAITING_REVEALSIG:
 	    /* Use the incoming parameters, but just retransmit the old
 	     * D-H Key Message. */
-	    free(auth->encgx);
-	    auth->encgx = encbuf;
-	    encbuf = NULL;
-	    auth->encgx_len = enclen;
-	    memmove(auth->hashgx, hashbuf, 32);
+	    err = store_commit(auth, msg);
 	    break;
     }
 
     return err;
-
-invval:
-    err = gcry_error(GPG_ERR_INV_VALUE);
-    goto err;
-memerr:
-    err = gcry_error(GPG_ERR_ENOMEM);
-err:
-    free(buf);
-    free(encbuf);
-    return err;
 }
 
 /*
  * Calculate the encrypted part of the Reveal Signature and Signature
- * Messages, given a MAC key, an encryption key, two DH public keys, an
- * authentication public key (contained in an OtrlPrivKey structure),
+ * Messages, given a MAC key, an encryption key, our DH keypair, their DH
+ * public key, an authentication public key (contained in an OtrlPrivKey
+ * structure),
  * and a keyid.  If no error is returned, *authbufp will point to the
  * result, and *authlenp will point to its length.
  */
 static gcry_error_t calculate_pubkey_auth(unsigned char **authbufp,
 	size_t *authlenp, gcry_md_hd_t mackey, gcry_cipher_hd_t enckey,
-	gcry_mpi_t our_dh_pub, gcry_mpi_t their_dh_pub,
+	DH_keypair *our_dh, gcry_mpi_t their_dh_pub,
 	OtrlPrivKey *privkey, unsigned int keyid)
 {
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
     const enum gcry_mpi_format format = GCRYMPI_FMT_USG;
-    size_t ourpublen, theirpublen, totallen, lenp;
+    size_t ourwirelen, theirpublen, totallen, lenp;
+    const unsigned char *ourwire;
     unsigned char *buf = NULL, *bufp = NULL;
     unsigned char macbuf[32];
-    unsigned char *sigbuf = NULL;
-    size_t siglen;
 
     /* How big are the DH public keys? */
-    gcry_mpi_print(format, NULL, 0, &ourpublen, our_dh_pub);
+    ourwire = otrl_dh_keypair_pubwire(our_dh, &ourwirelen);
+    if (ourwire == NULL) goto memerr;
     gcry_mpi_print(format, NULL, 0, &theirpublen, their_dh_pub);
 
     /* How big is the total structure to be MAC'd? */
-    totallen = 4 + ourpublen + 4 + theirpublen + 2 + privkey->pubkey_datalen
+    totallen = ourwirelen + 4 + theirpublen + 2 + privkey->pubkey_datalen
 	    + 4;
     buf = malloc(totallen);
     if (buf == NULL) goto memerr;
@@ -457,7 +651,9 @@ static gcry_error_t calculate_pubkey_auth(unsigned char **authbufp,
     lenp = totallen;
 
     /* Write the data to be MAC'd */
-    write_mpi(our_dh_pub, ourpublen, "Our DH pubkey");
+    memmove(bufp, ourwire, ourwirelen);
+    debug_data("Our DH pubkey", bufp + 4, ourwirelen - 4);
+    bufp += ourwirelen; lenp -= ourwirelen;
     write_mpi(their_dh_pub, theirpublen, "Their DH pubkey");
     bufp[0] = ((privkey->pubkey_type) >> 8) & 0xff;
     bufp[1] = (privkey->pubkey_type) & 0xff;
@@ -478,12 +674,8 @@ static gcry_error_t calculate_pubkey_auth(unsigned char **authbufp,
     free(buf);
     buf = NULL;
 
-    /* Sign the MAC */
-    err = otrl_privkey_sign(&sigbuf, &siglen, privkey, macbuf, 32);
-    if (err) goto err;
-
     /* Calculate the total size of the structure to be encrypted */
-    totallen = 2 + privkey->pubkey_datalen + 4 + siglen;
+    totallen = 2 + privkey->pubkey_datalen + 4 + 40;
     buf = malloc(totallen);
     if (buf == NULL) goto memerr;
     bufp = buf;
@@ -498,11 +690,12 @@ static gcry_error_t calculate_pubkey_auth(unsigned char **authbufp,
     bufp += privkey->pubkey_datalen; lenp -= privkey->pubkey_datalen;
     write_int(keyid);
     debug_int("Keyid", bufp-4);
-    memmove(bufp, sigbuf, siglen);
-    debug_data("Signature", bufp, siglen);
-    bufp += siglen; lenp -= siglen;
-    free(sigbuf);
-    sigbuf = NULL;
+
+    /* Sign the MAC */
+    err = otrl_privkey_sign_into(bufp, privkey, macbuf, 32);
+    if (err) goto err;
+    debug_data("Signature", bufp, 40);
+    bufp += 40; lenp -= 40;
 
     assert(lenp == 0);
 
@@ -519,7 +712,6 @@ memerr:
     err = gcry_error(GPG_ERR_ENOMEM);
 err:
     free(buf);
-    free(sigbuf);
     return err;
 }
 
@@ -529,23 +721,28 @@ err:
  * keys.  The fingerprint of the received public key will get put into
  * fingerprintbufp, and the received keyid will get put in *keyidp.
  * The encrypted data pointed to by authbuf will be decrypted in place.
+ * The public key is taken from the public key cache of the given
+ * context's userstate if it's there, and put there if it isn't.
  */
-static gcry_error_t check_pubkey_auth(unsigned char fingerprintbufp[20],
+static gcry_error_t check_pubkey_auth(ConnContext *context,
+	unsigned char fingerprintbufp[20],
 	unsigned int *keyidp, unsigned char *authbuf, size_t authlen,
 	gcry_md_hd_t mackey, gcry_cipher_hd_t enckey,
-	gcry_mpi_t our_dh_pub, gcry_mpi_t their_dh_pub)
+	DH_keypair *our_dh, gcry_mpi_t their_dh_pub)
 {
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
     const enum gcry_mpi_format format = GCRYMPI_FMT_USG;
-    size_t ourpublen, theirpublen, totallen, lenp;
+    size_t ourwirelen, theirpublen, totallen, lenp, keylenp;
+    const unsigned char *ourwire;
     unsigned char *buf = NULL, *bufp = NULL;
     unsigned char macbuf[32];
     unsigned short pubkey_type;
-    gcry_mpi_t p,q,g,y;
-    gcry_sexp_t pubs = NULL;
+    gcry_mpi_t p = NULL, q = NULL, g = NULL, y = NULL;
+    OtrlPubKey *cached = NULL;
     unsigned int received_keyid;
     unsigned char *fingerprintstart, *fingerprintend, *sigbuf;
-    size_t siglen;
+    size_t siglen, keympilen;
+    int i;
 
     /* Start by decrypting it */
     err = gcry_cipher_decrypt(enckey, authbuf, authlen, NULL, 0);
@@ -560,19 +757,30 @@ static gcry_error_t check_pubkey_auth(unsigned char fingerprintbufp[20],
     bufp += 2; lenp -= 2;
     if (pubkey_type != OTRL_PUBKEY_TYPE_DSA) goto invval;
     fingerprintstart = bufp;
-    read_mpi(p);
-    read_mpi(q);
-    read_mpi(g);
-    read_mpi(y);
+    keylenp = lenp;
+    for (i = 0; i < 4; ++i) {
+	read_int(keympilen);
+	require_len(keympilen);
+	bufp += keympilen; lenp -= keympilen;
+    }
     fingerprintend = bufp;
     gcry_md_hash_buffer(GCRY_MD_SHA1, fingerprintbufp,
 	    fingerprintstart, fingerprintend-fingerprintstart);
-    gcry_sexp_build(&pubs, NULL,
-	"(public-key (dsa (p %m)(q %m)(g %m)(y %m)))", p, q, g, y);
-    gcry_mpi_release(p);
-    gcry_mpi_release(q);
-    gcry_mpi_release(g);
-    gcry_mpi_release(y);
+
+    /* Only parse the key if it isn't cached */
+    if (context) {
+	cached = otrl_pubkey_cache_find(context->m_context,
+		fingerprintbufp, fingerprintstart,
+		fingerprintend - fingerprintstart);
+    }
+    if (!cached) {
+	bufp = fingerprintstart;
+	lenp = keylenp;
+	read_mpi(p);
+	read_mpi(q);
+	read_mpi(g);
+	read_mpi(y);
+    }
 
     /* Get the keyid */
     read_int(received_keyid);
@@ -583,11 +791,12 @@ static gcry_error_t check_pubkey_auth(unsigned char fingerprintbufp[20],
     siglen = lenp;
 
     /* How big are the DH public keys? */
-    gcry_mpi_print(format, NULL, 0, &ourpublen, our_dh_pub);
+    ourwire = otrl_dh_keypair_pubwire(our_dh, &ourwirelen);
+    if (ourwire == NULL) goto memerr;
     gcry_mpi_print(format, NULL, 0, &theirpublen, their_dh_pub);
 
     /* Now calculate the message to be MAC'd. */
-    totallen = 4 + ourpublen + 4 + theirpublen + 2 +
+    totallen = ourwirelen + 4 + theirpublen + 2 +
 	(fingerprintend - fingerprintstart) + 4;
     buf = malloc(totallen);
     if (buf == NULL) goto memerr;
@@ -596,7 +805,9 @@ static gcry_error_t check_pubkey_auth(unsigned char fingerprintbufp[20],
     lenp = totallen;
 
     write_mpi(their_dh_pub, theirpublen, "Their DH pubkey");
-    write_mpi(our_dh_pub, ourpublen, "Our DH pubkey");
+    memmove(bufp, ourwire, ourwirelen);
+    debug_data("Our DH pubkey", bufp + 4, ourwirelen - 4);
+    bufp += ourwirelen; lenp -= ourwirelen;
     bufp[0] = (pubkey_type >> 8) & 0xff;
     bufp[1] = pubkey_type & 0xff;
     bufp += 2; lenp -= 2;
@@ -618,10 +829,28 @@ static gcry_error_t check_pubkey_auth(unsigned char fingerprintbufp[20],
     buf = NULL;
 
     /* Verify the signature on the MAC */
-    err = otrl_privkey_verify(sigbuf, siglen, pubkey_type, pubs, macbuf, 32);
+    if (cached) {
+	err = otrl_privkey_verify_mpi(sigbuf, siglen, cached->p, cached->q,
+		cached->g, cached->y, macbuf, 32);
+    } else {
+	err = otrl_privkey_verify_mpi(sigbuf, siglen, p, q, g, y, macbuf,
+		32);
+    }
     if (err) goto err;
-    gcry_sexp_release(pubs);
-    pubs = NULL;
+
+    /* The key is known good now, so it's worth keeping */
+    if (cached) {
+	otrl_pubkey_release(cached);
+    } else if (context) {
+	otrl_pubkey_cache_add(context->m_context, fingerprintbufp,
+		fingerprintstart, fingerprintend - fingerprintstart,
+		p, q, g, y);
+    } else {
+	gcry_mpi_release(p);
+	gcry_mpi_release(q);
+	gcry_mpi_release(g);
+	gcry_mpi_release(y);
+    }
 
     /* Everything checked out */
     *keyidp = received_keyid;
@@ -634,7 +863,11 @@ memerr:
     err = gcry_error(GPG_ERR_ENOMEM);
 err:
     free(buf);
-    gcry_sexp_release(pubs);
+    otrl_pubkey_release(cached);
+    gcry_mpi_release(p);
+    gcry_mpi_release(q);
+    gcry_mpi_release(g);
+    gcry_mpi_release(y);
     return err;
 }
 
@@ -655,10 +888,11 @@ static gcry_error_t create_revealsig_message(OtrlAuthInfo *auth,
 
     /* Get the encrypted authenticator */
     err = calculate_pubkey_auth(&authbuf, &authlen, auth->mac_m1, auth->enc_c,
-	    auth->our_dh.pub, auth->their_pub, privkey, auth->our_keyid);
+	    &(auth->our_dh), auth->their_pub, privkey, auth->our_keyid);
     if (err) goto err;
 
-    buflen = OTRL_HEADER_LEN + (auth->protocol_version == 3 ? 8 : 0) + 4 + 16
+    buflen = OTRL_HEADER_LEN
+	    + (otrl_version_is(auth->protocol_version, 3) ? 8 : 0) + 4 + 16
 	    + 4 + authlen + 20;
     buf = malloc(buflen);
     if (buf == NULL) goto memerr;
@@ -668,7 +902,7 @@ static gcry_error_t create_revealsig_message(OtrlAuthInfo *auth,
 
     /* header */
     write_header(auth->protocol_version, '\x11');
-    if (auth->protocol_version == 3) {
+    if (otrl_version_is(auth->protocol_version, 3)) {
 	/* instance tags */
 	write_int(auth->context->our_instance);
 	debug_int("Sender instag", bufp-4);
@@ -733,11 +967,12 @@ static gcry_error_t create_signature_message(OtrlAuthInfo *auth,
 
     /* Get the encrypted authenticator */
     err = calculate_pubkey_auth(&authbuf, &authlen, auth->mac_m1p,
-	    auth->enc_cp, auth->our_dh.pub, auth->their_pub, privkey,
+	    auth->enc_cp, &(auth->our_dh), auth->their_pub, privkey,
 	    auth->our_keyid);
     if (err) goto err;
 
-    buflen = OTRL_HEADER_LEN + (auth->protocol_version == 3 ? 8 : 0) + 4
+    buflen = OTRL_HEADER_LEN
+	    + (otrl_version_is(auth->protocol_version, 3) ? 8 : 0) + 4
 	    + authlen + 20;
     buf = malloc(buflen);
     if (buf == NULL) goto memerr;
@@ -747,7 +982,7 @@ static gcry_error_t create_signature_message(OtrlAuthInfo *auth,
 
     /* header */
     write_header(auth->protocol_version, '\x12');
-    if (auth->protocol_version == 3) {
+    if (otrl_version_is(auth->protocol_version, 3)) {
 	/* instance tags */
 	write_int(auth->context->our_instance);
 	debug_int("Sender instag", bufp-4);
@@ -797,46 +1032,47 @@ err:
 gcry_error_t otrl_auth_handle_key(OtrlAuthInfo *auth, const char *keymsg,
 	int *havemsgp, OtrlPrivKey *privkey)
 {
-    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
-    unsigned char *buf = NULL, *bufp = NULL;
-    size_t buflen, lenp;
-    gcry_mpi_t incoming_pub = NULL;
-    int res;
-    unsigned int msg_version;
+    gcry_error_t err;
+    OtrlAuthMessage msg;
 
     *havemsgp = 0;
 
-    msg_version = otrl_proto_message_version(keymsg);
-
-    res = otrl_base64_otr_decode(keymsg, &buf, &buflen);
-    if (res == -1) goto memerr;
-    if (res == -2) goto invval;
+    err = otrl_auth_message_parse(&msg, keymsg);
+    if (!err) err = otrl_auth_handle_key_parsed(auth, &msg, havemsgp,
+	    privkey);
+    otrl_auth_message_free(&msg);
+    return err;
+}
 
-    bufp = buf;
-    lenp = buflen;
+/*
+ * Handle an incoming D-H Key Message, already parsed by
+ * otrl_auth_message_parse, as otrl_auth_handle_key does.
+ */
+gcry_error_t otrl_auth_handle_key_parsed(OtrlAuthInfo *auth,
+	const OtrlAuthMessage *msg, int *havemsgp, OtrlPrivKey *privkey)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    gcry_mpi_t incoming_pub = NULL;
 
-    /* Header */
-    skip_header('\x0a');
+    *havemsgp = 0;
 
-    if (msg_version == 3) {
-	require_len(8);
-	bufp += 8; lenp -= 8;
-    }
+    if (msg->msgtype != '\x0a') return gcry_error(GPG_ERR_INV_VALUE);
 
     /* g^y */
-    read_mpi(incoming_pub);
-
-    if (lenp != 0) goto invval;
-    free(buf);
-    buf = NULL;
+    if (msg->gy_len) {
+	gcry_mpi_scan(&incoming_pub, GCRYMPI_FMT_USG, msg->gy, msg->gy_len,
+		NULL);
+    } else {
+	incoming_pub = gcry_mpi_set_ui(NULL, 0);
+    }
 
     switch(auth->authstate) {
 	case OTRL_AUTHSTATE_AWAITING_DHKEY:
 	    /* The other party may also be establishing a session with
 	    another instance running a different version. Ignore any
 	    DHKEY messages we aren't expecting. */
-	    if (msg_version != auth->protocol_version) {
-	      goto err;
+	    if (msg->version != auth->protocol_version) {
+	      break;
 	    }
 
 	    /* Store the incoming public key */
@@ -851,11 +1087,11 @@ gcry_error_t otrl_auth_handle_key(OtrlAuthInfo *auth, const char *keymsg,
 		    &(auth->enc_c), &(auth->enc_cp),
 		    &(auth->mac_m1), &(auth->mac_m1p),
 		    &(auth->mac_m2), &(auth->mac_m2p));
-	    if (err) goto err;
+	    if (err) break;
 
 	    /* Create the Reveal Signature Message */
 	    err = create_revealsig_message(auth, privkey);
-	    if (err) goto err;
+	    if (err) break;
 	    *havemsgp = 1;
 	    auth->authstate = OTRL_AUTHSTATE_AWAITING_SIG;
 
@@ -880,16 +1116,6 @@ gcry_error_t otrl_auth_handle_key(OtrlAuthInfo *auth, const char *keymsg,
 
     gcry_mpi_release(incoming_pub);
     return err;
-
-invval:
-    err = gcry_error(GPG_ERR_INV_VALUE);
-    goto err;
-memerr:
-    err = gcry_error(GPG_ERR_ENOMEM);
-err:
-    free(buf);
-    gcry_mpi_release(incoming_pub);
-    return err;
 }
 
 /*
@@ -903,62 +1129,52 @@ gcry_error_t otrl_auth_handle_revealsig(OtrlAuthInfo *auth,
 	const char *revealmsg, int *havemsgp, OtrlPrivKey *privkey,
 	gcry_error_t (*auth_succeeded)(const OtrlAuthInfo *auth, void *asdata),
 	void *asdata)
+{
+    gcry_error_t err;
+    OtrlAuthMessage msg;
+
+    *havemsgp = 0;
+
+    err = otrl_auth_message_parse(&msg, revealmsg);
+    if (!err) err = otrl_auth_handle_revealsig_parsed(auth, &msg,
+	    havemsgp, privkey, auth_succeeded, asdata);
+    otrl_auth_message_free(&msg);
+    return err;
+}
+
+/*
+ * Handle an incoming Reveal Signature Message, already parsed by
+ * otrl_auth_message_parse, as otrl_auth_handle_revealsig does.  The
+ * signature is decrypted in place, so msg can't be handled again.
+ */
+gcry_error_t otrl_auth_handle_revealsig_parsed(OtrlAuthInfo *auth,
+	OtrlAuthMessage *msg, int *havemsgp, OtrlPrivKey *privkey,
+	gcry_error_t (*auth_succeeded)(const OtrlAuthInfo *auth, void *asdata),
+	void *asdata)
 {
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
-    unsigned char *buf = NULL, *bufp = NULL, *gxbuf = NULL;
-    unsigned char *authstart, *authend, *macstart;
-    size_t buflen, lenp, rlen, authlen;
+    unsigned char gxspace[256];
+    unsigned char *bufp = NULL, *gxbuf = NULL;
+    size_t lenp;
     gcry_cipher_hd_t enc = NULL;
     gcry_mpi_t incoming_pub = NULL;
     unsigned char ctr[16], hashbuf[32];
-    int res;
-    unsigned char version;
 
     *havemsgp = 0;
 
-    res = otrl_base64_otr_decode(revealmsg, &buf, &buflen);
-    if (res == -1) goto memerr;
-    if (res == -2) goto invval;
-
-    bufp = buf;
-    lenp = buflen;
-
-    require_len(3);
-    version = bufp[1];
-
-    /* Header */
-    skip_header('\x11');
-
-    if (version == 3) {
-	require_len(8);
-	bufp += 8; lenp -= 8;
-    }
-
-    /* r */
-    read_int(rlen);
-    if (rlen != 16) goto invval;
-    require_len(rlen);
-    memmove(auth->r, bufp, rlen);
-    bufp += rlen; lenp -= rlen;
-
-    /* auth */
-    authstart = bufp;
-    read_int(authlen);
-    require_len(authlen);
-    bufp += authlen; lenp -= authlen;
-    authend = bufp;
-
-    /* MAC */
-    require_len(20);
-    macstart = bufp;
-    bufp += 20; lenp -= 20;
-
-    if (lenp != 0) goto invval;
+    if (msg->msgtype != '\x11') return gcry_error(GPG_ERR_INV_VALUE);
 
     switch(auth->authstate) {
 	case OTRL_AUTHSTATE_AWAITING_REVEALSIG:
-	    gxbuf = malloc(auth->encgx_len);
-	    if (auth->encgx_len && gxbuf == NULL) goto memerr;
+	    memmove(auth->r, msg->r, 16);
+
+	    /* g^x of a 1536-bit group fits on the stack */
+	    if (auth->encgx_len <= sizeof(gxspace)) {
+		gxbuf = gxspace;
+	    } else {
+		gxbuf = malloc(auth->encgx_len);
+		if (gxbuf == NULL) goto memerr;
+	    }
 
 	    /* Use r to decrypt the value of g^x we received earlier */
 	    err = gcry_cipher_open(&enc, GCRY_CIPHER_AES, GCRY_CIPHER_MODE_CTR,
@@ -991,7 +1207,7 @@ gcry_error_t otrl_auth_handle_revealsig(OtrlAuthInfo *auth,
 	    lenp = auth->encgx_len;
 
 	    read_mpi(incoming_pub);
-	    free(gxbuf);
+	    if (gxbuf != gxspace) free(gxbuf);
 	    gxbuf = NULL;
 
 	    if (lenp != 0) goto invval;
@@ -1009,27 +1225,21 @@ gcry_error_t otrl_auth_handle_revealsig(OtrlAuthInfo *auth,
 		    &(auth->mac_m2), &(auth->mac_m2p));
 	    if (err) goto err;
 
-	    /* Check the MAC */
+	    /* Check the MAC, which covers the signature's length too */
 	    gcry_md_reset(auth->mac_m2);
-	    gcry_md_write(auth->mac_m2, authstart, authend - authstart);
+	    gcry_md_write(auth->mac_m2, msg->encsig - 4, msg->encsig_len + 4);
 
-	    if (otrl_mem_differ(macstart,
+	    if (otrl_mem_differ(msg->mac,
 			gcry_md_read(auth->mac_m2, GCRY_MD_SHA256),
 			20)) goto invval;
 
 	    /* Check the auth */
-	    err = check_pubkey_auth(auth->their_fingerprint,
-		    &(auth->their_keyid), authstart + 4,
-		    authend - authstart - 4, auth->mac_m1, auth->enc_c,
-		    auth->our_dh.pub, auth->their_pub);
+	    err = check_pubkey_auth(auth->context, auth->their_fingerprint,
+		    &(auth->their_keyid), msg->encsig, msg->encsig_len,
+		    auth->mac_m1, auth->enc_c, &(auth->our_dh),
+		    auth->their_pub);
 	    if (err) goto err;
 
-	    authstart = NULL;
-	    authend = NULL;
-	    macstart = NULL;
-	    free(buf);
-	    buf = NULL;
-
 	    /* Create the Signature Message */
 	    err = create_signature_message(auth, privkey);
 	    if (err) goto err;
@@ -1049,8 +1259,6 @@ gcry_error_t otrl_auth_handle_revealsig(OtrlAuthInfo *auth,
 	case OTRL_AUTHSTATE_V1_SETUP:
 	    /* Ignore this message */
 	    *havemsgp = 0;
-	    free(buf);
-	    buf = NULL;
 	    break;
     }
 
@@ -1065,8 +1273,7 @@ invval:
 memerr:
     err = gcry_error(GPG_ERR_ENOMEM);
 err:
-    free(buf);
-    free(gxbuf);
+    if (gxbuf != gxspace) free(gxbuf);
     gcry_cipher_close(enc);
     gcry_mpi_release(incoming_pub);
     return err;
@@ -1083,68 +1290,50 @@ gcry_error_t otrl_auth_handle_signature(OtrlAuthInfo *auth,
 	gcry_error_t (*auth_succeeded)(const OtrlAuthInfo *auth, void *asdata),
 	void *asdata)
 {
-    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
-    unsigned char *buf = NULL, *bufp = NULL;
-    unsigned char *authstart, *authend, *macstart;
-    size_t buflen, lenp, authlen;
-    int res;
-    unsigned char version;
+    gcry_error_t err;
+    OtrlAuthMessage msg;
 
     *havemsgp = 0;
 
-    res = otrl_base64_otr_decode(sigmsg, &buf, &buflen);
-    if (res == -1) goto memerr;
-    if (res == -2) goto invval;
-
-    bufp = buf;
-    lenp = buflen;
-
-    require_len(3);
-    version = bufp[1];
-
-    /* Header */
-    skip_header('\x12');
-
-    if (version == 3) {
-	require_len(8);
-	bufp += 8; lenp -= 8;
-    }
+    err = otrl_auth_message_parse(&msg, sigmsg);
+    if (!err) err = otrl_auth_handle_signature_parsed(auth, &msg,
+	    havemsgp, auth_succeeded, asdata);
+    otrl_auth_message_free(&msg);
+    return err;
+}
 
-    /* auth */
-    authstart = bufp;
-    read_int(authlen);
-    require_len(authlen);
-    bufp += authlen; lenp -= authlen;
-    authend = bufp;
+/*
+ * Handle an incoming Signature Message, already parsed by
+ * otrl_auth_message_parse, as otrl_auth_handle_signature does.  As
+ * with a Reveal Signature, msg can only be handled once.
+ */
+gcry_error_t otrl_auth_handle_signature_parsed(OtrlAuthInfo *auth,
+	OtrlAuthMessage *msg, int *havemsgp,
+	gcry_error_t (*auth_succeeded)(const OtrlAuthInfo *auth, void *asdata),
+	void *asdata)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
 
-    /* MAC */
-    require_len(20);
-    macstart = bufp;
-    bufp += 20; lenp -= 20;
+    *havemsgp = 0;
 
-    if (lenp != 0) goto invval;
+    if (msg->msgtype != '\x12') return gcry_error(GPG_ERR_INV_VALUE);
 
     switch(auth->authstate) {
 	case OTRL_AUTHSTATE_AWAITING_SIG:
 	    /* Check the MAC */
 	    gcry_md_reset(auth->mac_m2p);
-	    gcry_md_write(auth->mac_m2p, authstart, authend - authstart);
-	    if (otrl_mem_differ(macstart,
+	    gcry_md_write(auth->mac_m2p, msg->encsig - 4,
+		    msg->encsig_len + 4);
+	    if (otrl_mem_differ(msg->mac,
 			gcry_md_read(auth->mac_m2p, GCRY_MD_SHA256),
-			20)) goto invval;
+			20)) return gcry_error(GPG_ERR_INV_VALUE);
 
 	    /* Check the auth */
-	    err = check_pubkey_auth(auth->their_fingerprint,
-		    &(auth->their_keyid), authstart + 4,
-		    authend - authstart - 4, auth->mac_m1p, auth->enc_cp,
-		    auth->our_dh.pub, auth->their_pub);
-	    if (err) goto err;
-
-	    authstart = NULL;
-	    authend = NULL;
-	    macstart = NULL;
-	    free(buf);
-	    buf = NULL;
+	    err = check_pubkey_auth(auth->context, auth->their_fingerprint,
+		    &(auth->their_keyid), msg->encsig, msg->encsig_len,
+		    auth->mac_m1p, auth->enc_cp, &(auth->our_dh),
+		    auth->their_pub);
+	    if (err) return err;
 
 	    /* No error?  Then we've completed our end of the
 	     * authentication. */
@@ -1163,21 +1352,10 @@ gcry_error_t otrl_auth_handle_signature(OtrlAuthInfo *auth,
 	case OTRL_AUTHSTATE_V1_SETUP:
 	    /* Ignore this message */
 	    *havemsgp = 0;
-	    free(buf);
-	    buf = NULL;
 	    break;
     }
 
     return err;
-
-invval:
-    err = gcry_error(GPG_ERR_INV_VALUE);
-    goto err;
-memerr:
-    err = gcry_error(GPG_ERR_ENOMEM);
-err:
-    free(buf);
-    return err;
 }
 
 /* Version 1 routines, for compatibility */
@@ -1192,8 +1370,8 @@ static gcry_error_t create_v1_key_exchange_message(OtrlAuthInfo *auth,
 {
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
     const enum gcry_mpi_format format = GCRYMPI_FMT_USG;
-    unsigned char *buf = NULL, *bufp = NULL, *sigbuf = NULL;
-    size_t lenp, ourpublen, totallen, siglen;
+    unsigned char *buf = NULL, *bufp = NULL;
+    size_t lenp, ourpublen, totallen;
     unsigned char hashbuf[20];
 
     if (privkey->pubkey_type != OTRL_PUBKEY_TYPE_DSA) {
@@ -1230,15 +1408,10 @@ static gcry_error_t create_v1_key_exchange_message(OtrlAuthInfo *auth,
     /* Hash all the data written so far, and sign the hash */
     gcry_md_hash_buffer(GCRY_MD_SHA1, hashbuf, buf, bufp - buf);
 
-    err = otrl_privkey_sign(&sigbuf, &siglen, privkey, hashbuf, 20);
+    err = otrl_privkey_sign_into(bufp, privkey, hashbuf, 20);
     if (err) goto err;
-
-    if (siglen != 40) goto invval;
-    memmove(bufp, sigbuf, 40);
     debug_data("Signature", bufp, 40);
     bufp += 40; lenp -= 40;
-    free(sigbuf);
-    sigbuf = NULL;
 
     assert(lenp == 0);
 
@@ -1250,14 +1423,10 @@ static gcry_error_t create_v1_key_exchange_message(OtrlAuthInfo *auth,
 
     return err;
 
-invval:
-    err = gcry_error(GPG_ERR_INV_VALUE);
-    goto err;
 memerr:
     err = gcry_error(GPG_ERR_ENOMEM);
 err:
     free(buf);
-    free(sigbuf);
     return err;
 }
 
@@ -1273,6 +1442,8 @@ gcry_error_t otrl_auth_start_v1(OtrlAuthInfo *auth, DH_keypair *our_dh,
 {
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
 
+    if (!OTRL_HAVE_V1) return gcry_error(GPG_ERR_INV_VALUE);
+
     /* Clear out this OtrlAuthInfo and start over */
     otrl_auth_clear(auth);
     auth->initiated = 1;
@@ -1283,7 +1454,8 @@ gcry_error_t otrl_auth_start_v1(OtrlAuthInfo *auth, DH_keypair *our_dh,
 	otrl_dh_keypair_copy(&(auth->our_dh), our_dh);
 	auth->our_keyid = our_keyid;
     } else {
-	otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
+	otrl_dh_gen_keypair_pooled(auth->dh_keypool, DH1536_GROUP_ID,
+	    &(auth->our_dh));
 	auth->our_keyid = 1;
     }
 
@@ -1313,14 +1485,14 @@ gcry_error_t otrl_auth_handle_v1_key_exchange(OtrlAuthInfo *auth,
     unsigned char *buf = NULL, *bufp = NULL;
     unsigned char *fingerprintstart, *fingerprintend;
     unsigned char fingerprintbuf[20], hashbuf[20];
-    gcry_mpi_t p, q, g, y, received_pub = NULL;
-    gcry_sexp_t pubs = NULL;
+    gcry_mpi_t p = NULL, q = NULL, g = NULL, y = NULL, received_pub = NULL;
     size_t buflen, lenp;
     unsigned char received_reply;
     unsigned int received_keyid;
     int res;
 
     *havemsgp = 0;
+    if (!OTRL_HAVE_V1) return gcry_error(GPG_ERR_INV_VALUE);
 
     res = otrl_base64_otr_decode(keyexchmsg, &buf, &buflen);
     if (res == -1) goto memerr;
@@ -1348,12 +1520,6 @@ gcry_error_t otrl_auth_handle_v1_key_exchange(OtrlAuthInfo *auth,
     fingerprintend = bufp;
     gcry_md_hash_buffer(GCRY_MD_SHA1, fingerprintbuf,
 	    fingerprintstart, fingerprintend-fingerprintstart);
-    gcry_sexp_build(&pubs, NULL,
-	"(public-key (dsa (p %m)(q %m)(g %m)(y %m)))", p, q, g, y);
-    gcry_mpi_release(p);
-    gcry_mpi_release(q);
-    gcry_mpi_release(g);
-    gcry_mpi_release(y);
 
     /* keyid */
     read_int(received_keyid);
@@ -1365,11 +1531,13 @@ gcry_error_t otrl_auth_handle_v1_key_exchange(OtrlAuthInfo *auth,
     /* Verify the signature */
     if (lenp != 40) goto invval;
     gcry_md_hash_buffer(GCRY_MD_SHA1, hashbuf, buf, bufp - buf);
-    err = otrl_privkey_verify(bufp, lenp, OTRL_PUBKEY_TYPE_DSA,
-	    pubs, hashbuf, 20);
+    err = otrl_privkey_verify_mpi(bufp, lenp, p, q, g, y, hashbuf, 20);
     if (err) goto err;
-    gcry_sexp_release(pubs);
-    pubs = NULL;
+    gcry_mpi_release(p);
+    gcry_mpi_release(q);
+    gcry_mpi_release(g);
+    gcry_mpi_release(y);
+    p = q = g = y = NULL;
     free(buf);
     buf = NULL;
 
@@ -1401,7 +1569,8 @@ gcry_error_t otrl_auth_handle_v1_key_exchange(OtrlAuthInfo *auth,
 	    otrl_dh_keypair_copy(&(auth->our_dh), our_dh);
 	    auth->our_keyid = our_keyid;
 	} else if (auth->our_keyid == 0) {
-	    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(auth->our_dh));
+	    otrl_dh_gen_keypair_pooled(auth->dh_keypool, DH1536_GROUP_ID,
+		    &(auth->our_dh));
 	    auth->our_keyid = 1;
 	}
 
@@ -1433,7 +1602,10 @@ memerr:
     err = gcry_error(GPG_ERR_ENOMEM);
 err:
     free(buf);
-    gcry_sexp_release(pubs);
+    gcry_mpi_release(p);
+    gcry_mpi_release(q);
+    gcry_mpi_release(g);
+    gcry_mpi_release(y);
     gcry_mpi_release(received_pub);
     return err;
 }
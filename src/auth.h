@@ -34,6 +34,19 @@ typedef enum {
     OTRL_AUTHSTATE_V1_SETUP
 } OtrlAuthState;
 
+/* The parts of a D-H Commit Message that don't depend on whom it's
+ * sent to, worked out ahead of time. */
+typedef struct {
+    DH_keypair our_dh;                    /* Our D-H key */
+    unsigned char r[16];                  /* The encryption key */
+    unsigned char *encgx;                 /* The encrypted value of g^x,
+					     or NULL if nothing has been
+					     prepared */
+    size_t encgx_len;                     /*  ...and its length */
+    unsigned char hashgx[32];             /* SHA256(g^x) */
+    time_t expires;                       /* When to stop using it */
+} OtrlAuthPrepared;
+
 typedef struct {
     OtrlAuthState authstate;              /* Our state */
 
@@ -82,8 +95,57 @@ typedef struct {
 					     COMMIT message, and this is
 					     a master context.  0
 					     otherwise. */
+
+    DH_keypool *dh_keypool;               /* Where to get fresh D-H keys
+					     from, or NULL to generate
+					     them as needed.  Not cleared
+					     by otrl_auth_clear. */
+
+    OtrlAuthPrepared prepared;            /* For the next AKE we start,
+					     if it comes soon enough.
+					     Not cleared by
+					     otrl_auth_clear. */
 } OtrlAuthInfo;
 
+/* The most decoded bytes an OtrlAuthMessage holds in itself; a D-H
+ * Commit is about 250 bytes, and a Reveal Signature with a DSA key
+ * about 600.  Bigger messages are decoded into allocated memory. */
+#define OTRL_AUTH_MESSAGE_SPACE 1024
+
+/* A D-H Commit, D-H Key, Reveal Signature or Signature Message,
+ * base64-decoded once, with its fields found.  The field pointers all
+ * point into buf, and are only set for the message types that have
+ * them. */
+typedef struct {
+    unsigned char *buf;                   /* The decoded message */
+    size_t buflen;                        /*  ...and its length */
+    unsigned int version;                 /* The protocol version */
+    unsigned char msgtype;                /* The message type byte */
+    unsigned int instance_from;           /* For version 3, the sender's */
+    unsigned int instance_to;             /*  and recipient's instance
+					     tags */
+
+    unsigned char *encgx;                 /* D-H Commit: encrypted g^x */
+    size_t encgx_len;                     /*  ...and its length */
+    unsigned char *hashgx;                /* D-H Commit: SHA256(g^x),
+					     32 bytes */
+
+    unsigned char *gy;                    /* D-H Key: g^y, as unsigned
+					     big-endian bytes */
+    size_t gy_len;                        /*  ...and its length */
+
+    unsigned char *r;                     /* Reveal Signature: r, 16
+					     bytes */
+    unsigned char *encsig;                /* Reveal Signature and
+					     Signature: the encrypted
+					     signature, after its
+					     4-byte length */
+    size_t encsig_len;                    /*  ...and its length */
+    unsigned char *mac;                   /* ...and its 20-byte MAC */
+
+    unsigned char space[OTRL_AUTH_MESSAGE_SPACE];
+} OtrlAuthMessage;
+
 #include "privkey-t.h"
 
 /*
@@ -97,12 +159,48 @@ void otrl_auth_new(struct context *context);
 void otrl_auth_clear(OtrlAuthInfo *auth);
 
 /*
- * Start a fresh AKE (version 2 or 3) using the given OtrlAuthInfo.  Generate
- * a fresh DH keypair to use.  If no error is returned, the message to
- * transmit will be contained in auth->lastauthmsg.
+ * Initialize the fields of an OtrlAuthPrepared (already allocated) to
+ * hold nothing.
+ */
+void otrl_auth_prepared_init(OtrlAuthPrepared *prep);
+
+/*
+ * Free whatever the given OtrlAuthPrepared holds, and set it back to
+ * holding nothing.
+ */
+void otrl_auth_prepared_free(OtrlAuthPrepared *prep);
+
+/*
+ * Work out the D-H keypair, r, encrypted g^x and SHA256(g^x) of a D-H
+ * Commit Message into prep, which must hold nothing, taking the
+ * keypair from pool if there's one in it (pool may be NULL).  The
+ * material can be used by otrl_auth_start_v23 until the time expires.
+ */
+gcry_error_t otrl_auth_prepare_commit(OtrlAuthPrepared *prep,
+	DH_keypool *pool, time_t expires);
+
+/*
+ * Start a fresh AKE (version 2 or 3) using the given OtrlAuthInfo.  Use
+ * the material in auth->prepared if it hasn't expired, or else
+ * generate a fresh DH keypair to use.  If no error is returned, the
+ * message to transmit will be contained in auth->lastauthmsg.
  */
 gcry_error_t otrl_auth_start_v23(OtrlAuthInfo *auth, int version);
 
+/*
+ * Decode the AKE message otrmsg, which must be a D-H Commit, D-H Key,
+ * Reveal Signature or Signature Message, into msg and check that its
+ * fields are all there.  Return GPG_ERR_INV_VALUE if they aren't.
+ * Whatever is returned, free msg with otrl_auth_message_free.
+ */
+gcry_error_t otrl_auth_message_parse(OtrlAuthMessage *msg,
+	const char *otrmsg);
+
+/*
+ * Free what otrl_auth_message_parse allocated for msg, if anything.
+ */
+void otrl_auth_message_free(OtrlAuthMessage *msg);
+
 /*
  * Handle an incoming D-H Commit Message.  If no error is returned, the
  * message to send will be left in auth->lastauthmsg.  Generate a fresh
@@ -111,6 +209,13 @@ gcry_error_t otrl_auth_start_v23(OtrlAuthInfo *auth, int version);
 gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
 	const char *commitmsg, int version);
 
+/*
+ * Handle an incoming D-H Commit Message, already parsed by
+ * otrl_auth_message_parse, as otrl_auth_handle_commit does.
+ */
+gcry_error_t otrl_auth_handle_commit_parsed(OtrlAuthInfo *auth,
+	const OtrlAuthMessage *msg);
+
 /*
  * Handle an incoming D-H Key Message.  If no error is returned, and
  * *havemsgp is 1, the message to sent will be left in auth->lastauthmsg.
@@ -119,6 +224,13 @@ gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
 gcry_error_t otrl_auth_handle_key(OtrlAuthInfo *auth, const char *keymsg,
 	int *havemsgp, OtrlPrivKey *privkey);
 
+/*
+ * Handle an incoming D-H Key Message, already parsed by
+ * otrl_auth_message_parse, as otrl_auth_handle_key does.
+ */
+gcry_error_t otrl_auth_handle_key_parsed(OtrlAuthInfo *auth,
+	const OtrlAuthMessage *msg, int *havemsgp, OtrlPrivKey *privkey);
+
 /*
  * Handle an incoming Reveal Signature Message.  If no error is
  * returned, and *havemsgp is 1, the message to be sent will be left in
@@ -131,6 +243,16 @@ gcry_error_t otrl_auth_handle_revealsig(OtrlAuthInfo *auth,
 	gcry_error_t (*auth_succeeded)(const OtrlAuthInfo *auth, void *asdata),
 	void *asdata);
 
+/*
+ * Handle an incoming Reveal Signature Message, already parsed by
+ * otrl_auth_message_parse, as otrl_auth_handle_revealsig does.  The
+ * signature is decrypted in place, so msg can't be handled again.
+ */
+gcry_error_t otrl_auth_handle_revealsig_parsed(OtrlAuthInfo *auth,
+	OtrlAuthMessage *msg, int *havemsgp, OtrlPrivKey *privkey,
+	gcry_error_t (*auth_succeeded)(const OtrlAuthInfo *auth, void *asdata),
+	void *asdata);
+
 /*
  * Handle an incoming Signature Message.  If no error is returned, and
  * *havemsgp is 1, the message to be sent will be left in
@@ -142,6 +264,16 @@ gcry_error_t otrl_auth_handle_signature(OtrlAuthInfo *auth,
 	gcry_error_t (*auth_succeeded)(const OtrlAuthInfo *auth, void *asdata),
 	void *asdata);
 
+/*
+ * Handle an incoming Signature Message, already parsed by
+ * otrl_auth_message_parse, as otrl_auth_handle_signature does.  As
+ * with a Reveal Signature, msg can only be handled once.
+ */
+gcry_error_t otrl_auth_handle_signature_parsed(OtrlAuthInfo *auth,
+	OtrlAuthMessage *msg, int *havemsgp,
+	gcry_error_t (*auth_succeeded)(const OtrlAuthInfo *auth, void *asdata),
+	void *asdata);
+
 /*
  * Start a fresh AKE (version 1) using the given OtrlAuthInfo.  If
  * our_dh is NULL, generate a fresh DH keypair to use.  Otherwise, use a
@@ -55,9 +55,16 @@ VERSION HISTORY:
 
 \******************************************************************* */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdio.h>
 #include <string.h>
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 /* libotr headers */
 #include "b64.h"
@@ -93,6 +100,313 @@ static void encodeblock( char *out, const unsigned char *in, size_t len )
 		     : '=';
 }
 
+static size_t decode(unsigned char *out, const char *in, size_t b64len);
+
+/*
+ * SIMD kernels.  These only ever handle runs of whole blocks of plain
+ * base64 (no whitespace, padding or other characters); everything else
+ * is left to the scalar code above and below, which remains the
+ * reference for what the output should be.
+ */
+
+/* The fastest kernels this machine can run (-1 if not yet known) */
+static int simd_level = -1;
+
+/* The fastest kernels we're allowed to use */
+static int simd_limit = OTRL_B64_SIMD_AVX2;
+
+/*
+ * Return the fastest kind of SIMD code the base64 functions can use on
+ * this machine: OTRL_B64_SIMD_NONE, OTRL_B64_SIMD_SSE41 or
+ * OTRL_B64_SIMD_AVX2.
+ */
+int otrl_base64_simd_level(void)
+{
+    /* Should two threads both get here first, they'll each work out
+     * the same answer. */
+    if (simd_level < 0) {
+	int level = OTRL_B64_SIMD_NONE;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+	    level = OTRL_B64_SIMD_AVX2;
+	} else if (__builtin_cpu_supports("sse4.1")) {
+	    level = OTRL_B64_SIMD_SSE41;
+	}
+#endif
+	simd_level = level;
+    }
+    return simd_level;
+}
+
+/*
+ * Stop the base64 functions from using any SIMD code faster than
+ * level.  This is for testing and benchmarking the slower code paths.
+ * Return the kind of SIMD code that will now be used.
+ */
+int otrl_base64_set_simd_level(int level)
+{
+    simd_limit = level;
+    return otrl_base64_simd_level() < level ?
+	otrl_base64_simd_level() : level;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* Spread 12 bytes of input over 16 bytes, 6 bits to each */
+__attribute__((target("sse4.1")))
+static __m128i enc_reshuffle_sse41(__m128i in)
+{
+    __m128i t0, t1, t2, t3;
+
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+/* Turn 6-bit values into base64 characters */
+__attribute__((target("sse4.1")))
+static __m128i enc_translate_sse41(__m128i in)
+{
+    /* What to add to each of: A-Z, a-z, 0-9 (10 entries), +, / */
+    const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+	    -4, -4, -4, -4, -19, -16, 0, 0);
+    __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+    __m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+
+    indices = _mm_sub_epi8(indices, mask);
+    return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
+
+/* Each round reads 16 bytes of input but encodes only the first 12 */
+__attribute__((target("sse4.1")))
+static size_t encode_sse41(char *out, const unsigned char *in, size_t inlen)
+{
+    size_t done = 0;
+
+    while (inlen - done >= 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+	v = enc_translate_sse41(enc_reshuffle_sse41(v));
+	_mm_storeu_si128((__m128i *)out, v);
+	out += 16;
+	done += 12;
+    }
+    return done;
+}
+
+/* Check 16 characters of input and turn them into 6-bit values.  Return
+ * 0 if there's anything but plain base64 among them. */
+__attribute__((target("sse4.1")))
+static int dec_translate_sse41(__m128i *str)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+	    0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71,
+	    -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(*str, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(*str, mask_2f);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    __m128i eq_2f, roll;
+
+    if (!_mm_testz_si128(lo, hi)) return 0;
+
+    eq_2f = _mm_cmpeq_epi8(*str, mask_2f);
+    roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    *str = _mm_add_epi8(*str, roll);
+    return 1;
+}
+
+/* Pack 16 6-bit values into the low 12 bytes */
+__attribute__((target("sse4.1")))
+static __m128i dec_reshuffle_sse41(__m128i in)
+{
+    __m128i merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    __m128i out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+
+    return _mm_shuffle_epi8(out, _mm_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/* Each round decodes 16 characters into 12 bytes */
+__attribute__((target("sse4.1")))
+static size_t decode_sse41(unsigned char *out, const char *in, size_t inlen)
+{
+    size_t done = 0;
+
+    while (inlen - done >= 16) {
+	__m128i str = _mm_loadu_si128((const __m128i *)(in + done));
+	int last;
+	if (!dec_translate_sse41(&str)) break;
+	str = dec_reshuffle_sse41(str);
+	_mm_storel_epi64((__m128i *)out, str);
+	last = _mm_extract_epi32(str, 2);
+	memmove(out + 8, &last, 4);
+	out += 12;
+	done += 16;
+    }
+    return done;
+}
+
+__attribute__((target("avx2")))
+static __m256i enc_reshuffle_avx2(__m256i in)
+{
+    __m256i t0, t1, t2, t3;
+
+    /* The input was loaded from 4 bytes before where it starts, so that
+     * the upper lane gets bytes 12-23; the lower lane's are 4-15. */
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6, 4, 5));
+    t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    return _mm256_or_si256(t1, t3);
+}
+
+__attribute__((target("avx2")))
+static __m256i enc_translate_avx2(__m256i in)
+{
+    const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+	    -4, -4, -4, -4, -19, -16, 0, 0, 65, 71, -4, -4, -4, -4, -4, -4,
+	    -4, -4, -4, -4, -19, -16, 0, 0);
+    __m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+    __m256i mask = _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25));
+
+    indices = _mm256_sub_epi8(indices, mask);
+    return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+}
+
+/* Each round encodes 24 bytes, reading from 4 bytes before them to 4
+ * bytes after, so the first and last few rounds are left to SSE4.1. */
+__attribute__((target("avx2")))
+static size_t encode_avx2(char *out, const unsigned char *in, size_t inlen)
+{
+    size_t done;
+
+    if (inlen < 16 + 28) return encode_sse41(out, in, inlen);
+
+    done = encode_sse41(out, in, 16);
+    out += 16;
+    while (inlen - done >= 28) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(in + done - 4));
+	v = enc_translate_avx2(enc_reshuffle_avx2(v));
+	_mm256_storeu_si256((__m256i *)out, v);
+	out += 32;
+	done += 24;
+    }
+    return done + encode_sse41(out, in + done, inlen - done);
+}
+
+__attribute__((target("avx2")))
+static int dec_translate_avx2(__m256i *str)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b,
+	    0x1b, 0x1a, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	    0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02,
+	    0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	    0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65,
+	    -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 19, 4, -65, -65, -71,
+	    -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(*str, 4),
+	    mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(*str, mask_2f);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i eq_2f, roll;
+
+    if (!_mm256_testz_si256(lo, hi)) return 0;
+
+    eq_2f = _mm256_cmpeq_epi8(*str, mask_2f);
+    roll = _mm256_shuffle_epi8(lut_roll,
+	    _mm256_add_epi8(eq_2f, hi_nibbles));
+    *str = _mm256_add_epi8(*str, roll);
+    return 1;
+}
+
+/* Pack 32 6-bit values into the low 24 bytes */
+__attribute__((target("avx2")))
+static __m256i dec_reshuffle_avx2(__m256i in)
+{
+    __m256i merged = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+    __m256i out = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+
+    out = _mm256_shuffle_epi8(out, _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return _mm256_permutevar8x32_epi32(out,
+	    _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+}
+
+/* Each round decodes 32 characters into 24 bytes */
+__attribute__((target("avx2")))
+static size_t decode_avx2(unsigned char *out, const char *in, size_t inlen)
+{
+    size_t done = 0;
+
+    while (inlen - done >= 32) {
+	__m256i str = _mm256_loadu_si256((const __m256i *)(in + done));
+	if (!dec_translate_avx2(&str)) break;
+	str = dec_reshuffle_avx2(str);
+	_mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(str));
+	_mm_storel_epi64((__m128i *)(out + 16),
+		_mm256_extracti128_si256(str, 1));
+	out += 24;
+	done += 32;
+    }
+    return done + decode_sse41(out, in + done, inlen - done);
+}
+
+#endif  /* HAVE_X86_SIMD */
+
+/* Encode as much of the start of data as the SIMD kernels can, and
+ * return how many bytes of it (a multiple of 3) were encoded. */
+static size_t encode_bulk(char *base64data, const unsigned char *data,
+	size_t datalen)
+{
+#ifdef HAVE_X86_SIMD
+    int level = otrl_base64_simd_level();
+    if (level > simd_limit) level = simd_limit;
+    if (level == OTRL_B64_SIMD_AVX2) {
+	return encode_avx2(base64data, data, datalen);
+    } else if (level == OTRL_B64_SIMD_SSE41) {
+	return encode_sse41(base64data, data, datalen);
+    }
+#endif
+    return 0;
+}
+
+/* Decode as much of the start of base64data as the SIMD kernels can,
+ * and return how many characters of it (a multiple of 4) were
+ * decoded. */
+static size_t decode_bulk(unsigned char *data, const char *base64data,
+	size_t base64len)
+{
+#ifdef HAVE_X86_SIMD
+    int level = otrl_base64_simd_level();
+    if (level > simd_limit) level = simd_limit;
+    if (level == OTRL_B64_SIMD_AVX2) {
+	return decode_avx2(data, base64data, base64len);
+    } else if (level == OTRL_B64_SIMD_SSE41) {
+	return decode_sse41(data, base64data, base64len);
+    }
+#endif
+    return 0;
+}
+
 /*
  * base64 encode data.  Insert no linebreaks or whitespace.
  *
@@ -103,6 +417,12 @@ size_t otrl_base64_encode(char *base64data, const unsigned char *data,
 	size_t datalen)
 {
     size_t base64len = 0;
+    size_t bulk = encode_bulk(base64data, data, datalen);
+
+    base64data += bulk / 3 * 4;
+    base64len += bulk / 3 * 4;
+    data += bulk;
+    datalen -= bulk;
 
     while(datalen > 2) {
 	encodeblock(base64data, data, 3);
@@ -160,8 +480,19 @@ size_t otrl_base64_decode(unsigned char *data, const char *base64data,
     size_t b64accum = 0;
 
     while(base64len > 0) {
-	char b = *base64data;
+	char b;
 	unsigned char bdecode;
+	if (b64accum == 0) {
+	    /* Between blocks, let the SIMD code take any run of plain
+	     * base64 */
+	    size_t bulk = decode_bulk(data, base64data, base64len);
+	    data += bulk / 4 * 3;
+	    datalen += bulk / 4 * 3;
+	    base64data += bulk;
+	    base64len -= bulk;
+	    if (base64len == 0) break;
+	}
+	b = *base64data;
 	++base64data;
 	--base64len;
 	if (b < '+' || b > 'z') continue;  /* Skip non-base64 chars */
@@ -188,6 +519,110 @@ size_t otrl_base64_decode(unsigned char *data, const char *base64data,
     return datalen;
 }
 
+/*
+ * Prepare to base64-decode base64len bytes of base64data with
+ * otrl_base64_decoder_read.  The input is treated exactly as
+ * otrl_base64_decode would treat it.
+ */
+void otrl_base64_decoder_init(OtrlBase64Decoder *dec,
+	const char *base64data, size_t base64len)
+{
+    dec->base64data = base64data;
+    dec->base64len = base64len;
+    dec->b64accum = 0;
+    dec->blocklen = 0;
+    dec->blockpos = 0;
+    dec->finished = 0;
+}
+
+/* Decode the next block of input into out, which must have room for 3
+ * bytes, and return the number of bytes written. */
+static size_t decoder_next_block(OtrlBase64Decoder *dec, unsigned char *out)
+{
+    while(dec->base64len > 0) {
+	char b = *(dec->base64data);
+	unsigned char bdecode;
+	++(dec->base64data);
+	--(dec->base64len);
+	if (b < '+' || b > 'z') continue;  /* Skip non-base64 chars */
+	if (b == '=') {
+	    /* Force termination */
+	    size_t written = decode(out, dec->b64, dec->b64accum);
+	    dec->b64accum = 0;
+	    dec->finished = 1;
+	    return written;
+	}
+	bdecode = cd64[b-'+'];
+	if (bdecode == '$') continue;  /* Skip non-base64 chars */
+	dec->b64[dec->b64accum++] = bdecode-'>';
+	if (dec->b64accum == 4) {
+	    /* We have a complete block; decode it. */
+	    dec->b64accum = 0;
+	    return decode(out, dec->b64, 4);
+	}
+    }
+
+    /* Just discard any short block at the end. */
+    dec->b64accum = 0;
+    dec->finished = 1;
+    return 0;
+}
+
+/*
+ * Decode up to datalen more bytes into data.  This will return the
+ * number of bytes actually decoded, which is less than datalen only
+ * once the end of the input has been reached.
+ */
+size_t otrl_base64_decoder_read(OtrlBase64Decoder *dec, unsigned char *data,
+	size_t datalen)
+{
+    size_t got = 0;
+
+    while (got < datalen) {
+	if (dec->blockpos < dec->blocklen) {
+	    /* Hand out what's left of the last block first */
+	    size_t n = dec->blocklen - dec->blockpos;
+	    if (n > datalen - got) n = datalen - got;
+	    memmove(data + got, dec->block + dec->blockpos, n);
+	    dec->blockpos += n;
+	    got += n;
+	} else if (dec->finished) {
+	    break;
+	} else if (dec->b64accum == 0 && datalen - got >= 4 *
+		OTRL_B64_DECODED_LEN) {
+	    /* Let the SIMD code take what it can, but no more than fits */
+	    size_t maxlen = (datalen - got) / OTRL_B64_DECODED_LEN *
+		OTRL_B64_ENCODED_LEN;
+	    size_t bulk = decode_bulk(data + got, dec->base64data,
+		    dec->base64len < maxlen ? dec->base64len : maxlen);
+	    got += bulk / OTRL_B64_ENCODED_LEN * OTRL_B64_DECODED_LEN;
+	    dec->base64data += bulk;
+	    dec->base64len -= bulk;
+	    if (bulk == 0) {
+		got += decoder_next_block(dec, data + got);
+	    }
+	} else if (datalen - got >= OTRL_B64_DECODED_LEN) {
+	    /* There's room to decode straight into the output */
+	    got += decoder_next_block(dec, data + got);
+	} else {
+	    dec->blocklen = decoder_next_block(dec, dec->block);
+	    dec->blockpos = 0;
+	}
+    }
+
+    return got;
+}
+
+/*
+ * Return the most bytes the rest of the input could decode to.
+ */
+size_t otrl_base64_decoder_remaining(const OtrlBase64Decoder *dec)
+{
+    if (dec->finished) return dec->blocklen - dec->blockpos;
+    return (dec->blocklen - dec->blockpos) +
+	OTRL_B64_MAX_DECODED_SIZE(dec->base64len + dec->b64accum);
+}
+
 /*
  * Base64-encode a block of data, stick "?OTR:" and "." around it, and
  * return the result, or NULL in the event of a memory error.  The
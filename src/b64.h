@@ -28,6 +28,11 @@
 /* into blocks of this many bytes: */
 #define OTRL_B64_ENCODED_LEN 4
 
+/* The kinds of SIMD code the base64 functions can use */
+#define OTRL_B64_SIMD_NONE 0
+#define OTRL_B64_SIMD_SSE41 1
+#define OTRL_B64_SIMD_AVX2 2
+
 /* An encoded block of length encoded_len can turn into a maximum of
  * this many decoded bytes: */
 #define OTRL_B64_MAX_DECODED_SIZE(encoded_len) \
@@ -54,6 +59,52 @@ size_t otrl_base64_encode(char *base64data, const unsigned char *data,
 size_t otrl_base64_decode(unsigned char *data, const char *base64data,
 	size_t base64len);
 
+/*
+ * Return the fastest kind of SIMD code the base64 functions can use on
+ * this machine: OTRL_B64_SIMD_NONE, OTRL_B64_SIMD_SSE41 or
+ * OTRL_B64_SIMD_AVX2.
+ */
+int otrl_base64_simd_level(void);
+
+/*
+ * Stop the base64 functions from using any SIMD code faster than
+ * level.  This is for testing and benchmarking the slower code paths.
+ * Return the kind of SIMD code that will now be used.
+ */
+int otrl_base64_set_simd_level(int level);
+
+/* State for base64-decoding a buffer a piece at a time */
+typedef struct {
+    const char *base64data;     /* The input not yet looked at */
+    size_t base64len;
+    char b64[4];                /* Input characters not yet decoded */
+    size_t b64accum;
+    unsigned char block[3];     /* Decoded bytes not yet returned */
+    size_t blocklen, blockpos;
+    int finished;               /* Have we reached the end of the input? */
+} OtrlBase64Decoder;
+
+/*
+ * Prepare to base64-decode base64len bytes of base64data with
+ * otrl_base64_decoder_read.  The input is treated exactly as
+ * otrl_base64_decode would treat it.
+ */
+void otrl_base64_decoder_init(OtrlBase64Decoder *dec,
+	const char *base64data, size_t base64len);
+
+/*
+ * Decode up to datalen more bytes into data.  This will return the
+ * number of bytes actually decoded, which is less than datalen only
+ * once the end of the input has been reached.
+ */
+size_t otrl_base64_decoder_read(OtrlBase64Decoder *dec, unsigned char *data,
+	size_t datalen);
+
+/*
+ * Return the most bytes the rest of the input could decode to.
+ */
+size_t otrl_base64_decoder_remaining(const OtrlBase64Decoder *dec);
+
 /*
  * Base64-encode a block of data, stick "?OTR:" and "." around it, and
  * return the result, or NULL in the event of a memory error.
@@ -0,0 +1,271 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* libotr headers */
+#include "capture.h"
+#include "proto.h"
+#include "trace.h"
+
+#define CAPTURE_FORMAT 1
+
+/* The number an account or correspondent has been given, found by the
+ * strings that name it */
+typedef struct s_CaptureName {
+    struct s_CaptureName *next;
+    unsigned int hash;
+    size_t keylen;
+    unsigned int id;
+    char key[1];
+} CaptureName;
+
+struct s_OtrlCapture {
+    FILE *fp;
+    unsigned long long start;     /* When the capture was started, in ns */
+    CaptureName **names;
+    size_t names_size;            /* The number of buckets in names */
+    size_t names_used;
+    unsigned int num_accounts;
+    unsigned int num_peers;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t mutex;        /* Protects all of the above */
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+#define capture_lock(c) pthread_mutex_lock(&((c)->mutex))
+#define capture_unlock(c) pthread_mutex_unlock(&((c)->mutex))
+#else
+#define capture_lock(c)
+#define capture_unlock(c)
+#endif
+
+/* Start a capture written to fp, which must stay open until the
+ * capture is freed.  Return NULL if out of memory. */
+OtrlCapture *otrl_capture_new(FILE *fp)
+{
+    OtrlCapture *cap = malloc(sizeof(*cap));
+
+    if (!cap) return NULL;
+    cap->names_size = 256;
+    cap->names = calloc(cap->names_size, sizeof(CaptureName *));
+    if (!cap->names) {
+	free(cap);
+	return NULL;
+    }
+    cap->fp = fp;
+    cap->start = otrl_trace_now();
+    cap->names_used = 0;
+    cap->num_accounts = 0;
+    cap->num_peers = 0;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&(cap->mutex), NULL);
+#endif
+
+    fprintf(fp, "# libotr capture %d\n", CAPTURE_FORMAT);
+    return cap;
+}
+
+/* Double the number of buckets in the capture's table of names, if it
+ * can. */
+static void capture_names_grow(OtrlCapture *cap)
+{
+    size_t newsize = 2 * cap->names_size;
+    CaptureName **newnames = calloc(newsize, sizeof(CaptureName *));
+    size_t i;
+
+    if (!newnames) return;
+    for (i = 0; i < cap->names_size; ++i) {
+	CaptureName *name, *next;
+
+	for (name = cap->names[i]; name; name = next) {
+	    next = name->next;
+	    name->next = newnames[name->hash & (newsize - 1)];
+	    newnames[name->hash & (newsize - 1)] = name;
+	}
+    }
+    free(cap->names);
+    cap->names = newnames;
+    cap->names_size = newsize;
+}
+
+/* Return the number of the account (if username is NULL) or of the
+ * correspondent named by the given strings, numbering it if it's new.
+ * Return 0 if out of memory; the numbers start at 1.  The capture must
+ * be locked. */
+static unsigned int capture_name_id(OtrlCapture *cap,
+	const char *accountname, const char *protocol, const char *username)
+{
+    size_t alen = strlen(accountname), plen = strlen(protocol);
+    size_t ulen = username ? strlen(username) : 0;
+    size_t keylen = alen + 1 + plen + (username ? 1 + ulen : 0);
+    unsigned int hash = 5381;
+    CaptureName *name;
+    char keybuf[256];
+    char *key = keylen <= sizeof(keybuf) ? keybuf : malloc(keylen);
+    size_t i;
+
+    if (!key) return 0;
+    memmove(key, accountname, alen + 1);
+    memmove(key + alen + 1, protocol, plen);
+    if (username) {
+	key[alen + 1 + plen] = '\0';
+	memmove(key + alen + 1 + plen + 1, username, ulen);
+    }
+    for (i = 0; i < keylen; ++i) {
+	hash = hash * 33 + (unsigned char)key[i];
+    }
+
+    for (name = cap->names[hash & (cap->names_size - 1)]; name;
+	    name = name->next) {
+	if (name->hash == hash && name->keylen == keylen &&
+		!memcmp(name->key, key, keylen)) break;
+    }
+
+    if (!name) {
+	name = malloc(sizeof(CaptureName) + keylen);
+	if (name) {
+	    memmove(name->key, key, keylen);
+	    name->hash = hash;
+	    name->keylen = keylen;
+	    name->id = username ? ++cap->num_peers : ++cap->num_accounts;
+	    name->next = cap->names[hash & (cap->names_size - 1)];
+	    cap->names[hash & (cap->names_size - 1)] = name;
+	    if (++cap->names_used > cap->names_size) {
+		capture_names_grow(cap);
+	    }
+	}
+    }
+    if (key != keybuf) free(key);
+    return name ? name->id : 0;
+}
+
+/* The kind of message, as it's recorded in a capture */
+static const char *capture_kind(const char *message)
+{
+    const char *otrtag = strstr(message, "?OTR");
+
+    /* Fragments of protocol versions 3 and 2 */
+    if (otrtag && (otrtag[4] == '|' || otrtag[4] == ',')) return "frag";
+
+    switch (otrl_proto_message_type(message)) {
+	case OTRL_MSGTYPE_NOTOTR:
+	    return "plain";
+	case OTRL_MSGTYPE_TAGGEDPLAINTEXT:
+	    return "tagged";
+	case OTRL_MSGTYPE_QUERY:
+	    return "query";
+	case OTRL_MSGTYPE_DH_COMMIT:
+	    return "commit";
+	case OTRL_MSGTYPE_DH_KEY:
+	    return "key";
+	case OTRL_MSGTYPE_REVEALSIG:
+	    return "reveal";
+	case OTRL_MSGTYPE_SIGNATURE:
+	    return "sig";
+	case OTRL_MSGTYPE_V1_KEYEXCH:
+	    return "v1keyexch";
+	case OTRL_MSGTYPE_DATA:
+	    return "data";
+	case OTRL_MSGTYPE_ERROR:
+	    return "error";
+	default:
+	    return "unknown";
+    }
+}
+
+/* Record one message in the given direction. */
+static void capture_message(OtrlCapture *cap, char dir,
+	const char *accountname, const char *protocol, const char *peer,
+	const char *message)
+{
+    unsigned long long msec = (otrl_trace_now() - cap->start) / 1000000;
+    const char *kind = capture_kind(message);
+    unsigned int account, peerid;
+
+    capture_lock(cap);
+    account = capture_name_id(cap, accountname, protocol, NULL);
+    peerid = capture_name_id(cap, accountname, protocol, peer);
+    fprintf(cap->fp, "%llu %c %u %u %s %lu", msec, dir, account, peerid,
+	    kind, (unsigned long)strlen(message));
+    if (!strcmp(kind, "frag")) {
+	const char *comma = strchr(strstr(message, "?OTR"), ',');
+	unsigned int k = 0, n = 0;
+
+	if (comma) sscanf(comma + 1, "%u,%u", &k, &n);
+	fprintf(cap->fp, " %u/%u", k, n);
+    }
+    fputc('\n', cap->fp);
+    capture_unlock(cap);
+}
+
+/* Record a message about to be sent to the network.  Call this from
+ * your inject_message callback, and wherever you send a message that
+ * otrl_message_sending gave back to you. */
+void otrl_capture_sent(OtrlCapture *cap, const char *accountname,
+	const char *protocol, const char *recipient, const char *message)
+{
+    if (!cap || !accountname || !protocol || !recipient || !message) return;
+    capture_message(cap, 'S', accountname, protocol, recipient, message);
+}
+
+/* Record a message just received from the network, just before passing
+ * it to otrl_message_receiving (or one of its batch or offload
+ * versions). */
+void otrl_capture_received(OtrlCapture *cap, const char *accountname,
+	const char *protocol, const char *sender, const char *message)
+{
+    if (!cap || !accountname || !protocol || !sender || !message) return;
+    capture_message(cap, 'R', accountname, protocol, sender, message);
+}
+
+/* Stop the given capture, flushing its file but not closing it. */
+void otrl_capture_free(OtrlCapture *cap)
+{
+    size_t i;
+
+    if (!cap) return;
+    fflush(cap->fp);
+    for (i = 0; i < cap->names_size; ++i) {
+	CaptureName *name, *next;
+
+	for (name = cap->names[i]; name; name = next) {
+	    next = name->next;
+	    free(name);
+	}
+    }
+    free(cap->names);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&(cap->mutex));
+#endif
+    free(cap);
+}
@@ -0,0 +1,66 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdio.h>
+
+/* A capture records the shape of an application's OTR traffic, so that
+ * it can be played back later by tests/bench/otr_replay to profile
+ * libotr on a realistic workload.  Nothing that could identify anyone,
+ * nor anything of what was said, is recorded: accounts and
+ * correspondents are numbered in the order they're first seen, and a
+ * message is recorded only as its kind, its length and, for a
+ * fragment, its place among the others.
+ *
+ * Each message is one line of text,
+ *
+ *    <msec> <dir> <account> <peer> <kind> <length> [<k>/<n>]
+ *
+ * where msec is the time since the capture was started, dir is S for a
+ * message sent and R for one received, kind is one of plain, tagged,
+ * query, commit, key, reveal, sig, v1keyexch, data, error, unknown or
+ * frag, and the fragment's k and n follow frag.  Lines starting with #
+ * are comments. */
+
+typedef struct s_OtrlCapture OtrlCapture;
+
+/* Start a capture written to fp, which must stay open until the
+ * capture is freed.  Return NULL if out of memory. */
+OtrlCapture *otrl_capture_new(FILE *fp);
+
+/* Record a message about to be sent to the network.  Call this from
+ * your inject_message callback, and wherever you send a message that
+ * otrl_message_sending gave back to you. */
+void otrl_capture_sent(OtrlCapture *cap, const char *accountname,
+	const char *protocol, const char *recipient, const char *message);
+
+/* Record a message just received from the network, just before passing
+ * it to otrl_message_receiving (or one of its batch or offload
+ * versions). */
+void otrl_capture_received(OtrlCapture *cap, const char *accountname,
+	const char *protocol, const char *sender, const char *message);
+
+/* Stop the given capture, flushing its file but not closing it. */
+void otrl_capture_free(OtrlCapture *cap);
+
+#endif
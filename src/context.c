@@ -21,6 +21,7 @@
 
 /* system headers */
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 
 /* libgcrypt headers */
@@ -28,7 +29,18 @@
 
 /* libotr headers */
 #include "context.h"
+#include "fpstore.h"
 #include "instag.h"
+#include "mem.h"
+#include "pubkeycache.h"
+#include "stats.h"
+
+/* The fields at the start of struct context that otrl_context_find and
+ * the walks of the context list look at fit in one 64-byte cache line
+ * on the usual LP64 and ILP32 targets */
+typedef char context_hot_fields_fit[
+    offsetof(ConnContext, protocol_version) + sizeof(unsigned int) <= 64 ?
+    1 : -1];
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -120,25 +132,106 @@ void otrl_context_all_dump(FILE *f, OtrlUserState us)
 }
 #endif
 
-/* Create a new connection context. */
-static ConnContext * new_context(const char * user, const char * accountname,
-	const char * protocol)
+/* The number of contexts in each slab */
+#define CONTEXT_SLAB_BLOCKS 32
+
+/* A context allocated from a slab, together with its private part and
+ * its SM state */
+typedef struct s_OtrlContextBlock {
+    ConnContext context;
+    ConnContextPriv context_priv;
+    OtrlSMState smstate;
+} OtrlContextBlock;
+
+struct s_OtrlContextSlab {
+    struct s_OtrlContextSlab *next;
+    OtrlContextBlock blocks[CONTEXT_SLAB_BLOCKS];
+};
+
+/* Take a block from the userstate's slabs, adding a new slab if they're
+ * all in use.  The context_priv and smstate pointers of the returned
+ * context are set, but nothing is initialized.  Return NULL if out of
+ * memory. */
+static ConnContext *context_slab_alloc(OtrlUserState us)
+{
+    OtrlContextBlock *block;
+
+    if (us->context_slab_free == NULL) {
+	struct s_OtrlContextSlab *slab;
+	int i;
+
+	slab = malloc(sizeof(*slab));
+	if (slab == NULL) return NULL;
+	slab->next = us->context_slab_root;
+	us->context_slab_root = slab;
+	for (i = CONTEXT_SLAB_BLOCKS - 1; i >= 0; --i) {
+	    slab->blocks[i].context.next = us->context_slab_free;
+	    us->context_slab_free = &(slab->blocks[i].context);
+	}
+    }
+
+    block = (OtrlContextBlock *)us->context_slab_free;
+    us->context_slab_free = block->context.next;
+    block->context.context_priv = &(block->context_priv);
+    block->context.smstate = &(block->smstate);
+
+    return &(block->context);
+}
+
+/* Wipe a forgotten context's block and put it back on the free list. */
+static void context_slab_release(OtrlUserState us, ConnContext *context)
+{
+    otrl_mem_wipe(context, sizeof(OtrlContextBlock));
+    context->next = us->context_slab_free;
+    us->context_slab_free = context;
+}
+
+/* Free all the slabs of a userstate.  All of its contexts must already
+ * have been forgotten. */
+static void context_slab_free_all(OtrlUserState us)
 {
-    ConnContext * context;
+    while (us->context_slab_root) {
+	struct s_OtrlContextSlab *slab = us->context_slab_root;
+	us->context_slab_root = slab->next;
+	free(slab);
+    }
+    us->context_slab_free = NULL;
+}
+
+/* Create a new connection context.  The username, accountname and
+ * protocol are interned in the given OtrlUserState. */
+static ConnContext * new_context(OtrlUserState us, const char * user,
+	const char * accountname, const char * protocol)
+{
+    ConnContext * context = NULL;
     OtrlSMState *smstate;
 
-    context = malloc(sizeof(ConnContext));
-    assert(context != NULL);
+    if (us->context_slab) {
+	context = context_slab_alloc(us);
+    }
+    if (context) {
+	smstate = context->smstate;
+	otrl_context_priv_init(context->context_priv);
+	context->context_priv->in_slab = 1;
+    } else {
+	context = malloc(sizeof(ConnContext));
+	assert(context != NULL);
+	smstate = malloc(sizeof(OtrlSMState));
+	assert(smstate != NULL);
+	context->context_priv = otrl_context_priv_new();
+	assert(context->context_priv != NULL);
+    }
 
-    context->username = strdup(user);
-    context->accountname = strdup(accountname);
-    context->protocol = strdup(protocol);
+    context->username = otrl_userstate_intern(us, user);
+    context->accountname = otrl_userstate_intern(us, accountname);
+    context->protocol = otrl_userstate_intern(us, protocol);
+    assert(context->username != NULL && context->accountname != NULL &&
+	    context->protocol != NULL);
 
     context->msgstate = OTRL_MSGSTATE_PLAINTEXT;
     otrl_auth_new(context);
+    context->auth.dh_keypool = us->dh_keypool;
 
-    smstate = malloc(sizeof(OtrlSMState));
-    assert(smstate != NULL);
     otrl_sm_state_new(smstate);
     context->smstate = smstate;
 
@@ -148,15 +241,20 @@ static ConnContext * new_context(const char * user, const char * accountname,
     context->fingerprint_root.context = context;
     context->fingerprint_root.next = NULL;
     context->fingerprint_root.tous = NULL;
+    context->fingerprint_root.trust = NULL;
+    context->fingerprint_root.hash_next = NULL;
+    context->fingerprint_root.hash_tous = NULL;
+    context->fingerprint_root.changed_next = NULL;
+    context->fingerprint_root.changed_tous = NULL;
+    context->fingerprint_root.pubkey = NULL;
     context->active_fingerprint = NULL;
     memset(context->sessionid, 0, 20);
     context->sessionid_len = 0;
+    context->sessionid_half = OTRL_SESSIONID_FIRST_HALF_BOLD;
     context->protocol_version = 0;
     context->otr_offer = OFFER_NOT;
     context->app_data = NULL;
     context->app_data_free = NULL;
-    context->context_priv = otrl_context_priv_new();
-    assert(context->context_priv != NULL);
     context->next = NULL;
     context->m_context = context;
     context->recent_rcvd_child = NULL;
@@ -166,6 +264,259 @@ static ConnContext * new_context(const char * user, const char * accountname,
     return context;
 }
 
+/* The initial number of buckets in a userstate's context index */
+#define CONTEXT_INDEX_INITIAL_SIZE 64
+
+/* Hash a username/accountname/protocol triple.  The strings must be
+ * interned, so their addresses are enough to identify them. */
+static unsigned int context_index_hash(const char *user,
+	const char *accountname, const char *protocol)
+{
+    size_t hash = (size_t)user >> 4;
+
+    hash = hash * 2654435761U + ((size_t)accountname >> 4);
+    hash = hash * 2654435761U + ((size_t)protocol >> 4);
+    return (unsigned int)(hash ^ (hash >> 16));
+}
+
+/* Find the first context in the list for the given (interned)
+ * username/accountname/protocol, or NULL if there is none. */
+static ConnContext *context_index_find(OtrlUserState us, unsigned int hash,
+	const char *user, const char *accountname, const char *protocol)
+{
+    ConnContext *c;
+
+    if (us->context_index == NULL) return NULL;
+
+    for (c = us->context_index[hash & (us->context_index_size - 1)]; c;
+	    c = c->context_priv->index_next) {
+	if (c->username == user && c->accountname == accountname &&
+		c->protocol == protocol) {
+	    return c;
+	}
+    }
+    return NULL;
+}
+
+/* strcmp, but short-circuited for interned strings */
+static int context_strcmp(const char *a, const char *b)
+{
+    return a == b ? 0 : strcmp(a, b);
+}
+
+/* Link the given context into the front of its bucket in the context
+ * index. */
+static void context_index_link(OtrlUserState us, ConnContext *context)
+{
+    ConnContextPriv *priv = context->context_priv;
+    ConnContext **bucket =
+	&(us->context_index[priv->index_hash & (us->context_index_size - 1)]);
+
+    priv->index_next = *bucket;
+    if (*bucket) {
+	(*bucket)->context_priv->index_tous = &(priv->index_next);
+    }
+    *bucket = context;
+    priv->index_tous = bucket;
+}
+
+/* Index the first context in the list for each
+ * username/accountname/protocol, into a new, empty context index. */
+static void context_index_build(OtrlUserState us)
+{
+    ConnContext *c, *prev = NULL;
+
+    for (c = us->context_root; c; prev = c, c = c->next) {
+	if (prev && prev->username == c->username &&
+		prev->accountname == c->accountname &&
+		prev->protocol == c->protocol) {
+	    continue;
+	}
+	c->context_priv->index_hash = context_index_hash(c->username,
+		c->accountname, c->protocol);
+	++us->context_index_used;
+	context_index_link(us, c);
+    }
+}
+
+/* Grow the context index so that it has at least as many buckets as
+ * indexed contexts.  If we can't get the memory, just leave it as it
+ * is; lookups will still work, only with longer chains.  If there's no
+ * index at all yet, they walk the list instead, and the first index we
+ * do get takes in all the contexts there are by then. */
+static void context_index_grow(OtrlUserState us)
+{
+    ConnContext **oldindex = us->context_index;
+    size_t oldsize = us->context_index_size;
+    size_t newsize, i;
+
+    if (oldindex && us->context_index_used < oldsize) return;
+
+    newsize = oldsize ? oldsize * 2 : CONTEXT_INDEX_INITIAL_SIZE;
+    us->context_index = calloc(newsize, sizeof(ConnContext *));
+    if (us->context_index == NULL) {
+	us->context_index = oldindex;
+	return;
+    }
+    us->context_index_size = newsize;
+    if (oldindex == NULL) {
+	context_index_build(us);
+	return;
+    }
+
+    for (i = 0; i < oldsize; ++i) {
+	while (oldindex[i]) {
+	    ConnContext *c = oldindex[i];
+	    oldindex[i] = c->context_priv->index_next;
+	    context_index_link(us, c);
+	}
+    }
+    free(oldindex);
+}
+
+/* Add the given context, which is now the first one in the list for its
+ * username/accountname/protocol, to the context index. */
+static void context_index_insert(OtrlUserState us, ConnContext *context,
+	unsigned int hash)
+{
+    if (us->context_index == NULL) {
+	/* A new index takes in this context along with any others */
+	context_index_grow(us);
+	return;
+    }
+    context->context_priv->index_hash = hash;
+    ++us->context_index_used;
+    context_index_grow(us);
+    context_index_link(us, context);
+}
+
+/* The indexed context oldctx is going away.  Put newctx (if non-NULL,
+ * the next context in the list with the same
+ * username/accountname/protocol) in its place in the context index, or
+ * else remove it from the index entirely. */
+static void context_index_replace(ConnContext *oldctx, ConnContext *newctx)
+{
+    ConnContextPriv *oldpriv = oldctx->context_priv;
+
+    if (newctx) {
+	ConnContextPriv *newpriv = newctx->context_priv;
+	newpriv->index_hash = oldpriv->index_hash;
+	newpriv->index_next = oldpriv->index_next;
+	newpriv->index_tous = oldpriv->index_tous;
+	*(newpriv->index_tous) = newctx;
+	if (newpriv->index_next) {
+	    newpriv->index_next->context_priv->index_tous =
+		&(newpriv->index_next);
+	}
+    } else {
+	*(oldpriv->index_tous) = oldpriv->index_next;
+	if (oldpriv->index_next) {
+	    oldpriv->index_next->context_priv->index_tous =
+		oldpriv->index_tous;
+	}
+	--oldpriv->userstate->context_index_used;
+    }
+    oldpriv->index_next = NULL;
+    oldpriv->index_tous = NULL;
+}
+
+/* The initial number of children a master context has room for */
+#define CONTEXT_CHILDREN_INITIAL_SIZE 4
+
+/* Find the child of the given master context with the given instance
+ * tag.  Return 1 if it has one, with its place in the master's children
+ * in *posp, or else 0, with the place it would go in *posp. */
+static int context_child_search(ConnContext *m_context,
+	otrl_instag_t their_instance, unsigned int *posp)
+{
+    ConnContextPriv *mpriv = m_context->context_priv;
+    unsigned int lo = 0, hi = mpriv->children_used;
+
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	otrl_instag_t instag = mpriv->children[mid]->their_instance;
+
+	if (instag == their_instance) {
+	    *posp = mid;
+	    return 1;
+	} else if (instag < their_instance) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    *posp = lo;
+    return 0;
+}
+
+/* Add the given new child to its master's children */
+static void context_child_add(ConnContext *child)
+{
+    ConnContext *m_context = child->m_context;
+    ConnContextPriv *mpriv = m_context->context_priv;
+    unsigned int pos;
+
+    context_child_search(m_context, child->their_instance, &pos);
+    if (mpriv->children_used == mpriv->children_size) {
+	unsigned int newsize = mpriv->children_size ?
+	    mpriv->children_size * 2 : CONTEXT_CHILDREN_INITIAL_SIZE;
+	ConnContext **children = realloc(mpriv->children,
+		newsize * sizeof(ConnContext *));
+	assert(children != NULL);
+	mpriv->children = children;
+	mpriv->children_size = newsize;
+    }
+    memmove(mpriv->children + pos + 1, mpriv->children + pos,
+	    (mpriv->children_used - pos) * sizeof(ConnContext *));
+    mpriv->children[pos] = child;
+    ++mpriv->children_used;
+}
+
+/* Take the given child out of its master's children, if it's there */
+static void context_child_remove(ConnContext *child)
+{
+    ConnContext *m_context = child->m_context;
+    ConnContextPriv *mpriv = m_context->context_priv;
+    unsigned int pos;
+
+    if (context_child_search(m_context, child->their_instance, &pos) &&
+	    mpriv->children[pos] == child) {
+	--mpriv->children_used;
+	memmove(mpriv->children + pos, mpriv->children + pos + 1,
+		(mpriv->children_used - pos) * sizeof(ConnContext *));
+    }
+}
+
+/* Tell the master of the given context that the context's msgstate,
+ * active fingerprint or lastrecv, or the trust of one of the master's
+ * fingerprints, has changed, so that otrl_context_find works out
+ * OTRL_INSTAG_BEST afresh. */
+void otrl_context_best_changed(ConnContext *context)
+{
+    if (context && context->m_context) {
+	context->m_context->context_priv->best_instance = NULL;
+    }
+}
+
+/* Find the instance OTRL_INSTAG_BEST means for the given master
+ * context, remembering it until otrl_context_best_changed is called.
+ * In the threaded mode, where lookups share the userstate's read lock
+ * and the fields it depends on change under the family locks, it is
+ * worked out every time instead. */
+static ConnContext *context_best_instance(ConnContext *m_context)
+{
+    ConnContextPriv *mpriv = m_context->context_priv;
+
+    if (mpriv->userstate->lock) {
+	return otrl_context_find_recent_secure_instance(m_context);
+    }
+    if (mpriv->best_instance == NULL) {
+	mpriv->best_instance =
+	    otrl_context_find_recent_secure_instance(m_context);
+    }
+    return mpriv->best_instance;
+}
+
 ConnContext * otrl_context_find_recent_instance(ConnContext * context,
 	otrl_instag_t recent_instag) {
     ConnContext * m_context;
@@ -243,30 +594,180 @@ ConnContext * otrl_context_find_recent_secure_instance(ConnContext * context)
     return cresult;
 }
 
-/* Look up a connection context by name/account/protocol/instag from the given
- * OtrlUserState.  If add_if_missing is true, allocate and return a new
- * context if one does not currently exist.  In that event, call
- * add_app_data(data, context) so that app_data and app_data_free can be
- * filled in by the application, and set *addedp to 1.
- * In the 'their_instance' field note that you can also specify a 'meta-
- * instance' value such as OTRL_INSTAG_MASTER, OTRL_INSTAG_RECENT,
- * OTRL_INSTAG_RECENT_RECEIVED and OTRL_INSTAG_RECENT_SENT. */
-ConnContext * otrl_context_find(OtrlUserState us, const char *user,
+/* The initial number of buckets in a userstate's fingerprint table */
+#define FINGERPRINT_TABLE_INITIAL_SIZE 64
+
+/* Hash a fingerprint.  It's a hash already, so any four of its bytes
+ * will do. */
+static unsigned int fingerprint_hash(const unsigned char fingerprint[20])
+{
+    return (unsigned int)fingerprint[0] |
+	((unsigned int)fingerprint[1] << 8) |
+	((unsigned int)fingerprint[2] << 16) |
+	((unsigned int)fingerprint[3] << 24);
+}
+
+/* Link the given fingerprint into the front of its bucket in the
+ * fingerprint table. */
+static void fingerprint_table_link(OtrlUserState us, Fingerprint *f)
+{
+    Fingerprint **bucket = &(us->fingerprint_table[
+	    fingerprint_hash(f->fingerprint) &
+	    (us->fingerprint_table_size - 1)]);
+
+    f->hash_next = *bucket;
+    if (*bucket) {
+	(*bucket)->hash_tous = &(f->hash_next);
+    }
+    *bucket = f;
+    f->hash_tous = bucket;
+}
+
+/* Grow the fingerprint table so that it has at least as many buckets
+ * as fingerprints.  If we can't get the memory, just leave it as it
+ * is; lookups will still work, only with longer chains. */
+static void fingerprint_table_grow(OtrlUserState us)
+{
+    Fingerprint **oldtable = us->fingerprint_table;
+    size_t oldsize = us->fingerprint_table_size;
+    size_t newsize, i;
+
+    if (oldtable && us->fingerprint_table_used < oldsize) return;
+
+    newsize = oldsize ? oldsize * 2 : FINGERPRINT_TABLE_INITIAL_SIZE;
+    us->fingerprint_table = calloc(newsize, sizeof(Fingerprint *));
+    if (us->fingerprint_table == NULL) {
+	assert(oldtable != NULL);
+	us->fingerprint_table = oldtable;
+	return;
+    }
+    us->fingerprint_table_size = newsize;
+
+    for (i = 0; i < oldsize; ++i) {
+	while (oldtable[i]) {
+	    Fingerprint *f = oldtable[i];
+	    oldtable[i] = f->hash_next;
+	    fingerprint_table_link(us, f);
+	}
+    }
+    free(oldtable);
+}
+
+/* Add a fingerprint to a master context that doesn't have it yet, with
+ * the userstate's write lock already held.  The fingerprint's value
+ * goes in the same block as it, just after it. */
+static Fingerprint *fingerprint_add(ConnContext *context,
+	const unsigned char fingerprint[20])
+{
+    OtrlUserState us = context->context_priv->userstate;
+    Fingerprint *f = malloc(sizeof(*f) + 20);
+    assert(f != NULL);
+    f->fingerprint = (unsigned char *)(f + 1);
+    memmove(f->fingerprint, fingerprint, 20);
+    f->context = context;
+    f->trust = NULL;
+    f->changed_next = NULL;
+    f->changed_tous = NULL;
+    f->pubkey = NULL;
+    f->next = context->fingerprint_root.next;
+    if (f->next) {
+	f->next->tous = &(f->next);
+    }
+    context->fingerprint_root.next = f;
+    f->tous = &(context->fingerprint_root.next);
+    ++us->fingerprint_table_used;
+    fingerprint_table_grow(us);
+    fingerprint_table_link(us, f);
+    return f;
+}
+
+/* Give the new master context passed as arg a fingerprint from the
+ * userstate's fingerprint store */
+static void context_fpstore_found(void *arg,
+	const unsigned char fingerprint[20], const char *trust)
+{
+    otrl_context_set_trust(fingerprint_add(arg, fingerprint), trust);
+}
+
+/* Do the work of otrl_context_find, with the userstate's lock already
+ * held (the write lock, if add_if_missing is set).  A new context gets
+ * our_instance as its instance tag (if it's not 0), and is appended to
+ * added[*numaddedp], so that the caller can call add_app_data for it
+ * once the lock is released; at most two contexts are added, a child
+ * first and then its master. */
+static ConnContext *context_find(OtrlUserState us, const char *user,
 	const char *accountname, const char *protocol,
-	otrl_instag_t their_instance, int add_if_missing, int *addedp,
-	void (*add_app_data)(void *data, ConnContext *context), void *data)
+	otrl_instag_t their_instance, int add_if_missing,
+	otrl_instag_t our_instance, ConnContext **added, int *numaddedp)
 {
     ConnContext ** curp;
+    ConnContext *head = NULL;
+    const char *iuser, *iaccountname, *iprotocol;
     int usercmp = 1, acctcmp = 1, protocmp = 1;
-    if (addedp) *addedp = 0;
-    if (!user || !accountname || !protocol) return NULL;
 
-    for (curp = &(us->context_root); *curp; curp = &((*curp)->next)) {
-	if ((usercmp = strcmp((*curp)->username, user)) > 0 ||
+    /* Use the index to jump straight to the contexts for this
+     * username/accountname/protocol.  Only if there are none do we need
+     * to walk the list, to find where to insert the new one.  If any of
+     * the strings has never been interned, there can't be any such
+     * contexts. */
+    iuser = otrl_userstate_intern_find(us, user);
+    iaccountname = otrl_userstate_intern_find(us, accountname);
+    iprotocol = otrl_userstate_intern_find(us, protocol);
+    if (iuser && iaccountname && iprotocol) {
+	user = iuser;
+	accountname = iaccountname;
+	protocol = iprotocol;
+	head = context_index_find(us,
+		context_index_hash(user, accountname, protocol),
+		user, accountname, protocol);
+    }
+    if (head && head->their_instance == OTRL_INSTAG_MASTER &&
+	    their_instance >= OTRL_MIN_VALID_INSTAG) {
+	/* A particular child of this master: look it up among its
+	 * children, or find where it goes in the list after them */
+	unsigned int pos;
+
+	if (context_child_search(head, their_instance, &pos)) {
+	    return head->context_priv->children[pos];
+	}
+	if (!add_if_missing) return NULL;
+	curp = pos > 0 ? &(head->context_priv->children[pos - 1]->next) :
+	    &(head->next);
+    } else if (head) {
+	curp = head->tous;
+    } else if (add_if_missing) {
+	/* Contexts are often added in sorted order, as when reading a
+	 * fingerprint file, so start from the one added last if the new
+	 * one goes after it, rather than from the top of the list. */
+	ConnContext *last = us->context_last_added;
+	if (last && (usercmp = context_strcmp(last->username, user)) <= 0 &&
+		(usercmp < 0 ||
+		(acctcmp = context_strcmp(last->accountname,
+		    accountname)) < 0 ||
+		(acctcmp == 0 &&
+		context_strcmp(last->protocol, protocol) < 0))) {
+	    curp = &(last->next);
+	} else {
+	    curp = &(us->context_root);
+	}
+	usercmp = acctcmp = 1;
+    } else if (us->context_index == NULL && iuser && iaccountname &&
+	    iprotocol) {
+	/* We couldn't get the memory for an index, so look through the
+	 * whole list */
+	curp = &(us->context_root);
+    } else {
+	return NULL;
+    }
+
+    for (; *curp; curp = &((*curp)->next)) {
+	if ((usercmp = context_strcmp((*curp)->username, user)) > 0 ||
 		(usercmp == 0 &&
-		(acctcmp = strcmp((*curp)->accountname, accountname)) > 0) ||
+		(acctcmp = context_strcmp((*curp)->accountname,
+		    accountname)) > 0) ||
 		(usercmp == 0 && acctcmp == 0 &&
-		(protocmp = strcmp((*curp)->protocol, protocol)) > 0) ||
+		(protocmp = context_strcmp((*curp)->protocol,
+		    protocol)) > 0) ||
 		(usercmp == 0 && acctcmp == 0 && protocmp == 0
 		&& (their_instance < OTRL_MIN_VALID_INSTAG ||
 		    ((*curp)->their_instance >= their_instance))))
@@ -287,7 +788,7 @@ ConnContext * otrl_context_find(OtrlUserState us, const char *user,
 	/* We need to go back and check more values in the context */
 	switch(their_instance) {
 	    case OTRL_INSTAG_BEST:
-		return otrl_context_find_recent_secure_instance(*curp);
+		return context_best_instance(*curp);
 	    case OTRL_INSTAG_RECENT:
 	    case OTRL_INSTAG_RECENT_RECEIVED:
 	    case OTRL_INSTAG_RECENT_SENT:
@@ -299,24 +800,30 @@ ConnContext * otrl_context_find(OtrlUserState us, const char *user,
 
     if (add_if_missing) {
 	ConnContext *newctx;
-	OtrlInsTag *our_instag = (OtrlInsTag *)otrl_instag_find(us, accountname,
-		protocol);
 
-	if (addedp) *addedp = 1;
-	newctx = new_context(user, accountname, protocol);
+	newctx = new_context(us, user, accountname, protocol);
 	newctx->next = *curp;
 	if (*curp) {
 	    (*curp)->tous = &(newctx->next);
 	}
 	*curp = newctx;
 	newctx->tous = curp;
-	if (add_app_data) {
-	    add_app_data(data, *curp);
+	newctx->context_priv->userstate = us;
+	if (head == NULL) {
+	    context_index_insert(us, newctx,
+		    context_index_hash(newctx->username, newctx->accountname,
+			newctx->protocol));
+	} else if (newctx->next == head) {
+	    context_index_replace(head, newctx);
+	}
+	added[(*numaddedp)++] = newctx;
+	if (their_instance == OTRL_INSTAG_MASTER) {
+	    us->context_last_added = newctx;
 	}
 
 	/* Initialize specified instance tags */
-	if (our_instag) {
-	    newctx->our_instance = our_instag->instag;
+	if (our_instance) {
+	    newctx->our_instance = our_instance;
 	}
 
 	if (their_instance >= OTRL_MIN_VALID_INSTAG ||
@@ -325,8 +832,14 @@ ConnContext * otrl_context_find(OtrlUserState us, const char *user,
 	}
 
 	if (their_instance >= OTRL_MIN_VALID_INSTAG) {
-	    newctx->m_context = otrl_context_find(us, user, accountname,
-		protocol, OTRL_INSTAG_MASTER, 1, NULL, add_app_data, data);
+	    newctx->m_context = context_find(us, user, accountname,
+		protocol, OTRL_INSTAG_MASTER, 1, our_instance, added,
+		numaddedp);
+	    if (newctx->m_context != newctx &&
+		    newctx->m_context->their_instance == OTRL_INSTAG_MASTER) {
+		context_child_add(newctx);
+	    }
+	    otrl_context_best_changed(newctx);
 	}
 
 	if (their_instance == OTRL_INSTAG_MASTER) {
@@ -337,11 +850,76 @@ ConnContext * otrl_context_find(OtrlUserState us, const char *user,
 	    newctx->recent_sent_child = newctx;
 	}
 
+	/* In the threaded mode, each family has its own mutex */
+	if (us->lock && newctx->m_context == newctx) {
+	    int locknew = otrl_context_priv_lock_new(newctx->context_priv);
+	    assert(locknew == 0);
+	}
+
+	/* A new master picks up its fingerprints from the store */
+	if (us->fpstore && their_instance == OTRL_INSTAG_MASTER) {
+	    otrl_fpstore_lookup(us->fpstore, newctx->username,
+		    newctx->accountname, newctx->protocol,
+		    context_fpstore_found, newctx);
+	}
+
 	return *curp;
     }
     return NULL;
 }
 
+/* Look up a connection context by name/account/protocol/instag from the given
+ * OtrlUserState.  If add_if_missing is true, allocate and return a new
+ * context if one does not currently exist.  In that event, call
+ * add_app_data(data, context) so that app_data and app_data_free can be
+ * filled in by the application, and set *addedp to 1.
+ * In the 'their_instance' field note that you can also specify a 'meta-
+ * instance' value such as OTRL_INSTAG_MASTER, OTRL_INSTAG_RECENT,
+ * OTRL_INSTAG_RECENT_RECEIVED and OTRL_INSTAG_RECENT_SENT.
+ * In the threaded mode, the lookup takes the userstate's read lock, and
+ * only adding a context takes its write lock; add_app_data is called
+ * once the lock has been released. */
+ConnContext * otrl_context_find(OtrlUserState us, const char *user,
+	const char *accountname, const char *protocol,
+	otrl_instag_t their_instance, int add_if_missing, int *addedp,
+	void (*add_app_data)(void *data, ConnContext *context), void *data)
+{
+    ConnContext *context, *added[2];
+    OtrlInsTag *our_instag;
+    otrl_instag_t our_instance = 0;
+    int numadded = 0, i;
+
+    if (addedp) *addedp = 0;
+    if (!user || !accountname || !protocol) return NULL;
+
+    otrl_userstate_rdlock(us);
+    context = context_find(us, user, accountname, protocol,
+	    their_instance, 0, 0, added, &numadded);
+    otrl_userstate_unlock(us);
+    if (context || !add_if_missing) return context;
+
+    /* Not there, so add it.  Someone else may have done so before we
+     * get the write lock, in which case we'll just find theirs. */
+    our_instag = otrl_instag_find(us, accountname, protocol);
+    if (our_instag) {
+	our_instance = our_instag->instag;
+    }
+
+    otrl_userstate_wrlock(us);
+    context = context_find(us, user, accountname, protocol,
+	    their_instance, 1, our_instance, added, &numadded);
+    otrl_userstate_unlock(us);
+
+    if (numadded > 0 && addedp) *addedp = 1;
+    if (add_app_data) {
+	for (i = 0; i < numadded; ++i) {
+	    add_app_data(data, added[i]);
+	}
+    }
+
+    return context;
+}
+
 /* Return true iff the given fingerprint is marked as trusted. */
 int otrl_context_is_fingerprint_trusted(Fingerprint *fprint) {
     return fprint && fprint->trust && fprint->trust[0] != '\0';
@@ -363,52 +941,122 @@ void otrl_context_update_recent_child(ConnContext *context,
 
 }
 
+/* Keep a copy of msg (of length len) in secure memory as the last
+ * message the given context sent, in case it has to be retransmitted,
+ * in place of any copy it had, so long as that's within the limits of
+ * otrl_userstate_set_retransmit_limits.  Return 0 if it was kept, or
+ * -1 if not.  With a timeout, otrl_message_poll is told to come back
+ * and throw the copy away. */
+int otrl_context_keep_lastmessage(ConnContext *context, const char *msg,
+	size_t len)
+{
+    ConnContextPriv *priv = context->context_priv;
+    OtrlUserState us = priv->userstate;
+
+    otrl_context_priv_lastmessage_drop(priv);
+
+    if (us && ((us->retransmit_max_len > 0 &&
+		    len > us->retransmit_max_len) ||
+		(us->retransmit_max_total > 0 &&
+		 otrl_stats_get(us->retransmit_bytes) + len >
+		 us->retransmit_max_total))) {
+	otrl_stats_add(us->stats.retransmits_dropped, 1);
+	return -1;
+    }
+
+    priv->lastmessage = gcry_malloc_secure(len + 1);
+    if (priv->lastmessage == NULL) return -1;
+    memmove(priv->lastmessage, msg, len);
+    priv->lastmessage[len] = '\0';
+
+    if (us) {
+	otrl_stats_add(us->retransmit_bytes, len);
+	if (us->retransmit_timeout > 0) {
+	    otrl_userstate_wrlock(us);
+	    otrl_userstate_deadline_add(us, context,
+		    time(NULL) + us->retransmit_timeout);
+	    otrl_userstate_unlock(us);
+	}
+    }
+    return 0;
+}
+
 /* Find a fingerprint in a given context, perhaps adding it if not
- * present. */
+ * present.  In the threaded mode, this takes the userstate's read lock,
+ * or its write lock if add_if_missing is set. */
 Fingerprint *otrl_context_find_fingerprint(ConnContext *context,
 	unsigned char fingerprint[20], int add_if_missing, int *addedp)
 {
     Fingerprint *f;
+    OtrlUserState us;
     if (addedp) *addedp = 0;
 
     if (!context || !context->m_context) return NULL;
 
     context = context->m_context;
+    us = context->context_priv->userstate;
 
-    f = context->fingerprint_root.next;
-    while(f) {
-	if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
-	f = f->next;
+    if (add_if_missing) {
+	otrl_userstate_wrlock(us);
+    } else {
+	otrl_userstate_rdlock(us);
+    }
+
+    if (us->fingerprint_table) {
+	for (f = us->fingerprint_table[fingerprint_hash(fingerprint) &
+		(us->fingerprint_table_size - 1)]; f; f = f->hash_next) {
+	    if (f->context == context &&
+		    !memcmp(f->fingerprint, fingerprint, 20)) {
+		otrl_userstate_unlock(us);
+		return f;
+	    }
+	}
     }
 
     /* Didn't find it. */
     if (add_if_missing) {
 	if (addedp) *addedp = 1;
-	f = malloc(sizeof(*f));
-	assert(f != NULL);
-	f->fingerprint = malloc(20);
-	assert(f->fingerprint != NULL);
-	memmove(f->fingerprint, fingerprint, 20);
-	f->context = context;
-	f->trust = NULL;
-	f->next = context->fingerprint_root.next;
-	if (f->next) {
-	    f->next->tous = &(f->next);
-	}
-	context->fingerprint_root.next = f;
-	f->tous = &(context->fingerprint_root.next);
+	f = fingerprint_add(context, fingerprint);
+	otrl_userstate_unlock(us);
 	return f;
     }
+    otrl_userstate_unlock(us);
+    return NULL;
+}
+
+/* Return the next of the given OtrlUserState's Fingerprints (after
+ * prev, or the first if prev is NULL) with the given value, or NULL if
+ * there are no more.  In the threaded mode, the caller must hold the
+ * userstate's lock. */
+Fingerprint *otrl_context_fingerprint_next(OtrlUserState us,
+	const unsigned char fingerprint[20], Fingerprint *prev)
+{
+    Fingerprint *f;
+
+    if (prev) {
+	f = prev->hash_next;
+    } else if (us->fingerprint_table) {
+	f = us->fingerprint_table[fingerprint_hash(fingerprint) &
+	    (us->fingerprint_table_size - 1)];
+    } else {
+	return NULL;
+    }
+
+    for (; f; f = f->hash_next) {
+	if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
+    }
     return NULL;
 }
 
-/* Set the trust level for a given fingerprint */
+/* Set the trust level for a given fingerprint.  In the threaded mode,
+ * the caller must hold the userstate's write lock. */
 void otrl_context_set_trust(Fingerprint *fprint, const char *trust)
 {
     if (fprint == NULL) return;
 
     free(fprint->trust);
     fprint->trust = trust ? strdup(trust) : NULL;
+    otrl_context_best_changed(fprint->context);
 }
 
 /* Force a context into the OTRL_MSGSTATE_FINISHED state. */
@@ -422,6 +1070,7 @@ void otrl_context_force_finished(ConnContext *context)
     context->protocol_version = 0;
     otrl_sm_state_free(context->smstate);
     otrl_context_priv_force_finished(context->context_priv);
+    otrl_context_best_changed(context);
 }
 
 /* Force a context into the OTRL_MSGSTATE_PLAINTEXT state. */
@@ -434,48 +1083,76 @@ void otrl_context_force_plaintext(ConnContext *context)
     context->msgstate = OTRL_MSGSTATE_PLAINTEXT;
 }
 
-/* Forget a fingerprint (so long as it's not the active one.  If it's a
- * fingerprint_root, forget the whole context (as long as
- * and_maybe_context is set, and it's PLAINTEXT).  Also, if it's not
- * the fingerprint_root, but it's the only fingerprint, and we're
- * PLAINTEXT, forget the whole context if and_maybe_context is set. */
-void otrl_context_forget_fingerprint(Fingerprint *fprint,
-	int and_maybe_context)
+static int context_forget(ConnContext *context);
+
+/* Forget a fingerprint, as otrl_context_forget_fingerprint does, with
+ * the userstate's write lock already held.  If forget_stored is set,
+ * forget it in the userstate's fingerprint store (if any) too. */
+static void fingerprint_forget(Fingerprint *fprint, int and_maybe_context,
+	int forget_stored)
 {
     ConnContext *context = fprint->context;
+    OtrlUserState us = context->context_priv->userstate;
     if (fprint == &(context->fingerprint_root)) {
 	if (context->msgstate == OTRL_MSGSTATE_PLAINTEXT &&
 		and_maybe_context) {
-	    otrl_context_forget(context);
+	    context_forget(context);
 	}
     } else {
 	if (context->msgstate != OTRL_MSGSTATE_PLAINTEXT ||
 		context->active_fingerprint != fprint) {
 
-	    free(fprint->fingerprint);
+	    if (forget_stored && us->fpstore) {
+		otrl_fpstore_remove(us->fpstore, fprint);
+	    }
 	    free(fprint->trust);
 	    *(fprint->tous) = fprint->next;
 	    if (fprint->next) {
 		fprint->next->tous = fprint->tous;
 	    }
+	    *(fprint->hash_tous) = fprint->hash_next;
+	    if (fprint->hash_next) {
+		fprint->hash_next->hash_tous = fprint->hash_tous;
+	    }
+	    --us->fingerprint_table_used;
+	    otrl_userstate_changed_fingerprint_forget(us, fprint);
+	    otrl_pubkey_cache_forget(us, fprint);
 	    free(fprint);
+	    otrl_context_best_changed(context);
 	    if (context->msgstate == OTRL_MSGSTATE_PLAINTEXT &&
 		    context->fingerprint_root.next == NULL &&
 		    and_maybe_context) {
 		/* We just deleted the only fingerprint.  Forget the
 		 * whole thing. */
-		otrl_context_forget(context);
+		context_forget(context);
 	    }
 	}
     }
 }
 
-/* Forget a whole context, so long as it's PLAINTEXT. If a context has child
- * instances, don't remove this instance unless children are also all in
- * PLAINTEXT state. In this case, the children will also be removed.
- * Returns 0 on success, 1 on failure. */
-int otrl_context_forget(ConnContext *context)
+/* Forget a fingerprint (so long as it's not the active one.  If it's a
+ * fingerprint_root, forget the whole context (as long as
+ * and_maybe_context is set, and it's PLAINTEXT).  Also, if it's not
+ * the fingerprint_root, but it's the only fingerprint, and we're
+ * PLAINTEXT, forget the whole context if and_maybe_context is set. */
+void otrl_context_forget_fingerprint(Fingerprint *fprint,
+	int and_maybe_context)
 {
+    OtrlUserState us = fprint->context->context_priv->userstate;
+
+    otrl_userstate_wrlock(us);
+    fingerprint_forget(fprint, and_maybe_context, 1);
+    otrl_userstate_unlock(us);
+}
+
+/* Forget a whole context, as context_forget does, with its family's
+ * mutex held as well.  The mutex is let go of just before it's freed
+ * with the master context; if the family is kept, or context isn't its
+ * master, the caller still has it. */
+static int context_forget_held(ConnContext *context)
+{
+    OtrlUserState us;
+
     if (context->msgstate != OTRL_MSGSTATE_PLAINTEXT) return 1;
 
     if (context->their_instance == OTRL_INSTAG_MASTER) {
@@ -487,9 +1164,17 @@ int otrl_context_forget(ConnContext *context)
 	    if (c_iter->msgstate != OTRL_MSGSTATE_PLAINTEXT) return 1;
 	}
 
+	/* Forget the indexed children from the end, so that none of
+	 * them has to be moved up, then any the index doesn't know */
+	while (context->context_priv->children_used > 0) {
+	    if (context_forget(context->context_priv->children[
+			context->context_priv->children_used - 1])) {
+		return 1;
+	    }
+	}
 	c_iter = context->next;
 	while (c_iter && c_iter->m_context == context->m_context) {
-	    if (!otrl_context_forget(c_iter)) {
+	    if (!context_forget(c_iter)) {
 		c_iter = context->next;
 	    } else {
 		return 1;
@@ -501,20 +1186,31 @@ int otrl_context_forget(ConnContext *context)
     /* Just to be safe, force to plaintext.  This also frees any
      * extraneous data lying around. */
     otrl_context_force_plaintext(context);
+    otrl_auth_prepared_free(&(context->auth.prepared));
 
     /* First free all the Fingerprints */
     while(context->fingerprint_root.next) {
-	otrl_context_forget_fingerprint(context->fingerprint_root.next, 0);
+	fingerprint_forget(context->fingerprint_root.next, 0, 0);
+    }
+    /* If we're the first context for our username/accountname/protocol,
+     * hand our place in the index to the next one, if any */
+    if (context->context_priv->index_tous) {
+	ConnContext *next = context->next;
+	if (next && (next->username != context->username ||
+		next->accountname != context->accountname ||
+		next->protocol != context->protocol)) {
+	    next = NULL;
+	}
+	context_index_replace(context, next);
     }
+
     /* Now free all the dynamic info here */
-    free(context->username);
-    free(context->accountname);
-    free(context->protocol);
-    free(context->smstate);
+    otrl_userstate_intern_release(context->username);
+    otrl_userstate_intern_release(context->accountname);
+    otrl_userstate_intern_release(context->protocol);
     context->username = NULL;
     context->accountname = NULL;
     context->protocol = NULL;
-    context->smstate = NULL;
 
     /* Free the application data, if it exists */
     if (context->app_data && context->app_data_free) {
@@ -528,20 +1224,186 @@ int otrl_context_forget(ConnContext *context)
 	context->next->tous = context->tous;
     }
 
-    free(context);
+    if (context->m_context == context) {
+	otrl_context_unlock(context);
+    }
+    otrl_context_priv_lock_free(context->context_priv);
+
+    us = context->context_priv->userstate;
+    if (us->context_last_added == context) {
+	us->context_last_added = NULL;
+    }
+    otrl_userstate_deadline_remove(us, context);
+    otrl_userstate_ake_forget(us, context);
+    otrl_userstate_heartbeat_forget(us, context);
+    otrl_userstate_changed_context_forget(us, context);
+    if (context->m_context != context) {
+	context_child_remove(context);
+	otrl_context_best_changed(context);
+    }
+    free(context->context_priv->children);
+    otrl_context_priv_hibernate(context->context_priv);
+    if (context->context_priv->in_slab) {
+	context_slab_release(us, context);
+    } else {
+	free(context->smstate);
+	free(context->context_priv);
+	free(context);
+    }
     return 0;
 }
 
+/* Forget a whole context, as otrl_context_forget does, with the
+ * userstate's write lock already held. */
+static int context_forget(ConnContext *context)
+{
+    ConnContext *m_context = context->m_context;
+    int ret;
+
+    /* Everyone else takes the family's mutex before the userstate's
+     * lock, so we mustn't wait for it here; if another thread is busy
+     * with the family, keep it */
+    if (otrl_context_trylock(m_context)) return 1;
+    ret = context_forget_held(context);
+    if (ret || m_context != context) {
+	otrl_context_unlock(m_context);
+    }
+    return ret;
+}
+
+/* Forget a whole context, so long as it's PLAINTEXT. If a context has child
+ * instances, don't remove this instance unless children are also all in
+ * PLAINTEXT state. In this case, the children will also be removed.
+ * In the threaded mode, the family is also kept if another thread holds
+ * its lock.  Returns 0 on success, 1 on failure. */
+int otrl_context_forget(ConnContext *context)
+{
+    OtrlUserState us = context->context_priv->userstate;
+    int ret;
+
+    otrl_userstate_wrlock(us);
+    ret = context_forget(context);
+    otrl_userstate_unlock(us);
+    return ret;
+}
+
+/* Forget all the contexts of the given accountname and protocol, as
+ * otrl_context_forget would forget each family, walking the contexts
+ * just once under a single write lock.  Families that aren't all
+ * PLAINTEXT, or whose lock another thread holds, are kept. */
+void otrl_context_forget_account(OtrlUserState us, const char *accountname,
+	const char *protocol)
+{
+    ConnContext **cp;
+    char *acct, *proto;
+
+    otrl_userstate_wrlock(us);
+    /* Hold our own references, so the strings can't go away with the
+     * last of the account's contexts */
+    acct = otrl_userstate_intern(us, accountname);
+    proto = otrl_userstate_intern(us, protocol);
+
+    cp = &(us->context_root);
+    while (acct && proto && *cp) {
+	ConnContext *context = *cp;
+
+	if (context->accountname == acct && context->protocol == proto &&
+		context->m_context == context && !context_forget(context)) {
+	    /* *cp is now whatever followed the family */
+	    continue;
+	}
+	cp = &(context->next);
+    }
+
+    otrl_userstate_intern_release(acct);
+    otrl_userstate_intern_release(proto);
+    otrl_userstate_unlock(us);
+}
+
+/* Free a context that otrl_context_forget_all is forgetting along with
+ * all the others, once its secrets have been wiped by forcing it to
+ * plaintext.  It isn't unlinked from the userstate's lists and tables
+ * one by one, as context_forget would, since they're all being emptied
+ * at once.  A context in a slab is freed with the slab. */
+static void context_teardown(OtrlUserState us, ConnContext *context)
+{
+    Fingerprint *fprint, *next;
+
+    otrl_auth_prepared_free(&(context->auth.prepared));
+    otrl_context_priv_hibernate(context->context_priv);
+
+    for (fprint = context->fingerprint_root.next; fprint; fprint = next) {
+	next = fprint->next;
+	otrl_pubkey_cache_forget(us, fprint);
+	free(fprint->trust);
+	free(fprint);
+    }
+
+    otrl_userstate_intern_release(context->username);
+    otrl_userstate_intern_release(context->accountname);
+    otrl_userstate_intern_release(context->protocol);
+
+    if (context->app_data && context->app_data_free) {
+	(context->app_data_free)(context->app_data);
+    }
+
+    otrl_context_priv_lock_free(context->context_priv);
+    free(context->context_priv->children);
+    if (!context->context_priv->in_slab) {
+	free(context->smstate);
+	free(context->context_priv);
+	free(context);
+    }
+}
+
 /* Forget all the contexts in a given OtrlUserState. */
 void otrl_context_forget_all(OtrlUserState us)
 {
-    ConnContext *c_iter;
+    ConnContext *context, *next;
 
-    for (c_iter = us->context_root; c_iter; c_iter = c_iter->next) {
-	otrl_context_force_plaintext(c_iter);
+    otrl_userstate_wrlock(us);
+    for (context = us->context_root; context; context = context->next) {
+	otrl_context_force_plaintext(context);
     }
-
-    while (us->context_root) {
-	otrl_context_forget(us->context_root);
+    for (context = us->context_root; context; context = next) {
+	next = context->next;
+	context_teardown(us, context);
     }
+    us->context_root = NULL;
+    us->context_last_added = NULL;
+    otrl_userstate_contexts_forgotten(us);
+
+    free(us->context_index);
+    us->context_index = NULL;
+    us->context_index_size = 0;
+    us->context_index_used = 0;
+    free(us->fingerprint_table);
+    us->fingerprint_table = NULL;
+    us->fingerprint_table_size = 0;
+    us->fingerprint_table_used = 0;
+
+    context_slab_free_all(us);
+    otrl_userstate_unlock(us);
+}
+
+/* Take the mutex of the given context's family (its master context and
+ * all of the master's children).  This does nothing unless the
+ * userstate is in the threaded mode.  The mutex is recursive. */
+void otrl_context_lock(ConnContext *context)
+{
+    otrl_context_priv_lock(context->m_context->context_priv);
+}
+
+/* Try to take the mutex of the given context's family, without
+ * waiting.  Return 0 if we got it (which we always do outside the
+ * threaded mode), or -1 if another thread holds it. */
+int otrl_context_trylock(ConnContext *context)
+{
+    return otrl_context_priv_trylock(context->m_context->context_priv);
+}
+
+/* Release the mutex of the given context's family. */
+void otrl_context_unlock(ConnContext *context)
+{
+    otrl_context_priv_unlock(context->m_context->context_priv);
 }
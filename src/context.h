@@ -50,14 +50,37 @@ typedef enum {
 typedef struct s_fingerprint {
     struct s_fingerprint *next;        /* The next fingerprint in the list */
     struct s_fingerprint **tous;       /* A pointer to the pointer to us */
-    unsigned char *fingerprint;        /* The fingerprint, or NULL */
+    unsigned char *fingerprint;        /* The fingerprint, or NULL; it's
+					  kept in the same block as us */
     struct context *context;           /* The context to which we belong */
     char *trust;                       /* The trust level of the fingerprint */
+    struct s_fingerprint *hash_next;   /* The next fingerprint in our
+					  bucket of the userstate's
+					  fingerprint table */
+    struct s_fingerprint **hash_tous;  /* A pointer to the pointer to us
+					  there */
+    struct s_fingerprint *changed_next;  /* The next fingerprint in the
+					    userstate's list of changes
+					    held back */
+    struct s_fingerprint **changed_tous;  /* A pointer to the pointer to
+					     us there, or NULL if we
+					     aren't in it */
+    struct s_OtrlPubKey *pubkey;       /* The parsed public key with this
+					  fingerprint, if it's in the
+					  userstate's public key cache,
+					  or NULL */
 } Fingerprint;
 
 struct context {
+    /* The fields looked at for every message, and on every walk of the
+     * context list, come first, so that they share a cache line or
+     * two; the bulky state of the AKE comes last. */
+
     struct context * next;             /* Linked list pointer */
-    struct context ** tous;            /* A pointer to the pointer to us */
+    struct context *m_context;         /* If this is a child context, this
+					  field will point to the master
+					  context. Otherwise it will point to
+					  itself. */
 
     /* Context information that is meant for internal use */
 
@@ -70,10 +93,16 @@ struct context {
 					  this account... */
     char * protocol;                   /* ... and this protocol */
 
-    struct context *m_context;         /* If this is a child context, this
-					  field will point to the master
-					  context. Otherwise it will point to
-					  itself. */
+    otrl_instag_t their_instance;      /* The user's instance tag */
+    OtrlMessageState msgstate;         /* The state of message disposition
+					  with this user */
+    otrl_instag_t our_instance;        /* Our instance tag for this computer*/
+    unsigned int protocol_version;     /* The version of OTR in use */
+
+    Fingerprint *active_fingerprint;   /* Which fingerprint is in use now?
+					  A pointer into the list at
+					  fingerprint_root */
+
     struct context *recent_rcvd_child; /* If this is a master context, this
 					  points to the child context that
 					  has received a message most recently.
@@ -87,28 +116,10 @@ struct context {
 					  the most recent of recent_rcvd_child
 					  and recent_sent_child */
 
-    otrl_instag_t our_instance;        /* Our instance tag for this computer*/
-    otrl_instag_t their_instance;      /* The user's instance tag */
-
-    OtrlMessageState msgstate;         /* The state of message disposition
-					  with this user */
-    OtrlAuthInfo auth;                 /* The state of ongoing
-					  authentication with this user */
-
-    Fingerprint fingerprint_root;      /* The root of a linked list of
-					  Fingerprints entries. This list will
-					  only be populated in master contexts.
-					  For child contexts,
-					  fingerprint_root.next will always
-					  point to NULL. */
-    Fingerprint *active_fingerprint;   /* Which fingerprint is in use now?
-					  A pointer into the above list */
-
-    unsigned char sessionid[20];       /* The sessionid and bold half */
-    size_t sessionid_len;              /* determined when this private */
-    OtrlSessionIdHalf sessionid_half;  /* connection was established. */
+    struct context ** tous;            /* A pointer to the pointer to us */
 
-    unsigned int protocol_version;     /* The version of OTR in use */
+    OtrlSMState *smstate;              /* The state of the current
+					  socialist millionaires exchange */
 
     enum {
 	OFFER_NOT,
@@ -123,8 +134,19 @@ struct context {
     /* A function to free the above data when we forget this context */
     void (*app_data_free)(void *);
 
-    OtrlSMState *smstate;              /* The state of the current
-					  socialist millionaires exchange */
+    unsigned char sessionid[20];       /* The sessionid and bold half */
+    size_t sessionid_len;              /* determined when this private */
+    OtrlSessionIdHalf sessionid_half;  /* connection was established. */
+
+    Fingerprint fingerprint_root;      /* The root of a linked list of
+					  Fingerprints entries. This list will
+					  only be populated in master contexts.
+					  For child contexts,
+					  fingerprint_root.next will always
+					  point to NULL. */
+
+    OtrlAuthInfo auth;                 /* The state of ongoing
+					  authentication with this user */
 };
 
 #include "userstate.h"
@@ -150,14 +172,31 @@ int otrl_context_is_fingerprint_trusted(Fingerprint *fprint);
 void otrl_context_update_recent_child(ConnContext *context,
 	unsigned int sent_msg);
 
+/* Keep a copy of msg (of length len) in secure memory as the last
+ * message the given context sent, in case it has to be retransmitted,
+ * in place of any copy it had, so long as that's within the limits of
+ * otrl_userstate_set_retransmit_limits.  Return 0 if it was kept, or
+ * -1 if not. */
+int otrl_context_keep_lastmessage(ConnContext *context, const char *msg,
+	size_t len);
+
 /* Find a fingerprint in a given context, perhaps adding it if not
  * present. */
 Fingerprint *otrl_context_find_fingerprint(ConnContext *context,
 	unsigned char fingerprint[20], int add_if_missing, int *addedp);
 
-/* Set the trust level for a given fingerprint */
+/* Set the trust level for a given fingerprint.  In the threaded mode,
+ * the caller must hold the userstate's write lock. */
 void otrl_context_set_trust(Fingerprint *fprint, const char *trust);
 
+/* Return the next of the given OtrlUserState's Fingerprints (after
+ * prev, or the first if prev is NULL) with the given value, which will
+ * each belong to a different master context, or NULL if there are no
+ * more.  In the threaded mode, the caller must hold the userstate's
+ * lock. */
+Fingerprint *otrl_context_fingerprint_next(OtrlUserState us,
+	const unsigned char fingerprint[20], Fingerprint *prev);
+
 /* Force a context into the OTRL_MSGSTATE_FINISHED state. */
 void otrl_context_force_finished(ConnContext *context);
 
@@ -175,9 +214,17 @@ void otrl_context_forget_fingerprint(Fingerprint *fprint,
 /* Forget a whole context, so long as it's PLAINTEXT. If a context has child
  * instances, don't remove this instance unless children are also all in
  * PLAINTEXT state. In this case, the children will also be removed.
- * Returns 0 on success, 1 on failure. */
+ * In the threaded mode, the family is also kept if another thread holds
+ * its lock.  Returns 0 on success, 1 on failure. */
 int otrl_context_forget(ConnContext *context);
 
+/* Forget all the contexts of the given accountname and protocol, as
+ * otrl_context_forget would forget each family, walking the contexts
+ * just once under a single write lock.  Families that aren't all
+ * PLAINTEXT, or whose lock another thread holds, are kept. */
+void otrl_context_forget_account(OtrlUserState us, const char *accountname,
+	const char *protocol);
+
 /* Forget all the contexts in a given OtrlUserState. */
 void otrl_context_forget_all(OtrlUserState us);
 
@@ -190,4 +237,24 @@ ConnContext * otrl_context_find_recent_instance(ConnContext * context,
  * in this case is limited to a one-second resolution. */
 ConnContext * otrl_context_find_recent_secure_instance(ConnContext * context);
 
+/* Tell the master of the given context that the context's msgstate,
+ * active fingerprint or lastrecv, or the trust of one of the master's
+ * fingerprints, has changed, so that otrl_context_find works out
+ * OTRL_INSTAG_BEST afresh.  libotr calls this itself; applications
+ * only need to if they change those fields directly. */
+void otrl_context_best_changed(ConnContext *context);
+
+/* Take the mutex of the given context's family (its master context and
+ * all of the master's children).  This does nothing unless the
+ * userstate is in the threaded mode.  The mutex is recursive. */
+void otrl_context_lock(ConnContext *context);
+
+/* Try to take the mutex of the given context's family, without
+ * waiting.  Return 0 if we got it (which we always do outside the
+ * threaded mode), or -1 if another thread holds it. */
+int otrl_context_trylock(ConnContext *context);
+
+/* Release the mutex of the given context's family. */
+void otrl_context_unlock(ConnContext *context);
+
 #endif
@@ -18,15 +18,25 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* libgcrypt headers */
 #include <gcrypt.h>
 
 /* libotr headers */
 #include "context_priv.h"
+#include "stats.h"
+#include "userstate.h"
 
 /* Create a new private connection context */
 ConnContextPriv *otrl_context_priv_new()
@@ -35,51 +45,186 @@ ConnContextPriv *otrl_context_priv_new()
 	context_priv = malloc(sizeof(*context_priv));
 	assert(context_priv != NULL);
 
+	otrl_context_priv_init(context_priv);
+
+	return context_priv;
+}
+
+/* Initialize the fields of a private connection context (already
+ * allocated). */
+void otrl_context_priv_init(ConnContextPriv *context_priv)
+{
 	context_priv->fragment = NULL;
 	context_priv->fragment_len = 0;
+	context_priv->fragment_size = 0;
 	context_priv->fragment_n = 0;
 	context_priv->fragment_k = 0;
+	context_priv->fragment_inorder = 0;
+	context_priv->fragment_seen = NULL;
+	context_priv->fragment_pieces = NULL;
+	context_priv->fragment_time = 0;
 	context_priv->numsavedkeys = 0;
 	context_priv->saved_mac_keys = NULL;
+	context_priv->savedkeys_size = 0;
 	context_priv->generation = 0;
 	context_priv->lastsent = 0;
 	context_priv->lastmessage = NULL;
 	context_priv->lastrecv = 0;
 	context_priv->may_retransmit = 0;
+	context_priv->convert_buf = NULL;
+	context_priv->convert_buf_size = 0;
+	context_priv->convert_never = 0;
+	context_priv->userstate = NULL;
+	context_priv->in_slab = 0;
+	context_priv->index_hash = 0;
+	context_priv->index_next = NULL;
+	context_priv->index_tous = NULL;
+	context_priv->deadline_index = 0;
+	context_priv->children = NULL;
+	context_priv->children_used = 0;
+	context_priv->children_size = 0;
+	context_priv->best_instance = NULL;
+	context_priv->heartbeat_next = NULL;
+	context_priv->heartbeat_tous = NULL;
+	context_priv->heartbeat_when = 0;
+	context_priv->changed_next = NULL;
+	context_priv->changed_tous = NULL;
+	context_priv->account = NULL;
+	context_priv->family_lock = NULL;
+	context_priv->offload_head = NULL;
+	context_priv->offload_tail = NULL;
+	context_priv->offload_busy = 0;
 	context_priv->their_keyid = 0;
 	context_priv->their_y = NULL;
 	context_priv->their_old_y = NULL;
 	context_priv->our_keyid = 0;
-	context_priv->our_dh_key.groupid = 0;
-	context_priv->our_dh_key.priv = NULL;
-	context_priv->our_dh_key.pub = NULL;
-	context_priv->our_old_dh_key.groupid = 0;
-	context_priv->our_old_dh_key.priv = NULL;
-	context_priv->our_old_dh_key.pub = NULL;
-	otrl_dh_session_blank(&(context_priv->sesskeys[0][0]));
-	otrl_dh_session_blank(&(context_priv->sesskeys[0][1]));
-	otrl_dh_session_blank(&(context_priv->sesskeys[1][0]));
-	otrl_dh_session_blank(&(context_priv->sesskeys[1][1]));
-
-	return context_priv;
+	otrl_dh_keypair_init(&(context_priv->our_dh_key));
+	otrl_dh_keypair_init(&(context_priv->our_old_dh_key));
+	context_priv->sesskeys = NULL;
 }
 
-/* Resets the appropriate variables when a context
- * is being force finished
- */
-void otrl_context_priv_force_finished(ConnContextPriv *context_priv)
+/* Throw away any partly-received fragmented message. */
+void otrl_context_priv_fragment_clear(ConnContextPriv *context_priv)
 {
 	free(context_priv->fragment);
 	context_priv->fragment = NULL;
 	context_priv->fragment_len = 0;
+	context_priv->fragment_size = 0;
 	context_priv->fragment_n = 0;
 	context_priv->fragment_k = 0;
+	context_priv->fragment_inorder = 0;
+	free(context_priv->fragment_seen);
+	context_priv->fragment_seen = NULL;
+	free(context_priv->fragment_pieces);
+	context_priv->fragment_pieces = NULL;
+	context_priv->fragment_time = 0;
+}
+
+/* Throw away any partly-received fragmented message, counting its
+ * fragments as dropped in our userstate's statistics. */
+void otrl_context_priv_fragment_drop(ConnContextPriv *context_priv)
+{
+	otrl_stats_us_add(context_priv->userstate, fragments_dropped,
+		context_priv->fragment_k);
+	otrl_context_priv_fragment_clear(context_priv);
+}
+
+#ifdef HAVE_PTHREAD_H
+struct s_OtrlContextLock {
+	pthread_mutex_t mutex;	/* Recursive, so callbacks can re-enter */
+};
+#endif
+
+/* Give a master context's private part a family mutex.  Return 0 on
+ * success, or -1 if out of memory or without thread support. */
+int otrl_context_priv_lock_new(ConnContextPriv *context_priv)
+{
+#ifdef HAVE_PTHREAD_H
+	struct s_OtrlContextLock *lock;
+	pthread_mutexattr_t attr;
+	int err;
+
+	if (context_priv->family_lock) return 0;
+
+	lock = malloc(sizeof(*lock));
+	if (lock == NULL) return -1;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	err = pthread_mutex_init(&(lock->mutex), &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err) {
+		free(lock);
+		return -1;
+	}
+
+	context_priv->family_lock = lock;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/* Free a private part's family mutex, if it has one. */
+void otrl_context_priv_lock_free(ConnContextPriv *context_priv)
+{
+#ifdef HAVE_PTHREAD_H
+	if (context_priv->family_lock == NULL) return;
+
+	pthread_mutex_destroy(&(context_priv->family_lock->mutex));
+	free(context_priv->family_lock);
+	context_priv->family_lock = NULL;
+#endif
+}
+
+/* Lock a master context's family mutex, if it has one. */
+void otrl_context_priv_lock(ConnContextPriv *context_priv)
+{
+#ifdef HAVE_PTHREAD_H
+	if (context_priv->family_lock) {
+		pthread_mutex_lock(&(context_priv->family_lock->mutex));
+	}
+#endif
+}
+
+/* Try to lock a master context's family mutex, without waiting.
+ * Return 0 if we got it (or there is none). */
+int otrl_context_priv_trylock(ConnContextPriv *context_priv)
+{
+#ifdef HAVE_PTHREAD_H
+	if (context_priv->family_lock) {
+		return pthread_mutex_trylock(
+			&(context_priv->family_lock->mutex)) ? -1 : 0;
+	}
+#endif
+	return 0;
+}
+
+/* Unlock a master context's family mutex, if it has one. */
+void otrl_context_priv_unlock(ConnContextPriv *context_priv)
+{
+#ifdef HAVE_PTHREAD_H
+	if (context_priv->family_lock) {
+		pthread_mutex_unlock(&(context_priv->family_lock->mutex));
+	}
+#endif
+}
+
+/* Resets the appropriate variables when a context
+ * is being force finished
+ */
+void otrl_context_priv_force_finished(ConnContextPriv *context_priv)
+{
+	otrl_context_priv_fragment_clear(context_priv);
 	context_priv->numsavedkeys = 0;
 	free(context_priv->saved_mac_keys);
 	context_priv->saved_mac_keys = NULL;
-	gcry_free(context_priv->lastmessage);
-	context_priv->lastmessage = NULL;
-	context_priv->may_retransmit = 0;
+	context_priv->savedkeys_size = 0;
+	otrl_context_priv_lastmessage_drop(context_priv);
+	free(context_priv->convert_buf);
+	context_priv->convert_buf = NULL;
+	context_priv->convert_buf_size = 0;
+	context_priv->convert_never = 0;
 	context_priv->their_keyid = 0;
 	gcry_mpi_release(context_priv->their_y);
 	context_priv->their_y = NULL;
@@ -88,8 +233,59 @@ void otrl_context_priv_force_finished(ConnContextPriv *context_priv)
 	context_priv->our_keyid = 0;
 	otrl_dh_keypair_free(&(context_priv->our_dh_key));
 	otrl_dh_keypair_free(&(context_priv->our_old_dh_key));
+	if (context_priv->sesskeys) {
+		otrl_dh_session_free(&(context_priv->sesskeys[0][0]));
+		otrl_dh_session_free(&(context_priv->sesskeys[0][1]));
+		otrl_dh_session_free(&(context_priv->sesskeys[1][0]));
+		otrl_dh_session_free(&(context_priv->sesskeys[1][1]));
+	}
+}
+
+/* Throw away the copy of the last message sent, if there is one,
+ * taking it off its userstate's count of such copies. */
+void otrl_context_priv_lastmessage_drop(ConnContextPriv *context_priv)
+{
+	if (context_priv->lastmessage) {
+		if (context_priv->userstate) {
+			otrl_stats_add(context_priv->userstate->retransmit_bytes,
+				(size_t)0 - strlen(context_priv->lastmessage));
+		}
+		gcry_free(context_priv->lastmessage);
+		context_priv->lastmessage = NULL;
+	}
+	context_priv->may_retransmit = 0;
+}
+
+/* Make sure a private connection context has its session keys,
+ * allocating them (blank) if it is new or hibernating.  Return 0 on
+ * success, or -1 if out of memory. */
+int otrl_context_priv_wake(ConnContextPriv *context_priv)
+{
+	DH_sesskeys (*sesskeys)[2];
+
+	if (context_priv->sesskeys) return 0;
+
+	sesskeys = malloc(2 * sizeof(*sesskeys));
+	if (sesskeys == NULL) return -1;
+	otrl_dh_session_blank(&(sesskeys[0][0]));
+	otrl_dh_session_blank(&(sesskeys[0][1]));
+	otrl_dh_session_blank(&(sesskeys[1][0]));
+	otrl_dh_session_blank(&(sesskeys[1][1]));
+	context_priv->sesskeys = sesskeys;
+	return 0;
+}
+
+/* Free the session keys of a private connection context, leaving it
+ * hibernating until otrl_context_priv_wake is next called.  Its
+ * context must not be encrypted. */
+void otrl_context_priv_hibernate(ConnContextPriv *context_priv)
+{
+	if (context_priv->sesskeys == NULL) return;
+
 	otrl_dh_session_free(&(context_priv->sesskeys[0][0]));
 	otrl_dh_session_free(&(context_priv->sesskeys[0][1]));
 	otrl_dh_session_free(&(context_priv->sesskeys[1][0]));
 	otrl_dh_session_free(&(context_priv->sesskeys[1][1]));
+	free(context_priv->sesskeys);
+	context_priv->sesskeys = NULL;
 }
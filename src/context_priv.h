@@ -27,19 +27,47 @@
 #include "auth.h"
 #include "sm.h"
 
+struct context;
+struct s_OtrlUserState;
+
+/* Where one fragment of a fragmented message was put */
+typedef struct s_OtrlFragmentPiece {
+	unsigned short k;	/* Which fragment this is (from 1) */
+	size_t offset;		/* Where its data starts in fragment */
+	size_t len;		/* How long its data is */
+} OtrlFragmentPiece;
+
 typedef struct context_priv {
-	/* The part of the fragmented message we've seen so far */
+	/* The parts of the fragmented message we've seen so far, in the
+	 * order they arrived */
 	char *fragment;
 
 	/* The length of fragment */
 	size_t fragment_len;
 
+	/* The number of bytes allocated for fragment */
+	size_t fragment_size;
+
 	/* The total number of fragments in this message */
 	unsigned short fragment_n;
 
-	/* The highest fragment number we've seen so far for this message */
+	/* The number of different fragments we've seen so far for this
+	 * message */
 	unsigned short fragment_k;
 
+	/* Did those fragments arrive in order, so that fragment already
+	 * holds them in the right order? */
+	int fragment_inorder;
+
+	/* Bit k-1 is set once fragment k of this message has arrived */
+	unsigned char *fragment_seen;
+
+	/* The fragments that have arrived, in the order they arrived */
+	OtrlFragmentPiece *fragment_pieces;
+
+	/* When the first fragment of this message to arrive did */
+	time_t fragment_time;
+
 	/* current keyid used by other side; this is set to 0 if we get
 	 * a OTRL_TLV_DISCONNECTED message from them. */
 	unsigned int their_keyid;
@@ -60,12 +88,18 @@ typedef struct context_priv {
 	DH_keypair our_old_dh_key;
 
 	/* sesskeys[i][j] are the session keys derived from DH
-	 * key[our_keyid-i] and mpi Y[their_keyid-j] */
-	DH_sesskeys sesskeys[2][2];
-
-	/* saved mac keys to be revealed later */
+	 * key[our_keyid-i] and mpi Y[their_keyid-j].  They are allocated
+	 * when first needed (see otrl_context_priv_wake), and sesskeys is
+	 * NULL until then, or once otrl_message_poll has put an idle
+	 * context into hibernation. */
+	DH_sesskeys (*sesskeys)[2];
+
+	/* saved mac keys to be revealed later, and how many there is
+	 * room for in saved_mac_keys; it's kept from one reveal to the
+	 * next, and only grows */
 	unsigned int numsavedkeys;
 	unsigned char *saved_mac_keys;
+	unsigned int savedkeys_size;
 
 	/* generation number: increment every time we go private, and never
 	 * reset to 0 (unless we remove the context entirely) */
@@ -83,12 +117,122 @@ typedef struct context_priv {
 	/* Is the last message eligible for retransmission? */
 	int may_retransmit;
 
+	/* The buffer messages we send are converted in, when the
+	 * userstate has a convert_inplace callback, and its size */
+	char *convert_buf;
+	size_t convert_buf_size;
+
+	/* Has convert_inplace said none of our messages need
+	 * converting? */
+	int convert_never;
+
+	/* The OtrlUserState whose context list we are in */
+	struct s_OtrlUserState *userstate;
+
+	/* Were we (together with our context and its SM state) allocated
+	 * from one of the userstate's slabs? */
+	int in_slab;
+
+	/* If we are the first context in the list for our
+	 * username/accountname/protocol, we are also linked into the
+	 * userstate's context index through these fields.  Otherwise,
+	 * index_tous is NULL. */
+	unsigned int index_hash;
+	struct context *index_next;
+	struct context **index_tous;
+
+	/* Our place in the userstate's deadline heap, plus 1, or 0 if we
+	 * aren't in it */
+	size_t deadline_index;
+
+	/* If we are a master context, our children, sorted by
+	 * their_instance, so that one can be found without walking the
+	 * context list */
+	struct context **children;
+	unsigned int children_used;
+	unsigned int children_size;
+
+	/* If we are a master context, the instance of our family that
+	 * OTRL_INSTAG_BEST last found, or NULL if it has to be worked out
+	 * again (see otrl_context_best_changed) */
+	struct context *best_instance;
+
+	/* Our place in the userstate's queue of heartbeats to be sent
+	 * from otrl_message_poll, and when ours is due; heartbeat_tous is
+	 * NULL if we aren't in it */
+	struct context *heartbeat_next;
+	struct context **heartbeat_tous;
+	time_t heartbeat_when;
+
+	/* Our place in the userstate's list of contexts whose changes
+	 * are being held back for otrl_message_poll to tell the
+	 * application about; changed_tous is NULL if we aren't in it */
+	struct context *changed_next;
+	struct context **changed_tous;
+
+	/* If we are a master context, the entry in the userstate's account
+	 * table for our accountname/protocol, once our privkey has been
+	 * looked up; else NULL */
+	struct s_OtrlAccount *account;
+
+	/* If we are a master context and the userstate is in the threaded
+	 * mode, the mutex shared by us and our children; else NULL */
+	struct s_OtrlContextLock *family_lock;
+
+	/* If we are a master context, the messages for our family that
+	 * otrl_message_receiving_offload and otrl_message_receiving_start
+	 * have queued to be handled later, and whether a thread is
+	 * already handling them.  These are protected by the userstate's
+	 * offload lock if it has one, or else by our family lock. */
+	struct s_OtrlReceiveJob *offload_head;
+	struct s_OtrlReceiveJob *offload_tail;
+	int offload_busy;
+
 } ConnContextPriv;
 
 /* Create a new private connection context. */
 ConnContextPriv *otrl_context_priv_new();
 
+/* Initialize the fields of a private connection context (already
+ * allocated). */
+void otrl_context_priv_init(ConnContextPriv *context_priv);
+
+/* Throw away any partly-received fragmented message. */
+void otrl_context_priv_fragment_clear(ConnContextPriv *context_priv);
+
+/* Throw away any partly-received fragmented message, counting its
+ * fragments as dropped in our userstate's statistics. */
+void otrl_context_priv_fragment_drop(ConnContextPriv *context_priv);
+
+/* Give a master context's private part a family mutex.  Return 0 on
+ * success, or -1 if out of memory or without thread support. */
+int otrl_context_priv_lock_new(ConnContextPriv *context_priv);
+
+/* Free a private part's family mutex, if it has one. */
+void otrl_context_priv_lock_free(ConnContextPriv *context_priv);
+
+/* Lock, try to lock, or unlock a master context's family mutex.  These
+ * do nothing (and the trylock succeeds) if there is no mutex.  The
+ * trylock returns 0 if it got the lock. */
+void otrl_context_priv_lock(ConnContextPriv *context_priv);
+int otrl_context_priv_trylock(ConnContextPriv *context_priv);
+void otrl_context_priv_unlock(ConnContextPriv *context_priv);
+
 /* Frees up memory that was used in otrl_context_priv_new */
 void otrl_context_priv_force_finished(ConnContextPriv *context_priv);
 
+/* Throw away the copy of the last message sent, if there is one,
+ * taking it off its userstate's count of such copies. */
+void otrl_context_priv_lastmessage_drop(ConnContextPriv *context_priv);
+
+/* Make sure a private connection context has its session keys,
+ * allocating them (blank) if it is new or hibernating.  Return 0 on
+ * success, or -1 if out of memory. */
+int otrl_context_priv_wake(ConnContextPriv *context_priv);
+
+/* Free the session keys of a private connection context, leaving it
+ * hibernating until otrl_context_priv_wake is next called.  Its
+ * context must not be encrypted. */
+void otrl_context_priv_hibernate(ConnContextPriv *context_priv);
+
 #endif
@@ -19,14 +19,24 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* libgcrypt headers */
 #include <gcrypt.h>
 
 /* libotr headers */
 #include "dh.h"
+#include "mem.h"
+#include "stats.h"
 
 
 static const char* DH1536_MODULUS_S = "0x"
@@ -46,6 +56,114 @@ static gcry_mpi_t DH1536_MODULUS = NULL;
 static gcry_mpi_t DH1536_MODULUS_MINUS_2 = NULL;
 static gcry_mpi_t DH1536_GENERATOR = NULL;
 
+/* Fixed-base exponentiation of the generator.  Our private keys are
+ * DH1536_PRIV_LEN_BYTES long; split them into DH1536_TABLE_WINDOWS
+ * windows of DH1536_TABLE_WINDOW_BITS bits each, and keep a table of
+ * g^(d * 2^(DH1536_TABLE_WINDOW_BITS * i)) for each window i and digit
+ * d.  Then g^x is just one modular multiplication per window, with no
+ * squarings.  Table entries are stored as big-endian byte strings of
+ * DH1536_MOD_LEN_BYTES so that they can be selected without
+ * secret-dependent memory accesses. */
+#define DH1536_PRIV_LEN_BYTES 40
+#define DH1536_TABLE_WINDOW_BITS 4
+#define DH1536_TABLE_DIGITS (1 << DH1536_TABLE_WINDOW_BITS)
+#define DH1536_TABLE_WINDOWS \
+    (DH1536_PRIV_LEN_BYTES * 8 / DH1536_TABLE_WINDOW_BITS)
+
+static unsigned char *DH1536_GENERATOR_TABLE = NULL;
+
+/* The process-wide counters otrl_userstate_stats reports */
+unsigned long otrl_stats_dh_keygens = 0;
+unsigned long otrl_stats_modexps = 0;
+
+/*
+ * Build the fixed-base table for DH1536_GENERATOR.  If we can't get the
+ * memory, leave DH1536_GENERATOR_TABLE NULL and fall back to
+ * gcry_mpi_powm.
+ */
+static void dh_build_generator_table(void)
+{
+    const size_t entrylen = DH1536_MOD_LEN_BYTES;
+    unsigned char *table, *entry;
+    gcry_mpi_t base, power;
+    size_t written;
+    int i, d;
+
+    table = malloc(DH1536_TABLE_WINDOWS * DH1536_TABLE_DIGITS * entrylen);
+    if (table == NULL) return;
+
+    base = gcry_mpi_copy(DH1536_GENERATOR);
+    power = gcry_mpi_new(DH1536_MOD_LEN_BITS);
+    entry = table;
+    for (i = 0; i < DH1536_TABLE_WINDOWS; ++i) {
+	/* base = g^(2^(DH1536_TABLE_WINDOW_BITS * i)) */
+	gcry_mpi_set_ui(power, 1);
+	for (d = 0; d < DH1536_TABLE_DIGITS; ++d) {
+	    memset(entry, 0, entrylen);
+	    gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &written, power);
+	    gcry_mpi_print(GCRYMPI_FMT_USG, entry + entrylen - written,
+		    written, NULL, power);
+	    entry += entrylen;
+	    gcry_mpi_mulm(power, power, base, DH1536_MODULUS);
+	}
+	for (d = 0; d < DH1536_TABLE_WINDOW_BITS; ++d) {
+	    gcry_mpi_mulm(base, base, base, DH1536_MODULUS);
+	}
+    }
+    gcry_mpi_release(base);
+    gcry_mpi_release(power);
+
+    DH1536_GENERATOR_TABLE = table;
+}
+
+/*
+ * Compute g^x mod p using the fixed-base table, where x is the
+ * DH1536_PRIV_LEN_BYTES-byte big-endian value in secbuf.  Every table
+ * entry of every window is read, and one multiplication is done per
+ * window, whatever the digits of x are.  Return 0 on success, or -1,
+ * leaving result alone, if there's no secure memory to select the
+ * entries in.
+ */
+static int dh_generator_powm(gcry_mpi_t result, const unsigned char *secbuf)
+{
+    const size_t entrylen = DH1536_MOD_LEN_BYTES;
+    unsigned char *selected;
+    const unsigned char *entry = DH1536_GENERATOR_TABLE;
+    gcry_mpi_t factor;
+    int i, d;
+    size_t j;
+
+    selected = gcry_malloc_secure(entrylen);
+    if (!selected) return -1;
+
+    gcry_mpi_set_ui(result, 1);
+    for (i = 0; i < DH1536_TABLE_WINDOWS; ++i) {
+	unsigned int bit = i * DH1536_TABLE_WINDOW_BITS;
+	unsigned int digit = (secbuf[DH1536_PRIV_LEN_BYTES - 1 - bit / 8]
+		>> (bit % 8)) & (DH1536_TABLE_DIGITS - 1);
+
+	memset(selected, 0, entrylen);
+	for (d = 0; d < DH1536_TABLE_DIGITS; ++d) {
+	    /* 0xff if d == digit, 0x00 otherwise, without a branch */
+	    unsigned char mask =
+		(unsigned char)((((unsigned int)d ^ digit) - 1) >> 8);
+	    for (j = 0; j < entrylen; ++j) {
+		selected[j] |= entry[j] & mask;
+	    }
+	    entry += entrylen;
+	}
+
+	factor = NULL;
+	gcry_mpi_scan(&factor, GCRYMPI_FMT_USG, selected, entrylen, NULL);
+	gcry_mpi_mulm(result, result, factor, DH1536_MODULUS);
+	gcry_mpi_release(factor);
+    }
+
+    otrl_mem_wipe(selected, entrylen);
+    gcry_free(selected);
+    return 0;
+}
+
 /*
  * Call this once, at plugin load time.  It sets up the modulus and
  * generator MPIs.
@@ -58,6 +176,7 @@ void otrl_dh_init(void)
 	(const unsigned char *)DH1536_GENERATOR_S, 0, NULL);
     DH1536_MODULUS_MINUS_2 = gcry_mpi_new(DH1536_MOD_LEN_BITS);
     gcry_mpi_sub_ui(DH1536_MODULUS_MINUS_2, DH1536_MODULUS, 2);
+    dh_build_generator_table();
 }
 
 /*
@@ -68,6 +187,8 @@ void otrl_dh_keypair_init(DH_keypair *kp)
     kp->groupid = 0;
     kp->priv = NULL;
     kp->pub = NULL;
+    kp->pubwire = NULL;
+    kp->pubwirelen = 0;
 }
 
 /*
@@ -78,6 +199,15 @@ void otrl_dh_keypair_copy(DH_keypair *dst, const DH_keypair *src)
     dst->groupid = src->groupid;
     dst->priv = gcry_mpi_copy(src->priv);
     dst->pub = gcry_mpi_copy(src->pub);
+    dst->pubwire = NULL;
+    dst->pubwirelen = 0;
+    if (src->pubwire) {
+	dst->pubwire = malloc(src->pubwirelen);
+	if (dst->pubwire) {
+	    memmove(dst->pubwire, src->pubwire, src->pubwirelen);
+	    dst->pubwirelen = src->pubwirelen;
+	}
+    }
 }
 
 /*
@@ -88,8 +218,11 @@ void otrl_dh_keypair_free(DH_keypair *kp)
 {
     gcry_mpi_release(kp->priv);
     gcry_mpi_release(kp->pub);
+    free(kp->pubwire);
     kp->priv = NULL;
     kp->pub = NULL;
+    kp->pubwire = NULL;
+    kp->pubwirelen = 0;
 }
 
 /*
@@ -106,23 +239,200 @@ gcry_error_t otrl_dh_gen_keypair(unsigned int groupid, DH_keypair *kp)
     }
 
     /* Generate the secret key: a random 320-bit value */
-    secbuf = gcry_random_bytes_secure(40, GCRY_STRONG_RANDOM);
-    gcry_mpi_scan(&privkey, GCRYMPI_FMT_USG, secbuf, 40, NULL);
-    gcry_free(secbuf);
+    secbuf = gcry_random_bytes_secure(DH1536_PRIV_LEN_BYTES,
+	    GCRY_STRONG_RANDOM);
+    gcry_mpi_scan(&privkey, GCRYMPI_FMT_USG, secbuf, DH1536_PRIV_LEN_BYTES,
+	    NULL);
 
     kp->groupid = groupid;
     kp->priv = privkey;
     kp->pub = gcry_mpi_new(DH1536_MOD_LEN_BITS);
-    gcry_mpi_powm(kp->pub, DH1536_GENERATOR, privkey, DH1536_MODULUS);
+    otrl_stats_add(otrl_stats_dh_keygens, 1);
+    otrl_stats_add(otrl_stats_modexps, 1);
+    if (!DH1536_GENERATOR_TABLE || dh_generator_powm(kp->pub, secbuf)) {
+	gcry_mpi_powm(kp->pub, DH1536_GENERATOR, privkey, DH1536_MODULUS);
+    }
+    gcry_free(secbuf);
+
+    /* Serialize the public key now, while we're off the critical path;
+     * if we can't, otrl_dh_keypair_pubwire will try again later. */
+    kp->pubwire = NULL;
+    kp->pubwirelen = 0;
+    otrl_dh_keypair_pubwire(kp, NULL);
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
 /*
- * Construct session keys from a DH keypair and someone else's public
- * key.
+ * Return the public key of a DH keypair as it's sent: a 4-byte length,
+ * then the bytes of the key.  Put its length (those 4 bytes included)
+ * into *lenp.  This is worked out when the keypair is generated, or
+ * the first time it's asked for if pub was set some other way.  Return
+ * NULL if out of memory.
  */
-gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
-	gcry_mpi_t y)
+const unsigned char *otrl_dh_keypair_pubwire(DH_keypair *kp, size_t *lenp)
+{
+    if (kp->pubwire == NULL) {
+	size_t npub;
+	unsigned char *wire;
+
+	gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &npub, kp->pub);
+	wire = malloc(4 + npub);
+	if (wire == NULL) return NULL;
+	wire[0] = (npub >> 24) & 0xff;
+	wire[1] = (npub >> 16) & 0xff;
+	wire[2] = (npub >> 8) & 0xff;
+	wire[3] = npub & 0xff;
+	gcry_mpi_print(GCRYMPI_FMT_USG, wire + 4, npub, NULL, kp->pub);
+	kp->pubwire = wire;
+	kp->pubwirelen = 4 + npub;
+    }
+    if (lenp) *lenp = kp->pubwirelen;
+    return kp->pubwire;
+}
+
+struct s_DH_keypool {
+    DH_keypair *keys;          /* The keypairs ready to be used */
+    unsigned int size;         /* How many there is room for */
+    unsigned int count;        /* How many there are */
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t mutex;     /* Protects keys and count */
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+#define keypool_lock(p) pthread_mutex_lock(&((p)->mutex))
+#define keypool_unlock(p) pthread_mutex_unlock(&((p)->mutex))
+#else
+#define keypool_lock(p)
+#define keypool_unlock(p)
+#endif
+
+/*
+ * Create an empty pool that will hold up to size pre-generated DH1536
+ * keypairs.  Return NULL if out of memory.
+ */
+DH_keypool *otrl_dh_keypool_new(unsigned int size)
+{
+    DH_keypool *pool = malloc(sizeof(DH_keypool));
+    if (pool == NULL) return NULL;
+
+    pool->keys = malloc(size * sizeof(DH_keypair));
+    if (pool->keys == NULL && size > 0) {
+	free(pool);
+	return NULL;
+    }
+    pool->size = size;
+    pool->count = 0;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&(pool->mutex), NULL);
+#endif
+    return pool;
+}
+
+/*
+ * Free a DH keypool and any keypairs still in it.
+ */
+void otrl_dh_keypool_free(DH_keypool *pool)
+{
+    if (pool == NULL) return;
+
+    while (pool->count > 0) {
+	otrl_dh_keypair_free(&(pool->keys[--pool->count]));
+    }
+    free(pool->keys);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&(pool->mutex));
+#endif
+    free(pool);
+}
+
+/*
+ * Generate up to max keypairs (but no more than the pool has room for)
+ * and add them to the pool.  This may be called from a thread other
+ * than the one that takes keys out of the pool.  Return the number of
+ * keypairs added.
+ */
+unsigned int otrl_dh_keypool_refill(DH_keypool *pool, unsigned int max)
+{
+    unsigned int added = 0;
+
+    if (pool == NULL) return 0;
+
+    while (added < max) {
+	DH_keypair kp;
+	int full;
+
+	keypool_lock(pool);
+	full = (pool->count >= pool->size);
+	keypool_unlock(pool);
+	if (full) break;
+
+	/* Don't hold the lock during the exponentiation */
+	otrl_dh_keypair_init(&kp);
+	if (otrl_dh_gen_keypair(DH1536_GROUP_ID, &kp)) break;
+
+	keypool_lock(pool);
+	if (pool->count < pool->size) {
+	    pool->keys[pool->count++] = kp;
+	    full = 0;
+	} else {
+	    full = 1;
+	}
+	keypool_unlock(pool);
+	if (full) {
+	    otrl_dh_keypair_free(&kp);
+	    break;
+	}
+	++added;
+    }
+    return added;
+}
+
+/*
+ * Return the number of keypairs currently in the pool.
+ */
+unsigned int otrl_dh_keypool_count(DH_keypool *pool)
+{
+    unsigned int count;
+
+    if (pool == NULL) return 0;
+
+    keypool_lock(pool);
+    count = pool->count;
+    keypool_unlock(pool);
+    return count;
+}
+
+/*
+ * Generate a DH keypair for a specified group, taking a pre-generated
+ * one from the pool if there is one.  pool may be NULL, in which case
+ * (as when it's empty) the keypair is generated on the spot.
+ */
+gcry_error_t otrl_dh_gen_keypair_pooled(DH_keypool *pool,
+	unsigned int groupid, DH_keypair *kp)
+{
+    if (pool && groupid == DH1536_GROUP_ID) {
+	int found = 0;
+
+	keypool_lock(pool);
+	if (pool->count > 0) {
+	    *kp = pool->keys[--pool->count];
+	    found = 1;
+	}
+	keypool_unlock(pool);
+	if (found) return gcry_error(GPG_ERR_NO_ERROR);
+    }
+
+    return otrl_dh_gen_keypair(groupid, kp);
+}
+
+/*
+ * Derive the session keys into sess, whose key material must already be
+ * blank.  Any cipher and MAC handles sess already has are re-keyed;
+ * missing ones are opened.
+ */
+static gcry_error_t dh_session_derive(DH_sesskeys *sess,
+	const DH_keypair *kp, gcry_mpi_t y)
 {
     gcry_mpi_t gab;
     size_t gablen;
@@ -131,8 +441,6 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
     unsigned char sendbyte, rcvbyte;
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
 
-    otrl_dh_session_blank(sess);
-
     if (kp->groupid != DH1536_GROUP_ID) {
 	/* Invalid group id */
 	return gcry_error(GPG_ERR_INV_VALUE);
@@ -140,7 +448,7 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
 
     /* Calculate the shared secret MPI */
     gab = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
-    gcry_mpi_powm(gab, y, kp->priv, DH1536_MODULUS);
+    otrl_powm(gab, y, kp->priv, DH1536_MODULUS);
 
     /* Output it in the right format */
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &gablen, gab);
@@ -174,33 +482,41 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
     /* Calculate the sending encryption key */
     gabdata[0] = sendbyte;
     gcry_md_hash_buffer(GCRY_MD_SHA1, hashdata, gabdata, gablen+5);
-    err = gcry_cipher_open(&(sess->sendenc), GCRY_CIPHER_AES,
-	    GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
-    if (err) goto err;
+    if (!sess->sendenc) {
+	err = gcry_cipher_open(&(sess->sendenc), GCRY_CIPHER_AES,
+		GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
+	if (err) goto err;
+    }
     err = gcry_cipher_setkey(sess->sendenc, hashdata, 16);
     if (err) goto err;
 
     /* Calculate the sending MAC key */
     gcry_md_hash_buffer(GCRY_MD_SHA1, sess->sendmackey, hashdata, 16);
-    err = gcry_md_open(&(sess->sendmac), GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
-    if (err) goto err;
+    if (!sess->sendmac) {
+	err = gcry_md_open(&(sess->sendmac), GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
+	if (err) goto err;
+    }
     err = gcry_md_setkey(sess->sendmac, sess->sendmackey, 20);
     if (err) goto err;
 
     /* Calculate the receiving encryption key */
     gabdata[0] = rcvbyte;
     gcry_md_hash_buffer(GCRY_MD_SHA1, hashdata, gabdata, gablen+5);
-    err = gcry_cipher_open(&(sess->rcvenc), GCRY_CIPHER_AES,
-	    GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
-    if (err) goto err;
+    if (!sess->rcvenc) {
+	err = gcry_cipher_open(&(sess->rcvenc), GCRY_CIPHER_AES,
+		GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
+	if (err) goto err;
+    }
     err = gcry_cipher_setkey(sess->rcvenc, hashdata, 16);
     if (err) goto err;
 
     /* Calculate the receiving MAC key (and save it in the DH_sesskeys
      * struct, so we can reveal it later) */
     gcry_md_hash_buffer(GCRY_MD_SHA1, sess->rcvmackey, hashdata, 16);
-    err = gcry_md_open(&(sess->rcvmac), GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
-    if (err) goto err;
+    if (!sess->rcvmac) {
+	err = gcry_md_open(&(sess->rcvmac), GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
+	if (err) goto err;
+    }
     err = gcry_md_setkey(sess->rcvmac, sess->rcvmackey, 20);
     if (err) goto err;
 
@@ -208,6 +524,7 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
      * symmetric key for transferring files, or something like that) */
     gabdata[0] = 0xff;
     gcry_md_hash_buffer(GCRY_MD_SHA256, sess->extrakey, gabdata, gablen+5);
+    sess->derived = 1;
 
     gcry_free(gabdata);
     gcry_free(hashdata);
@@ -219,6 +536,30 @@ err:
     return err;
 }
 
+/*
+ * Construct session keys from a DH keypair and someone else's public
+ * key.
+ */
+gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
+	gcry_mpi_t y)
+{
+    otrl_dh_session_blank(sess);
+    return dh_session_derive(sess, kp, y);
+}
+
+/*
+ * Construct session keys from a DH keypair and someone else's public
+ * key into a DH_sesskeys that is either blank or was set up by an
+ * earlier call, re-keying any cipher and MAC handles it already has
+ * rather than opening new ones.
+ */
+gcry_error_t otrl_dh_session_rekey(DH_sesskeys *sess, const DH_keypair *kp,
+	gcry_mpi_t y)
+{
+    otrl_dh_session_clear(sess);
+    return dh_session_derive(sess, kp, y);
+}
+
 /*
  * Compute the secure session id, two encryption keys, and four MAC keys
  * given our DH key and their DH public key.
@@ -258,7 +599,7 @@ gcry_error_t otrl_dh_compute_v2_auth_keys(const DH_keypair *our_dh,
 
     /* Calculate the shared secret MPI */
     s = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
-    gcry_mpi_powm(s, their_pub, our_dh->priv, DH1536_MODULUS);
+    otrl_powm(s, their_pub, our_dh->priv, DH1536_MODULUS);
 
     /* Output it in the right format */
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &slen, s);
@@ -383,7 +724,7 @@ gcry_error_t otrl_dh_compute_v1_session_id(const DH_keypair *our_dh,
 
     /* Calculate the shared secret MPI */
     s = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
-    gcry_mpi_powm(s, their_pub, our_dh->priv, DH1536_MODULUS);
+    otrl_powm(s, their_pub, our_dh->priv, DH1536_MODULUS);
 
     /* Output it in the right format */
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &slen, s);
@@ -436,6 +777,28 @@ void otrl_dh_session_free(DH_sesskeys *sess)
     otrl_dh_session_blank(sess);
 }
 
+/*
+ * Wipe the keys out of a DH_sesskeys, but keep its cipher and MAC
+ * handles open so that otrl_dh_session_rekey can reuse them.
+ */
+void otrl_dh_session_clear(DH_sesskeys *sess)
+{
+    static const unsigned char zerokey[16];
+
+    /* Don't leave the old encryption keys sitting in the handles */
+    if (sess->sendenc) gcry_cipher_setkey(sess->sendenc, zerokey, 16);
+    if (sess->rcvenc) gcry_cipher_setkey(sess->rcvenc, zerokey, 16);
+
+    memset(sess->sendctr, 0, 16);
+    memset(sess->rcvctr, 0, 16);
+    memset(sess->sendmackey, 0, 20);
+    memset(sess->rcvmackey, 0, 20);
+    sess->sendmacused = 0;
+    sess->rcvmacused = 0;
+    memset(sess->extrakey, 0, OTRL_EXTRAKEY_BYTES);
+    sess->derived = 0;
+}
+
 /*
  * Blank out the contents of a DH_sesskeys (without releasing it)
  */
@@ -452,6 +815,7 @@ void otrl_dh_session_blank(DH_sesskeys *sess)
     sess->sendmacused = 0;
     sess->rcvmacused = 0;
     memset(sess->extrakey, 0, OTRL_EXTRAKEY_BYTES);
+    sess->derived = 0;
 }
 
 /* Increment the top half of a counter block */
@@ -26,8 +26,15 @@
 typedef struct {
     unsigned int groupid;
     gcry_mpi_t priv, pub;
+    unsigned char *pubwire;     /* pub as it's sent (a 4-byte length,
+				   then its bytes), or NULL if it hasn't
+				   been worked out */
+    size_t pubwirelen;          /*  ...and its length */
 } DH_keypair;
 
+/* A pool of pre-generated DH keypairs */
+typedef struct s_DH_keypool DH_keypool;
+
 /* Which half of the secure session id should be shown in bold? */
 typedef enum {
     OTRL_SESSIONID_FIRST_HALF_BOLD,
@@ -48,6 +55,7 @@ typedef struct {
     unsigned char rcvmackey[20];
     int rcvmacused;
     unsigned char extrakey[OTRL_EXTRAKEY_BYTES];
+    int derived;                /* Have the keys above been computed? */
 } DH_sesskeys;
 
 /*
@@ -77,6 +85,47 @@ void otrl_dh_keypair_free(DH_keypair *kp);
  */
 gcry_error_t otrl_dh_gen_keypair(unsigned int groupid, DH_keypair *kp);
 
+/*
+ * Return the public key of a DH keypair as it's sent: a 4-byte length,
+ * then the bytes of the key.  Put its length (those 4 bytes included)
+ * into *lenp.  This is worked out when the keypair is generated, or
+ * the first time it's asked for if pub was set some other way.  Return
+ * NULL if out of memory.
+ */
+const unsigned char *otrl_dh_keypair_pubwire(DH_keypair *kp, size_t *lenp);
+
+/*
+ * Create an empty pool that will hold up to size pre-generated DH1536
+ * keypairs.  Return NULL if out of memory.
+ */
+DH_keypool *otrl_dh_keypool_new(unsigned int size);
+
+/*
+ * Free a DH keypool and any keypairs still in it.
+ */
+void otrl_dh_keypool_free(DH_keypool *pool);
+
+/*
+ * Generate up to max keypairs (but no more than the pool has room for)
+ * and add them to the pool.  This may be called from a thread other
+ * than the one that takes keys out of the pool.  Return the number of
+ * keypairs added.
+ */
+unsigned int otrl_dh_keypool_refill(DH_keypool *pool, unsigned int max);
+
+/*
+ * Return the number of keypairs currently in the pool.
+ */
+unsigned int otrl_dh_keypool_count(DH_keypool *pool);
+
+/*
+ * Generate a DH keypair for a specified group, taking a pre-generated
+ * one from the pool if there is one.  pool may be NULL, in which case
+ * (as when it's empty) the keypair is generated on the spot.
+ */
+gcry_error_t otrl_dh_gen_keypair_pooled(DH_keypool *pool,
+	unsigned int groupid, DH_keypair *kp);
+
 /*
  * Construct session keys from a DH keypair and someone else's public
  * key.
@@ -84,6 +133,15 @@ gcry_error_t otrl_dh_gen_keypair(unsigned int groupid, DH_keypair *kp);
 gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
 	gcry_mpi_t y);
 
+/*
+ * Construct session keys from a DH keypair and someone else's public
+ * key into a DH_sesskeys that is either blank or was set up by an
+ * earlier call, re-keying any cipher and MAC handles it already has
+ * rather than opening new ones.
+ */
+gcry_error_t otrl_dh_session_rekey(DH_sesskeys *sess, const DH_keypair *kp,
+	gcry_mpi_t y);
+
 /*
  * Compute the secure session id, two encryption keys, and four MAC keys
  * given our DH key and their DH public key.
@@ -108,6 +166,12 @@ gcry_error_t otrl_dh_compute_v1_session_id(const DH_keypair *our_dh,
  */
 void otrl_dh_session_free(DH_sesskeys *sess);
 
+/*
+ * Wipe the keys out of a DH_sesskeys, but keep its cipher and MAC
+ * handles open so that otrl_dh_session_rekey can reuse them.
+ */
+void otrl_dh_session_clear(DH_sesskeys *sess);
+
 /*
  * Blank out the contents of a DH_sesskeys (without releasing it)
  */
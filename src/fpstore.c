@@ -0,0 +1,1073 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "context.h"
+#include "fpstore.h"
+#include "userstate.h"
+
+/* The file starts with a header:
+ *
+ *    8 bytes   FPSTORE_MAGIC
+ *    4 bytes   the number of records in the table
+ *    4 bytes   the length of the string table
+ *    8 bytes   reserved (zero)
+ *
+ * followed by the table of records, sorted by hash and then by
+ * username, accountname, protocol and fingerprint:
+ *
+ *    4 bytes   hash of the username, accountname and protocol
+ *    4 bytes   offset of the username in the string table
+ *    4 bytes   offset of the accountname in the string table
+ *    4 bytes   offset of the protocol in the string table
+ *   20 bytes   fingerprint
+ *   16 bytes   trust, NUL-padded
+ *
+ * then the string table, of NUL-terminated strings, and then the log,
+ * to the end of the file.  Each log entry is:
+ *
+ *    4 bytes   the length of the rest of the entry
+ *    1 byte    FPSTORE_LOG_SET or FPSTORE_LOG_REMOVE
+ *   20 bytes   fingerprint
+ *              the username, accountname, protocol and trust, each
+ *              NUL-terminated
+ *
+ * and overrides whatever the table and the earlier entries said about
+ * that fingerprint.  All numbers are big-endian. */
+
+#define FPSTORE_MAGIC "OTRLFPS1"
+#define FPSTORE_HEADER_LEN 24
+#define FPSTORE_RECORD_LEN 52
+#define FPSTORE_TRUST_LEN 16  /* Room for a trust, including its NUL */
+
+#define FPSTORE_REC_HASH 0
+#define FPSTORE_REC_USERNAME 4
+#define FPSTORE_REC_ACCOUNTNAME 8
+#define FPSTORE_REC_PROTOCOL 12
+#define FPSTORE_REC_FINGERPRINT 16
+#define FPSTORE_REC_TRUST 36
+
+#define FPSTORE_LOG_SET 1
+#define FPSTORE_LOG_REMOVE 2
+#define FPSTORE_LOG_MIN_LEN (1 + 20 + 4)
+
+/* One entry of the log, with its strings in the same block */
+typedef struct s_OtrlFpLogEntry {
+    struct s_OtrlFpLogEntry *next;  /* The next entry in the same bucket,
+				       in the order they were logged */
+    unsigned int hash;
+    int op;
+    unsigned char fingerprint[20];
+    const char *username;
+    const char *accountname;
+    const char *protocol;
+    const char *trust;
+} OtrlFpLogEntry;
+
+struct s_OtrlFingerprintStore {
+    char *filename;
+    int fd;                        /* Open for reading and writing */
+    unsigned char *map;            /* The header, table and strings */
+    size_t maplen;
+    int mapped;                    /* Is map mmapped, or malloced? */
+    unsigned int count;            /* Number of records in the table */
+    const unsigned char *records;
+    const char *strings;
+    size_t strings_len;
+    off_t end;                     /* Where the next log entry goes */
+    OtrlFpLogEntry **log;          /* Hash table of the log entries */
+    size_t log_size;               /* Number of buckets (a power of 2) */
+    size_t log_used;               /* Number of log entries */
+};
+
+static unsigned int fpstore_get32(const unsigned char *p)
+{
+    return (((unsigned int)p[0]) << 24) | (p[1] << 16) | (p[2] << 8) |
+	p[3];
+}
+
+static void fpstore_put32(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+/* Hash a username/accountname/protocol (FNV-1a) */
+static unsigned int fpstore_hash(const char *username,
+	const char *accountname, const char *protocol)
+{
+    const char *strs[3];
+    unsigned int hash = 2166136261U;
+    int i;
+
+    strs[0] = username;
+    strs[1] = accountname;
+    strs[2] = protocol;
+    for (i = 0; i < 3; ++i) {
+	const unsigned char *s = (const unsigned char *)strs[i];
+	do {
+	    hash ^= *s;
+	    hash *= 16777619U;
+	} while (*s++);
+    }
+    return hash;
+}
+
+/* Read or write exactly len bytes at offset off of fd */
+static int fpstore_pread(int fd, void *buf, size_t len, off_t off)
+{
+    unsigned char *p = buf;
+
+    if (lseek(fd, off, SEEK_SET) == (off_t)-1) return -1;
+    while (len > 0) {
+	ssize_t got = read(fd, p, len);
+	if (got < 0 && errno == EINTR) continue;
+	if (got <= 0) return -1;
+	p += got;
+	len -= got;
+    }
+    return 0;
+}
+
+static int fpstore_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+    const unsigned char *p = buf;
+
+    if (lseek(fd, off, SEEK_SET) == (off_t)-1) return -1;
+    while (len > 0) {
+	ssize_t put = write(fd, p, len);
+	if (put < 0 && errno == EINTR) continue;
+	if (put <= 0) return -1;
+	p += put;
+	len -= put;
+    }
+    return 0;
+}
+
+/* The string at offset off of the string table (which ends with a NUL,
+ * if it isn't empty) */
+static const char *fpstore_string(const OtrlFingerprintStore *store,
+	unsigned int off)
+{
+    return off < store->strings_len ? store->strings + off : "";
+}
+
+/* Compare the key of the record at rec with the given one */
+static int fpstore_record_cmp(const OtrlFingerprintStore *store,
+	const unsigned char *rec, unsigned int hash, const char *username,
+	const char *accountname, const char *protocol)
+{
+    unsigned int rechash = fpstore_get32(rec + FPSTORE_REC_HASH);
+    int cmp;
+
+    if (rechash != hash) return rechash < hash ? -1 : 1;
+    cmp = strcmp(fpstore_string(store,
+		fpstore_get32(rec + FPSTORE_REC_USERNAME)), username);
+    if (cmp) return cmp;
+    cmp = strcmp(fpstore_string(store,
+		fpstore_get32(rec + FPSTORE_REC_ACCOUNTNAME)), accountname);
+    if (cmp) return cmp;
+    return strcmp(fpstore_string(store,
+		fpstore_get32(rec + FPSTORE_REC_PROTOCOL)), protocol);
+}
+
+/* Find the records of a username/accountname/protocol: there are
+ * *countp of them, starting at the returned one. */
+static const unsigned char *fpstore_records_find(
+	const OtrlFingerprintStore *store, unsigned int hash,
+	const char *username, const char *accountname, const char *protocol,
+	unsigned int *countp)
+{
+    unsigned int lo = 0, hi = store->count, n = 0;
+
+    while (lo < hi) {
+	unsigned int mid = lo + (hi - lo) / 2;
+	if (fpstore_record_cmp(store,
+		    store->records + mid * FPSTORE_RECORD_LEN, hash,
+		    username, accountname, protocol) < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    while (lo + n < store->count && fpstore_record_cmp(store,
+		store->records + (lo + n) * FPSTORE_RECORD_LEN, hash,
+		username, accountname, protocol) == 0) {
+	++n;
+    }
+
+    *countp = n;
+    return store->records + lo * FPSTORE_RECORD_LEN;
+}
+
+/* Is the log entry about the given username/accountname/protocol? */
+static int fpstore_log_matches(const OtrlFpLogEntry *entry,
+	unsigned int hash, const char *username, const char *accountname,
+	const char *protocol)
+{
+    return entry->hash == hash && !strcmp(entry->username, username) &&
+	!strcmp(entry->accountname, accountname) &&
+	!strcmp(entry->protocol, protocol);
+}
+
+/* Add an entry to the end of its bucket of the log's hash table */
+static void fpstore_log_link(OtrlFingerprintStore *store,
+	OtrlFpLogEntry *entry)
+{
+    OtrlFpLogEntry **entryp = &(store->log[entry->hash &
+	    (store->log_size - 1)]);
+
+    while (*entryp) entryp = &((*entryp)->next);
+    entry->next = NULL;
+    *entryp = entry;
+}
+
+/* Make a log entry from the len bytes of its encoding at buf (without
+ * the length), and add it to the log's hash table.  Return -1 if the
+ * encoding is bad, or if out of memory. */
+static int fpstore_log_add(OtrlFingerprintStore *store,
+	const unsigned char *buf, size_t len)
+{
+    OtrlFpLogEntry *entry;
+    const char *strs[4];
+    const char *p, *end;
+    char *copy;
+    int i;
+
+    if (len < FPSTORE_LOG_MIN_LEN ||
+	    (buf[0] != FPSTORE_LOG_SET && buf[0] != FPSTORE_LOG_REMOVE)) {
+	return -1;
+    }
+
+    /* There must be exactly four strings */
+    p = (const char *)buf + 21;
+    end = (const char *)buf + len;
+    for (i = 0; i < 4; ++i) {
+	const char *nul = memchr(p, '\0', end - p);
+	if (nul == NULL) return -1;
+	strs[i] = p;
+	p = nul + 1;
+    }
+    if (p != end) return -1;
+
+    /* Keep the hash table no fuller than one entry per bucket */
+    if (store->log_used >= store->log_size) {
+	size_t newsize = store->log_size ? 2 * store->log_size : 64;
+	OtrlFpLogEntry **oldlog = store->log;
+	size_t oldsize = store->log_size, b;
+
+	store->log = calloc(newsize, sizeof(OtrlFpLogEntry *));
+	if (store->log == NULL) {
+	    store->log = oldlog;
+	    return -1;
+	}
+	store->log_size = newsize;
+	for (b = 0; b < oldsize; ++b) {
+	    OtrlFpLogEntry *old = oldlog[b];
+	    while (old) {
+		OtrlFpLogEntry *next = old->next;
+		fpstore_log_link(store, old);
+		old = next;
+	    }
+	}
+	free(oldlog);
+    }
+
+    entry = malloc(sizeof(OtrlFpLogEntry) + (len - 21));
+    if (entry == NULL) return -1;
+    copy = (char *)(entry + 1);
+    memcpy(copy, buf + 21, len - 21);
+    entry->op = buf[0];
+    memmove(entry->fingerprint, buf + 1, 20);
+    entry->username = copy + (strs[0] - (const char *)buf - 21);
+    entry->accountname = copy + (strs[1] - (const char *)buf - 21);
+    entry->protocol = copy + (strs[2] - (const char *)buf - 21);
+    entry->trust = copy + (strs[3] - (const char *)buf - 21);
+    entry->hash = fpstore_hash(entry->username, entry->accountname,
+	    entry->protocol);
+
+    fpstore_log_link(store, entry);
+    ++store->log_used;
+    return 0;
+}
+
+/* Encode a log entry, including its length, into a newly allocated
+ * buffer, and put its length in *lenp.  Return NULL if out of
+ * memory. */
+static unsigned char *fpstore_log_encode(size_t *lenp, int op,
+	const unsigned char fingerprint[20], const char *username,
+	const char *accountname, const char *protocol, const char *trust)
+{
+    size_t ulen = strlen(username) + 1, alen = strlen(accountname) + 1;
+    size_t plen = strlen(protocol) + 1, tlen = strlen(trust) + 1;
+    size_t len = 4 + 1 + 20 + ulen + alen + plen + tlen;
+    unsigned char *buf = malloc(len), *p;
+
+    if (buf == NULL) return NULL;
+    fpstore_put32(buf, len - 4);
+    buf[4] = op;
+    memmove(buf + 5, fingerprint, 20);
+    p = buf + 25;
+    memmove(p, username, ulen);
+    memmove(p += ulen, accountname, alen);
+    memmove(p += alen, protocol, plen);
+    memmove(p + plen, trust, tlen);
+
+    *lenp = len;
+    return buf;
+}
+
+/* Add an entry to the end of the store's log */
+static gcry_error_t fpstore_log_append(OtrlFingerprintStore *store, int op,
+	const unsigned char fingerprint[20], const char *username,
+	const char *accountname, const char *protocol, const char *trust)
+{
+    size_t len;
+    unsigned char *buf = fpstore_log_encode(&len, op, fingerprint,
+	    username, accountname, protocol, trust);
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    if (buf == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    if (fpstore_pwrite(store->fd, buf, len, store->end)) {
+	err = gcry_error_from_errno(errno);
+    } else if (fpstore_log_add(store, buf + 4, len - 4)) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+    } else {
+	store->end += len;
+    }
+    free(buf);
+    return err;
+}
+
+/* Find what the store says about one fingerprint of a
+ * username/accountname/protocol whose records are the count at recs.
+ * Return 1 and put its trust in *trustp if the store holds it, or
+ * return 0 if not.  Put its record in *recp (or NULL if it has none),
+ * and whether the log mentions it in *loggedp. */
+static int fpstore_fingerprint_find(const OtrlFingerprintStore *store,
+	unsigned int hash, const char *username, const char *accountname,
+	const char *protocol, const unsigned char *recs, unsigned int count,
+	const unsigned char fingerprint[20], const char **trustp,
+	const unsigned char **recp, int *loggedp)
+{
+    const OtrlFpLogEntry *entry;
+    int present = 0;
+    unsigned int i;
+
+    *trustp = NULL;
+    *recp = NULL;
+    *loggedp = 0;
+
+    for (i = 0; i < count; ++i) {
+	const unsigned char *rec = recs + i * FPSTORE_RECORD_LEN;
+	if (!memcmp(rec + FPSTORE_REC_FINGERPRINT, fingerprint, 20)) {
+	    *recp = rec;
+	    /* A trust that fills its field can't be ours */
+	    *trustp = rec[FPSTORE_REC_TRUST + FPSTORE_TRUST_LEN - 1] ? "" :
+		(const char *)rec + FPSTORE_REC_TRUST;
+	    present = 1;
+	    break;
+	}
+    }
+
+    if (store->log_size == 0) return present;
+    for (entry = store->log[hash & (store->log_size - 1)]; entry;
+	    entry = entry->next) {
+	if (!fpstore_log_matches(entry, hash, username, accountname,
+		    protocol) || memcmp(entry->fingerprint, fingerprint, 20)) {
+	    continue;
+	}
+	*loggedp = 1;
+	present = entry->op == FPSTORE_LOG_SET;
+	*trustp = present ? entry->trust : NULL;
+    }
+    return present;
+}
+
+/* Call found(arg, fingerprint, trust) for each fingerprint the store
+ * holds for the given username/accountname/protocol. */
+void otrl_fpstore_lookup(OtrlFingerprintStore *store, const char *username,
+	const char *accountname, const char *protocol,
+	void (*found)(void *arg, const unsigned char fingerprint[20],
+	    const char *trust),
+	void *arg)
+{
+    unsigned int hash = fpstore_hash(username, accountname, protocol);
+    unsigned int count, i;
+    const unsigned char *recs = fpstore_records_find(store, hash,
+	    username, accountname, protocol, &count), *rec;
+    const OtrlFpLogEntry *entry, *earlier;
+    const char *trust;
+    int logged;
+
+    /* Each fingerprint in the table, unless the log removed it */
+    for (i = 0; i < count; ++i) {
+	const unsigned char *fingerprint =
+	    recs + i * FPSTORE_RECORD_LEN + FPSTORE_REC_FINGERPRINT;
+	if (fpstore_fingerprint_find(store, hash, username, accountname,
+		    protocol, recs, count, fingerprint, &trust, &rec,
+		    &logged)) {
+	    found(arg, fingerprint, trust);
+	}
+    }
+
+    /* And each one only the log has, the first time it comes up */
+    if (store->log_size == 0) return;
+    for (entry = store->log[hash & (store->log_size - 1)]; entry;
+	    entry = entry->next) {
+	if (entry->op != FPSTORE_LOG_SET || !fpstore_log_matches(entry,
+		    hash, username, accountname, protocol)) {
+	    continue;
+	}
+	for (earlier = store->log[hash & (store->log_size - 1)];
+		earlier != entry; earlier = earlier->next) {
+	    if (fpstore_log_matches(earlier, hash, username, accountname,
+			protocol) &&
+		    !memcmp(earlier->fingerprint, entry->fingerprint, 20)) {
+		break;
+	    }
+	}
+	if (earlier != entry) continue;
+	if (fpstore_fingerprint_find(store, hash, username, accountname,
+		    protocol, recs, count, entry->fingerprint, &trust, &rec,
+		    &logged) && rec == NULL) {
+	    found(arg, entry->fingerprint, trust);
+	}
+    }
+}
+
+/* Free a store */
+static void fpstore_free(OtrlFingerprintStore *store)
+{
+    size_t b;
+
+    if (store == NULL) return;
+
+    for (b = 0; b < store->log_size; ++b) {
+	OtrlFpLogEntry *entry = store->log[b];
+	while (entry) {
+	    OtrlFpLogEntry *next = entry->next;
+	    free(entry);
+	    entry = next;
+	}
+    }
+    free(store->log);
+#ifdef HAVE_SYS_MMAN_H
+    if (store->mapped) {
+	munmap(store->map, store->maplen);
+    } else
+#endif
+    {
+	free(store->map);
+    }
+    if (store->fd >= 0) close(store->fd);
+    free(store->filename);
+    free(store);
+}
+
+/* Order the fingerprints of a userstate as the table of a store
+ * has them */
+typedef struct {
+    unsigned int hash;
+    Fingerprint *fprint;
+} OtrlFpStoreItem;
+
+static int fpstore_item_cmp(const void *a, const void *b)
+{
+    const OtrlFpStoreItem *ia = a, *ib = b;
+    const ConnContext *ca = ia->fprint->context, *cb = ib->fprint->context;
+    int cmp;
+
+    if (ia->hash != ib->hash) return ia->hash < ib->hash ? -1 : 1;
+    if (ca != cb) {
+	cmp = strcmp(ca->username, cb->username);
+	if (cmp) return cmp;
+	cmp = strcmp(ca->accountname, cb->accountname);
+	if (cmp) return cmp;
+	cmp = strcmp(ca->protocol, cb->protocol);
+	if (cmp) return cmp;
+    }
+    return memcmp(ia->fprint->fingerprint, ib->fprint->fingerprint, 20);
+}
+
+/* Write the table (and log) of a store holding the given items to
+ * storef */
+static gcry_error_t fpstore_write_FILEp(FILE *storef,
+	OtrlFpStoreItem *items, size_t count)
+{
+    unsigned char header[FPSTORE_HEADER_LEN], rec[FPSTORE_RECORD_LEN];
+    unsigned int stroff = 0, useroff = 0, acctoff = 0, protooff = 0;
+    const ConnContext *context;
+    size_t i;
+
+    memset(header, 0, sizeof(header));
+    memmove(header, FPSTORE_MAGIC, 8);
+    fpstore_put32(header + 8, count);
+    for (i = 0, context = NULL; i < count; ++i) {
+	if (items[i].fprint->context == context) continue;
+	context = items[i].fprint->context;
+	stroff += strlen(context->username) + 1 +
+	    strlen(context->accountname) + 1 + strlen(context->protocol) + 1;
+    }
+    fpstore_put32(header + 12, stroff);
+    if (fwrite(header, sizeof(header), 1, storef) != 1) goto err;
+
+    /* The table, with each context's strings written once */
+    for (i = 0, context = NULL, stroff = 0; i < count; ++i) {
+	const char *trust = items[i].fprint->trust;
+
+	if (items[i].fprint->context != context) {
+	    context = items[i].fprint->context;
+	    useroff = stroff;
+	    acctoff = useroff + strlen(context->username) + 1;
+	    protooff = acctoff + strlen(context->accountname) + 1;
+	    stroff = protooff + strlen(context->protocol) + 1;
+	}
+	memset(rec, 0, sizeof(rec));
+	fpstore_put32(rec + FPSTORE_REC_HASH, items[i].hash);
+	fpstore_put32(rec + FPSTORE_REC_USERNAME, useroff);
+	fpstore_put32(rec + FPSTORE_REC_ACCOUNTNAME, acctoff);
+	fpstore_put32(rec + FPSTORE_REC_PROTOCOL, protooff);
+	memmove(rec + FPSTORE_REC_FINGERPRINT, items[i].fprint->fingerprint,
+		20);
+	if (trust && strlen(trust) < FPSTORE_TRUST_LEN) {
+	    memmove(rec + FPSTORE_REC_TRUST, trust, strlen(trust));
+	}
+	if (fwrite(rec, sizeof(rec), 1, storef) != 1) goto err;
+    }
+
+    for (i = 0, context = NULL; i < count; ++i) {
+	if (items[i].fprint->context == context) continue;
+	context = items[i].fprint->context;
+	if (fwrite(context->username, strlen(context->username) + 1, 1,
+		    storef) != 1 ||
+		fwrite(context->accountname,
+		    strlen(context->accountname) + 1, 1, storef) != 1 ||
+		fwrite(context->protocol, strlen(context->protocol) + 1, 1,
+		    storef) != 1) {
+	    goto err;
+	}
+    }
+
+    /* Trusts too long for the table go in the log */
+    for (i = 0; i < count; ++i) {
+	const char *trust = items[i].fprint->trust;
+	unsigned char *buf;
+	size_t len;
+	int bad;
+
+	if (!trust || strlen(trust) < FPSTORE_TRUST_LEN) continue;
+	context = items[i].fprint->context;
+	buf = fpstore_log_encode(&len, FPSTORE_LOG_SET,
+		items[i].fprint->fingerprint, context->username,
+		context->accountname, context->protocol, trust);
+	if (buf == NULL) return gcry_error(GPG_ERR_ENOMEM);
+	bad = fwrite(buf, len, 1, storef) != 1;
+	free(buf);
+	if (bad) goto err;
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+err:
+    return gcry_error_from_errno(errno);
+}
+
+/* Write every fingerprint of the given OtrlUserState to a new binary
+ * fingerprint store in the named file, replacing any that was there.
+ * If the userstate has a store open, only the fingerprints of contexts
+ * looked up so far are written; otrl_fpstore_compact writes them
+ * all. */
+gcry_error_t otrl_fpstore_write(OtrlUserState us, const char *filename)
+{
+    gcry_error_t err;
+    OtrlFpStoreItem *items = NULL;
+    size_t count = 0, i = 0;
+    ConnContext *context;
+    Fingerprint *fprint;
+    char *tmpname;
+    FILE *storef;
+
+    tmpname = malloc(strlen(filename) + 5);
+    if (tmpname == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    strcpy(tmpname, filename);
+    strcat(tmpname, ".new");
+
+    otrl_userstate_rdlock(us);
+    for (context = us->context_root; context; context = context->next) {
+	/* Fingerprints are only stored in the master contexts */
+	if (context->their_instance != OTRL_INSTAG_MASTER) continue;
+	for (fprint = context->fingerprint_root.next; fprint;
+		fprint = fprint->next) {
+	    ++count;
+	}
+    }
+    if (count > 0) {
+	items = malloc(count * sizeof(OtrlFpStoreItem));
+	if (items == NULL) {
+	    otrl_userstate_unlock(us);
+	    free(tmpname);
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+    }
+    for (context = us->context_root; context; context = context->next) {
+	unsigned int hash;
+
+	if (context->their_instance != OTRL_INSTAG_MASTER) continue;
+	hash = fpstore_hash(context->username, context->accountname,
+		context->protocol);
+	for (fprint = context->fingerprint_root.next; fprint;
+		fprint = fprint->next) {
+	    items[i].hash = hash;
+	    items[i].fprint = fprint;
+	    ++i;
+	}
+    }
+    if (count > 0) {
+	qsort(items, count, sizeof(OtrlFpStoreItem), fpstore_item_cmp);
+    }
+
+    storef = fopen(tmpname, "wb");
+    if (!storef) {
+	err = gcry_error_from_errno(errno);
+    } else {
+	err = fpstore_write_FILEp(storef, items, count);
+	if (fclose(storef) && !err) {
+	    err = gcry_error_from_errno(errno);
+	}
+	if (!err && rename(tmpname, filename)) {
+	    err = gcry_error_from_errno(errno);
+	}
+	if (err) remove(tmpname);
+    }
+    otrl_userstate_unlock(us);
+
+    free(items);
+    free(tmpname);
+    return err;
+}
+
+/* Add a fingerprint found in the store to the context given as arg,
+ * unless it already has it */
+static void fpstore_found_add(void *arg, const unsigned char fingerprint[20],
+	const char *trust)
+{
+    ConnContext *context = arg;
+    OtrlUserState us = context->context_priv->userstate;
+    unsigned char fp[20];
+    Fingerprint *fprint;
+    int added;
+
+    memmove(fp, fingerprint, 20);
+    fprint = otrl_context_find_fingerprint(context, fp, 1, &added);
+    if (fprint && added) {
+	otrl_userstate_wrlock(us);
+	otrl_context_set_trust(fprint, trust);
+	otrl_userstate_unlock(us);
+    }
+}
+
+/* Open the binary fingerprint store in the named file for the given
+ * OtrlUserState, closing any it already had open.  The contexts that
+ * already exist pick up their fingerprints from it straight away; the
+ * rest do so when they are first looked up. */
+gcry_error_t otrl_fpstore_open(OtrlUserState us, const char *filename)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    OtrlFingerprintStore *store;
+    unsigned char header[FPSTORE_HEADER_LEN];
+    unsigned char *logbuf = NULL;
+    size_t loglen, pos;
+    struct stat st;
+    ConnContext *context;
+
+    store = calloc(1, sizeof(OtrlFingerprintStore));
+    if (store == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    store->fd = -1;
+    store->filename = strdup(filename);
+    if (store->filename == NULL) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto fail;
+    }
+
+    store->fd = open(filename, O_RDWR);
+    if (store->fd < 0 || fstat(store->fd, &st) ||
+	    fpstore_pread(store->fd, header, sizeof(header), 0)) {
+	err = gcry_error_from_errno(errno);
+	goto fail;
+    }
+    if (memcmp(header, FPSTORE_MAGIC, 8)) {
+	err = gcry_error(GPG_ERR_BAD_DATA);
+	goto fail;
+    }
+    store->count = fpstore_get32(header + 8);
+    store->strings_len = fpstore_get32(header + 12);
+    if (store->strings_len > (size_t)-1 - FPSTORE_HEADER_LEN ||
+	    store->count > ((size_t)-1 - FPSTORE_HEADER_LEN -
+		store->strings_len) / FPSTORE_RECORD_LEN) {
+	err = gcry_error(GPG_ERR_BAD_DATA);
+	goto fail;
+    }
+    store->maplen = FPSTORE_HEADER_LEN +
+	(size_t)store->count * FPSTORE_RECORD_LEN + store->strings_len;
+    if ((off_t)store->maplen > st.st_size) {
+	err = gcry_error(GPG_ERR_BAD_DATA);
+	goto fail;
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+    store->map = mmap(NULL, store->maplen, PROT_READ, MAP_SHARED,
+	    store->fd, 0);
+    if (store->map == MAP_FAILED) {
+	store->map = NULL;
+    } else {
+	store->mapped = 1;
+    }
+#endif
+    if (store->map == NULL) {
+	store->map = malloc(store->maplen);
+	if (store->map == NULL) {
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	    goto fail;
+	}
+	if (fpstore_pread(store->fd, store->map, store->maplen, 0)) {
+	    err = gcry_error_from_errno(errno);
+	    goto fail;
+	}
+    }
+    store->records = store->map + FPSTORE_HEADER_LEN;
+    store->strings = (const char *)store->records +
+	(size_t)store->count * FPSTORE_RECORD_LEN;
+    if (store->strings_len > 0 &&
+	    store->strings[store->strings_len - 1] != '\0') {
+	err = gcry_error(GPG_ERR_BAD_DATA);
+	goto fail;
+    }
+
+    /* Read the log.  If it ends with a partly-written entry, the next
+     * one will go in its place. */
+    loglen = st.st_size - store->maplen;
+    store->end = store->maplen;
+    if (loglen > 0) {
+	logbuf = malloc(loglen);
+	if (logbuf == NULL) {
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	    goto fail;
+	}
+	if (fpstore_pread(store->fd, logbuf, loglen, store->maplen)) {
+	    err = gcry_error_from_errno(errno);
+	    goto fail;
+	}
+    }
+    for (pos = 0; pos + 4 <= loglen; ) {
+	size_t len = fpstore_get32(logbuf + pos);
+	if (len > loglen - pos - 4 ||
+		fpstore_log_add(store, logbuf + pos + 4, len)) {
+	    break;
+	}
+	pos += 4 + len;
+    }
+    store->end += pos;
+    if (store->end < st.st_size) {
+	/* Drop the rest, so that it can't be mistaken for entries later;
+	 * if that fails, the next entry still goes in its place */
+	int truncated = ftruncate(store->fd, store->end);
+	(void)truncated;
+    }
+    free(logbuf);
+    logbuf = NULL;
+
+    otrl_fpstore_close(us);
+    otrl_userstate_wrlock(us);
+    us->fpstore = store;
+    otrl_userstate_unlock(us);
+
+    for (context = us->context_root; context; context = context->next) {
+	if (context->their_instance != OTRL_INSTAG_MASTER) continue;
+	otrl_fpstore_lookup(store, context->username, context->accountname,
+		context->protocol, fpstore_found_add, context);
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+fail:
+    free(logbuf);
+    fpstore_free(store);
+    return err;
+}
+
+/* Collect the fingerprints of the store that the context given as arg
+ * no longer has */
+typedef struct {
+    ConnContext *context;
+    unsigned char (*gone)[20];
+    size_t numgone;
+    size_t sizegone;
+    int nomem;
+} OtrlFpStoreGone;
+
+static void fpstore_found_gone(void *arg, const unsigned char fingerprint[20],
+	const char *trust)
+{
+    OtrlFpStoreGone *gone = arg;
+    Fingerprint *fprint;
+
+    for (fprint = gone->context->fingerprint_root.next; fprint;
+	    fprint = fprint->next) {
+	if (!memcmp(fprint->fingerprint, fingerprint, 20)) return;
+    }
+
+    if (gone->numgone == gone->sizegone) {
+	size_t newsize = gone->sizegone ? 2 * gone->sizegone : 4;
+	unsigned char (*newgone)[20] = realloc(gone->gone, newsize * 20);
+	if (newgone == NULL) {
+	    gone->nomem = 1;
+	    return;
+	}
+	gone->gone = newgone;
+	gone->sizegone = newsize;
+    }
+    memmove(gone->gone[gone->numgone++], fingerprint, 20);
+}
+
+/* Write the changes made to the fingerprints of the given
+ * OtrlUserState's contexts since its store was opened (or last
+ * synced) to the store: a change of trust in place, if possible, and
+ * anything else by adding to the store's log.  Call this where you
+ * would have called otrl_privkey_write_fingerprints. */
+gcry_error_t otrl_fpstore_sync(OtrlUserState us)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    OtrlFingerprintStore *store = us->fpstore;
+    OtrlFpStoreGone gone;
+    ConnContext *context;
+
+    if (store == NULL) return gcry_error(GPG_ERR_NO_ERROR);
+
+    gone.gone = NULL;
+    gone.sizegone = 0;
+
+    otrl_userstate_wrlock(us);
+    for (context = us->context_root; context && !err;
+	    context = context->next) {
+	unsigned int hash, count;
+	const unsigned char *recs;
+	Fingerprint *fprint;
+	size_t i;
+
+	if (context->their_instance != OTRL_INSTAG_MASTER) continue;
+	hash = fpstore_hash(context->username, context->accountname,
+		context->protocol);
+	recs = fpstore_records_find(store, hash, context->username,
+		context->accountname, context->protocol, &count);
+
+	for (fprint = context->fingerprint_root.next; fprint && !err;
+		fprint = fprint->next) {
+	    const char *trust = fprint->trust ? fprint->trust : "";
+	    const char *stored;
+	    const unsigned char *rec;
+	    int logged;
+
+	    if (fpstore_fingerprint_find(store, hash, context->username,
+			context->accountname, context->protocol, recs, count,
+			fprint->fingerprint, &stored, &rec, &logged) &&
+		    !strcmp(stored, trust)) {
+		continue;
+	    }
+
+	    if (rec && !logged && strlen(trust) < FPSTORE_TRUST_LEN) {
+		/* Just update the record */
+		unsigned char newtrust[FPSTORE_TRUST_LEN];
+		size_t index = (rec - store->records) / FPSTORE_RECORD_LEN;
+
+		memset(newtrust, 0, sizeof(newtrust));
+		memmove(newtrust, trust, strlen(trust));
+		if (fpstore_pwrite(store->fd, newtrust, sizeof(newtrust),
+			    FPSTORE_HEADER_LEN + index * FPSTORE_RECORD_LEN +
+			    FPSTORE_REC_TRUST)) {
+		    err = gcry_error_from_errno(errno);
+		} else if (!store->mapped) {
+		    memmove(store->map + FPSTORE_HEADER_LEN +
+			    index * FPSTORE_RECORD_LEN + FPSTORE_REC_TRUST,
+			    newtrust, sizeof(newtrust));
+		}
+	    } else {
+		err = fpstore_log_append(store, FPSTORE_LOG_SET,
+			fprint->fingerprint, context->username,
+			context->accountname, context->protocol, trust);
+	    }
+	}
+
+	/* Anything the store has that the context doesn't must have been
+	 * forgotten */
+	gone.context = context;
+	gone.numgone = 0;
+	gone.nomem = 0;
+	otrl_fpstore_lookup(store, context->username, context->accountname,
+		context->protocol, fpstore_found_gone, &gone);
+	if (gone.nomem && !err) err = gcry_error(GPG_ERR_ENOMEM);
+	for (i = 0; i < gone.numgone && !err; ++i) {
+	    err = fpstore_log_append(store, FPSTORE_LOG_REMOVE, gone.gone[i],
+		    context->username, context->accountname,
+		    context->protocol, "");
+	}
+    }
+    otrl_userstate_unlock(us);
+
+    free(gone.gone);
+    return err;
+}
+
+/* Record in the store that the given fingerprint has been forgotten.
+ * The caller must hold the userstate's write lock. */
+void otrl_fpstore_remove(OtrlFingerprintStore *store, Fingerprint *fprint)
+{
+    ConnContext *context = fprint->context;
+    unsigned int hash, count;
+    const unsigned char *recs, *rec;
+    const char *trust;
+    int logged;
+
+    hash = fpstore_hash(context->username, context->accountname,
+	    context->protocol);
+    recs = fpstore_records_find(store, hash, context->username,
+	    context->accountname, context->protocol, &count);
+    if (fpstore_fingerprint_find(store, hash, context->username,
+		context->accountname, context->protocol, recs, count,
+		fprint->fingerprint, &trust, &rec, &logged)) {
+	fpstore_log_append(store, FPSTORE_LOG_REMOVE, fprint->fingerprint,
+		context->username, context->accountname, context->protocol,
+		"");
+    }
+}
+
+/* Look up a context for every username/accountname/protocol in the
+ * given OtrlUserState's store, calling add_app_data for the ones that
+ * are added, as otrl_context_find does, so that all of its
+ * fingerprints are in memory. */
+gcry_error_t otrl_fpstore_load_all(OtrlUserState us,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void *data)
+{
+    OtrlFingerprintStore *store = us->fpstore;
+    const unsigned char *rec, *prev = NULL;
+    unsigned int i;
+    size_t b;
+
+    if (store == NULL) return gcry_error(GPG_ERR_NO_ERROR);
+
+    for (i = 0; i < store->count; ++i) {
+	const char *username, *accountname, *protocol;
+
+	rec = store->records + i * FPSTORE_RECORD_LEN;
+	if (prev && !memcmp(prev, rec, FPSTORE_REC_FINGERPRINT)) continue;
+	prev = rec;
+	username = fpstore_string(store,
+		fpstore_get32(rec + FPSTORE_REC_USERNAME));
+	accountname = fpstore_string(store,
+		fpstore_get32(rec + FPSTORE_REC_ACCOUNTNAME));
+	protocol = fpstore_string(store,
+		fpstore_get32(rec + FPSTORE_REC_PROTOCOL));
+	if (otrl_context_find(us, username, accountname, protocol,
+		    OTRL_INSTAG_MASTER, 1, NULL, add_app_data, data) == NULL) {
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+    }
+
+    for (b = 0; b < store->log_size; ++b) {
+	const OtrlFpLogEntry *entry;
+	for (entry = store->log[b]; entry; entry = entry->next) {
+	    if (entry->op != FPSTORE_LOG_SET) continue;
+	    if (otrl_context_find(us, entry->username, entry->accountname,
+			entry->protocol, OTRL_INSTAG_MASTER, 1, NULL,
+			add_app_data, data) == NULL) {
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	}
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Rewrite the given OtrlUserState's store with its log folded into its
+ * table, loading every fingerprint into memory along the way, as
+ * otrl_fpstore_load_all does. */
+gcry_error_t otrl_fpstore_compact(OtrlUserState us,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void *data)
+{
+    gcry_error_t err;
+    char *filename;
+
+    if (us->fpstore == NULL) return gcry_error(GPG_ERR_NO_ERROR);
+
+    err = otrl_fpstore_load_all(us, add_app_data, data);
+    if (err) return err;
+
+    /* Catch up with any changes the store hasn't seen yet */
+    err = otrl_fpstore_sync(us);
+    if (err) return err;
+
+    filename = strdup(us->fpstore->filename);
+    if (filename == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    err = otrl_fpstore_write(us, filename);
+    if (!err) {
+	err = otrl_fpstore_open(us, filename);
+    }
+    free(filename);
+    return err;
+}
+
+/* Close the given OtrlUserState's store, if it has one open, without
+ * writing anything to it. */
+void otrl_fpstore_close(OtrlUserState us)
+{
+    OtrlFingerprintStore *store;
+
+    otrl_userstate_wrlock(us);
+    store = us->fpstore;
+    us->fpstore = NULL;
+    otrl_userstate_unlock(us);
+
+    fpstore_free(store);
+}
@@ -0,0 +1,97 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __FPSTORE_H__
+#define __FPSTORE_H__
+
+#include <gcrypt.h>
+
+#include "userstate.h"
+
+/* A binary fingerprint store is an alternative to the text file that
+ * otrl_privkey_read_fingerprints and otrl_privkey_write_fingerprints
+ * use, for when there are too many fingerprints to read in and write
+ * out in full.  It holds a table of fingerprints, sorted so that those
+ * of one username/accountname/protocol can be found without reading
+ * the rest, followed by a log of the changes made since the table was
+ * written.
+ *
+ * Once a store is opened for a userstate, each master context picks up
+ * its fingerprints from the store when it is first looked up, and
+ * otrl_fpstore_sync writes out just what has changed.  To import a
+ * text fingerprint file, read it with otrl_privkey_read_fingerprints
+ * and write it out with otrl_fpstore_write; to export one, call
+ * otrl_fpstore_load_all, then otrl_privkey_write_fingerprints. */
+
+typedef struct s_OtrlFingerprintStore OtrlFingerprintStore;
+
+/* Write every fingerprint of the given OtrlUserState to a new binary
+ * fingerprint store in the named file, replacing any that was there.
+ * If the userstate has a store open, only the fingerprints of contexts
+ * looked up so far are written; otrl_fpstore_compact writes them
+ * all. */
+gcry_error_t otrl_fpstore_write(OtrlUserState us, const char *filename);
+
+/* Open the binary fingerprint store in the named file for the given
+ * OtrlUserState, closing any it already had open.  The contexts that
+ * already exist pick up their fingerprints from it straight away; the
+ * rest do so when they are first looked up. */
+gcry_error_t otrl_fpstore_open(OtrlUserState us, const char *filename);
+
+/* Write the changes made to the fingerprints of the given
+ * OtrlUserState's contexts since its store was opened (or last
+ * synced) to the store: a change of trust in place, if possible, and
+ * anything else by adding to the store's log.  Call this where you
+ * would have called otrl_privkey_write_fingerprints. */
+gcry_error_t otrl_fpstore_sync(OtrlUserState us);
+
+/* Look up a context for every username/accountname/protocol in the
+ * given OtrlUserState's store, calling add_app_data for the ones that
+ * are added, as otrl_context_find does, so that all of its
+ * fingerprints are in memory. */
+gcry_error_t otrl_fpstore_load_all(OtrlUserState us,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void *data);
+
+/* Rewrite the given OtrlUserState's store with its log folded into its
+ * table, loading every fingerprint into memory along the way, as
+ * otrl_fpstore_load_all does. */
+gcry_error_t otrl_fpstore_compact(OtrlUserState us,
+	void (*add_app_data)(void *data, ConnContext *context),
+	void *data);
+
+/* Close the given OtrlUserState's store, if it has one open, without
+ * writing anything to it. */
+void otrl_fpstore_close(OtrlUserState us);
+
+/* Call found(arg, fingerprint, trust) for each fingerprint the store
+ * holds for the given username/accountname/protocol. */
+void otrl_fpstore_lookup(OtrlFingerprintStore *store, const char *username,
+	const char *accountname, const char *protocol,
+	void (*found)(void *arg, const unsigned char fingerprint[20],
+	    const char *trust),
+	void *arg);
+
+/* Record in the store that the given fingerprint has been forgotten.
+ * The caller must hold the userstate's write lock. */
+void otrl_fpstore_remove(OtrlFingerprintStore *store, Fingerprint *fprint);
+
+#endif
@@ -21,20 +21,56 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* libgcrypt headers */
 #include <gcrypt.h>
 
 /* libotr headers */
 #include "instag.h"
+#include "keystore.h"
+#include "mem.h"
 #include "userstate.h"
 
-/* Forget the given instag. */
+/* The line otrl_instag_write_FILEp starts the file with.  It should be
+ * ignored when read back in, since there are no tabs. */
+#define INSTAG_FILE_HEADER "# WARNING! You shouldn't copy this file to " \
+    "another computer. It is unnecessary and can cause problems.\n"
+
+/* The entry in the account table for the given instag, or NULL.  Only
+ * the instags we make ourselves, with their strings in the same block,
+ * are ever in the table; ones linked in by hand may have anything in
+ * their account field. */
+static OtrlAccount *instag_account(const OtrlInsTag *p)
+{
+    return p->accountname == (const char *)(p + 1) ? p->account : NULL;
+}
+
+/* Forget the given instag.  In the threaded mode, the caller must hold
+ * the userstate's write lock. */
 void otrl_instag_forget(OtrlInsTag* instag) {
+    OtrlAccount *account;
+
     if (!instag) return;
 
-    if (instag->accountname) free(instag->accountname);
-    if (instag->protocol) free(instag->protocol);
+    /* If our account's entry points to us, point it at the next instag
+     * for the account in the list, if any */
+    account = instag_account(instag);
+    if (account && --account->instag_count == 0) {
+	account->instag = NULL;
+    } else if (account && account->instag == instag) {
+	OtrlInsTag *p;
+	for (p = instag->next; p && instag_account(p) != account;
+		p = p->next);
+	account->instag = p;
+    }
+
+    /* The ones we make ourselves have their strings in the same block;
+     * ones linked in by hand may not */
+    if (instag->accountname != (char *)(instag + 1)) {
+	free(instag->accountname);
+	free(instag->protocol);
+    }
 
     /* Re-link the list */
     *(instag->tous) = instag->next;
@@ -47,25 +83,118 @@ void otrl_instag_forget(OtrlInsTag* instag) {
 
 /* Forget all instags in a given OtrlUserState. */
 void otrl_instag_forget_all(OtrlUserState us) {
-    while(us->instag_root) {
-	otrl_instag_forget(us->instag_root);
+    OtrlInsTag *p, *next;
+
+    otrl_userstate_wrlock(us);
+    /* None of them are kept, so there's no next instag to find for
+     * each account */
+    for (p = us->instag_root; p; p = next) {
+	OtrlAccount *account = instag_account(p);
+
+	next = p->next;
+	if (account) {
+	    account->instag = NULL;
+	    account->instag_count = 0;
+	}
+	if (p->accountname != (char *)(p + 1)) {
+	    free(p->accountname);
+	    free(p->protocol);
+	}
+	free(p);
     }
+    us->instag_root = NULL;
+    otrl_userstate_unlock(us);
 }
 
 /* Fetch the instance tag from the given OtrlUserState associated with
- * the given account */
+ * the given account, or failing that, from its key store */
 OtrlInsTag * otrl_instag_find(OtrlUserState us, const char *accountname,
 	const char *protocol)
 {
-    OtrlInsTag *p;
+    OtrlInsTag *p = NULL;
+    OtrlAccount *account;
+
+    otrl_userstate_rdlock(us);
+    account = otrl_userstate_account_find(us, accountname, protocol, 0);
+    if (account) p = account->instag;
+    if (!p) {
+	/* It may have been linked into the list by hand */
+	for(p=us->instag_root; p; p=p->next) {
+	    if (!strcmp(p->accountname, accountname) &&
+		    !strcmp(p->protocol, protocol)) {
+		break;
+	    }
+	}
+    }
+    otrl_userstate_unlock(us);
+    return p ? p :
+	otrl_keystore_find_instag(us->keystore, accountname, protocol);
+}
 
-    for(p=us->instag_root; p; p=p->next) {
-	if (!strcmp(p->accountname, accountname) &&
-		!strcmp(p->protocol, protocol)) {
-	    return p;
+/* Add an instag to the front of the given OtrlUserState's list, and
+ * make it the one its account's entry in the account table points to.
+ * The caller must hold the userstate's write lock. */
+static gcry_error_t instag_link(OtrlUserState us, OtrlInsTag *p)
+{
+    p->account = otrl_userstate_account_find(us, p->accountname,
+	    p->protocol, 1);
+    if (!p->account) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    p->account->instag = p;
+    ++p->account->instag_count;
+
+    p->next = us->instag_root;
+    if (p->next) {
+	p->next->tous = &(p->next);
+    }
+    p->tous = &(us->instag_root);
+    us->instag_root = p;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Allocate a new instag for the given account, with the accountname
+ * and protocol (of the given lengths) stored after it in one block.
+ * Return NULL if out of memory. */
+static OtrlInsTag *instag_new(const char *accountname, size_t accountlen,
+	const char *protocol, size_t protocollen, otrl_instag_t instag)
+{
+    OtrlInsTag *p = malloc(sizeof(*p) + accountlen + protocollen + 2);
+
+    if (!p) return NULL;
+    p->accountname = (char *)(p + 1);
+    memcpy(p->accountname, accountname, accountlen);
+    p->accountname[accountlen] = '\0';
+    p->protocol = p->accountname + accountlen + 1;
+    memcpy(p->protocol, protocol, protocollen);
+    p->protocol[protocollen] = '\0';
+    p->instag = instag;
+    p->account = NULL;
+    return p;
+}
+
+/* Parse the hex instance tag of exactly 8 nybbles in str, or return 0
+ * if it isn't one. */
+static otrl_instag_t instag_parse(const char *str, size_t len)
+{
+    otrl_instag_t instag = 0;
+    size_t i;
+
+    if (len != 8) return 0;
+    for (i = 0; i < len; ++i) {
+	char c = str[i];
+	instag <<= 4;
+	if (c >= '0' && c <= '9') {
+	    instag |= c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+	    instag |= c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+	    instag |= c - 'A' + 10;
+	} else {
+	    return 0;
 	}
     }
-    return NULL;
+    return instag;
 }
 
 /* Read our instance tag from a file on disk into the given
@@ -90,95 +219,65 @@ gcry_error_t otrl_instag_read(OtrlUserState us, const char *filename)
  * OtrlUserState. The FILE* must be open for reading. */
 gcry_error_t otrl_instag_read_FILEp(OtrlUserState us, FILE *instf)
 {
-    if (!instf) return gcry_error(GPG_ERR_NO_ERROR);
-
-    OtrlInsTag *p;
-    char storeline[1000];
-    size_t maxsize = sizeof(storeline);
-
-    while(fgets(storeline, maxsize, instf)) {
-	char *prevpos;
-	char *pos;
-	unsigned int instag = 0;
-
-	p = malloc(sizeof(*p));
-	if (!p) {
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
-
-	/* Parse the line, which should be of the form:
-	 * accountname\tprotocol\t40_hex_nybbles\n          */
-	prevpos = storeline;
-	pos = strchr(prevpos, '\t');
-	if (!pos) {
-	    free(p);
-	    continue;
-	}
-	*pos = '\0';
-	pos++;
-	p->accountname = malloc(pos - prevpos);
-	if (!(p->accountname)) {
-	    free(p);
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
-	memmove(p->accountname, prevpos, pos - prevpos);
+    char *buf = NULL, *line, *end;
+    size_t size = 0, len = 0;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
 
-	prevpos = pos;
-	pos = strchr(prevpos, '\t');
-	if (!pos) {
-	    free(p->accountname);
-	    free(p);
-	    continue;
-	}
-	*pos = '\0';
-	pos++;
-	p->protocol = malloc(pos - prevpos);
-	if (!(p->protocol)) {
-	    free(p->accountname);
-	    free(p);
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
-	memmove(p->protocol, prevpos, pos - prevpos);
-
-	prevpos = pos;
-	pos = strchr(prevpos, '\r');
-	if (!pos) pos = strchr(prevpos, '\n');
-	if (!pos) {
-	    free(p->accountname);
-	    free(p->protocol);
-	    free(p);
-	    continue;
-	}
-	*pos = '\0';
-	pos++;
-	/* hex str of length 8 */
-	if (strlen(prevpos) != 8) {
-	    free(p->accountname);
-	    free(p->protocol);
-	    free(p);
-	    continue;
-	}
-
-	sscanf(prevpos, "%08x", &instag);
+    if (!instf) return gcry_error(GPG_ERR_NO_ERROR);
 
-	if (instag < OTRL_MIN_VALID_INSTAG) {
-	    free(p->accountname);
-	    free(p->protocol);
-	    free(p);
-	    continue;
+    /* Read the whole file in, then parse it in one pass */
+    do {
+	if (len == size) {
+	    char *newbuf;
+	    size = size ? size * 2 : 4096;
+	    newbuf = realloc(buf, size);
+	    if (!newbuf) {
+		free(buf);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    buf = newbuf;
 	}
-	p->instag = instag;
+	len += fread(buf + len, 1, size - len, instf);
+    } while (len == size);
+    if (ferror(instf)) {
+	free(buf);
+	return gcry_error_from_errno(errno);
+    }
 
-	/* Link it up */
-	p->next = us->instag_root;
-	if (p->next) {
-	    p->next->tous = &(p->next);
+    otrl_userstate_wrlock(us);
+    end = buf + len;
+    for (line = buf; line < end && !err; ) {
+	char *nl = memchr(line, '\n', end - line);
+	char *eol, *tab1, *tab2;
+	otrl_instag_t instag;
+	OtrlInsTag *p;
+
+	/* Each line should be of the form:
+	 * accountname\tprotocol\t8_hex_nybbles\n
+	 * A last line with no newline is cut short, so skip it. */
+	if (!nl) break;
+	eol = memchr(line, '\r', nl - line);
+	if (!eol) eol = nl;
+	tab1 = memchr(line, '\t', eol - line);
+	tab2 = tab1 ? memchr(tab1 + 1, '\t', eol - (tab1 + 1)) : NULL;
+	instag = tab2 ? instag_parse(tab2 + 1, eol - (tab2 + 1)) : 0;
+
+	if (instag >= OTRL_MIN_VALID_INSTAG) {
+	    p = instag_new(line, tab1 - line, tab1 + 1, tab2 - (tab1 + 1),
+		    instag);
+	    if (!p) {
+		err = gcry_error(GPG_ERR_ENOMEM);
+	    } else {
+		err = instag_link(us, p);
+		if (err) free(p);
+	    }
 	}
-	p->tous = &(us->instag_root);
-	us->instag_root = p;
+	line = nl + 1;
     }
+    otrl_userstate_unlock(us);
 
-    return gcry_error(GPG_ERR_NO_ERROR);
+    free(buf);
+    return err;
 }
 
 /* Generate a new instance tag for the given account and write to file */
@@ -220,21 +319,21 @@ gcry_error_t otrl_instag_generate_FILEp(OtrlUserState us, FILE *instf,
 	const char *accountname, const char *protocol)
 {
     OtrlInsTag *p;
+    gcry_error_t err;
     if (!accountname || !protocol) return gcry_error(GPG_ERR_NO_ERROR);
 
-    p = (OtrlInsTag *)malloc(sizeof(OtrlInsTag));
-    p->accountname = strdup(accountname);
-    p->protocol = strdup(protocol);
-
-    p->instag = otrl_instag_get_new();
+    p = instag_new(accountname, strlen(accountname), protocol,
+	    strlen(protocol), otrl_instag_get_new());
+    if (!p) return gcry_error(GPG_ERR_ENOMEM);
 
     /* Add to our list in OtrlUserState */
-    p->next = us->instag_root;
-    if (p->next) {
-	p->next->tous = &(p->next);
+    otrl_userstate_wrlock(us);
+    err = instag_link(us, p);
+    otrl_userstate_unlock(us);
+    if (err) {
+	free(p);
+	return err;
     }
-    p->tous = &(us->instag_root);
-    us->instag_root = p;
 
     otrl_instag_write_FILEp(us, instf);
 
@@ -263,15 +362,142 @@ gcry_error_t otrl_instag_write(OtrlUserState us, const char *filename)
 gcry_error_t otrl_instag_write_FILEp(OtrlUserState us, FILE *instf)
 {
     OtrlInsTag *p;
-    /* This line should be ignored when read back in, since there are no
-    tabs. */
-    fprintf(instf, "# WARNING! You shouldn't copy this file to another"
-    " computer. It is unnecessary and can cause problems.\n");
+    fputs(INSTAG_FILE_HEADER, instf);
+    otrl_userstate_rdlock(us);
     for(p=us->instag_root; p; p=p->next) {
 	fprintf(instf, "%s\t%s\t%08x\n", p->accountname, p->protocol,
 		p->instag);
     }
+    otrl_userstate_unlock(us);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* Get new instance tags for count accounts at once, drawing them all
+ * from one call to the random number generator, and add them to the
+ * end of the named file in one write, instead of rewriting the file
+ * as otrl_instag_generate does.  As with otrl_instag_generate, any
+ * instance tag an account had before is superseded but not forgotten;
+ * otrl_instag_compact drops it from the file. */
+gcry_error_t otrl_instag_generate_many(OtrlUserState us,
+	const char *filename, const char **accountnames,
+	const char **protocols, unsigned int count)
+{
+    otrl_instag_t *instags;
+    OtrlInsTag **added;
+    FILE *instf;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    unsigned int i, linked = 0;
+
+    if (!us || !filename) return gcry_error(GPG_ERR_INV_VALUE);
+    if (count == 0) return gcry_error(GPG_ERR_NO_ERROR);
+
+    instags = malloc(count * sizeof(otrl_instag_t));
+    added = malloc(count * sizeof(OtrlInsTag *));
+    if (!instags || !added) {
+	free(instags);
+	free(added);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    gcry_randomize(instags, count * sizeof(otrl_instag_t),
+	    GCRY_STRONG_RANDOM);
+
+    otrl_userstate_wrlock(us);
+    for (i = 0; i < count && !err; ++i) {
+	OtrlInsTag *p;
+
+	/* The few that land on a reserved value are drawn again */
+	if (instags[i] < OTRL_MIN_VALID_INSTAG) {
+	    instags[i] = otrl_instag_get_new();
+	}
+	p = instag_new(accountnames[i], strlen(accountnames[i]),
+		protocols[i], strlen(protocols[i]), instags[i]);
+	if (!p) {
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	} else if ((err = instag_link(us, p))) {
+	    free(p);
+	} else {
+	    added[linked++] = p;
+	}
+    }
+    otrl_userstate_unlock(us);
+    otrl_mem_wipe(instags, count * sizeof(otrl_instag_t));
+    free(instags);
+
+    /* Add the ones we got to the file, with the header if it's new */
+    instf = fopen(filename, "ab");
+    if (!instf) {
+	err = gcry_error_from_errno(errno);
+    } else {
+	if (fseek(instf, 0, SEEK_END) == 0 && ftell(instf) == 0) {
+	    fputs(INSTAG_FILE_HEADER, instf);
+	}
+	for (i = 0; i < linked; ++i) {
+	    fprintf(instf, "%s\t%s\t%08x\n", added[i]->accountname,
+		    added[i]->protocol, added[i]->instag);
+	}
+	if (fclose(instf) && !err) {
+	    err = gcry_error_from_errno(errno);
+	}
+    }
+    free(added);
+
+    return err;
+}
+
+/* Get a new instance tag for the given account and add it to the end
+ * of the named file, as otrl_instag_generate_many does. */
+gcry_error_t otrl_instag_append(OtrlUserState us, const char *filename,
+	const char *accountname, const char *protocol)
+{
+    if (!accountname || !protocol) return gcry_error(GPG_ERR_NO_ERROR);
+    return otrl_instag_generate_many(us, filename, &accountname, &protocol,
+	    1);
+}
+
+/* Rewrite the named file with just the current instance tag of each
+ * of our accounts, dropping the ones that otrl_instag_append and
+ * otrl_instag_generate_many have superseded.  The file is written under
+ * a temporary name and renamed into place, so it holds either the old
+ * instance tags or the new ones. */
+gcry_error_t otrl_instag_compact(OtrlUserState us, const char *filename)
+{
+    OtrlInsTag *p;
+    FILE *instf;
+    char *tmpname;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    if (!us || !filename) return gcry_error(GPG_ERR_INV_VALUE);
+
+    tmpname = malloc(strlen(filename) + 5);
+    if (!tmpname) return gcry_error(GPG_ERR_ENOMEM);
+    sprintf(tmpname, "%s.new", filename);
+
+    instf = fopen(tmpname, "wb");
+    if (!instf) {
+	err = gcry_error_from_errno(errno);
+	free(tmpname);
+	return err;
+    }
+    fputs(INSTAG_FILE_HEADER, instf);
+    otrl_userstate_rdlock(us);
+    for (p = us->instag_root; p; p = p->next) {
+	OtrlAccount *account = instag_account(p);
+
+	if (account && account->instag != p) continue;
+	fprintf(instf, "%s\t%s\t%08x\n", p->accountname, p->protocol,
+		p->instag);
+    }
+    otrl_userstate_unlock(us);
+
+    if (fclose(instf)) {
+	err = gcry_error_from_errno(errno);
+    }
+    if (!err && rename(tmpname, filename)) {
+	err = gcry_error_from_errno(errno);
+    }
+    if (err) remove(tmpname);
+    free(tmpname);
+
+    return err;
+}
@@ -44,18 +44,21 @@ typedef struct s_OtrlInsTag {
     char *accountname;
     char *protocol;
     otrl_instag_t instag;
+    struct s_OtrlAccount *account;  /* Our entry in the userstate's
+				       account table, or NULL */
 } OtrlInsTag;
 
 #include "userstate.h"
 
-/* Forget the given instag. */
+/* Forget the given instag.  In the threaded mode, the caller must hold
+ * the userstate's write lock. */
 void otrl_instag_forget(OtrlInsTag* instag);
 
 /* Forget all instags in a given OtrlUserState. */
 void otrl_instag_forget_all(OtrlUserState us);
 
 /* Fetch the instance tag from the given OtrlUserState associated with
- * the given account */
+ * the given account, or failing that, from its key store */
 OtrlInsTag * otrl_instag_find(OtrlUserState us, const char *accountname,
 	const char *protocol);
 
@@ -79,6 +82,28 @@ gcry_error_t otrl_instag_generate(OtrlUserState us, const char *filename,
 gcry_error_t otrl_instag_generate_FILEp(OtrlUserState us, FILE *instf,
 	const char *accountname, const char *protocol);
 
+/* Get new instance tags for count accounts at once, drawing them all
+ * from one call to the random number generator, and add them to the
+ * end of the named file in one write, instead of rewriting the file
+ * as otrl_instag_generate does.  As with otrl_instag_generate, any
+ * instance tag an account had before is superseded but not forgotten;
+ * otrl_instag_compact drops it from the file. */
+gcry_error_t otrl_instag_generate_many(OtrlUserState us,
+	const char *filename, const char **accountnames,
+	const char **protocols, unsigned int count);
+
+/* Get a new instance tag for the given account and add it to the end
+ * of the named file, as otrl_instag_generate_many does. */
+gcry_error_t otrl_instag_append(OtrlUserState us, const char *filename,
+	const char *accountname, const char *protocol);
+
+/* Rewrite the named file with just the current instance tag of each
+ * of our accounts, dropping the ones that otrl_instag_append and
+ * otrl_instag_generate_many have superseded.  The file is written under
+ * a temporary name and renamed into place, so it holds either the old
+ * instance tags or the new ones. */
+gcry_error_t otrl_instag_compact(OtrlUserState us, const char *filename);
+
 /* Write our instance tags to a file on disk. */
 gcry_error_t otrl_instag_write(OtrlUserState us, const char *filename);
 
@@ -0,0 +1,151 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "instag.h"
+#include "keystore.h"
+#include "privkey.h"
+#include "userstate.h"
+
+/* The keys and tags are kept in a userstate of the store's own, which
+ * is never put in the threaded mode: nothing changes it once the store
+ * is shared, and its account table serves lookups without any locks. */
+struct s_OtrlKeyStore {
+    unsigned int refcount;         /* Updated atomically */
+    OtrlUserState us;
+};
+
+/* Create a new, empty key store, holding one reference to it for the
+ * caller.  Return NULL if out of memory. */
+OtrlKeyStore *otrl_keystore_create(void)
+{
+    OtrlKeyStore *store = malloc(sizeof(*store));
+
+    if (!store) return NULL;
+    store->us = otrl_userstate_create();
+    if (!store->us) {
+	free(store);
+	return NULL;
+    }
+    store->refcount = 1;
+    return store;
+}
+
+/* Release a reference to the given key store, freeing it if it was the
+ * last. */
+void otrl_keystore_release(OtrlKeyStore *store)
+{
+    if (!store) return;
+    if (__atomic_sub_fetch(&store->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+	return;
+    }
+    otrl_userstate_free(store->us);
+    free(store);
+}
+
+/* Whether the given key store may still be changed: it may not once
+ * anything but its creator holds a reference to it. */
+static int keystore_writable(OtrlKeyStore *store)
+{
+    return __atomic_load_n(&store->refcount, __ATOMIC_ACQUIRE) == 1;
+}
+
+/* Read a set of private DSA keys from a file on disk into the given
+ * key store, replacing any it had.  Return GPG_ERR_CONFLICT if the
+ * store is attached to a userstate. */
+gcry_error_t otrl_keystore_read_privkeys(OtrlKeyStore *store,
+	const char *filename)
+{
+    if (!keystore_writable(store)) return gcry_error(GPG_ERR_CONFLICT);
+    return otrl_privkey_read(store->us, filename);
+}
+
+/* Read a set of private DSA keys from a FILE* into the given key
+ * store, as otrl_keystore_read_privkeys does.  The FILE* must be open
+ * for reading. */
+gcry_error_t otrl_keystore_read_privkeys_FILEp(OtrlKeyStore *store,
+	FILE *privf)
+{
+    if (!keystore_writable(store)) return gcry_error(GPG_ERR_CONFLICT);
+    return otrl_privkey_read_FILEp(store->us, privf);
+}
+
+/* Read instance tags from a file on disk into the given key store.
+ * Return GPG_ERR_CONFLICT if the store is attached to a userstate. */
+gcry_error_t otrl_keystore_read_instags(OtrlKeyStore *store,
+	const char *filename)
+{
+    if (!keystore_writable(store)) return gcry_error(GPG_ERR_CONFLICT);
+    return otrl_instag_read(store->us, filename);
+}
+
+/* Read instance tags from a FILE* into the given key store, as
+ * otrl_keystore_read_instags does.  The FILE* must be open for
+ * reading. */
+gcry_error_t otrl_keystore_read_instags_FILEp(OtrlKeyStore *store,
+	FILE *instf)
+{
+    if (!keystore_writable(store)) return gcry_error(GPG_ERR_CONFLICT);
+    return otrl_instag_read_FILEp(store->us, instf);
+}
+
+/* Fetch the private key in the given key store for the given account,
+ * or NULL if there is none (or no store). */
+OtrlPrivKey *otrl_keystore_find_privkey(OtrlKeyStore *store,
+	const char *accountname, const char *protocol)
+{
+    if (!store) return NULL;
+    return otrl_privkey_find(store->us, accountname, protocol);
+}
+
+/* Fetch the instance tag in the given key store for the given account,
+ * or NULL if there is none (or no store). */
+OtrlInsTag *otrl_keystore_find_instag(OtrlKeyStore *store,
+	const char *accountname, const char *protocol)
+{
+    if (!store) return NULL;
+    return otrl_instag_find(store->us, accountname, protocol);
+}
+
+/* Attach the given key store to the given OtrlUserState, taking a
+ * reference to it, and releasing the one it had attached before.
+ * NULL just detaches that one.  Don't do this while other threads are
+ * using the userstate. */
+void otrl_keystore_attach(OtrlUserState us, OtrlKeyStore *store)
+{
+    OtrlKeyStore *old;
+
+    if (store) {
+	__atomic_add_fetch(&store->refcount, 1, __ATOMIC_ACQ_REL);
+    }
+    otrl_userstate_wrlock(us);
+    old = us->keystore;
+    us->keystore = store;
+    otrl_userstate_unlock(us);
+    otrl_keystore_release(old);
+}
@@ -0,0 +1,95 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef __KEYSTORE_H__
+#define __KEYSTORE_H__
+
+#include <stdio.h>
+#include <gcrypt.h>
+
+#include "privkey-t.h"
+#include "instag.h"
+#include "userstate.h"
+
+/* A key store holds private keys and instance tags that many
+ * OtrlUserStates can share, for accounts (a service's, say) that all of
+ * them use.  Read the keys and tags into the store once, then attach it
+ * to each userstate: otrl_privkey_find and otrl_instag_find look in
+ * the store after finding nothing in the userstate itself, so a
+ * userstate's own keys and tags for an account win.
+ *
+ * Once attached, a store doesn't change, so any number of userstates
+ * in any number of threads can use it at once.  It is reference
+ * counted: each userstate it is attached to holds a reference, as does
+ * the caller of otrl_keystore_create, and it is freed when the last one
+ * is released. */
+
+typedef struct s_OtrlKeyStore OtrlKeyStore;
+
+/* Create a new, empty key store, holding one reference to it for the
+ * caller.  Return NULL if out of memory. */
+OtrlKeyStore *otrl_keystore_create(void);
+
+/* Release a reference to the given key store, freeing it if it was the
+ * last. */
+void otrl_keystore_release(OtrlKeyStore *store);
+
+/* Read a set of private DSA keys from a file on disk into the given
+ * key store, replacing any it had.  Return GPG_ERR_CONFLICT if the
+ * store is attached to a userstate. */
+gcry_error_t otrl_keystore_read_privkeys(OtrlKeyStore *store,
+	const char *filename);
+
+/* Read a set of private DSA keys from a FILE* into the given key
+ * store, as otrl_keystore_read_privkeys does.  The FILE* must be open
+ * for reading. */
+gcry_error_t otrl_keystore_read_privkeys_FILEp(OtrlKeyStore *store,
+	FILE *privf);
+
+/* Read instance tags from a file on disk into the given key store.
+ * Return GPG_ERR_CONFLICT if the store is attached to a userstate. */
+gcry_error_t otrl_keystore_read_instags(OtrlKeyStore *store,
+	const char *filename);
+
+/* Read instance tags from a FILE* into the given key store, as
+ * otrl_keystore_read_instags does.  The FILE* must be open for
+ * reading. */
+gcry_error_t otrl_keystore_read_instags_FILEp(OtrlKeyStore *store,
+	FILE *instf);
+
+/* Fetch the private key in the given key store for the given account,
+ * or NULL if there is none (or no store). */
+OtrlPrivKey *otrl_keystore_find_privkey(OtrlKeyStore *store,
+	const char *accountname, const char *protocol);
+
+/* Fetch the instance tag in the given key store for the given account,
+ * or NULL if there is none (or no store). */
+OtrlInsTag *otrl_keystore_find_instag(OtrlKeyStore *store,
+	const char *accountname, const char *protocol);
+
+/* Attach the given key store to the given OtrlUserState, taking a
+ * reference to it, and releasing the one it had attached before.
+ * NULL just detaches that one.  Don't do this while other threads are
+ * using the userstate. */
+void otrl_keystore_attach(OtrlUserState us, OtrlKeyStore *store);
+
+#endif
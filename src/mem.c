@@ -19,6 +19,7 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+
 /* Memory allocation routines for libgcrypt.  All of the session key
  * information gets allocated through here, so we can wipe it out when
  * it's free()d.  We don't use the built-in secmem functions of
@@ -29,36 +30,337 @@
  * handled the same way (since we're not going to be running as root,
  * and so won't actually have pinned memory), pretend all allocated
  * memory (but just from libgcrypt) is requested secure, and wipe it on
- * free(). */
+ * free().
+ *
+ * Small allocations (which is nearly all of them: MPIs and their limbs,
+ * cipher and MAC contexts) are served from per-size-class pools.  The
+ * pools get their memory in chunks which we try to mlock() so it won't
+ * be swapped out, and freed blocks are wiped and kept for reuse rather
+ * than handed back to the system allocator.
+ *
+ * The pools are shared by every thread, behind one mutex.  So that
+ * threads doing crypto at the same time don't queue up there, each
+ * thread keeps a small cache of free blocks of the smallest size
+ * classes (which hold the hashes, keys and 1536-bit MPIs), and only
+ * takes the mutex to move a batch of blocks between its cache and the
+ * pools.  Blocks are wiped before they go into a cache, and a thread's
+ * cache is handed back to the pools when the thread exits. */
 
 /* Uncomment the following to add a check that our free() and realloc() only
  * get called on things returned from our malloc(). */
 /* #define OTRL_MEM_MAGIC 0x31415926 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #ifdef OTRL_MEM_MAGIC
 #include <stdio.h>
 #endif
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* libgcrypt headers */
 #include <gcrypt.h>
 
 /* libotr headers */
 #include "mem.h"
+#include "stats.h"
+
+/* The smallest size class; each class is twice the size of the one
+ * before it.  Sizes include our header. */
+#define OTRL_MEM_MIN_CLASS_SIZE 32
+
+/* How much memory to add to a pool at a time */
+#define OTRL_MEM_CHUNK_SIZE 65536
 
 static size_t header_size;
 
+/* The free blocks of each size class, linked through their first
+ * word */
+static void *pool_free[OTRL_MEM_NUM_CLASSES];
+
+static OtrlMemStats mem_stats;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define mem_lock() pthread_mutex_lock(&mem_mutex)
+#define mem_unlock() pthread_mutex_unlock(&mem_mutex)
+#else
+#define mem_lock()
+#define mem_unlock()
+#endif
+
+#ifdef HAVE_PTHREAD_H
+/* The size classes that get per-thread caches: up to 256 bytes */
+#define OTRL_MEM_CACHE_CLASSES 4
+
+/* The most free blocks of one size class a thread's cache may hold,
+ * and how many to move to or from the pools at once */
+#define OTRL_MEM_CACHE_MAX 64
+#define OTRL_MEM_CACHE_BATCH 32
+
+/* One thread's cache of free blocks, linked through their first word
+ * like the pools */
+typedef struct {
+    void *free[OTRL_MEM_CACHE_CLASSES];
+    unsigned int count[OTRL_MEM_CACHE_CLASSES];
+} MemCache;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static int cache_key_ok = 0;
+#endif
+
+/* Calling memset through a volatile pointer keeps the compiler from
+ * deciding the stores are dead and removing them. */
+static void *(* const volatile wipe_memset)(void *, int, size_t) = memset;
+
+/* Overwrite a block of memory that is about to be freed or reused, in
+ * a way the compiler won't optimize away. */
+void otrl_mem_wipe(void *p, size_t n)
+{
+#ifdef HAVE_EXPLICIT_BZERO
+    explicit_bzero(p, n);
+#else
+    wipe_memset(p, 0, n);
+#endif
+}
+
+/* Return the size class for a block of n bytes (including the header),
+ * or -1 if it's too big for any of them. */
+static int size_class(size_t n)
+{
+    int c = 0;
+    size_t size = OTRL_MEM_MIN_CLASS_SIZE;
+
+    while (size < n) {
+	if (++c == OTRL_MEM_NUM_CLASSES) return -1;
+	size <<= 1;
+    }
+    return c;
+}
+
+/* Add a chunk of fresh blocks to the pool for the given size class.
+ * Must be called with the lock held.  Return 0 on success, -1 if out
+ * of memory. */
+static int pool_grow(int c)
+{
+    size_t size = (size_t)OTRL_MEM_MIN_CLASS_SIZE << c;
+    size_t chunk_size = size > OTRL_MEM_CHUNK_SIZE ? size :
+	OTRL_MEM_CHUNK_SIZE;
+    char *chunk, *block;
+
+#ifdef HAVE_SYS_MMAN_H
+    chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED) return -1;
+#ifdef HAVE_MLOCK
+    /* This will fail if we're over RLIMIT_MEMLOCK; the pool still
+     * works, it's just not pinned. */
+    if (mlock(chunk, chunk_size) == 0) {
+	mem_stats.locked_bytes += chunk_size;
+    }
+#endif
+#else
+    chunk = malloc(chunk_size);
+    if (chunk == NULL) return -1;
+#endif
+    mem_stats.pooled_bytes += chunk_size;
+
+    for (block = chunk + chunk_size - size; block >= chunk; block -= size) {
+	*(void **)block = pool_free[c];
+	pool_free[c] = block;
+    }
+    return 0;
+}
+
+/* Record that a block of n bytes (including the header) has been handed
+ * out.  This doesn't need the lock; a thread's cache hands out blocks
+ * without it. */
+static void stats_add(size_t n)
+{
+    size_t live;
+
+#ifdef HAVE_ATOMIC_BUILTINS
+    size_t high;
+
+    live = __atomic_add_fetch(&mem_stats.live_bytes, n - header_size,
+	    __ATOMIC_RELAXED);
+    high = __atomic_load_n(&mem_stats.high_water_bytes, __ATOMIC_RELAXED);
+    while (live > high && !__atomic_compare_exchange_n(
+		&mem_stats.high_water_bytes, &high, live, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+#else
+    live = (mem_stats.live_bytes += n - header_size);
+    if (live > mem_stats.high_water_bytes) {
+	mem_stats.high_water_bytes = live;
+    }
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Hand all of the blocks in a thread's cache back to the pools.  This
+ * is the destructor of cache_key, so it's run as the thread exits. */
+static void cache_flush(void *arg)
+{
+    MemCache *cache = arg;
+    int c;
+
+    mem_lock();
+    for (c = 0; c < OTRL_MEM_CACHE_CLASSES; ++c) {
+	void *block, *next;
+
+	for (block = cache->free[c]; block; block = next) {
+	    next = *(void **)block;
+	    *(void **)block = pool_free[c];
+	    pool_free[c] = block;
+	}
+	otrl_stats_sub(mem_stats.cached_bytes,
+		cache->count[c] * ((size_t)OTRL_MEM_MIN_CLASS_SIZE << c));
+    }
+    mem_unlock();
+    free(cache);
+}
+
+static void cache_key_init(void)
+{
+    cache_key_ok = (pthread_key_create(&cache_key, cache_flush) == 0);
+}
+
+/* Return the calling thread's cache, making it if it hasn't got one
+ * yet, or NULL if it can't have one. */
+static MemCache *cache_get(void)
+{
+    MemCache *cache;
+
+    if (!cache_key_ok) return NULL;
+    cache = pthread_getspecific(cache_key);
+    if (cache == NULL) {
+	cache = calloc(1, sizeof(MemCache));
+	if (cache && pthread_setspecific(cache_key, cache)) {
+	    free(cache);
+	    cache = NULL;
+	}
+    }
+    return cache;
+}
+
+/* Take a block of size class c from the thread's cache, first filling
+ * the cache from the pool if it's empty.  Return NULL if out of
+ * memory. */
+static void *cache_take(MemCache *cache, int c)
+{
+    size_t size = (size_t)OTRL_MEM_MIN_CLASS_SIZE << c;
+    void *p;
+
+    if (cache->free[c] == NULL) {
+	unsigned int n;
+
+	mem_lock();
+	for (n = 0; n < OTRL_MEM_CACHE_BATCH; ++n) {
+	    if (pool_free[c] == NULL && pool_grow(c)) break;
+	    p = pool_free[c];
+	    pool_free[c] = *(void **)p;
+	    *(void **)p = cache->free[c];
+	    cache->free[c] = p;
+	}
+	mem_unlock();
+	if (n == 0) return NULL;
+	cache->count[c] += n;
+	otrl_stats_add(mem_stats.cached_bytes, n * size);
+    }
+
+    p = cache->free[c];
+    cache->free[c] = *(void **)p;
+    --cache->count[c];
+    otrl_stats_sub(mem_stats.cached_bytes, size);
+    return p;
+}
+
+/* Put a wiped block of size class c in the thread's cache, handing a
+ * batch back to the pool if the cache is full. */
+static void cache_put(MemCache *cache, int c, void *p)
+{
+    size_t size = (size_t)OTRL_MEM_MIN_CLASS_SIZE << c;
+
+    *(void **)p = cache->free[c];
+    cache->free[c] = p;
+    otrl_stats_add(mem_stats.cached_bytes, size);
+
+    if (++cache->count[c] > OTRL_MEM_CACHE_MAX) {
+	unsigned int n;
+
+	mem_lock();
+	for (n = 0; n < OTRL_MEM_CACHE_BATCH; ++n) {
+	    p = cache->free[c];
+	    cache->free[c] = *(void **)p;
+	    *(void **)p = pool_free[c];
+	    pool_free[c] = p;
+	}
+	mem_unlock();
+	cache->count[c] -= OTRL_MEM_CACHE_BATCH;
+	otrl_stats_sub(mem_stats.cached_bytes,
+		OTRL_MEM_CACHE_BATCH * size);
+    }
+}
+#endif
+
 static void *otrl_mem_malloc(size_t n)
 {
     void *p;
     size_t new_n = n;
+    int c;
     new_n += header_size;
 
     /* Check for overflow attack */
     if (new_n < n) return NULL;
-    p = malloc(new_n);
-    if (p == NULL) return NULL;
+
+    c = size_class(new_n);
+#ifdef HAVE_PTHREAD_H
+    if (c >= 0 && c < OTRL_MEM_CACHE_CLASSES) {
+	MemCache *cache = cache_get();
+
+	if (cache) {
+	    p = cache_take(cache, c);
+	    if (p == NULL) return NULL;
+	    otrl_stats_add(mem_stats.class_allocs[c], 1);
+	    stats_add(new_n);
+	    goto done;
+	}
+    }
+#endif
+    mem_lock();
+    if (c >= 0) {
+	if (pool_free[c] == NULL && pool_grow(c)) {
+	    mem_unlock();
+	    return NULL;
+	}
+	p = pool_free[c];
+	pool_free[c] = *(void **)p;
+	otrl_stats_add(mem_stats.class_allocs[c], 1);
+    } else {
+	p = malloc(new_n);
+	if (p == NULL) {
+	    mem_unlock();
+	    return NULL;
+	}
+	++mem_stats.large_allocs;
+    }
+    mem_unlock();
+    stats_add(new_n);
+
+#ifdef HAVE_PTHREAD_H
+done:
+#endif
 
     ((size_t *)p)[0] = new_n;  /* Includes header size */
 #ifdef OTRL_MEM_MAGIC
@@ -77,6 +379,7 @@ static void otrl_mem_free(void *p)
 {
     void *real_p = (void *)((char *)p - header_size);
     size_t n = ((size_t *)real_p)[0];
+    int c;
 #ifdef OTRL_MEM_MAGIC
     if (((size_t *)real_p)[1] != OTRL_MEM_MAGIC) {
 	fprintf(stderr, "Illegal free!\n");
@@ -84,14 +387,30 @@ static void otrl_mem_free(void *p)
     }
 #endif
 
-    /* Wipe the memory (in the same way the built-in deallocator in
-     * libgcrypt would) */
-    memset(real_p, 0xff, n);
-    memset(real_p, 0xaa, n);
-    memset(real_p, 0x55, n);
-    memset(real_p, 0x00, n);
+    /* Wipe the memory.  Anything past n was already wiped (or never
+     * used) */
+    otrl_mem_wipe(real_p, n);
+
+    c = size_class(n);
+    otrl_stats_sub(mem_stats.live_bytes, n - header_size);
+#ifdef HAVE_PTHREAD_H
+    if (c >= 0 && c < OTRL_MEM_CACHE_CLASSES) {
+	MemCache *cache = cache_get();
 
-    free(real_p);
+	if (cache) {
+	    cache_put(cache, c, real_p);
+	    return;
+	}
+    }
+#endif
+    mem_lock();
+    if (c >= 0) {
+	*(void **)real_p = pool_free[c];
+	pool_free[c] = real_p;
+    } else {
+	free(real_p);
+    }
+    mem_unlock();
 }
 
 static void *otrl_mem_realloc(void *p, size_t n)
@@ -109,6 +428,7 @@ static void *otrl_mem_realloc(void *p, size_t n)
 	size_t magic = ((size_t *)real_p)[1];
 #endif
 	size_t new_n = n;
+	int old_c, new_c;
 	new_n += header_size;
 
 	/* Check for overflow attack */
@@ -121,20 +441,31 @@ static void *otrl_mem_realloc(void *p, size_t n)
 	}
 #endif
 
-	if (new_n < old_n) {
-	    /* Overwrite the space we're about to stop using */
-	    void *p = (void *)((char *)real_p + new_n);
-	    size_t excess = old_n - new_n;
-	    memset(p, 0xff, excess);
-	    memset(p, 0xaa, excess);
-	    memset(p, 0x55, excess);
-	    memset(p, 0x00, excess);
+	old_c = size_class(old_n);
+	new_c = size_class(new_n);
 
-	    /* We don't actually need to realloc() */
+	if ((old_c >= 0 && old_c == new_c) ||
+		(old_c < 0 && new_c < 0 && new_n < old_n)) {
+	    /* The block we have is big enough */
+	    if (new_n < old_n) {
+		/* Overwrite the space we're about to stop using */
+		otrl_mem_wipe((char *)real_p + new_n, old_n - new_n);
+	    }
 	    new_p = real_p;
-	} else {
+	    otrl_stats_sub(mem_stats.live_bytes, old_n - header_size);
+	    stats_add(new_n);
+	} else if (old_c < 0 && new_c < 0) {
 	    new_p = realloc(real_p, new_n);
 	    if (new_p == NULL) return NULL;
+	    otrl_stats_sub(mem_stats.live_bytes, old_n - header_size);
+	    stats_add(new_n);
+	} else {
+	    /* Move to a block of a different size class */
+	    void *q = otrl_mem_malloc(n);
+	    if (q == NULL) return NULL;
+	    memmove(q, p, (old_n < new_n ? old_n : new_n) - header_size);
+	    otrl_mem_free(p);
+	    return q;
 	}
 
 	((size_t *)new_p)[0] = new_n;  /* Includes header size */
@@ -154,6 +485,9 @@ void otrl_mem_init(void)
 	header_size = sizeof(size_t);
     }
 #endif
+#ifdef HAVE_PTHREAD_H
+    pthread_once(&cache_once, cache_key_init);
+#endif
 
     gcry_set_allocation_handler(
 	    otrl_mem_malloc,
@@ -164,6 +498,32 @@ void otrl_mem_init(void)
 	);
 }
 
+/* Get a snapshot of the allocation statistics of the libgcrypt
+ * allocation handlers. */
+void otrl_mem_get_stats(OtrlMemStats *stats)
+{
+    int c;
+
+    mem_lock();
+    *stats = mem_stats;
+    mem_unlock();
+
+    /* These are kept up to date without the lock */
+    stats->live_bytes = otrl_stats_get(mem_stats.live_bytes);
+    stats->high_water_bytes = otrl_stats_get(mem_stats.high_water_bytes);
+    stats->cached_bytes = otrl_stats_get(mem_stats.cached_bytes);
+    for (c = 0; c < OTRL_MEM_NUM_CLASSES; ++c) {
+	stats->class_allocs[c] = otrl_stats_get(mem_stats.class_allocs[c]);
+    }
+}
+
+/* Return the size (including an internal header) of the blocks in the
+ * given size class. */
+size_t otrl_mem_class_size(int size_class)
+{
+    return (size_t)OTRL_MEM_MIN_CLASS_SIZE << size_class;
+}
+
 /* Compare two memory blocks in time dependent on the length of the
  * blocks, but not their contents.  Returns 1 if they differ, 0 if they
  * are the same. */
@@ -24,8 +24,42 @@
 
 #include <stdlib.h>
 
+/* The number of size classes in the pools behind the libgcrypt
+ * allocation handlers */
+#define OTRL_MEM_NUM_CLASSES 8
+
+/* Allocation statistics for the libgcrypt allocation handlers */
+typedef struct {
+    size_t live_bytes;                /* Bytes currently allocated */
+    size_t high_water_bytes;          /* The most live_bytes has been */
+    size_t pooled_bytes;              /* Bytes taken from the system
+					 for the pools */
+    size_t locked_bytes;              /* ...and how many of those we
+					 managed to mlock() */
+    unsigned long class_allocs[OTRL_MEM_NUM_CLASSES];
+				      /* Allocations served from each
+					 size class */
+    unsigned long large_allocs;       /* Allocations too big for any
+					 size class */
+    size_t cached_bytes;              /* Free blocks (with their
+					 headers) held in the threads'
+					 own caches */
+} OtrlMemStats;
+
 void otrl_mem_init(void);
 
+/* Overwrite a block of memory that is about to be freed or reused, in
+ * a way the compiler won't optimize away. */
+void otrl_mem_wipe(void *p, size_t n);
+
+/* Get a snapshot of the allocation statistics of the libgcrypt
+ * allocation handlers. */
+void otrl_mem_get_stats(OtrlMemStats *stats);
+
+/* Return the size (including an internal header) of the blocks in the
+ * given size class. */
+size_t otrl_mem_class_size(int size_class);
+
 /* Compare two memory blocks in time dependent on the length of the
  * blocks, but not their contents.  Returns 1 if they differ, 0 if they
  * are the same. */
@@ -19,10 +19,15 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <stdint.h>
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -31,10 +36,17 @@
 #include "privkey.h"
 #include "userstate.h"
 #include "proto.h"
+#include "sha1mb.h"
 #include "auth.h"
 #include "message.h"
 #include "sm.h"
 #include "instag.h"
+#include "keystore.h"
+#include "mem.h"
+#include "offload.h"
+#include "protocols.h"
+#include "stats.h"
+#include "trace.h"
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -88,9 +100,8 @@ static gcry_error_t fragment_and_send(const OtrlMessageAppOps *ops,
 	    char **fragments;
 	    gcry_error_t err;
 	    int i;
-	    int headerlen = context->protocol_version == 3 ? 37 : 19;
-	    /* Like ceil(msglen/(mms - headerlen)) */
-	    int fragment_count = ((msglen - 1) / (mms - headerlen)) + 1;
+	    int fragment_count = otrl_proto_fragment_count(mms, context,
+		    message);
 
 	    err = otrl_proto_fragment_create(mms, fragment_count, &fragments,
 		    context, message);
@@ -138,6 +149,175 @@ static gcry_error_t fragment_and_send(const OtrlMessageAppOps *ops,
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* Find our privkey for the given context's account.  The account's
+ * entry in the account table is kept on the master context, so that
+ * after the first time this is just a pointer lookup. */
+static OtrlPrivKey *context_privkey(OtrlUserState us, ConnContext *context)
+{
+    ConnContextPriv *mpriv = context->m_context->context_priv;
+    OtrlPrivKey *privkey = NULL;
+
+    if (mpriv->account) {
+	otrl_userstate_rdlock(us);
+	privkey = mpriv->account->privkey;
+	otrl_userstate_unlock(us);
+	if (privkey) return privkey;
+    }
+
+    privkey = otrl_privkey_find(us, context->accountname, context->protocol);
+    /* Keep the entry only if it's the one that found the key: a key from
+     * the key store is in the store's account table, not ours, and one
+     * linked in by hand isn't in any, so those are looked up each time */
+    if (privkey) {
+	OtrlAccount *account;
+
+	otrl_userstate_rdlock(us);
+	account = otrl_userstate_account_find(us, context->accountname,
+		context->protocol, 0);
+	otrl_userstate_unlock(us);
+	if (account && account->privkey == privkey) {
+	    mpriv->account = account;
+	}
+    }
+    return privkey;
+}
+
+/* Return the entry in the account table for the given context's
+ * account, adding it if need be, and keep it on the master context as
+ * context_privkey does.  Return NULL if out of memory. */
+static OtrlAccount *context_account(OtrlUserState us, ConnContext *context)
+{
+    ConnContextPriv *mpriv = context->m_context->context_priv;
+
+    if (!mpriv->account) {
+	otrl_userstate_wrlock(us);
+	mpriv->account = otrl_userstate_account_find(us, context->accountname,
+		context->protocol, 1);
+	otrl_userstate_unlock(us);
+    }
+    return mpriv->account;
+}
+
+/* Return a newly-allocated query message for the given context's
+ * account, copied from the one kept in its account table entry. */
+static char *context_query_msg(OtrlUserState us, ConnContext *context,
+	OtrlPolicy policy)
+{
+    OtrlAccount *account = context_account(us, context);
+
+    if (!account) {
+	return otrl_proto_default_query_msg(context->accountname, policy);
+    }
+    return otrl_proto_account_query_msg(us, account, policy);
+}
+
+/* Tell the application that the given context (if non-NULL) was added
+ * or changed state, or that the given fingerprint (if non-NULL) was
+ * added or given a new trust: straight away, through
+ * update_context_list or write_fingerprints, or, if the userstate
+ * holds back changes, by noting it for otrl_message_poll, and making
+ * sure the timer goes off when that's due. */
+static void note_change(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context, Fingerprint *fprint)
+{
+    unsigned int interval = us->changes_debounce > 0 ?
+	us->changes_debounce : 1;
+    int start_timer = 0;
+
+    if (!us->changes_held) {
+	if (context && ops->update_context_list) {
+	    ops->update_context_list(opdata);
+	}
+	if (fprint && ops->write_fingerprints) {
+	    ops->write_fingerprints(opdata);
+	}
+	return;
+    }
+
+    otrl_userstate_wrlock(us);
+    if (us->changes_due == 0 && (us->timer_running == 0 ||
+		us->timer_running > interval) && ops->timer_control) {
+	us->timer_running = interval;
+	start_timer = 1;
+    }
+    otrl_userstate_changed(us, context, fprint,
+	    time(NULL) + us->changes_debounce);
+    otrl_userstate_unlock(us);
+
+    /* The application may well call otrl_message_poll from inside
+     * timer_control, so don't hold the lock */
+    if (start_timer) {
+	ops->timer_control(opdata, interval);
+    }
+}
+
+/* Convert the *lenp bytes and NUL in the buffer *bufp, of *sizep
+ * bytes, with us->convert_inplace, moving it to a bigger one with
+ * realloc() if asked to.  Return 0 if it was converted, or -1 if there
+ * was nothing to convert (or no memory for it); the message in the
+ * buffer is then as it was. */
+static int convert_in_place(OtrlUserState us, void *opdata,
+	ConnContext *context, OtrlConvertType convert_type, char **bufp,
+	size_t *sizep, size_t *lenp)
+{
+    size_t need;
+
+    if (context->context_priv->convert_never) return -1;
+
+    while ((need = us->convert_inplace(opdata, context, convert_type,
+		    *bufp, lenp, *sizep)) != 0) {
+	char *newbuf;
+
+	if (need == OTRL_CONVERT_NEVER) {
+	    context->context_priv->convert_never = 1;
+	    return -1;
+	}
+	/* Don't go round forever with a buffer that's too small */
+	if (need <= *sizep) return -1;
+	newbuf = realloc(*bufp, need);
+	if (!newbuf) return -1;
+	*bufp = newbuf;
+	*sizep = need;
+    }
+    if (*lenp >= *sizep) return -1;
+    (*bufp)[*lenp] = '\0';
+    return 0;
+}
+
+/* Return original_msg converted for sending in the context's
+ * conversion buffer, which is reused from one message to the next, or
+ * original_msg itself if there's nothing to convert.  *lenp is set to
+ * how much of the buffer to wipe once the message is encrypted. */
+static const char *convert_sending(OtrlUserState us, void *opdata,
+	ConnContext *context, const char *original_msg, size_t *lenp)
+{
+    ConnContextPriv *priv = context->context_priv;
+    size_t len = strlen(original_msg);
+    int converted;
+
+    *lenp = 0;
+    if (priv->convert_never) return original_msg;
+
+    if (priv->convert_buf_size < len + 1) {
+	char *newbuf;
+
+	if (priv->convert_buf) {
+	    otrl_mem_wipe(priv->convert_buf, priv->convert_buf_size);
+	}
+	newbuf = realloc(priv->convert_buf, len + 1);
+	if (!newbuf) return original_msg;
+	priv->convert_buf = newbuf;
+	priv->convert_buf_size = len + 1;
+    }
+    memcpy(priv->convert_buf, original_msg, len + 1);
+
+    converted = !convert_in_place(us, opdata, context,
+	    OTRL_CONVERT_SENDING, &(priv->convert_buf),
+	    &(priv->convert_buf_size), &len);
+    *lenp = priv->convert_buf_size;
+    return converted ? priv->convert_buf : original_msg;
+}
+
 static void populate_context_instag(OtrlUserState us, const OtrlMessageAppOps
 	*ops, void *opdata, const char *accountname, const char *protocol,
 	ConnContext *context) {
@@ -162,58 +342,30 @@ void otrl_message_free(char *message)
     free(message);
 }
 
-/* Handle a message about to be sent to the network.  It is safe to pass
- * all messages about to be sent to this routine.  add_appdata is a
- * function that will be called in the event that a new ConnContext is
- * created.  It will be passed the data that you supplied, as well as a
- * pointer to the new ConnContext.  You can use this to add
- * application-specific information to the ConnContext using the
- * "context->app" field, for example.  If you don't need to do this, you
- * can pass NULL for the last two arguments of otrl_message_sending.
- *
- * tlvs is a chain of OtrlTLVs to append to the private message.  It is
- * usually correct to just pass NULL here.
- *
- * If non-NULL, ops->convert_msg will be called just before encrypting a
- * message.
- *
- * "instag" specifies the instance tag of the buddy (protocol version 3 only).
- * Meta-instances may also be specified (e.g., OTRL_INSTAG_MOST_SECURE).
- * If "contextp" is not NULL, it will be set to the ConnContext used for
- * sending the message.
- *
- * If no fragmentation or msg injection is wanted, use OTRL_FRAGMENT_SEND_SKIP
- * as the OtrlFragmentPolicy. In this case, this function will assign *messagep
- * with the encrypted msg. If the routine returns non-zero, then the library
- * tried to encrypt the message, but for some reason failed. DO NOT send the
- * message in the clear in that case. If *messagep gets set by the call to
- * something non-NULL, then you should replace your message with the contents
- * of *messagep, and send that instead.
- *
- * Other fragmentation policies are OTRL_FRAGMENT_SEND_ALL,
- * OTRL_FRAGMENT_SEND_ALL_BUT_LAST, or OTRL_FRAGMENT_SEND_ALL_BUT_FIRST. In
- * these cases, the appropriate fragments will be automatically sent. For the
- * last two policies, the remaining fragment will be passed in *original_msg.
- *
- * Call otrl_message_free(*messagep) if you don't need *messagep or when you're
- * done with it. */
-gcry_error_t otrl_message_sending(OtrlUserState us,
+/* Handle a message about to be sent to the network, as
+ * otrl_message_sending does.  If the message is to be padded, and
+ * *mmsp is negative, set it to the max message size, for the caller to
+ * use again. */
+static gcry_error_t message_sending(OtrlUserState us,
 	const OtrlMessageAppOps *ops,
 	void *opdata, const char *accountname, const char *protocol,
 	const char *recipient, otrl_instag_t their_instag,
 	const char *original_msg, OtrlTLV *tlvs, char **messagep,
 	OtrlFragmentPolicy fragPolicy, ConnContext **contextp,
 	void (*add_appdata)(void *data, ConnContext *context),
-	void *data)
+	void *data, int *mmsp)
 {
     ConnContext * context = NULL;
     char * msgtosend;
     const char * err_msg;
     gcry_error_t err_code, err;
     OtrlPolicy policy = OTRL_POLICY_DEFAULT;
+    OtrlPolicy wanted;
     int context_added = 0;
     int convert_called = 0;
     char *converted_msg = NULL;
+    const char *inplace_msg = NULL;
+    size_t convert_wipe = 0;
 
     if (messagep) {
 	*messagep = NULL;
@@ -235,9 +387,12 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
     context = otrl_context_find(us, recipient, accountname, protocol,
 	    their_instag, 1, &context_added, add_appdata, data);
 
+    /* Hold on to this conversation until we're done with it */
+    otrl_context_lock(context);
+
     /* Update the context list if we added one */
-    if (context_added && ops->update_context_list) {
-	ops->update_context_list(opdata);
+    if (context_added) {
+	note_change(us, ops, opdata, context, NULL);
     }
 
     /* Find or generate the instance tag if needed */
@@ -254,9 +409,26 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
     if (ops->policy) {
 	policy = ops->policy(opdata, context);
     }
+    wanted = policy;
+    policy = otrl_policy_built(policy);
 
     /* Should we go on at all? */
     if ((policy & OTRL_POLICY_VERSION_MASK) == 0) {
+	if ((wanted & OTRL_POLICY_REQUIRE_ENCRYPTION) &&
+		(wanted & OTRL_POLICY_VERSION_MASK)) {
+	    /* Encryption is required, but none of the protocol versions
+	     * allowed are built into this library, so we can never
+	     * start OTR.  The message must not go out in the clear. */
+	    if (ops->handle_msg_event) {
+		ops->handle_msg_event(opdata,
+			OTRL_MSGEVENT_ENCRYPTION_REQUIRED,
+			context, NULL, gcry_error(GPG_ERR_NO_ERROR));
+	    }
+	    *messagep = strdup("");
+	    err = gcry_error(*messagep ? GPG_ERR_UNSUPPORTED_PROTOCOL :
+		    GPG_ERR_ENOMEM);
+	    goto fragment;
+	}
 	err =  gcry_error(GPG_ERR_NO_ERROR);
 	goto fragment;
     }
@@ -289,7 +461,7 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
     /* If this is an OTR Query message, don't encrypt it. */
     if (otrl_proto_message_type(original_msg) == OTRL_MSGTYPE_QUERY) {
 	/* Replace the "?OTR?" with a custom message */
-	char *bettermsg = otrl_proto_default_query_msg(accountname, policy);
+	char *bettermsg = context_query_msg(us, context, policy);
 	if (bettermsg) {
 	    *messagep = bettermsg;
 	}
@@ -306,28 +478,30 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 		/* We're trying to send an unencrypted message with a policy
 		 * that disallows that.  Don't do that, but try to start
 		 * up OTR instead. */
+		char *bettermsg;
+
 		if (ops->handle_msg_event) {
 		    ops->handle_msg_event(opdata,
 			    OTRL_MSGEVENT_ENCRYPTION_REQUIRED,
 			    context, NULL, gcry_error(GPG_ERR_NO_ERROR));
 		}
 
-		context->context_priv->lastmessage =
-			gcry_malloc_secure(strlen(original_msg) + 1);
-		if (context->context_priv->lastmessage) {
-		    char *bettermsg = otrl_proto_default_query_msg(accountname,
-			    policy);
-		    strcpy(context->context_priv->lastmessage, original_msg);
+		/* Send the query message in its place whether or not we
+		 * get to keep a copy to retransmit once we're secure;
+		 * the message itself must never go out in the clear. */
+		if (otrl_context_keep_lastmessage(context, original_msg,
+			    strlen(original_msg)) == 0) {
 		    context->context_priv->lastsent = time(NULL);
-		    otrl_context_update_recent_child(context, 1);
 		    context->context_priv->may_retransmit = 2;
-		    if (bettermsg) {
-			*messagep = bettermsg;
-			context->otr_offer = OFFER_SENT;
-		    } else {
-			err = gcry_error(GPG_ERR_ENOMEM);
-			goto fragment;
-		    }
+		}
+		otrl_context_update_recent_child(context, 1);
+		bettermsg = context_query_msg(us, context, policy);
+		if (bettermsg) {
+		    *messagep = bettermsg;
+		    context->otr_offer = OFFER_SENT;
+		} else {
+		    err = gcry_error(GPG_ERR_ENOMEM);
+		    goto fragment;
 		}
 	    } else {
 		if ((policy & OTRL_POLICY_SEND_WHITESPACE_TAG) &&
@@ -335,31 +509,11 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 		    /* See if this user can speak OTR.  Append the
 		     * OTR_MESSAGE_TAG to the plaintext message, and see
 		     * if he responds. */
-		    size_t msglen = strlen(original_msg);
-		    size_t basetaglen = strlen(OTRL_MESSAGE_TAG_BASE);
-		    size_t v1taglen = (policy & OTRL_POLICY_ALLOW_V1) ?
-			strlen(OTRL_MESSAGE_TAG_V1) : 0;
-		    size_t v2taglen = (policy & OTRL_POLICY_ALLOW_V2) ?
-			strlen(OTRL_MESSAGE_TAG_V2) : 0;
-		    size_t v3taglen = (policy & OTRL_POLICY_ALLOW_V3) ?
-			strlen(OTRL_MESSAGE_TAG_V3) : 0;
-		    char *taggedmsg = malloc(msglen + basetaglen + v1taglen
-			    + v2taglen + v3taglen + 1);
+		    OtrlAccount *account = context_account(us, context);
+		    char *taggedmsg = account ?
+			otrl_proto_account_tag_msg(us, account, policy,
+				original_msg) : NULL;
 		    if (taggedmsg) {
-			strcpy(taggedmsg, original_msg);
-			strcpy(taggedmsg + msglen, OTRL_MESSAGE_TAG_BASE);
-			if (v1taglen) {
-			    strcpy(taggedmsg + msglen + basetaglen,
-				    OTRL_MESSAGE_TAG_V1);
-			}
-			if (v2taglen) {
-			    strcpy(taggedmsg + msglen + basetaglen + v1taglen,
-				    OTRL_MESSAGE_TAG_V2);
-			}
-			if (v3taglen) {
-			    strcpy(taggedmsg + msglen + basetaglen + v1taglen
-				    + v2taglen, OTRL_MESSAGE_TAG_V3);
-			}
 			*messagep = taggedmsg;
 			context->otr_offer = OFFER_SENT;
 		    }
@@ -368,7 +522,10 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 	    break;
 	case OTRL_MSGSTATE_ENCRYPTED:
 	    /* convert the original message if necessary */
-	    if (ops->convert_msg) {
+	    if (us->convert_inplace) {
+		inplace_msg = convert_sending(us, opdata, context,
+			original_msg, &convert_wipe);
+	    } else if (ops->convert_msg) {
 		ops->convert_msg(opdata, context, OTRL_CONVERT_SENDING,
 			&converted_msg, original_msg);
 
@@ -377,18 +534,30 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 		}
 	    }
 
-	    /* Create the new, encrypted message */
-	    if (convert_called) {
-		err_code = otrl_proto_create_data(&msgtosend, context,
-			converted_msg, tlvs, 0, NULL);
-
-		if (ops->convert_free) {
-		    ops->convert_free(opdata, context, converted_msg);
-		    converted_msg = NULL;
+	    /* Create the new, encrypted message, padded if the policy
+	     * says so */
+	    if (policy & OTRL_POLICY_PAD_MESSAGES) {
+		if (*mmsp < 0) {
+		    *mmsp = ops->max_message_size ?
+			ops->max_message_size(opdata, context) : 0;
 		}
+		err_code = otrl_proto_create_data_padded(&msgtosend,
+			context, convert_called ? converted_msg :
+			inplace_msg ? inplace_msg : original_msg, tlvs, 0,
+			NULL, *mmsp);
 	    } else {
 		err_code = otrl_proto_create_data(&msgtosend, context,
-			original_msg, tlvs, 0, NULL);
+			convert_called ? converted_msg :
+			inplace_msg ? inplace_msg : original_msg,
+			tlvs, 0, NULL);
+	    }
+	    if (convert_called && ops->convert_free) {
+		ops->convert_free(opdata, context, converted_msg);
+		converted_msg = NULL;
+	    }
+	    if (convert_wipe) {
+		otrl_mem_wipe(context->context_priv->convert_buf,
+			convert_wipe);
 	    }
 	    if (!err_code) {
 		context->context_priv->lastsent = time(NULL);
@@ -437,6 +606,7 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 fragment:
     if (fragPolicy == OTRL_FRAGMENT_SEND_SKIP ) {
 	/* Do not fragment/inject. Default behaviour of libotr3.2.0 */
+	if (context) otrl_context_unlock(context);
 	return err;
     } else {
 	/* Fragment and send according to policy */
@@ -453,10 +623,290 @@ fragment:
 		}
 	    }
 	}
+	if (context) otrl_context_unlock(context);
 	return err;
     }
 }
 
+/* Handle a message about to be sent to the network.  It is safe to pass
+ * all messages about to be sent to this routine.  add_appdata is a
+ * function that will be called in the event that a new ConnContext is
+ * created.  It will be passed the data that you supplied, as well as a
+ * pointer to the new ConnContext.  You can use this to add
+ * application-specific information to the ConnContext using the
+ * "context->app" field, for example.  If you don't need to do this, you
+ * can pass NULL for the last two arguments of otrl_message_sending.
+ *
+ * tlvs is a chain of OtrlTLVs to append to the private message.  It is
+ * usually correct to just pass NULL here.
+ *
+ * If non-NULL, ops->convert_msg will be called just before encrypting a
+ * message.
+ *
+ * If the policy includes OTRL_POLICY_PAD_MESSAGES, the encrypted message
+ * is padded to hide its exact length, but never so much that it would
+ * need an extra fragment; see otrl_proto_create_data_padded.
+ *
+ * "instag" specifies the instance tag of the buddy (protocol version 3 only).
+ * Meta-instances may also be specified (e.g., OTRL_INSTAG_MOST_SECURE).
+ * If "contextp" is not NULL, it will be set to the ConnContext used for
+ * sending the message.
+ *
+ * If no fragmentation or msg injection is wanted, use OTRL_FRAGMENT_SEND_SKIP
+ * as the OtrlFragmentPolicy. In this case, this function will assign *messagep
+ * with the encrypted msg. If the routine returns non-zero, then the library
+ * tried to encrypt the message, but for some reason failed. DO NOT send the
+ * message in the clear in that case. If *messagep gets set by the call to
+ * something non-NULL, then you should replace your message with the contents
+ * of *messagep, and send that instead.  If the policy requires encryption
+ * but allows only protocol versions this library was built without, the
+ * message is refused: OTRL_MSGEVENT_ENCRYPTION_REQUIRED is raised and
+ * GPG_ERR_UNSUPPORTED_PROTOCOL returned.
+ *
+ * Other fragmentation policies are OTRL_FRAGMENT_SEND_ALL,
+ * OTRL_FRAGMENT_SEND_ALL_BUT_LAST, or OTRL_FRAGMENT_SEND_ALL_BUT_FIRST. In
+ * these cases, the appropriate fragments will be automatically sent. For the
+ * last two policies, the remaining fragment will be passed in *original_msg.
+ *
+ * Call otrl_message_free(*messagep) if you don't need *messagep or when you're
+ * done with it. */
+gcry_error_t otrl_message_sending(OtrlUserState us,
+	const OtrlMessageAppOps *ops,
+	void *opdata, const char *accountname, const char *protocol,
+	const char *recipient, otrl_instag_t their_instag,
+	const char *original_msg, OtrlTLV *tlvs, char **messagep,
+	OtrlFragmentPolicy fragPolicy, ConnContext **contextp,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    int mms = -1;
+
+    return message_sending(us, ops, opdata, accountname, protocol,
+	    recipient, their_instag, original_msg, tlvs, messagep,
+	    fragPolicy, contextp, add_appdata, data, &mms);
+}
+
+/* The messages and fragments a batch send has queued for injection,
+ * and the memory it must free once they've been sent */
+typedef struct {
+    OtrlInjectMessage *msgs;
+    size_t count;
+    size_t size;
+    void **owned;
+    size_t numowned;
+    size_t ownedsize;
+} InjectQueue;
+
+/* Take ownership of block, to be freed once the queue has been sent.
+ * Return non-zero if out of memory, in which case block is freed. */
+static int inject_queue_own(InjectQueue *queue, void *block)
+{
+    if (queue->numowned == queue->ownedsize) {
+	size_t newsize = queue->ownedsize ? 2 * queue->ownedsize : 16;
+	void **newowned = realloc(queue->owned, newsize * sizeof(void *));
+	if (!newowned) {
+	    free(block);
+	    return 1;
+	}
+	queue->owned = newowned;
+	queue->ownedsize = newsize;
+    }
+    queue->owned[queue->numowned++] = block;
+    return 0;
+}
+
+/* Queue msg, which the queue must already own, for sending to
+ * context's correspondent.  Return non-zero if out of memory. */
+static int inject_queue_push(InjectQueue *queue, ConnContext *context,
+	const char *msg)
+{
+    if (queue->count == queue->size) {
+	size_t newsize = queue->size ? 2 * queue->size : 16;
+	OtrlInjectMessage *newmsgs = realloc(queue->msgs,
+		newsize * sizeof(OtrlInjectMessage));
+	if (!newmsgs) return 1;
+	queue->msgs = newmsgs;
+	queue->size = newsize;
+    }
+
+    queue->msgs[queue->count].accountname = context->accountname;
+    queue->msgs[queue->count].protocol = context->protocol;
+    queue->msgs[queue->count].recipient = context->username;
+    queue->msgs[queue->count].message = msg;
+    queue->count++;
+    return 0;
+}
+
+/* Queue msg (taking ownership of it) for sending to context's
+ * correspondent.  Return non-zero if out of memory. */
+static int inject_queue_add(InjectQueue *queue, ConnContext *context,
+	char *msg)
+{
+    if (inject_queue_own(queue, msg)) return 1;
+    return inject_queue_push(queue, context, msg);
+}
+
+/* Queue message (taking ownership of it) for sending to context's
+ * correspondent, fragmenting it first if it's longer than mms.  Return
+ * an error if out of memory. */
+static gcry_error_t inject_queue_fragment(InjectQueue *queue,
+	ConnContext *context, char *message, int mms)
+{
+    int msglen = strlen(message);
+    char **fragments;
+    gcry_error_t err;
+    int i, fragment_count;
+
+    if (mms == 0 || msglen <= mms) {
+	return inject_queue_add(queue, context, message) ?
+	    gcry_error(GPG_ERR_ENOMEM) : gcry_error(GPG_ERR_NO_ERROR);
+    }
+
+    fragment_count = otrl_proto_fragment_count(mms, context, message);
+    err = otrl_proto_fragment_create(mms, fragment_count, &fragments,
+	    context, message);
+    free(message);
+    if (err) return err;
+
+    /* The fragments are all in the one block with their array, so
+     * that's what the queue takes over */
+    if (inject_queue_own(queue, fragments)) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    for (i = 0; i < fragment_count; i++) {
+	if (inject_queue_push(queue, context, fragments[i])) {
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+    }
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* The max_message_size for one accountname/protocol in a batch send */
+typedef struct {
+    const char *accountname;
+    const char *protocol;
+    int mms;
+} BatchMMS;
+
+/* Encrypt a batch of count messages and send them, as if each had been
+ * passed to otrl_message_sending with OTRL_FRAGMENT_SEND_ALL.  The
+ * ops->max_message_size callback is called only once per
+ * accountname/protocol pair in the batch (with the context of the
+ * first message for that pair), and every message and fragment to be
+ * sent is handed, in order, to a single call of inject_messages.  If
+ * inject_messages is NULL, ops->inject_message is called for each
+ * instead.
+ *
+ * If results is not NULL, it must have room for count entries, and
+ * results[i] is set to what became of items[i].  As with
+ * otrl_message_sending, a message the library leaves alone (an
+ * ordinary plaintext message) is not sent; results[i].injected is 0
+ * for such a message, and the caller should send it as it is.
+ *
+ * add_appdata and data are as for otrl_message_sending.  Errors with
+ * individual messages are reported in results; an error is returned
+ * only if the batch couldn't be started for lack of memory. */
+gcry_error_t otrl_message_sending_batch(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata,
+	const OtrlSendMessage *items, size_t count, OtrlSendResult *results,
+	void (*inject_messages)(void *opdata, const OtrlInjectMessage *msgs,
+	    size_t count),
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    InjectQueue queue = { NULL, 0, 0, NULL, 0, 0 };
+    BatchMMS *mmscache;
+    size_t i, j, nummms = 0;
+
+    if (count == 0) return gcry_error(GPG_ERR_NO_ERROR);
+
+    mmscache = malloc(count * sizeof(BatchMMS));
+    if (!mmscache) return gcry_error(GPG_ERR_ENOMEM);
+
+    for (i = 0; i < count; ++i) {
+	const OtrlSendMessage *item = &items[i];
+	ConnContext *context = NULL;
+	char *msg = NULL;
+	gcry_error_t err;
+	int mms = -1;
+	int *mmsp = &mms;
+	size_t mark;
+
+	/* Ask for the max message size only the first time we see
+	 * each accountname/protocol, either to pad the message or to
+	 * fragment it */
+	if (item->accountname && item->protocol) {
+	    for (j = 0; j < nummms; ++j) {
+		if (!strcmp(mmscache[j].accountname, item->accountname) &&
+			!strcmp(mmscache[j].protocol, item->protocol)) break;
+	    }
+	    if (j == nummms) {
+		mmscache[j].accountname = item->accountname;
+		mmscache[j].protocol = item->protocol;
+		mmscache[j].mms = -1;
+		++nummms;
+	    }
+	    mmsp = &mmscache[j].mms;
+	}
+
+	err = message_sending(us, ops, opdata, item->accountname,
+		item->protocol, item->recipient, item->instag, item->message,
+		item->tlvs, &msg, OTRL_FRAGMENT_SEND_SKIP, &context,
+		add_appdata, data, mmsp);
+
+	if (results) {
+	    results[i].err = err;
+	    results[i].injected = 0;
+	    results[i].context = context;
+	}
+	if (err || !msg || !context || !(ops->inject_message ||
+		    inject_messages)) {
+	    otrl_message_free(msg);
+	    continue;
+	}
+
+	if (*mmsp < 0) {
+	    *mmsp = ops->max_message_size ?
+		ops->max_message_size(opdata, context) : 0;
+	}
+	mms = *mmsp;
+
+	mark = queue.count;
+	otrl_context_lock(context);
+	err = inject_queue_fragment(&queue, context, msg, mms);
+	otrl_context_unlock(context);
+	if (err) {
+	    /* Don't send only some of the fragments */
+	    queue.count = mark;
+	}
+	if (results) {
+	    results[i].err = err;
+	    results[i].injected = !err;
+	}
+    }
+
+    if (queue.count > 0) {
+	if (inject_messages) {
+	    inject_messages(opdata, queue.msgs, queue.count);
+	} else {
+	    for (i = 0; i < queue.count; ++i) {
+		ops->inject_message(opdata, queue.msgs[i].accountname,
+			queue.msgs[i].protocol, queue.msgs[i].recipient,
+			queue.msgs[i].message);
+	    }
+	}
+    }
+
+    for (i = 0; i < queue.numowned; ++i) {
+	free(queue.owned[i]);
+    }
+    free(queue.owned);
+    free(queue.msgs);
+    free(mmscache);
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
 /* If err == 0, send the last auth message for the given context to the
  * appropriate user.  Otherwise, display an appripriate error dialog.
  * Return the value of err that was passed. */
@@ -485,12 +935,27 @@ static gcry_error_t send_or_error_auth(const OtrlMessageAppOps *ops,
 	    if (context == context->m_context &&
 		    context->auth.authstate == OTRL_AUTHSTATE_AWAITING_DHKEY &&
 		    context->auth.protocol_version == 3) {
+		time_t expiry = now + MAX_AKE_WAIT_TIME + 1;
+		time_t next;
+		int start_timer = 0;
+
 		context->auth.commit_sent_time = now;
-		/* If there's not already a timer running to clean up
-		 * this private key, try to start one. */
-		if (us->timer_running == 0 && ops && ops->timer_control) {
-		    ops->timer_control(opdata, POLL_DEFAULT_INTERVAL);
-		    us->timer_running = 1;
+		otrl_userstate_wrlock(us);
+		next = otrl_userstate_deadline_next(us);
+		otrl_userstate_deadline_add(us, context, expiry);
+		/* If there's not already a timer running that will go off
+		 * in time to clean up this private key, try to start
+		 * one. */
+		if ((us->timer_running == 0 || expiry < next) &&
+			ops && ops->timer_control) {
+		    us->timer_running = MAX_AKE_WAIT_TIME + 1;
+		    start_timer = 1;
+		}
+		otrl_userstate_unlock(us);
+		/* The application may well call otrl_message_poll from
+		 * inside timer_control, so don't hold the lock */
+		if (start_timer) {
+		    ops->timer_control(opdata, MAX_AKE_WAIT_TIME + 1);
 		}
 	    }
 	}
@@ -516,7 +981,6 @@ typedef struct {
 static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
 {
     EncrData *edata = asdata;
-    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
     Fingerprint *found_print = NULL;
     int fprint_added = 0;
     OtrlMessageState oldstate = edata->context->msgstate;
@@ -546,9 +1010,7 @@ static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
 		    edata->context->auth.their_fingerprint);
 	}
 	/* Arrange that the new fingerprint be written to disk */
-	if (edata->ops->write_fingerprints) {
-	    edata->ops->write_fingerprints(edata->opdata);
-	}
+	note_change(edata->us, edata->ops, edata->opdata, NULL, found_print);
     }
 
     /* Is this a new session or just a refresh of an existing one? */
@@ -578,6 +1040,11 @@ static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
 	return gcry_error(GPG_ERR_NO_ERROR);
     }
 
+    /* A context that isn't encrypted may have no session keys */
+    if (otrl_context_priv_wake(edata->context->context_priv)) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
     /* Copy the information from the auth into the context */
     memmove(edata->context->sessionid,
 	    edata->context->auth.secure_session_id, 20);
@@ -604,32 +1071,26 @@ static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
 	otrl_dh_keypair_free(&(edata->context->context_priv->our_old_dh_key));
 	otrl_dh_keypair_copy(&(edata->context->context_priv->our_old_dh_key),
 		&(edata->context->auth.our_dh));
-	otrl_dh_gen_keypair(
+	otrl_dh_gen_keypair_pooled(edata->context->auth.dh_keypool,
 		edata->context->context_priv->our_old_dh_key.groupid,
 		&(edata->context->context_priv->our_dh_key));
 	edata->context->context_priv->our_keyid = edata->context->auth.our_keyid
 		+ 1;
     }
 
-    /* Create the session keys from the DH keys */
-    otrl_dh_session_free(&(edata->context->context_priv->sesskeys[0][0]));
-    err = otrl_dh_session(&(edata->context->context_priv->sesskeys[0][0]),
-	    &(edata->context->context_priv->our_dh_key),
-	    edata->context->context_priv->their_y);
-    if (err) return err;
-    otrl_dh_session_free(&(edata->context->context_priv->sesskeys[1][0]));
-    err = otrl_dh_session(&(edata->context->context_priv->sesskeys[1][0]),
-	    &(edata->context->context_priv->our_old_dh_key),
-	    edata->context->context_priv->their_y);
-    if (err) return err;
+    /* Clear the session keys for their new DH key; they'll be computed
+     * from the DH keys when they're first used. */
+    otrl_dh_session_clear(&(edata->context->context_priv->sesskeys[0][0]));
+    otrl_dh_session_clear(&(edata->context->context_priv->sesskeys[1][0]));
 
     edata->context->context_priv->generation++;
     edata->context->active_fingerprint = found_print;
     edata->context->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+    otrl_context_best_changed(edata->context);
+    otrl_stats_us_add(edata->context->context_priv->userstate,
+	    akes_completed, 1);
 
-    if (edata->ops->update_context_list) {
-	edata->ops->update_context_list(edata->opdata);
-    }
+    note_change(edata->us, edata->ops, edata->opdata, edata->context, NULL);
     if (oldstate == OTRL_MSGSTATE_ENCRYPTED && oldprint == found_print) {
 	if (edata->ops->still_secure) {
 	    edata->ops->still_secure(edata->opdata, edata->context,
@@ -722,13 +1183,15 @@ static void maybe_resend(EncrData *edata)
 static void set_smp_trust(const OtrlMessageAppOps *ops, void *opdata,
 	ConnContext *context, int trusted)
 {
+    OtrlUserState us = context->context_priv->userstate;
+
+    otrl_userstate_wrlock(us);
     otrl_context_set_trust(context->active_fingerprint, trusted ? "smp" : "");
+    otrl_userstate_unlock(us);
 
     /* Write the new info to disk, redraw the ui, and redraw the
      * OTR buttons. */
-    if (ops->write_fingerprints) {
-	ops->write_fingerprints(opdata);
-    }
+    note_change(us, ops, opdata, NULL, context->active_fingerprint);
 }
 
 static void init_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
@@ -742,8 +1205,11 @@ static void init_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
     unsigned char our_fp[20];
     unsigned char *combined_buf;
     size_t combined_buf_len;
-    OtrlTLV *sendtlv;
+    size_t qlen = question != NULL ? strlen(question) + 1 : 0;
+    OtrlTLVBuf sendtlvs;
+    unsigned char *tlvdata;
     char *sendsmp = NULL;
+    unsigned long long tracestart;
 
     if (!context || context->msgstate != OTRL_MSGSTATE_ENCRYPTED) return;
 
@@ -775,6 +1241,7 @@ static void init_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    combined_buf_len);
     free(combined_buf);
 
+    tracestart = otrl_trace_begin(us);
     if (initiating) {
 	otrl_sm_step1(context->smstate, combined_secret, SM_DIGEST_SIZE,
 		&smpmsg, &smpmsglen);
@@ -782,28 +1249,26 @@ static void init_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 	otrl_sm_step2b(context->smstate, combined_secret, SM_DIGEST_SIZE,
 		&smpmsg, &smpmsglen);
     }
-
-    /* If we've got a question, attach it to the smpmsg */
-    if (question != NULL) {
-	size_t qlen = strlen(question);
-	unsigned char *qsmpmsg = malloc(qlen + 1 + smpmsglen);
-	if (!qsmpmsg) {
-	    free(smpmsg);
-	    return;
-	}
-	strcpy((char *)qsmpmsg, question);
-	memmove(qsmpmsg + qlen + 1, smpmsg, smpmsglen);
-	free(smpmsg);
-	smpmsg = qsmpmsg;
-	smpmsglen += qlen + 1;
-    }
-
-    /* Send msg with next smp msg content */
-    sendtlv = otrl_tlv_new(initiating ?
+    otrl_trace_end(us, tracestart,
+	    initiating ? OTRL_TRACE_SM_STEP1 : OTRL_TRACE_SM_STEP2B, context,
+	    0, smpmsglen);
+
+    /* Send msg with next smp msg content, after the question if we've
+     * got one */
+    otrl_tlvbuf_init(&sendtlvs);
+    tlvdata = otrl_tlvbuf_reserve(&sendtlvs, initiating ?
 	    (question != NULL ? OTRL_TLV_SMP1Q : OTRL_TLV_SMP1)
 	    : OTRL_TLV_SMP2,
-	    smpmsglen, smpmsg);
-    err = otrl_proto_create_data(&sendsmp, context, "", sendtlv,
+	    qlen + smpmsglen);
+    if (!tlvdata) {
+	free(smpmsg);
+	return;
+    }
+    if (question != NULL) {
+	memmove(tlvdata, question, qlen);
+    }
+    memmove(tlvdata + qlen, smpmsg, smpmsglen);
+    err = otrl_proto_create_data_tlvbuf(&sendsmp, context, "", &sendtlvs,
 	    OTRL_MSGFLAGS_IGNORE_UNREADABLE, NULL);
     if (!err) {
 	/*  Send it, and set the next expected message to the
@@ -814,7 +1279,7 @@ static void init_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 		initiating ? OTRL_SMP_EXPECT2 : OTRL_SMP_EXPECT3;
     }
     free(sendsmp);
-    otrl_tlv_free(sendtlv);
+    otrl_tlvbuf_free(&sendtlvs);
     free(smpmsg);
 }
 
@@ -823,7 +1288,9 @@ void otrl_message_initiate_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata, ConnContext *context, const unsigned char *secret,
 	size_t secretlen)
 {
+    otrl_context_lock(context);
     init_respond_smp(us, ops, opdata, context, NULL, secret, secretlen, 1);
+    otrl_context_unlock(context);
 }
 
 /* Initiate the Socialist Millionaires' Protocol and send a prompt
@@ -832,7 +1299,9 @@ void otrl_message_initiate_smp_q(OtrlUserState us,
 	const OtrlMessageAppOps *ops, void *opdata, ConnContext *context,
 	const char *question, const unsigned char *secret, size_t secretlen)
 {
+    otrl_context_lock(context);
     init_respond_smp(us, ops, opdata, context, question, secret, secretlen, 1);
+    otrl_context_unlock(context);
 }
 
 /* Respond to a buddy initiating the Socialist Millionaires' Protocol */
@@ -840,7 +1309,9 @@ void otrl_message_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata, ConnContext *context, const unsigned char *secret,
 	size_t secretlen)
 {
+    otrl_context_lock(context);
     init_respond_smp(us, ops, opdata, context, NULL, secret, secretlen, 0);
+    otrl_context_unlock(context);
 }
 
 /* Abort the SMP.  Called when an unexpected SMP message breaks the
@@ -848,154 +1319,377 @@ void otrl_message_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 void otrl_message_abort_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata, ConnContext *context)
 {
-    OtrlTLV *sendtlv = otrl_tlv_new(OTRL_TLV_SMP_ABORT, 0,
-	    (const unsigned char *)"");
+    OtrlTLVBuf sendtlvs;
     char *sendsmp = NULL;
     gcry_error_t err;
 
+    otrl_tlvbuf_init(&sendtlvs);
+    otrl_tlvbuf_append(&sendtlvs, OTRL_TLV_SMP_ABORT, 0, NULL);
+
+    otrl_context_lock(context);
     context->smstate->nextExpected = OTRL_SMP_EXPECT1;
 
-    err = otrl_proto_create_data(&sendsmp,
-	    context, "", sendtlv,
+    err = otrl_proto_create_data_tlvbuf(&sendsmp,
+	    context, "", &sendtlvs,
 	    OTRL_MSGFLAGS_IGNORE_UNREADABLE, NULL);
     if (!err) {
 	/* Send the abort signal so our buddy knows we've stopped */
 	err = fragment_and_send(ops, opdata, context,
 		sendsmp, OTRL_FRAGMENT_SEND_ALL, NULL);
     }
+    otrl_context_unlock(context);
     free(sendsmp);
-    otrl_tlv_free(sendtlv);
+    otrl_tlvbuf_free(&sendtlvs);
 }
 
-static void message_malformed(const OtrlMessageAppOps *ops,
-	void *opdata, ConnContext *context) {
-    if (ops->handle_msg_event) {
-	ops->handle_msg_event(opdata, OTRL_MSGEVENT_RCVDMSG_MALFORMED, context,
-	    NULL, gcry_error(GPG_ERR_NO_ERROR));
-    }
+/* receive_errors in OtrlUserStateStats has room for every event */
+typedef char receive_errors_fit[
+    OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE < OTRL_STATS_NUM_MSGEVENTS ?
+    1 : -1];
 
-    if (ops->inject_message && ops->otr_error_message) {
-	const char *err_msg = ops->otr_error_message(opdata, context,
-		OTRL_ERRCODE_MSG_MALFORMED);
+/* Count a received message we couldn't use, by the event we report for
+ * it, in the statistics of the userstate of the given context. */
+static void count_receive_error(ConnContext *context, OtrlMessageEvent event)
+{
+    otrl_stats_us_add(context->context_priv->userstate,
+	    receive_errors[event], 1);
+}
 
-	if (err_msg) {
-	    char *buf = malloc(strlen(OTR_ERROR_PREFIX) + strlen(err_msg) + 1);
+/* The length of the AKE message the given OtrlAuthInfo has to send, if
+ * it has one */
+static size_t auth_msglen(const OtrlAuthInfo *auth, int haveauthmsg)
+{
+    return haveauthmsg && auth->lastauthmsg ? strlen(auth->lastauthmsg) : 0;
+}
 
-	    if (buf) {
-		strcpy(buf, OTR_ERROR_PREFIX);
-		strcat(buf, err_msg);
-		ops->inject_message(opdata, context->accountname,
-			context->protocol, context->username, buf);
-		free(buf);
-	    }
+/* Answer the DH-Commit commitmsg of the given protocol version that
+ * the given context received. */
+static void answer_commit(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context, const char *commitmsg,
+	int version)
+{
+    unsigned long long tracestart = otrl_trace_begin(us);
+    gcry_error_t err = otrl_auth_handle_commit(&(context->auth), commitmsg,
+	    version);
+
+    otrl_trace_end(us, tracestart, OTRL_TRACE_AUTH_COMMIT, context,
+	    strlen(commitmsg), auth_msglen(&(context->auth), !err));
+    if (!err) otrl_stats_add(us->stats.akes_started, 1);
+    send_or_error_auth(ops, opdata, err, context, us);
+}
 
-	    if (ops->otr_error_message_free) {
-		ops->otr_error_message_free(opdata, err_msg);
-	    }
+/* Find out whether the given context's correspondent has a trusted
+ * fingerprint, and when we last sent to any instance of them, which is
+ * how the AKE admission control ranks their DH-Commits. */
+static void ake_rank(ConnContext *context, int *trustedp, time_t *seenp)
+{
+    ConnContext *m_context = context->m_context;
+    ConnContext *c;
+    Fingerprint *fprint;
+
+    *trustedp = 0;
+    for (fprint = m_context->fingerprint_root.next; fprint;
+	    fprint = fprint->next) {
+	if (otrl_context_is_fingerprint_trusted(fprint)) {
+	    *trustedp = 1;
+	    break;
+	}
+    }
+    *seenp = 0;
+    for (c = m_context; c && c->m_context == m_context; c = c->next) {
+	if (c->context_priv->lastsent > *seenp) {
+	    *seenp = c->context_priv->lastsent;
 	}
     }
 }
 
+/* Ask the userstate's AKE admission control whether the given context
+ * may answer the DH-Commit commitmsg now.  If not, it is held back for
+ * otrl_message_poll to answer once there is room.  Return 1 if the
+ * context may go ahead. */
+static int ake_admit(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context, const char *commitmsg,
+	int version)
+{
+    time_t now = time(NULL);
+    time_t seen;
+    int trusted, admitted;
+    int start_timer = 0;
+
+    ake_rank(context, &trusted, &seen);
+    otrl_userstate_wrlock(us);
+    admitted = otrl_userstate_ake_admit(us, context, trusted, seen, now,
+	    now - MAX_AKE_WAIT_TIME);
+    if (!admitted && otrl_userstate_ake_defer(us, context, commitmsg,
+		version, trusted, seen, now) == 0 &&
+	    ops && ops->timer_control && us->timer_running != 1) {
+	/* Have otrl_message_poll look for room every second */
+	us->timer_running = 1;
+	start_timer = 1;
+    }
+    otrl_userstate_unlock(us);
+    if (start_timer) {
+	ops->timer_control(opdata, 1);
+    }
+    return admitted;
+}
 
-/* Handle a message just received from the network.  It is safe to pass
- * all received messages to this routine.  add_appdata is a function
- * that will be called in the event that a new ConnContext is created.
- * It will be passed the data that you supplied, as well as
- * a pointer to the new ConnContext.  You can use this to add
- * application-specific information to the ConnContext using the
- * "context->app" field, for example.  If you don't need to do this, you
- * can pass NULL for the last two arguments of otrl_message_receiving.
- *
- * If non-NULL, ops->convert_msg will be called after a data message is
- * decrypted.
- *
- * If "contextp" is not NULL, it will be set to the ConnContext used for
- * receiving the message.
- *
- * If otrl_message_receiving returns 1, then the message you received
- * was an internal protocol message, and no message should be delivered
- * to the user.
- *
- * If it returns 0, then check if *messagep was set to non-NULL.  If
- * so, replace the received message with the contents of *messagep, and
- * deliver that to the user instead.  You must call
- * otrl_message_free(*messagep) when you're done with it.  If tlvsp is
- * non-NULL, *tlvsp will be set to a chain of any TLVs that were
- * transmitted along with this message.  You must call
- * otrl_tlv_free(*tlvsp) when you're done with those.
- *
- * If otrl_message_receiving returns 0 and *messagep is NULL, then this
- * was an ordinary, non-OTR message, which should just be delivered to
- * the user without modification. */
-int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
-	void *opdata, const char *accountname, const char *protocol,
-	const char *sender, const char *message, char **newmessagep,
-	OtrlTLV **tlvsp, ConnContext **contextp,
-	void (*add_appdata)(void *data, ConnContext *context),
-	void *data)
+/* Once the given context's AKE is over, stop counting it against the
+ * userstate's AKE admission control. */
+static void ake_done(OtrlUserState us, ConnContext *context)
 {
-    ConnContext *context, *m_context, *best_context;
-    OtrlMessageType msgtype;
-    int context_added = 0;
-    OtrlPolicy policy = OTRL_POLICY_DEFAULT;
-    char *unfragmessage = NULL, *otrtag = NULL;
-    EncrData edata;
-    otrl_instag_t our_instance = 0, their_instance = 0;
-    int version;
+    if (us->ake_max_inflight == 0 ||
+	    context->auth.authstate != OTRL_AUTHSTATE_NONE) {
+	return;
+    }
+    otrl_userstate_wrlock(us);
+    otrl_userstate_ake_release(us, context);
+    otrl_userstate_unlock(us);
+}
+
+/* Send a heartbeat (an empty Data message) in the given context, to
+ * have the other side rotate its keys */
+static void send_heartbeat(const OtrlMessageAppOps *ops, void *opdata,
+	ConnContext *context, time_t now)
+{
+    char *heartbeat;
     gcry_error_t err;
 
-    if (!accountname || !protocol || !sender || !message || !newmessagep)
-	return 0;
+    /* Create the heartbeat message */
+    err = otrl_proto_create_data(&heartbeat, context, "", NULL,
+	    OTRL_MSGFLAGS_IGNORE_UNREADABLE, NULL);
+    if (err) return;
 
-    *newmessagep = NULL;
-    if (tlvsp) *tlvsp = NULL;
+    /* Send it, and inject a debug message */
+    if (ops->inject_message) {
+	ops->inject_message(opdata, context->accountname,
+		context->protocol, context->username, heartbeat);
+    }
+    free(heartbeat);
 
-    if (contextp) {
-	*contextp = NULL;
+    context->context_priv->lastsent = now;
+    otrl_context_update_recent_child(context, 1);
+    otrl_stats_us_add(context->context_priv->userstate, heartbeats_sent, 1);
+
+    /* Signal an event for the heartbeat message */
+    if (ops->handle_msg_event) {
+	ops->handle_msg_event(opdata, OTRL_MSGEVENT_LOG_HEARTBEAT_SENT,
+		context, NULL, gcry_error(GPG_ERR_NO_ERROR));
+    }
+}
+
+/* Queue a heartbeat for the given context, for otrl_message_poll to
+ * send once heartbeat_delay is up, and make sure the timer goes off
+ * by then. */
+static void heartbeat_defer(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context, time_t now)
+{
+    unsigned int interval = us->heartbeat_delay > 0 ?
+	us->heartbeat_delay : 1;
+    int start_timer = 0;
+
+    otrl_userstate_wrlock(us);
+    otrl_userstate_heartbeat_queue(us, context, now + us->heartbeat_delay);
+    if ((us->timer_running == 0 || us->timer_running > interval) &&
+	    ops->timer_control) {
+	us->timer_running = interval;
+	start_timer = 1;
+    }
+    otrl_userstate_unlock(us);
+
+    /* The application may well call otrl_message_poll from inside
+     * timer_control, so don't hold the lock */
+    if (start_timer) {
+	ops->timer_control(opdata, interval);
+    }
+}
+
+/* Send the heartbeats whose time has come, up to heartbeat_max of them
+ * (or all of them, if that's 0), leaving the rest for the next poll.  A
+ * heartbeat is no longer needed if something else has been sent since
+ * it was queued. */
+static void heartbeat_run_deferred(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, time_t now)
+{
+    ConnContext *context;
+    unsigned int sent = 0;
+
+    if (ops == NULL) return;
+
+    while (us->heartbeat_max == 0 || sent < us->heartbeat_max) {
+	otrl_userstate_wrlock(us);
+	context = otrl_userstate_heartbeat_next(us, now);
+	/* Take the family before letting go of the userstate's lock, so
+	 * the context can't be forgotten in between.  Don't wait for a
+	 * conversation another thread is working on; its heartbeat goes
+	 * back in the queue for next time. */
+	if (context && otrl_context_trylock(context)) {
+	    otrl_userstate_heartbeat_queue(us, context, now + 1);
+	    otrl_userstate_unlock(us);
+	    continue;
+	}
+	otrl_userstate_unlock(us);
+	if (context == NULL) break;
+
+	if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
+		context->context_priv->their_keyid > 0 &&
+		context->context_priv->lastsent <
+		(now - HEARTBEAT_INTERVAL)) {
+	    send_heartbeat(ops, opdata, context, now);
+	    ++sent;
+	} else {
+	    otrl_stats_add(us->stats.heartbeats_suppressed, 1);
+	}
+	otrl_context_unlock(context);
+    }
+}
+
+/* Answer as many of the DH-Commits held back by the AKE admission
+ * control as there is now room for. */
+static void ake_run_deferred(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, time_t now)
+{
+    ConnContext *context;
+    char *commitmsg;
+    unsigned int version;
+
+    if (ops == NULL) return;
+
+    for (;;) {
+	otrl_userstate_wrlock(us);
+	context = otrl_userstate_ake_peek(us, now - MAX_AKE_WAIT_TIME);
+	/* Take the family before letting go of the userstate's lock, so
+	 * the context can't be forgotten in between.  If another thread
+	 * is working on it, leave its DH-Commit (and those behind it)
+	 * held back until next time. */
+	if (context && otrl_context_trylock(context)) {
+	    context = NULL;
+	} else if (context) {
+	    otrl_userstate_ake_next(us, now, now - MAX_AKE_WAIT_TIME,
+		    &commitmsg, &version);
+	}
+	otrl_userstate_unlock(us);
+	if (context == NULL) break;
+
+	answer_commit(us, ops, opdata, context, commitmsg, version);
+	ake_done(us, context);
+	otrl_context_unlock(context);
+	free(commitmsg);
+    }
+}
+
+static void message_malformed(const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context) {
+    count_receive_error(context, OTRL_MSGEVENT_RCVDMSG_MALFORMED);
+    if (ops->handle_msg_event) {
+	ops->handle_msg_event(opdata, OTRL_MSGEVENT_RCVDMSG_MALFORMED, context,
+	    NULL, gcry_error(GPG_ERR_NO_ERROR));
+    }
+
+    if (ops->inject_message && ops->otr_error_message) {
+	const char *err_msg = ops->otr_error_message(opdata, context,
+		OTRL_ERRCODE_MSG_MALFORMED);
+
+	if (err_msg) {
+	    char *buf = malloc(strlen(OTR_ERROR_PREFIX) + strlen(err_msg) + 1);
+
+	    if (buf) {
+		strcpy(buf, OTR_ERROR_PREFIX);
+		strcat(buf, err_msg);
+		ops->inject_message(opdata, context->accountname,
+			context->protocol, context->username, buf);
+		free(buf);
+	    }
+
+	    if (ops->otr_error_message_free) {
+		ops->otr_error_message_free(opdata, err_msg);
+	    }
+	}
     }
+}
+
+
+/* Find (or create) the master context for messages from sender to
+ * accountname/protocol, make sure it has an instance tag, and put its
+ * policy into *policyp.  The master context is returned with its
+ * family locked. */
+static ConnContext *receiving_master_context(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol, const char *sender, OtrlPolicy *policyp,
+	void (*add_appdata)(void *data, ConnContext *context), void *data)
+{
+    ConnContext *m_context;
+    int context_added = 0;
 
     /* Find the master context and state with this correspondent */
     m_context = otrl_context_find(us, sender, accountname,
 	    protocol, OTRL_INSTAG_MASTER, 1, &context_added, add_appdata, data);
-    context = m_context;
+    otrl_context_lock(m_context);
 
     /* Update the context list if we added one */
-    if (context_added && ops->update_context_list) {
-	ops->update_context_list(opdata);
+    if (context_added) {
+	note_change(us, ops, opdata, m_context, NULL);
     }
 
-    best_context = otrl_context_find(us, sender, accountname,
-	    protocol, OTRL_INSTAG_BEST, 0, NULL, add_appdata, data);
-
     /* Find or generate the instance tag if needed */
-    if (!context->our_instance) {
+    if (!m_context->our_instance) {
 	populate_context_instag(us, ops, opdata, accountname, protocol,
-		context);
+		m_context);
     }
 
-
     /* Check the policy */
+    *policyp = OTRL_POLICY_DEFAULT;
     if (ops->policy) {
-	policy = ops->policy(opdata, context);
+	*policyp = ops->policy(opdata, m_context);
     }
+    *policyp = otrl_policy_built(*policyp);
 
-    /* Should we go on at all? */
-    if ((policy & OTRL_POLICY_VERSION_MASK) == 0) {
-	return 0;
-    }
+    return m_context;
+}
+
+/* Handle a message just received from the network, given its master
+ * context m_context and the policy for it, as otrl_message_receiving
+ * does.  If premac isn't NULL, it may hold the message's MAC, already
+ * worked out. */
+static int receiving_in_context(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, ConnContext *m_context,
+	OtrlPolicy policy, const char *accountname, const char *protocol,
+	const char *sender, const char *message, const OtrlDataMac *premac,
+	char **newmessagep, OtrlTLV **tlvsp, ConnContext **contextp,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    ConnContext *context = m_context, *best_context;
+    OtrlMessageType msgtype;
+    int context_added = 0;
+    char *unfragmessage = NULL, *otrtag = NULL;
+    EncrData edata;
+    otrl_instag_t our_instance = 0, their_instance = 0;
+    OtrlMessageInfo msginfo;
+    int version;
+    unsigned long long tracestart;
+    time_t now;
+    gcry_error_t err;
 
-    otrtag = strstr(message, "?OTR");
+    best_context = otrl_context_find(us, sender, accountname,
+	    protocol, OTRL_INSTAG_BEST, 0, NULL, add_appdata, data);
+
+    /* Find the "?OTR", the fragment header if there is one, and
+     * everything else we need to know about the message, in a single
+     * pass */
+    otrl_proto_message_classify(&msginfo, message);
+    otrtag = (char *)msginfo.tag;
     if (otrtag) {
-	/* See if we have a V3 fragment.  The '4' in the next line is
-	 * strlen("?OTR").  otrtag[4] is the character immediately after
-	 * the "?OTR", and is guaranteed to exist, because in the worst
-	 * case, it is the NUL terminating 'message'. */
-	if (otrtag[4] == '|') {
+	/* See if we have a V3 fragment. */
+	if (msginfo.fragment.has_instances) {
 	    /* Get the instance tag from fragment header*/
-	    sscanf(otrtag, "?OTR|%x|%x,", &their_instance, &our_instance);
+	    their_instance = msginfo.fragment.instance_from;
+	    our_instance = msginfo.fragment.instance_to;
 	    /* Ignore message if it is intended for a different instance */
 	    if (our_instance && context->our_instance != our_instance) {
 
+		    count_receive_error(m_context,
+			    OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE);
 		    if (ops->handle_msg_event) {
 			ops->handle_msg_event(opdata,
 				OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE,
@@ -1013,8 +1707,8 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		return 1;
 	    }
 	}
-	switch(otrl_proto_fragment_accumulate(&unfragmessage,
-		context, message)) {
+	switch(otrl_proto_fragment_accumulate_parsed(&unfragmessage,
+		context, &msginfo.fragment)) {
 	    case OTRL_FRAGMENT_UNFRAGMENTED:
 		/* Do nothing */
 		break;
@@ -1025,15 +1719,16 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    case OTRL_FRAGMENT_COMPLETE:
 		/* We've got a new complete message, in unfragmessage. */
 		message = unfragmessage;
-		otrtag = strstr(message, "?OTR");
+		otrl_proto_message_classify(&msginfo, message);
+		otrtag = (char *)msginfo.tag;
 		break;
 	}
     }
 
     /* What type of message is it?  Note that this just checks the
      * header; it's not necessarily a _valid_ message of this type. */
-    msgtype = otrl_proto_message_type(message);
-    version = otrl_proto_message_version(message);
+    msgtype = msginfo.type;
+    version = msginfo.version;
 
     /* See if they responded to our OTR offer */
     if ((policy & OTRL_POLICY_SEND_WHITESPACE_TAG)) {
@@ -1054,14 +1749,18 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
     /* Check the to and from instance tags */
     if (version == 3) {
 	err = gcry_error(GPG_ERR_INV_VALUE);
-	if (otrtag) {
-	    err = otrl_proto_instance(otrtag, &their_instance, &our_instance);
+	if (msginfo.has_instances) {
+	    their_instance = msginfo.instance_from;
+	    our_instance = msginfo.instance_to;
+	    err = gcry_error(GPG_ERR_NO_ERROR);
 	}
 	if (!err) {
 	    if ((msgtype == OTRL_MSGTYPE_DH_COMMIT && our_instance &&
 		    context->our_instance != our_instance) ||
 		    (msgtype != OTRL_MSGTYPE_DH_COMMIT &&
 		    context->our_instance != our_instance)) {
+		count_receive_error(m_context,
+			OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE);
 		if (ops->handle_msg_event) {
 		    ops->handle_msg_event(opdata,
 			    OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE,
@@ -1092,13 +1791,22 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    context->auth.protocol_version = 3;
 	    context->protocol_version = 3;
 	    context->msgstate = m_context->msgstate;
+	    otrl_context_best_changed(context);
 
 	    if (m_context->context_priv->may_retransmit) {
-		gcry_free(context->context_priv->lastmessage);
+		otrl_context_priv_lastmessage_drop(context->context_priv);
 		context->context_priv->lastmessage = m_context->context_priv->lastmessage;
 		m_context->context_priv->lastmessage = NULL;
 		context->context_priv->may_retransmit = m_context->context_priv->may_retransmit;
 		m_context->context_priv->may_retransmit = 0;
+		if (context->context_priv->lastmessage &&
+			us->retransmit_timeout > 0) {
+		    otrl_userstate_wrlock(us);
+		    otrl_userstate_deadline_add(us, context,
+			    m_context->context_priv->lastsent +
+			    us->retransmit_timeout);
+		    otrl_userstate_unlock(us);
+		}
 	    }
 
 	    if (msgtype == OTRL_MSGTYPE_DH_KEY) {
@@ -1109,9 +1817,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    }
 
 	    /* Update the context list */
-	    if (ops->update_context_list) {
-		ops->update_context_list(opdata);
-	    }
+	    note_change(us, ops, opdata, context, NULL);
 	} else if (m_context != context) {
 	    /* Switching from m_context to existing instance context */
 	    if (msgtype == OTRL_MSGTYPE_DH_KEY && m_context->auth.authstate
@@ -1119,6 +1825,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    !(context->auth.authstate ==
 		    OTRL_AUTHSTATE_AWAITING_DHKEY)) {
 		context->msgstate = m_context->msgstate;
+		otrl_context_best_changed(context);
 		context->auth.protocol_version = 3;
 		context->protocol_version = 3;
 		otrl_auth_copy_on_key(&(m_context->auth), &(context->auth));
@@ -1131,7 +1838,11 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
     }
 
     /* update time of last received message */
-    context->context_priv->lastrecv = time(NULL);
+    now = time(NULL);
+    if (context->context_priv->lastrecv != now) {
+	context->context_priv->lastrecv = now;
+	otrl_context_best_changed(context);
+    }
     otrl_context_update_recent_child(context, 0);
 
     edata.gone_encrypted = 0;
@@ -1149,6 +1860,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	unsigned int our_keyid;
 	OtrlPrivKey *privkey;
 	int haveauthmsg;
+	OtrlAuthMessage akemsg;
 
 	case OTRL_MSGTYPE_QUERY:
 	    /* See if we should use an existing DH keypair, or generate
@@ -1162,31 +1874,32 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    }
 
 	    /* Find the best version of OTR that we both speak */
-	    switch(otrl_proto_query_bestversion(message, policy)) {
+	    switch(otrl_proto_bestversion(msginfo.versions, policy)) {
 		case 3:
 		    err = otrl_auth_start_v23(&(context->auth), 3);
+		    if (!err) otrl_stats_add(us->stats.akes_started, 1);
 		    send_or_error_auth(ops, opdata, err, context, us);
 		    break;
 		case 2:
 		    err = otrl_auth_start_v23(&(context->auth), 2);
+		    if (!err) otrl_stats_add(us->stats.akes_started, 1);
 		    send_or_error_auth(ops, opdata, err, context, us);
 		    break;
 		case 1:
 		    /* Get our private key */
-		    privkey = otrl_privkey_find(us, context->accountname,
-			    context->protocol);
+		    privkey = context_privkey(us, context);
 		    if (privkey == NULL) {
 			/* We've got no private key! */
 			if (ops->create_privkey) {
 			    ops->create_privkey(opdata, context->accountname,
 				    context->protocol);
-			    privkey = otrl_privkey_find(us,
-				    context->accountname, context->protocol);
+			    privkey = context_privkey(us, context);
 			}
 		    }
 		    if (privkey) {
 			err = otrl_auth_start_v1(&(context->auth), our_dh,
 				our_keyid, privkey);
+			if (!err) otrl_stats_add(us->stats.akes_started, 1);
 			send_or_error_auth(ops, opdata, err, context, us);
 		    }
 		    break;
@@ -1199,28 +1912,39 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    break;
 
 	case OTRL_MSGTYPE_DH_COMMIT:
-	    err = otrl_auth_handle_commit(&(context->auth), otrtag, version);
-	    send_or_error_auth(ops, opdata, err, context, us);
+	    /* A DH-Commit that would start a new AKE may have to wait its
+	     * turn */
+	    if (context->auth.authstate != OTRL_AUTHSTATE_NONE ||
+		    us->ake_max_inflight == 0 ||
+		    ake_admit(us, ops, opdata, context, otrtag, version)) {
+		answer_commit(us, ops, opdata, context, otrtag, version);
+		ake_done(us, context);
+	    }
 
 	    if (edata.ignore_message == -1) edata.ignore_message = 1;
 	    break;
 
 	case OTRL_MSGTYPE_DH_KEY:
 	    /* Get our private key */
-	    privkey = otrl_privkey_find(us, context->accountname,
-		    context->protocol);
+	    privkey = context_privkey(us, context);
 	    if (privkey == NULL) {
 		/* We've got no private key! */
 		if (ops->create_privkey) {
 		    ops->create_privkey(opdata, context->accountname,
 			    context->protocol);
-		    privkey = otrl_privkey_find(us,
-			    context->accountname, context->protocol);
+		    privkey = context_privkey(us, context);
 		}
 	    }
 	    if (privkey) {
-		err = otrl_auth_handle_key(&(context->auth), otrtag,
-			&haveauthmsg, privkey);
+		tracestart = otrl_trace_begin(us);
+		haveauthmsg = 0;
+		err = otrl_auth_message_parse(&akemsg, otrtag);
+		if (!err) err = otrl_auth_handle_key_parsed(&(context->auth),
+			&akemsg, &haveauthmsg, privkey);
+		otrl_auth_message_free(&akemsg);
+		otrl_trace_end(us, tracestart, OTRL_TRACE_AUTH_KEY, context,
+			strlen(otrtag),
+			auth_msglen(&(context->auth), haveauthmsg));
 		if (err || haveauthmsg) {
 		    send_or_error_auth(ops, opdata, err, context, us);
 		}
@@ -1231,33 +1955,46 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
 	case OTRL_MSGTYPE_REVEALSIG:
 	    /* Get our private key */
-	    privkey = otrl_privkey_find(us, context->accountname,
-		    context->protocol);
+	    privkey = context_privkey(us, context);
 	    if (privkey == NULL) {
 		/* We've got no private key! */
 		if (ops->create_privkey) {
 		    ops->create_privkey(opdata, context->accountname,
 			    context->protocol);
-		    privkey = otrl_privkey_find(us,
-			    context->accountname, context->protocol);
+		    privkey = context_privkey(us, context);
 		}
 	    }
 	    if (privkey) {
-		err = otrl_auth_handle_revealsig(&(context->auth),
-			otrtag, &haveauthmsg, privkey, go_encrypted,
-			&edata);
+		tracestart = otrl_trace_begin(us);
+		haveauthmsg = 0;
+		err = otrl_auth_message_parse(&akemsg, otrtag);
+		if (!err) err = otrl_auth_handle_revealsig_parsed(
+			&(context->auth), &akemsg, &haveauthmsg, privkey,
+			go_encrypted, &edata);
+		otrl_auth_message_free(&akemsg);
+		otrl_trace_end(us, tracestart, OTRL_TRACE_AUTH_REVEALSIG,
+			context, strlen(otrtag),
+			auth_msglen(&(context->auth), haveauthmsg));
 		if (err || haveauthmsg) {
 		    send_or_error_auth(ops, opdata, err, context, us);
 		    maybe_resend(&edata);
 		}
+		ake_done(us, context);
 	    }
 
 	    if (edata.ignore_message == -1) edata.ignore_message = 1;
 	    break;
 
 	case OTRL_MSGTYPE_SIGNATURE:
-	    err = otrl_auth_handle_signature(&(context->auth),
-		    otrtag, &haveauthmsg, go_encrypted, &edata);
+	    tracestart = otrl_trace_begin(us);
+	    haveauthmsg = 0;
+	    err = otrl_auth_message_parse(&akemsg, otrtag);
+	    if (!err) err = otrl_auth_handle_signature_parsed(
+		    &(context->auth), &akemsg, &haveauthmsg, go_encrypted,
+		    &edata);
+	    otrl_auth_message_free(&akemsg);
+	    otrl_trace_end(us, tracestart, OTRL_TRACE_AUTH_SIGNATURE, context,
+		    strlen(otrtag), auth_msglen(&(context->auth), haveauthmsg));
 	    if (err || haveauthmsg) {
 		send_or_error_auth(ops, opdata, err, context, us);
 		maybe_resend(&edata);
@@ -1278,21 +2015,23 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    }
 
 	    /* Get our private key */
-	    privkey = otrl_privkey_find(us, context->accountname,
-		    context->protocol);
+	    privkey = context_privkey(us, context);
 	    if (privkey == NULL) {
 		/* We've got no private key! */
 		if (ops->create_privkey) {
 		    ops->create_privkey(opdata, context->accountname,
 			    context->protocol);
-		    privkey = otrl_privkey_find(us, context->accountname,
-			    context->protocol);
+		    privkey = context_privkey(us, context);
 		}
 	    }
 	    if (privkey) {
+		tracestart = otrl_trace_begin(us);
 		err = otrl_auth_handle_v1_key_exchange(&(context->auth),
 			message, &haveauthmsg, privkey, our_dh, our_keyid,
 			go_encrypted, &edata);
+		otrl_trace_end(us, tracestart, OTRL_TRACE_AUTH_V1_KEYEXCH,
+			context, strlen(message),
+			auth_msglen(&(context->auth), haveauthmsg));
 		if (err || haveauthmsg) {
 		    send_or_error_auth(ops, opdata, err, context, us);
 		    maybe_resend(&edata);
@@ -1305,7 +2044,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	case OTRL_MSGTYPE_DATA:
 	    switch(context->msgstate) {
 		gcry_error_t err;
-		OtrlTLV *tlvs, *tlv;
+		const unsigned char *tlvdata;
+		size_t tlvlen;
+		OtrlTLVView tlv;
 		char *plaintext;
 		char *buf;
 		const char *err_msg;
@@ -1326,17 +2067,23 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    if(best_context && best_context != context &&
 			best_context->msgstate == OTRL_MSGSTATE_ENCRYPTED) {
 
+			count_receive_error(m_context,
+				OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE);
 			if (ops->handle_msg_event) {
 			    ops->handle_msg_event(opdata,
 				    OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE,
 				    m_context, NULL,
 				    gcry_error(GPG_ERR_NO_ERROR));
 			}
-		    } else if (ops->handle_msg_event) {
-			ops->handle_msg_event(opdata,
+		    } else {
+			count_receive_error(context,
+				OTRL_MSGEVENT_RCVDMSG_NOT_IN_PRIVATE);
+			if (ops->handle_msg_event) {
+			    ops->handle_msg_event(opdata,
 				    OTRL_MSGEVENT_RCVDMSG_NOT_IN_PRIVATE,
 				    context, NULL,
 				    gcry_error(GPG_ERR_NO_ERROR));
+			}
 		    }
 		    edata.ignore_message = 1;
 
@@ -1347,8 +2094,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
 		case OTRL_MSGSTATE_ENCRYPTED:
 		    extrakey = gcry_malloc_secure(OTRL_EXTRAKEY_BYTES);
-		    err = otrl_proto_accept_data(&plaintext, &tlvs, context,
-				    message, &flags, extrakey);
+		    err = otrl_proto_accept_data_view_premac(&plaintext,
+			    &tlvdata, &tlvlen, context, message, &flags,
+			    extrakey, premac);
 		    if (err) {
 			int is_conflict =
 				(gpg_err_code(err) == GPG_ERR_CONFLICT);
@@ -1356,6 +2104,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    edata.ignore_message = 1;
 			    break;
 			}
+			count_receive_error(context, is_conflict ?
+				OTRL_MSGEVENT_RCVDMSG_UNREADABLE :
+				OTRL_MSGEVENT_RCVDMSG_MALFORMED);
 			if (is_conflict) {
 			    if (ops->handle_msg_event) {
 				ops->handle_msg_event(opdata,
@@ -1401,21 +2152,22 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    /* If the other side told us he's disconnected his
 		     * private connection, make a note of that so we
 		     * don't try sending anything else to him. */
-		    if (otrl_tlv_find(tlvs, OTRL_TLV_DISCONNECTED)) {
+		    if (otrl_tlv_view_find(&tlv, tlvdata, tlvlen,
+				OTRL_TLV_DISCONNECTED)) {
 			otrl_context_force_finished(context);
 		    }
 
 		    /* If the other side told us to use the current
 		     * extra symmetric key, let the application know. */
-		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SYMKEY);
-		    if (tlv && otrl_api_version >= 0x040000) {
-			if (ops->received_symkey && tlv->len >= 4) {
-			    unsigned char *bufp = tlv->data;
+		    if (otrl_tlv_view_find(&tlv, tlvdata, tlvlen,
+				OTRL_TLV_SYMKEY) && otrl_api_version >= 0x040000) {
+			if (ops->received_symkey && tlv.len >= 4) {
+			    const unsigned char *bufp = tlv.data;
 			    unsigned int use =
 				(bufp[0] << 24) | (bufp[1] << 16) |
 				(bufp[2] << 8) | bufp[3];
 			    ops->received_symkey(opdata, context, use,
-				    bufp+4, tlv->len - 4, extrakey);
+				    bufp+4, tlv.len - 4, extrakey);
 			}
 		    }
 		    gcry_free(extrakey);
@@ -1424,18 +2176,27 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    /* If TLVs contain SMP data, process it */
 		    nextMsg = context->smstate->nextExpected;
 
-		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP1Q);
-		    if (tlv) {
-			if (nextMsg == OTRL_SMP_EXPECT1 && tlv->len > 0) {
+		    if (otrl_tlv_view_find(&tlv, tlvdata, tlvlen,
+				OTRL_TLV_SMP1Q)) {
+			if (nextMsg == OTRL_SMP_EXPECT1 && tlv.len > 0) {
 			    /* We can only do the verification half now.
 			     * We must wait for the secret to be entered
 			     * to continue. */
-			    char *question = (char *)tlv->data;
-			    char *qend = memchr(question, '\0', tlv->len - 1);
-			    size_t qlen = qend ? (qend - question + 1) :
-				    tlv->len;
-			    otrl_sm_step2a(context->smstate, tlv->data + qlen,
-				    tlv->len - qlen, 1);
+			    const char *qdata = (const char *)tlv.data;
+			    const char *qend = memchr(qdata, '\0', tlv.len - 1);
+			    size_t qlen = qend ? (qend - qdata + 1) : tlv.len;
+			    /* The TLV isn't NUL-terminated, so the question
+			     * needs a copy to be handed on as a string */
+			    char *question = malloc(qlen + 1);
+			    if (question) {
+				memmove(question, qdata, qlen);
+				question[qlen] = '\0';
+			    }
+			    tracestart = otrl_trace_begin(us);
+			    otrl_sm_step2a(context->smstate, tlv.data + qlen,
+				    tlv.len - qlen, 1);
+			    otrl_trace_end(us, tracestart, OTRL_TRACE_SM_STEP2A,
+				    context, tlv.len, 0);
 
 			    if (context->smstate->sm_prog_state !=
 				    OTRL_SMP_PROG_CHEATED) {
@@ -1455,6 +2216,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 				context->smstate->sm_prog_state =
 					OTRL_SMP_PROG_OK;
 			    }
+			    free(question);
 			} else {
 			    if (ops->handle_smp_event) {
 				ops->handle_smp_event(opdata,
@@ -1464,14 +2226,17 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			}
 		    }
 
-		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP1);
-		    if (tlv) {
+		    if (otrl_tlv_view_find(&tlv, tlvdata, tlvlen,
+				OTRL_TLV_SMP1)) {
 			if (nextMsg == OTRL_SMP_EXPECT1) {
 			    /* We can only do the verification half now.
 			     * We must wait for the secret to be entered
 			     * to continue. */
-			    otrl_sm_step2a(context->smstate, tlv->data,
-				    tlv->len, 0);
+			    tracestart = otrl_trace_begin(us);
+			    otrl_sm_step2a(context->smstate, tlv.data,
+				    tlv.len, 0);
+			    otrl_trace_end(us, tracestart, OTRL_TRACE_SM_STEP2A,
+				    context, tlv.len, 0);
 			    if (context->smstate->sm_prog_state !=
 				    OTRL_SMP_PROG_CHEATED) {
 				if (ops->handle_smp_event) {
@@ -1499,32 +2264,38 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			}
 		    }
 
-		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP2);
-		    if (tlv) {
+		    if (otrl_tlv_view_find(&tlv, tlvdata, tlvlen,
+				OTRL_TLV_SMP2)) {
 			if (nextMsg == OTRL_SMP_EXPECT2) {
 			    unsigned char* nextmsg;
 			    int nextmsglen;
-			    OtrlTLV *sendtlv;
+			    OtrlTLVBuf sendtlvs;
 			    char *sendsmp = NULL;
-			    otrl_sm_step3(context->smstate, tlv->data,
-				    tlv->len, &nextmsg, &nextmsglen);
+			    tracestart = otrl_trace_begin(us);
+			    otrl_sm_step3(context->smstate, tlv.data,
+				    tlv.len, &nextmsg, &nextmsglen);
+			    otrl_trace_end(us, tracestart, OTRL_TRACE_SM_STEP3,
+				    context, tlv.len, nextmsglen);
 
 			    if (context->smstate->sm_prog_state !=
 				    OTRL_SMP_PROG_CHEATED) {
 				/* Send msg with next smp msg content */
-				sendtlv = otrl_tlv_new(OTRL_TLV_SMP3,
-					nextmsglen, nextmsg);
-				err = otrl_proto_create_data(&sendsmp,
-					context, "", sendtlv,
-					OTRL_MSGFLAGS_IGNORE_UNREADABLE,
-					NULL);
+				otrl_tlvbuf_init(&sendtlvs);
+				err = otrl_tlvbuf_append(&sendtlvs,
+					OTRL_TLV_SMP3, nextmsglen, nextmsg);
+				if (!err) {
+				    err = otrl_proto_create_data_tlvbuf(
+					    &sendsmp, context, "", &sendtlvs,
+					    OTRL_MSGFLAGS_IGNORE_UNREADABLE,
+					    NULL);
+				}
 				if (!err) {
-				err = fragment_and_send(ops,
-					opdata, context, sendsmp,
-					OTRL_FRAGMENT_SEND_ALL, NULL);
+				    err = fragment_and_send(ops,
+					    opdata, context, sendsmp,
+					    OTRL_FRAGMENT_SEND_ALL, NULL);
 				}
 				free(sendsmp);
-				otrl_tlv_free(sendtlv);
+				otrl_tlvbuf_free(&sendtlvs);
 
 				if (ops->handle_smp_event) {
 				    ops->handle_smp_event(opdata,
@@ -1554,15 +2325,18 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			}
 		    }
 
-		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP3);
-		    if (tlv) {
+		    if (otrl_tlv_view_find(&tlv, tlvdata, tlvlen,
+				OTRL_TLV_SMP3)) {
 			if (nextMsg == OTRL_SMP_EXPECT3) {
 			    unsigned char* nextmsg;
 			    int nextmsglen;
-			    OtrlTLV *sendtlv;
+			    OtrlTLVBuf sendtlvs;
 			    char *sendsmp = NULL;
-			    err = otrl_sm_step4(context->smstate, tlv->data,
-				    tlv->len, &nextmsg, &nextmsglen);
+			    tracestart = otrl_trace_begin(us);
+			    err = otrl_sm_step4(context->smstate, tlv.data,
+				    tlv.len, &nextmsg, &nextmsglen);
+			    otrl_trace_end(us, tracestart, OTRL_TRACE_SM_STEP4,
+				    context, tlv.len, err ? 0 : nextmsglen);
 			    /* Set trust level based on result */
 			    if (context->smstate->received_question == 0) {
 				set_smp_trust(ops, opdata, context,
@@ -1572,19 +2346,22 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    if (context->smstate->sm_prog_state !=
 				    OTRL_SMP_PROG_CHEATED) {
 				/* Send msg with next smp msg content */
-				sendtlv = otrl_tlv_new(OTRL_TLV_SMP4,
-					nextmsglen, nextmsg);
-				err = otrl_proto_create_data(&sendsmp,
-					context, "", sendtlv,
-					OTRL_MSGFLAGS_IGNORE_UNREADABLE,
-					NULL);
+				otrl_tlvbuf_init(&sendtlvs);
+				err = otrl_tlvbuf_append(&sendtlvs,
+					OTRL_TLV_SMP4, nextmsglen, nextmsg);
 				if (!err) {
-				err = fragment_and_send(ops,
-					opdata, context, sendsmp,
-					OTRL_FRAGMENT_SEND_ALL, NULL);
+				    err = otrl_proto_create_data_tlvbuf(
+					    &sendsmp, context, "", &sendtlvs,
+					    OTRL_MSGFLAGS_IGNORE_UNREADABLE,
+					    NULL);
+				}
+				if (!err) {
+				    err = fragment_and_send(ops,
+					    opdata, context, sendsmp,
+					    OTRL_FRAGMENT_SEND_ALL, NULL);
 				}
 				free(sendsmp);
-				otrl_tlv_free(sendtlv);
+				otrl_tlvbuf_free(&sendtlvs);
 
 				if (ops->handle_smp_event) {
 				    OtrlSMPEvent succorfail =
@@ -1618,11 +2395,14 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			}
 		    }
 
-		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP4);
-		    if (tlv) {
+		    if (otrl_tlv_view_find(&tlv, tlvdata, tlvlen,
+				OTRL_TLV_SMP4)) {
 			if (nextMsg == OTRL_SMP_EXPECT4) {
-			    err = otrl_sm_step5(context->smstate, tlv->data,
-				    tlv->len);
+			    tracestart = otrl_trace_begin(us);
+			    err = otrl_sm_step5(context->smstate, tlv.data,
+				    tlv.len);
+			    otrl_trace_end(us, tracestart, OTRL_TRACE_SM_STEP5,
+				    context, tlv.len, 0);
 			    /* Set trust level based on result */
 			    set_smp_trust(ops, opdata, context,
 				    (err == gcry_error(GPG_ERR_NO_ERROR)));
@@ -1660,8 +2440,8 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			}
 		    }
 
-		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP_ABORT);
-		    if (tlv) {
+		    if (otrl_tlv_view_find(&tlv, tlvdata, tlvlen,
+				OTRL_TLV_SMP_ABORT)) {
 			context->smstate->nextExpected = OTRL_SMP_EXPECT1;
 			if (ops->handle_smp_event) {
 			    ops->handle_smp_event(opdata, OTRL_SMPEVENT_ABORT,
@@ -1683,45 +2463,25 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    context->context_priv->their_keyid > 0) {
 			/* If it's *not* a heartbeat, and we haven't
 			 * sent anything in a while, also send a
-			 * heartbeat. */
+			 * heartbeat, or have otrl_message_poll send it
+			 * if we don't send anything before then. */
 			time_t now = time(NULL);
 			if (context->context_priv->lastsent <
 				(now - HEARTBEAT_INTERVAL)) {
-			    char *heartbeat;
-
-			    /* Create the heartbeat message */
-			    err = otrl_proto_create_data(&heartbeat,
-				    context, "", NULL,
-				    OTRL_MSGFLAGS_IGNORE_UNREADABLE,
-				    NULL);
-			    if (!err) {
-				/* Send it, and inject a debug message */
-				if (ops->inject_message) {
-				    ops->inject_message(opdata, accountname,
-					    protocol, sender, heartbeat);
-				}
-				free(heartbeat);
-
-				context->context_priv->lastsent = now;
-				otrl_context_update_recent_child(context, 1);
-
-				/* Signal an event for the heartbeat message */
-				if (ops->handle_msg_event) {
-				    ops->handle_msg_event(opdata,
-					    OTRL_MSGEVENT_LOG_HEARTBEAT_SENT,
-					    context, NULL,
-					    gcry_error(GPG_ERR_NO_ERROR));
-				}
+			    if (us->heartbeat_max > 0) {
+				heartbeat_defer(us, ops, opdata, context,
+					now);
+			    } else {
+				send_heartbeat(ops, opdata, context, now);
 			    }
 			}
 		    }
 
 		    /* Return the TLVs even if ignore_message == 1 so
-		     * that we can attach TLVs to heartbeats. */
+		     * that we can attach TLVs to heartbeats.  Only build
+		     * a chain of them if the application wants one. */
 		    if (tlvsp) {
-			*tlvsp = tlvs;
-		    } else {
-			otrl_tlv_free(tlvs);
+			*tlvsp = otrl_tlv_parse(tlvdata, tlvlen);
 		    }
 
 		    if (edata.ignore_message != 1) {
@@ -1731,7 +2491,15 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			edata.ignore_message = 0;
 
 			/* convert the plaintext message if necessary */
-			if (ops->convert_msg) {
+			if (us->convert_inplace) {
+			    size_t len = strlen(plaintext);
+			    size_t size = len + 1;
+
+			    convert_in_place(us, opdata, context,
+				    OTRL_CONVERT_RECEIVING, &plaintext, &size,
+				    &len);
+			    *newmessagep = plaintext;
+			} else if (ops->convert_msg) {
 			    ops->convert_msg(opdata, context,
 				    OTRL_CONVERT_RECEIVING, &converted_msg,
 				    plaintext);
@@ -1756,8 +2524,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
 	case OTRL_MSGTYPE_ERROR:
 	    if ((policy & OTRL_POLICY_ERROR_START_AKE)) {
-		char *msgtosend = otrl_proto_default_query_msg(
-			context->accountname, policy);
+		char *msgtosend = context_query_msg(us, context, policy);
 		if (msgtosend && ops->inject_message) {
 		    ops->inject_message(opdata, context->accountname,
 			    context->protocol, context->username,
@@ -1774,6 +2541,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
 	    /* In any event, display the error message, with the
 	     * display_otr_message callback, if possible */
+	    count_receive_error(context, OTRL_MSGEVENT_RCVDMSG_GENERAL_ERR);
 	    if (ops->handle_msg_event) {
 		/* Remove the OTR error prefix and pass the msg */
 		const char *just_err_msg = strstr(message, OTR_ERROR_PREFIX);
@@ -1796,8 +2564,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 
 	case OTRL_MSGTYPE_TAGGEDPLAINTEXT:
 	    /* Strip the tag from the message */
-	    bestversion = otrl_proto_whitespace_bestversion(message,
-		    &startwhite, &endwhite, policy);
+	    bestversion = otrl_proto_bestversion(msginfo.versions, policy);
+	    startwhite = msginfo.whitespace_start;
+	    endwhite = msginfo.whitespace_end;
 	    if (startwhite && endwhite) {
 		size_t restlen = strlen(endwhite);
 		char *strippedmsg = strdup(message);
@@ -1814,30 +2583,30 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		switch(bestversion) {
 		    case 3:
 			err = otrl_auth_start_v23(&(context->auth), 3);
+			if (!err) otrl_stats_add(us->stats.akes_started, 1);
 			send_or_error_auth(ops, opdata, err, context, us);
 			break;
 		    case 2:
 			err = otrl_auth_start_v23(&(context->auth), 2);
+			if (!err) otrl_stats_add(us->stats.akes_started, 1);
 			send_or_error_auth(ops, opdata, err, context, us);
 			break;
 		    case 1:
 			/* Get our private key */
-			privkey = otrl_privkey_find(us, context->accountname,
-				context->protocol);
+			privkey = context_privkey(us, context);
 			if (privkey == NULL) {
 			    /* We've got no private key! */
 			    if (ops->create_privkey) {
 				ops->create_privkey(opdata,
 					context->accountname,
 					context->protocol);
-				privkey = otrl_privkey_find(us,
-					context->accountname,
-					context->protocol);
+				privkey = context_privkey(us, context);
 			    }
 			}
 			if (privkey) {
 			    err = otrl_auth_start_v1(&(context->auth), NULL, 0,
 				    privkey);
+			    if (!err) otrl_stats_add(us->stats.akes_started, 1);
 			    send_or_error_auth(ops, opdata, err, context, us);
 			}
 			break;
@@ -1853,6 +2622,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    (policy & OTRL_POLICY_REQUIRE_ENCRYPTION)) {
 		/* Not fine.  Let the user know. */
 		const char *plainmsg = (*newmessagep) ? *newmessagep : message;
+		count_receive_error(context, OTRL_MSGEVENT_RCVDMSG_UNENCRYPTED);
 		if (ops->handle_msg_event) {
 		    ops->handle_msg_event(opdata,
 			    OTRL_MSGEVENT_RCVDMSG_UNENCRYPTED,
@@ -1867,6 +2637,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	case OTRL_MSGTYPE_UNKNOWN:
 	    /* We received an OTR message we didn't recognize.  Ignore
 	     * it, and signal an event. */
+	    count_receive_error(context, OTRL_MSGEVENT_RCVDMSG_UNRECOGNIZED);
 	    if (ops->handle_msg_event) {
 		ops->handle_msg_event(opdata,
 			OTRL_MSGEVENT_RCVDMSG_UNRECOGNIZED,
@@ -1885,11 +2656,713 @@ end:
     return edata.ignore_message;
 }
 
+/* Handle a message just received from the network.  It is safe to pass
+ * all received messages to this routine.  add_appdata is a function
+ * that will be called in the event that a new ConnContext is created.
+ * It will be passed the data that you supplied, as well as
+ * a pointer to the new ConnContext.  You can use this to add
+ * application-specific information to the ConnContext using the
+ * "context->app" field, for example.  If you don't need to do this, you
+ * can pass NULL for the last two arguments of otrl_message_receiving.
+ *
+ * If non-NULL, ops->convert_msg will be called after a data message is
+ * decrypted.
+ *
+ * If "contextp" is not NULL, it will be set to the ConnContext used for
+ * receiving the message.
+ *
+ * If otrl_message_receiving returns 1, then the message you received
+ * was an internal protocol message, and no message should be delivered
+ * to the user.
+ *
+ * If it returns 0, then check if *messagep was set to non-NULL.  If
+ * so, replace the received message with the contents of *messagep, and
+ * deliver that to the user instead.  You must call
+ * otrl_message_free(*messagep) when you're done with it.  If tlvsp is
+ * non-NULL, *tlvsp will be set to a chain of any TLVs that were
+ * transmitted along with this message.  You must call
+ * otrl_tlv_free(*tlvsp) when you're done with those.
+ *
+ * If otrl_message_receiving returns 0 and *messagep is NULL, then this
+ * was an ordinary, non-OTR message, which should just be delivered to
+ * the user without modification. */
+int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, const char *accountname, const char *protocol,
+	const char *sender, const char *message, char **newmessagep,
+	OtrlTLV **tlvsp, ConnContext **contextp,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    ConnContext *m_context;
+    OtrlPolicy policy;
+    int ignore;
+
+    if (!accountname || !protocol || !sender || !message || !newmessagep)
+	return 0;
+
+    *newmessagep = NULL;
+    if (tlvsp) *tlvsp = NULL;
+
+    if (contextp) {
+	*contextp = NULL;
+    }
+
+    m_context = receiving_master_context(us, ops, opdata, accountname,
+	    protocol, sender, &policy, add_appdata, data);
+
+    /* Should we go on at all? */
+    if ((policy & OTRL_POLICY_VERSION_MASK) == 0) {
+	otrl_context_unlock(m_context);
+	return 0;
+    }
+
+    ignore = receiving_in_context(us, ops, opdata, m_context, policy,
+	    accountname, protocol, sender, message, NULL, newmessagep, tlvsp,
+	    contextp, add_appdata, data);
+    otrl_context_unlock(m_context);
+    return ignore;
+}
+
+/* One message of a batch, and the master context it's for */
+typedef struct {
+    ConnContext *m_context;
+    size_t index;
+} BatchEntry;
+
+/* Order batch entries by master context, keeping the order of the
+ * entries for each context. */
+static int batch_entry_cmp(const void *a, const void *b)
+{
+    const BatchEntry *ea = a, *eb = b;
+    uintptr_t ca = (uintptr_t)ea->m_context, cb = (uintptr_t)eb->m_context;
+
+    if (ca != cb) return ca < cb ? -1 : 1;
+    if (ea->index != eb->index) return ea->index < eb->index ? -1 : 1;
+    return 0;
+}
+
+/* Compute the MACs of the n messages set up in bufs, lens and keys by
+ * batch_premac, all at once, into the premacs of the items which[]
+ * says they came from.  bufs are freed. */
+static void batch_premac_run(const OtrlReceivedMessage *items,
+	OtrlDataMac *premacs, unsigned char *bufs[],
+	unsigned char keys[][20], size_t lens[], size_t which[], int n)
+{
+    unsigned char macs[OTRL_SHA1MB_LANES][20];
+    const unsigned char *msgs[OTRL_SHA1MB_LANES];
+    int j;
+
+    /* One message is no quicker this way; it's left to be MACed as it
+     * would have been anyway */
+    if (n >= 2) {
+	for (j = 0; j < n; ++j) msgs[j] = bufs[j];
+	otrl_sha1mb_hmac(macs, (const unsigned char (*)[20])keys, msgs,
+		lens, n);
+	for (j = 0; j < n; ++j) {
+	    OtrlDataMac *premac = &premacs[which[j]];
+
+	    premac->datamsg = items[which[j]].message;
+	    memmove(premac->mackey, keys[j], 20);
+	    memmove(premac->mac, macs[j], 20);
+	}
+	otrl_mem_wipe(macs, sizeof(macs));
+    }
+    for (j = 0; j < n; ++j) free(bufs[j]);
+    otrl_mem_wipe(keys, n * 20);
+}
+
+/* Work out the MACs of the batch's Data Messages for contexts in the
+ * ENCRYPTED state, several at a time, into premacs (which is indexed
+ * like items).  The messages in a group can be for any mix of
+ * correspondents, each with their own keys; it's only their handling
+ * that has to stay in order within a correspondent, and that happens
+ * later.  A MAC is only ever used if the message turns out to use the
+ * very key it was computed with, so anything that changes in between
+ * just means that message gets MACed again as usual. */
+static void batch_premac(OtrlUserState us, const OtrlReceivedMessage *items,
+	const BatchEntry *entries, size_t numentries, OtrlDataMac *premacs)
+{
+    unsigned char *bufs[OTRL_SHA1MB_LANES];
+    unsigned char keys[OTRL_SHA1MB_LANES][20];
+    size_t lens[OTRL_SHA1MB_LANES];
+    size_t which[OTRL_SHA1MB_LANES];
+    size_t i;
+    int n = 0;
+
+    for (i = 0; i < numentries; ) {
+	ConnContext *m_context = entries[i].m_context;
+
+	otrl_context_lock(m_context);
+	for (; i < numentries && entries[i].m_context == m_context; ++i) {
+	    const OtrlReceivedMessage *item = &items[entries[i].index];
+	    ConnContext *context = m_context;
+	    OtrlMessageInfo msginfo;
+
+	    otrl_proto_message_classify(&msginfo, item->message);
+	    if (msginfo.type != OTRL_MSGTYPE_DATA ||
+		    msginfo.fragment.is_fragment) continue;
+	    if (msginfo.version == 3) {
+		if (!msginfo.has_instances ||
+			msginfo.instance_to != m_context->our_instance ||
+			msginfo.instance_from < OTRL_MIN_VALID_INSTAG) {
+		    continue;
+		}
+		context = otrl_context_find(us, item->sender,
+			item->accountname, item->protocol,
+			msginfo.instance_from, 0, NULL, NULL, NULL);
+	    }
+	    if (!context || context->msgstate != OTRL_MSGSTATE_ENCRYPTED) {
+		continue;
+	    }
+	    if (otrl_proto_data_mac_prepare(context, item->message,
+			&bufs[n], &lens[n], keys[n])) continue;
+	    which[n] = entries[i].index;
+	    if (++n == OTRL_SHA1MB_LANES) {
+		batch_premac_run(items, premacs, bufs, keys, lens, which, n);
+		n = 0;
+	    }
+	}
+	otrl_context_unlock(m_context);
+    }
+    batch_premac_run(items, premacs, bufs, keys, lens, which, n);
+}
+
+/* Handle a batch of count messages just received from the network, as
+ * if each had been passed to otrl_message_receiving.  The messages are
+ * grouped by correspondent: the master context is looked up, and its
+ * policy asked for, once per correspondent per batch, and the messages
+ * in each group are then handled back to back.  Messages from the same
+ * correspondent are always handled in the order they appear in items;
+ * messages from different correspondents may be handled in a different
+ * order.
+ *
+ * Once every message has been handled, handle_results is called once,
+ * with results[i] saying what became of items[i].  The newmessage and
+ * tlvs of each result are freed when handle_results returns; set them
+ * to NULL to keep them (and free them yourself later with
+ * otrl_message_free and otrl_tlv_free).  add_appdata and data are as
+ * for otrl_message_receiving.  The callbacks must not forget any
+ * contexts while the batch is being handled.
+ *
+ * Returns an error, without handling any message, if out of memory. */
+gcry_error_t otrl_message_receiving_batch(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata,
+	const OtrlReceivedMessage *items, size_t count,
+	void (*handle_results)(void *opdata, OtrlReceivedResult *results,
+	    size_t count),
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    OtrlReceivedResult *results;
+    BatchEntry *entries;
+    OtrlDataMac *premacs = NULL;
+    size_t i, numentries = 0;
+    int any_added = 0;
+
+    if (count == 0) return gcry_error(GPG_ERR_NO_ERROR);
+
+    results = calloc(count, sizeof(OtrlReceivedResult));
+    entries = malloc(count * sizeof(BatchEntry));
+    if (!results || !entries) {
+	free(results);
+	free(entries);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    /* Find the master context for each message */
+    for (i = 0; i < count; ++i) {
+	const OtrlReceivedMessage *item = &items[i];
+	int context_added = 0;
+
+	if (!item->accountname || !item->protocol || !item->sender ||
+		!item->message) continue;
+
+	entries[numentries].m_context = otrl_context_find(us, item->sender,
+		item->accountname, item->protocol, OTRL_INSTAG_MASTER, 1,
+		&context_added, add_appdata, data);
+	entries[numentries].index = i;
+	++numentries;
+	if (context_added && us->changes_held) {
+	    note_change(us, ops, opdata, entries[numentries - 1].m_context,
+		    NULL);
+	} else if (context_added) {
+	    any_added = 1;
+	}
+    }
+
+    /* Update the context list if we added any */
+    if (any_added && ops->update_context_list) {
+	ops->update_context_list(opdata);
+    }
+
+    qsort(entries, numentries, sizeof(BatchEntry), batch_entry_cmp);
+
+    /* If several Data Messages' MACs can be checked at once, get them
+     * out of the way first.  This is only a shortcut, so if there's no
+     * memory for it, just go without. */
+    if (numentries >= 2 && otrl_sha1mb_faster()) {
+	premacs = calloc(count, sizeof(OtrlDataMac));
+	if (premacs) batch_premac(us, items, entries, numentries, premacs);
+    }
+
+    for (i = 0; i < numentries; ) {
+	ConnContext *m_context = entries[i].m_context;
+	const OtrlReceivedMessage *first = &items[entries[i].index];
+	OtrlPolicy policy = OTRL_POLICY_DEFAULT;
+
+	otrl_context_lock(m_context);
+
+	/* Find or generate the instance tag if needed */
+	if (!m_context->our_instance) {
+	    populate_context_instag(us, ops, opdata, first->accountname,
+		    first->protocol, m_context);
+	}
+
+	/* Check the policy */
+	if (ops->policy) {
+	    policy = ops->policy(opdata, m_context);
+	}
+	policy = otrl_policy_built(policy);
+
+	for (; i < numentries && entries[i].m_context == m_context; ++i) {
+	    const OtrlReceivedMessage *item = &items[entries[i].index];
+	    OtrlReceivedResult *result = &results[entries[i].index];
+
+	    /* Should we go on at all? */
+	    if ((policy & OTRL_POLICY_VERSION_MASK) == 0) continue;
+
+	    result->ignore = receiving_in_context(us, ops, opdata, m_context,
+		    policy, item->accountname, item->protocol, item->sender,
+		    item->message, premacs ? &premacs[entries[i].index] : NULL,
+		    &result->newmessage, &result->tlvs, &result->context,
+		    add_appdata, data);
+	}
+
+	otrl_context_unlock(m_context);
+    }
+
+    handle_results(opdata, results, count);
+
+    for (i = 0; i < count; ++i) {
+	otrl_message_free(results[i].newmessage);
+	otrl_tlv_free(results[i].tlvs);
+    }
+    free(results);
+    free(entries);
+    if (premacs) {
+	otrl_mem_wipe(premacs, count * sizeof(OtrlDataMac));
+	free(premacs);
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* A message for otrl_message_receiving_offload or
+ * otrl_message_receiving_start to handle */
+typedef struct s_OtrlReceiveJob {
+    struct s_OtrlReceiveJob *next;
+    OtrlUserState us;
+    ConnContext *m_context;
+    const OtrlMessageAppOps *ops;
+    void *opdata;
+    OtrlReceivedMessage item;
+    void (*handle_result)(void *opdata, const OtrlReceivedMessage *item,
+	    OtrlReceivedResult *result);
+    void (*add_appdata)(void *data, ConnContext *context);
+    void *data;
+    int done;                   /* Has result been filled in? */
+    OtrlReceivedResult result;
+} OtrlReceiveJob;
+
+/* Lock the queue of messages waiting for a master context's family.
+ * With offloading, the offload's lock protects it; without, nothing
+ * holds the family lock for long while the queue is busy, so that
+ * does. */
+static void receive_queue_lock(ConnContext *m_context)
+{
+    OtrlOffload *offload = m_context->context_priv->userstate->offload;
+
+    if (offload) {
+	otrl_offload_lock(offload);
+    } else {
+	otrl_context_lock(m_context);
+    }
+}
+
+/* Unlock the queue of messages waiting for a master context's
+ * family. */
+static void receive_queue_unlock(ConnContext *m_context)
+{
+    OtrlOffload *offload = m_context->context_priv->userstate->offload;
+
+    if (offload) {
+	otrl_offload_unlock(offload);
+    } else {
+	otrl_context_unlock(m_context);
+    }
+}
+
+/* Handle one queued message, and report what became of it: to its
+ * handle_result, if it has one, or else in job->result. */
+static void receive_job_handle(OtrlReceiveJob *job)
+{
+    OtrlReceivedResult *result = &job->result;
+
+    result->newmessage = NULL;
+    result->tlvs = NULL;
+    result->context = NULL;
+    result->ignore = otrl_message_receiving(job->us, job->ops, job->opdata,
+	    job->item.accountname, job->item.protocol, job->item.sender,
+	    job->item.message, &result->newmessage, &result->tlvs,
+	    &result->context, job->add_appdata, job->data);
+
+    if (job->handle_result) {
+	job->handle_result(job->opdata, &job->item, result);
+
+	otrl_message_free(result->newmessage);
+	otrl_tlv_free(result->tlvs);
+    }
+}
+
+/* Take the next message off the queue for a master context's family,
+ * which the caller has marked busy, and handle it.  Messages from
+ * otrl_message_receiving_offload are freed; the others are marked
+ * done, for otrl_message_resume to collect.  Returns 0, and marks the
+ * queue idle again, if there were no messages left. */
+static int receive_jobs_step(ConnContext *m_context)
+{
+    ConnContextPriv *priv = m_context->context_priv;
+    OtrlReceiveJob *job;
+
+    receive_queue_lock(m_context);
+    job = priv->offload_head;
+    if (job == NULL) {
+	priv->offload_busy = 0;
+	receive_queue_unlock(m_context);
+	return 0;
+    }
+    priv->offload_head = job->next;
+    if (priv->offload_head == NULL) priv->offload_tail = NULL;
+    receive_queue_unlock(m_context);
+
+    receive_job_handle(job);
+
+    if (job->handle_result) {
+	free(job);
+    } else {
+	receive_queue_lock(m_context);
+	job->done = 1;
+	receive_queue_unlock(m_context);
+    }
+    return 1;
+}
+
+/* Handle the messages queued for a master context's family, in order,
+ * until there are none left. */
+static void receive_jobs_run(void *arg)
+{
+    while (receive_jobs_step(arg));
+}
+
+/* Will handling this message for this master context's family need
+ * expensive public-key operations? */
+static int receive_is_expensive(ConnContext *m_context, const char *message)
+{
+    OtrlMessageInfo info;
+    ConnContext *context;
+    int expensive = 0;
+
+    otrl_proto_message_classify(&info, message);
+
+    /* The last piece of a fragmented message may complete anything, so
+     * assume the worst */
+    if (info.fragment.is_fragment) {
+	return info.fragment.valid && info.fragment.n > 1 &&
+	    info.fragment.k == info.fragment.n;
+    }
+
+    switch (info.type) {
+	case OTRL_MSGTYPE_DH_COMMIT:
+	case OTRL_MSGTYPE_DH_KEY:
+	case OTRL_MSGTYPE_REVEALSIG:
+	case OTRL_MSGTYPE_SIGNATURE:
+	case OTRL_MSGTYPE_V1_KEYEXCH:
+	    return 1;
+	case OTRL_MSGTYPE_DATA:
+	    break;
+	default:
+	    return 0;
+    }
+
+    /* A Data Message is probably an SMP step if an SMP is in progress.
+     * If someone else is busy with this family, it's not worth waiting
+     * to find out. */
+    if (otrl_context_trylock(m_context)) return 1;
+    for (context = m_context; context && context->m_context == m_context;
+	    context = context->next) {
+	if (context->smstate->nextExpected != OTRL_SMP_EXPECT1) {
+	    expensive = 1;
+	    break;
+	}
+    }
+    otrl_context_unlock(m_context);
+    return expensive;
+}
+
+/* Queue a copy of job's message behind any others waiting from the
+ * same correspondent, unless there are none and it needs no expensive
+ * public-key operations.  Returns 1 if it was queued, putting the copy
+ * in *queuedp (if queuedp is non-NULL), 0 if it should be handled right
+ * away instead, or -1 if out of memory.  If job has a handle_result,
+ * and the queue was idle, start emptying it on the userstate's
+ * offload. */
+static int receive_job_queue(OtrlReceiveJob *job, OtrlReceiveJob **queuedp)
+{
+    OtrlUserState us = job->us;
+    ConnContext *m_context;
+    ConnContextPriv *priv;
+    OtrlReceiveJob *queued;
+    size_t alen, plen, slen, mlen;
+    int context_added = 0, idle, start;
+    char *p;
+
+    m_context = otrl_context_find(us, job->item.sender,
+	    job->item.accountname, job->item.protocol, OTRL_INSTAG_MASTER,
+	    1, &context_added, job->add_appdata, job->data);
+    if (context_added) {
+	note_change(us, job->ops, job->opdata, m_context, NULL);
+    }
+    priv = m_context->context_priv;
+
+    receive_queue_lock(m_context);
+    idle = !priv->offload_busy && priv->offload_head == NULL;
+    receive_queue_unlock(m_context);
+    if (idle && !receive_is_expensive(m_context, job->item.message)) {
+	/* Nothing to wait for */
+	return 0;
+    }
+
+    /* Queue a copy of the message, with its strings in the same
+     * block */
+    alen = strlen(job->item.accountname) + 1;
+    plen = strlen(job->item.protocol) + 1;
+    slen = strlen(job->item.sender) + 1;
+    mlen = strlen(job->item.message) + 1;
+    queued = malloc(sizeof(OtrlReceiveJob) + alen + plen + slen + mlen);
+    if (queued == NULL) return -1;
+    *queued = *job;
+    queued->m_context = m_context;
+    queued->done = 0;
+    p = (char *)(queued + 1);
+    queued->item.accountname = memcpy(p, job->item.accountname, alen);
+    queued->item.protocol = memcpy(p += alen, job->item.protocol, plen);
+    queued->item.sender = memcpy(p += plen, job->item.sender, slen);
+    queued->item.message = memcpy(p += slen, job->item.message, mlen);
+    if (queuedp) *queuedp = queued;
+
+    receive_queue_lock(m_context);
+    if (priv->offload_tail) {
+	priv->offload_tail->next = queued;
+    } else {
+	priv->offload_head = queued;
+    }
+    priv->offload_tail = queued;
+    start = job->handle_result && !priv->offload_busy;
+    if (start) priv->offload_busy = 1;
+    receive_queue_unlock(m_context);
+
+    if (start && otrl_offload_run(us->offload, receive_jobs_run,
+		m_context)) {
+	/* We couldn't hand the queue off, so empty it here */
+	receive_jobs_run(m_context);
+    }
+    return 1;
+}
+
+/* Handle a message just received from the network, as
+ * otrl_message_receiving does, but without waiting for any expensive
+ * public-key operations it needs.  If offloading has been set up with
+ * otrl_userstate_set_offload, the AKE messages, the Data Messages that
+ * arrive while an SMP is in progress, and any message that arrives
+ * while earlier ones from the same correspondent are still waiting,
+ * are queued to be handled on another thread, in the order they
+ * arrived; everything else is handled right away.
+ *
+ * Either way, handle_result is called once the message has been
+ * handled (possibly before this returns, and possibly on another
+ * thread), with item holding the message and its sender, and result
+ * saying what became of it, as for otrl_message_receiving_batch.  The
+ * newmessage and tlvs of the result are freed when handle_result
+ * returns; set them to NULL to keep them.  All the other callbacks may
+ * be called on another thread too, and ops, opdata and data must stay
+ * valid until the userstate's offloading is turned off.
+ *
+ * Returns an error, without handling the message, if out of memory. */
+gcry_error_t otrl_message_receiving_offload(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol, const char *sender, const char *message,
+	void (*handle_result)(void *opdata, const OtrlReceivedMessage *item,
+	    OtrlReceivedResult *result),
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    OtrlReceiveJob job;
+
+    if (!accountname || !protocol || !sender || !message || !handle_result)
+	return gcry_error(GPG_ERR_INV_VALUE);
+
+    job.next = NULL;
+    job.us = us;
+    job.m_context = NULL;
+    job.ops = ops;
+    job.opdata = opdata;
+    job.item.accountname = accountname;
+    job.item.protocol = protocol;
+    job.item.sender = sender;
+    job.item.message = message;
+    job.handle_result = handle_result;
+    job.add_appdata = add_appdata;
+    job.data = data;
+    job.done = 0;
+
+    if (us->offload) {
+	int queued = receive_job_queue(&job, NULL);
+
+	if (queued < 0) return gcry_error(GPG_ERR_ENOMEM);
+	if (queued) return gcry_error(GPG_ERR_NO_ERROR);
+    }
+
+    receive_job_handle(&job);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Start handling a message just received from the network, as
+ * otrl_message_receiving does, but stop short of any expensive
+ * public-key operations: if the message is an AKE message, a Data
+ * Message that arrived while an SMP is in progress, the last piece of
+ * a fragmented message, or is from a correspondent with earlier
+ * messages still waiting, set *handlep and return
+ * OTRL_RECEIVE_IN_PROGRESS without handling it yet.  Call
+ * otrl_message_resume with the handle later, when there's time for
+ * the work (or on another thread), to finish handling it.  Otherwise,
+ * set *handlep to NULL, handle the message right away, and return
+ * what otrl_message_receiving would.
+ *
+ * The messages from each correspondent are still handled in the order
+ * they arrived.  ops, opdata and data must stay valid until the
+ * message has been handled, and every handle must be resumed until it
+ * is done before its correspondent's contexts are forgotten. */
+int otrl_message_receiving_start(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol, const char *sender, const char *message,
+	char **newmessagep, OtrlTLV **tlvsp, ConnContext **contextp,
+	OtrlReceiveHandle **handlep,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    OtrlReceiveJob job;
+
+    *handlep = NULL;
+
+    if (accountname && protocol && sender && message && newmessagep) {
+	job.next = NULL;
+	job.us = us;
+	job.m_context = NULL;
+	job.ops = ops;
+	job.opdata = opdata;
+	job.item.accountname = accountname;
+	job.item.protocol = protocol;
+	job.item.sender = sender;
+	job.item.message = message;
+	job.handle_result = NULL;
+	job.add_appdata = add_appdata;
+	job.data = data;
+	job.done = 0;
+
+	/* If we're out of memory, just do the work now */
+	if (receive_job_queue(&job, handlep) > 0) {
+	    *newmessagep = NULL;
+	    if (tlvsp) *tlvsp = NULL;
+	    if (contextp) *contextp = NULL;
+	    return OTRL_RECEIVE_IN_PROGRESS;
+	}
+    }
+
+    return otrl_message_receiving(us, ops, opdata, accountname, protocol,
+	    sender, message, newmessagep, tlvsp, contextp, add_appdata, data);
+}
+
+/* Finish handling a message that otrl_message_receiving_start left in
+ * progress, along with any that arrived before it from the same
+ * correspondent and haven't been handled yet.  If the message has now
+ * been handled, free the handle, put what otrl_message_receiving would
+ * have into *newmessagep, *tlvsp and *contextp (each if non-NULL), and
+ * return what it would have.  If another thread is busy with that
+ * correspondent's messages, return OTRL_RECEIVE_IN_PROGRESS straight
+ * away instead; try again later. */
+int otrl_message_resume(OtrlReceiveHandle *handle, char **newmessagep,
+	OtrlTLV **tlvsp, ConnContext **contextp)
+{
+    ConnContext *m_context = handle->m_context;
+    ConnContextPriv *priv = m_context->context_priv;
+    OtrlOffload *offload = priv->userstate->offload;
+    int ignore;
+
+    receive_queue_lock(m_context);
+    if (!handle->done) {
+	int restart;
+
+	if (priv->offload_busy) {
+	    receive_queue_unlock(m_context);
+	    return OTRL_RECEIVE_IN_PROGRESS;
+	}
+	priv->offload_busy = 1;
+	receive_queue_unlock(m_context);
+
+	/* Our message is still in the queue, so it can't run dry before
+	 * we get to it */
+	while (!handle->done) {
+	    receive_jobs_step(m_context);
+	}
+
+	/* Hand anything that arrived in the meantime back to the
+	 * offload */
+	receive_queue_lock(m_context);
+	restart = offload && priv->offload_head;
+	if (!restart) priv->offload_busy = 0;
+	receive_queue_unlock(m_context);
+	if (restart && otrl_offload_run(offload, receive_jobs_run,
+		    m_context)) {
+	    receive_jobs_run(m_context);
+	}
+    } else {
+	receive_queue_unlock(m_context);
+    }
+
+    if (newmessagep) {
+	*newmessagep = handle->result.newmessage;
+    } else {
+	otrl_message_free(handle->result.newmessage);
+    }
+    if (tlvsp) {
+	*tlvsp = handle->result.tlvs;
+    } else {
+	otrl_tlv_free(handle->result.tlvs);
+    }
+    if (contextp) *contextp = handle->result.context;
+    ignore = handle->result.ignore;
+    free(handle);
+
+    return ignore;
+}
+
 /* Put a connection into the PLAINTEXT state, first sending the
  * other side a notice that we're doing so if we're currently ENCRYPTED,
- * and we think he's logged in. Affects only the specified context. */
+ * and we think he's logged in. Affects only the specified context.  If
+ * queue is not NULL, the notice is added to it instead of being sent,
+ * and the caller is left to tell the application of the change. */
 static void disconnect_context(OtrlUserState us, const OtrlMessageAppOps *ops,
-	void *opdata, ConnContext *context)
+	void *opdata, ConnContext *context, InjectQueue *queue)
 {
     if (!context) return;
 
@@ -1898,25 +3371,32 @@ static void disconnect_context(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    ops->is_logged_in &&
 	    ops->is_logged_in(opdata, context->accountname, context->protocol,
 		    context->username) == 1) {
-	if (ops->inject_message) {
+	if (queue || ops->inject_message) {
 	    char *encmsg = NULL;
 	    gcry_error_t err;
-	    OtrlTLV *tlv = otrl_tlv_new(OTRL_TLV_DISCONNECTED, 0, NULL);
+	    unsigned char tlvdata[4] = { 0, OTRL_TLV_DISCONNECTED, 0, 0 };
+	    OtrlTLVBuf tlvbuf;
 
-	    err = otrl_proto_create_data(&encmsg, context, "", tlv,
+	    /* A single empty TLV needs no allocation at all */
+	    tlvbuf.data = tlvdata;
+	    tlvbuf.len = tlvbuf.size = sizeof(tlvdata);
+	    err = otrl_proto_create_data_tlvbuf(&encmsg, context, "", &tlvbuf,
 		    OTRL_MSGFLAGS_IGNORE_UNREADABLE, NULL);
-	    if (!err) {
+	    if (!err && queue) {
+		/* The queue owns encmsg now, even if it's out of memory */
+		inject_queue_add(queue, context, encmsg);
+		encmsg = NULL;
+	    } else if (!err) {
 		ops->inject_message(opdata, context->accountname,
 			context->protocol, context->username, encmsg);
 	    }
 	    free(encmsg);
-	    otrl_tlv_free(tlv);
 	}
     }
 
     otrl_context_force_plaintext(context);
-    if (ops->update_context_list) {
-	ops->update_context_list(opdata);
+    if (!queue) {
+	note_change(us, ops, opdata, context, NULL);
     }
 }
 
@@ -1933,7 +3413,9 @@ void otrl_message_disconnect(OtrlUserState us, const OtrlMessageAppOps *ops,
 
     if (!context) return;
 
-    disconnect_context(us, ops, opdata, context);
+    otrl_context_lock(context);
+    disconnect_context(us, ops, opdata, context, NULL);
+    otrl_context_unlock(context);
 }
 
 /* Put a connection into the PLAINTEXT state, first sending the
@@ -1953,9 +3435,101 @@ void otrl_message_disconnect_all_instances(OtrlUserState us,
 
     if (!context) return;
 
+    otrl_context_lock(context);
     for (c_iter = context; c_iter && c_iter->m_context == context->m_context;
 	c_iter = c_iter->next) {
-	disconnect_context(us, ops, opdata, c_iter);
+	disconnect_context(us, ops, opdata, c_iter, NULL);
+    }
+    otrl_context_unlock(context);
+}
+
+/* Put every connection of the given accountname and protocol into the
+ * PLAINTEXT state, as otrl_message_disconnect_all_instances would for
+ * each correspondent, and then forget them all, as
+ * otrl_context_forget_account does.  The contexts are walked just
+ * once, and the notices are all handed to a single call of
+ * inject_messages (or to ops->inject_message, one by one, if
+ * inject_messages is NULL), followed by a single call of
+ * ops->update_context_list.  Don't use the account's contexts from
+ * another thread meanwhile. */
+void otrl_message_disconnect_account(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol,
+	void (*inject_messages)(void *opdata, const OtrlInjectMessage *msgs,
+	    size_t count))
+{
+    InjectQueue queue = { NULL, 0, 0, NULL, 0, 0 };
+    ConnContext **masters = NULL;
+    size_t nummasters = 0, masterssize = 0, i;
+    ConnContext *c_iter;
+    char *acct, *proto;
+
+    if (!accountname || !protocol) return;
+
+    /* Find the families in one walk, by comparing the interned
+     * strings' addresses */
+    otrl_userstate_rdlock(us);
+    acct = otrl_userstate_intern_find(us, accountname);
+    proto = otrl_userstate_intern_find(us, protocol);
+    for (c_iter = (acct && proto) ? us->context_root : NULL; c_iter;
+	    c_iter = c_iter->next) {
+	if (c_iter->accountname != acct || c_iter->protocol != proto ||
+		c_iter->m_context != c_iter) continue;
+	if (nummasters == masterssize) {
+	    size_t newsize = masterssize ? 2 * masterssize : 16;
+	    ConnContext **newmasters = realloc(masters,
+		    newsize * sizeof(ConnContext *));
+	    /* Out of memory: deal with the families found so far, and
+	     * leave the rest as they are */
+	    if (!newmasters) break;
+	    masters = newmasters;
+	    masterssize = newsize;
+	}
+	masters[nummasters++] = c_iter;
+    }
+    otrl_userstate_unlock(us);
+
+    if (nummasters == 0) {
+	free(masters);
+	return;
+    }
+
+    for (i = 0; i < nummasters; ++i) {
+	ConnContext *context = masters[i];
+
+	otrl_context_lock(context);
+	for (c_iter = context; c_iter &&
+		c_iter->m_context == context->m_context;
+		c_iter = c_iter->next) {
+	    disconnect_context(us, ops, opdata, c_iter, &queue);
+	}
+	otrl_context_unlock(context);
+    }
+    free(masters);
+
+    /* The notices point at the contexts' strings, so send them before
+     * the contexts are forgotten */
+    if (queue.count > 0) {
+	if (inject_messages) {
+	    inject_messages(opdata, queue.msgs, queue.count);
+	} else if (ops->inject_message) {
+	    for (i = 0; i < queue.count; ++i) {
+		ops->inject_message(opdata, queue.msgs[i].accountname,
+			queue.msgs[i].protocol, queue.msgs[i].recipient,
+			queue.msgs[i].message);
+	    }
+	}
+    }
+    for (i = 0; i < queue.numowned; ++i) {
+	free(queue.owned[i]);
+    }
+    free(queue.owned);
+    free(queue.msgs);
+
+    otrl_context_forget_account(us, accountname, protocol);
+
+    if (ops->update_context_list) {
+	ops->update_context_list(opdata);
     }
 }
 
@@ -1972,13 +3546,22 @@ gcry_error_t otrl_message_symkey(OtrlUserState us,
 	return gcry_error(GPG_ERR_INV_VALUE);
     }
 
+    otrl_context_lock(context);
     if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
 	    context->context_priv->their_keyid > 0) {
-	unsigned char *tlvdata = malloc(usedatalen+4);
 	char *encmsg = NULL;
 	gcry_error_t err;
-	OtrlTLV *tlv;
-
+	OtrlTLVBuf tlvbuf;
+	unsigned char *tlvdata;
+
+	otrl_tlvbuf_init(&tlvbuf);
+	tlvdata = otrl_tlvbuf_reserve(&tlvbuf, OTRL_TLV_SYMKEY,
+		usedatalen+4);
+	if (!tlvdata) {
+	    otrl_context_unlock(context);
+	    return gcry_error(usedatalen+4 > 0xffff ?
+		    GPG_ERR_INV_VALUE : GPG_ERR_ENOMEM);
+	}
 	tlvdata[0] = (use >> 24) & 0xff;
 	tlvdata[1] = (use >> 16) & 0xff;
 	tlvdata[2] = (use >> 8) & 0xff;
@@ -1987,25 +3570,64 @@ gcry_error_t otrl_message_symkey(OtrlUserState us,
 	    memmove(tlvdata+4, usedata, usedatalen);
 	}
 
-	tlv = otrl_tlv_new(OTRL_TLV_SYMKEY, usedatalen+4, tlvdata);
-	free(tlvdata);
-
-	err = otrl_proto_create_data(&encmsg, context, "", tlv,
+	err = otrl_proto_create_data_tlvbuf(&encmsg, context, "", &tlvbuf,
 		OTRL_MSGFLAGS_IGNORE_UNREADABLE, symkey);
 	if (!err && ops->inject_message) {
 	    ops->inject_message(opdata, context->accountname,
 		    context->protocol, context->username, encmsg);
 	}
 	free(encmsg);
-	otrl_tlv_free(tlv);
+	otrl_tlvbuf_free(&tlvbuf);
 
+	otrl_context_unlock(context);
 	return err;
     }
+    otrl_context_unlock(context);
 
     /* We weren't in an encrypted session. */
     return gcry_error(GPG_ERR_INV_VALUE);
 }
 
+/* Tell the application about the changes held back, if they're due by
+ * now, with one call to us->coalesced_changes, or else one to each of
+ * update_context_list and write_fingerprints. */
+static void changes_deliver(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, time_t now)
+{
+    ConnContext **contexts = NULL;
+    Fingerprint **fingerprints = NULL;
+    size_t ncontexts = 0, nfingerprints = 0;
+    OtrlCoalescedChanges coalesced_changes;
+    int due;
+
+    if (us->changes_due == 0) return;
+
+    otrl_userstate_wrlock(us);
+    due = otrl_userstate_changed_take(us, now, &contexts, &ncontexts,
+	    &fingerprints, &nfingerprints);
+    coalesced_changes = us->coalesced_changes;
+    otrl_userstate_unlock(us);
+    if (!due) goto done;
+
+    if (coalesced_changes) {
+	if (ncontexts > 0 || nfingerprints > 0) {
+	    coalesced_changes(opdata, contexts, ncontexts,
+		    fingerprints, nfingerprints);
+	}
+    } else if (ops) {
+	if (ncontexts > 0 && ops->update_context_list) {
+	    ops->update_context_list(opdata);
+	}
+	if (nfingerprints > 0 && ops->write_fingerprints) {
+	    ops->write_fingerprints(opdata);
+	}
+    }
+
+done:
+    free(contexts);
+    free(fingerprints);
+}
+
 /* If you do _not_ define a timer_control callback function, set a timer
  * to go off every definterval =
  * otrl_message_poll_get_default_interval(userstate) seconds, and call
@@ -2019,22 +3641,69 @@ unsigned int otrl_message_poll_get_default_interval(OtrlUserState us)
  * timer_control callback, or every definterval =
  * otrl_message_poll_get_default_interval(userstate) seconds if you have
  * no timer_control callback.  This function must be called from the
- * main libotr thread.*/
+ * main libotr thread, unless the userstate is in the threaded mode, in
+ * which case any thread may call it; conversations that other threads
+ * are busy with are then left for next time. */
 void otrl_message_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata)
 {
     /* Wipe private keys last sent before this time */
-    time_t expire_before = time(NULL) - MAX_AKE_WAIT_TIME;
+    time_t now = time(NULL);
+    time_t expire_before = now - MAX_AKE_WAIT_TIME;
+    time_t next;
+    unsigned int interval;
+    int set_timer = 0;
 
     ConnContext *contextp;
 
-    /* Is there a context still waiting for a DHKEY message, even after
-     * we wipe the stale ones? */
-    int still_waiting = 0;
-
     if (us == NULL) return;
 
-    for (contextp = us->context_root; contextp; contextp = contextp->next) {
+    /* Answer any DH-Commits held back that there is now room for, send
+     * the heartbeats that are due, and tell the application about the
+     * changes held back */
+    ake_run_deferred(us, ops, opdata, now);
+    heartbeat_run_deferred(us, ops, opdata, now);
+    changes_deliver(us, ops, opdata, now);
+
+    otrl_userstate_wrlock(us);
+
+    /* Only the contexts with an AKE or a fragmented message that may
+     * have expired by now need looking at */
+    while ((contextp = otrl_userstate_deadline_pop(us, now)) != NULL) {
+	ConnContextPriv *priv = contextp->context_priv;
+
+	/* Don't wait for a conversation another thread is working on;
+	 * we'll get to it next time. */
+	if (otrl_context_trylock(contextp)) {
+	    otrl_userstate_deadline_add(us, contextp, now + 1);
+	    continue;
+	}
+
+	/* Throw away any fragmented message that has taken too long to
+	 * arrive in full. */
+	if (priv->fragment_n > 0 && us->fragment_timeout > 0) {
+	    time_t expiry = priv->fragment_time + us->fragment_timeout;
+
+	    if (expiry <= now) {
+		otrl_context_priv_fragment_drop(priv);
+	    } else {
+		otrl_userstate_deadline_add(us, contextp, expiry);
+	    }
+	}
+
+	/* Throw away the copy of the last message sent once it's been
+	 * kept long enough. */
+	if (priv->lastmessage && us->retransmit_timeout > 0) {
+	    time_t expiry = priv->lastsent + us->retransmit_timeout;
+
+	    if (expiry <= now) {
+		otrl_context_priv_lastmessage_drop(priv);
+		otrl_stats_add(us->stats.retransmits_dropped, 1);
+	    } else {
+		otrl_userstate_deadline_add(us, contextp, expiry);
+	    }
+	}
+
 	/* If this is a master context, and it's still waiting for a
 	 * v3 DHKEY message, see if it's waited long enough. */
 	if (contextp->m_context == contextp &&
@@ -2043,16 +3712,86 @@ void otrl_message_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
 		contextp->auth.commit_sent_time > 0) {
 	    if (contextp->auth.commit_sent_time < expire_before) {
 		otrl_auth_clear(&contextp->auth);
+		otrl_stats_add(us->stats.akes_expired, 1);
 	    } else {
 		/* Not yet expired */
-		still_waiting = 1;
+		otrl_userstate_deadline_add(us, contextp,
+			contextp->auth.commit_sent_time +
+			MAX_AKE_WAIT_TIME + 1);
+	    }
+	}
+
+	otrl_context_unlock(contextp);
+    }
+
+    /* Free the session keys of the contexts that have been idle for
+     * long enough, leaving any another thread is working on until next
+     * time. */
+    if (us->hibernate_idle > 0 && now >= us->hibernate_next) {
+	time_t idle_before = now - us->hibernate_idle;
+
+	for (contextp = us->context_root; contextp;
+		contextp = contextp->next) {
+	    ConnContextPriv *priv = contextp->context_priv;
+
+	    if (otrl_context_trylock(contextp)) continue;
+	    if (priv->sesskeys &&
+		    contextp->msgstate != OTRL_MSGSTATE_ENCRYPTED &&
+		    priv->lastsent < idle_before &&
+		    priv->lastrecv < idle_before) {
+		otrl_context_priv_hibernate(priv);
 	    }
+	    otrl_context_unlock(contextp);
+	}
+	us->hibernate_next = now +
+	    (us->hibernate_idle > 1 ? us->hibernate_idle / 2 : 1);
+    }
+
+    /* Have the timer go off when the next thing may expire, or stop it,
+     * if possible, if there's nothing more to wait for.  Only tell the
+     * application when that changes: many call otrl_message_poll
+     * straight from timer_control, and would otherwise never return. */
+    next = otrl_userstate_deadline_next(us);
+    interval = next > now ? (unsigned int)(next - now) : (next > 0);
+    if (us->hibernate_idle > 0) {
+	/* Come back for the next look for idle contexts */
+	unsigned int hibernate_interval = us->hibernate_next > now ?
+	    (unsigned int)(us->hibernate_next - now) : 1;
+
+	if (interval == 0 || hibernate_interval < interval) {
+	    interval = hibernate_interval;
 	}
     }
+    if (us->heartbeat_head) {
+	/* Come back when the next heartbeat is due */
+	time_t due = us->heartbeat_head->context_priv->heartbeat_when;
+	unsigned int heartbeat_interval = due > now ?
+	    (unsigned int)(due - now) : 1;
+
+	if (interval == 0 || heartbeat_interval < interval) {
+	    interval = heartbeat_interval;
+	}
+    }
+    if (us->changes_due > 0) {
+	/* Come back when the changes held back are to be told about */
+	unsigned int changes_interval = us->changes_due > now ?
+	    (unsigned int)(us->changes_due - now) : 1;
+
+	if (interval == 0 || changes_interval < interval) {
+	    interval = changes_interval;
+	}
+    }
+    if (us->ake_deferred_used > 0 && interval != 1) {
+	/* Look for room for the DH-Commits still held back */
+	interval = 1;
+    }
+    if (ops && ops->timer_control && interval != us->timer_running) {
+	us->timer_running = interval;
+	set_timer = 1;
+    }
+    otrl_userstate_unlock(us);
 
-    /* If there's nothing more to wait for, stop the timer, if possible. */
-    if (still_waiting == 0 && ops && ops->timer_control) {
-	ops->timer_control(opdata, 0);
-	us->timer_running = 0;
+    if (set_timer) {
+	ops->timer_control(opdata, interval);
     }
 }
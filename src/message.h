@@ -72,11 +72,6 @@ typedef enum {
     OTRL_NOTIFY_INFO
 } OtrlNotifyLevel;
 
-typedef enum {
-    OTRL_CONVERT_SENDING,
-    OTRL_CONVERT_RECEIVING
-} OtrlConvertType;
-
 typedef struct s_OtrlMessageAppOps {
     /* Return the OTR policy for the given context. */
     OtrlPolicy (*policy)(void *opdata, ConnContext *context);
@@ -264,6 +259,10 @@ typedef struct s_OtrlMessageAppOps {
      * must call otrl_message_poll(userstate, uiops, uiopdata); from the
      * main libotr thread.
      *
+     * Each time libotr calls timer_control, interval is how long
+     * until the next piece of stale state is due to be cleaned up, so
+     * it may change from one call to the next.
+     *
      * The timing does not have to be exact; this timer is used to
      * provide forward secrecy by cleaning up stale private state that
      * may otherwise stick around in memory.  Note that the
@@ -310,9 +309,15 @@ void otrl_message_free(char *message);
  * tlvs is a chain of OtrlTLVs to append to the private message.  It is
  * usually correct to just pass NULL here.
  *
- * If non-NULL, ops->convert_msg will be called just before encrypting a
+ * The userstate's in-place conversion (see
+ * otrl_userstate_set_convert_inplace), if it has one, or else
+ * ops->convert_msg if non-NULL, will be called just before encrypting a
  * message.
  *
+ * If the policy includes OTRL_POLICY_PAD_MESSAGES, the encrypted message
+ * is padded to hide its exact length, but never so much that it would
+ * need an extra fragment; see otrl_proto_create_data_padded.
+ *
  * "instag" specifies the instance tag of the buddy (protocol version 3 only).
  * Meta-instances may also be specified (e.g., OTRL_INSTAG_MOST_SECURE).
  * If "contextp" is not NULL, it will be set to the ConnContext used for
@@ -324,7 +329,10 @@ void otrl_message_free(char *message);
  * tried to encrypt the message, but for some reason failed. DO NOT send the
  * message in the clear in that case. If *messagep gets set by the call to
  * something non-NULL, then you should replace your message with the contents
- * of *messagep, and send that instead.
+ * of *messagep, and send that instead.  If the policy requires encryption
+ * but allows only protocol versions this library was built without, the
+ * message is refused: OTRL_MSGEVENT_ENCRYPTION_REQUIRED is raised and
+ * GPG_ERR_UNSUPPORTED_PROTOCOL returned.
  *
  * Other fragmentation policies are OTRL_FRAGMENT_SEND_ALL,
  * OTRL_FRAGMENT_SEND_ALL_BUT_LAST, or OTRL_FRAGMENT_SEND_ALL_BUT_FIRST. In
@@ -351,7 +359,9 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
  * "context->app" field, for example.  If you don't need to do this, you
  * can pass NULL for the last two arguments of otrl_message_receiving.
  *
- * If non-NULL, ops->convert_msg will be called after a data message is
+ * The userstate's in-place conversion (see
+ * otrl_userstate_set_convert_inplace), if it has one, or else
+ * ops->convert_msg if non-NULL, will be called after a data message is
  * decrypted.
  *
  * If "contextp" is not NULL, it will be set to the ConnContext used for
@@ -379,6 +389,174 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void (*add_appdata)(void *data, ConnContext *context),
 	void *data);
 
+/* One message to send, for otrl_message_sending_batch */
+typedef struct s_OtrlSendMessage {
+    const char *accountname;
+    const char *protocol;
+    const char *recipient;
+    otrl_instag_t instag;
+    const char *message;
+    OtrlTLV *tlvs;
+} OtrlSendMessage;
+
+/* What became of one message passed to otrl_message_sending_batch */
+typedef struct s_OtrlSendResult {
+    gcry_error_t err;        /* What otrl_message_sending would have
+				returned */
+    int injected;            /* Was the message (or its fragments) sent? */
+    ConnContext *context;    /* The context used for sending it */
+} OtrlSendResult;
+
+/* One message or fragment for the network, as the arguments to the
+ * inject_message callback */
+typedef struct s_OtrlInjectMessage {
+    const char *accountname;
+    const char *protocol;
+    const char *recipient;
+    const char *message;
+} OtrlInjectMessage;
+
+/* Encrypt a batch of count messages and send them, as if each had been
+ * passed to otrl_message_sending with OTRL_FRAGMENT_SEND_ALL.  The
+ * ops->max_message_size callback is called only once per
+ * accountname/protocol pair in the batch (with the context of the
+ * first message for that pair), and every message and fragment to be
+ * sent is handed, in order, to a single call of inject_messages.  If
+ * inject_messages is NULL, ops->inject_message is called for each
+ * instead.
+ *
+ * If results is not NULL, it must have room for count entries, and
+ * results[i] is set to what became of items[i].  As with
+ * otrl_message_sending, a message the library leaves alone (an
+ * ordinary plaintext message) is not sent; results[i].injected is 0
+ * for such a message, and the caller should send it as it is.
+ *
+ * add_appdata and data are as for otrl_message_sending.  Errors with
+ * individual messages are reported in results; an error is returned
+ * only if the batch couldn't be started for lack of memory. */
+gcry_error_t otrl_message_sending_batch(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata,
+	const OtrlSendMessage *items, size_t count, OtrlSendResult *results,
+	void (*inject_messages)(void *opdata, const OtrlInjectMessage *msgs,
+	    size_t count),
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data);
+
+/* One message just received from the network, for
+ * otrl_message_receiving_batch */
+typedef struct s_OtrlReceivedMessage {
+    const char *accountname;
+    const char *protocol;
+    const char *sender;
+    const char *message;
+} OtrlReceivedMessage;
+
+/* What became of one message passed to otrl_message_receiving_batch:
+ * ignore is what otrl_message_receiving would have returned, and
+ * newmessage, tlvs and context are what it would have put in
+ * *messagep, *tlvsp and *contextp. */
+typedef struct s_OtrlReceivedResult {
+    int ignore;
+    char *newmessage;
+    OtrlTLV *tlvs;
+    ConnContext *context;
+} OtrlReceivedResult;
+
+/* Handle a batch of count messages just received from the network, as
+ * if each had been passed to otrl_message_receiving.  The messages are
+ * grouped by correspondent: the master context is looked up, and its
+ * policy asked for, once per correspondent per batch, and the messages
+ * in each group are then handled back to back.  Messages from the same
+ * correspondent are always handled in the order they appear in items;
+ * messages from different correspondents may be handled in a different
+ * order.
+ *
+ * Once every message has been handled, handle_results is called once,
+ * with results[i] saying what became of items[i].  The newmessage and
+ * tlvs of each result are freed when handle_results returns; set them
+ * to NULL to keep them (and free them yourself later with
+ * otrl_message_free and otrl_tlv_free).  add_appdata and data are as
+ * for otrl_message_receiving.  The callbacks must not forget any
+ * contexts while the batch is being handled.
+ *
+ * Returns an error, without handling any message, if out of memory. */
+gcry_error_t otrl_message_receiving_batch(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata,
+	const OtrlReceivedMessage *items, size_t count,
+	void (*handle_results)(void *opdata, OtrlReceivedResult *results,
+	    size_t count),
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data);
+
+/* Handle a message just received from the network, as
+ * otrl_message_receiving does, but without waiting for any expensive
+ * public-key operations it needs.  If offloading has been set up with
+ * otrl_userstate_set_offload, the AKE messages, the Data Messages that
+ * arrive while an SMP is in progress, and any message that arrives
+ * while earlier ones from the same correspondent are still waiting,
+ * are queued to be handled on another thread, in the order they
+ * arrived; everything else is handled right away.
+ *
+ * Either way, handle_result is called once the message has been
+ * handled (possibly before this returns, and possibly on another
+ * thread), with item holding the message and its sender, and result
+ * saying what became of it, as for otrl_message_receiving_batch.  The
+ * newmessage and tlvs of the result are freed when handle_result
+ * returns; set them to NULL to keep them.  All the other callbacks may
+ * be called on another thread too, and ops, opdata and data must stay
+ * valid until the userstate's offloading is turned off.
+ *
+ * Returns an error, without handling the message, if out of memory. */
+gcry_error_t otrl_message_receiving_offload(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol, const char *sender, const char *message,
+	void (*handle_result)(void *opdata, const OtrlReceivedMessage *item,
+	    OtrlReceivedResult *result),
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data);
+
+/* What otrl_message_receiving_start and otrl_message_resume return
+ * while a message is still waiting to be handled */
+#define OTRL_RECEIVE_IN_PROGRESS 2
+
+/* A message that otrl_message_receiving_start left in progress */
+typedef struct s_OtrlReceiveJob OtrlReceiveHandle;
+
+/* Start handling a message just received from the network, as
+ * otrl_message_receiving does, but stop short of any expensive
+ * public-key operations: if the message is an AKE message, a Data
+ * Message that arrived while an SMP is in progress, the last piece of
+ * a fragmented message, or is from a correspondent with earlier
+ * messages still waiting, set *handlep and return
+ * OTRL_RECEIVE_IN_PROGRESS without handling it yet.  Call
+ * otrl_message_resume with the handle later, when there's time for
+ * the work (or on another thread), to finish handling it.  Otherwise,
+ * set *handlep to NULL, handle the message right away, and return
+ * what otrl_message_receiving would.
+ *
+ * The messages from each correspondent are still handled in the order
+ * they arrived.  ops, opdata and data must stay valid until the
+ * message has been handled, and every handle must be resumed until it
+ * is done before its correspondent's contexts are forgotten. */
+int otrl_message_receiving_start(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol, const char *sender, const char *message,
+	char **newmessagep, OtrlTLV **tlvsp, ConnContext **contextp,
+	OtrlReceiveHandle **handlep,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data);
+
+/* Finish handling a message that otrl_message_receiving_start left in
+ * progress, along with any that arrived before it from the same
+ * correspondent and haven't been handled yet.  If the message has now
+ * been handled, free the handle, put what otrl_message_receiving would
+ * have into *newmessagep, *tlvsp and *contextp (each if non-NULL), and
+ * return what it would have.  If another thread is busy with that
+ * correspondent's messages, return OTRL_RECEIVE_IN_PROGRESS straight
+ * away instead; try again later. */
+int otrl_message_resume(OtrlReceiveHandle *handle, char **newmessagep,
+	OtrlTLV **tlvsp, ConnContext **contextp);
+
 /* Put a connection into the PLAINTEXT state, first sending the
  * other side a notice that we're doing so if we're currently ENCRYPTED,
  * and we think he's logged in. Affects only the specified instance. */
@@ -393,6 +571,21 @@ void otrl_message_disconnect_all_instances(OtrlUserState us,
 	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
 	const char *protocol, const char *username);
 
+/* Put every connection of the given accountname and protocol into the
+ * PLAINTEXT state, as otrl_message_disconnect_all_instances would for
+ * each correspondent, and then forget them all, as
+ * otrl_context_forget_account does.  The contexts are walked just
+ * once, and the notices are all handed to a single call of
+ * inject_messages (or to ops->inject_message, one by one, if
+ * inject_messages is NULL), followed by a single call of
+ * ops->update_context_list.  Don't use the account's contexts from
+ * another thread meanwhile. */
+void otrl_message_disconnect_account(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol,
+	void (*inject_messages)(void *opdata, const OtrlInjectMessage *msgs,
+	    size_t count));
+
 /* Initiate the Socialist Millionaires' Protocol */
 void otrl_message_initiate_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata, ConnContext *context, const unsigned char *secret,
@@ -433,7 +626,9 @@ unsigned int otrl_message_poll_get_default_interval(OtrlUserState us);
  * timer_control callback, or every definterval =
  * otrl_message_poll_get_default_interval(userstate) seconds if you have
  * no timer_control callback.  This function must be called from the
- * main libotr thread.*/
+ * main libotr thread, unless the userstate is in the threaded mode, in
+ * which case any thread may call it; conversations that other threads
+ * are busy with are then left for next time. */
 void otrl_message_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata);
 
@@ -0,0 +1,248 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdlib.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* libotr headers */
+#include "offload.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/* A job waiting for, or being run on, another thread */
+typedef struct s_OtrlOffloadJob {
+    struct s_OtrlOffloadJob *next;
+    OtrlOffload *offload;
+    void (*run)(void *job);
+    void *job;
+} OtrlOffloadJob;
+
+struct s_OtrlOffload {
+    pthread_mutex_t mutex;     /* Protects the fields below, and the
+				  queues of the offload's users */
+    pthread_cond_t work;       /* Signalled when a job is queued, or the
+				  pool is stopping */
+    pthread_cond_t idle;       /* Signalled when outstanding drops to 0 */
+    unsigned long outstanding; /* Jobs started but not yet finished */
+    OtrlOffloadSubmit submit;  /* The application's submit, or NULL */
+    void *submitdata;
+    OtrlOffloadJob *head;      /* The pool's queue of jobs */
+    OtrlOffloadJob *tail;
+    int stopping;              /* Should the pool's threads exit? */
+    unsigned int numthreads;   /* How many threads the pool has */
+    pthread_t *threads;
+};
+
+/* Run a job, and note that it's finished. */
+static void offload_job_run(void *arg)
+{
+    OtrlOffloadJob *job = arg;
+    OtrlOffload *offload = job->offload;
+
+    job->run(job->job);
+    free(job);
+
+    pthread_mutex_lock(&(offload->mutex));
+    if (--offload->outstanding == 0) {
+	pthread_cond_broadcast(&(offload->idle));
+    }
+    pthread_mutex_unlock(&(offload->mutex));
+}
+
+/* The body of each of the pool's threads */
+static void *offload_thread(void *arg)
+{
+    OtrlOffload *offload = arg;
+
+    pthread_mutex_lock(&(offload->mutex));
+    for (;;) {
+	OtrlOffloadJob *job;
+
+	while (offload->head == NULL && !offload->stopping) {
+	    pthread_cond_wait(&(offload->work), &(offload->mutex));
+	}
+	job = offload->head;
+	if (job == NULL) break;
+	offload->head = job->next;
+	if (offload->head == NULL) offload->tail = NULL;
+
+	pthread_mutex_unlock(&(offload->mutex));
+	offload_job_run(job);
+	pthread_mutex_lock(&(offload->mutex));
+    }
+    pthread_mutex_unlock(&(offload->mutex));
+    return NULL;
+}
+
+/* Create somewhere to run jobs off the calling thread.  If submit is
+ * non-NULL, jobs are handed to it, along with submitdata; otherwise, a
+ * pool of the given number of threads is started to run them.  Return
+ * NULL if out of memory, if threads is 0 and there is no submit, or if
+ * this libotr was built without thread support. */
+OtrlOffload *otrl_offload_new(unsigned int threads, OtrlOffloadSubmit submit,
+	void *submitdata)
+{
+    OtrlOffload *offload;
+
+    if (submit == NULL && threads == 0) return NULL;
+
+    offload = malloc(sizeof(OtrlOffload));
+    if (offload == NULL) return NULL;
+
+    pthread_mutex_init(&(offload->mutex), NULL);
+    pthread_cond_init(&(offload->work), NULL);
+    pthread_cond_init(&(offload->idle), NULL);
+    offload->outstanding = 0;
+    offload->submit = submit;
+    offload->submitdata = submitdata;
+    offload->head = NULL;
+    offload->tail = NULL;
+    offload->stopping = 0;
+    offload->numthreads = 0;
+    offload->threads = NULL;
+
+    if (submit == NULL) {
+	offload->threads = malloc(threads * sizeof(pthread_t));
+	if (offload->threads == NULL) {
+	    otrl_offload_free(offload);
+	    return NULL;
+	}
+	for (; offload->numthreads < threads; ++offload->numthreads) {
+	    if (pthread_create(&(offload->threads[offload->numthreads]),
+			NULL, offload_thread, offload)) {
+		break;
+	    }
+	}
+	if (offload->numthreads == 0) {
+	    otrl_offload_free(offload);
+	    return NULL;
+	}
+    }
+
+    return offload;
+}
+
+/* Arrange for run(job) to be called on another thread.  Return 0 on
+ * success, or -1 if out of memory (in which case run is not called). */
+int otrl_offload_run(OtrlOffload *offload, void (*run)(void *job),
+	void *job)
+{
+    OtrlOffloadJob *ojob = malloc(sizeof(OtrlOffloadJob));
+
+    if (ojob == NULL) return -1;
+    ojob->next = NULL;
+    ojob->offload = offload;
+    ojob->run = run;
+    ojob->job = job;
+
+    pthread_mutex_lock(&(offload->mutex));
+    ++offload->outstanding;
+    if (offload->submit == NULL) {
+	if (offload->tail) {
+	    offload->tail->next = ojob;
+	} else {
+	    offload->head = ojob;
+	}
+	offload->tail = ojob;
+	pthread_cond_signal(&(offload->work));
+    }
+    pthread_mutex_unlock(&(offload->mutex));
+
+    if (offload->submit) {
+	offload->submit(offload->submitdata, offload_job_run, ojob);
+    }
+    return 0;
+}
+
+/* Take the mutex that the users of an offload share to protect their
+ * queues of work. */
+void otrl_offload_lock(OtrlOffload *offload)
+{
+    pthread_mutex_lock(&(offload->mutex));
+}
+
+/* Release the mutex taken by otrl_offload_lock. */
+void otrl_offload_unlock(OtrlOffload *offload)
+{
+    pthread_mutex_unlock(&(offload->mutex));
+}
+
+/* Wait until every job passed to otrl_offload_run has finished, then
+ * stop the pool's threads (if any) and free the offload. */
+void otrl_offload_free(OtrlOffload *offload)
+{
+    unsigned int i;
+
+    if (offload == NULL) return;
+
+    pthread_mutex_lock(&(offload->mutex));
+    while (offload->outstanding > 0) {
+	pthread_cond_wait(&(offload->idle), &(offload->mutex));
+    }
+    offload->stopping = 1;
+    pthread_cond_broadcast(&(offload->work));
+    pthread_mutex_unlock(&(offload->mutex));
+
+    for (i = 0; i < offload->numthreads; ++i) {
+	pthread_join(offload->threads[i], NULL);
+    }
+    free(offload->threads);
+    pthread_cond_destroy(&(offload->idle));
+    pthread_cond_destroy(&(offload->work));
+    pthread_mutex_destroy(&(offload->mutex));
+    free(offload);
+}
+
+#else
+
+/* Without thread support, there's nowhere else to run anything. */
+OtrlOffload *otrl_offload_new(unsigned int threads, OtrlOffloadSubmit submit,
+	void *submitdata)
+{
+    return NULL;
+}
+
+int otrl_offload_run(OtrlOffload *offload, void (*run)(void *job),
+	void *job)
+{
+    return -1;
+}
+
+void otrl_offload_lock(OtrlOffload *offload)
+{
+}
+
+void otrl_offload_unlock(OtrlOffload *offload)
+{
+}
+
+void otrl_offload_free(OtrlOffload *offload)
+{
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __OFFLOAD_H__
+#define __OFFLOAD_H__
+
+/* An application's way of running jobs off the calling thread: arrange
+ * for run(job) to be called, once, on some other thread. */
+typedef void (*OtrlOffloadSubmit)(void *submitdata,
+	void (*run)(void *job), void *job);
+
+typedef struct s_OtrlOffload OtrlOffload;
+
+/* Create somewhere to run jobs off the calling thread.  If submit is
+ * non-NULL, jobs are handed to it, along with submitdata; otherwise, a
+ * pool of the given number of threads is started to run them.  Return
+ * NULL if out of memory, if threads is 0 and there is no submit, or if
+ * this libotr was built without thread support. */
+OtrlOffload *otrl_offload_new(unsigned int threads, OtrlOffloadSubmit submit,
+	void *submitdata);
+
+/* Arrange for run(job) to be called on another thread.  Return 0 on
+ * success, or -1 if out of memory (in which case run is not called). */
+int otrl_offload_run(OtrlOffload *offload, void (*run)(void *job),
+	void *job);
+
+/* Take or release the mutex that the users of an offload share to
+ * protect their queues of work.  Hold it only briefly, and don't call
+ * anything else while holding it. */
+void otrl_offload_lock(OtrlOffload *offload);
+void otrl_offload_unlock(OtrlOffload *offload);
+
+/* Wait until every job passed to otrl_offload_run has finished, then
+ * stop the pool's threads (if any) and free the offload. */
+void otrl_offload_free(OtrlOffload *offload);
+
+#endif
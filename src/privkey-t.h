@@ -33,6 +33,8 @@ typedef struct s_OtrlPrivKey {
     gcry_sexp_t privkey;
     unsigned char *pubkey_data;
     size_t pubkey_datalen;
+    struct s_OtrlAccount *account;  /* Our entry in the userstate's
+				       account table, or NULL */
 } OtrlPrivKey;
 
 #define OTRL_PUBKEY_TYPE_DSA 0x0000
@@ -45,6 +47,23 @@ typedef struct s_OtrlPendingPrivKey {
 
     char *accountname;
     char *protocol;
+    struct s_OtrlAccount *account;  /* Our entry in the userstate's
+				       account table */
+    void *batch;                    /* The otrl_privkey_generate_batch
+				       call generating this key, or NULL */
 } OtrlPendingPrivKey;
 
+/* The list of privkeys that otrl_privkey_read_indexed has found in a
+ * file but that have not yet been loaded, with where each one's
+ * "account" S-exp is in the file */
+typedef struct s_OtrlPrivKeyIndex {
+    struct s_OtrlPrivKeyIndex *next;
+    struct s_OtrlPrivKeyIndex **tous;
+
+    char *accountname;
+    char *protocol;
+    long offset;
+    size_t length;
+} OtrlPrivKeyIndex;
+
 #endif
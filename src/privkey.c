@@ -18,6 +18,10 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,8 +32,11 @@
 #include <gcrypt.h>
 
 /* libotr headers */
+#include "keystore.h"
+#include "offload.h"
 #include "privkey.h"
 #include "serial.h"
+#include "stats.h"
 
 /* Convert a 20-byte hash value to a 45-byte human-readable value */
 void otrl_privkey_hash_to_human(
@@ -197,13 +204,196 @@ gcry_error_t otrl_privkey_read(OtrlUserState us, const char *filename)
     return err;
 }
 
+/* Read the whole of a FILE* into a new buffer, which the caller must
+ * free(). */
+static gcry_error_t file_read_all(FILE *f, char **bufp, size_t *lenp)
+{
+    struct stat st;
+    char *buf;
+    gcry_error_t err;
+
+    if (fstat(fileno(f), &st)) {
+	err = gcry_error_from_errno(errno);
+	return err;
+    }
+    buf = malloc(st.st_size);
+    if (!buf && st.st_size > 0) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    if (fread(buf, st.st_size, 1, f) != 1) {
+	err = gcry_error_from_errno(errno);
+	free(buf);
+	return err;
+    }
+
+    *bufp = buf;
+    *lenp = st.st_size;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Check that a private key S-exp is a DSA key whose signatures fit
+ * the format, which only has room for a 160-bit q. */
+static gcry_error_t dsa_check(gcry_sexp_t privkey)
+{
+    gcry_sexp_t dsas, qs;
+    gcry_mpi_t q = NULL;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    dsas = gcry_sexp_find_token(privkey, "dsa", 0);
+    qs = gcry_sexp_find_token(dsas, "q", 0);
+    if (qs) q = gcry_sexp_nth_mpi(qs, 1, GCRYMPI_FMT_USG);
+    if (q == NULL || gcry_mpi_get_nbits(q) > 160) {
+	err = gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    gcry_mpi_release(q);
+    gcry_sexp_release(qs);
+    gcry_sexp_release(dsas);
+    return err;
+}
+
+/* Make a new OtrlPrivKey, with its public key, from an "account"
+ * S-exp.  Its accountname and protocol are stored after it in the same
+ * block. */
+static gcry_error_t account_read(gcry_sexp_t accounts, OtrlPrivKey **pp)
+{
+    gcry_sexp_t names, protos, privs;
+    const char *name, *proto;
+    size_t namelen, protolen;
+    const char *token;
+    size_t tokenlen;
+    gcry_error_t err;
+    OtrlPrivKey *p;
+
+    /* It's really an "account" S-exp? */
+    token = gcry_sexp_nth_data(accounts, 0, &tokenlen);
+    if (tokenlen != 7 || strncmp(token, "account", 7)) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    /* Extract the name, protocol, and privkey S-exps */
+    names = gcry_sexp_find_token(accounts, "name", 0);
+    protos = gcry_sexp_find_token(accounts, "protocol", 0);
+    privs = gcry_sexp_find_token(accounts, "private-key", 0);
+    if (!names || !protos || !privs) {
+	gcry_sexp_release(names);
+	gcry_sexp_release(protos);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    /* Extract the actual name and protocol */
+    name = gcry_sexp_nth_data(names, 1, &namelen);
+    proto = gcry_sexp_nth_data(protos, 1, &protolen);
+    if (!name || !proto) {
+	gcry_sexp_release(names);
+	gcry_sexp_release(protos);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+
+    /* Make a new OtrlPrivKey entry */
+    p = malloc(sizeof(*p) + namelen + protolen + 2);
+    if (!p) {
+	gcry_sexp_release(names);
+	gcry_sexp_release(protos);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    p->accountname = (char *)(p + 1);
+    memmove(p->accountname, name, namelen);
+    p->accountname[namelen] = '\0';
+    p->protocol = p->accountname + namelen + 1;
+    memmove(p->protocol, proto, protolen);
+    p->protocol[protolen] = '\0';
+    gcry_sexp_release(names);
+    gcry_sexp_release(protos);
+
+    /* Fill it in, and make its public key before anyone else can
+     * see it */
+    p->pubkey_type = OTRL_PUBKEY_TYPE_DSA;
+    p->privkey = privs;
+    p->account = NULL;
+    err = make_pubkey(&(p->pubkey_data), &(p->pubkey_datalen), p->privkey);
+    if (!err) {
+	err = dsa_check(p->privkey);
+	if (err) free(p->pubkey_data);
+    }
+    if (err) {
+	gcry_sexp_release(privs);
+	free(p);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+
+    *pp = p;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Add a privkey to the front of the given OtrlUserState's list, and
+ * make it the one its account's entry in the account table points to.
+ * The caller must hold the userstate's write lock. */
+static gcry_error_t privkey_link(OtrlUserState us, OtrlPrivKey *p)
+{
+    p->account = otrl_userstate_account_find(us, p->accountname,
+	    p->protocol, 1);
+    if (!p->account) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    p->account->privkey = p;
+    ++p->account->privkey_count;
+
+    p->next = us->privkey_root;
+    if (p->next) {
+	p->next->tous = &(p->next);
+    }
+    p->tous = &(us->privkey_root);
+    us->privkey_root = p;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Look for a privkey by walking the given OtrlUserState's list, for
+ * one that was linked into it by hand rather than through the account
+ * table.  The caller must hold the userstate's lock. */
+static OtrlPrivKey *privkey_find_unindexed(OtrlUserState us,
+	const char *accountname, const char *protocol)
+{
+    OtrlPrivKey *p;
+
+    for(p=us->privkey_root; p; p=p->next) {
+	if (!strcmp(p->accountname, accountname) &&
+		!strcmp(p->protocol, protocol)) {
+	    break;
+	}
+    }
+    return p;
+}
+
+/* The entry in the account table for the given privkey, or NULL.  Only
+ * the privkeys we make ourselves, with their strings in the same block,
+ * are ever in the table; ones linked in by hand may have anything in
+ * their account field. */
+static OtrlAccount *privkey_account(const OtrlPrivKey *p)
+{
+    return p->accountname == (const char *)(p + 1) ? p->account : NULL;
+}
+
+/* Free a privkey that isn't linked into any list. */
+static void privkey_free(OtrlPrivKey *p)
+{
+    /* The ones we make ourselves have their strings in the same block;
+     * ones linked in by hand may not */
+    if (p->accountname != (char *)(p + 1)) {
+	free(p->accountname);
+	free(p->protocol);
+    }
+    gcry_sexp_release(p->privkey);
+    free(p->pubkey_data);
+    free(p);
+}
+
 /* Read a sets of private DSA keys from a FILE* into the given
  * OtrlUserState.  The FILE* must be open for reading. */
 gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf)
 {
-    int privfd;
-    struct stat st;
     char *buf;
+    size_t buflen;
     const char *token;
     size_t tokenlen;
     gcry_error_t err;
@@ -216,22 +406,12 @@ gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf)
     otrl_privkey_forget_all(us);
 
     /* Load the data into a buffer */
-    privfd = fileno(privf);
-    if (fstat(privfd, &st)) {
-	err = gcry_error_from_errno(errno);
-	return err;
-    }
-    buf = malloc(st.st_size);
-    if (!buf && st.st_size > 0) {
-	return gcry_error(GPG_ERR_ENOMEM);
-    }
-    if (fread(buf, st.st_size, 1, privf) != 1) {
-	err = gcry_error_from_errno(errno);
-	free(buf);
+    err = file_read_all(privf, &buf, &buflen);
+    if (err) {
 	return err;
     }
 
-    err = gcry_sexp_new(&allkeys, buf, st.st_size, 0);
+    err = gcry_sexp_new(&allkeys, buf, buflen, 0);
     free(buf);
     if (err) {
 	return err;
@@ -245,103 +425,310 @@ gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf)
 
     /* Get each account */
     for(i=1; i<gcry_sexp_length(allkeys); ++i) {
-	gcry_sexp_t names, protos, privs;
-	char *name, *proto;
 	gcry_sexp_t accounts;
 	OtrlPrivKey *p;
 
 	/* Get the ith "account" S-exp */
 	accounts = gcry_sexp_nth(allkeys, i);
-
-	/* It's really an "account" S-exp? */
-	token = gcry_sexp_nth_data(accounts, 0, &tokenlen);
-	if (tokenlen != 7 || strncmp(token, "account", 7)) {
-	    gcry_sexp_release(accounts);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	/* Extract the name, protocol, and privkey S-exps */
-	names = gcry_sexp_find_token(accounts, "name", 0);
-	protos = gcry_sexp_find_token(accounts, "protocol", 0);
-	privs = gcry_sexp_find_token(accounts, "private-key", 0);
+	err = account_read(accounts, &p);
 	gcry_sexp_release(accounts);
-	if (!names || !protos || !privs) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	/* Extract the actual name and protocol */
-	token = gcry_sexp_nth_data(names, 1, &tokenlen);
-	if (!token) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
+	if (err) {
 	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+	    return err;
 	}
-	name = malloc(tokenlen + 1);
-	if (!name) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
+
+	/* Link it up */
+	otrl_userstate_wrlock(us);
+	err = privkey_link(us, p);
+	otrl_userstate_unlock(us);
+	if (err) {
+	    privkey_free(p);
 	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
+	    return err;
 	}
-	memmove(name, token, tokenlen);
-	name[tokenlen] = '\0';
-	gcry_sexp_release(names);
+    }
+    gcry_sexp_release(allkeys);
 
-	token = gcry_sexp_nth_data(protos, 1, &tokenlen);
-	if (!token) {
-	    free(name);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Skip the S-exp element (an atom, or a whole list) starting at p,
+ * along with any whitespace before it.  Return a pointer just past it,
+ * or NULL if it is malformed or runs past end. */
+static const char *sexp_skip(const char *p, const char *end)
+{
+    int depth = 0;
+
+    do {
+	while (p < end && strchr(" \t\r\n\f\v", *p)) ++p;
+	if (p >= end) return NULL;
+
+	if (*p == '(') {
+	    ++depth;
+	    ++p;
+	} else if (*p == ')') {
+	    if (depth == 0) return NULL;
+	    --depth;
+	    ++p;
+	} else if (*p == '"') {
+	    for (++p; p < end && *p != '"'; ++p) {
+		if (*p == '\\') ++p;
+	    }
+	    if (p >= end) return NULL;
+	    ++p;
+	} else if (*p == '#' || *p == '|' || *p == '[') {
+	    char close = (*p == '[') ? ']' : *p;
+	    p = memchr(p + 1, close, end - p - 1);
+	    if (p == NULL) return NULL;
+	    ++p;
+	} else if (*p >= '0' && *p <= '9') {
+	    /* A length-prefixed raw string, or just a token of digits */
+	    size_t len = 0;
+	    const char *q = p;
+	    while (q < end && *q >= '0' && *q <= '9' && len < (1 << 24)) {
+		len = len * 10 + (*q++ - '0');
+	    }
+	    if (q < end && *q == ':') {
+		if ((size_t)(end - q - 1) < len) return NULL;
+		p = q + 1 + len;
+	    } else {
+		while (p < end && !strchr(" \t\r\n\f\v()\"#|[", *p)) ++p;
+	    }
+	} else {
+	    while (p < end && !strchr(" \t\r\n\f\v()\"#|[", *p)) ++p;
 	}
-	proto = malloc(tokenlen + 1);
-	if (!proto) {
-	    free(name);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
+    } while (depth > 0);
+
+    return p;
+}
+
+/* Is the S-exp element starting at p (after any whitespace) the given
+ * token? */
+static int sexp_is_token(const char *p, const char *end, const char *token)
+{
+    size_t len = strlen(token);
+
+    while (p < end && strchr(" \t\r\n\f\v", *p)) ++p;
+    return (size_t)(end - p) > len && !memcmp(p, token, len) &&
+	strchr(" \t\r\n\f\v()\"#|[", p[len]);
+}
+
+/* Get the value of the "(name ...)" or "(protocol ...)" list of the
+ * given tag in the "account" S-exp from start to end, without parsing
+ * the rest of it.  The new string must be free()d. */
+static gcry_error_t account_index_field(const char *start, const char *end,
+	const char *tag, char **valuep)
+{
+    const char *p = start + 1, *next;
+
+    /* Skip the "account" token */
+    p = sexp_skip(p, end);
+    while (p && (next = sexp_skip(p, end)) != NULL) {
+	while (strchr(" \t\r\n\f\v", *p)) ++p;
+	if (*p == '(' && sexp_is_token(p + 1, next, tag)) {
+	    gcry_sexp_t field;
+	    const char *token;
+	    size_t tokenlen;
+	    gcry_error_t err = gcry_sexp_new(&field, p, next - p, 0);
+
+	    if (err) return err;
+	    token = gcry_sexp_nth_data(field, 1, &tokenlen);
+	    if (!token) {
+		gcry_sexp_release(field);
+		return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+	    }
+	    *valuep = malloc(tokenlen + 1);
+	    if (!*valuep) {
+		gcry_sexp_release(field);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    memmove(*valuep, token, tokenlen);
+	    (*valuep)[tokenlen] = '\0';
+	    gcry_sexp_release(field);
+	    return gcry_error(GPG_ERR_NO_ERROR);
 	}
-	memmove(proto, token, tokenlen);
-	proto[tokenlen] = '\0';
-	gcry_sexp_release(protos);
+	p = next;
+    }
+    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+}
 
-	/* Make a new OtrlPrivKey entry */
-	p = malloc(sizeof(*p));
-	if (!p) {
-	    free(name);
-	    free(proto);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
+/* Forget a privkey index entry.  The caller must hold the userstate's
+ * write lock. */
+static void privkey_index_forget(OtrlPrivKeyIndex *pki)
+{
+    free(pki->accountname);
+    free(pki->protocol);
+
+    *(pki->tous) = pki->next;
+    if (pki->next) {
+	pki->next->tous = pki->tous;
+    }
+
+    free(pki);
+}
+
+/* Read in and parse the privkey of an index entry, add it to the
+ * userstate's list, and forget the entry.  If anything goes wrong, the
+ * entry is forgotten all the same.  The caller must hold the
+ * userstate's write lock. */
+static OtrlPrivKey *privkey_index_load(OtrlUserState us,
+	OtrlPrivKeyIndex *pki)
+{
+    OtrlPrivKey *p = NULL;
+    gcry_sexp_t accounts;
+    char *buf;
+    FILE *privf;
+    int ok = 0;
+
+    buf = malloc(pki->length);
+    privf = fopen(us->privkey_index_file, "rb");
+    if (buf && privf && fseek(privf, pki->offset, SEEK_SET) == 0 &&
+	    fread(buf, pki->length, 1, privf) == 1 &&
+	    !gcry_sexp_new(&accounts, buf, pki->length, 0)) {
+	if (!account_read(accounts, &p)) {
+	    /* Make sure the file still has the key we expected here */
+	    if (!strcmp(p->accountname, pki->accountname) &&
+		    !strcmp(p->protocol, pki->protocol)) {
+		ok = 1;
+	    } else {
+		privkey_free(p);
+	    }
 	}
+	gcry_sexp_release(accounts);
+    }
+    if (privf) fclose(privf);
+    free(buf);
 
-	/* Fill it in and link it up */
-	p->accountname = name;
-	p->protocol = proto;
-	p->pubkey_type = OTRL_PUBKEY_TYPE_DSA;
-	p->privkey = privs;
-	p->next = us->privkey_root;
-	if (p->next) {
-	    p->next->tous = &(p->next);
+    privkey_index_forget(pki);
+    if (!ok) return NULL;
+
+    if (privkey_link(us, p)) {
+	privkey_free(p);
+	return NULL;
+    }
+    return p;
+}
+
+/* Load every privkey still in the given OtrlUserState's index. */
+static void privkey_index_load_all(OtrlUserState us)
+{
+    if (!us) return;
+
+    otrl_userstate_wrlock(us);
+    while (us->privkey_index_root) {
+	privkey_index_load(us, us->privkey_index_root);
+    }
+    otrl_userstate_unlock(us);
+}
+
+/* Read a set of private DSA keys from a file on disk into the given
+ * OtrlUserState, as otrl_privkey_read does, except that only where each
+ * account's key is in the file is noted now.  A key is read in and
+ * parsed when otrl_privkey_find is first called for its account, and
+ * until then it is not in the userstate's privkey_root list.  The file
+ * must not be changed while any keys remain to be read from it; if
+ * one's account no longer matches when it is read, otrl_privkey_find
+ * finds no key for it. */
+gcry_error_t otrl_privkey_read_indexed(OtrlUserState us,
+	const char *filename)
+{
+    FILE *privf;
+    char *buf, *file;
+    size_t buflen;
+    const char *p, *end, *next;
+    OtrlPrivKeyIndex *index = NULL, **indexp = &index;
+    gcry_error_t err;
+
+    /* Release any old ideas we had about our keys */
+    otrl_privkey_forget_all(us);
+
+    /* Open the privkey file.  We use rb mode so that on WIN32, fread()
+     * reads the same number of bytes that fstat() indicates are in the
+     * file. */
+    privf = fopen(filename, "rb");
+    if (!privf) {
+	err = gcry_error_from_errno(errno);
+	return err;
+    }
+    err = file_read_all(privf, &buf, &buflen);
+    fclose(privf);
+    if (err) {
+	return err;
+    }
+
+    file = strdup(filename);
+    if (!file) {
+	free(buf);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    /* Find the "(privkeys" list, and note where each "account" S-exp
+     * in it starts and ends */
+    p = buf;
+    end = buf + buflen;
+    while (p < end && strchr(" \t\r\n\f\v", *p)) ++p;
+    if (p >= end || *p != '(' || !sexp_is_token(p + 1, end, "privkeys") ||
+	    sexp_skip(p, end) == NULL) {
+	err = gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    if (!err) {
+	p = sexp_skip(p + 1, end);
+	while (1) {
+	    OtrlPrivKeyIndex *pki;
+
+	    while (p < end && strchr(" \t\r\n\f\v", *p)) ++p;
+	    if (p >= end || *p == ')') break;
+	    next = sexp_skip(p, end);
+	    if (!next || *p != '(' ||
+		    !sexp_is_token(p + 1, next, "account")) {
+		err = gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+		break;
+	    }
+
+	    pki = malloc(sizeof(*pki));
+	    if (!pki) {
+		err = gcry_error(GPG_ERR_ENOMEM);
+		break;
+	    }
+	    pki->accountname = NULL;
+	    pki->protocol = NULL;
+	    pki->offset = p - buf;
+	    pki->length = next - p;
+	    pki->next = NULL;
+	    pki->tous = indexp;
+	    *indexp = pki;
+	    indexp = &(pki->next);
+
+	    err = account_index_field(p, next, "name", &(pki->accountname));
+	    if (!err) {
+		err = account_index_field(p, next, "protocol",
+			&(pki->protocol));
+	    }
+	    if (err) break;
+	    p = next;
 	}
-	p->tous = &(us->privkey_root);
-	us->privkey_root = p;
-	err = make_pubkey(&(p->pubkey_data), &(p->pubkey_datalen), p->privkey);
-	if (err) {
-	    gcry_sexp_release(allkeys);
-	    otrl_privkey_forget(p);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    free(buf);
+
+    if (err) {
+	while (index) {
+	    OtrlPrivKeyIndex *pki = index;
+	    index = pki->next;
+	    free(pki->accountname);
+	    free(pki->protocol);
+	    free(pki);
 	}
+	free(file);
+	return err;
     }
-    gcry_sexp_release(allkeys);
+
+    otrl_userstate_wrlock(us);
+    us->privkey_index_root = index;
+    if (index) {
+	index->tous = &(us->privkey_index_root);
+    }
+    us->privkey_index_file = file;
+    otrl_userstate_unlock(us);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
@@ -349,30 +736,25 @@ gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf)
 static OtrlPendingPrivKey *pending_find(OtrlUserState us,
 	const char *accountname, const char *protocol)
 {
-    OtrlPendingPrivKey *search = us->pending_root;
+    OtrlAccount *account = otrl_userstate_account_find(us, accountname,
+	    protocol, 0);
 
-    while (search) {
-	if (!strcmp(search->accountname, accountname) &&
-		!strcmp(search->protocol, protocol)) {
-	    /* Found it */
-	    return search;
-	}
-	search = search->next;
-    }
-    return NULL;
+    return account ? account->pending : NULL;
 }
 
 /* Insert an account/protocol pair into the pending privkey list of the
  * given OtrlUserState and return a pointer to the new
- * OtrlPendingPrivKey, or return NULL if it's already there. */
+ * OtrlPendingPrivKey, or return NULL if it's already there (or if out
+ * of memory). */
 static OtrlPendingPrivKey *pending_insert(OtrlUserState us,
 	const char *accountname, const char *protocol)
 {
-    /* See if it's already there */
-    OtrlPendingPrivKey *search = pending_find(us, accountname, protocol);
+    OtrlPendingPrivKey *search;
+    OtrlAccount *account = otrl_userstate_account_find(us, accountname,
+	    protocol, 1);
 
-    if (search) {
-	/* It is */
+    /* See if it's already there */
+    if (!account || account->pending) {
 	return NULL;
     }
 
@@ -382,6 +764,9 @@ static OtrlPendingPrivKey *pending_insert(OtrlUserState us,
 
     search->accountname = strdup(accountname);
     search->protocol = strdup(protocol);
+    search->account = account;
+    search->batch = NULL;
+    account->pending = search;
 
     search->next = us->pending_root;
     us->pending_root = search;
@@ -395,6 +780,7 @@ static OtrlPendingPrivKey *pending_insert(OtrlUserState us,
 static void pending_forget(OtrlPendingPrivKey *ppk)
 {
     if (ppk) {
+	ppk->account->pending = NULL;
 	free(ppk->accountname);
 	free(ppk->protocol);
 
@@ -411,9 +797,11 @@ static void pending_forget(OtrlPendingPrivKey *ppk)
 /* Free the memory associated with the pending privkey list */
 void otrl_privkey_pending_forget_all(OtrlUserState us)
 {
+    otrl_userstate_wrlock(us);
     while(us->pending_root) {
 	pending_forget(us->pending_root);
     }
+    otrl_userstate_unlock(us);
 }
 
 static gcry_error_t sexp_write(FILE *privf, gcry_sexp_t sexp)
@@ -475,16 +863,20 @@ struct s_pending_privkey_calc {
 gcry_error_t otrl_privkey_generate_start(OtrlUserState us,
 	const char *accountname, const char *protocol, void **newkeyp)
 {
-    OtrlPendingPrivKey *found = pending_find(us, accountname, protocol);
+    OtrlPendingPrivKey *found;
     struct s_pending_privkey_calc *ppc;
 
+    otrl_userstate_wrlock(us);
+    found = pending_find(us, accountname, protocol);
     if (found) {
+	otrl_userstate_unlock(us);
 	if (newkeyp) *newkeyp = NULL;
 	return gcry_error(GPG_ERR_EEXIST);
     }
 
     /* We're not already creating this key.  Mark it as in progress. */
     pending_insert(us, accountname, protocol);
+    otrl_userstate_unlock(us);
 
     /* Allocate the working structure */
     ppc = malloc(sizeof(*ppc));
@@ -555,7 +947,9 @@ void otrl_privkey_generate_cancelled(OtrlUserState us, void *newkey)
 	    (struct s_pending_privkey_calc *)newkey;
 
     if (us) {
+	otrl_userstate_wrlock(us);
 	pending_forget(pending_find(us, ppc->accountname, ppc->protocol));
+	otrl_userstate_unlock(us);
     }
 
     /* Deallocate ppc */
@@ -571,7 +965,12 @@ gcry_error_t otrl_privkey_generate_finish(OtrlUserState us,
 	void *newkey, const char *filename)
 {
     gcry_error_t err;
-    FILE *privf = privkey_fopen(filename, &err);
+    FILE *privf;
+
+    /* Read in the indexed keys first, since they may be in the file
+     * we're about to overwrite */
+    privkey_index_load_all(us);
+    privf = privkey_fopen(filename, &err);
     if (!privf) {
 	return err;
     }
@@ -595,9 +994,12 @@ gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
     if (ppc && us && privf) {
 	OtrlPrivKey *p;
 
-	/* Output the other keys we know */
+	/* Output the other keys we know, reading in any we have only
+	 * noted the place of so far */
+	privkey_index_load_all(us);
 	fprintf(privf, "(privkeys\n");
 
+	otrl_userstate_rdlock(us);
 	for (p=us->privkey_root; p; p=p->next) {
 	    /* Skip this one if our new key replaces it */
 	    if (!strcmp(p->accountname, ppc->accountname) &&
@@ -607,6 +1009,7 @@ gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
 
 	    account_write(privf, p->accountname, p->protocol, p->privkey);
 	}
+	otrl_userstate_unlock(us);
 	account_write(privf, ppc->accountname, ppc->protocol, ppc->privkey);
 	fprintf(privf, ")\n");
 
@@ -627,7 +1030,12 @@ gcry_error_t otrl_privkey_generate(OtrlUserState us, const char *filename,
 	const char *accountname, const char *protocol)
 {
     gcry_error_t err;
-    FILE *privf = privkey_fopen(filename, &err);
+    FILE *privf;
+
+    /* Read in the indexed keys first, since they may be in the file
+     * we're about to overwrite */
+    privkey_index_load_all(us);
+    privf = privkey_fopen(filename, &err);
     if (!privf) {
 	return err;
     }
@@ -657,6 +1065,159 @@ gcry_error_t otrl_privkey_generate_FILEp(OtrlUserState us, FILE *privf,
     return err;
 }
 
+/* One key of an otrl_privkey_generate_batch call */
+typedef struct {
+    struct s_pending_privkey_calc *ppc;  /* NULL if we're skipping it */
+    gcry_error_t err;
+} OtrlPrivKeyBatchItem;
+
+/* Run otrl_privkey_generate_calculate for a batch item. */
+static void batch_calculate(void *job)
+{
+    OtrlPrivKeyBatchItem *item = job;
+
+    item->err = otrl_privkey_generate_calculate(item->ppc);
+}
+
+/* Generate private DSA keys for count accounts at once, spreading the
+ * work over the given number of threads, then write them, with the
+ * keys we already have for other accounts, to the named file in one
+ * pass, and load them all into the given OtrlUserState.  The file is
+ * written under a temporary name and renamed into place, so it holds
+ * either all the new keys or none of them.  Accounts whose key is
+ * already being generated are skipped.  If threads is 0, or this
+ * libotr was built without thread support, the keys are generated on
+ * the calling thread.  This must be called from the main thread. */
+gcry_error_t otrl_privkey_generate_batch(OtrlUserState us,
+	const char *filename, const char **accountnames,
+	const char **protocols, unsigned int count, unsigned int threads)
+{
+    OtrlPrivKeyBatchItem *items;
+    OtrlOffload *offload = NULL;
+    OtrlPrivKey *p;
+    FILE *privf = NULL;
+    char *tmpname;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    unsigned int i;
+
+    if (!us || !filename) return gcry_error(GPG_ERR_INV_VALUE);
+    if (count == 0) return gcry_error(GPG_ERR_NO_ERROR);
+
+    items = calloc(count, sizeof(OtrlPrivKeyBatchItem));
+    tmpname = malloc(strlen(filename) + 5);
+    if (!items || !tmpname) {
+	free(items);
+	free(tmpname);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    sprintf(tmpname, "%s.new", filename);
+
+    /* Mark the keys as in progress, as otrl_privkey_generate_start
+     * does */
+    otrl_userstate_wrlock(us);
+    for (i = 0; i < count; ++i) {
+	OtrlPendingPrivKey *ppk = pending_insert(us, accountnames[i],
+		protocols[i]);
+	struct s_pending_privkey_calc *ppc;
+
+	if (!ppk) continue;
+	ppc = malloc(sizeof(*ppc));
+	if (ppc) {
+	    ppc->accountname = strdup(accountnames[i]);
+	    ppc->protocol = strdup(protocols[i]);
+	    ppc->privkey = NULL;
+	}
+	if (!ppc || !ppc->accountname || !ppc->protocol) {
+	    if (ppc) {
+		free(ppc->accountname);
+		free(ppc->protocol);
+		free(ppc);
+	    }
+	    pending_forget(ppk);
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	    break;
+	}
+	ppk->batch = items;
+	items[i].ppc = ppc;
+    }
+    otrl_userstate_unlock(us);
+
+    /* Do the calculations, on the pool's threads if we can get them,
+     * and wait for them all to finish */
+    if (!err && threads > 1) {
+	offload = otrl_offload_new(threads, NULL, NULL);
+    }
+    for (i = 0; !err && i < count; ++i) {
+	if (!items[i].ppc) continue;
+	if (!offload || otrl_offload_run(offload, batch_calculate,
+		    &(items[i]))) {
+	    batch_calculate(&(items[i]));
+	}
+    }
+    if (offload) {
+	otrl_offload_free(offload);
+    }
+    for (i = 0; !err && i < count; ++i) {
+	if (items[i].ppc) err = items[i].err;
+    }
+
+    /* Write the keys we're keeping, then the new ones, to the temporary
+     * file, reading in any indexed keys first */
+    if (!err) {
+	privkey_index_load_all(us);
+	privf = privkey_fopen(tmpname, &err);
+    }
+    if (privf) {
+	fprintf(privf, "(privkeys\n");
+
+	otrl_userstate_rdlock(us);
+	for (p = us->privkey_root; p; p = p->next) {
+	    /* Skip this one if one of our new keys replaces it */
+	    OtrlAccount *account = privkey_account(p);
+
+	    if (account && account->pending &&
+		    account->pending->batch == items) {
+		continue;
+	    }
+	    if (!err) {
+		err = account_write(privf, p->accountname, p->protocol,
+			p->privkey);
+	    }
+	}
+	otrl_userstate_unlock(us);
+	for (i = 0; i < count; ++i) {
+	    struct s_pending_privkey_calc *ppc = items[i].ppc;
+	    if (ppc && !err) {
+		err = account_write(privf, ppc->accountname, ppc->protocol,
+			ppc->privkey);
+	    }
+	}
+	fprintf(privf, ")\n");
+
+	if (fclose(privf) && !err) {
+	    err = gcry_error_from_errno(errno);
+	}
+	if (!err && rename(tmpname, filename)) {
+	    err = gcry_error_from_errno(errno);
+	}
+	if (err) {
+	    remove(tmpname);
+	} else {
+	    err = otrl_privkey_read(us, filename);
+	}
+    }
+
+    for (i = 0; i < count; ++i) {
+	if (items[i].ppc) {
+	    otrl_privkey_generate_cancelled(us, items[i].ppc);
+	}
+    }
+    free(items);
+    free(tmpname);
+
+    return err;
+}
+
 /* Convert a hex character to a value */
 static unsigned int ctoh(char c)
 {
@@ -757,7 +1318,9 @@ gcry_error_t otrl_privkey_read_fingerprints_FILEp(OtrlUserState us,
 		OTRL_INSTAG_MASTER, 1, NULL, add_app_data, data);
 	/* Add the fingerprint if not already there */
 	fng = otrl_context_find_fingerprint(context, fingerprint, 1, NULL);
+	otrl_userstate_wrlock(us);
 	otrl_context_set_trust(fng, trust);
+	otrl_userstate_unlock(us);
     }
 
     return gcry_error(GPG_ERR_NO_ERROR);
@@ -792,6 +1355,7 @@ gcry_error_t otrl_privkey_write_fingerprints_FILEp(OtrlUserState us,
 
     if (!storef) return gcry_error(GPG_ERR_NO_ERROR);
 
+    otrl_userstate_rdlock(us);
     for(context = us->context_root; context; context = context->next) {
 	/* Fingerprints are only stored in the master contexts */
 	if (context->their_instance != OTRL_INSTAG_MASTER) continue;
@@ -808,34 +1372,66 @@ gcry_error_t otrl_privkey_write_fingerprints_FILEp(OtrlUserState us,
 	    fprintf(storef, "\t%s\n", fprint->trust ? fprint->trust : "");
 	}
     }
+    otrl_userstate_unlock(us);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
 /* Fetch the private key from the given OtrlUserState associated with
- * the given account */
+ * the given account, or failing that, from its key store */
 OtrlPrivKey *otrl_privkey_find(OtrlUserState us, const char *accountname,
 	const char *protocol)
 {
-    OtrlPrivKey *p;
+    OtrlPrivKey *p = NULL;
+    OtrlAccount *account;
+    OtrlPrivKeyIndex *pki;
     if (!accountname || !protocol) return NULL;
 
-    for(p=us->privkey_root; p; p=p->next) {
-	if (!strcmp(p->accountname, accountname) &&
-		!strcmp(p->protocol, protocol)) {
-	    return p;
+    otrl_userstate_rdlock(us);
+    account = otrl_userstate_account_find(us, accountname, protocol, 0);
+    if (account) p = account->privkey;
+    if (!p) p = privkey_find_unindexed(us, accountname, protocol);
+    if (p || !us->privkey_index_root) {
+	otrl_userstate_unlock(us);
+	return p ? p :
+	    otrl_keystore_find_privkey(us->keystore, accountname, protocol);
+    }
+    otrl_userstate_unlock(us);
+
+    /* Read it in if otrl_privkey_read_indexed noted where it is.  Look
+     * again once we have the write lock, in case another thread got
+     * there first. */
+    otrl_userstate_wrlock(us);
+    account = otrl_userstate_account_find(us, accountname, protocol, 0);
+    if (account) p = account->privkey;
+    for(pki=us->privkey_index_root; !p && pki; pki=pki->next) {
+	if (!strcmp(pki->accountname, accountname) &&
+		!strcmp(pki->protocol, protocol)) {
+	    p = privkey_index_load(us, pki);
+	    break;
 	}
     }
-    return NULL;
+    otrl_userstate_unlock(us);
+    return p ? p :
+	otrl_keystore_find_privkey(us->keystore, accountname, protocol);
 }
 
-/* Forget a private key */
+/* Forget a private key.  In the threaded mode, the caller must hold the
+ * userstate's write lock. */
 void otrl_privkey_forget(OtrlPrivKey *privkey)
 {
-    free(privkey->accountname);
-    free(privkey->protocol);
-    gcry_sexp_release(privkey->privkey);
-    free(privkey->pubkey_data);
+    OtrlAccount *account = privkey_account(privkey);
+
+    /* If our account's entry points to us, point it at the next key
+     * for the account in the list, if any */
+    if (account && --account->privkey_count == 0) {
+	account->privkey = NULL;
+    } else if (account && account->privkey == privkey) {
+	OtrlPrivKey *p;
+	for (p = privkey->next; p && privkey_account(p) != account;
+		p = p->next);
+	account->privkey = p;
+    }
 
     /* Re-link the list */
     *(privkey->tous) = privkey->next;
@@ -844,15 +1440,34 @@ void otrl_privkey_forget(OtrlPrivKey *privkey)
     }
 
     /* Free the privkey struct */
-    free(privkey);
+    privkey_free(privkey);
 }
 
 /* Forget all private keys in a given OtrlUserState. */
 void otrl_privkey_forget_all(OtrlUserState us)
 {
-    while (us->privkey_root) {
-	otrl_privkey_forget(us->privkey_root);
+    OtrlPrivKey *p, *next;
+
+    otrl_userstate_wrlock(us);
+    /* Every key goes, so each account can just be emptied, rather than
+     * pointed at the next of its keys each time */
+    for (p = us->privkey_root; p; p = next) {
+	OtrlAccount *account = privkey_account(p);
+
+	next = p->next;
+	if (account) {
+	    account->privkey = NULL;
+	    account->privkey_count = 0;
+	}
+	privkey_free(p);
     }
+    us->privkey_root = NULL;
+    while (us->privkey_index_root) {
+	privkey_index_forget(us->privkey_index_root);
+    }
+    free(us->privkey_index_file);
+    us->privkey_index_file = NULL;
+    otrl_userstate_unlock(us);
 }
 
 /* Sign data using a private key.  The data must be small enough to be
@@ -862,41 +1477,76 @@ void otrl_privkey_forget_all(OtrlUserState us)
 gcry_error_t otrl_privkey_sign(unsigned char **sigp, size_t *siglenp,
 	OtrlPrivKey *privkey, const unsigned char *data, size_t len)
 {
-    gcry_mpi_t r,s, datampi;
-    gcry_sexp_t dsas, rs, ss, sigs, datas;
-    size_t nr, ns;
-    const enum gcry_mpi_format format = GCRYMPI_FMT_USG;
-
-    if (privkey->pubkey_type != OTRL_PUBKEY_TYPE_DSA)
-	return gcry_error(GPG_ERR_INV_VALUE);
+    gcry_error_t err;
 
     *sigp = malloc(40);
     if (*sigp == NULL) return gcry_error(GPG_ERR_ENOMEM);
     *siglenp = 40;
 
+    err = otrl_privkey_sign_into(*sigp, privkey, data, len);
+    if (err) {
+	free(*sigp);
+	*sigp = NULL;
+	*siglenp = 0;
+    }
+    return err;
+}
+
+/* Turn the data to be signed or verified into an MPI. */
+static gcry_mpi_t data_to_mpi(const unsigned char *data, size_t len)
+{
+    gcry_mpi_t datampi;
+
     if (len) {
 	gcry_mpi_scan(&datampi, GCRYMPI_FMT_USG, data, len, NULL);
     } else {
 	datampi = gcry_mpi_set_ui(NULL, 0);
     }
-    gcry_sexp_build(&datas, NULL, "(%m)", datampi);
+    return datampi;
+}
+
+/* Sign data using a private key, as otrl_privkey_sign does, but write
+ * the 40-byte signature into the given buffer.  The signing itself is
+ * left to libgcrypt, which blinds it; only a data S-exp is built for
+ * each signature, against the key S-exp read in with the key. */
+gcry_error_t otrl_privkey_sign_into(unsigned char sig[40],
+	OtrlPrivKey *privkey, const unsigned char *data, size_t len)
+{
+    gcry_mpi_t datampi, r = NULL, s = NULL;
+    gcry_sexp_t datas, sigs, rs, ss;
+    size_t nr, ns;
+    const enum gcry_mpi_format format = GCRYMPI_FMT_USG;
+    gcry_error_t err;
+
+    if (privkey->pubkey_type != OTRL_PUBKEY_TYPE_DSA)
+	return gcry_error(GPG_ERR_INV_VALUE);
+
+    datampi = data_to_mpi(data, len);
+    err = gcry_sexp_build(&datas, NULL, "(%m)", datampi);
     gcry_mpi_release(datampi);
-    gcry_pk_sign(&sigs, datas, privkey->privkey);
+    if (err) return err;
+    err = gcry_pk_sign(&sigs, datas, privkey->privkey);
     gcry_sexp_release(datas);
-    dsas = gcry_sexp_find_token(sigs, "dsa", 0);
+    if (err) return err;
+
+    rs = gcry_sexp_find_token(sigs, "r", 0);
+    ss = gcry_sexp_find_token(sigs, "s", 0);
     gcry_sexp_release(sigs);
-    rs = gcry_sexp_find_token(dsas, "r", 0);
-    ss = gcry_sexp_find_token(dsas, "s", 0);
-    gcry_sexp_release(dsas);
-    r = gcry_sexp_nth_mpi(rs, 1, GCRYMPI_FMT_USG);
+    if (rs) r = gcry_sexp_nth_mpi(rs, 1, format);
+    if (ss) s = gcry_sexp_nth_mpi(ss, 1, format);
     gcry_sexp_release(rs);
-    s = gcry_sexp_nth_mpi(ss, 1, GCRYMPI_FMT_USG);
     gcry_sexp_release(ss);
+    if (r == NULL || s == NULL) {
+	gcry_mpi_release(r);
+	gcry_mpi_release(s);
+	return gcry_error(GPG_ERR_BAD_SIGNATURE);
+    }
+
     gcry_mpi_print(format, NULL, 0, &nr, r);
     gcry_mpi_print(format, NULL, 0, &ns, s);
-    memset(*sigp, 0, 40);
-    gcry_mpi_print(format, (*sigp)+(20-nr), nr, NULL, r);
-    gcry_mpi_print(format, (*sigp)+20+(20-ns), ns, NULL, s);
+    memset(sig, 0, 40);
+    gcry_mpi_print(format, sig+(20-nr), nr, NULL, r);
+    gcry_mpi_print(format, sig+20+(20-ns), ns, NULL, s);
     gcry_mpi_release(r);
     gcry_mpi_release(s);
 
@@ -916,11 +1566,7 @@ gcry_error_t otrl_privkey_verify(const unsigned char *sigbuf, size_t siglen,
     if (pubkey_type != OTRL_PUBKEY_TYPE_DSA || siglen != 40)
 	return gcry_error(GPG_ERR_INV_VALUE);
 
-    if (len) {
-	gcry_mpi_scan(&datampi, GCRYMPI_FMT_USG, data, len, NULL);
-    } else {
-	datampi = gcry_mpi_set_ui(NULL, 0);
-    }
+    datampi = data_to_mpi(data, len);
     gcry_sexp_build(&datas, NULL, "(%m)", datampi);
     gcry_mpi_release(datampi);
     gcry_mpi_scan(&r, GCRYMPI_FMT_USG, sigbuf, 20, NULL);
@@ -936,3 +1582,52 @@ gcry_error_t otrl_privkey_verify(const unsigned char *sigbuf, size_t siglen,
     return err;
 }
 
+/* Verify a signature on data using the DSA public key with the given
+ * parameters, as otrl_privkey_verify does, without building any
+ * S-exps. */
+gcry_error_t otrl_privkey_verify_mpi(const unsigned char *sigbuf,
+	size_t siglen, gcry_mpi_t p, gcry_mpi_t q, gcry_mpi_t g,
+	gcry_mpi_t y, const unsigned char *data, size_t len)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    gcry_mpi_t datampi, r, s, w, u1, u2, v;
+
+    if (siglen != 40) return gcry_error(GPG_ERR_INV_VALUE);
+
+    gcry_mpi_scan(&r, GCRYMPI_FMT_USG, sigbuf, 20, NULL);
+    gcry_mpi_scan(&s, GCRYMPI_FMT_USG, sigbuf+20, 20, NULL);
+    if (gcry_mpi_cmp_ui(r, 0) == 0 || gcry_mpi_cmp(r, q) >= 0 ||
+	    gcry_mpi_cmp_ui(s, 0) == 0 || gcry_mpi_cmp(s, q) >= 0) {
+	gcry_mpi_release(r);
+	gcry_mpi_release(s);
+	return gcry_error(GPG_ERR_BAD_SIGNATURE);
+    }
+
+    /* The signature is good if r = (g^u1 y^u2 mod p) mod q, where
+     * w = s^-1 mod q, u1 = Hw mod q and u2 = rw mod q. */
+    datampi = data_to_mpi(data, len);
+    w = gcry_mpi_new(0);
+    u1 = gcry_mpi_new(0);
+    u2 = gcry_mpi_new(0);
+    v = gcry_mpi_new(0);
+    gcry_mpi_invm(w, s, q);
+    gcry_mpi_mulm(u1, datampi, w, q);
+    gcry_mpi_mulm(u2, r, w, q);
+    otrl_powm(v, g, u1, p);
+    otrl_powm(u1, y, u2, p);
+    gcry_mpi_mulm(v, v, u1, p);
+    gcry_mpi_mod(v, v, q);
+    if (gcry_mpi_cmp(v, r)) {
+	err = gcry_error(GPG_ERR_BAD_SIGNATURE);
+    }
+
+    gcry_mpi_release(datampi);
+    gcry_mpi_release(r);
+    gcry_mpi_release(s);
+    gcry_mpi_release(w);
+    gcry_mpi_release(u1);
+    gcry_mpi_release(u2);
+    gcry_mpi_release(v);
+
+    return err;
+}
@@ -55,6 +55,17 @@ gcry_error_t otrl_privkey_read(OtrlUserState us, const char *filename);
  * OtrlUserState.  The FILE* must be open for reading. */
 gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf);
 
+/* Read a set of private DSA keys from a file on disk into the given
+ * OtrlUserState, as otrl_privkey_read does, except that only where each
+ * account's key is in the file is noted now.  A key is read in and
+ * parsed when otrl_privkey_find is first called for its account, and
+ * until then it is not in the userstate's privkey_root list.  The file
+ * must not be changed while any keys remain to be read from it; if
+ * one's account no longer matches when it is read, otrl_privkey_find
+ * finds no key for it. */
+gcry_error_t otrl_privkey_read_indexed(OtrlUserState us,
+	const char *filename);
+
 /* Free the memory associated with the pending privkey list */
 void otrl_privkey_pending_forget_all(OtrlUserState us);
 
@@ -102,6 +113,19 @@ gcry_error_t otrl_privkey_generate(OtrlUserState us, const char *filename,
 gcry_error_t otrl_privkey_generate_FILEp(OtrlUserState us, FILE *privf,
 	const char *accountname, const char *protocol);
 
+/* Generate private DSA keys for count accounts at once, spreading the
+ * work over the given number of threads, then write them, with the
+ * keys we already have for other accounts, to the named file in one
+ * pass, and load them all into the given OtrlUserState.  The file is
+ * written under a temporary name and renamed into place, so it holds
+ * either all the new keys or none of them.  Accounts whose key is
+ * already being generated are skipped.  If threads is 0, or this
+ * libotr was built without thread support, the keys are generated on
+ * the calling thread.  This must be called from the main thread. */
+gcry_error_t otrl_privkey_generate_batch(OtrlUserState us,
+	const char *filename, const char **accountnames,
+	const char **protocols, unsigned int count, unsigned int threads);
+
 /* Read the fingerprint store from a file on disk into the given
  * OtrlUserState.  Use add_app_data to add application data to each
  * ConnContext so created. */
@@ -128,11 +152,12 @@ gcry_error_t otrl_privkey_write_fingerprints_FILEp(OtrlUserState us,
 	FILE *storef);
 
 /* Fetch the private key from the given OtrlUserState associated with
- * the given account */
+ * the given account, or failing that, from its key store */
 OtrlPrivKey *otrl_privkey_find(OtrlUserState us, const char *accountname,
 	const char *protocol);
 
-/* Forget a private key */
+/* Forget a private key.  In the threaded mode, the caller must hold the
+ * userstate's write lock. */
 void otrl_privkey_forget(OtrlPrivKey *privkey);
 
 /* Forget all private keys in a given OtrlUserState. */
@@ -145,10 +170,24 @@ void otrl_privkey_forget_all(OtrlUserState us);
 gcry_error_t otrl_privkey_sign(unsigned char **sigp, size_t *siglenp,
 	OtrlPrivKey *privkey, const unsigned char *data, size_t len);
 
+/* Sign data using a private key, as otrl_privkey_sign does, but write
+ * the 40-byte signature into the given buffer.  The signing itself is
+ * left to libgcrypt, which blinds it; only a data S-exp is built for
+ * each signature, against the key S-exp read in with the key. */
+gcry_error_t otrl_privkey_sign_into(unsigned char sig[40],
+	OtrlPrivKey *privkey, const unsigned char *data, size_t len);
+
 /* Verify a signature on data using a public key.  The data must be
  * small enough to be signed (i.e. already hashed, if necessary). */
 gcry_error_t otrl_privkey_verify(const unsigned char *sigbuf, size_t siglen,
 	unsigned short pubkey_type, gcry_sexp_t pubs,
 	const unsigned char *data, size_t len);
 
+/* Verify a signature on data using the DSA public key with the given
+ * parameters, as otrl_privkey_verify does, without building any
+ * S-exps. */
+gcry_error_t otrl_privkey_verify_mpi(const unsigned char *sigbuf,
+	size_t siglen, gcry_mpi_t p, gcry_mpi_t q, gcry_mpi_t g,
+	gcry_mpi_t y, const unsigned char *data, size_t len);
+
 #endif
@@ -22,10 +22,16 @@
 /* OTR Protocol implementation.  This file should be independent of
  * gaim, so that it can be used to make other clients. */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <time.h>
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -35,9 +41,12 @@
 #include "privkey.h"
 #include "proto.h"
 #include "mem.h"
+#include "protocols.h"
 #include "version.h"
 #include "tlv.h"
 #include "serial.h"
+#include "stats.h"
+#include "trace.h"
 
 #if OTRL_DEBUGGING
 extern const char *OTRL_DEBUGGING_DEBUGSTR;
@@ -96,10 +105,15 @@ const char *otrl_version(void)
     return OTRL_VERSION;
 }
 
+/* The number of MAC keys a context first has room to save: two key
+ * rotations' worth */
+#define SAVED_MAC_KEYS_INITIAL_SIZE 8
+
 /* Store some MAC keys to be revealed later */
 static gcry_error_t reveal_macs(ConnContext *context,
 	DH_sesskeys *sess1, DH_sesskeys *sess2)
 {
+    ConnContextPriv *priv = context->context_priv;
     unsigned int numnew = sess1->rcvmacused + sess1->sendmacused +
 	sess2->rcvmacused + sess2->sendmacused;
     unsigned int newnumsaved;
@@ -108,12 +122,23 @@ static gcry_error_t reveal_macs(ConnContext *context,
     /* Is there anything to do? */
     if (numnew == 0) return gcry_error(GPG_ERR_NO_ERROR);
 
-    newnumsaved = context->context_priv->numsavedkeys + numnew;
-    newmacs = realloc(context->context_priv->saved_mac_keys,
-	    newnumsaved * 20);
-    if (!newmacs) {
-	return gcry_error(GPG_ERR_ENOMEM);
+    /* The buffer is kept from one reveal to the next, so it only needs
+     * to grow (by doubling) when the other side sends many times
+     * without our replying. */
+    newnumsaved = priv->numsavedkeys + numnew;
+    if (newnumsaved > priv->savedkeys_size) {
+	unsigned int newsize = priv->savedkeys_size ?
+	    priv->savedkeys_size : SAVED_MAC_KEYS_INITIAL_SIZE;
+
+	while (newsize < newnumsaved) newsize *= 2;
+	newmacs = realloc(priv->saved_mac_keys, newsize * 20);
+	if (!newmacs) {
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	priv->saved_mac_keys = newmacs;
+	priv->savedkeys_size = newsize;
     }
+    newmacs = priv->saved_mac_keys;
     if (sess1->rcvmacused) {
 	memmove(newmacs + context->context_priv->numsavedkeys * 20,
 		sess1->rcvmackey, 20);
@@ -134,17 +159,68 @@ static gcry_error_t reveal_macs(ConnContext *context,
 		sess2->sendmackey, 20);
 	context->context_priv->numsavedkeys++;
     }
-    context->context_priv->saved_mac_keys = newmacs;
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* Exchange the contents of two DH_sesskeys.  The rotations below use
+ * this so that the cipher and MAC handles of the keys being retired
+ * end up in the slots about to be recomputed, and can be re-keyed
+ * instead of closed and opened again. */
+static void swap_sesskeys(DH_sesskeys *sess1, DH_sesskeys *sess2)
+{
+    DH_sesskeys tmp;
+
+    memmove(&tmp, sess1, sizeof(DH_sesskeys));
+    memmove(sess1, sess2, sizeof(DH_sesskeys));
+    memmove(sess2, &tmp, sizeof(DH_sesskeys));
+}
+
+/* Return in *sessp the session keys between our key ouridx (0 for
+ * our_dh_key, 1 for our_old_dh_key) and their key theiridx (0 for
+ * their_y, 1 for their_old_y).  The rotations below only clear the
+ * slots whose keys changed, so compute them here the first time
+ * they're actually needed. */
+static gcry_error_t get_sesskeys(ConnContext *context, unsigned int ouridx,
+	unsigned int theiridx, DH_sesskeys **sessp)
+{
+    DH_sesskeys *sess;
+    OtrlUserState us = context->context_priv->userstate;
+    const DH_keypair *kp;
+    gcry_mpi_t y;
+    unsigned long long tracestart;
+    gcry_error_t err;
+
+    if (otrl_context_priv_wake(context->context_priv)) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    sess = &(context->context_priv->sesskeys[ouridx][theiridx]);
+    *sessp = sess;
+    if (sess->derived) return gcry_error(GPG_ERR_NO_ERROR);
+
+    kp = ouridx ? &(context->context_priv->our_old_dh_key) :
+	    &(context->context_priv->our_dh_key);
+    y = theiridx ? context->context_priv->their_old_y :
+	    context->context_priv->their_y;
+    if (kp->pub == NULL || y == NULL) {
+	return gcry_error(GPG_ERR_CONFLICT);
+    }
+    tracestart = otrl_trace_begin(us);
+    err = otrl_dh_session_rekey(sess, kp, y);
+    otrl_trace_end(us, tracestart, OTRL_TRACE_DH_SESSION, context, 0, 0);
+    return err;
+}
+
 /* Make a new DH key for us, and rotate old old ones.  Be sure to keep
  * the sesskeys array in sync. */
 static gcry_error_t rotate_dh_keys(ConnContext *context)
 {
     gcry_error_t err;
 
+    if (otrl_context_priv_wake(context->context_priv)) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
     /* Rotate the keypair */
     otrl_dh_keypair_free(&(context->context_priv->our_old_dh_key));
     memmove(&(context->context_priv->our_old_dh_key),
@@ -155,36 +231,20 @@ static gcry_error_t rotate_dh_keys(ConnContext *context)
     err = reveal_macs(context, &(context->context_priv->sesskeys[1][0]),
 	    &(context->context_priv->sesskeys[1][1]));
     if (err) return err;
-    otrl_dh_session_free(&(context->context_priv->sesskeys[1][0]));
-    otrl_dh_session_free(&(context->context_priv->sesskeys[1][1]));
-    memmove(&(context->context_priv->sesskeys[1][0]),
-	    &(context->context_priv->sesskeys[0][0]),
-	    sizeof(DH_sesskeys));
-    memmove(&(context->context_priv->sesskeys[1][1]),
-	    &(context->context_priv->sesskeys[0][1]),
-	    sizeof(DH_sesskeys));
+    otrl_dh_session_clear(&(context->context_priv->sesskeys[1][0]));
+    otrl_dh_session_clear(&(context->context_priv->sesskeys[1][1]));
+    swap_sesskeys(&(context->context_priv->sesskeys[1][0]),
+	    &(context->context_priv->sesskeys[0][0]));
+    swap_sesskeys(&(context->context_priv->sesskeys[1][1]),
+	    &(context->context_priv->sesskeys[0][1]));
 
     /* Create a new DH key */
-    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(context->context_priv->our_dh_key));
+    otrl_dh_gen_keypair_pooled(context->auth.dh_keypool, DH1536_GROUP_ID,
+	    &(context->context_priv->our_dh_key));
     context->context_priv->our_keyid++;
 
-    /* Make the session keys */
-    if (context->context_priv->their_y) {
-	err = otrl_dh_session(&(context->context_priv->sesskeys[0][0]),
-		&(context->context_priv->our_dh_key),
-		context->context_priv->their_y);
-	if (err) return err;
-    } else {
-	otrl_dh_session_blank(&(context->context_priv->sesskeys[0][0]));
-    }
-    if (context->context_priv->their_old_y) {
-	err = otrl_dh_session(&(context->context_priv->sesskeys[0][1]),
-		&(context->context_priv->our_dh_key),
-		context->context_priv->their_old_y);
-	if (err) return err;
-    } else {
-	otrl_dh_session_blank(&(context->context_priv->sesskeys[0][1]));
-    }
+    /* The session keys for the new key are left cleared; get_sesskeys
+     * will compute them when they're first used. */
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
@@ -194,6 +254,10 @@ static gcry_error_t rotate_y_keys(ConnContext *context, gcry_mpi_t new_y)
 {
     gcry_error_t err;
 
+    if (otrl_context_priv_wake(context->context_priv)) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
     /* Rotate the public key */
     gcry_mpi_release(context->context_priv->their_old_y);
     context->context_priv->their_old_y = context->context_priv->their_y;
@@ -202,29 +266,19 @@ static gcry_error_t rotate_y_keys(ConnContext *context, gcry_mpi_t new_y)
     err = reveal_macs(context, &(context->context_priv->sesskeys[0][1]),
 	    &(context->context_priv->sesskeys[1][1]));
     if (err) return err;
-    otrl_dh_session_free(&(context->context_priv->sesskeys[0][1]));
-    otrl_dh_session_free(&(context->context_priv->sesskeys[1][1]));
-    memmove(&(context->context_priv->sesskeys[0][1]),
-	    &(context->context_priv->sesskeys[0][0]),
-	    sizeof(DH_sesskeys));
-    memmove(&(context->context_priv->sesskeys[1][1]),
-	    &(context->context_priv->sesskeys[1][0]),
-	    sizeof(DH_sesskeys));
+    otrl_dh_session_clear(&(context->context_priv->sesskeys[0][1]));
+    otrl_dh_session_clear(&(context->context_priv->sesskeys[1][1]));
+    swap_sesskeys(&(context->context_priv->sesskeys[0][1]),
+	    &(context->context_priv->sesskeys[0][0]));
+    swap_sesskeys(&(context->context_priv->sesskeys[1][1]),
+	    &(context->context_priv->sesskeys[1][0]));
 
     /* Copy in the new public key */
     context->context_priv->their_y = gcry_mpi_copy(new_y);
     context->context_priv->their_keyid++;
 
-    /* Make the session keys */
-    err = otrl_dh_session(&(context->context_priv->sesskeys[0][0]),
-	    &(context->context_priv->our_dh_key),
-	    context->context_priv->their_y);
-    if (err) return err;
-    err = otrl_dh_session(&(context->context_priv->sesskeys[1][0]),
-	    &(context->context_priv->our_old_dh_key),
-	    context->context_priv->their_y);
-    if (err) return err;
-
+    /* The session keys for the new public key are left cleared;
+     * get_sesskeys will compute them when they're first used. */
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
@@ -235,7 +289,7 @@ char *otrl_proto_default_query_msg(const char *ourname, OtrlPolicy policy)
 {
     char *msg;
     int v1_supported, v2_supported, v3_supported;
-    char *version_tag;
+    char version_tag[8];
     char *bufp;
     /* Don't use g_strdup_printf here, because someone (not us) is going
      * to free() the *message pointer, not g_free() it.  We can't
@@ -249,10 +303,10 @@ char *otrl_proto_default_query_msg(const char *ourname, OtrlPolicy policy)
 	    "https://otr.cypherpunks.ca/</a> for more information.";
 
     /* Figure out the version tag */
+    policy = otrl_policy_built(policy);
     v1_supported = (policy & OTRL_POLICY_ALLOW_V1);
     v2_supported = (policy & OTRL_POLICY_ALLOW_V2);
     v3_supported = (policy & OTRL_POLICY_ALLOW_V3);
-    version_tag = malloc(8);
     bufp = version_tag;
     if (v1_supported) {
 	*bufp = '?';
@@ -277,27 +331,144 @@ char *otrl_proto_default_query_msg(const char *ourname, OtrlPolicy policy)
     /* Remove two "%s", add '\0' */
     msg = malloc(strlen(format) + strlen(version_tag) + strlen(ourname) - 3);
     if (!msg) {
-	free(version_tag);
 	return NULL;
     }
     sprintf(msg, format, version_tag, ourname);
-    free(version_tag);
     return msg;
 }
 
-/* Return the best version of OTR support by both sides, given an OTR
- * Query Message and the local policy. */
-unsigned int otrl_proto_query_bestversion(const char *otrquerymsg,
+/* Return a newly-allocated copy of len bytes of str, and a NUL. */
+static char *copy_string(const char *str, size_t len)
+{
+    char *copy = malloc(len + 1);
+
+    if (copy) {
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+    }
+    return copy;
+}
+
+/* Return a pointer to a newly-allocated OTR query message for the
+ * given entry of the userstate's account table, as
+ * otrl_proto_default_query_msg makes it.  The message is kept in the
+ * entry, so after the first time for a policy this is a single copy.
+ * The caller must not hold the userstate's lock. */
+char *otrl_proto_account_query_msg(OtrlUserState us, OtrlAccount *account,
 	OtrlPolicy policy)
 {
-    char *otrtag;
-    unsigned int query_versions = 0;
+    char *msg, *kept;
+    size_t len;
 
+    /* The message only depends on the versions we allow */
+    policy = otrl_policy_built(policy) & OTRL_POLICY_VERSION_MASK;
 
-    otrtag = strstr(otrquerymsg, "?OTR");
-    if (!otrtag) {
-	return 0;
+    otrl_userstate_rdlock(us);
+    if (account->querymsg && account->querymsg_policy == policy) {
+	msg = copy_string(account->querymsg, account->querymsg_len);
+	otrl_userstate_unlock(us);
+	return msg;
+    }
+    otrl_userstate_unlock(us);
+
+    msg = otrl_proto_default_query_msg(account->accountname, policy);
+    if (!msg) return NULL;
+
+    len = strlen(msg);
+    kept = copy_string(msg, len);
+    if (kept) {
+	otrl_userstate_wrlock(us);
+	free(account->querymsg);
+	account->querymsg = kept;
+	account->querymsg_len = len;
+	account->querymsg_policy = policy;
+	otrl_userstate_unlock(us);
+    }
+    return msg;
+}
+
+/* Return a pointer to a newly-allocated copy of msg with the whitespace
+ * tag for the given policy on the end.  The tag is kept in the given
+ * entry of the userstate's account table.  The caller must not hold
+ * the userstate's lock. */
+char *otrl_proto_account_tag_msg(OtrlUserState us, OtrlAccount *account,
+	OtrlPolicy policy, const char *msg)
+{
+    size_t msglen = strlen(msg);
+    char tag[sizeof(OTRL_MESSAGE_TAG_BASE) + sizeof(OTRL_MESSAGE_TAG_V1) +
+	sizeof(OTRL_MESSAGE_TAG_V2) + sizeof(OTRL_MESSAGE_TAG_V3)];
+    size_t taglen;
+    char *taggedmsg, *kept;
+
+    policy &= OTRL_POLICY_VERSION_MASK;
+
+    otrl_userstate_rdlock(us);
+    if (account->tag && account->tag_policy == policy) {
+	taggedmsg = malloc(msglen + account->tag_len + 1);
+	if (taggedmsg) {
+	    memcpy(taggedmsg, msg, msglen);
+	    memcpy(taggedmsg + msglen, account->tag, account->tag_len + 1);
+	}
+	otrl_userstate_unlock(us);
+	return taggedmsg;
+    }
+    otrl_userstate_unlock(us);
+
+    strcpy(tag, OTRL_MESSAGE_TAG_BASE);
+    if (policy & OTRL_POLICY_ALLOW_V1) {
+	strcat(tag, OTRL_MESSAGE_TAG_V1);
+    }
+    if (policy & OTRL_POLICY_ALLOW_V2) {
+	strcat(tag, OTRL_MESSAGE_TAG_V2);
+    }
+    if (policy & OTRL_POLICY_ALLOW_V3) {
+	strcat(tag, OTRL_MESSAGE_TAG_V3);
+    }
+    taglen = strlen(tag);
+
+    kept = copy_string(tag, taglen);
+    if (kept) {
+	otrl_userstate_wrlock(us);
+	free(account->tag);
+	account->tag = kept;
+	account->tag_len = taglen;
+	account->tag_policy = policy;
+	otrl_userstate_unlock(us);
+    }
+
+    taggedmsg = malloc(msglen + taglen + 1);
+    if (taggedmsg) {
+	memcpy(taggedmsg, msg, msglen);
+	memcpy(taggedmsg + msglen, tag, taglen + 1);
     }
+    return taggedmsg;
+}
+
+/* Return the best version of OTR support by both sides, given the set
+ * of versions the other side offered (bit v-1 for version v) and the
+ * local policy. */
+unsigned int otrl_proto_bestversion(unsigned int query_versions,
+	OtrlPolicy policy)
+{
+    policy = otrl_policy_built(policy);
+    if ((policy & OTRL_POLICY_ALLOW_V3) && (query_versions & (1<<2))) {
+	return 3;
+    }
+    if ((policy & OTRL_POLICY_ALLOW_V2) && (query_versions & (1<<1))) {
+	return 2;
+    }
+    if ((policy & OTRL_POLICY_ALLOW_V1) && (query_versions & (1<<0))) {
+	return 1;
+    }
+    return 0;
+}
+
+/* Return the set of versions offered by the OTR Query Message whose
+ * "?OTR" is at otrtag. */
+static unsigned int query_versions_at(const char *otrtag)
+{
+    unsigned int query_versions = 0;
+
     otrtag += 4;
 
     if (*otrtag == '?') {
@@ -316,36 +487,17 @@ unsigned int otrl_proto_query_bestversion(const char *otrquerymsg,
 	    }
 	}
     }
-
-    if ((policy & OTRL_POLICY_ALLOW_V3) && (query_versions & (1<<2))) {
-	return 3;
-    }
-    if ((policy & OTRL_POLICY_ALLOW_V2) && (query_versions & (1<<1))) {
-	return 2;
-    }
-    if ((policy & OTRL_POLICY_ALLOW_V1) && (query_versions & (1<<0))) {
-	return 1;
-    }
-    return 0;
+    return query_versions;
 }
 
-/* Locate any whitespace tag in this message, and return the best
- * version of OTR support on both sides.  Set *starttagp and *endtagp to
- * the start and end of the located tag, so that it can be snipped out. */
-unsigned int otrl_proto_whitespace_bestversion(const char *msg,
-	const char **starttagp, const char **endtagp, OtrlPolicy policy)
+/* Return the set of versions offered by the whitespace tag at
+ * starttag, and set *endtagp to the end of the tag. */
+static unsigned int whitespace_versions_at(const char *starttag,
+	const char **endtagp)
 {
-    const char *starttag, *endtag;
+    const char *endtag = starttag + strlen(OTRL_MESSAGE_TAG_BASE);
     unsigned int query_versions = 0;
 
-    *starttagp = NULL;
-    *endtagp = NULL;
-
-    starttag = strstr(msg, OTRL_MESSAGE_TAG_BASE);
-    if (!starttag) return 0;
-
-    endtag = starttag + strlen(OTRL_MESSAGE_TAG_BASE);
-
     /* Look for groups of 8 spaces and/or tabs */
     while(1) {
 	int i;
@@ -372,36 +524,51 @@ unsigned int otrl_proto_whitespace_bestversion(const char *msg,
 	}
     }
 
-    *starttagp = starttag;
     *endtagp = endtag;
-
-    if ((policy & OTRL_POLICY_ALLOW_V3) && (query_versions & (1<<2))) {
-	return 3;
-    }
-    if ((policy & OTRL_POLICY_ALLOW_V2) && (query_versions & (1<<1))) {
-	return 2;
-    }
-    if ((policy & OTRL_POLICY_ALLOW_V1) && (query_versions & (1<<0))) {
-	return 1;
-    }
-    return 0;
+    return query_versions;
 }
 
-/* Find the message type. */
-OtrlMessageType otrl_proto_message_type(const char *message)
+/* Return the best version of OTR support by both sides, given an OTR
+ * Query Message and the local policy. */
+unsigned int otrl_proto_query_bestversion(const char *otrquerymsg,
+	OtrlPolicy policy)
 {
     char *otrtag;
 
-    otrtag = strstr(message, "?OTR");
-
+    otrtag = strstr(otrquerymsg, "?OTR");
     if (!otrtag) {
-	if (strstr(message, OTRL_MESSAGE_TAG_BASE)) {
-	    return OTRL_MSGTYPE_TAGGEDPLAINTEXT;
-	} else {
-	    return OTRL_MSGTYPE_NOTOTR;
-	}
+	return 0;
     }
 
+    return otrl_proto_bestversion(query_versions_at(otrtag), policy);
+}
+
+/* Locate any whitespace tag in this message, and return the best
+ * version of OTR support on both sides.  Set *starttagp and *endtagp to
+ * the start and end of the located tag, so that it can be snipped out. */
+unsigned int otrl_proto_whitespace_bestversion(const char *msg,
+	const char **starttagp, const char **endtagp, OtrlPolicy policy)
+{
+    const char *starttag, *endtag;
+    unsigned int query_versions;
+
+    *starttagp = NULL;
+    *endtagp = NULL;
+
+    starttag = strstr(msg, OTRL_MESSAGE_TAG_BASE);
+    if (!starttag) return 0;
+
+    query_versions = whitespace_versions_at(starttag, &endtag);
+
+    *starttagp = starttag;
+    *endtagp = endtag;
+
+    return otrl_proto_bestversion(query_versions, policy);
+}
+
+/* Find the type of the message whose "?OTR" is at otrtag. */
+static OtrlMessageType message_type_at(const char *otrtag)
+{
     if (!strncmp(otrtag, "?OTR:AAM", 8) || !strncmp(otrtag, "?OTR:AAI", 8)) {
 	switch(*(otrtag + 8)) {
 	    case 'C': return OTRL_MSGTYPE_DH_COMMIT;
@@ -420,6 +587,37 @@ OtrlMessageType otrl_proto_message_type(const char *message)
     return OTRL_MSGTYPE_UNKNOWN;
 }
 
+/* Find the version of the message whose "?OTR" is at otrtag. */
+static int message_version_at(const char *otrtag)
+{
+    if (!strncmp(otrtag, "?OTR:AAM", 8))
+	return 3;
+    if (!strncmp(otrtag, "?OTR:AAI", 8))
+	return 2;
+    if (!strncmp(otrtag, "?OTR:AAE", 8))
+	return 1;
+
+    return 0;
+}
+
+/* Find the message type. */
+OtrlMessageType otrl_proto_message_type(const char *message)
+{
+    char *otrtag;
+
+    otrtag = strstr(message, "?OTR");
+
+    if (!otrtag) {
+	if (strstr(message, OTRL_MESSAGE_TAG_BASE)) {
+	    return OTRL_MSGTYPE_TAGGEDPLAINTEXT;
+	} else {
+	    return OTRL_MSGTYPE_NOTOTR;
+	}
+    }
+
+    return message_type_at(otrtag);
+}
+
 /* Find the message version. */
 int otrl_proto_message_version(const char *message)
 {
@@ -431,14 +629,7 @@ int otrl_proto_message_version(const char *message)
 	return 0;
     }
 
-    if (!strncmp(otrtag, "?OTR:AAM", 8))
-	return 3;
-    if (!strncmp(otrtag, "?OTR:AAI", 8))
-	return 2;
-    if (!strncmp(otrtag, "?OTR:AAE", 8))
-	return 1;
-
-    return 0;
+    return message_version_at(otrtag);
 }
 
 /* Find the instance tags in this message */
@@ -472,70 +663,209 @@ invval:
     return err;
 }
 
-/* Create an OTR Data message.  Pass the plaintext as msg, and an
- * optional chain of TLVs.  A newly-allocated string will be returned in
- * *encmessagep. Put the current extra symmetric key into extrakey
- * (if non-NULL). */
-gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
-	const char *msg, const OtrlTLV *tlvs, unsigned char flags,
-	unsigned char *extrakey)
+/* The most a Data Message can have before its encrypted part: header,
+ * instance tags, flags, keyids, a 1536-bit Y, counter and length */
+#define DATA_PREFIX_MAX_LEN (OTRL_HEADER_LEN + 8 + 1 + 4 + 4 + 4 + 192 + 8 + 4)
+
+/* How much plaintext to encrypt at a time */
+#define DATA_CHUNK_LEN 192
+
+/* Writes the binary form of a Data Message straight into the base64
+ * encoding of it, optionally MACing what's written along the way. */
+typedef struct {
+    char *out;                  /* Where the next base64 block goes */
+    unsigned char pending[3];   /* Bytes not yet base64-encoded */
+    size_t npending;
+    gcry_md_hd_t mac;           /* If non-NULL, MAC everything written */
+} DataWriter;
+
+static void data_write(DataWriter *w, const unsigned char *data, size_t len)
 {
-    size_t justmsglen = strlen(msg);
-    size_t msglen = justmsglen + 1 + otrl_tlv_seriallen(tlvs);
+    size_t whole;
+
+    if (w->mac) gcry_md_write(w->mac, data, len);
+
+    if (w->npending > 0) {
+	while (w->npending < 3 && len > 0) {
+	    w->pending[w->npending++] = *data++;
+	    --len;
+	}
+	if (w->npending < 3) return;
+	w->out += otrl_base64_encode(w->out, w->pending, 3);
+	w->npending = 0;
+    }
+
+    whole = len - len % 3;
+    w->out += otrl_base64_encode(w->out, data, whole);
+    memmove(w->pending, data + whole, len - whole);
+    w->npending = len - whole;
+}
+
+/* Encrypt len bytes of data and write the result, a chunk at a time so
+ * the plaintext never needs to be gathered into one buffer. */
+static gcry_error_t data_write_encrypted(DataWriter *w,
+	gcry_cipher_hd_t enc, const unsigned char *data, size_t len)
+{
+    unsigned char chunk[DATA_CHUNK_LEN];
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    while (len > 0) {
+	size_t n = len < DATA_CHUNK_LEN ? len : DATA_CHUNK_LEN;
+	err = gcry_cipher_encrypt(enc, chunk, n, data, n);
+	if (err) break;
+	data_write(w, chunk, n);
+	data += n;
+	len -= n;
+    }
+    otrl_mem_wipe(chunk, sizeof(chunk));
+    return err;
+}
+
+/* The length of a Data Message in the given context, before base64
+ * encoding, whose encrypted part is msglen bytes long. */
+static size_t data_rawlen(ConnContext *context, size_t msglen)
+{
+    size_t reveallen = 20 * context->context_priv->numsavedkeys;
+    int version = context->protocol_version;
+    size_t pubwirelen = 0;
     size_t buflen;
-    size_t pubkeylen;
-    unsigned char *buf = NULL;
+
+    /* Header, msg flags, send keyid, recv keyid, counter, msg len, msg
+     * len of revealed mac keys, revealed mac keys, MAC */
+    buflen = OTRL_HEADER_LEN + (otrl_version_is(version, 3) ? 8 : 0)
+	+ (otrl_version_is(version, 1) ? 0 : 1) + 4 + 4
+	+ 8 + 4 + msglen + 4 + reveallen + 20;
+    if (!otrl_dh_keypair_pubwire(&(context->context_priv->our_dh_key),
+		&pubwirelen)) {
+	/* Out of memory; count the largest key there could be, and let
+	 * otrl_proto_create_data report it */
+	pubwirelen = 4 + 192;
+    }
+    buflen += pubwirelen;
+
+    return buflen;
+}
+
+/* The length of the buffer (including the terminating NUL) needed for
+ * a Data Message carrying the given plaintext and tlvlen bytes of
+ * serialized TLVs in the given context. */
+static size_t data_len(ConnContext *context, const char *msg, size_t tlvlen)
+{
+    size_t buflen = data_rawlen(context, strlen(msg) + 1 + tlvlen);
+
+    /* "?OTR:", the base64 encoding, "." and the NUL */
+    return 5 + ((buflen + 2) / 3) * 4 + 1 + 1;
+}
+
+/* The length of the header otrl_proto_fragment_create puts on each
+ * fragment in the given context, with the comma after the piece: k
+ * and n are always written with five digits. */
+static size_t fragment_headerlen(ConnContext *context)
+{
+    /* "?OTR|%08x|%08x,%05hu,%05hu," and "," */
+    return otrl_version_is(context->auth.protocol_version, 3) ? 36 : 18;
+}
+
+/* The smallest size padded plaintext is rounded up to */
+#define PAD_MIN_BUCKET 64
+
+/* How many bytes of padding TLV (header included) to add to a Data
+ * Message carrying the given plaintext and tlvlen bytes of TLVs, so
+ * that its encrypted part is a power of two long.  If mms is
+ * non-zero, the padding stops short of whatever would make
+ * fragment_and_send split the message into more fragments than it
+ * would have anyway. */
+static size_t data_padlen(ConnContext *context, const char *msg,
+	size_t tlvlen, int mms)
+{
+    size_t plainlen = strlen(msg) + 1 + tlvlen;
+    size_t target;
+    size_t headerlen = fragment_headerlen(context);
+
+    for (target = PAD_MIN_BUCKET; target < plainlen + 4; target *= 2);
+
+    if (mms > 0 && (size_t)mms > headerlen) {
+	/* The length of the message as sent, without its NUL, and the
+	 * most it can grow to in the same number of fragments */
+	size_t sentlen = data_len(context, msg, tlvlen) - 1;
+	size_t limit = (size_t)mms;
+	size_t maxraw, fixed = data_rawlen(context, 0);
+
+	if (sentlen > limit) {
+	    size_t fraglen = mms - headerlen;
+	    limit = ((sentlen - 1) / fraglen + 1) * fraglen;
+	}
+	/* "?OTR:", the base64 encoding and "." */
+	maxraw = limit < 6 ? 0 : ((limit - 6) / 4) * 3;
+	if (maxraw < fixed + plainlen + 4) return 0;
+	if (target > maxraw - fixed) target = maxraw - fixed;
+    }
+
+    if (target < plainlen + 4) return 0;
+    if (target - plainlen - 4 > 0xffff) return 4 + 0xffff;
+    return target - plainlen;
+}
+
+/* A source of padding to encrypt */
+static const unsigned char data_zeros[256];
+
+/* Return the length of the buffer (including the terminating NUL) that
+ * otrl_proto_create_data_buf needs for a Data Message carrying the
+ * given plaintext and TLVs in the given context. */
+size_t otrl_proto_create_data_len(ConnContext *context, const char *msg,
+	const OtrlTLV *tlvs)
+{
+    return data_len(context, msg, otrl_tlv_seriallen(tlvs));
+}
+
+/* Do the work of create_data_buf, below. */
+static gcry_error_t encrypt_data_buf(char *encmessage, size_t encmessagelen,
+	ConnContext *context, const char *msg, const OtrlTLV *tlvs,
+	const unsigned char *tlvdata, size_t tlvdatalen, size_t padlen,
+	size_t tlvlen, unsigned char flags, unsigned char *extrakey)
+{
+    size_t justmsglen = strlen(msg);
+    size_t msglen = justmsglen + 1 + tlvlen;
+    const unsigned char *pubwire;
+    size_t pubwirelen;
+    unsigned char prefix[DATA_PREFIX_MAX_LEN];
+    unsigned char tlvhead[4];
     unsigned char *bufp;
     size_t lenp;
-    DH_sesskeys *sess = &(context->context_priv->sesskeys[1][0]);
+    const OtrlTLV *tlv;
+    DH_sesskeys *sess;
+    DataWriter w;
     gcry_error_t err;
     size_t reveallen = 20 * context->context_priv->numsavedkeys;
-    char *base64buf = NULL;
-    unsigned char *msgbuf = NULL;
-    enum gcry_mpi_format format = GCRYMPI_FMT_USG;
-    char *msgdup;
     int version = context->protocol_version;
 
-    *encmessagep = NULL;
-
     /* Make sure we're actually supposed to be able to encrypt */
     if (context->msgstate != OTRL_MSGSTATE_ENCRYPTED ||
 	    context->context_priv->their_keyid == 0) {
 	return gcry_error(GPG_ERR_CONFLICT);
     }
 
-    /* We need to copy the incoming msg, since it might be an alias for
-     * context->lastmessage, which we'll be freeing soon. */
-    msgdup = gcry_malloc_secure(justmsglen + 1);
-    if (msgdup == NULL) {
-	return gcry_error(GPG_ERR_ENOMEM);
+    if (encmessagelen < data_len(context, msg, tlvlen)) {
+	return gcry_error(GPG_ERR_BUFFER_TOO_SHORT);
     }
-    strcpy(msgdup, msg);
-
-    /* Header, msg flags, send keyid, recv keyid, counter, msg len, msg
-     * len of revealed mac keys, revealed mac keys, MAC */
-    buflen = OTRL_HEADER_LEN + (version == 3 ? 8 : 0)
-	+ (version == 2 || version == 3 ? 1 : 0) + 4 + 4
-	+ 8 + 4 + msglen + 4 + reveallen + 20;
-    gcry_mpi_print(format, NULL, 0, &pubkeylen,
-	    context->context_priv->our_dh_key.pub);
-    buflen += pubkeylen + 4;
-    buf = malloc(buflen);
-    msgbuf = gcry_malloc_secure(msglen);
-    if (buf == NULL || msgbuf == NULL) {
-	free(buf);
-	gcry_free(msgbuf);
-	gcry_free(msgdup);
+    pubwire = otrl_dh_keypair_pubwire(&(context->context_priv->our_dh_key),
+	    &pubwirelen);
+    if (pubwire == NULL) {
 	return gcry_error(GPG_ERR_ENOMEM);
     }
-    memmove(msgbuf, msgdup, justmsglen);
-    msgbuf[justmsglen] = '\0';
-    otrl_tlv_serialize(msgbuf + justmsglen + 1, tlvs);
-    bufp = buf;
-    lenp = buflen;
-    if (version == 1) {
+    if (pubwirelen > 4 + 192) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    /* We always send with our old key and their newest one */
+    err = get_sesskeys(context, 1, 0, &sess);
+    if (err) return err;
+
+    bufp = prefix;
+    lenp = sizeof(prefix);
+    if (otrl_version_is(version, 1)) {
 	memmove(bufp, "\x00\x01\x03", 3);  /* header */
-    } else if (version == 2) {
+    } else if (otrl_version_is(version, 2)) {
 	memmove(bufp, "\x00\x02\x03", 3);  /* header */
     } else {
 	memmove(bufp, "\x00\x03\x03", 3);  /* header */
@@ -544,7 +874,7 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     debug_data("Header", bufp, 3);
     bufp += 3; lenp -= 3;
 
-    if (version == 3) {
+    if (otrl_version_is(version, 3)) {
 	/* v3 instance tags */
 	write_int(context->our_instance);
 	debug_int("Sender instag", bufp-4);
@@ -552,7 +882,7 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
 	debug_int("Recipient instag", bufp-4);
     }
 
-    if (version == 2 || version == 3) {
+    if (!otrl_version_is(version, 1)) {
 	bufp[0] = flags;
 	bufp += 1; lenp -= 1;
     }
@@ -562,7 +892,9 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     write_int(context->context_priv->their_keyid); /* recipient keyid */
     debug_int("Recipient keyid", bufp-4);
 
-    write_mpi(context->context_priv->our_dh_key.pub, pubkeylen, "Y");  /* Y */
+    memmove(bufp, pubwire, pubwirelen);                 /* Y */
+    debug_data("Y", bufp + 4, pubwirelen - 4);
+    bufp += pubwirelen; lenp -= pubwirelen;
 
     otrl_dh_incctr(sess->sendctr);
     memmove(bufp, sess->sendctr, 8);      /* Counter (top 8 bytes only) */
@@ -572,57 +904,79 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     write_int(msglen);                        /* length of encrypted data */
     debug_int("Msg len", bufp-4);
 
+    memmove(encmessage, "?OTR:", 5);
+    w.out = encmessage + 5;
+    w.npending = 0;
+    w.mac = sess->sendmac;
+    gcry_md_reset(sess->sendmac);
+    data_write(&w, prefix, bufp - prefix);
+
+    /* The encrypted data: the message, a NUL, and the TLVs */
     err = gcry_cipher_reset(sess->sendenc);
-    if (err) goto err;
+    if (err) return err;
     err = gcry_cipher_setctr(sess->sendenc, sess->sendctr, 16);
-    if (err) goto err;
-    err = gcry_cipher_encrypt(sess->sendenc, bufp, msglen, msgbuf, msglen);
-    if (err) goto err;                              /* encrypted data */
-    debug_data("Enc data", bufp, msglen);
-    bufp += msglen;
-    lenp -= msglen;
+    if (err) return err;
+    err = data_write_encrypted(&w, sess->sendenc,
+	    (const unsigned char *)msg, justmsglen + 1);
+    if (err) return err;
+    for (tlv = tlvs; tlv; tlv = tlv->next) {
+	tlvhead[0] = (tlv->type >> 8) & 0xff;
+	tlvhead[1] = tlv->type & 0xff;
+	tlvhead[2] = (tlv->len >> 8) & 0xff;
+	tlvhead[3] = tlv->len & 0xff;
+	err = data_write_encrypted(&w, sess->sendenc, tlvhead, 4);
+	if (err) return err;
+	err = data_write_encrypted(&w, sess->sendenc, tlv->data, tlv->len);
+	if (err) return err;
+    }
+    if (tlvdatalen > 0) {
+	err = data_write_encrypted(&w, sess->sendenc, tlvdata, tlvdatalen);
+	if (err) return err;
+    }
+    if (padlen > 0) {
+	tlvhead[0] = (OTRL_TLV_PADDING >> 8) & 0xff;
+	tlvhead[1] = OTRL_TLV_PADDING & 0xff;
+	tlvhead[2] = ((padlen - 4) >> 8) & 0xff;
+	tlvhead[3] = (padlen - 4) & 0xff;
+	err = data_write_encrypted(&w, sess->sendenc, tlvhead, 4);
+	if (err) return err;
+	for (padlen -= 4; padlen > 0; ) {
+	    size_t n = padlen < sizeof(data_zeros) ?
+		padlen : sizeof(data_zeros);
+	    err = data_write_encrypted(&w, sess->sendenc, data_zeros, n);
+	    if (err) return err;
+	    padlen -= n;
+	}
+    }
 
-    gcry_md_reset(sess->sendmac);
-    gcry_md_write(sess->sendmac, buf, bufp-buf);
-    memmove(bufp, gcry_md_read(sess->sendmac, GCRY_MD_SHA1), 20);
-    debug_data("MAC", bufp, 20);
-    bufp += 20;                                         /* MAC */
-    lenp -= 20;
+    w.mac = NULL;
+    data_write(&w, gcry_md_read(sess->sendmac, GCRY_MD_SHA1), 20);  /* MAC */
 
+    bufp = prefix;
+    lenp = sizeof(prefix);
     write_int(reveallen);                     /* length of revealed MAC keys */
-    debug_int("Revealed MAC length", bufp-4);
+    data_write(&w, prefix, 4);
 
     if (reveallen > 0) {
-	memmove(bufp, context->context_priv->saved_mac_keys, reveallen);
-	debug_data("Revealed MAC data", bufp, reveallen);
-	bufp += reveallen; lenp -= reveallen;
-	free(context->context_priv->saved_mac_keys);
-	context->context_priv->saved_mac_keys = NULL;
+	data_write(&w, context->context_priv->saved_mac_keys, reveallen);
+	otrl_mem_wipe(context->context_priv->saved_mac_keys, reveallen);
 	context->context_priv->numsavedkeys = 0;
     }
 
-    assert(lenp == 0);
-
-    /* Make the base64-encoding. */
-    base64buf = otrl_base64_otr_encode(buf, buflen);
-    if (base64buf == NULL) {
-	err = gcry_error(GPG_ERR_ENOMEM);
-	goto err;
+    if (w.npending > 0) {
+	w.out += otrl_base64_encode(w.out, w.pending, w.npending);
     }
+    w.out[0] = '.';
+    w.out[1] = '\0';
 
-    free(buf);
-    gcry_free(msgbuf);
-    *encmessagep = base64buf;
-    gcry_free(context->context_priv->lastmessage);
-    context->context_priv->lastmessage = NULL;
-    context->context_priv->may_retransmit = 0;
-    if (msglen > 0) {
-	context->context_priv->lastmessage = gcry_malloc_secure(justmsglen + 1);
-	if (context->context_priv->lastmessage) {
-	    strcpy(context->context_priv->lastmessage, msgdup);
-	}
+    /* Keep a copy of the plaintext in case it needs to be retransmitted.
+     * msg may itself be the previous copy, in which case keep that. */
+    if (msg != context->context_priv->lastmessage) {
+	otrl_context_keep_lastmessage(context, msg, justmsglen);
     }
-    gcry_free(msgdup);
+    context->context_priv->may_retransmit = 0;
+    otrl_stats_us_add(context->context_priv->userstate, bytes_encrypted,
+	    msglen);
 
     /* Save a copy of the current extra key */
     if (extrakey) {
@@ -630,28 +984,140 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     }
 
     return gcry_error(GPG_ERR_NO_ERROR);
-err:
-    free(buf);
-    gcry_free(msgbuf);
-    gcry_free(msgdup);
-    *encmessagep = NULL;
+}
+
+/* Create an OTR Data message in encmessage, which is encmessagelen
+ * bytes long.  The TLVs are the chain tlvs followed by the tlvdatalen
+ * bytes of already serialized ones at tlvdata, and then, if padlen is
+ * non-zero, a padding TLV padlen bytes long; tlvlen is the serialized
+ * length of them all. */
+static gcry_error_t create_data_buf(char *encmessage, size_t encmessagelen,
+	ConnContext *context, const char *msg, const OtrlTLV *tlvs,
+	const unsigned char *tlvdata, size_t tlvdatalen, size_t padlen,
+	size_t tlvlen, unsigned char flags, unsigned char *extrakey)
+{
+    OtrlUserState us = context->context_priv->userstate;
+    unsigned long long tracestart = otrl_trace_begin(us);
+    gcry_error_t err;
+
+    err = encrypt_data_buf(encmessage, encmessagelen, context, msg, tlvs,
+	    tlvdata, tlvdatalen, padlen, tlvlen, flags, extrakey);
+    otrl_trace_end(us, tracestart, OTRL_TRACE_CREATE_DATA, context,
+	    strlen(msg) + 1 + tlvlen, err ? 0 : strlen(encmessage));
     return err;
 }
 
-/* Extract the flags from an otherwise unreadable Data Message. */
-gcry_error_t otrl_proto_data_read_flags(const char *datamsg,
-	unsigned char *flagsp)
+/* Create an OTR Data message in the caller's buffer encmessage, which
+ * is encmessagelen bytes long; otrl_proto_create_data_len says how long
+ * it needs to be.  Pass the plaintext as msg, and an optional chain of
+ * TLVs.  Put the current extra symmetric key into extrakey (if
+ * non-NULL). */
+gcry_error_t otrl_proto_create_data_buf(char *encmessage,
+	size_t encmessagelen, ConnContext *context, const char *msg,
+	const OtrlTLV *tlvs, unsigned char flags, unsigned char *extrakey)
 {
-    char *otrtag, *endtag;
-    unsigned char *rawmsg = NULL;
-    unsigned char *bufp;
-    size_t msglen, rawlen, lenp;
-    unsigned char version;
+    return create_data_buf(encmessage, encmessagelen, context, msg, tlvs,
+	    NULL, 0, 0, otrl_tlv_seriallen(tlvs), flags, extrakey);
+}
+
+/* Create an OTR Data message in a newly-allocated string in
+ * *encmessagep, with the TLVs as for create_data_buf.  If pad is set,
+ * pad it as data_padlen says for the max message size mms. */
+static gcry_error_t create_data(char **encmessagep, ConnContext *context,
+	const char *msg, const OtrlTLV *tlvs, const unsigned char *tlvdata,
+	size_t tlvdatalen, int pad, int mms, unsigned char flags,
+	unsigned char *extrakey)
+{
+    size_t tlvlen = otrl_tlv_seriallen(tlvs) + tlvdatalen;
+    size_t padlen = 0;
+    size_t encmessagelen;
+    char *encmessage;
+    gcry_error_t err;
+
+    *encmessagep = NULL;
+
+    /* Make sure we're actually supposed to be able to encrypt */
+    if (context->msgstate != OTRL_MSGSTATE_ENCRYPTED ||
+	    context->context_priv->their_keyid == 0) {
+	return gcry_error(GPG_ERR_CONFLICT);
+    }
+
+    if (pad) {
+	padlen = data_padlen(context, msg, tlvlen, mms);
+	tlvlen += padlen;
+    }
+    encmessagelen = data_len(context, msg, tlvlen);
+    encmessage = malloc(encmessagelen);
+    if (encmessage == NULL) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    err = create_data_buf(encmessage, encmessagelen, context, msg, tlvs,
+	    tlvdata, tlvdatalen, padlen, tlvlen, flags, extrakey);
+    if (err) {
+	free(encmessage);
+	return err;
+    }
+
+    *encmessagep = encmessage;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Create an OTR Data message.  Pass the plaintext as msg, and an
+ * optional chain of TLVs.  A newly-allocated string will be returned in
+ * *encmessagep. Put the current extra symmetric key into extrakey
+ * (if non-NULL). */
+gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
+	const char *msg, const OtrlTLV *tlvs, unsigned char flags,
+	unsigned char *extrakey)
+{
+    return create_data(encmessagep, context, msg, tlvs, NULL, 0, 0, 0,
+	    flags, extrakey);
+}
+
+/* Create an OTR Data message, as otrl_proto_create_data does, but add
+ * a padding TLV so that the encrypted part of the message is a power
+ * of two bytes long (at least 64), which hides the exact length of
+ * the plaintext.  If mms is non-zero, the message is padded only as
+ * far as it can be without needing an extra fragment of at most mms
+ * bytes: if it has to be fragmented anyway, its last fragment is
+ * filled up instead. */
+gcry_error_t otrl_proto_create_data_padded(char **encmessagep,
+	ConnContext *context, const char *msg, const OtrlTLV *tlvs,
+	unsigned char flags, unsigned char *extrakey, int mms)
+{
+    return create_data(encmessagep, context, msg, tlvs, NULL, 0, 1, mms,
+	    flags, extrakey);
+}
+
+/* Create an OTR Data message, as otrl_proto_create_data does, but with
+ * the TLVs already serialized in tlvbuf (which may be NULL). */
+gcry_error_t otrl_proto_create_data_tlvbuf(char **encmessagep,
+	ConnContext *context, const char *msg, const OtrlTLVBuf *tlvbuf,
+	unsigned char flags, unsigned char *extrakey)
+{
+    return create_data(encmessagep, context, msg, NULL,
+	    tlvbuf ? tlvbuf->data : NULL, tlvbuf ? tlvbuf->len : 0, 0, 0,
+	    flags, extrakey);
+}
+
+/* Decode the next n bytes of a Data Message from the base64 decoder dec
+ * into head, and point bufp and lenp at them for the read_* macros. */
+#define stream_read(n) do { \
+	if (otrl_base64_decoder_read(&dec, head, (n)) < (n)) goto invval; \
+	bufp = head; lenp = (n); \
+    } while(0)
+
+/* Find the base64 part of an OTR message and set up dec to decode it.
+ * Return 0 on success, or -1 if there isn't one. */
+static int data_decoder_init(OtrlBase64Decoder *dec, const char *datamsg)
+{
+    const char *otrtag, *endtag;
+    size_t msglen;
 
-    if (flagsp) *flagsp = 0;
     otrtag = strstr(datamsg, "?OTR:");
     if (!otrtag) {
-	goto invval;
+	return -1;
     }
     endtag = strchr(otrtag, '.');
     if (endtag) {
@@ -661,169 +1127,299 @@ gcry_error_t otrl_proto_data_read_flags(const char *datamsg,
     }
 
     /* Skip over the "?OTR:" */
-    otrtag += 5;
-    msglen -= 5;
+    otrl_base64_decoder_init(dec, otrtag + 5, msglen - 5);
+    return 0;
+}
 
-    /* Base64-decode the message */
-    rawlen = OTRL_B64_MAX_DECODED_SIZE(msglen);   /* maximum possible */
-    rawmsg = malloc(rawlen);
-    if (!rawmsg && rawlen > 0) {
-	return gcry_error(GPG_ERR_ENOMEM);
+/* Extract the flags from an otherwise unreadable Data Message. */
+gcry_error_t otrl_proto_data_read_flags(const char *datamsg,
+	unsigned char *flagsp)
+{
+    OtrlBase64Decoder dec;
+    unsigned char head[OTRL_HEADER_LEN + 8 + 1];
+    unsigned char *bufp;
+    size_t lenp;
+    unsigned char version;
+
+    if (flagsp) *flagsp = 0;
+
+    /* Only the header needs decoding */
+    if (data_decoder_init(&dec, datamsg)) {
+	goto invval;
     }
-    rawlen = otrl_base64_decode(rawmsg, otrtag, msglen);  /* actual size */
 
-    bufp = rawmsg;
-    lenp = rawlen;
+    stream_read(3);
+    version = bufp[1];
+    if (!otrl_version_built(version)) goto invval;
+    skip_header('\x03');
+
+    if (otrl_version_is(version, 3)) {
+	stream_read(8);
+    }
+
+    if (!otrl_version_is(version, 1)) {
+	stream_read(1);
+	if (flagsp) *flagsp = bufp[0];
+    }
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+invval:
+    return gcry_error(GPG_ERR_INV_VALUE);
+}
+
+/* Get ready to check the MAC of the Data Message datamsg somewhere
+ * other than otrl_proto_accept_data_view_premac, so that several of
+ * them can be checked together.  Decode the message into *rawmsgp (which
+ * the caller must free()), put the length of the part of it the MAC
+ * covers into *macedlenp, and copy the MAC key of the session keys it
+ * claims to use into mackey.  The message is only looked at, not
+ * accepted, so nothing in context changes but that those session keys
+ * may be computed. */
+gcry_error_t otrl_proto_data_mac_prepare(ConnContext *context,
+	const char *datamsg, unsigned char **rawmsgp, size_t *macedlenp,
+	unsigned char mackey[20])
+{
+    unsigned char *rawmsg = NULL;
+    unsigned char *bufp;
+    size_t msglen, lenp, mpilen, datalen;
+    unsigned int sender_keyid, recipient_keyid;
+    unsigned char version;
+    DH_sesskeys *sess;
+    gcry_error_t err;
+
+    *rawmsgp = NULL;
+    *macedlenp = 0;
+
+    if (otrl_base64_otr_decode(datamsg, &rawmsg, &msglen)) {
+	goto invval;
+    }
 
+    bufp = rawmsg;
+    lenp = msglen;
     require_len(3);
     version = bufp[1];
+    if (!otrl_version_built(version)) goto invval;
     skip_header('\x03');
-
-    if (version == 3) {
+    if (otrl_version_is(version, 3)) {
 	require_len(8);
 	bufp += 8; lenp -= 8;
     }
-
-    if (version == 2 || version == 3) {
+    if (!otrl_version_is(version, 1)) {
 	require_len(1);
-	if (flagsp) *flagsp = bufp[0];
 	bufp += 1; lenp -= 1;
     }
+    read_int(sender_keyid);
+    read_int(recipient_keyid);
+    read_int(mpilen);
+    require_len(mpilen);
+    bufp += mpilen; lenp -= mpilen;
+    require_len(8);
+    bufp += 8; lenp -= 8;
+    read_int(datalen);
+    require_len(datalen);
+    bufp += datalen; lenp -= datalen;
+    require_len(20);
+    *macedlenp = bufp - rawmsg;
 
-    free(rawmsg);
+    /* The same checks otrl_proto_accept_data_view makes */
+    if (context->context_priv->their_keyid == 0 ||
+	    (sender_keyid != context->context_priv->their_keyid &&
+		sender_keyid != context->context_priv->their_keyid - 1) ||
+	    (recipient_keyid != context->context_priv->our_keyid &&
+	     recipient_keyid != context->context_priv->our_keyid - 1) ||
+	    sender_keyid == 0 || recipient_keyid == 0) {
+	goto conflict;
+    }
+    if (sender_keyid == context->context_priv->their_keyid - 1 &&
+	    context->context_priv->their_old_y == NULL) {
+	goto conflict;
+    }
+    err = get_sesskeys(context,
+	    context->context_priv->our_keyid - recipient_keyid,
+	    context->context_priv->their_keyid - sender_keyid, &sess);
+    if (err) goto err;
+    memmove(mackey, sess->rcvmackey, 20);
+
+    *rawmsgp = rawmsg;
     return gcry_error(GPG_ERR_NO_ERROR);
 
 invval:
+    err = gcry_error(GPG_ERR_INV_VALUE);
+    goto err;
+conflict:
+    err = gcry_error(GPG_ERR_CONFLICT);
+    goto err;
+err:
     free(rawmsg);
-    return gcry_error(GPG_ERR_INV_VALUE);
+    *macedlenp = 0;
+    return err;
 }
 
-/* Accept an OTR Data Message in datamsg.  Decrypt it and put the
- * plaintext into *plaintextp, and any TLVs into tlvsp.  Put any
- * received flags into *flagsp (if non-NULL).  Put the current extra
- * symmetric key into extrakey (if non-NULL). */
-gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
+/* Do the work of otrl_proto_accept_data_view_premac, below. */
+static gcry_error_t accept_data_view(char **plaintextp,
+	const unsigned char **tlvdatap, size_t *tlvlenp,
 	ConnContext *context, const char *datamsg, unsigned char *flagsp,
-	unsigned char *extrakey)
+	unsigned char *extrakey, const OtrlDataMac *premac)
 {
-    char *otrtag, *endtag;
+    OtrlBase64Decoder dec;
     gcry_error_t err;
-    unsigned char *rawmsg = NULL;
-    size_t msglen, rawlen, lenp;
-    unsigned char *macstart, *macend;
+    gcry_error_t keyerr = gcry_error(GPG_ERR_NO_ERROR);
+    unsigned char head[OTRL_HEADER_LEN + 8 + 1 + 4 + 4];
+    unsigned char chunk[DATA_CHUNK_LEN];
+    unsigned char ystore[192];
+    unsigned char *ybuf = NULL;
+    size_t lenp, headlen, mpilen, done;
     unsigned char *bufp;
     unsigned int sender_keyid, recipient_keyid;
     gcry_mpi_t sender_next_y = NULL;
     unsigned char ctr[8];
+    unsigned char ctrblock[16];
     size_t datalen, reveallen;
     unsigned char *data = NULL;
     unsigned char *nul = NULL;
     unsigned char givenmac[20];
-    DH_sesskeys *sess;
+    DH_sesskeys *sess = NULL;
+    gcry_md_hd_t mac = NULL;
+    const unsigned char *ourmac = NULL;
     unsigned char version;
 
     *plaintextp = NULL;
-    *tlvsp = NULL;
+    *tlvdatap = NULL;
+    *tlvlenp = 0;
     if (flagsp) *flagsp = 0;
-    otrtag = strstr(datamsg, "?OTR:");
-    if (!otrtag) {
-	goto invval;
-    }
-    endtag = strchr(otrtag, '.');
-    if (endtag) {
-	msglen = endtag-otrtag;
-    } else {
-	msglen = strlen(otrtag);
-    }
-
-    /* Skip over the "?OTR:" */
-    otrtag += 5;
-    msglen -= 5;
 
-    /* Base64-decode the message */
-    rawlen = OTRL_B64_MAX_DECODED_SIZE(msglen);   /* maximum possible */
-    rawmsg = malloc(rawlen);
-    if (!rawmsg && rawlen > 0) {
-	err = gcry_error(GPG_ERR_ENOMEM);
-	goto err;
+    /* The message is base64-decoded and MACed a piece at a time,
+     * straight into the buffer that will hold the plaintext, and
+     * decrypted there once it's been verified. */
+    if (data_decoder_init(&dec, datamsg)) {
+	goto invval;
     }
-    rawlen = otrl_base64_decode(rawmsg, otrtag, msglen);  /* actual size */
 
-    bufp = rawmsg;
-    lenp = rawlen;
-
-    macstart = bufp;
-    require_len(3);
+    stream_read(3);
     version = bufp[1];
-
+    if (!otrl_version_built(version)) goto invval;
     skip_header('\x03');
+    headlen = 3;
 
-    if (version == 3) {
-	require_len(8);
-	bufp += 8; lenp -= 8;
+    if (otrl_version_is(version, 3)) {
+	if (otrl_base64_decoder_read(&dec, head + headlen, 8) < 8) {
+	    goto invval;
+	}
+	headlen += 8;
     }
 
-    if (version == 2 || version == 3) {
-	require_len(1);
-	if (flagsp) *flagsp = bufp[0];
-	bufp += 1; lenp -= 1;
+    if (!otrl_version_is(version, 1)) {
+	if (otrl_base64_decoder_read(&dec, head + headlen, 1) < 1) {
+	    goto invval;
+	}
+	if (flagsp) *flagsp = head[headlen];
+	headlen += 1;
     }
 
+    if (otrl_base64_decoder_read(&dec, head + headlen, 8) < 8) {
+	goto invval;
+    }
+    bufp = head + headlen;
+    lenp = 8;
+    headlen += 8;
     read_int(sender_keyid);
     read_int(recipient_keyid);
-    read_mpi(sender_next_y);
-    require_len(8);
+
+    /* We can't take any action on this message (especially rotating
+     * keys) until we've verified the MAC on this message.  To that end,
+     * we need to know which keys this message is claiming to use.  A
+     * malformed message is reported as such even if its keys are also
+     * wrong, so don't give up on it until it's been fully read. */
+    if (context->context_priv->their_keyid == 0 ||
+	    (sender_keyid != context->context_priv->their_keyid &&
+		sender_keyid != context->context_priv->their_keyid - 1) ||
+	    (recipient_keyid != context->context_priv->our_keyid &&
+	     recipient_keyid != context->context_priv->our_keyid - 1) ||
+	    sender_keyid == 0 || recipient_keyid == 0) {
+	keyerr = gcry_error(GPG_ERR_CONFLICT);
+    } else if (sender_keyid == context->context_priv->their_keyid - 1 &&
+	    context->context_priv->their_old_y == NULL) {
+	keyerr = gcry_error(GPG_ERR_CONFLICT);
+    } else {
+	/* These are the session keys this message is claiming to use. */
+	keyerr = get_sesskeys(context,
+		context->context_priv->our_keyid - recipient_keyid,
+		context->context_priv->their_keyid - sender_keyid, &sess);
+    }
+    if (!keyerr && premac && premac->datamsg == datamsg &&
+	    !otrl_mem_differ(premac->mackey, sess->rcvmackey, 20)) {
+	/* The MAC has already been computed, with these same keys */
+	ourmac = premac->mac;
+    } else if (!keyerr) {
+	mac = sess->rcvmac;
+	gcry_md_reset(mac);
+	gcry_md_write(mac, head, headlen);
+    }
+
+    /* Their next public key.  It's only parsed if they turn out to be
+     * using the key we have for them now, so this one is new. */
+    stream_read(4);
+    if (mac) gcry_md_write(mac, head, 4);
+    read_int(mpilen);
+    if (mpilen > otrl_base64_decoder_remaining(&dec)) goto invval;
+    if (mpilen) {
+	ybuf = mpilen <= sizeof(ystore) ? ystore : malloc(mpilen);
+	if (!ybuf) {
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	    goto err;
+	}
+	if (otrl_base64_decoder_read(&dec, ybuf, mpilen) < mpilen) {
+	    goto invval;
+	}
+	if (mac) gcry_md_write(mac, ybuf, mpilen);
+    }
+
+    /* The counter and the length of the encrypted data */
+    stream_read(12);
+    if (mac) gcry_md_write(mac, head, 12);
     memmove(ctr, bufp, 8);
     bufp += 8; lenp -= 8;
     read_int(datalen);
-    require_len(datalen);
+    if (datalen > otrl_base64_decoder_remaining(&dec)) goto invval;
     data = malloc(datalen+1);
     if (!data) {
 	err = gcry_error(GPG_ERR_ENOMEM);
 	goto err;
     }
-    memmove(data, bufp, datalen);
+
+    /* Decode and MAC the encrypted data; it's only decrypted once the
+     * MAC and counter have checked out. */
+    for (done = 0; done < datalen; ) {
+	size_t n = datalen - done;
+	if (n > DATA_CHUNK_LEN) n = DATA_CHUNK_LEN;
+	if (otrl_base64_decoder_read(&dec, data + done, n) < n) goto invval;
+	if (mac) gcry_md_write(mac, data + done, n);
+	done += n;
+    }
     data[datalen] = '\0';
-    bufp += datalen; lenp -= datalen;
-    macend = bufp;
-    require_len(20);
-    memmove(givenmac, bufp, 20);
-    bufp += 20; lenp -= 20;
+
+    if (otrl_base64_decoder_read(&dec, givenmac, 20) < 20) goto invval;
+    stream_read(4);
     read_int(reveallen);
-    require_len(reveallen);
     /* Just skip over the revealed MAC keys, which we don't need.  They
      * were published for deniability of transcripts. */
-    bufp += reveallen; lenp -= reveallen;
+    while (reveallen > 0) {
+	size_t n = reveallen < DATA_CHUNK_LEN ? reveallen : DATA_CHUNK_LEN;
+	if (otrl_base64_decoder_read(&dec, chunk, n) < n) goto invval;
+	reveallen -= n;
+    }
 
     /* That should be everything */
-    if (lenp != 0) goto invval;
+    if (otrl_base64_decoder_read(&dec, chunk, 1) != 0) goto invval;
 
-    /* We don't take any action on this message (especially rotating
-     * keys) until we've verified the MAC on this message.  To that end,
-     * we need to know which keys this message is claiming to use. */
-    if (context->context_priv->their_keyid == 0 ||
-	    (sender_keyid != context->context_priv->their_keyid &&
-		sender_keyid != context->context_priv->their_keyid - 1) ||
-	    (recipient_keyid != context->context_priv->our_keyid &&
-	     recipient_keyid != context->context_priv->our_keyid - 1) ||
-	    sender_keyid == 0 || recipient_keyid == 0) {
-	goto conflict;
-    }
-
-    if (sender_keyid == context->context_priv->their_keyid - 1 &&
-	    context->context_priv->their_old_y == NULL) {
-	goto conflict;
+    if (keyerr) {
+	err = keyerr;
+	goto err;
     }
 
-    /* These are the session keys this message is claiming to use. */
-    sess = &(context->context_priv->sesskeys
-	    [context->context_priv->our_keyid - recipient_keyid]
-	    [context->context_priv->their_keyid - sender_keyid]);
-
-    gcry_md_reset(sess->rcvmac);
-    gcry_md_write(sess->rcvmac, macstart, macend-macstart);
-    if (otrl_mem_differ(givenmac, gcry_md_read(sess->rcvmac, GCRY_MD_SHA1),
-	    20)) {
+    if (!ourmac) ourmac = gcry_md_read(mac, GCRY_MD_SHA1);
+    if (otrl_mem_differ(givenmac, ourmac, 20)) {
 	/* The MACs didn't match! */
 	goto conflict;
     }
@@ -835,14 +1431,15 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
 	goto conflict;
     }
 
-    /* Decrypt the message */
-    memmove(sess->rcvctr, ctr, 8);
+    /* Decrypt the data in place.  The low half of the counter block
+     * stays as it is. */
+    memmove(ctrblock, ctr, 8);
+    memmove(ctrblock + 8, sess->rcvctr + 8, 8);
     err = gcry_cipher_reset(sess->rcvenc);
+    if (!err) err = gcry_cipher_setctr(sess->rcvenc, ctrblock, 16);
+    if (!err) err = gcry_cipher_decrypt(sess->rcvenc, data, datalen, NULL, 0);
     if (err) goto err;
-    err = gcry_cipher_setctr(sess->rcvenc, sess->rcvctr, 16);
-    if (err) goto err;
-    err = gcry_cipher_decrypt(sess->rcvenc, data, datalen, NULL, 0);
-    if (err) goto err;
+    memmove(sess->rcvctr, ctr, 8);
 
     /* Save a copy of the current extra key */
     if (extrakey) {
@@ -859,11 +1456,18 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
 
     if (sender_keyid == context->context_priv->their_keyid) {
 	/* They've sent us a new public key */
+	if (mpilen) {
+	    gcry_mpi_scan(&sender_next_y, GCRYMPI_FMT_USG, ybuf, mpilen,
+		    NULL);
+	} else {
+	    sender_next_y = gcry_mpi_set_ui(NULL, 0);
+	}
 	err = rotate_y_keys(context, sender_next_y);
 	if (err) goto err;
     }
 
     gcry_mpi_release(sender_next_y);
+    if (ybuf != ystore) free(ybuf);
     *plaintextp = (char *)data;
 
     /* See if there are TLVs */
@@ -871,9 +1475,12 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
     while (nul < data+datalen && *nul) ++nul;
     /* If we stopped before the end, skip the NUL we stopped at */
     if (nul < data+datalen) ++nul;
-    *tlvsp = otrl_tlv_parse(nul, (data+datalen)-nul);
+    *tlvdatap = nul;
+    *tlvlenp = (data+datalen)-nul;
+    otrl_stats_us_add(context->context_priv->userstate, bytes_decrypted,
+	    datalen);
 
-    free(rawmsg);
+    otrl_mem_wipe(chunk, sizeof(chunk));
     return gcry_error(GPG_ERR_NO_ERROR);
 
 invval:
@@ -883,180 +1490,523 @@ conflict:
     err = gcry_error(GPG_ERR_CONFLICT);
     goto err;
 err:
+    if (ybuf != ystore) free(ybuf);
     gcry_mpi_release(sender_next_y);
-    free(data);
-    free(rawmsg);
+    if (data) {
+	otrl_mem_wipe(data, datalen);
+	free(data);
+    }
+    otrl_mem_wipe(chunk, sizeof(chunk));
     return err;
 }
 
-/* Accumulate a potential fragment into the current context. */
-OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
-	ConnContext *context, const char *msg)
+/* Accept an OTR Data Message in datamsg, as otrl_proto_accept_data_view
+ * does, but don't compute its MAC if premac (which may be NULL) already
+ * holds it for datamsg, worked out with the keys the message turns out
+ * to use.  Otherwise the MAC is computed here, as usual. */
+gcry_error_t otrl_proto_accept_data_view_premac(char **plaintextp,
+	const unsigned char **tlvdatap, size_t *tlvlenp,
+	ConnContext *context, const char *datamsg, unsigned char *flagsp,
+	unsigned char *extrakey, const OtrlDataMac *premac)
+{
+    OtrlUserState us = context->context_priv->userstate;
+    unsigned long long tracestart = otrl_trace_begin(us);
+    gcry_error_t err;
+
+    err = accept_data_view(plaintextp, tlvdatap, tlvlenp, context, datamsg,
+	    flagsp, extrakey, premac);
+    otrl_trace_end(us, tracestart, OTRL_TRACE_ACCEPT_DATA, context,
+	    strlen(datamsg), err ? 0 :
+	    (size_t)((*tlvdatap + *tlvlenp) - (unsigned char *)*plaintextp));
+    return err;
+}
+
+/* Accept an OTR Data Message in datamsg, as otrl_proto_accept_data
+ * does, but without parsing the TLVs: point *tlvdatap at the serialized
+ * TLVs inside *plaintextp, and put their length into *tlvlenp.  They
+ * can then be read with otrl_tlv_view_next or otrl_tlv_view_find for
+ * as long as *plaintextp is kept. */
+gcry_error_t otrl_proto_accept_data_view(char **plaintextp,
+	const unsigned char **tlvdatap, size_t *tlvlenp,
+	ConnContext *context, const char *datamsg, unsigned char *flagsp,
+	unsigned char *extrakey)
+{
+    return otrl_proto_accept_data_view_premac(plaintextp, tlvdatap,
+	    tlvlenp, context, datamsg, flagsp, extrakey, NULL);
+}
+
+/* Accept an OTR Data Message in datamsg.  Decrypt it and put the
+ * plaintext into *plaintextp, and any TLVs into tlvsp.  Put any
+ * received flags into *flagsp (if non-NULL).  Put the current extra
+ * symmetric key into extrakey (if non-NULL). */
+gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
+	ConnContext *context, const char *datamsg, unsigned char *flagsp,
+	unsigned char *extrakey)
+{
+    const unsigned char *tlvdata;
+    size_t tlvlen;
+    gcry_error_t err;
+
+    err = otrl_proto_accept_data_view(plaintextp, &tlvdata, &tlvlen,
+	    context, datamsg, flagsp, extrakey);
+    *tlvsp = err ? NULL : otrl_tlv_parse(tlvdata, tlvlen);
+    return err;
+}
+
+/* The most we'll allocate up front for a fragmented message, however
+ * many fragments it claims to have */
+#define FRAGMENT_MAX_RESERVE (1024 * 1024)
+
+/* Has the userstate's fragment timeout passed for the message being
+ * reassembled in context_priv? */
+static int fragment_expired(ConnContextPriv *context_priv, time_t now)
+{
+    OtrlUserState us = context_priv->userstate;
+
+    return context_priv->fragment_n > 0 && us && us->fragment_timeout > 0
+	&& now - context_priv->fragment_time >= (time_t)us->fragment_timeout;
+}
+
+/* Start reassembling a message of n fragments, the first of which to
+ * arrive has fraglen bytes of data.  Room for the whole message is
+ * reserved, guessing that the other fragments are the same size. */
+static gcry_error_t fragment_start(ConnContextPriv *context_priv,
+	unsigned short n, size_t fraglen, time_t now)
+{
+    OtrlUserState us = context_priv->userstate;
+    size_t reserve = FRAGMENT_MAX_RESERVE;
+
+    if (fraglen < reserve / n) {
+	reserve = fraglen * n;
+    }
+    if (us && us->fragment_max_len > 0 && reserve > us->fragment_max_len) {
+	reserve = us->fragment_max_len;
+    }
+
+    context_priv->fragment = malloc(reserve + 1);
+    context_priv->fragment_seen = calloc((n + 7) / 8, 1);
+    if (!context_priv->fragment || !context_priv->fragment_seen) {
+	otrl_context_priv_fragment_clear(context_priv);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    context_priv->fragment_size = reserve + 1;
+    context_priv->fragment_len = 0;
+    context_priv->fragment_n = n;
+    context_priv->fragment_k = 0;
+    context_priv->fragment_inorder = 1;
+    context_priv->fragment_time = now;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Add fragment k, whose data is the fraglen bytes at frag, to the
+ * message being reassembled.  Fragment k must not have arrived
+ * already. */
+static gcry_error_t fragment_add(ConnContextPriv *context_priv,
+	unsigned short k, const char *frag, size_t fraglen)
+{
+    OtrlUserState us = context_priv->userstate;
+    size_t newlen = context_priv->fragment_len + fraglen;
+    unsigned short got = context_priv->fragment_k;
+    OtrlFragmentPiece *piece;
+
+    /* Check for overflow, and against the limit */
+    if (newlen < fraglen || newlen + 1 == 0) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    if (us && us->fragment_max_len > 0 && newlen > us->fragment_max_len) {
+	return gcry_error(GPG_ERR_TOO_LARGE);
+    }
+
+    if (newlen + 1 > context_priv->fragment_size) {
+	/* We guessed too small; grow geometrically from here */
+	size_t newsize = context_priv->fragment_size * 2;
+	char *newfrag;
+	if (newsize < newlen + 1) newsize = newlen + 1;
+	newfrag = realloc(context_priv->fragment, newsize);
+	if (!newfrag) return gcry_error(GPG_ERR_ENOMEM);
+	context_priv->fragment = newfrag;
+	context_priv->fragment_size = newsize;
+    }
+
+    /* The list of pieces grows as they arrive, not all at once as the
+     * other side says how many there will be. */
+    if ((got & (got - 1)) == 0) {
+	size_t newcount = got ? 2 * (size_t)got : 1;
+	OtrlFragmentPiece *newpieces = realloc(context_priv->fragment_pieces,
+		newcount * sizeof(OtrlFragmentPiece));
+	if (!newpieces) return gcry_error(GPG_ERR_ENOMEM);
+	context_priv->fragment_pieces = newpieces;
+    }
+
+    piece = &(context_priv->fragment_pieces[got]);
+    piece->k = k;
+    piece->offset = context_priv->fragment_len;
+    piece->len = fraglen;
+    memmove(context_priv->fragment + context_priv->fragment_len, frag,
+	    fraglen);
+    context_priv->fragment_len = newlen;
+    context_priv->fragment_seen[(k - 1) / 8] |= 1 << ((k - 1) % 8);
+    if (k != got + 1) context_priv->fragment_inorder = 0;
+    context_priv->fragment_k = got + 1;
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Hand back the message whose fragments have all arrived, in a
+ * newly-allocated string, and forget about it.  Return NULL if out of
+ * memory. */
+static char *fragment_finish(ConnContextPriv *context_priv)
 {
-    OtrlFragmentResult res = OTRL_FRAGMENT_INCOMPLETE;
-    const char *tag;
-    unsigned short n = 0, k = 0;
-    int start = 0, end = 0;
-
-    tag = strstr(msg, "?OTR|");
-    if (tag) {
-	sscanf(tag, "?OTR|%*x|%*x,%hu,%hu,%n%*[^,],%n", &k, &n, &start, &end);
-    } else if ((tag = strstr(msg, "?OTR,")) != NULL) {
-	sscanf(tag, "?OTR,%hu,%hu,%n%*[^,],%n", &k, &n, &start, &end);
+    char *msg;
+
+    if (context_priv->fragment_inorder) {
+	/* The usual case: the fragments are already where they go */
+	msg = context_priv->fragment;
+	context_priv->fragment = NULL;
     } else {
-	/* Unfragmented message, so discard any fragment we may have */
-	free(context->context_priv->fragment);
-	context->context_priv->fragment = NULL;
-	context->context_priv->fragment_len = 0;
-	context->context_priv->fragment_n = 0;
-	context->context_priv->fragment_k = 0;
-	res = OTRL_FRAGMENT_UNFRAGMENTED;
-	return res;
-    }
-
-    if (k > 0 && n > 0 && k <= n && start > 0 && end > 0 && start < end) {
-	if (k == 1) {
-	    size_t fraglen = end - start - 1;
-	    size_t newsize = fraglen + 1;
-	    free(context->context_priv->fragment);
-	    context->context_priv->fragment = NULL;
-	    if (newsize >= 1) {  /* Check for overflow */
-		context->context_priv->fragment = malloc(newsize);
+	unsigned short *order = malloc(context_priv->fragment_n *
+		sizeof(unsigned short));
+	msg = malloc(context_priv->fragment_len + 1);
+	if (order && msg) {
+	    unsigned short i;
+	    size_t len = 0;
+	    for (i = 0; i < context_priv->fragment_k; ++i) {
+		order[context_priv->fragment_pieces[i].k - 1] = i;
 	    }
-	    if (context->context_priv->fragment) {
-		memmove(context->context_priv->fragment, tag + start, fraglen);
-		context->context_priv->fragment_len = fraglen;
-		context->context_priv->fragment[
-			context->context_priv->fragment_len] = '\0';
-		context->context_priv->fragment_n = n;
-		context->context_priv->fragment_k = k;
-	    } else {
-		context->context_priv->fragment_len = 0;
-		context->context_priv->fragment_n = 0;
-		context->context_priv->fragment_k = 0;
+	    for (i = 0; i < context_priv->fragment_n; ++i) {
+		OtrlFragmentPiece *piece =
+		    &(context_priv->fragment_pieces[order[i]]);
+		memmove(msg + len, context_priv->fragment + piece->offset,
+			piece->len);
+		len += piece->len;
 	    }
-	} else if (n == context->context_priv->fragment_n &&
-		k == context->context_priv->fragment_k + 1) {
-	    size_t fraglen = end - start - 1;
-	    char *newfrag = NULL;
-	    size_t newsize = context->context_priv->fragment_len + fraglen + 1;
-	    /* Check for overflow */
-	    if (newsize > context->context_priv->fragment_len) {
-		newfrag = realloc(context->context_priv->fragment, newsize);
+	} else {
+	    free(msg);
+	    msg = NULL;
+	}
+	free(order);
+    }
+    if (msg) {
+	msg[context_priv->fragment_len] = '\0';
+    }
+
+    otrl_context_priv_fragment_clear(context_priv);
+    return msg;
+}
+
+/* Read a number in the given base (10 or 16) that fits in max, ending
+ * in the given character, from *sp, and move *sp past the end
+ * character.  Return 0 if there isn't one. */
+static int fragment_parse_num(const char **sp, unsigned int base,
+	unsigned int max, char end, unsigned int *nump)
+{
+    const char *s = *sp;
+    unsigned int num = 0;
+
+    do {
+	unsigned int digit;
+	if (*s >= '0' && *s <= '9') {
+	    digit = *s - '0';
+	} else if (base == 16 && *s >= 'a' && *s <= 'f') {
+	    digit = *s - 'a' + 10;
+	} else if (base == 16 && *s >= 'A' && *s <= 'F') {
+	    digit = *s - 'A' + 10;
+	} else {
+	    return 0;
+	}
+	if (num > (max - digit) / base) return 0;  /* Too big */
+	num = num * base + digit;
+	++s;
+    } while (*s != end);
+
+    *nump = num;
+    *sp = s + 1;
+    return 1;
+}
+
+static void fragment_parse_at(OtrlFragmentHeader *hdr, const char *otrtag);
+
+/* Find the first "?OTR" in msg and, if it starts a fragment, parse the
+ * fragment's header, in one pass over it, into *hdr.  Every field that
+ * couldn't be read is left as 0 (or NULL). */
+void otrl_proto_fragment_parse(OtrlFragmentHeader *hdr, const char *msg)
+{
+    fragment_parse_at(hdr, strstr(msg, "?OTR"));
+}
+
+/* Parse the fragment header, if any, whose "?OTR" is at otrtag (which
+ * may be NULL) into *hdr. */
+static void fragment_parse_at(OtrlFragmentHeader *hdr, const char *otrtag)
+{
+    const char *s;
+    unsigned int k, n;
+
+    memset(hdr, 0, sizeof(*hdr));
+
+    hdr->tag = otrtag;
+    if (!hdr->tag) return;
+
+    /* hdr->tag[4] exists, because at worst it's the terminating NUL */
+    s = hdr->tag + 4;
+    if (*s == '|') {
+	hdr->is_fragment = 1;
+	hdr->has_instances = 1;
+	++s;
+	if (!fragment_parse_num(&s, 16, 0xffffffff, '|',
+		    &hdr->instance_from)) return;
+	if (!fragment_parse_num(&s, 16, 0xffffffff, ',',
+		    &hdr->instance_to)) return;
+    } else if (*s == ',') {
+	hdr->is_fragment = 1;
+	++s;
+    } else {
+	return;
+    }
+
+    if (!fragment_parse_num(&s, 10, 0xffff, ',', &k)) return;
+    if (!fragment_parse_num(&s, 10, 0xffff, ',', &n)) return;
+
+    /* Then the (non-empty) piece of the message, and a ',' */
+    hdr->data = s;
+    while (*s != ',' && *s != '\0') ++s;
+    if (*s != ',' || s == hdr->data) {
+	hdr->data = NULL;
+	return;
+    }
+    hdr->datalen = s - hdr->data;
+    hdr->k = k;
+    hdr->n = n;
+    hdr->valid = (k > 0 && n > 0 && k <= n);
+}
+
+/* Classify message in one pass over it, filling in *info.  The type
+ * and version are those otrl_proto_message_type and
+ * otrl_proto_message_version would find. */
+void otrl_proto_message_classify(OtrlMessageInfo *info, const char *message)
+{
+    const char *p = message;
+    const char *whitespace = NULL;
+
+    memset(info, 0, sizeof(*info));
+
+    /* Look for the first "?OTR", and any whitespace tag before it.
+     * Every whitespace tag has a tab as its second character, so the
+     * whole search is for the first '?' or tab, which the C library
+     * does a word or vector at a time. */
+    while ((p = strpbrk(p, "?\t")) != NULL) {
+	if (*p == '?') {
+	    if (!strncmp(p, "?OTR", 4)) {
+		info->tag = p;
+		break;
 	    }
-	    if (newfrag) {
-		context->context_priv->fragment = newfrag;
-		memmove(context->context_priv->fragment +
-			context->context_priv->fragment_len,
-			tag + start, fraglen);
-		context->context_priv->fragment_len += fraglen;
-		context->context_priv->fragment[
-			context->context_priv->fragment_len] = '\0';
-		context->context_priv->fragment_k = k;
+	} else if (!whitespace && p > message && !strncmp(p - 1,
+		    OTRL_MESSAGE_TAG_BASE, strlen(OTRL_MESSAGE_TAG_BASE))) {
+	    whitespace = p - 1;
+	}
+	++p;
+    }
+
+    fragment_parse_at(&info->fragment, info->tag);
+
+    if (!info->tag) {
+	if (whitespace) {
+	    info->type = OTRL_MSGTYPE_TAGGEDPLAINTEXT;
+	    info->whitespace_start = whitespace;
+	    info->versions = whitespace_versions_at(whitespace,
+		    &info->whitespace_end);
+	} else {
+	    info->type = OTRL_MSGTYPE_NOTOTR;
+	}
+	return;
+    }
+
+    info->type = message_type_at(info->tag);
+    info->version = message_version_at(info->tag);
+
+    if (info->type == OTRL_MSGTYPE_QUERY) {
+	info->versions = query_versions_at(info->tag);
+    }
+
+    if (info->tag[4] == ':') {
+	info->payload = info->tag + 5;
+    }
+
+    /* The instance tags follow the first 4 base64 characters, as in
+     * otrl_proto_instance */
+    if (info->version == 3 && strnlen(info->tag, 21) == 21) {
+	unsigned char buf[OTRL_B64_MAX_DECODED_SIZE(12)];
+	const unsigned char *bufp = buf;
+	size_t lenp = otrl_base64_decode(buf, info->tag + 9, 12);
+	read_int(info->instance_from);
+	read_int(info->instance_to);
+	info->has_instances = 1;
+    }
+invval:
+    return;
+}
+
+/* Accumulate a potential fragment into the current context.  Fragments
+ * may arrive in any order; a repeat of one we already have is ignored,
+ * except that a repeat of the first starts a new message. */
+OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
+	ConnContext *context, const char *msg)
+{
+    OtrlFragmentHeader hdr;
+
+    otrl_proto_fragment_parse(&hdr, msg);
+    return otrl_proto_fragment_accumulate_parsed(unfragmessagep, context,
+	    &hdr);
+}
+
+/* Accumulate a potential fragment, already parsed by
+ * otrl_proto_fragment_parse, into the current context. */
+OtrlFragmentResult otrl_proto_fragment_accumulate_parsed(
+	char **unfragmessagep, ConnContext *context,
+	const OtrlFragmentHeader *hdr)
+{
+    ConnContextPriv *context_priv = context->context_priv;
+
+    if (!hdr->is_fragment) {
+	/* Unfragmented message, so discard any fragment we may have */
+	otrl_context_priv_fragment_drop(context_priv);
+	return OTRL_FRAGMENT_UNFRAGMENTED;
+    }
+
+    if (hdr->valid) {
+	unsigned short k = hdr->k, n = hdr->n;
+	time_t now = time(NULL);
+
+	/* Is this part of a different message from the one we have? */
+	if (context_priv->fragment_n > 0 && (n != context_priv->fragment_n
+		    || (k == 1 && (context_priv->fragment_seen[0] & 1))
+		    || fragment_expired(context_priv, now))) {
+	    otrl_context_priv_fragment_drop(context_priv);
+	}
+
+	if (context_priv->fragment_n == 0 &&
+		fragment_start(context_priv, n, hdr->datalen, now) == 0 &&
+		context_priv->userstate &&
+		context_priv->userstate->fragment_timeout > 0) {
+	    /* Have otrl_message_poll throw it away if the rest takes too
+	     * long */
+	    OtrlUserState us = context_priv->userstate;
+
+	    otrl_userstate_wrlock(us);
+	    otrl_userstate_deadline_add(us, context,
+		    now + us->fragment_timeout);
+	    otrl_userstate_unlock(us);
+	}
+
+	if (context_priv->fragment_n > 0 &&
+		!(context_priv->fragment_seen[(k - 1) / 8] &
+		    (1 << ((k - 1) % 8)))) {
+	    if (fragment_add(context_priv, k, hdr->data, hdr->datalen)) {
+		otrl_context_priv_fragment_drop(context_priv);
 	    } else {
-		free(context->context_priv->fragment);
-		context->context_priv->fragment = NULL;
-		context->context_priv->fragment_len = 0;
-		context->context_priv->fragment_n = 0;
-		context->context_priv->fragment_k = 0;
+		otrl_stats_us_add(context_priv->userstate,
+			fragments_accumulated, 1);
 	    }
-	} else {
-	    free(context->context_priv->fragment);
-	    context->context_priv->fragment = NULL;
-	    context->context_priv->fragment_len = 0;
-	    context->context_priv->fragment_n = 0;
-	    context->context_priv->fragment_k = 0;
 	}
     }
 
-    if (context->context_priv->fragment_n > 0 &&
-	    context->context_priv->fragment_n ==
-	    context->context_priv->fragment_k) {
+    if (context_priv->fragment_n > 0 &&
+	    context_priv->fragment_n == context_priv->fragment_k) {
 	/* We've got a complete message */
-	*unfragmessagep = context->context_priv->fragment;
-	context->context_priv->fragment = NULL;
-	context->context_priv->fragment_len = 0;
-	context->context_priv->fragment_n = 0;
-	context->context_priv->fragment_k = 0;
-	res = OTRL_FRAGMENT_COMPLETE;
+	*unfragmessagep = fragment_finish(context_priv);
+	if (*unfragmessagep) {
+	    return OTRL_FRAGMENT_COMPLETE;
+	}
     }
 
-    return res;
+    return OTRL_FRAGMENT_INCOMPLETE;
 }
 
-/* Create a fragmented message. */
+/* Return how many fragments of at most mms bytes (not counting the
+ * NUL) otrl_proto_fragment_create needs to split message into in the
+ * given context: 1 if it doesn't need splitting (or mms is 0), or 0 if
+ * it can't be split that small. */
+int otrl_proto_fragment_count(int mms, ConnContext *context,
+	const char *message)
+{
+    size_t msglen = strlen(message);
+    size_t headerlen = fragment_headerlen(context);
+    size_t count;
+
+    if (mms == 0 || msglen <= (size_t)mms) return 1;
+    if (mms < 0 || (size_t)mms <= headerlen) return 0;
+
+    count = (msglen - 1) / (mms - headerlen) + 1;
+    return count > 65535 ? 0 : (int)count;
+}
+
+/* Create a fragmented message.  Each fragment is filled to exactly mms
+ * bytes, but for the last; use otrl_proto_fragment_count to find how
+ * many there need to be.  The fragments are all kept in one block
+ * with the array of them, which otrl_proto_fragment_free frees. */
 gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
 	char ***fragments, ConnContext *context, const char *message)
 {
-    char *fragdata;
-    size_t fragdatalen = 0;
-    int curfrag = 0;
-    size_t index = 0;
     size_t msglen = strlen(message);
-    /* Should vary by number of msgs */
-    int headerlen = context->protocol_version == 3 ? 37 : 19;
-
+    size_t headerlen = fragment_headerlen(context);
+    char prefix[24];
+    size_t prefixlen;
+    size_t fragdatalen, datalen, index = 0;
+    char counts[12];
     char **fragmentarray;
+    char *bufp;
+    int curfrag;
 
-    if (fragment_count < 1 || fragment_count > 65535) {
+    if (fragment_count < 1 || fragment_count > 65535 ||
+	    mms <= 0 || (size_t)mms <= headerlen) {
 	return gcry_error(GPG_ERR_INV_VALUE);
     }
+    fragdatalen = mms - headerlen;
 
-    fragmentarray = malloc(fragment_count * sizeof(char*));
-    if(!fragmentarray) return gcry_error(GPG_ERR_ENOMEM);
-
-    /*
-     * Find the next message fragment and store it in the array.
-     */
-    for(curfrag = 1; curfrag <= fragment_count; curfrag++) {
-	int i;
-	char *fragmentmsg;
+    /* As before, a message too long for fragment_count fragments is
+     * cut short */
+    datalen = (size_t)fragment_count * fragdatalen;
+    if (datalen > msglen) datalen = msglen;
 
-	if (msglen - index < (size_t)(mms - headerlen)) {
-	    fragdatalen = msglen - index;
-	} else {
-	    fragdatalen = mms - headerlen;
-	}
+    fragmentarray = malloc(fragment_count * sizeof(char *) + datalen +
+	    fragment_count * (headerlen + 1));
+    if(!fragmentarray) return gcry_error(GPG_ERR_ENOMEM);
+    bufp = (char *)(fragmentarray + fragment_count);
 
-	fragdata = malloc(fragdatalen + 1);
-	if(!fragdata) {
-		for (i=0; i<curfrag-1; free(fragmentarray[i++])) {}
-		free(fragmentarray);
-		return gcry_error(GPG_ERR_ENOMEM);
-	}
-	strncpy(fragdata, message, fragdatalen);
-	fragdata[fragdatalen] = 0;
-
-	fragmentmsg = malloc(fragdatalen+headerlen+1);
-	if(!fragmentmsg) {
-	    for (i=0; i<curfrag-1; free(fragmentarray[i++])) {}
-	    free(fragmentarray);
-	    free(fragdata);
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
+    /* Everything in the header before k is the same for every
+     * fragment */
+    if (!otrl_version_is(context->auth.protocol_version, 3)) {
+	prefixlen = 5;
+	memmove(prefix, "?OTR,", 5);
+    } else {
+	/* V3 messages require instance tags in the header */
+	prefixlen = snprintf(prefix, sizeof(prefix), "?OTR|%08x|%08x,",
+		context->our_instance, context->their_instance);
+    }
+    snprintf(counts, sizeof(counts), ",%05hu,",
+	    (unsigned short)fragment_count);
 
-	/*
-	 * Create the actual fragment and store it in the array
-	 */
-	if (context->auth.protocol_version != 3) {
-	    snprintf(fragmentmsg, fragdatalen + headerlen,
-		    "?OTR,%05hu,%05hu,%s,", (unsigned short)curfrag,
-			    (unsigned short)fragment_count, fragdata);
-	} else {
-	    /* V3 messages require instance tags in the header */
-	    snprintf(fragmentmsg, fragdatalen + headerlen,
-		    "?OTR|%08x|%08x,%05hu,%05hu,%s,",
-		    context->our_instance, context->their_instance,
-		    (unsigned short)curfrag, (unsigned short)fragment_count,
-		    fragdata);
+    for(curfrag = 1; curfrag <= fragment_count; curfrag++) {
+	size_t n = msglen - index < fragdatalen ? msglen - index :
+	    fragdatalen;
+	unsigned short k = curfrag;
+	int d;
+
+	fragmentarray[curfrag-1] = bufp;
+	memmove(bufp, prefix, prefixlen);
+	bufp += prefixlen;
+	for (d = 4; d >= 0; d--) {
+	    bufp[d] = '0' + k % 10;
+	    k /= 10;
 	}
-	fragmentmsg[fragdatalen + headerlen] = 0;
-
-	fragmentarray[curfrag-1] = fragmentmsg;
-
-	free(fragdata);
-	index += fragdatalen;
-	message += fragdatalen;
+	bufp += 5;
+	memmove(bufp, counts, 7);
+	bufp += 7;
+	memmove(bufp, message + index, n);
+	bufp += n;
+	bufp[0] = ',';
+	bufp[1] = '\0';
+	bufp += 2;
+	index += n;
     }
 
     *fragments = fragmentarray;
@@ -1066,16 +2016,8 @@ gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
 /* Free a string array containing fragment messages. */
 void otrl_proto_fragment_free(char ***fragments, unsigned short arraylen)
 {
-    int i;
-    char **fragmentarray = *fragments;
-    if(fragmentarray) {
-	for(i = 0; i < arraylen; i++)
-	{
-	    if(fragmentarray[i]) {
-		free(fragmentarray[i]);
-	    }
-	}
-	free(fragmentarray);
-    }
+    /* The fragments are in the same block as the array */
+    free(*fragments);
+    *fragments = NULL;
 }
 
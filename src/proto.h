@@ -45,6 +45,7 @@ typedef unsigned int OtrlPolicy;
 #define OTRL_POLICY_SEND_WHITESPACE_TAG		0x10
 #define OTRL_POLICY_WHITESPACE_START_AKE	0x20
 #define OTRL_POLICY_ERROR_START_AKE		0x40
+#define OTRL_POLICY_PAD_MESSAGES		0x80
 
 #define OTRL_POLICY_VERSION_MASK (OTRL_POLICY_ALLOW_V1 | OTRL_POLICY_ALLOW_V2 |\
 	OTRL_POLICY_ALLOW_V3)
@@ -92,6 +93,42 @@ typedef enum {
     OTRL_FRAGMENT_COMPLETE
 } OtrlFragmentResult;
 
+/* What otrl_proto_fragment_parse found in a message */
+typedef struct s_OtrlFragmentHeader {
+    const char *tag;            /* The first "?OTR" in the message, or
+				   NULL if there is none */
+    int is_fragment;            /* Is tag followed by '|' or ','? */
+    int has_instances;          /* Is it a v3 ("?OTR|") fragment? */
+    unsigned int instance_from; /* The sender's instance tag, or 0 if it
+				   couldn't be read */
+    unsigned int instance_to;   /* The recipient's instance tag, or 0 if
+				   it couldn't be read */
+    int valid;                  /* Was the whole header well-formed? */
+    unsigned short k;           /* This fragment's number */
+    unsigned short n;           /* The total number of fragments */
+    const char *data;           /* This fragment's piece of the message */
+    size_t datalen;             /* The length of data */
+} OtrlFragmentHeader;
+
+/* What otrl_proto_message_classify found in a message */
+typedef struct s_OtrlMessageInfo {
+    OtrlMessageType type;       /* As otrl_proto_message_type finds */
+    int version;                /* As otrl_proto_message_version finds */
+    const char *tag;            /* The first "?OTR", or NULL */
+    const char *payload;        /* For "?OTR:" messages, the base64 data
+				   after the ':', else NULL */
+    int has_instances;          /* Were instance tags read from a v3
+				   message? */
+    unsigned int instance_from; /* The sender's instance tag */
+    unsigned int instance_to;   /* The recipient's instance tag */
+    unsigned int versions;      /* For Query Messages and tagged
+				   plaintext, the versions offered (bit
+				   v-1 for version v) */
+    const char *whitespace_start;  /* For tagged plaintext, the start */
+    const char *whitespace_end;    /* and end of the whitespace tag */
+    OtrlFragmentHeader fragment;   /* The fragment header, if any */
+} OtrlMessageInfo;
+
 typedef enum {
     OTRL_FRAGMENT_SEND_SKIP, /* Return new message back to caller,
 			      * but don't inject. */
@@ -100,6 +137,14 @@ typedef enum {
     OTRL_FRAGMENT_SEND_ALL_BUT_LAST
 } OtrlFragmentPolicy;
 
+/* The MAC of a Data Message, worked out ahead of accepting it; see
+ * otrl_proto_data_mac_prepare */
+typedef struct s_OtrlDataMac {
+    const char *datamsg;         /* The message the MAC is of */
+    unsigned char mackey[20];    /* The key it was computed with */
+    unsigned char mac[20];       /* The MAC itself */
+} OtrlDataMac;
+
 /* Initialize the OTR library.  Pass the version of the API you are
  * using. */
 gcry_error_t otrl_init(unsigned int ver_major, unsigned int ver_minor,
@@ -122,11 +167,32 @@ const char *otrl_version(void);
  * with it. */
 char *otrl_proto_default_query_msg(const char *ourname, OtrlPolicy policy);
 
+/* Return a pointer to a newly-allocated OTR query message for the
+ * given entry of the userstate's account table, as
+ * otrl_proto_default_query_msg makes it.  The message is kept in the
+ * entry, so after the first time for a policy this is a single copy.
+ * The caller must not hold the userstate's lock. */
+char *otrl_proto_account_query_msg(OtrlUserState us, OtrlAccount *account,
+	OtrlPolicy policy);
+
+/* Return a pointer to a newly-allocated copy of msg with the whitespace
+ * tag for the given policy on the end.  The tag is kept in the given
+ * entry of the userstate's account table.  The caller must not hold
+ * the userstate's lock. */
+char *otrl_proto_account_tag_msg(OtrlUserState us, OtrlAccount *account,
+	OtrlPolicy policy, const char *msg);
+
 /* Return the best version of OTR support by both sides, given an OTR
  * Query Message and the local policy. */
 unsigned int otrl_proto_query_bestversion(const char *querymsg,
 	OtrlPolicy policy);
 
+/* Return the best version of OTR support by both sides, given the set
+ * of versions the other side offered (bit v-1 for version v) and the
+ * local policy. */
+unsigned int otrl_proto_bestversion(unsigned int query_versions,
+	OtrlPolicy policy);
+
 /* Locate any whitespace tag in this message, and return the best
  * version of OTR support on both sides.  Set *starttagp and *endtagp to
  * the start and end of the located tag, so that it can be snipped out. */
@@ -151,6 +217,38 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
 	const char *msg, const OtrlTLV *tlvs, unsigned char flags,
 	unsigned char *extrakey);
 
+/* Create an OTR Data message, as otrl_proto_create_data does, but add
+ * a padding TLV so that the encrypted part of the message is a power
+ * of two bytes long (at least 64), which hides the exact length of
+ * the plaintext.  If mms is non-zero, the message is padded only as
+ * far as it can be without needing an extra fragment of at most mms
+ * bytes: if it has to be fragmented anyway, its last fragment is
+ * filled up instead. */
+gcry_error_t otrl_proto_create_data_padded(char **encmessagep,
+	ConnContext *context, const char *msg, const OtrlTLV *tlvs,
+	unsigned char flags, unsigned char *extrakey, int mms);
+
+/* Create an OTR Data message, as otrl_proto_create_data does, but with
+ * the TLVs already serialized in tlvbuf (which may be NULL). */
+gcry_error_t otrl_proto_create_data_tlvbuf(char **encmessagep,
+	ConnContext *context, const char *msg, const OtrlTLVBuf *tlvbuf,
+	unsigned char flags, unsigned char *extrakey);
+
+/* Return the length of the buffer (including the terminating NUL) that
+ * otrl_proto_create_data_buf needs for a Data Message carrying the
+ * given plaintext and TLVs in the given context. */
+size_t otrl_proto_create_data_len(ConnContext *context, const char *msg,
+	const OtrlTLV *tlvs);
+
+/* Create an OTR Data message in the caller's buffer encmessage, which
+ * is encmessagelen bytes long; otrl_proto_create_data_len says how long
+ * it needs to be.  Pass the plaintext as msg, and an optional chain of
+ * TLVs.  Put the current extra symmetric key into extrakey (if
+ * non-NULL). */
+gcry_error_t otrl_proto_create_data_buf(char *encmessage,
+	size_t encmessagelen, ConnContext *context, const char *msg,
+	const OtrlTLV *tlvs, unsigned char flags, unsigned char *extrakey);
+
 /* Extract the flags from an otherwise unreadable Data Message. */
 gcry_error_t otrl_proto_data_read_flags(const char *datamsg,
 	unsigned char *flagsp);
@@ -163,12 +261,71 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
 	ConnContext *context, const char *datamsg, unsigned char *flagsp,
 	unsigned char *extrakey);
 
+/* Accept an OTR Data Message in datamsg, as otrl_proto_accept_data
+ * does, but without parsing the TLVs: point *tlvdatap at the serialized
+ * TLVs inside *plaintextp, and put their length into *tlvlenp.  They
+ * can then be read with otrl_tlv_view_next or otrl_tlv_view_find for
+ * as long as *plaintextp is kept. */
+gcry_error_t otrl_proto_accept_data_view(char **plaintextp,
+	const unsigned char **tlvdatap, size_t *tlvlenp,
+	ConnContext *context, const char *datamsg, unsigned char *flagsp,
+	unsigned char *extrakey);
+
+/* Accept an OTR Data Message in datamsg, as otrl_proto_accept_data_view
+ * does, but don't compute its MAC if premac (which may be NULL) already
+ * holds it for datamsg, worked out with the keys the message turns out
+ * to use.  Otherwise the MAC is computed here, as usual. */
+gcry_error_t otrl_proto_accept_data_view_premac(char **plaintextp,
+	const unsigned char **tlvdatap, size_t *tlvlenp,
+	ConnContext *context, const char *datamsg, unsigned char *flagsp,
+	unsigned char *extrakey, const OtrlDataMac *premac);
+
+/* Get ready to check the MAC of the Data Message datamsg somewhere
+ * other than otrl_proto_accept_data_view_premac, so that several of
+ * them can be checked together.  Decode the message into *rawmsgp (which
+ * the caller must free()), put the length of the part of it the MAC
+ * covers into *macedlenp, and copy the MAC key of the session keys it
+ * claims to use into mackey.  The message is only looked at, not
+ * accepted, so nothing in context changes but that those session keys
+ * may be computed. */
+gcry_error_t otrl_proto_data_mac_prepare(ConnContext *context,
+	const char *datamsg, unsigned char **rawmsgp, size_t *macedlenp,
+	unsigned char mackey[20]);
+
+/* Find the first "?OTR" in msg and, if it starts a fragment, parse the
+ * fragment's header, in one pass over it, into *hdr.  Every field that
+ * couldn't be read is left as 0 (or NULL). */
+void otrl_proto_fragment_parse(OtrlFragmentHeader *hdr, const char *msg);
+
+/* Classify message in one pass over it, filling in *info.  The type
+ * and version are those otrl_proto_message_type and
+ * otrl_proto_message_version would find. */
+void otrl_proto_message_classify(OtrlMessageInfo *info, const char *message);
+
 /* Accumulate a potential fragment into the current context. */
 OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
 	ConnContext *context, const char *msg);
 
+/* Accumulate a potential fragment, already parsed by
+ * otrl_proto_fragment_parse, into the current context. */
+OtrlFragmentResult otrl_proto_fragment_accumulate_parsed(
+	char **unfragmessagep, ConnContext *context,
+	const OtrlFragmentHeader *hdr);
+
+/* Return how many fragments of at most mms bytes (not counting the
+ * NUL) otrl_proto_fragment_create needs to split message into in the
+ * given context: 1 if it doesn't need splitting (or mms is 0), or 0 if
+ * it can't be split that small. */
+int otrl_proto_fragment_count(int mms, ConnContext *context,
+	const char *message);
+
+/* Create a fragmented message.  Each fragment is filled to exactly mms
+ * bytes, but for the last; use otrl_proto_fragment_count to find how
+ * many there need to be.  The fragments are all kept in one block
+ * with the array of them, which otrl_proto_fragment_free frees. */
 gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
 	char ***fragments, ConnContext *context, const char *message);
 
+/* Free a string array containing fragment messages. */
 void otrl_proto_fragment_free(char ***fragments, unsigned short arraylen);
 #endif
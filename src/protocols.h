@@ -0,0 +1,71 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Chris Alexander, Willy Lew,
+ *  			     Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The versions of the OTR protocol built in, as chosen with configure's
+ * --enable-protocols.  This header is internal to the library, and
+ * isn't installed. */
+
+#ifndef __PROTOCOLS_H__
+#define __PROTOCOLS_H__
+
+#include "proto.h"
+
+#ifdef OTRL_NO_PROTOCOL_V1
+#define OTRL_HAVE_V1 0
+#else
+#define OTRL_HAVE_V1 1
+#endif
+
+#ifdef OTRL_NO_PROTOCOL_V2
+#define OTRL_HAVE_V2 0
+#else
+#define OTRL_HAVE_V2 1
+#endif
+
+#ifdef OTRL_NO_PROTOCOL_V3
+#define OTRL_HAVE_V3 0
+#else
+#define OTRL_HAVE_V3 1
+#endif
+
+#define OTRL_NUM_VERSIONS (OTRL_HAVE_V1 + OTRL_HAVE_V2 + OTRL_HAVE_V3)
+
+/* The OTRL_POLICY_ALLOW_V* bits of the versions built in */
+#define OTRL_POLICY_BUILT_VERSIONS \
+    ((OTRL_HAVE_V1 ? OTRL_POLICY_ALLOW_V1 : 0) | \
+     (OTRL_HAVE_V2 ? OTRL_POLICY_ALLOW_V2 : 0) | \
+     (OTRL_HAVE_V3 ? OTRL_POLICY_ALLOW_V3 : 0))
+
+/* A policy with the versions that aren't built in taken out */
+#define otrl_policy_built(policy) \
+    ((policy) & (~OTRL_POLICY_VERSION_MASK | OTRL_POLICY_BUILT_VERSIONS))
+
+/* Is version one of those built in? */
+#define otrl_version_built(version) \
+    ((OTRL_HAVE_V1 && (version) == 1) || (OTRL_HAVE_V2 && (version) == 2) \
+     || (OTRL_HAVE_V3 && (version) == 3))
+
+/* Is version, which must already be known to be one of those built
+ * in, the constant v?  With a single version built in, this is a
+ * constant itself, so the compiler drops the code for the others. */
+#define otrl_version_is(version, v) \
+    (OTRL_HAVE_V##v && (OTRL_NUM_VERSIONS == 1 || (version) == (v)))
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdlib.h>
+#include <string.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "context.h"
+#include "pubkeycache.h"
+#include "userstate.h"
+
+/* Take the given key out of the given OtrlUserState's LRU list. */
+static void lru_unlink(OtrlUserState us, OtrlPubKey *key)
+{
+    if (key->lru_prev) {
+	key->lru_prev->lru_next = key->lru_next;
+    } else {
+	us->pubkey_lru_head = key->lru_next;
+    }
+    if (key->lru_next) {
+	key->lru_next->lru_prev = key->lru_prev;
+    } else {
+	us->pubkey_lru_tail = key->lru_prev;
+    }
+    key->lru_prev = NULL;
+    key->lru_next = NULL;
+}
+
+/* Put the given key at the front of the given OtrlUserState's LRU
+ * list. */
+static void lru_push(OtrlUserState us, OtrlPubKey *key)
+{
+    key->lru_prev = NULL;
+    key->lru_next = us->pubkey_lru_head;
+    if (us->pubkey_lru_head) {
+	us->pubkey_lru_head->lru_prev = key;
+    } else {
+	us->pubkey_lru_tail = key;
+    }
+    us->pubkey_lru_head = key;
+}
+
+/* Find the given master context's Fingerprint with the given value,
+ * with the userstate's lock already held. */
+static Fingerprint *find_fprint(OtrlUserState us, ConnContext *context,
+	const unsigned char fingerprint[20])
+{
+    Fingerprint *f = NULL;
+
+    while ((f = otrl_context_fingerprint_next(us, fingerprint, f))) {
+	if (f->context == context) return f;
+    }
+    return NULL;
+}
+
+/* Look for the key whose datalen bytes of serialized form are in data,
+ * and whose fingerprint is given, among those cached for the given
+ * master context.  If it's there, mark it as the most recently used
+ * and return it with a reference for the caller, who should release
+ * it with otrl_pubkey_release.  Otherwise, return NULL. */
+OtrlPubKey *otrl_pubkey_cache_find(ConnContext *context,
+	const unsigned char fingerprint[20], const unsigned char *data,
+	size_t datalen)
+{
+    OtrlUserState us = context->context_priv->userstate;
+    Fingerprint *f;
+    OtrlPubKey *key = NULL;
+
+    if (us->pubkey_cache_max == 0) return NULL;
+
+    otrl_userstate_wrlock(us);
+    f = find_fprint(us, context, fingerprint);
+    /* The fingerprint is a hash of the data, but comparing the data
+     * itself means we never rely on that hash not colliding. */
+    if (f && f->pubkey && f->pubkey->datalen == datalen &&
+	    !memcmp(f->pubkey->data, data, datalen)) {
+	key = f->pubkey;
+	__atomic_add_fetch(&(key->refcount), 1, __ATOMIC_RELAXED);
+	lru_unlink(us, key);
+	lru_push(us, key);
+    }
+    otrl_userstate_unlock(us);
+    return key;
+}
+
+/* Cache the key whose serialized form and fingerprint are given, and
+ * which has been parsed into p, q, g and y, for the given master
+ * context, if the cache is on and the context already has the
+ * fingerprint.  The cache takes over p, q, g and y either way. */
+void otrl_pubkey_cache_add(ConnContext *context,
+	const unsigned char fingerprint[20], const unsigned char *data,
+	size_t datalen, gcry_mpi_t p, gcry_mpi_t q, gcry_mpi_t g,
+	gcry_mpi_t y)
+{
+    OtrlUserState us = context->context_priv->userstate;
+    OtrlPubKey *key = NULL;
+    Fingerprint *f;
+
+    if (us->pubkey_cache_max > 0) {
+	key = malloc(sizeof(*key) + datalen);
+    }
+    if (key == NULL) {
+	gcry_mpi_release(p);
+	gcry_mpi_release(q);
+	gcry_mpi_release(g);
+	gcry_mpi_release(y);
+	return;
+    }
+    key->refcount = 1;
+    key->data = (unsigned char *)(key + 1);
+    memmove(key->data, data, datalen);
+    key->datalen = datalen;
+    key->p = p;
+    key->q = q;
+    key->g = g;
+    key->y = y;
+
+    otrl_userstate_wrlock(us);
+    f = find_fprint(us, context, fingerprint);
+    if (f) {
+	otrl_pubkey_cache_forget(us, f);
+	key->fprint = f;
+	f->pubkey = key;
+	lru_push(us, key);
+	++us->pubkey_cache_used;
+	otrl_pubkey_cache_trim(us);
+	key = NULL;
+    }
+    otrl_userstate_unlock(us);
+
+    if (key) {
+	key->fprint = NULL;
+	otrl_pubkey_release(key);
+    }
+}
+
+/* Release a reference to the given key, freeing it if it was the
+ * last. */
+void otrl_pubkey_release(OtrlPubKey *key)
+{
+    if (key == NULL ||
+	    __atomic_sub_fetch(&(key->refcount), 1, __ATOMIC_ACQ_REL) > 0) {
+	return;
+    }
+    gcry_mpi_release(key->p);
+    gcry_mpi_release(key->q);
+    gcry_mpi_release(key->g);
+    gcry_mpi_release(key->y);
+    free(key);
+}
+
+/* Drop the key the given Fingerprint has cached, if any, with the
+ * userstate's write lock already held. */
+void otrl_pubkey_cache_forget(OtrlUserState us, Fingerprint *fprint)
+{
+    OtrlPubKey *key = fprint->pubkey;
+
+    if (key == NULL) return;
+    lru_unlink(us, key);
+    --us->pubkey_cache_used;
+    fprint->pubkey = NULL;
+    key->fprint = NULL;
+    otrl_pubkey_release(key);
+}
+
+/* Drop the least recently used keys until the given OtrlUserState's
+ * cache holds no more than it's allowed to, with the userstate's write
+ * lock already held. */
+void otrl_pubkey_cache_trim(OtrlUserState us)
+{
+    while (us->pubkey_cache_used > us->pubkey_cache_max) {
+	otrl_pubkey_cache_forget(us, us->pubkey_lru_tail->fprint);
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __PUBKEYCACHE_H__
+#define __PUBKEYCACHE_H__
+
+#include <gcrypt.h>
+
+#include "context.h"
+#include "userstate.h"
+
+/* The public key cache keeps the DSA public keys the AKE has verified
+ * signatures with, already parsed, on the Fingerprints they hash to,
+ * so that the next AKE with the same key doesn't parse it again.  It
+ * holds at most the number of keys given to
+ * otrl_userstate_set_pubkey_cache, dropping the least recently used
+ * one to make room.  A key is only cached once its master context
+ * knows its fingerprint, so a new contact's key is parsed twice. */
+
+typedef struct s_OtrlPubKey {
+    unsigned int refcount;         /* Updated atomically */
+    unsigned char *data;           /* The key as sent, after its type */
+    size_t datalen;                /*  ...and its length */
+    gcry_mpi_t p, q, g, y;         /* The key, parsed */
+    Fingerprint *fprint;           /* The Fingerprint holding us, or
+				      NULL once we've been dropped */
+    struct s_OtrlPubKey *lru_prev; /* The key used more recently */
+    struct s_OtrlPubKey *lru_next; /* The key used less recently */
+} OtrlPubKey;
+
+/* Look for the key whose datalen bytes of serialized form are in data,
+ * and whose fingerprint is given, among those cached for the given
+ * master context.  If it's there, mark it as the most recently used
+ * and return it with a reference for the caller, who should release
+ * it with otrl_pubkey_release.  Otherwise, return NULL. */
+OtrlPubKey *otrl_pubkey_cache_find(ConnContext *context,
+	const unsigned char fingerprint[20], const unsigned char *data,
+	size_t datalen);
+
+/* Cache the key whose serialized form and fingerprint are given, and
+ * which has been parsed into p, q, g and y, for the given master
+ * context, if the cache is on and the context already has the
+ * fingerprint.  The cache takes over p, q, g and y either way. */
+void otrl_pubkey_cache_add(ConnContext *context,
+	const unsigned char fingerprint[20], const unsigned char *data,
+	size_t datalen, gcry_mpi_t p, gcry_mpi_t q, gcry_mpi_t g,
+	gcry_mpi_t y);
+
+/* Release a reference to the given key, freeing it if it was the
+ * last. */
+void otrl_pubkey_release(OtrlPubKey *key);
+
+/* Drop the key the given Fingerprint has cached, if any, with the
+ * userstate's write lock already held. */
+void otrl_pubkey_cache_forget(OtrlUserState us, Fingerprint *fprint);
+
+/* Drop the least recently used keys until the given OtrlUserState's
+ * cache holds no more than it's allowed to, with the userstate's write
+ * lock already held. */
+void otrl_pubkey_cache_trim(OtrlUserState us);
+
+#endif
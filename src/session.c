@@ -0,0 +1,465 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "context.h"
+#include "mem.h"
+#include "protocols.h"
+#include "serial.h"
+#include "session.h"
+
+/* A session blob is:
+ *
+ *    4 bytes   SESSION_MAGIC
+ *    1 byte    SESSION_FORMAT
+ *   16 bytes   the initial AES-256-CTR counter block
+ *    n bytes   the session, encrypted
+ *   32 bytes   HMAC-SHA256 of all of the above
+ *
+ * with the encryption and MAC keys the SHA-256 hashes of the byte 0x01
+ * or 0x02 followed by the application's key.  The session itself is,
+ * with each integer 4 bytes, big-endian, and each MPI an integer
+ * length (0 for a missing one) followed by that many bytes:
+ *
+ *    the protocol version, our instance tag, their instance tag
+ *    the session id length, 20 bytes of session id, the bold half
+ *    1 if there is an active fingerprint, else 0; 20 bytes of it
+ *    their keyid, their Y, their previous Y
+ *    our keyid, our D-H key (private, then public), our previous one
+ *    for each of sesskeys[0][0], [0][1], [1][0] and [1][1]:
+ *	an integer of SESSION_SESS_* flags, and the top 8 bytes of the
+ *	sending and then the receiving counter
+ *    the number of saved MAC keys, and 20 bytes of each
+ */
+
+#define SESSION_MAGIC "OTRS"
+#define SESSION_FORMAT 1
+#define SESSION_HEADER_LEN (4 + 1 + 16)
+#define SESSION_MAC_LEN 32
+
+#define SESSION_SESS_DERIVED 0x01
+#define SESSION_SESS_SENDMACUSED 0x02
+#define SESSION_SESS_RCVMACUSED 0x04
+
+/* The number of MPIs in a session, and the fixed-size part of one
+ * sesskeys slot */
+#define SESSION_NUM_MPIS 6
+#define SESSION_SESS_LEN (4 + 8 + 8)
+
+/* Work out the encryption and MAC keys for a blob from the
+ * application's key. */
+static void session_keys(const unsigned char key[OTRL_SESSION_KEY_BYTES],
+	unsigned char enckey[32], unsigned char mackey[32])
+{
+    unsigned char buf[1 + OTRL_SESSION_KEY_BYTES];
+
+    memmove(buf + 1, key, OTRL_SESSION_KEY_BYTES);
+    buf[0] = 0x01;
+    gcry_md_hash_buffer(GCRY_MD_SHA256, enckey, buf, sizeof(buf));
+    buf[0] = 0x02;
+    gcry_md_hash_buffer(GCRY_MD_SHA256, mackey, buf, sizeof(buf));
+    otrl_mem_wipe(buf, sizeof(buf));
+}
+
+/* AES-256-CTR encrypt or decrypt len bytes from in to out, starting
+ * at the counter block ctr. */
+static gcry_error_t session_crypt(const unsigned char enckey[32],
+	const unsigned char *ctr, unsigned char *out, const unsigned char *in,
+	size_t len)
+{
+    gcry_cipher_hd_t cipher;
+    gcry_error_t err;
+
+    err = gcry_cipher_open(&cipher, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CTR,
+	    GCRY_CIPHER_SECURE);
+    if (err) return err;
+    err = gcry_cipher_setkey(cipher, enckey, 32);
+    if (!err) err = gcry_cipher_setctr(cipher, ctr, 16);
+    if (!err) err = gcry_cipher_encrypt(cipher, out, len, in, len);
+    gcry_cipher_close(cipher);
+    return err;
+}
+
+/* Put the HMAC-SHA256 of the len bytes at data into mac. */
+static gcry_error_t session_mac(const unsigned char mackey[32],
+	const unsigned char *data, size_t len, unsigned char *mac)
+{
+    gcry_md_hd_t md;
+    gcry_error_t err;
+
+    err = gcry_md_open(&md, GCRY_MD_SHA256,
+	    GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE);
+    if (err) return err;
+    err = gcry_md_setkey(md, mackey, 32);
+    if (!err) {
+	gcry_md_write(md, data, len);
+	memmove(mac, gcry_md_read(md, GCRY_MD_SHA256), SESSION_MAC_LEN);
+    }
+    gcry_md_close(md);
+    return err;
+}
+
+/* Put a newly-allocated blob with the encrypted session of the given
+ * context into *blobp, and its length into *bloblenp, sealed with
+ * key.  The caller should free() the blob.  Return GPG_ERR_CONFLICT if
+ * the context isn't in the OTRL_MSGSTATE_ENCRYPTED state. */
+gcry_error_t otrl_session_export(ConnContext *context,
+	const unsigned char key[OTRL_SESSION_KEY_BYTES],
+	unsigned char **blobp, size_t *bloblenp)
+{
+    ConnContextPriv *priv = context->context_priv;
+    gcry_mpi_t mpis[SESSION_NUM_MPIS];
+    size_t mpilens[SESSION_NUM_MPIS];
+    unsigned char enckey[32], mackey[32];
+    unsigned char *plain = NULL, *blob = NULL;
+    unsigned char *bufp;
+    size_t plainlen, bloblen, lenp;
+    gcry_error_t err;
+    int i, j;
+
+    *blobp = NULL;
+    *bloblenp = 0;
+
+    otrl_context_lock(context);
+    if (context->msgstate != OTRL_MSGSTATE_ENCRYPTED) {
+	otrl_context_unlock(context);
+	return gcry_error(GPG_ERR_CONFLICT);
+    }
+
+    mpis[0] = priv->their_y;
+    mpis[1] = priv->their_old_y;
+    mpis[2] = priv->our_dh_key.priv;
+    mpis[3] = priv->our_dh_key.pub;
+    mpis[4] = priv->our_old_dh_key.priv;
+    mpis[5] = priv->our_old_dh_key.pub;
+
+    plainlen = 4 * 3 + 4 + 20 + 4 + 4 + 20 + 4 + 4 + 4 * SESSION_SESS_LEN + 4
+	+ 20 * priv->numsavedkeys;
+    for (i = 0; i < SESSION_NUM_MPIS; ++i) {
+	mpilens[i] = 0;
+	if (mpis[i]) {
+	    gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &mpilens[i], mpis[i]);
+	}
+	plainlen += 4 + mpilens[i];
+    }
+    bloblen = SESSION_HEADER_LEN + plainlen + SESSION_MAC_LEN;
+
+    plain = gcry_malloc_secure(plainlen);
+    blob = malloc(bloblen);
+    if (!plain || !blob) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto err;
+    }
+
+    bufp = plain;
+    lenp = plainlen;
+    write_int(context->protocol_version);
+    write_int(context->our_instance);
+    write_int(context->their_instance);
+    write_int(context->sessionid_len);
+    memmove(bufp, context->sessionid, 20);
+    bufp += 20; lenp -= 20;
+    write_int(context->sessionid_half);
+    write_int(context->active_fingerprint ? 1 : 0);
+    if (context->active_fingerprint) {
+	memmove(bufp, context->active_fingerprint->fingerprint, 20);
+    } else {
+	memset(bufp, 0, 20);
+    }
+    bufp += 20; lenp -= 20;
+
+    for (i = 0; i < SESSION_NUM_MPIS; ++i) {
+	if (i == 0) write_int(priv->their_keyid);
+	if (i == 2) write_int(priv->our_keyid);
+	write_int(mpilens[i]);
+	if (mpilens[i]) {
+	    gcry_mpi_print(GCRYMPI_FMT_USG, bufp, lenp, NULL, mpis[i]);
+	}
+	bufp += mpilens[i]; lenp -= mpilens[i];
+    }
+
+    for (i = 0; i < 2; ++i) for (j = 0; j < 2; ++j) {
+	/* A context without session keys has derived none of them yet */
+	const DH_sesskeys *sess =
+	    priv->sesskeys ? &(priv->sesskeys[i][j]) : NULL;
+	unsigned int flags = 0;
+
+	if (sess == NULL) {
+	    write_int(flags);
+	    memset(bufp, 0, 16);
+	    bufp += 16; lenp -= 16;
+	    continue;
+	}
+	if (sess->derived) flags |= SESSION_SESS_DERIVED;
+	if (sess->sendmacused) flags |= SESSION_SESS_SENDMACUSED;
+	if (sess->rcvmacused) flags |= SESSION_SESS_RCVMACUSED;
+	write_int(flags);
+	memmove(bufp, sess->sendctr, 8);
+	memmove(bufp + 8, sess->rcvctr, 8);
+	bufp += 16; lenp -= 16;
+    }
+
+    write_int(priv->numsavedkeys);
+    if (priv->numsavedkeys) {
+	memmove(bufp, priv->saved_mac_keys, 20 * priv->numsavedkeys);
+    }
+    otrl_context_unlock(context);
+
+    /* Seal it */
+    session_keys(key, enckey, mackey);
+    memmove(blob, SESSION_MAGIC, 4);
+    blob[4] = SESSION_FORMAT;
+    gcry_create_nonce(blob + 5, 16);
+    err = session_crypt(enckey, blob + 5, blob + SESSION_HEADER_LEN, plain,
+	    plainlen);
+    if (!err) {
+	err = session_mac(mackey, blob, SESSION_HEADER_LEN + plainlen,
+		blob + SESSION_HEADER_LEN + plainlen);
+    }
+    otrl_mem_wipe(enckey, sizeof(enckey));
+    otrl_mem_wipe(mackey, sizeof(mackey));
+    otrl_mem_wipe(plain, plainlen);
+    gcry_free(plain);
+    if (err) {
+	free(blob);
+	return err;
+    }
+
+    *blobp = blob;
+    *bloblenp = bloblen;
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+err:
+    otrl_context_unlock(context);
+    gcry_free(plain);
+    free(blob);
+    return err;
+}
+
+/* Carry on the session in the blob made by otrl_session_export in the
+ * given context, which should be for the same username, accountname,
+ * protocol and instance tags as the one it was exported from, and
+ * must not already be encrypted.  On success the context is in the
+ * OTRL_MSGSTATE_ENCRYPTED state, with any SMP in progress forgotten.
+ * Return GPG_ERR_BAD_SIGNATURE if the blob wasn't sealed with key or
+ * has been altered, GPG_ERR_INV_VALUE if it isn't a session blob, and
+ * GPG_ERR_CONFLICT if the context is already encrypted or the blob is
+ * for another instance. */
+gcry_error_t otrl_session_import(ConnContext *context,
+	const unsigned char key[OTRL_SESSION_KEY_BYTES],
+	const unsigned char *blob, size_t bloblen)
+{
+    ConnContextPriv *priv = context->context_priv;
+    gcry_mpi_t mpis[SESSION_NUM_MPIS] = { NULL };
+    unsigned char enckey[32], mackey[32], mac[SESSION_MAC_LEN];
+    unsigned char *plain = NULL, *savedmacs = NULL;
+    const unsigned char *bufp;
+    size_t plainlen, lenp;
+    unsigned int protocol_version, our_instance, their_instance;
+    unsigned int sessionid_len, sessionid_half, has_fingerprint;
+    unsigned int their_keyid = 0, our_keyid = 0, numsavedkeys;
+    unsigned char sessionid[20], fingerprint[20];
+    unsigned int sessflags[2][2];
+    const unsigned char *sessctrs[2][2];
+    gcry_error_t err;
+    int i, j;
+
+    if (bloblen < SESSION_HEADER_LEN + SESSION_MAC_LEN ||
+	    memcmp(blob, SESSION_MAGIC, 4) || blob[4] != SESSION_FORMAT) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+    plainlen = bloblen - SESSION_HEADER_LEN - SESSION_MAC_LEN;
+
+    session_keys(key, enckey, mackey);
+    err = session_mac(mackey, blob, SESSION_HEADER_LEN + plainlen, mac);
+    if (!err && otrl_mem_differ(mac, blob + SESSION_HEADER_LEN + plainlen,
+		SESSION_MAC_LEN)) {
+	err = gcry_error(GPG_ERR_BAD_SIGNATURE);
+    }
+    if (!err) {
+	plain = gcry_malloc_secure(plainlen ? plainlen : 1);
+	if (!plain) err = gcry_error(GPG_ERR_ENOMEM);
+    }
+    if (!err) {
+	err = session_crypt(enckey, blob + 5, plain,
+		blob + SESSION_HEADER_LEN, plainlen);
+    }
+    otrl_mem_wipe(enckey, sizeof(enckey));
+    otrl_mem_wipe(mackey, sizeof(mackey));
+    if (err) goto err;
+
+    bufp = plain;
+    lenp = plainlen;
+    read_int(protocol_version);
+    read_int(our_instance);
+    read_int(their_instance);
+    read_int(sessionid_len);
+    require_len(20);
+    memmove(sessionid, bufp, 20);
+    bufp += 20; lenp -= 20;
+    read_int(sessionid_half);
+    read_int(has_fingerprint);
+    require_len(20);
+    memmove(fingerprint, bufp, 20);
+    bufp += 20; lenp -= 20;
+    if (!otrl_version_built(protocol_version) || sessionid_len > 20 ||
+	    sessionid_half > OTRL_SESSIONID_SECOND_HALF_BOLD) {
+	goto invval;
+    }
+
+    for (i = 0; i < SESSION_NUM_MPIS; ++i) {
+	size_t mpilen;
+
+	if (i == 0) read_int(their_keyid);
+	if (i == 2) read_int(our_keyid);
+	read_int(mpilen);
+	require_len(mpilen);
+	if (mpilen) {
+	    gcry_mpi_scan(&mpis[i], GCRYMPI_FMT_USG, bufp, mpilen, NULL);
+	}
+	bufp += mpilen; lenp -= mpilen;
+    }
+    /* Their Y and both halves of our current key are needed; our
+     * previous key must be whole if it's there at all */
+    if (!mpis[0] || !mpis[2] || !mpis[3] || (!mpis[4] != !mpis[5])) {
+	goto invval;
+    }
+
+    for (i = 0; i < 2; ++i) for (j = 0; j < 2; ++j) {
+	read_int(sessflags[i][j]);
+	require_len(16);
+	sessctrs[i][j] = bufp;
+	bufp += 16; lenp -= 16;
+	if ((sessflags[i][j] & SESSION_SESS_DERIVED) &&
+		(!mpis[i ? 4 : 2] || !mpis[j ? 1 : 0])) {
+	    goto invval;
+	}
+    }
+
+    read_int(numsavedkeys);
+    if (numsavedkeys > lenp / 20 || lenp != 20 * (size_t)numsavedkeys) {
+	goto invval;
+    }
+    if (numsavedkeys) {
+	savedmacs = malloc(20 * numsavedkeys);
+	if (!savedmacs) {
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	    goto err;
+	}
+	memmove(savedmacs, bufp, 20 * numsavedkeys);
+    }
+
+    otrl_context_lock(context);
+    if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED ||
+	    context->their_instance != their_instance ||
+	    (context->our_instance && context->our_instance != our_instance)) {
+	otrl_context_unlock(context);
+	err = gcry_error(GPG_ERR_CONFLICT);
+	goto err;
+    }
+
+    /* Start from a clean slate, then put the session in place */
+    otrl_context_force_plaintext(context);
+    priv->their_keyid = their_keyid;
+    priv->their_y = mpis[0];
+    priv->their_old_y = mpis[1];
+    priv->our_keyid = our_keyid;
+    priv->our_dh_key.groupid = DH1536_GROUP_ID;
+    priv->our_dh_key.priv = mpis[2];
+    priv->our_dh_key.pub = mpis[3];
+    if (mpis[4]) {
+	priv->our_old_dh_key.groupid = DH1536_GROUP_ID;
+	priv->our_old_dh_key.priv = mpis[4];
+	priv->our_old_dh_key.pub = mpis[5];
+    }
+    for (i = 0; i < SESSION_NUM_MPIS; ++i) mpis[i] = NULL;
+
+    if (otrl_context_priv_wake(priv)) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+    }
+    for (i = 0; i < 2 && !err; ++i) for (j = 0; j < 2 && !err; ++j) {
+	DH_sesskeys *sess = &(priv->sesskeys[i][j]);
+
+	if (sessflags[i][j] & SESSION_SESS_DERIVED) {
+	    err = otrl_dh_session_rekey(sess,
+		    i ? &(priv->our_old_dh_key) : &(priv->our_dh_key),
+		    j ? priv->their_old_y : priv->their_y);
+	    if (err) break;
+	    memmove(sess->sendctr, sessctrs[i][j], 8);
+	    memmove(sess->rcvctr, sessctrs[i][j] + 8, 8);
+	    sess->sendmacused =
+		(sessflags[i][j] & SESSION_SESS_SENDMACUSED) != 0;
+	    sess->rcvmacused =
+		(sessflags[i][j] & SESSION_SESS_RCVMACUSED) != 0;
+	}
+    }
+    if (err) {
+	otrl_context_force_plaintext(context);
+	otrl_context_unlock(context);
+	goto err;
+    }
+
+    priv->numsavedkeys = numsavedkeys;
+    priv->saved_mac_keys = savedmacs;
+    priv->savedkeys_size = numsavedkeys;
+    savedmacs = NULL;
+    priv->generation++;
+    priv->lastsent = priv->lastrecv = time(NULL);
+
+    context->protocol_version = protocol_version;
+    context->auth.protocol_version = protocol_version;
+    context->our_instance = our_instance;
+    memmove(context->sessionid, sessionid, 20);
+    context->sessionid_len = sessionid_len;
+    context->sessionid_half = sessionid_half;
+    context->active_fingerprint = has_fingerprint ?
+	otrl_context_find_fingerprint(context, fingerprint, 1, NULL) : NULL;
+    context->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+    otrl_context_best_changed(context);
+    otrl_context_unlock(context);
+
+    otrl_mem_wipe(plain, plainlen);
+    gcry_free(plain);
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+invval:
+    err = gcry_error(GPG_ERR_INV_VALUE);
+err:
+    for (i = 0; i < SESSION_NUM_MPIS; ++i) gcry_mpi_release(mpis[i]);
+    free(savedmacs);
+    if (plain) {
+	otrl_mem_wipe(plain, plainlen);
+	gcry_free(plain);
+    }
+    return err;
+}
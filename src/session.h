@@ -0,0 +1,66 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <gcrypt.h>
+
+#include "context.h"
+
+/* A session blob holds the state of an encrypted conversation (the D-H
+ * keys and key ids of both sides, the counters and MAC keys of the
+ * session keys made from them, the session id and the fingerprint in
+ * use), so that a process can carry on the conversation after a
+ * restart, or another process can take it over, without a new AKE.
+ * The blob is encrypted and authenticated with a key of
+ * OTRL_SESSION_KEY_BYTES bytes that the application keeps as safe as
+ * its private keys.
+ *
+ * A session must only ever be carried on from one copy of its state:
+ * once a context has been exported, don't send anything more with it,
+ * and import each blob just once.  Otherwise the counters in the blob
+ * would be used twice, which gives away the plaintexts. */
+
+#define OTRL_SESSION_KEY_BYTES 32
+
+/* Put a newly-allocated blob with the encrypted session of the given
+ * context into *blobp, and its length into *bloblenp, sealed with
+ * key.  The caller should free() the blob.  Return GPG_ERR_CONFLICT if
+ * the context isn't in the OTRL_MSGSTATE_ENCRYPTED state. */
+gcry_error_t otrl_session_export(ConnContext *context,
+	const unsigned char key[OTRL_SESSION_KEY_BYTES],
+	unsigned char **blobp, size_t *bloblenp);
+
+/* Carry on the session in the blob made by otrl_session_export in the
+ * given context, which should be for the same username, accountname,
+ * protocol and instance tags as the one it was exported from, and
+ * must not already be encrypted.  On success the context is in the
+ * OTRL_MSGSTATE_ENCRYPTED state, with any SMP in progress forgotten.
+ * Return GPG_ERR_BAD_SIGNATURE if the blob wasn't sealed with key or
+ * has been altered, GPG_ERR_INV_VALUE if it isn't a session blob, and
+ * GPG_ERR_CONFLICT if the context is already encrypted or the blob is
+ * for another instance. */
+gcry_error_t otrl_session_import(ConnContext *context,
+	const unsigned char key[OTRL_SESSION_KEY_BYTES],
+	const unsigned char *blob, size_t bloblen);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* HMAC-SHA1 of up to eight messages at once.  Each 32-bit lane of an
+ * AVX2 register carries the SHA-1 state of a different message, so
+ * the eight compressions of a round cost about what one does.  The
+ * messages may all be of different lengths; a lane whose message has
+ * run out of blocks is masked so that its state is left as it is. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <string.h>
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* libotr headers */
+#include "mem.h"
+#include "sha1mb.h"
+
+/* Whether this machine can run the kernels, and whether they're any
+ * quicker here than libgcrypt (-1 if not yet known) */
+static int available = -1;
+static int faster = -1;
+
+/* Return 1 if otrl_sha1mb_hmac can be used on this machine (it needs
+ * AVX2), or 0 if it can't. */
+int otrl_sha1mb_available(void)
+{
+    /* Two threads getting here at once both find the same answer */
+    if (available < 0) {
+	int avx2 = 0;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+	available = avx2;
+    }
+    return available;
+}
+
+/* Return 1 if otrl_sha1mb_hmac is worth using in place of libgcrypt's
+ * HMAC on this machine, or 0 if it isn't.  With the SHA extensions,
+ * libgcrypt's one-at-a-time SHA-1 is already about as quick per
+ * message as eight AVX2 lanes are. */
+int otrl_sha1mb_faster(void)
+{
+    if (faster < 0) {
+	int noshaext = 0;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	noshaext = !__builtin_cpu_supports("sha");
+#endif
+	faster = otrl_sha1mb_available() && noshaext;
+    }
+    return faster;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* Start each lane's SHA-1 state afresh */
+static void sha1_init(unsigned int h[5][OTRL_SHA1MB_LANES])
+{
+    static const unsigned int iv[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+    };
+    int w, l;
+
+    for (w = 0; w < 5; ++w) {
+	for (l = 0; l < OTRL_SHA1MB_LANES; ++l) {
+	    h[w][l] = iv[w];
+	}
+    }
+}
+
+/* Put block number b of the nblocks that a message of len bytes pads
+ * out to into block.  The message follows prefix bytes that have
+ * already been hashed, which count towards its length. */
+static void fill_block(unsigned char block[64], const unsigned char *msg,
+	size_t len, size_t b, size_t nblocks, size_t prefix)
+{
+    unsigned long long bits = (unsigned long long)(len + prefix) * 8;
+    size_t off = b * 64;
+    int j;
+
+    memset(block, 0, 64);
+    if (off < len) {
+	memmove(block, msg + off, len - off < 64 ? len - off : 64);
+    }
+    if (off <= len && len - off < 64) {
+	block[len - off] = 0x80;
+    }
+    if (b == nblocks - 1) {
+	for (j = 0; j < 8; ++j) {
+	    block[63 - j] = (unsigned char)(bits >> (8 * j));
+	}
+    }
+}
+
+/* Write the SHA-1 state of lane l out as a 20-byte digest */
+static void lane_digest(unsigned char out[20],
+	unsigned int h[5][OTRL_SHA1MB_LANES], int l)
+{
+    int w;
+
+    for (w = 0; w < 5; ++w) {
+	out[4 * w] = (unsigned char)(h[w][l] >> 24);
+	out[4 * w + 1] = (unsigned char)(h[w][l] >> 16);
+	out[4 * w + 2] = (unsigned char)(h[w][l] >> 8);
+	out[4 * w + 3] = (unsigned char)h[w][l];
+    }
+}
+
+#define ROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), \
+	_mm256_srli_epi32((x), 32 - (n)))
+
+/* Transpose the 8x8 matrix of 32-bit words in r, so that r[i] ends up
+ * holding word i of each of the rows that were there */
+__attribute__((target("avx2")))
+static void transpose_avx2(__m256i r[8])
+{
+    __m256i t[8], u[8];
+    int i;
+
+    for (i = 0; i < 8; i += 2) {
+	t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+	t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (i = 0; i < 8; i += 4) {
+	u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+	u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+	u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+	u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (i = 0; i < 4; ++i) {
+	r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+	r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+/* Run the SHA-1 compression function over one 64-byte block for each
+ * lane, the one blocks[l] points to for lane l, but only update the
+ * state of the lanes whose bits are set in active. */
+__attribute__((target("avx2")))
+static void compress_avx2(unsigned int h[5][OTRL_SHA1MB_LANES],
+	const unsigned char *const blocks[OTRL_SHA1MB_LANES],
+	unsigned int active)
+{
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+	    11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+	    11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i mask = _mm256_setr_epi32(
+	    -(int)(active & 1), -(int)((active >> 1) & 1),
+	    -(int)((active >> 2) & 1), -(int)((active >> 3) & 1),
+	    -(int)((active >> 4) & 1), -(int)((active >> 5) & 1),
+	    -(int)((active >> 6) & 1), -(int)((active >> 7) & 1));
+    __m256i w[16], a, b, c, d, e, k;
+    int t;
+
+    /* Each lane's block is a row; its words are wanted in columns */
+    for (t = 0; t < 8; ++t) {
+	w[t] = _mm256_loadu_si256((const __m256i *)blocks[t]);
+	w[t + 8] = _mm256_loadu_si256((const __m256i *)(blocks[t] + 32));
+    }
+    transpose_avx2(w);
+    transpose_avx2(w + 8);
+    for (t = 0; t < 16; ++t) {
+	w[t] = _mm256_shuffle_epi8(w[t], bswap);
+    }
+
+    a = _mm256_loadu_si256((const __m256i *)h[0]);
+    b = _mm256_loadu_si256((const __m256i *)h[1]);
+    c = _mm256_loadu_si256((const __m256i *)h[2]);
+    d = _mm256_loadu_si256((const __m256i *)h[3]);
+    e = _mm256_loadu_si256((const __m256i *)h[4]);
+
+    /* Each stretch of 20 rounds has its own function and constant */
+#define ROUND(t, f, k) do { \
+	__m256i tmp; \
+	if ((t) >= 16) { \
+	    tmp = _mm256_xor_si256( \
+		    _mm256_xor_si256(w[((t) + 13) & 15], w[((t) + 8) & 15]), \
+		    _mm256_xor_si256(w[((t) + 2) & 15], w[(t) & 15])); \
+	    w[(t) & 15] = ROL(tmp, 1); \
+	} \
+	tmp = _mm256_add_epi32(_mm256_add_epi32(ROL(a, 5), (f)), \
+		_mm256_add_epi32(_mm256_add_epi32(e, (k)), w[(t) & 15])); \
+	e = d; \
+	d = c; \
+	c = ROL(b, 30); \
+	b = a; \
+	a = tmp; \
+    } while(0)
+#define F1 _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define F2 _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define F3 _mm256_or_si256(_mm256_and_si256(b, c), \
+	_mm256_and_si256(d, _mm256_or_si256(b, c)))
+    k = _mm256_set1_epi32(0x5a827999);
+    for (t = 0; t < 20; ++t) ROUND(t, F1, k);
+    k = _mm256_set1_epi32(0x6ed9eba1);
+    for (; t < 40; ++t) ROUND(t, F2, k);
+    k = _mm256_set1_epi32((int)0x8f1bbcdc);
+    for (; t < 60; ++t) ROUND(t, F3, k);
+    k = _mm256_set1_epi32((int)0xca62c1d6);
+    for (; t < 80; ++t) ROUND(t, F2, k);
+#undef F1
+#undef F2
+#undef F3
+#undef ROUND
+
+#define UPDATE(i, x) _mm256_storeu_si256((__m256i *)h[i], \
+	_mm256_add_epi32(_mm256_loadu_si256((const __m256i *)h[i]), \
+	    _mm256_and_si256((x), mask)))
+    UPDATE(0, a);
+    UPDATE(1, b);
+    UPDATE(2, c);
+    UPDATE(3, d);
+    UPDATE(4, e);
+#undef UPDATE
+}
+
+__attribute__((target("avx2")))
+static void hmac_avx2(unsigned char macs[][20],
+	const unsigned char keys[][20], const unsigned char *const msgs[],
+	const size_t lens[], int n)
+{
+    unsigned int inner[5][OTRL_SHA1MB_LANES];
+    unsigned int outer[5][OTRL_SHA1MB_LANES];
+    /* The key blocks, and then the last block or two of each message,
+     * where the padding goes */
+    unsigned char pads[OTRL_SHA1MB_LANES][64];
+    unsigned char tails[OTRL_SHA1MB_LANES][128];
+    const unsigned char *blocks[OTRL_SHA1MB_LANES];
+    size_t full[OTRL_SHA1MB_LANES], nblocks[OTRL_SHA1MB_LANES];
+    size_t most = 0, b;
+    unsigned int all = (1u << n) - 1;
+    int i, j;
+
+    /* Lanes with no message still have to point somewhere */
+    memset(pads, 0, sizeof(pads));
+    memset(tails, 0, sizeof(tails));
+    for (i = 0; i < OTRL_SHA1MB_LANES; ++i) blocks[i] = pads[i];
+
+    /* Hash key ^ ipad and key ^ opad into each lane's inner and outer
+     * states */
+    sha1_init(inner);
+    sha1_init(outer);
+    for (i = 0; i < n; ++i) {
+	memset(pads[i], 0x36, 64);
+	for (j = 0; j < 20; ++j) pads[i][j] ^= keys[i][j];
+    }
+    compress_avx2(inner, blocks, all);
+    for (i = 0; i < n; ++i) {
+	memset(pads[i], 0x5c, 64);
+	for (j = 0; j < 20; ++j) pads[i][j] ^= keys[i][j];
+    }
+    compress_avx2(outer, blocks, all);
+
+    /* The messages, a block of each at a time, for as long as any of
+     * them lasts.  Whole blocks are read where they are. */
+    for (i = 0; i < n; ++i) {
+	full[i] = lens[i] / 64;
+	nblocks[i] = (lens[i] + 8) / 64 + 1;
+	for (b = full[i]; b < nblocks[i]; ++b) {
+	    fill_block(tails[i] + 64 * (b - full[i]), msgs[i], lens[i], b,
+		    nblocks[i], 64);
+	}
+	if (nblocks[i] > most) most = nblocks[i];
+    }
+    for (b = 0; b < most; ++b) {
+	unsigned int active = 0;
+
+	for (i = 0; i < n; ++i) {
+	    if (b >= nblocks[i]) continue;
+	    blocks[i] = b < full[i] ? msgs[i] + 64 * b :
+		tails[i] + 64 * (b - full[i]);
+	    active |= 1u << i;
+	}
+	compress_avx2(inner, blocks, active);
+    }
+
+    /* Then each inner hash, after key ^ opad */
+    for (i = 0; i < n; ++i) {
+	unsigned char digest[20];
+
+	lane_digest(digest, inner, i);
+	fill_block(pads[i], digest, 20, 0, 1, 64);
+	otrl_mem_wipe(digest, sizeof(digest));
+	blocks[i] = pads[i];
+    }
+    compress_avx2(outer, blocks, all);
+
+    for (i = 0; i < n; ++i) {
+	lane_digest(macs[i], outer, i);
+    }
+
+    otrl_mem_wipe(inner, sizeof(inner));
+    otrl_mem_wipe(outer, sizeof(outer));
+    otrl_mem_wipe(pads, sizeof(pads));
+    otrl_mem_wipe(tails, sizeof(tails));
+}
+
+#endif  /* HAVE_X86_SIMD */
+
+/* Work out the HMAC-SHA1 of each of the n (at most OTRL_SHA1MB_LANES)
+ * messages msgs[i], of lens[i] bytes, with the 20-byte key keys[i],
+ * into macs[i].  Only call this if otrl_sha1mb_available says so. */
+void otrl_sha1mb_hmac(unsigned char macs[][20],
+	const unsigned char keys[][20], const unsigned char *const msgs[],
+	const size_t lens[], int n)
+{
+#ifdef HAVE_X86_SIMD
+    if (n > 0 && n <= OTRL_SHA1MB_LANES) {
+	hmac_avx2(macs, keys, msgs, lens, n);
+    }
+#endif
+}
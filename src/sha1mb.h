@@ -0,0 +1,51 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* HMAC-SHA1 of several messages at once, each with its own key, for
+ * checking the MACs of a batch of Data Messages.  This header is
+ * internal to the library, and isn't installed. */
+
+#ifndef __SHA1MB_H__
+#define __SHA1MB_H__
+
+#include <stddef.h>
+
+/* The most HMACs otrl_sha1mb_hmac works out in one call */
+#define OTRL_SHA1MB_LANES 8
+
+/* Return 1 if otrl_sha1mb_hmac can be used on this machine (it needs
+ * AVX2), or 0 if it can't. */
+int otrl_sha1mb_available(void);
+
+/* Return 1 if otrl_sha1mb_hmac is worth using in place of libgcrypt's
+ * HMAC on this machine, or 0 if it isn't.  With the SHA extensions,
+ * libgcrypt's one-at-a-time SHA-1 is already about as quick per
+ * message as eight AVX2 lanes are. */
+int otrl_sha1mb_faster(void);
+
+/* Work out the HMAC-SHA1 of each of the n (at most OTRL_SHA1MB_LANES)
+ * messages msgs[i], of lens[i] bytes, with the 20-byte key keys[i],
+ * into macs[i].  Only call this if otrl_sha1mb_available says so. */
+void otrl_sha1mb_hmac(unsigned char macs[][20],
+	const unsigned char keys[][20], const unsigned char *const msgs[],
+	const size_t lens[], int n);
+
+#endif
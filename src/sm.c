@@ -19,9 +19,14 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 
 /* libgcrypt headers */
@@ -30,6 +35,7 @@
 /* libotr headers */
 #include "sm.h"
 #include "serial.h"
+#include "stats.h"
 
 #if OTRL_DEBUGGING
 
@@ -60,6 +66,14 @@ static const int SM_MSG2_LEN = 11;
 static const int SM_MSG3_LEN = 8;
 static const int SM_MSG4_LEN = 3;
 
+/* What each element of the messages we receive must be, checked as
+ * they are unserialized: 'g' a group element, 'e' an exponent, and '.'
+ * a hash, which can be anything. */
+static const char *SM_MSG1_CHECKS = "g.eg.e";
+static const char *SM_MSG2_CHECKS = "g.eg.egg.ee";
+static const char *SM_MSG3_CHECKS = "gg.eeg.e";
+static const char *SM_MSG4_CHECKS = "g.e";
+
 /* The modulus p */
 static const char* SM_MODULUS_S = "0x"
     "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD1"
@@ -89,12 +103,35 @@ static gcry_mpi_t SM_GENERATOR = NULL;
 static gcry_mpi_t SM_ORDER = NULL;
 static gcry_mpi_t SM_MODULUS_MINUS_2 = NULL;
 
+/* SM_MODULUS_MINUS_2 and SM_ORDER as 192 big-endian bytes, to check
+ * serialized MPIs against */
+static unsigned char SM_MODULUS_MINUS_2_BYTES[192];
+static unsigned char SM_ORDER_BYTES[192];
+
+/* Exponents are split into 4-bit digits for the routines below; this
+ * many cover SM_MOD_LEN_BITS. */
+#define SM_EXPON_DIGITS 384
+
+/* The most bases otrl_sm_powm_public takes at once */
+#define SM_POWM_MAX_BASES 3
+
+/* The hash used by otrl_sm_hash with each version byte already fed
+ * into it, for versions 1 to SM_HASH_MAX_VERSION */
+#define SM_HASH_MAX_VERSION 8
+static gcry_md_hd_t SM_HASH_PREFIX[SM_HASH_MAX_VERSION + 1];
+
+/* SM_GENERATOR_POWERS[i] = SM_GENERATOR^(16^i) mod SM_MODULUS */
+static gcry_mpi_t SM_GENERATOR_POWERS[SM_EXPON_DIGITS];
+
 /*
  * Call this once, at plugin load time.  It sets up the modulus and
- * generator MPIs.
+ * generator MPIs, the table of powers of the generator, and the
+ * hashes used for the proofs.
  */
 void otrl_sm_init(void)
 {
+    int i, j;
+
     gcry_check_version(NULL);
     gcry_mpi_scan(&SM_MODULUS, GCRYMPI_FMT_HEX,
 	(const unsigned char *)SM_MODULUS_S, 0, NULL);
@@ -104,6 +141,36 @@ void otrl_sm_init(void)
 	(const unsigned char *)SM_GENERATOR_S, 0, NULL);
     SM_MODULUS_MINUS_2 = gcry_mpi_new(SM_MOD_LEN_BITS);
     gcry_mpi_sub_ui(SM_MODULUS_MINUS_2, SM_MODULUS, 2);
+    gcry_mpi_print(GCRYMPI_FMT_USG, SM_MODULUS_MINUS_2_BYTES,
+	    sizeof(SM_MODULUS_MINUS_2_BYTES), NULL, SM_MODULUS_MINUS_2);
+    gcry_mpi_print(GCRYMPI_FMT_USG, SM_ORDER_BYTES,
+	    sizeof(SM_ORDER_BYTES), NULL, SM_ORDER);
+
+    /* Prepare a hash for each version byte.  Flushing the write
+     * means that copying the hash later does not modify it. */
+    for (i = 1; i <= SM_HASH_MAX_VERSION; ++i) {
+	unsigned char version = i;
+	gcry_md_close(SM_HASH_PREFIX[i]);
+	SM_HASH_PREFIX[i] = NULL;
+	if (gcry_md_open(&SM_HASH_PREFIX[i], SM_HASH_ALGORITHM, 0)) continue;
+	gcry_md_write(SM_HASH_PREFIX[i], &version, 1);
+	gcry_md_write(SM_HASH_PREFIX[i], NULL, 0);
+    }
+
+    /* Precompute the powers of the generator used to raise it to the
+     * exponents in the proofs we are sent */
+    for (i = 0; i < SM_EXPON_DIGITS; ++i) {
+	gcry_mpi_release(SM_GENERATOR_POWERS[i]);
+	if (i == 0) {
+	    SM_GENERATOR_POWERS[i] = gcry_mpi_copy(SM_GENERATOR);
+	    continue;
+	}
+	SM_GENERATOR_POWERS[i] = gcry_mpi_copy(SM_GENERATOR_POWERS[i-1]);
+	for (j = 0; j < 4; ++j) {
+	    gcry_mpi_mulm(SM_GENERATOR_POWERS[i], SM_GENERATOR_POWERS[i],
+		    SM_GENERATOR_POWERS[i], SM_MODULUS);
+	}
+    }
 }
 
 /*
@@ -270,52 +337,55 @@ static gcry_mpi_t randomExponent(void)
     return randexpon;
 }
 
+/* Feed an MPI to a hash as otrl_sm_hash serializes it: a 4-byte
+ * length, then the big-endian bytes. */
+static void hash_mpi(gcry_md_hd_t md, const gcry_mpi_t x)
+{
+    unsigned char buf[192];
+    unsigned char lenbuf[4];
+    unsigned char *data = buf;
+    size_t len;
+
+    /* Anything reduced mod SM_MODULUS fits in buf */
+    if (gcry_mpi_print(GCRYMPI_FMT_USG, buf, sizeof(buf), &len, x)) {
+	gcry_mpi_aprint(GCRYMPI_FMT_USG, &data, &len, x);
+    }
+    lenbuf[0] = (unsigned char)((len >> 24) & 0xFF);
+    lenbuf[1] = (unsigned char)((len >> 16) & 0xFF);
+    lenbuf[2] = (unsigned char)((len >> 8) & 0xFF);
+    lenbuf[3] = (unsigned char)(len & 0xFF);
+    gcry_md_write(md, lenbuf, 4);
+    gcry_md_write(md, data, len);
+    if (data != buf) gcry_free(data);
+}
+
 /*
  * Hash one or two mpis.  To hash only one mpi, b may be set to NULL.
  */
 static gcry_error_t otrl_sm_hash(gcry_mpi_t* hash, int version,
 	const gcry_mpi_t a, const gcry_mpi_t b)
 {
-    unsigned char* input;
-    unsigned char output[SM_DIGEST_SIZE];
-    size_t sizea;
-    size_t sizeb;
-    size_t totalsize;
-    unsigned char* dataa;
-    unsigned char* datab;
-
-    gcry_mpi_aprint(GCRYMPI_FMT_USG, &dataa, &sizea, a);
-    totalsize = 1 + 4 + sizea;
-    if (b) {
-	gcry_mpi_aprint(GCRYMPI_FMT_USG, &datab, &sizeb, b);
-	totalsize += 4 + sizeb;
-    } else {
-	sizeb = 0;
-    }
+    gcry_md_hd_t md;
+    gcry_error_t err;
 
-    input = malloc(totalsize);
-    input[0] = (unsigned char)version;
-    input[1] = (unsigned char)((sizea >> 24) & 0xFF);
-    input[2] = (unsigned char)((sizea >> 16) & 0xFF);
-    input[3] = (unsigned char)((sizea >> 8) & 0xFF);
-    input[4] = (unsigned char)(sizea & 0xFF);
-    memmove(input + 5, dataa, sizea);
-    if (b) {
-	input[5 + sizea] = (unsigned char)((sizeb >> 24) & 0xFF);
-	input[6 + sizea] = (unsigned char)((sizeb >> 16) & 0xFF);
-	input[7 + sizea] = (unsigned char)((sizeb >> 8) & 0xFF);
-	input[8 + sizea] = (unsigned char)(sizeb & 0xFF);
-	memmove(input + 9 + sizea, datab, sizeb);
+    if (version > 0 && version <= SM_HASH_MAX_VERSION &&
+	    SM_HASH_PREFIX[version]) {
+	err = gcry_md_copy(&md, SM_HASH_PREFIX[version]);
+    } else {
+	err = gcry_md_open(&md, SM_HASH_ALGORITHM, 0);
+	if (!err) {
+	    unsigned char versionbyte = (unsigned char)version;
+	    gcry_md_write(md, &versionbyte, 1);
+	}
     }
+    if (err) return err;
 
-    gcry_md_hash_buffer(SM_HASH_ALGORITHM, output, input, totalsize);
-    gcry_mpi_scan(hash, GCRYMPI_FMT_USG, output, SM_DIGEST_SIZE, NULL);
-    free(input);
-    input = NULL;
+    hash_mpi(md, a);
+    if (b) hash_mpi(md, b);
 
-    /* free memory */
-    gcry_free(dataa);
-    if (b) gcry_free(datab);
+    gcry_mpi_scan(hash, GCRYMPI_FMT_USG, gcry_md_read(md, SM_HASH_ALGORITHM),
+	    SM_DIGEST_SIZE, NULL);
+    gcry_md_close(md);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
@@ -364,13 +434,46 @@ static gcry_error_t serialize_mpi_array(unsigned char **buffer, int *buflen,
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* Check that the big-endian bytes of a serialized MPI are in the right
+ * range to be what check says: 'g' a (non-unit) group element, 'e' a
+ * (non-zero) exponent, or anything else for no check. */
+static int check_serialized(char check, const unsigned char *data,
+	size_t len)
+{
+    const unsigned char *max;
+    int cmp;
+
+    while (len > 0 && data[0] == 0) {
+	++data;
+	--len;
+    }
+    if (check == 'g') {
+	if (len == 0 || (len == 1 && data[0] < 2)) return 1;
+	max = SM_MODULUS_MINUS_2_BYTES;
+    } else if (check == 'e') {
+	if (len == 0) return 1;
+	max = SM_ORDER_BYTES;
+    } else {
+	return 0;
+    }
+
+    if (len != sizeof(SM_ORDER_BYTES)) {
+	return len > sizeof(SM_ORDER_BYTES);
+    }
+    cmp = memcmp(data, max, len);
+    return check == 'g' ? cmp > 0 : cmp >= 0;
+}
+
 /* Takes a buffer containing serialized and concatenated mpis
  * and converts it to an array of gcry_mpi_t structs.
  * The buffer is assumed to consist of a 4-byte int containing the
  * number of mpis in the array, followed by {size, data} pairs for
- * each mpi.  If malformed, method returns GCRY_ERROR_INV_VALUE */
+ * each mpi.  The checks string gives what each mpi must be, as
+ * check_serialized takes them.  If malformed or out of range, method
+ * returns GCRY_ERROR_INV_VALUE, having allocated nothing. */
 static gcry_error_t unserialize_mpi_array(gcry_mpi_t **mpis,
-	unsigned int expcount, const unsigned char *buffer, const int buflen)
+	unsigned int expcount, const char *checks,
+	const unsigned char *buffer, const int buflen)
 {
     unsigned int i;
     size_t lenp = buflen;
@@ -381,12 +484,19 @@ static gcry_error_t unserialize_mpi_array(gcry_mpi_t **mpis,
     read_int(thecount);
     if (thecount != expcount) goto invval;
 
-    *mpis = malloc(thecount * sizeof(gcry_mpi_t));
-
+    /* Check the whole message before making any MPIs of it */
     for (i=0; i<thecount; i++) {
-	(*mpis)[i] = NULL;
+	size_t mpilen;
+	read_int(mpilen);
+	require_len(mpilen);
+	if (check_serialized(checks[i], bufp, mpilen)) goto invval;
+	bufp += mpilen; lenp -= mpilen;
     }
 
+    bufp = buffer + 4;
+    lenp = buflen - 4;
+    *mpis = malloc(thecount * sizeof(gcry_mpi_t));
+
     for (i=0; i<thecount; i++) {
 	read_mpi((*mpis)[i]);
     }
@@ -394,35 +504,147 @@ static gcry_error_t unserialize_mpi_array(gcry_mpi_t **mpis,
     return gcry_error(GPG_ERR_NO_ERROR);
 
 invval:
-    if (*mpis) {
-	for (i=0; i<thecount; i++) {
-	    gcry_mpi_release((*mpis)[i]);
-	}
-	free(*mpis);
-	*mpis = NULL;
-    }
     return gcry_error(GPG_ERR_INV_VALUE);
 }
 
-/* Check that an MPI is in the right range to be a (non-unit) group
- * element */
-static int check_group_elem(gcry_mpi_t g)
+/* Split a non-negative exponent into 4-bit digits, least significant
+ * first.  Returns the number of digits, or -1 if the exponent is too
+ * big. */
+static int expon_digits(unsigned char digits[SM_EXPON_DIGITS],
+	const gcry_mpi_t e)
+{
+    unsigned char buf[SM_EXPON_DIGITS / 2];
+    size_t len, i;
+
+    if (gcry_mpi_cmp_ui(e, 0) < 0 ||
+	    gcry_mpi_get_nbits(e) > SM_EXPON_DIGITS * 4 ||
+	    gcry_mpi_print(GCRYMPI_FMT_USG, buf, sizeof(buf), &len, e)) {
+	return -1;
+    }
+    for (i = 0; i < len; ++i) {
+	digits[2*i] = buf[len-1-i] & 0x0f;
+	digits[2*i+1] = buf[len-1-i] >> 4;
+    }
+    return 2 * len;
+}
+
+/* Multiply *acc by x mod SM_MODULUS, where *acc is NULL for 1. */
+static void acc_mulm(gcry_mpi_t *acc, const gcry_mpi_t x)
 {
-    if (gcry_mpi_cmp_ui(g, 2) < 0 ||
-	    gcry_mpi_cmp(g, SM_MODULUS_MINUS_2) > 0) {
-	return 1;
+    if (*acc) {
+	gcry_mpi_mulm(*acc, *acc, x, SM_MODULUS);
+    } else {
+	*acc = gcry_mpi_copy(x);
     }
-    return 0;
 }
 
-/* Check that an MPI is in the right range to be a (non-zero) exponent */
-static int check_expon(gcry_mpi_t x)
+/* Multiply *acc by SM_GENERATOR raised to the exponent with the given
+ * digits, using the precomputed SM_GENERATOR_POWERS.  This takes one
+ * multiplication per non-zero digit, plus 30. */
+static void generator_powm(gcry_mpi_t *acc, const unsigned char *digits,
+	int ndigits)
 {
-    if (gcry_mpi_cmp_ui(x, 1) < 0 ||
-	    gcry_mpi_cmp(x, SM_ORDER) >= 0) {
-	return 1;
+    gcry_mpi_t a = NULL, b = NULL;
+    int i, j;
+
+    /* With e = sum e_i 16^i and G_i = g^(16^i), g^e is the product
+     * over j of (the product of the G_i with e_i >= j), and b runs
+     * through those inner products from j = 15 down. */
+    for (j = 15; j > 0; --j) {
+	for (i = 0; i < ndigits; ++i) {
+	    if (digits[i] == j) {
+		acc_mulm(&b, SM_GENERATOR_POWERS[i]);
+	    }
+	}
+	if (b) {
+	    acc_mulm(&a, b);
+	}
+    }
+    if (a) {
+	acc_mulm(acc, a);
     }
-    return 0;
+    gcry_mpi_release(a);
+    gcry_mpi_release(b);
+}
+
+/* Set res to the product of bases[i]^expons[i] mod SM_MODULUS, for i
+ * from 0 to nbases-1 (at most SM_POWM_MAX_BASES).  A base equal to
+ * SM_GENERATOR uses the precomputed table; the rest share their
+ * squarings, four bits of each exponent at a time.  How long this
+ * takes depends on the exponents, so they must be public: use it to
+ * check the proofs we are sent, never to make our own. */
+static void otrl_sm_powm_public(gcry_mpi_t res, int nbases,
+	const gcry_mpi_t *bases, const gcry_mpi_t *expons)
+{
+    unsigned char digits[SM_POWM_MAX_BASES][SM_EXPON_DIGITS];
+    int ndigits[SM_POWM_MAX_BASES];
+    gcry_mpi_t table[SM_POWM_MAX_BASES][16];
+    int fixed[SM_POWM_MAX_BASES];
+    gcry_mpi_t acc = NULL, gen = NULL;
+    int i, j, top = 0;
+
+    otrl_stats_add(otrl_stats_modexps, nbases);
+    for (i = 0; i < nbases; ++i) {
+	ndigits[i] = expon_digits(digits[i], expons[i]);
+	if (ndigits[i] < 0) break;
+    }
+    if (i < nbases) {
+	/* Something we don't have the tables for; do it the slow way */
+	gcry_mpi_t temp = gcry_mpi_new(SM_MOD_LEN_BITS);
+	gcry_mpi_set_ui(res, 1);
+	for (i = 0; i < nbases; ++i) {
+	    gcry_mpi_powm(temp, bases[i], expons[i], SM_MODULUS);
+	    gcry_mpi_mulm(res, res, temp, SM_MODULUS);
+	}
+	gcry_mpi_release(temp);
+	return;
+    }
+
+    for (i = 0; i < nbases; ++i) {
+	fixed[i] = SM_GENERATOR_POWERS[0] &&
+	    gcry_mpi_cmp(bases[i], SM_GENERATOR) == 0;
+	if (fixed[i]) {
+	    generator_powm(&gen, digits[i], ndigits[i]);
+	    continue;
+	}
+	table[i][1] = gcry_mpi_copy(bases[i]);
+	for (j = 2; j < 16; ++j) {
+	    table[i][j] = gcry_mpi_new(SM_MOD_LEN_BITS);
+	    gcry_mpi_mulm(table[i][j], table[i][j-1], bases[i], SM_MODULUS);
+	}
+	if (ndigits[i] > top) top = ndigits[i];
+    }
+
+    while (top-- > 0) {
+	if (acc) {
+	    for (j = 0; j < 4; ++j) {
+		gcry_mpi_mulm(acc, acc, acc, SM_MODULUS);
+	    }
+	}
+	for (i = 0; i < nbases; ++i) {
+	    if (!fixed[i] && top < ndigits[i] && digits[i][top]) {
+		acc_mulm(&acc, table[i][digits[i][top]]);
+	    }
+	}
+    }
+
+    if (gen) {
+	acc_mulm(&acc, gen);
+    }
+    if (acc) {
+	gcry_mpi_set(res, acc);
+    } else {
+	gcry_mpi_set_ui(res, 1);
+    }
+
+    for (i = 0; i < nbases; ++i) {
+	if (fixed[i]) continue;
+	for (j = 1; j < 16; ++j) {
+	    gcry_mpi_release(table[i][j]);
+	}
+    }
+    gcry_mpi_release(acc);
+    gcry_mpi_release(gen);
 }
 
 /*
@@ -433,7 +655,7 @@ static gcry_error_t otrl_sm_proof_know_log(gcry_mpi_t *c, gcry_mpi_t *d,
 {
     gcry_mpi_t r = randomExponent();
     gcry_mpi_t temp = gcry_mpi_snew(SM_MOD_LEN_BITS);
-    gcry_mpi_powm(temp, g, r, SM_MODULUS);
+    otrl_powm(temp, g, r, SM_MODULUS);
     otrl_sm_hash(c, version, temp, NULL);
     gcry_mpi_mulm(temp, x, *c, SM_ORDER);
     gcry_mpi_subm(*d, r, temp, SM_ORDER);
@@ -452,19 +674,16 @@ static int otrl_sm_check_know_log(const gcry_mpi_t c, const gcry_mpi_t d,
 {
     int comp;
 
-    gcry_mpi_t gd = gcry_mpi_new(SM_MOD_LEN_BITS);  /* g^d */
-    gcry_mpi_t xc = gcry_mpi_new(SM_MOD_LEN_BITS);  /* x^c */
     gcry_mpi_t gdxc = gcry_mpi_new(SM_MOD_LEN_BITS);   /* (g^d x^c) */
     gcry_mpi_t hgdxc = NULL;   /* h(g^d x^c) */
+    gcry_mpi_t bases[2], expons[2];
 
-    gcry_mpi_powm(gd, g, d, SM_MODULUS);
-    gcry_mpi_powm(xc, x, c, SM_MODULUS);
-    gcry_mpi_mulm(gdxc, gd, xc, SM_MODULUS);
+    bases[0] = g;  expons[0] = d;
+    bases[1] = x;  expons[1] = c;
+    otrl_sm_powm_public(gdxc, 2, bases, expons);
     otrl_sm_hash(&hgdxc, version, gdxc, NULL);
 
     comp = gcry_mpi_cmp(hgdxc, c);
-    gcry_mpi_release(gd);
-    gcry_mpi_release(xc);
     gcry_mpi_release(gdxc);
     gcry_mpi_release(hgdxc);
 
@@ -484,10 +703,10 @@ static gcry_error_t otrl_sm_proof_equal_coords(gcry_mpi_t *c, gcry_mpi_t *d1,
     gcry_mpi_t temp2 = gcry_mpi_new(SM_MOD_LEN_BITS);
 
     /* Compute the value of c, as c = h(g3^r1, g1^r1 g2^r2) */
-    gcry_mpi_powm(temp1, state->g1, r1, SM_MODULUS);
-    gcry_mpi_powm(temp2, state->g2, r2, SM_MODULUS);
+    otrl_powm(temp1, state->g1, r1, SM_MODULUS);
+    otrl_powm(temp2, state->g2, r2, SM_MODULUS);
     gcry_mpi_mulm(temp2, temp1, temp2, SM_MODULUS);
-    gcry_mpi_powm(temp1, state->g3, r1, SM_MODULUS);
+    otrl_powm(temp1, state->g3, r1, SM_MODULUS);
     otrl_sm_hash(c, version, temp1, temp2);
 
     /* Compute the d values, as d1 = r1 - r c, d2 = r2 - secret c */
@@ -516,8 +735,8 @@ static gcry_error_t otrl_sm_check_equal_coords(const gcry_mpi_t c,
 
     gcry_mpi_t temp1 = gcry_mpi_new(SM_MOD_LEN_BITS);
     gcry_mpi_t temp2 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_t temp3 = gcry_mpi_new(SM_MOD_LEN_BITS);
     gcry_mpi_t cprime = NULL;
+    gcry_mpi_t bases[3], expons[3];
 
     /* To verify, we test that hash(g3^d1 * p^c, g1^d1 * g2^d2 * q^c) = c
      * If indeed c = hash(g3^r1, g1^r1 g2^r2), d1 = r1 - r*c,
@@ -529,22 +748,20 @@ static gcry_error_t otrl_sm_check_equal_coords(const gcry_mpi_t c,
      * = hash(g3^r1, g1^r1 g2^r2)
      * = c
      */
-    gcry_mpi_powm(temp2, state->g3, d1, SM_MODULUS);
-    gcry_mpi_powm(temp3, p, c, SM_MODULUS);
-    gcry_mpi_mulm(temp1, temp2, temp3, SM_MODULUS);
+    bases[0] = state->g3;  expons[0] = d1;
+    bases[1] = p;          expons[1] = c;
+    otrl_sm_powm_public(temp1, 2, bases, expons);
 
-    gcry_mpi_powm(temp2, state->g1, d1, SM_MODULUS);
-    gcry_mpi_powm(temp3, state->g2, d2, SM_MODULUS);
-    gcry_mpi_mulm(temp2, temp2, temp3, SM_MODULUS);
-    gcry_mpi_powm(temp3, q, c, SM_MODULUS);
-    gcry_mpi_mulm(temp2, temp3, temp2, SM_MODULUS);
+    bases[0] = state->g1;  expons[0] = d1;
+    bases[1] = state->g2;  expons[1] = d2;
+    bases[2] = q;          expons[2] = c;
+    otrl_sm_powm_public(temp2, 3, bases, expons);
 
     otrl_sm_hash(&cprime, version, temp1, temp2);
 
     comp = gcry_mpi_cmp(c, cprime);
     gcry_mpi_release(temp1);
     gcry_mpi_release(temp2);
-    gcry_mpi_release(temp3);
     gcry_mpi_release(cprime);
 
     return comp;
@@ -561,8 +778,8 @@ static gcry_error_t otrl_sm_proof_equal_logs(gcry_mpi_t *c, gcry_mpi_t *d,
     gcry_mpi_t temp2 = gcry_mpi_new(SM_MOD_LEN_BITS);
 
     /* Compute the value of c, as c = h(g1^r, (Qa/Qb)^r) */
-    gcry_mpi_powm(temp1, state->g1, r, SM_MODULUS);
-    gcry_mpi_powm(temp2, state->qab, r, SM_MODULUS);
+    otrl_powm(temp1, state->g1, r, SM_MODULUS);
+    otrl_powm(temp2, state->qab, r, SM_MODULUS);
     otrl_sm_hash(c, version, temp1, temp2);
 
     /* Compute the d values, as d = r - x3 c */
@@ -587,8 +804,8 @@ static gcry_error_t otrl_sm_check_equal_logs(const gcry_mpi_t c,
 
     gcry_mpi_t temp1 = gcry_mpi_new(SM_MOD_LEN_BITS);
     gcry_mpi_t temp2 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_t temp3 = gcry_mpi_new(SM_MOD_LEN_BITS);
     gcry_mpi_t cprime = NULL;
+    gcry_mpi_t bases[2], expons[2];
 
     /* Here, we recall the exponents used to create g3.
      * If we have previously seen g3o = g1^x where x is unknown
@@ -603,20 +820,19 @@ static gcry_error_t otrl_sm_check_equal_logs(const gcry_mpi_t c,
      * = hash(g1^r1, qab^r1)
      * = c
      */
-    gcry_mpi_powm(temp2, state->g1, d, SM_MODULUS);
-    gcry_mpi_powm(temp3, state->g3o, c, SM_MODULUS);
-    gcry_mpi_mulm(temp1, temp2, temp3, SM_MODULUS);
+    bases[0] = state->g1;   expons[0] = d;
+    bases[1] = state->g3o;  expons[1] = c;
+    otrl_sm_powm_public(temp1, 2, bases, expons);
 
-    gcry_mpi_powm(temp3, state->qab, d, SM_MODULUS);
-    gcry_mpi_powm(temp2, r, c, SM_MODULUS);
-    gcry_mpi_mulm(temp2, temp3, temp2, SM_MODULUS);
+    bases[0] = state->qab;  expons[0] = d;
+    bases[1] = r;           expons[1] = c;
+    otrl_sm_powm_public(temp2, 2, bases, expons);
 
     otrl_sm_hash(&cprime, version, temp1, temp2);
 
     comp = gcry_mpi_cmp(c, cprime);
     gcry_mpi_release(temp1);
     gcry_mpi_release(temp2);
-    gcry_mpi_release(temp3);
     gcry_mpi_release(cprime);
 
     return comp;
@@ -654,10 +870,10 @@ gcry_error_t otrl_sm_step1(OtrlSMAliceState *astate,
     astate->x2 = randomExponent();
     astate->x3 = randomExponent();
 
-    gcry_mpi_powm(msg1[0], astate->g1, astate->x2, SM_MODULUS);
+    otrl_powm(msg1[0], astate->g1, astate->x2, SM_MODULUS);
     otrl_sm_proof_know_log(&(msg1[1]), &(msg1[2]), astate->g1, astate->x2, 1);
 
-    gcry_mpi_powm(msg1[3], astate->g1, astate->x3, SM_MODULUS);
+    otrl_powm(msg1[3], astate->g1, astate->x3, SM_MODULUS);
     otrl_sm_proof_know_log(&(msg1[4]), &(msg1[5]), astate->g1, astate->x3, 2);
 
     serialize_mpi_array(output, outputlen, SM_MSG1_LEN, msg1);
@@ -683,16 +899,11 @@ gcry_error_t otrl_sm_step2a(OtrlSMBobState *bstate, const unsigned char* input,
     bstate->sm_prog_state = OTRL_SMP_PROG_CHEATED;
 
     /* Read from input to find the mpis */
-    err = unserialize_mpi_array(&msg1, SM_MSG1_LEN, input, inputlen);
+    err = unserialize_mpi_array(&msg1, SM_MSG1_LEN, SM_MSG1_CHECKS,
+	    input, inputlen);
 
     if (err != gcry_error(GPG_ERR_NO_ERROR)) return err;
 
-    if (check_group_elem(msg1[0]) || check_expon(msg1[2]) ||
-	    check_group_elem(msg1[3]) || check_expon(msg1[5])) {
-	otrl_sm_msg_free(&msg1, SM_MSG1_LEN);
-	return gcry_error(GPG_ERR_INV_VALUE);
-    }
-
     /* Store Alice's g3a value for later in the protocol */
     gcry_mpi_set(bstate->g3o, msg1[3]);
 
@@ -708,8 +919,8 @@ gcry_error_t otrl_sm_step2a(OtrlSMBobState *bstate, const unsigned char* input,
     bstate->x3 = randomExponent();
 
     /* Combine the two halves from Bob and Alice and determine g2 and g3 */
-    gcry_mpi_powm(bstate->g2, msg1[0], bstate->x2, SM_MODULUS);
-    gcry_mpi_powm(bstate->g3, msg1[3], bstate->x3, SM_MODULUS);
+    otrl_powm(bstate->g2, msg1[0], bstate->x2, SM_MODULUS);
+    otrl_powm(bstate->g3, msg1[3], bstate->x3, SM_MODULUS);
 
     bstate->sm_prog_state = OTRL_SMP_PROG_OK;
 
@@ -744,20 +955,20 @@ gcry_error_t otrl_sm_step2b(OtrlSMBobState *bstate, const unsigned char* secret,
 
     otrl_sm_msg2_init(&msg2);
 
-    gcry_mpi_powm(msg2[0], bstate->g1, bstate->x2, SM_MODULUS);
+    otrl_powm(msg2[0], bstate->g1, bstate->x2, SM_MODULUS);
     otrl_sm_proof_know_log(&(msg2[1]), &(msg2[2]), bstate->g1, bstate->x2, 3);
 
-    gcry_mpi_powm(msg2[3], bstate->g1, bstate->x3, SM_MODULUS);
+    otrl_powm(msg2[3], bstate->g1, bstate->x3, SM_MODULUS);
     otrl_sm_proof_know_log(&(msg2[4]), &(msg2[5]), bstate->g1, bstate->x3, 4);
 
     /* Calculate P and Q values for Bob */
     r = randomExponent();
     qb1 = gcry_mpi_new(SM_MOD_LEN_BITS);
     qb2 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_powm(bstate->p, bstate->g3, r, SM_MODULUS);
+    otrl_powm(bstate->p, bstate->g3, r, SM_MODULUS);
     gcry_mpi_set(msg2[6], bstate->p);
-    gcry_mpi_powm(qb1, bstate->g1, r, SM_MODULUS);
-    gcry_mpi_powm(qb2, bstate->g2, bstate->secret, SM_MODULUS);
+    otrl_powm(qb1, bstate->g1, r, SM_MODULUS);
+    otrl_powm(qb2, bstate->g2, bstate->secret, SM_MODULUS);
     gcry_mpi_mulm(bstate->q, qb1, qb2, SM_MODULUS);
     gcry_mpi_set(msg2[7], bstate->q);
 
@@ -796,17 +1007,10 @@ gcry_error_t otrl_sm_step3(OtrlSMAliceState *astate, const unsigned char* input,
     *outputlen = 0;
     astate->sm_prog_state = OTRL_SMP_PROG_CHEATED;
 
-    err = unserialize_mpi_array(&msg2, SM_MSG2_LEN, input, inputlen);
+    err = unserialize_mpi_array(&msg2, SM_MSG2_LEN, SM_MSG2_CHECKS,
+	    input, inputlen);
     if (err != gcry_error(GPG_ERR_NO_ERROR)) return err;
 
-    if (check_group_elem(msg2[0]) || check_group_elem(msg2[3]) ||
-	    check_group_elem(msg2[6]) || check_group_elem(msg2[7]) ||
-	    check_expon(msg2[2]) || check_expon(msg2[5]) ||
-	    check_expon(msg2[9]) || check_expon(msg2[10])) {
-	otrl_sm_msg_free(&msg2, SM_MSG2_LEN);
-	return gcry_error(GPG_ERR_INV_VALUE);
-    }
-
     otrl_sm_msg3_init(&msg3);
 
     /* Store Bob's g3a value for later in the protocol */
@@ -821,8 +1025,8 @@ gcry_error_t otrl_sm_step3(OtrlSMAliceState *astate, const unsigned char* input,
     }
 
     /* Combine the two halves from Bob and Alice and determine g2 and g3 */
-    gcry_mpi_powm(astate->g2, msg2[0], astate->x2, SM_MODULUS);
-    gcry_mpi_powm(astate->g3, msg2[3], astate->x3, SM_MODULUS);
+    otrl_powm(astate->g2, msg2[0], astate->x2, SM_MODULUS);
+    otrl_powm(astate->g3, msg2[3], astate->x3, SM_MODULUS);
 
     /* Verify Bob's coordinate equality proof */
     if (otrl_sm_check_equal_coords(msg2[8], msg2[9], msg2[10], msg2[6], msg2[7],
@@ -836,10 +1040,10 @@ gcry_error_t otrl_sm_step3(OtrlSMAliceState *astate, const unsigned char* input,
     r = randomExponent();
     qa1 = gcry_mpi_new(SM_MOD_LEN_BITS);
     qa2 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_powm(astate->p, astate->g3, r, SM_MODULUS);
+    otrl_powm(astate->p, astate->g3, r, SM_MODULUS);
     gcry_mpi_set(msg3[0], astate->p);
-    gcry_mpi_powm(qa1, astate->g1, r, SM_MODULUS);
-    gcry_mpi_powm(qa2, astate->g2, astate->secret, SM_MODULUS);
+    otrl_powm(qa1, astate->g1, r, SM_MODULUS);
+    otrl_powm(qa2, astate->g2, astate->secret, SM_MODULUS);
     gcry_mpi_mulm(astate->q, qa1, qa2, SM_MODULUS);
     gcry_mpi_set(msg3[1], astate->q);
 
@@ -852,7 +1056,7 @@ gcry_error_t otrl_sm_step3(OtrlSMAliceState *astate, const unsigned char* input,
     gcry_mpi_mulm(astate->pab, astate->p, inv, SM_MODULUS);
     gcry_mpi_invm(inv, msg2[7], SM_MODULUS);
     gcry_mpi_mulm(astate->qab, astate->q, inv, SM_MODULUS);
-    gcry_mpi_powm(msg3[5], astate->qab, astate->x3, SM_MODULUS);
+    otrl_powm(msg3[5], astate->qab, astate->x3, SM_MODULUS);
     otrl_sm_proof_equal_logs(&(msg3[6]), &(msg3[7]), astate, 7);
 
     serialize_mpi_array(output, outputlen, SM_MSG3_LEN, msg3);
@@ -885,7 +1089,8 @@ gcry_error_t otrl_sm_step4(OtrlSMBobState *bstate, const unsigned char* input,
     gcry_mpi_t *msg3;
     gcry_mpi_t *msg4;
     gcry_error_t err;
-    err = unserialize_mpi_array(&msg3, SM_MSG3_LEN, input, inputlen);
+    err = unserialize_mpi_array(&msg3, SM_MSG3_LEN, SM_MSG3_CHECKS,
+	    input, inputlen);
 
     *output = NULL;
     *outputlen = 0;
@@ -895,14 +1100,6 @@ gcry_error_t otrl_sm_step4(OtrlSMBobState *bstate, const unsigned char* input,
 
     otrl_sm_msg4_init(&msg4);
 
-    if (check_group_elem(msg3[0]) || check_group_elem(msg3[1]) ||
-	    check_group_elem(msg3[5]) || check_expon(msg3[3]) ||
-	    check_expon(msg3[4]) || check_expon(msg3[7]))  {
-	otrl_sm_msg_free(&msg3, SM_MSG3_LEN);
-	otrl_sm_msg_free(&msg4, SM_MSG4_LEN);
-	return gcry_error(GPG_ERR_INV_VALUE);
-    }
-
     /* Verify Alice's coordinate equality proof */
     if (otrl_sm_check_equal_coords(msg3[2], msg3[3], msg3[4], msg3[0], msg3[1],
 	    bstate, 6)) {
@@ -927,14 +1124,14 @@ gcry_error_t otrl_sm_step4(OtrlSMBobState *bstate, const unsigned char* input,
     }
 
     /* Calculate Rb and proof */
-    gcry_mpi_powm(msg4[0], bstate->qab, bstate->x3, SM_MODULUS);
+    otrl_powm(msg4[0], bstate->qab, bstate->x3, SM_MODULUS);
     otrl_sm_proof_equal_logs(&(msg4[1]), &(msg4[2]), bstate, 8);
 
     serialize_mpi_array(output, outputlen, SM_MSG4_LEN, msg4);
 
     /* Calculate Rab and verify that secrets match */
     rab = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_powm(rab, msg3[5], bstate->x3, SM_MODULUS);
+    otrl_powm(rab, msg3[5], bstate->x3, SM_MODULUS);
     comp = gcry_mpi_cmp(rab, bstate->pab);
 
     /* Clean up everything allocated in this step */
@@ -964,16 +1161,12 @@ gcry_error_t otrl_sm_step5(OtrlSMAliceState *astate, const unsigned char* input,
     gcry_mpi_t rab;
     gcry_mpi_t *msg4;
     gcry_error_t err;
-    err = unserialize_mpi_array(&msg4, SM_MSG4_LEN, input, inputlen);
+    err = unserialize_mpi_array(&msg4, SM_MSG4_LEN, SM_MSG4_CHECKS,
+	    input, inputlen);
     astate->sm_prog_state = OTRL_SMP_PROG_CHEATED;
 
     if (err != gcry_error(GPG_ERR_NO_ERROR)) return err;
 
-    if (check_group_elem(msg4[0]) || check_expon(msg4[2])) {
-	otrl_sm_msg_free(&msg4, SM_MSG4_LEN);
-	return gcry_error(GPG_ERR_INV_VALUE);
-    }
-
     /* Verify Bob's log equality proof */
     if (otrl_sm_check_equal_logs(msg4[1], msg4[2], msg4[0], astate, 8)) {
 	otrl_sm_msg_free(&msg4, SM_MSG4_LEN);
@@ -982,7 +1175,7 @@ gcry_error_t otrl_sm_step5(OtrlSMAliceState *astate, const unsigned char* input,
 
     /* Calculate Rab and verify that secrets match */
     rab = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_powm(rab, msg4[0], astate->x3, SM_MODULUS);
+    otrl_powm(rab, msg4[0], astate->x3, SM_MODULUS);
 
     comp = gcry_mpi_cmp(rab, astate->pab);
     gcry_mpi_release(rab);
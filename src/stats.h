@@ -0,0 +1,57 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Chris Alexander, Willy Lew,
+ *  			     Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The counters behind otrl_userstate_stats.  This header is internal
+ * to the library, and isn't installed. */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <gcrypt.h>
+
+/* Counters are only ever read as a snapshot, so they're updated with
+ * relaxed atomics, which cost no more than a plain add.  Without
+ * those, the odd update from racing threads may be lost. */
+#ifdef HAVE_ATOMIC_BUILTINS
+#define otrl_stats_add(counter, n) \
+    ((void)__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED))
+#define otrl_stats_sub(counter, n) \
+    ((void)__atomic_fetch_sub(&(counter), (n), __ATOMIC_RELAXED))
+#define otrl_stats_get(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define otrl_stats_add(counter, n) ((void)((counter) += (n)))
+#define otrl_stats_sub(counter, n) ((void)((counter) -= (n)))
+#define otrl_stats_get(counter) (counter)
+#endif
+
+/* Add n to a counter of the userstate us, if there is one */
+#define otrl_stats_us_add(us, field, n) \
+    do { if (us) otrl_stats_add((us)->stats.field, (n)); } while (0)
+
+/* The counters that are kept for the whole process, since nothing
+ * about the work they count belongs to any one userstate */
+extern unsigned long otrl_stats_dh_keygens;
+extern unsigned long otrl_stats_modexps;
+
+/* gcry_mpi_powm, counted */
+#define otrl_powm(w, b, e, m) \
+    (otrl_stats_add(otrl_stats_modexps, 1), gcry_mpi_powm((w), (b), (e), (m)))
+
+#endif
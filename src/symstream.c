@@ -0,0 +1,285 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <string.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "mem.h"
+#include "symstream.h"
+
+/* A stream's header is:
+ *
+ *    4 bytes   SYMSTREAM_MAGIC
+ *    1 byte    SYMSTREAM_FORMAT
+ *    4 bytes   the chunk size, big-endian
+ *   16 bytes   a nonce, new for every stream
+ *
+ * The stream's AES-256-CTR and HMAC-SHA256 keys are the SHA-256 hashes
+ * of the byte 0x01 or 0x02 followed by the header, the extra symmetric
+ * key and the use-specific data.  Chunk i (counting from 0) is
+ * encrypted starting at the counter block made of i as 8 bytes,
+ * big-endian, and 8 zero bytes, and its tag is the HMAC of the header,
+ * i as 8 bytes, the byte 1 if it's the last chunk or 0 if not, and the
+ * encrypted chunk. */
+
+#define SYMSTREAM_MAGIC "OTRX"
+#define SYMSTREAM_FORMAT 1
+
+/* Work out one of the stream's keys. */
+static gcry_error_t symstream_key(unsigned char which,
+	const unsigned char header[OTRL_SYMSTREAM_HEADER_BYTES],
+	const unsigned char symkey[OTRL_EXTRAKEY_BYTES],
+	const unsigned char *usedata, size_t usedatalen, unsigned char key[32])
+{
+    gcry_md_hd_t md;
+    gcry_error_t err;
+
+    err = gcry_md_open(&md, GCRY_MD_SHA256, GCRY_MD_FLAG_SECURE);
+    if (err) return err;
+    gcry_md_putc(md, which);
+    gcry_md_write(md, header, OTRL_SYMSTREAM_HEADER_BYTES);
+    gcry_md_write(md, symkey, OTRL_EXTRAKEY_BYTES);
+    if (usedatalen > 0) gcry_md_write(md, usedata, usedatalen);
+    memmove(key, gcry_md_read(md, GCRY_MD_SHA256), 32);
+    gcry_md_close(md);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Set up the ciphers of a stream whose header and chunk size are
+ * already in place. */
+static gcry_error_t symstream_start(OtrlSymStream *stream,
+	const unsigned char symkey[OTRL_EXTRAKEY_BYTES],
+	const unsigned char *usedata, size_t usedatalen)
+{
+    unsigned char enckey[32], mackey[32];
+    gcry_error_t err;
+
+    stream->cipher = NULL;
+    stream->mac = NULL;
+    stream->next = 0;
+    stream->finished = 0;
+
+    err = symstream_key(0x01, stream->header, symkey, usedata, usedatalen,
+	    enckey);
+    if (!err) {
+	err = symstream_key(0x02, stream->header, symkey, usedata,
+		usedatalen, mackey);
+    }
+    if (!err) {
+	err = gcry_cipher_open(&(stream->cipher), GCRY_CIPHER_AES256,
+		GCRY_CIPHER_MODE_CTR, GCRY_CIPHER_SECURE);
+    }
+    if (!err) err = gcry_cipher_setkey(stream->cipher, enckey, 32);
+    if (!err) {
+	err = gcry_md_open(&(stream->mac), GCRY_MD_SHA256,
+		GCRY_MD_FLAG_HMAC | GCRY_MD_FLAG_SECURE);
+    }
+    if (!err) err = gcry_md_setkey(stream->mac, mackey, 32);
+    otrl_mem_wipe(enckey, sizeof(enckey));
+    otrl_mem_wipe(mackey, sizeof(mackey));
+
+    if (err) otrl_symstream_free(stream);
+    return err;
+}
+
+/* Start encrypting a stream of chunks of chunklen bytes (at most
+ * OTRL_SYMSTREAM_MAX_CHUNK) with the extra symmetric key symkey, and
+ * put the header to send ahead of them in header.  usedata is the
+ * use-specific data that was sent along with the key by
+ * otrl_message_symkey, which the stream's keys are bound to; it may be
+ * NULL if usedatalen is 0.  Every symkey gives a new key for every
+ * stream. */
+gcry_error_t otrl_symstream_encrypt_init(OtrlSymStream *stream,
+	const unsigned char symkey[OTRL_EXTRAKEY_BYTES],
+	const unsigned char *usedata, size_t usedatalen, size_t chunklen,
+	unsigned char header[OTRL_SYMSTREAM_HEADER_BYTES])
+{
+    gcry_error_t err;
+
+    if (chunklen == 0 || chunklen > OTRL_SYMSTREAM_MAX_CHUNK) {
+	return gcry_error(GPG_ERR_INV_LENGTH);
+    }
+
+    memmove(stream->header, SYMSTREAM_MAGIC, 4);
+    stream->header[4] = SYMSTREAM_FORMAT;
+    stream->header[5] = (chunklen >> 24) & 0xff;
+    stream->header[6] = (chunklen >> 16) & 0xff;
+    stream->header[7] = (chunklen >> 8) & 0xff;
+    stream->header[8] = chunklen & 0xff;
+    gcry_create_nonce(stream->header + 9, 16);
+    stream->chunklen = chunklen;
+
+    err = symstream_start(stream, symkey, usedata, usedatalen);
+    if (!err) memmove(header, stream->header, OTRL_SYMSTREAM_HEADER_BYTES);
+    return err;
+}
+
+/* Start decrypting the stream that begins with header, with the extra
+ * symmetric key symkey and the use-specific data usedata, as they were
+ * passed to the received_symkey callback.  Return GPG_ERR_INV_VALUE if
+ * header isn't the header of a symmetric stream. */
+gcry_error_t otrl_symstream_decrypt_init(OtrlSymStream *stream,
+	const unsigned char symkey[OTRL_EXTRAKEY_BYTES],
+	const unsigned char *usedata, size_t usedatalen,
+	const unsigned char header[OTRL_SYMSTREAM_HEADER_BYTES])
+{
+    size_t chunklen;
+
+    stream->cipher = NULL;
+    stream->mac = NULL;
+
+    chunklen = ((size_t)header[5] << 24) | ((size_t)header[6] << 16) |
+	((size_t)header[7] << 8) | header[8];
+    if (memcmp(header, SYMSTREAM_MAGIC, 4) ||
+	    header[4] != SYMSTREAM_FORMAT || chunklen == 0 ||
+	    chunklen > OTRL_SYMSTREAM_MAX_CHUNK) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    memmove(stream->header, header, OTRL_SYMSTREAM_HEADER_BYTES);
+    stream->chunklen = chunklen;
+    return symstream_start(stream, symkey, usedata, usedatalen);
+}
+
+/* Check that a chunk of len bytes may come next in the stream. */
+static gcry_error_t symstream_check(const OtrlSymStream *stream,
+	size_t len, int last)
+{
+    if (stream->finished || stream->cipher == NULL) {
+	return gcry_error(GPG_ERR_CONFLICT);
+    }
+    if (last ? len > stream->chunklen : len != stream->chunklen) {
+	return gcry_error(GPG_ERR_INV_LENGTH);
+    }
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Write i as 8 bytes, big-endian. */
+static void symstream_index(unsigned char buf[8], unsigned long long i)
+{
+    int j;
+
+    for (j = 7; j >= 0; --j) {
+	buf[j] = i & 0xff;
+	i >>= 8;
+    }
+}
+
+/* Put the tag of the next chunk, the len encrypted bytes at buf, into
+ * tag. */
+static void symstream_tag(OtrlSymStream *stream, const unsigned char *buf,
+	size_t len, int last, unsigned char tag[OTRL_SYMSTREAM_TAG_BYTES])
+{
+    unsigned char idx[8];
+
+    symstream_index(idx, stream->next);
+    gcry_md_reset(stream->mac);
+    gcry_md_write(stream->mac, stream->header, OTRL_SYMSTREAM_HEADER_BYTES);
+    gcry_md_write(stream->mac, idx, 8);
+    gcry_md_putc(stream->mac, last ? 1 : 0);
+    gcry_md_write(stream->mac, buf, len);
+    memmove(tag, gcry_md_read(stream->mac, GCRY_MD_SHA256),
+	    OTRL_SYMSTREAM_TAG_BYTES);
+}
+
+/* Encrypt or decrypt the next chunk, the len bytes at buf, in place. */
+static gcry_error_t symstream_crypt(OtrlSymStream *stream,
+	unsigned char *buf, size_t len)
+{
+    unsigned char ctr[16];
+    gcry_error_t err;
+
+    memset(ctr, 0, 16);
+    symstream_index(ctr, stream->next);
+    err = gcry_cipher_setctr(stream->cipher, ctr, 16);
+    if (!err && len > 0) {
+	err = gcry_cipher_encrypt(stream->cipher, buf, len, NULL, 0);
+    }
+    return err;
+}
+
+/* Encrypt the next chunk of the stream, the len bytes at buf, in place,
+ * and put its tag in tag.  len must be the stream's chunk size, unless
+ * last is set to say this is the last chunk, which may be shorter
+ * (even empty).  Return GPG_ERR_INV_LENGTH if the chunk is the wrong
+ * size, and GPG_ERR_CONFLICT if the stream is already finished. */
+gcry_error_t otrl_symstream_encrypt(OtrlSymStream *stream,
+	unsigned char *buf, size_t len, int last,
+	unsigned char tag[OTRL_SYMSTREAM_TAG_BYTES])
+{
+    gcry_error_t err = symstream_check(stream, len, last);
+
+    if (!err) err = symstream_crypt(stream, buf, len);
+    if (err) return err;
+
+    symstream_tag(stream, buf, len, last, tag);
+    stream->next++;
+    stream->finished = last;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Check the tag of the next chunk of the stream, the len bytes at buf,
+ * and if it's right, decrypt the chunk in place.  last must be set for
+ * the last chunk, and only for it.  Return GPG_ERR_BAD_SIGNATURE,
+ * leaving buf untouched, if the chunk or its tag has been altered, or
+ * isn't the next chunk, or its being the last one or not doesn't match
+ * last; GPG_ERR_INV_LENGTH if it's the wrong size; and
+ * GPG_ERR_CONFLICT if the stream is already finished.  A chunk that's
+ * been turned down may be tried again. */
+gcry_error_t otrl_symstream_decrypt(OtrlSymStream *stream,
+	unsigned char *buf, size_t len, int last,
+	const unsigned char tag[OTRL_SYMSTREAM_TAG_BYTES])
+{
+    unsigned char ourtag[OTRL_SYMSTREAM_TAG_BYTES];
+    gcry_error_t err = symstream_check(stream, len, last);
+
+    if (err) return err;
+
+    /* Only decrypt what's known to be genuine */
+    symstream_tag(stream, buf, len, last, ourtag);
+    if (otrl_mem_differ(ourtag, tag, OTRL_SYMSTREAM_TAG_BYTES)) {
+	return gcry_error(GPG_ERR_BAD_SIGNATURE);
+    }
+
+    err = symstream_crypt(stream, buf, len);
+    if (err) return err;
+    stream->next++;
+    stream->finished = last;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Free the keys of the given stream, finished or not. */
+void otrl_symstream_free(OtrlSymStream *stream)
+{
+    if (stream->cipher) gcry_cipher_close(stream->cipher);
+    if (stream->mac) gcry_md_close(stream->mac);
+    stream->cipher = NULL;
+    stream->mac = NULL;
+    stream->finished = 1;
+}
@@ -0,0 +1,105 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2014  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SYMSTREAM_H__
+#define __SYMSTREAM_H__
+
+#include <gcrypt.h>
+
+#include "dh.h"
+
+/* A symmetric stream encrypts and authenticates a large amount of
+ * data, such as a file being transferred, with the extra symmetric key
+ * that otrl_message_symkey gives the sender and the received_symkey
+ * callback gives the receiver.  The data is cut into chunks of a fixed
+ * size chosen by the sender (only the last may be shorter), each
+ * encrypted in place and given a tag of its own, so neither side ever
+ * needs a copy of the data or to hold more than one chunk of it.
+ *
+ * The sender starts a stream with otrl_symstream_encrypt_init, which
+ * gives it a header to send first, and the receiver starts its own
+ * from that header with otrl_symstream_decrypt_init.  The chunks must
+ * then be handled in order, and the last one marked as such at both
+ * ends, so that chunks can be neither reordered, replayed nor cut off
+ * the end unnoticed.  A stream is finished once its last chunk has
+ * been handled, and must be freed with otrl_symstream_free. */
+
+#define OTRL_SYMSTREAM_HEADER_BYTES (4 + 1 + 4 + 16)
+#define OTRL_SYMSTREAM_TAG_BYTES 32
+
+/* The largest chunk size a stream may have */
+#define OTRL_SYMSTREAM_MAX_CHUNK (1 << 24)
+
+typedef struct s_OtrlSymStream {
+    gcry_cipher_hd_t cipher;      /* AES-256-CTR with this stream's key */
+    gcry_md_hd_t mac;             /* HMAC-SHA256 with this stream's key */
+    unsigned char header[OTRL_SYMSTREAM_HEADER_BYTES];
+    size_t chunklen;              /* The size of every chunk but the last */
+    unsigned long long next;      /* The index of the next chunk */
+    int finished;                 /* Has the last chunk been handled? */
+} OtrlSymStream;
+
+/* Start encrypting a stream of chunks of chunklen bytes (at most
+ * OTRL_SYMSTREAM_MAX_CHUNK) with the extra symmetric key symkey, and
+ * put the header to send ahead of them in header.  usedata is the
+ * use-specific data that was sent along with the key by
+ * otrl_message_symkey, which the stream's keys are bound to; it may be
+ * NULL if usedatalen is 0.  Every symkey gives a new key for every
+ * stream. */
+gcry_error_t otrl_symstream_encrypt_init(OtrlSymStream *stream,
+	const unsigned char symkey[OTRL_EXTRAKEY_BYTES],
+	const unsigned char *usedata, size_t usedatalen, size_t chunklen,
+	unsigned char header[OTRL_SYMSTREAM_HEADER_BYTES]);
+
+/* Start decrypting the stream that begins with header, with the extra
+ * symmetric key symkey and the use-specific data usedata, as they were
+ * passed to the received_symkey callback.  Return GPG_ERR_INV_VALUE if
+ * header isn't the header of a symmetric stream. */
+gcry_error_t otrl_symstream_decrypt_init(OtrlSymStream *stream,
+	const unsigned char symkey[OTRL_EXTRAKEY_BYTES],
+	const unsigned char *usedata, size_t usedatalen,
+	const unsigned char header[OTRL_SYMSTREAM_HEADER_BYTES]);
+
+/* Encrypt the next chunk of the stream, the len bytes at buf, in place,
+ * and put its tag in tag.  len must be the stream's chunk size, unless
+ * last is set to say this is the last chunk, which may be shorter
+ * (even empty).  Return GPG_ERR_INV_LENGTH if the chunk is the wrong
+ * size, and GPG_ERR_CONFLICT if the stream is already finished. */
+gcry_error_t otrl_symstream_encrypt(OtrlSymStream *stream,
+	unsigned char *buf, size_t len, int last,
+	unsigned char tag[OTRL_SYMSTREAM_TAG_BYTES]);
+
+/* Check the tag of the next chunk of the stream, the len bytes at buf,
+ * and if it's right, decrypt the chunk in place.  last must be set for
+ * the last chunk, and only for it.  Return GPG_ERR_BAD_SIGNATURE,
+ * leaving buf untouched, if the chunk or its tag has been altered, or
+ * isn't the next chunk, or its being the last one or not doesn't match
+ * last; GPG_ERR_INV_LENGTH if it's the wrong size; and
+ * GPG_ERR_CONFLICT if the stream is already finished.  A chunk that's
+ * been turned down may be tried again. */
+gcry_error_t otrl_symstream_decrypt(OtrlSymStream *stream,
+	unsigned char *buf, size_t len, int last,
+	const unsigned char tag[OTRL_SYMSTREAM_TAG_BYTES]);
+
+/* Free the keys of the given stream, finished or not. */
+void otrl_symstream_free(OtrlSymStream *stream);
+
+#endif
@@ -45,19 +45,105 @@ OtrlTLV *otrl_tlv_parse(const unsigned char *serialized, size_t seriallen)
 {
     OtrlTLV *tlv = NULL;
     OtrlTLV **tlvp = &tlv;
-    while (seriallen >= 4) {
-	unsigned short type = (serialized[0] << 8) + serialized[1];
-	unsigned short len = (serialized[2] << 8) + serialized[3];
-	serialized += 4; seriallen -=4;
-	if (seriallen < len) break;
-	*tlvp = otrl_tlv_new(type, len, serialized);
-	serialized += len;
-	seriallen -= len;
+    OtrlTLVView view;
+    while (otrl_tlv_view_next(&view, &serialized, &seriallen)) {
+	*tlvp = otrl_tlv_new(view.type, view.len, view.data);
 	tlvp = &((*tlvp)->next);
     }
     return tlv;
 }
 
+/* Read the TLV at the start of *serializedp into *view without copying
+ * it, and move *serializedp and *seriallenp past it.  Return 1 if there
+ * was a whole TLV there, or 0 at the end of the chain. */
+int otrl_tlv_view_next(OtrlTLVView *view,
+	const unsigned char **serializedp, size_t *seriallenp)
+{
+    const unsigned char *serialized = *serializedp;
+    size_t seriallen = *seriallenp;
+
+    if (seriallen < 4) return 0;
+    view->type = (serialized[0] << 8) + serialized[1];
+    view->len = (serialized[2] << 8) + serialized[3];
+    if (seriallen - 4 < view->len) return 0;
+    view->data = serialized + 4;
+    *serializedp = serialized + 4 + view->len;
+    *seriallenp = seriallen - 4 - view->len;
+    return 1;
+}
+
+/* Find the first TLV with the given type in the serialized chain, and
+ * put a view of it into *view.  Return 1 if one was found, 0 if not. */
+int otrl_tlv_view_find(OtrlTLVView *view,
+	const unsigned char *serialized, size_t seriallen,
+	unsigned short type)
+{
+    while (otrl_tlv_view_next(view, &serialized, &seriallen)) {
+	if (view->type == type) return 1;
+    }
+    return 0;
+}
+
+/* Start an empty OtrlTLVBuf.  Nothing is allocated until the first
+ * TLV is added. */
+void otrl_tlvbuf_init(OtrlTLVBuf *tlvbuf)
+{
+    tlvbuf->data = NULL;
+    tlvbuf->len = 0;
+    tlvbuf->size = 0;
+}
+
+/* Add a TLV of the given type with len bytes of data to the end of
+ * tlvbuf, and return the place to write its data into, or NULL if
+ * len is too big for a TLV or there's no memory.  The place is only
+ * good until the next TLV is added. */
+unsigned char *otrl_tlvbuf_reserve(OtrlTLVBuf *tlvbuf, unsigned short type,
+	size_t len)
+{
+    unsigned char *bufp;
+
+    if (len > 0xffff) return NULL;
+
+    if (tlvbuf->size - tlvbuf->len < len + 4) {
+	/* The usual message has just the one TLV, so make room for
+	 * exactly that the first time, and double after that. */
+	size_t newsize = tlvbuf->size ? 2 * tlvbuf->size : 0;
+	unsigned char *newdata;
+
+	if (newsize < tlvbuf->len + len + 4) newsize = tlvbuf->len + len + 4;
+	newdata = realloc(tlvbuf->data, newsize);
+	if (newdata == NULL) return NULL;
+	tlvbuf->data = newdata;
+	tlvbuf->size = newsize;
+    }
+
+    bufp = tlvbuf->data + tlvbuf->len;
+    bufp[0] = (type >> 8) & 0xff;
+    bufp[1] = type & 0xff;
+    bufp[2] = (len >> 8) & 0xff;
+    bufp[3] = len & 0xff;
+    tlvbuf->len += len + 4;
+    return bufp + 4;
+}
+
+/* Add a TLV to the end of tlvbuf, copying the supplied data */
+gcry_error_t otrl_tlvbuf_append(OtrlTLVBuf *tlvbuf, unsigned short type,
+	unsigned short len, const unsigned char *data)
+{
+    unsigned char *bufp = otrl_tlvbuf_reserve(tlvbuf, type, len);
+
+    if (bufp == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    if (len > 0) memmove(bufp, data, len);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Deallocate the TLVs in tlvbuf, leaving it empty */
+void otrl_tlvbuf_free(OtrlTLVBuf *tlvbuf)
+{
+    free(tlvbuf->data);
+    otrl_tlvbuf_init(tlvbuf);
+}
+
 /* Deallocate a chain of TLVs */
 void otrl_tlv_free(OtrlTLV *tlv)
 {
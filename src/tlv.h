@@ -21,6 +21,8 @@
 #ifndef __TLV_H__
 #define __TLV_H__
 
+#include <gcrypt.h>
+
 typedef struct s_OtrlTLV {
     unsigned short type;
     unsigned short len;
@@ -28,6 +30,22 @@ typedef struct s_OtrlTLV {
     struct s_OtrlTLV *next;
 } OtrlTLV;
 
+/* A TLV pointing into the serialized chain it came from, rather than
+ * holding a copy of its data.  It's only good for as long as that
+ * buffer is, and its data is not NUL-terminated. */
+typedef struct s_OtrlTLVView {
+    unsigned short type;
+    unsigned short len;
+    const unsigned char *data;
+} OtrlTLVView;
+
+/* A chain of TLVs built up already serialized, in one buffer */
+typedef struct s_OtrlTLVBuf {
+    unsigned char *data;
+    size_t len;                    /* Bytes of serialized TLVs */
+    size_t size;                   /* Bytes allocated at data */
+} OtrlTLVBuf;
+
 /* TLV types */
 
 /* This is just padding for the encrypted message, and should be ignored. */
@@ -60,6 +78,36 @@ OtrlTLV *otrl_tlv_new(unsigned short type, unsigned short len,
 /* Construct a chain of TLVs from the given data */
 OtrlTLV *otrl_tlv_parse(const unsigned char *serialized, size_t seriallen);
 
+/* Read the TLV at the start of *serializedp into *view without copying
+ * it, and move *serializedp and *seriallenp past it.  Return 1 if there
+ * was a whole TLV there, or 0 at the end of the chain. */
+int otrl_tlv_view_next(OtrlTLVView *view,
+	const unsigned char **serializedp, size_t *seriallenp);
+
+/* Find the first TLV with the given type in the serialized chain, and
+ * put a view of it into *view.  Return 1 if one was found, 0 if not. */
+int otrl_tlv_view_find(OtrlTLVView *view,
+	const unsigned char *serialized, size_t seriallen,
+	unsigned short type);
+
+/* Start an empty OtrlTLVBuf.  Nothing is allocated until the first
+ * TLV is added. */
+void otrl_tlvbuf_init(OtrlTLVBuf *tlvbuf);
+
+/* Add a TLV of the given type with len bytes of data to the end of
+ * tlvbuf, and return the place to write its data into, or NULL if
+ * len is too big for a TLV or there's no memory.  The place is only
+ * good until the next TLV is added. */
+unsigned char *otrl_tlvbuf_reserve(OtrlTLVBuf *tlvbuf, unsigned short type,
+	size_t len);
+
+/* Add a TLV to the end of tlvbuf, copying the supplied data */
+gcry_error_t otrl_tlvbuf_append(OtrlTLVBuf *tlvbuf, unsigned short type,
+	unsigned short len, const unsigned char *data);
+
+/* Deallocate the TLVs in tlvbuf, leaving it empty */
+void otrl_tlvbuf_free(OtrlTLVBuf *tlvbuf);
+
 /* Deallocate a chain of TLVs */
 void otrl_tlv_free(OtrlTLV *tlv);
 
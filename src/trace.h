@@ -0,0 +1,52 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2012  Ian Goldberg, Chris Alexander, Willy Lew,
+ *  			     Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* The hooks behind otrl_userstate_set_trace.  This header is internal
+ * to the library, and isn't installed. */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "userstate.h"
+
+/* Return the current time for a trace, in nanoseconds of the monotonic
+ * clock, or 0 if we can't tell. */
+unsigned long long otrl_trace_now(void);
+
+/* Report a phase that started at start to the trace callback of the
+ * given OtrlUserState. */
+void otrl_trace_emit(OtrlUserState us, unsigned long long start,
+	OtrlTracePhase phase, ConnContext *context, size_t insize,
+	size_t outsize);
+
+/* Put a phase between otrl_trace_begin and otrl_trace_end.  Without a
+ * trace callback, this is a test of one pointer at each end, and the
+ * sizes passed to otrl_trace_end aren't even worked out. */
+#define otrl_trace_begin(us) \
+    (((us) && (us)->trace) ? otrl_trace_now() : 0)
+#define otrl_trace_end(us, start, phase, context, insize, outsize) \
+    do { \
+	if (start) { \
+	    otrl_trace_emit((us), (start), (phase), (context), (insize), \
+		    (outsize)); \
+	} \
+    } while (0)
+
+#endif
@@ -18,14 +18,167 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* libotr headers */
 #include "context.h"
+#include "context_priv.h"
+#include "fpstore.h"
+#include "keystore.h"
+#include "offload.h"
+#include "pubkeycache.h"
+#include "mem.h"
 #include "privkey.h"
+#include "stats.h"
+#include "trace.h"
 #include "userstate.h"
 
+/* The initial number of buckets in a userstate's account table */
+#define ACCOUNT_TABLE_INITIAL_SIZE 16
+
+/* Hash an accountname/protocol pair (FNV-1a, with a NUL between
+ * them). */
+static unsigned int account_hash(const char *accountname,
+	const char *protocol)
+{
+    unsigned int hash = 2166136261U;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)accountname; *p; ++p) {
+	hash = (hash ^ *p) * 16777619U;
+    }
+    hash *= 16777619U;
+    for (p = (const unsigned char *)protocol; *p; ++p) {
+	hash = (hash ^ *p) * 16777619U;
+    }
+    return hash;
+}
+
+/* Grow the account table so that it has at least as many buckets as
+ * entries.  If we can't get the memory, just leave it as it is. */
+static void account_table_grow(OtrlUserState us)
+{
+    OtrlAccount **oldtable = us->account_table;
+    size_t oldsize = us->account_table_size;
+    size_t newsize, i;
+
+    if (oldtable && us->account_table_used < oldsize) return;
+
+    newsize = oldsize ? oldsize * 2 : ACCOUNT_TABLE_INITIAL_SIZE;
+    us->account_table = calloc(newsize, sizeof(OtrlAccount *));
+    if (us->account_table == NULL) {
+	us->account_table = oldtable;
+	return;
+    }
+    us->account_table_size = newsize;
+
+    for (i = 0; i < oldsize; ++i) {
+	while (oldtable[i]) {
+	    OtrlAccount *entry = oldtable[i];
+	    OtrlAccount **bucket =
+		&(us->account_table[entry->hash & (newsize - 1)]);
+	    oldtable[i] = entry->next;
+	    entry->next = *bucket;
+	    *bucket = entry;
+	}
+    }
+    free(oldtable);
+}
+
+/* Free the given OtrlUserState's account table, once its privkeys and
+ * instance tags are gone. */
+static void account_table_free(OtrlUserState us)
+{
+    size_t i;
+
+    for (i = 0; i < us->account_table_size; ++i) {
+	while (us->account_table[i]) {
+	    OtrlAccount *entry = us->account_table[i];
+	    us->account_table[i] = entry->next;
+	    free(entry->accountname);
+	    free(entry->protocol);
+	    free(entry->querymsg);
+	    free(entry->tag);
+	    free(entry);
+	}
+    }
+    free(us->account_table);
+    us->account_table = NULL;
+    us->account_table_size = 0;
+    us->account_table_used = 0;
+}
+
+/* Return the entry for the given accountname/protocol in the given
+ * OtrlUserState's account table.  If there is none, add one if
+ * add_if_missing is set, or else return NULL; NULL is also returned if
+ * out of memory.  The caller must hold the userstate's lock (the write
+ * lock, if add_if_missing is set). */
+OtrlAccount *otrl_userstate_account_find(OtrlUserState us,
+	const char *accountname, const char *protocol, int add_if_missing)
+{
+    unsigned int hash = account_hash(accountname, protocol);
+    OtrlAccount *entry = NULL, **bucket;
+
+    if (us->account_table) {
+	for (entry = us->account_table[hash & (us->account_table_size - 1)];
+		entry; entry = entry->next) {
+	    if (entry->hash == hash &&
+		    !strcmp(entry->accountname, accountname) &&
+		    !strcmp(entry->protocol, protocol)) {
+		return entry;
+	    }
+	}
+    }
+    if (!add_if_missing) return NULL;
+
+    entry = malloc(sizeof(*entry));
+    if (!entry) return NULL;
+    entry->accountname = strdup(accountname);
+    entry->protocol = strdup(protocol);
+    if (!entry->accountname || !entry->protocol) {
+	free(entry->accountname);
+	free(entry->protocol);
+	free(entry);
+	return NULL;
+    }
+    ++us->account_table_used;
+    account_table_grow(us);
+    if (us->account_table == NULL) {
+	--us->account_table_used;
+	free(entry->accountname);
+	free(entry->protocol);
+	free(entry);
+	return NULL;
+    }
+    entry->hash = hash;
+    entry->privkey = NULL;
+    entry->privkey_count = 0;
+    entry->pending = NULL;
+    entry->instag = NULL;
+    entry->instag_count = 0;
+    entry->querymsg = NULL;
+    entry->querymsg_len = 0;
+    entry->querymsg_policy = 0;
+    entry->tag = NULL;
+    entry->tag_len = 0;
+    entry->tag_policy = 0;
+    bucket = &(us->account_table[hash & (us->account_table_size - 1)]);
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
 /* Create a new OtrlUserState.  Most clients will only need one of
  * these.  A OtrlUserState encapsulates the list of known fingerprints
  * and the list of private keys; if you have separate files for these
@@ -38,10 +191,68 @@ OtrlUserState otrl_userstate_create(void)
     OtrlUserState us = malloc(sizeof(struct s_OtrlUserState));
     if (!us) return NULL;
     us->context_root = NULL;
+    us->context_index = NULL;
+    us->context_index_size = 0;
+    us->context_index_used = 0;
+    us->fingerprint_table = NULL;
+    us->fingerprint_table_size = 0;
+    us->fingerprint_table_used = 0;
+    us->context_last_added = NULL;
+    us->intern_table = NULL;
+    us->intern_table_size = 0;
+    us->intern_table_used = 0;
+    us->context_slab = 0;
+    us->context_slab_root = NULL;
+    us->context_slab_free = NULL;
+    us->dh_keypool = NULL;
+    us->fragment_max_len = 0;
+    us->fragment_timeout = 0;
+    us->retransmit_max_len = 0;
+    us->retransmit_max_total = 0;
+    us->retransmit_timeout = 0;
+    us->retransmit_bytes = 0;
+    us->account_table = NULL;
+    us->account_table_size = 0;
+    us->account_table_used = 0;
     us->privkey_root = NULL;
     us->instag_root = NULL;
     us->pending_root = NULL;
+    us->privkey_index_root = NULL;
+    us->privkey_index_file = NULL;
     us->timer_running = 0;
+    us->lock = NULL;
+    us->offload = NULL;
+    us->deadlines = NULL;
+    us->deadlines_size = 0;
+    us->deadlines_used = 0;
+    us->fpstore = NULL;
+    us->keystore = NULL;
+    us->ake_max_inflight = 0;
+    us->ake_max_deferred = 0;
+    us->ake_inflight = NULL;
+    us->ake_inflight_used = 0;
+    us->ake_deferred = NULL;
+    us->ake_deferred_used = 0;
+    us->heartbeat_delay = 0;
+    us->heartbeat_max = 0;
+    us->heartbeat_head = NULL;
+    us->heartbeat_tail = &(us->heartbeat_head);
+    us->changes_held = 0;
+    us->changes_debounce = 0;
+    us->changes_due = 0;
+    us->coalesced_changes = NULL;
+    us->changed_contexts = NULL;
+    us->changed_fingerprints = NULL;
+    us->hibernate_idle = 0;
+    us->hibernate_next = 0;
+    us->pubkey_cache_max = 0;
+    us->pubkey_cache_used = 0;
+    us->pubkey_lru_head = NULL;
+    us->pubkey_lru_tail = NULL;
+    memset(&us->stats, 0, sizeof(us->stats));
+    us->trace = NULL;
+    us->trace_data = NULL;
+    us->convert_inplace = NULL;
     return us;
 }
 
@@ -49,9 +260,1187 @@ OtrlUserState otrl_userstate_create(void)
 stop it before freeing the userstate. */
 void otrl_userstate_free(OtrlUserState us)
 {
+    otrl_userstate_set_offload(us, 0, NULL, NULL);
+    otrl_fpstore_close(us);
     otrl_context_forget_all(us);
+    otrl_userstate_set_ake_admission(us, 0, 0);
     otrl_privkey_forget_all(us);
     otrl_privkey_pending_forget_all(us);
     otrl_instag_forget_all(us);
+    otrl_keystore_attach(us, NULL);
+    account_table_free(us);
+    free(us->intern_table);
+    free(us->deadlines);
+    otrl_dh_keypool_free(us->dh_keypool);
+    otrl_userstate_set_threaded(us, 0);
     free(us);
 }
+
+/* Choose whether new contexts in the given OtrlUserState are allocated
+ * from slabs, which keep each context, its private part and its SM
+ * state together in one block and recycle the blocks of forgotten
+ * contexts.  This is off by default; contexts that already exist are
+ * not affected. */
+void otrl_userstate_set_context_slab(OtrlUserState us, int enabled)
+{
+    us->context_slab = enabled;
+}
+
+#ifdef HAVE_PTHREAD_H
+struct s_OtrlUserStateLock {
+    pthread_rwlock_t rwlock;   /* Protects the userstate's lists */
+};
+#endif
+
+/* Choose whether the given OtrlUserState may be used from several
+ * threads at once.  In the threaded mode, its lists of contexts,
+ * private keys and instance tags are protected by a reader-writer lock,
+ * and each master context and its children (its "family") share a
+ * mutex, which otrl_message_sending, otrl_message_receiving and the
+ * other otrl_message_* routines hold while they work on that family.
+ * Only switch the threaded mode on or off while no other thread is
+ * using the userstate.  Return 0 on success, or -1 if out of memory or
+ * if this libotr was built without thread support.  See userstate.h
+ * for the rules the application must follow in the threaded mode. */
+int otrl_userstate_set_threaded(OtrlUserState us, int enabled)
+{
+    ConnContext *context;
+
+    if (!enabled) {
+	if (us->lock == NULL) return 0;
+	for (context = us->context_root; context; context = context->next) {
+	    otrl_context_priv_lock_free(context->context_priv);
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_rwlock_destroy(&(us->lock->rwlock));
+#endif
+	free(us->lock);
+	us->lock = NULL;
+	return 0;
+    }
+
+#ifdef HAVE_PTHREAD_H
+    if (us->lock) return 0;
+
+    us->lock = malloc(sizeof(struct s_OtrlUserStateLock));
+    if (us->lock == NULL) return -1;
+    if (pthread_rwlock_init(&(us->lock->rwlock), NULL)) {
+	free(us->lock);
+	us->lock = NULL;
+	return -1;
+    }
+
+    /* Give each existing family its mutex */
+    for (context = us->context_root; context; context = context->next) {
+	if (context->m_context == context &&
+		otrl_context_priv_lock_new(context->context_priv)) {
+	    otrl_userstate_set_threaded(us, 0);
+	    return -1;
+	}
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Choose where otrl_message_receiving_offload handles the messages
+ * that need expensive public-key operations: on an application's own
+ * thread pool, through submit, or, if submit is NULL, on a pool of the
+ * given number of threads of libotr's own.  Passing threads = 0 and
+ * submit = NULL turns offloading off again, after waiting for any
+ * messages still being handled.  Turning offloading on also turns on
+ * the threaded mode.  Return 0 on success, or -1 if out of memory or
+ * if this libotr was built without thread support. */
+int otrl_userstate_set_offload(OtrlUserState us, unsigned int threads,
+	void (*submit)(void *submitdata, void (*run)(void *job), void *job),
+	void *submitdata)
+{
+    OtrlOffload *offload = NULL;
+
+    if (threads > 0 || submit) {
+	if (otrl_userstate_set_threaded(us, 1)) return -1;
+	offload = otrl_offload_new(threads, submit, submitdata);
+	if (offload == NULL) return -1;
+    }
+
+    otrl_offload_free(us->offload);
+    us->offload = offload;
+    return 0;
+}
+
+/* Take the given OtrlUserState's read lock.  This does nothing unless
+ * the threaded mode is on. */
+void otrl_userstate_rdlock(OtrlUserState us)
+{
+#ifdef HAVE_PTHREAD_H
+    if (us && us->lock) pthread_rwlock_rdlock(&(us->lock->rwlock));
+#endif
+}
+
+/* Take the given OtrlUserState's write lock.  This does nothing unless
+ * the threaded mode is on. */
+void otrl_userstate_wrlock(OtrlUserState us)
+{
+#ifdef HAVE_PTHREAD_H
+    if (us && us->lock) pthread_rwlock_wrlock(&(us->lock->rwlock));
+#endif
+}
+
+/* Release whichever of the given OtrlUserState's locks this thread
+ * holds.  This does nothing unless the threaded mode is on. */
+void otrl_userstate_unlock(OtrlUserState us)
+{
+#ifdef HAVE_PTHREAD_H
+    if (us && us->lock) pthread_rwlock_unlock(&(us->lock->rwlock));
+#endif
+}
+
+/* Keep up to size of the DSA public keys the AKE verifies signatures
+ * with in the given OtrlUserState, already parsed, so that repeat AKEs
+ * with the same contacts don't parse them again.  The least recently
+ * used key is dropped to make room.  A size of 0, the default, turns
+ * the cache off and empties it. */
+void otrl_userstate_set_pubkey_cache(OtrlUserState us, unsigned int size)
+{
+    otrl_userstate_wrlock(us);
+    us->pubkey_cache_max = size;
+    otrl_pubkey_cache_trim(us);
+    otrl_userstate_unlock(us);
+}
+
+/* Limit how the contexts in the given OtrlUserState reassemble
+ * fragmented messages.  A message whose fragments add up to more than
+ * maxlen bytes is thrown away, as is one that isn't complete within
+ * timeout seconds of its first fragment arriving (the check happens
+ * when another fragment arrives, or in otrl_message_poll).  0 means no
+ * limit, which is the default for both. */
+void otrl_userstate_set_fragment_limits(OtrlUserState us, size_t maxlen,
+	unsigned int timeout)
+{
+    us->fragment_max_len = maxlen;
+    us->fragment_timeout = timeout;
+}
+
+/* Limit the copies the contexts in the given OtrlUserState keep in
+ * secure memory of the last message they sent.  A message longer than
+ * maxlen bytes isn't kept, nor is one that would take the copies kept
+ * by all the contexts over maxtotal bytes, and a copy is thrown away
+ * timeout seconds after its message was sent (from otrl_message_poll).
+ * 0 means no limit, which is the default for all three. */
+void otrl_userstate_set_retransmit_limits(OtrlUserState us, size_t maxlen,
+	size_t maxtotal, unsigned int timeout)
+{
+    us->retransmit_max_len = maxlen;
+    us->retransmit_max_total = maxtotal;
+    us->retransmit_timeout = timeout;
+}
+
+/* Give the given OtrlUserState a pool of up to size pre-generated D-H
+ * keypairs, which the AKE and key rotation will take from before
+ * generating fresh ones.  A size of 0 removes the pool.  The pool
+ * starts out empty; fill it with otrl_userstate_refill_dh_keypool.
+ * Return 0 on success, or -1 if out of memory. */
+int otrl_userstate_set_dh_keypool(OtrlUserState us, unsigned int size)
+{
+    DH_keypool *pool = NULL;
+    ConnContext *context;
+
+    if (size > 0) {
+	pool = otrl_dh_keypool_new(size);
+	if (pool == NULL) return -1;
+    }
+
+    /* Every context keeps its own pointer to the pool, so that the AKE
+     * code can find it without going through the userstate. */
+    for (context = us->context_root; context; context = context->next) {
+	context->auth.dh_keypool = pool;
+    }
+
+    otrl_dh_keypool_free(us->dh_keypool);
+    us->dh_keypool = pool;
+    return 0;
+}
+
+/* Generate up to max keypairs into the given OtrlUserState's D-H
+ * keypool, if it has one.  This is expensive, so call it from an idle
+ * callback, or from a thread of your own; it is safe to do the latter
+ * while the userstate is being used for other things, but not to
+ * remove or resize the pool at the same time.  Return the number of
+ * keypairs added. */
+unsigned int otrl_userstate_refill_dh_keypool(OtrlUserState us,
+	unsigned int max)
+{
+    return otrl_dh_keypool_refill(us->dh_keypool, max);
+}
+
+/* Is the given context one otrl_userstate_prepare_akes should prepare
+ * for at the time now? */
+static int ake_worth_preparing(ConnContext *context, time_t now)
+{
+    Fingerprint *fprint;
+
+    if (context->m_context != context ||
+	    context->msgstate == OTRL_MSGSTATE_ENCRYPTED ||
+	    context->auth.authstate != OTRL_AUTHSTATE_NONE ||
+	    (context->auth.prepared.encgx &&
+	     context->auth.prepared.expires > now)) {
+	return 0;
+    }
+    for (fprint = context->fingerprint_root.next; fprint;
+	    fprint = fprint->next) {
+	if (otrl_context_is_fingerprint_trusted(fprint)) return 1;
+    }
+    return 0;
+}
+
+/* Find a context that otrl_userstate_prepare_akes should prepare for
+ * at the time now, and whose family isn't busy.  If lock is set, take
+ * its family's mutex.  The caller must hold the userstate's read
+ * lock. */
+static ConnContext *ake_to_prepare(OtrlUserState us, time_t now, int lock)
+{
+    ConnContext *context;
+
+    for (context = us->context_root; context; context = context->next) {
+	if (!ake_worth_preparing(context, now)) continue;
+	if (!lock) return context;
+	if (otrl_context_trylock(context) == 0) {
+	    /* Check again, now that nothing can change it */
+	    if (ake_worth_preparing(context, now)) return context;
+	    otrl_context_unlock(context);
+	}
+    }
+    return NULL;
+}
+
+/* Work out the D-H Commit Message material for up to max of the
+ * contexts in the given OtrlUserState that are likely to start an AKE
+ * again soon (master contexts that aren't encrypted or in an AKE, but
+ * have a trusted fingerprint, so have been encrypted before) and don't
+ * already have some prepared.  An AKE any of them starts in the next
+ * lifetime seconds then sends its first message without doing any
+ * cryptography.  This is expensive, so call it from an idle callback,
+ * or from a thread of your own while the userstate is being used for
+ * other things.  Return the number of contexts prepared. */
+unsigned int otrl_userstate_prepare_akes(OtrlUserState us, unsigned int max,
+	unsigned int lifetime)
+{
+    unsigned int prepared = 0;
+
+    while (prepared < max) {
+	OtrlAuthPrepared prep;
+	ConnContext *context;
+	time_t now = time(NULL);
+
+	otrl_userstate_rdlock(us);
+	context = ake_to_prepare(us, now, 0);
+	otrl_userstate_unlock(us);
+	if (context == NULL) break;
+
+	/* The expensive part is done without holding any locks, and the
+	 * context to give it to is found again afterwards, in case it's
+	 * been forgotten in the meantime.  The family mutex is only
+	 * tried, as it's meant to be taken before the userstate's. */
+	otrl_auth_prepared_init(&prep);
+	if (otrl_auth_prepare_commit(&prep, us->dh_keypool,
+		    now + lifetime)) {
+	    break;
+	}
+
+	otrl_userstate_rdlock(us);
+	context = ake_to_prepare(us, now, 1);
+	if (context) {
+	    otrl_auth_prepared_free(&(context->auth.prepared));
+	    context->auth.prepared = prep;
+	    otrl_context_unlock(context);
+	    ++prepared;
+	} else {
+	    otrl_auth_prepared_free(&prep);
+	}
+	otrl_userstate_unlock(us);
+	if (context == NULL) break;
+    }
+    return prepared;
+}
+
+/* contexts in OtrlUserStateStats has room for every msgstate */
+typedef char stats_contexts_fit[
+    OTRL_MSGSTATE_FINISHED < OTRL_STATS_NUM_MSGSTATES ? 1 : -1];
+
+/* Fill in stats with a snapshot of the operational counters of the
+ * given OtrlUserState.  The counters are cheap enough to be always on;
+ * they're updated without taking the userstate's lock, so a snapshot
+ * taken while other threads are busy may be a few events out of
+ * date. */
+void otrl_userstate_stats(OtrlUserState us, OtrlUserStateStats *stats)
+{
+    ConnContext *context;
+    OtrlMemStats memstats;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->akes_started = otrl_stats_get(us->stats.akes_started);
+    stats->akes_completed = otrl_stats_get(us->stats.akes_completed);
+    stats->akes_expired = otrl_stats_get(us->stats.akes_expired);
+    stats->akes_deferred = otrl_stats_get(us->stats.akes_deferred);
+    stats->akes_shed = otrl_stats_get(us->stats.akes_shed);
+    stats->fragments_accumulated =
+	otrl_stats_get(us->stats.fragments_accumulated);
+    stats->fragments_dropped = otrl_stats_get(us->stats.fragments_dropped);
+    for (i = 0; i < OTRL_STATS_NUM_MSGEVENTS; ++i) {
+	stats->receive_errors[i] = otrl_stats_get(us->stats.receive_errors[i]);
+    }
+    stats->bytes_encrypted = otrl_stats_get(us->stats.bytes_encrypted);
+    stats->bytes_decrypted = otrl_stats_get(us->stats.bytes_decrypted);
+    stats->dh_keygens = otrl_stats_get(otrl_stats_dh_keygens);
+    stats->modexps = otrl_stats_get(otrl_stats_modexps);
+
+    otrl_mem_get_stats(&memstats);
+    stats->secure_high_water_bytes = memstats.high_water_bytes;
+    stats->retransmit_bytes = otrl_stats_get(us->retransmit_bytes);
+    stats->retransmits_dropped =
+	otrl_stats_get(us->stats.retransmits_dropped);
+    stats->heartbeats_sent = otrl_stats_get(us->stats.heartbeats_sent);
+    stats->heartbeats_suppressed =
+	otrl_stats_get(us->stats.heartbeats_suppressed);
+
+    otrl_userstate_rdlock(us);
+    for (context = us->context_root; context; context = context->next) {
+	if ((unsigned int)context->msgstate < OTRL_STATS_NUM_MSGSTATES) {
+	    ++stats->contexts[context->msgstate];
+	}
+	if (context->context_priv->sesskeys == NULL) {
+	    ++stats->contexts_hibernated;
+	}
+    }
+    otrl_userstate_unlock(us);
+}
+
+/* Have the given OtrlUserState call trace with data after each phase
+ * of the protocol listed in OtrlTracePhase, with how long it took, or
+ * stop if trace is NULL.  When it's off, tracing costs nothing but a
+ * test at each phase.  trace may be called from the threads of
+ * otrl_userstate_set_offload as well as from yours.  Don't change it
+ * while other threads are using the userstate. */
+void otrl_userstate_set_trace(OtrlUserState us, OtrlTraceCallback trace,
+	void *data)
+{
+    us->trace = trace;
+    us->trace_data = data;
+}
+
+/* Have the given OtrlUserState convert messages where they are, with
+ * convert_inplace, instead of with the application's convert_msg and
+ * convert_free ops; or go back to those if convert_inplace is NULL,
+ * the default.  convert_inplace is passed the opdata of the call that
+ * sends or receives the message.  Don't change it while other threads
+ * are using the userstate. */
+void otrl_userstate_set_convert_inplace(OtrlUserState us,
+	OtrlConvertInplace convert_inplace)
+{
+    us->convert_inplace = convert_inplace;
+}
+
+/* Return the current time for a trace, in nanoseconds of the monotonic
+ * clock, or 0 if we can't tell. */
+unsigned long long otrl_trace_now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) return 0;
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Report a phase that started at start to the trace callback of the
+ * given OtrlUserState. */
+void otrl_trace_emit(OtrlUserState us, unsigned long long start,
+	OtrlTracePhase phase, ConnContext *context, size_t insize,
+	size_t outsize)
+{
+    OtrlTraceCallback trace = us->trace;
+
+    if (trace) {
+	trace(us->trace_data, phase, context, insize, outsize, start,
+		otrl_trace_now());
+    }
+}
+
+/* The initial number of buckets in a userstate's intern table */
+#define INTERN_TABLE_INITIAL_SIZE 64
+
+/* Hash a string (FNV-1a). */
+static unsigned int intern_hash(const char *str)
+{
+    unsigned int hash = 2166136261U;
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)str; *p; ++p) {
+	hash = (hash ^ *p) * 16777619U;
+    }
+    return hash;
+}
+
+/* Find the entry for str in the intern table, given its hash. */
+static OtrlInternedString *intern_lookup(OtrlUserState us, const char *str,
+	unsigned int hash)
+{
+    OtrlInternedString *entry;
+
+    if (us->intern_table == NULL) return NULL;
+
+    for (entry = us->intern_table[hash & (us->intern_table_size - 1)];
+	    entry; entry = entry->next) {
+	if (entry->hash == hash && !strcmp(entry->str, str)) {
+	    return entry;
+	}
+    }
+    return NULL;
+}
+
+/* Grow the intern table so that it has at least as many buckets as
+ * strings.  Return 0 on success, -1 if out of memory and the table is
+ * still empty. */
+static int intern_grow(OtrlUserState us)
+{
+    OtrlInternedString **oldtable = us->intern_table;
+    size_t oldsize = us->intern_table_size;
+    size_t newsize, i;
+
+    if (oldtable && us->intern_table_used < oldsize) return 0;
+
+    newsize = oldsize ? oldsize * 2 : INTERN_TABLE_INITIAL_SIZE;
+    us->intern_table = calloc(newsize, sizeof(OtrlInternedString *));
+    if (us->intern_table == NULL) {
+	/* Just keep using the old table, with longer chains */
+	us->intern_table = oldtable;
+	return oldtable ? 0 : -1;
+    }
+    us->intern_table_size = newsize;
+
+    for (i = 0; i < oldsize; ++i) {
+	while (oldtable[i]) {
+	    OtrlInternedString *entry = oldtable[i];
+	    OtrlInternedString **bucket =
+		&(us->intern_table[entry->hash & (newsize - 1)]);
+	    oldtable[i] = entry->next;
+	    entry->next = *bucket;
+	    *bucket = entry;
+	}
+    }
+    free(oldtable);
+    return 0;
+}
+
+/* One entry of a userstate's deadline heap */
+struct s_OtrlDeadline {
+    time_t when;
+    ConnContext *context;
+};
+
+/* Put entry into slot i of the deadline heap, and tell its context
+ * where it is. */
+static void deadline_set(OtrlUserState us, size_t i,
+	struct s_OtrlDeadline entry)
+{
+    us->deadlines[i] = entry;
+    entry.context->context_priv->deadline_index = i + 1;
+}
+
+/* Move the entry in slot i of the deadline heap towards the top until
+ * it's no earlier than its parent. */
+static void deadline_sift_up(OtrlUserState us, size_t i)
+{
+    struct s_OtrlDeadline entry = us->deadlines[i];
+
+    while (i > 0 && us->deadlines[(i - 1) / 2].when > entry.when) {
+	deadline_set(us, i, us->deadlines[(i - 1) / 2]);
+	i = (i - 1) / 2;
+    }
+    deadline_set(us, i, entry);
+}
+
+/* Move the entry in slot i of the deadline heap towards the bottom
+ * until it's no later than its children. */
+static void deadline_sift_down(OtrlUserState us, size_t i)
+{
+    struct s_OtrlDeadline entry = us->deadlines[i];
+
+    for (;;) {
+	size_t child = 2 * i + 1;
+
+	if (child >= us->deadlines_used) break;
+	if (child + 1 < us->deadlines_used &&
+		us->deadlines[child + 1].when < us->deadlines[child].when) {
+	    ++child;
+	}
+	if (us->deadlines[child].when >= entry.when) break;
+	deadline_set(us, i, us->deadlines[child]);
+	i = child;
+    }
+    deadline_set(us, i, entry);
+}
+
+/* Make sure otrl_message_poll looks at the given context once the time
+ * when has come, because an AKE or a fragmented message may expire
+ * then.  A context already waiting for an earlier time keeps it.  The
+ * caller must hold the userstate's write lock.  Return 0 on success,
+ * or -1 if out of memory. */
+int otrl_userstate_deadline_add(OtrlUserState us, ConnContext *context,
+	time_t when)
+{
+    size_t index = context->context_priv->deadline_index;
+    struct s_OtrlDeadline entry;
+
+    if (index > 0) {
+	if (us->deadlines[index - 1].when > when) {
+	    us->deadlines[index - 1].when = when;
+	    deadline_sift_up(us, index - 1);
+	}
+	return 0;
+    }
+
+    if (us->deadlines_used == us->deadlines_size) {
+	size_t newsize = us->deadlines_size ? 2 * us->deadlines_size : 16;
+	struct s_OtrlDeadline *newdeadlines = realloc(us->deadlines,
+		newsize * sizeof(struct s_OtrlDeadline));
+
+	if (newdeadlines == NULL) return -1;
+	us->deadlines = newdeadlines;
+	us->deadlines_size = newsize;
+    }
+
+    entry.when = when;
+    entry.context = context;
+    us->deadlines[us->deadlines_used++] = entry;
+    deadline_sift_up(us, us->deadlines_used - 1);
+    return 0;
+}
+
+/* Stop otrl_message_poll looking at the given context.  The caller
+ * must hold the userstate's write lock. */
+void otrl_userstate_deadline_remove(OtrlUserState us, ConnContext *context)
+{
+    size_t index = context->context_priv->deadline_index;
+    struct s_OtrlDeadline last;
+
+    if (index == 0) return;
+
+    context->context_priv->deadline_index = 0;
+    last = us->deadlines[--us->deadlines_used];
+    if (index - 1 == us->deadlines_used) return;
+
+    /* Fill the hole with the last entry, and move it to where it
+     * belongs */
+    deadline_set(us, index - 1, last);
+    deadline_sift_up(us, index - 1);
+    deadline_sift_down(us, last.context->context_priv->deadline_index - 1);
+}
+
+/* Return the earliest time at which otrl_message_poll has a context to
+ * look at, or 0 if there is none. */
+time_t otrl_userstate_deadline_next(OtrlUserState us)
+{
+    return us->deadlines_used > 0 ? us->deadlines[0].when : 0;
+}
+
+/* Take the context with the earliest deadline out of the heap and
+ * return it, if that deadline is no later than now; else return NULL.
+ * The caller must hold the userstate's write lock. */
+ConnContext *otrl_userstate_deadline_pop(OtrlUserState us, time_t now)
+{
+    ConnContext *context;
+
+    if (us->deadlines_used == 0 || us->deadlines[0].when > now) {
+	return NULL;
+    }
+    context = us->deadlines[0].context;
+    otrl_userstate_deadline_remove(us, context);
+    return context;
+}
+
+/* One AKE that a userstate's admission control is counting as in
+ * flight, or one DH-Commit that it is holding back */
+struct s_OtrlAke {
+    ConnContext *context;
+    time_t when;                   /* When it was let in, or arrived */
+    int trusted;                   /* Does the correspondent have a
+				      trusted fingerprint? */
+    time_t seen;                   /* When we last sent to them */
+    char *msg;                     /* The held-back DH-Commit, or NULL */
+    unsigned int version;          /*  ...and its protocol version */
+};
+
+/* Is a more deserving of an AKE than b?  Correspondents with a trusted
+ * fingerprint come first, then those we last sent to most recently,
+ * then whoever has been waiting longest. */
+static int ake_before(const struct s_OtrlAke *a, const struct s_OtrlAke *b)
+{
+    if (a->trusted != b->trusted) return a->trusted;
+    if (a->seen != b->seen) return a->seen > b->seen;
+    return a->when < b->when;
+}
+
+/* Drop the held-back DH-Commit in slot i of the queue. */
+static void ake_deferred_drop(OtrlUserState us, unsigned int i)
+{
+    free(us->ake_deferred[i].msg);
+    us->ake_deferred[i] = us->ake_deferred[--us->ake_deferred_used];
+}
+
+/* Return the slot of the most (if best is set) or least deserving
+ * held-back DH-Commit; the queue must not be empty. */
+static unsigned int ake_deferred_find(OtrlUserState us, int best)
+{
+    unsigned int i, found = 0;
+
+    for (i = 1; i < us->ake_deferred_used; ++i) {
+	if (ake_before(&(us->ake_deferred[i]), &(us->ake_deferred[found]))
+		== best) {
+	    found = i;
+	}
+    }
+    return found;
+}
+
+/* Forget the AKEs let in, and the DH-Commits held back, before
+ * expire_before, whose senders will have given up on them by now. */
+static void ake_expire(OtrlUserState us, time_t expire_before)
+{
+    unsigned int i = 0;
+
+    while (i < us->ake_inflight_used) {
+	if (us->ake_inflight[i].when < expire_before) {
+	    us->ake_inflight[i] = us->ake_inflight[--us->ake_inflight_used];
+	} else {
+	    ++i;
+	}
+    }
+    i = 0;
+    while (i < us->ake_deferred_used) {
+	if (us->ake_deferred[i].when < expire_before) {
+	    ake_deferred_drop(us, i);
+	    otrl_stats_add(us->stats.akes_shed, 1);
+	} else {
+	    ++i;
+	}
+    }
+}
+
+/* Limit how many incoming AKEs the given OtrlUserState answers at
+ * once.  Once max_inflight AKEs answered with a DH-Key message haven't
+ * finished (or timed out), up to max_deferred further DH-Commits are
+ * held back, and answered from otrl_message_poll as room comes up.  A
+ * max_inflight of 0, the default, means no limit, and drops anything
+ * held back.  Return 0 on success, or -1 if out of memory. */
+int otrl_userstate_set_ake_admission(OtrlUserState us,
+	unsigned int max_inflight, unsigned int max_deferred)
+{
+    struct s_OtrlAke *inflight = NULL, *deferred = NULL;
+
+    if (max_inflight == 0) max_deferred = 0;
+    if (max_inflight > 0) {
+	inflight = malloc(max_inflight * sizeof(struct s_OtrlAke));
+	if (inflight == NULL) return -1;
+    }
+    if (max_deferred > 0) {
+	deferred = malloc(max_deferred * sizeof(struct s_OtrlAke));
+	if (deferred == NULL) {
+	    free(inflight);
+	    return -1;
+	}
+    }
+
+    /* Keep what still fits, dropping the least deserving of the
+     * held-back DH-Commits */
+    if (us->ake_inflight_used > max_inflight) {
+	us->ake_inflight_used = max_inflight;
+    }
+    while (us->ake_deferred_used > max_deferred) {
+	ake_deferred_drop(us, ake_deferred_find(us, 0));
+	otrl_stats_add(us->stats.akes_shed, 1);
+    }
+    if (us->ake_inflight_used > 0) {
+	memmove(inflight, us->ake_inflight,
+		us->ake_inflight_used * sizeof(struct s_OtrlAke));
+    }
+    if (us->ake_deferred_used > 0) {
+	memmove(deferred, us->ake_deferred,
+		us->ake_deferred_used * sizeof(struct s_OtrlAke));
+    }
+
+    free(us->ake_inflight);
+    free(us->ake_deferred);
+    us->ake_inflight = inflight;
+    us->ake_deferred = deferred;
+    us->ake_max_inflight = max_inflight;
+    us->ake_max_deferred = max_deferred;
+    return 0;
+}
+
+/* Have the contexts in the given OtrlUserState queue their heartbeats
+ * for otrl_message_poll to send, at most max_per_poll each time, after
+ * waiting at least delay seconds.  A max_per_poll of 0, the default,
+ * sends heartbeats straight away. */
+void otrl_userstate_set_heartbeat_deferral(OtrlUserState us,
+	unsigned int delay, unsigned int max_per_poll)
+{
+    otrl_userstate_wrlock(us);
+    us->heartbeat_delay = delay;
+    us->heartbeat_max = max_per_poll;
+    otrl_userstate_unlock(us);
+}
+
+/* Queue a heartbeat for the given context, due at when, unless it
+ * already has one queued.  The caller must hold the userstate's write
+ * lock. */
+void otrl_userstate_heartbeat_queue(OtrlUserState us, ConnContext *context,
+	time_t when)
+{
+    ConnContextPriv *priv = context->context_priv;
+
+    if (priv->heartbeat_tous) return;
+
+    priv->heartbeat_when = when;
+    priv->heartbeat_next = NULL;
+    priv->heartbeat_tous = us->heartbeat_tail;
+    *(us->heartbeat_tail) = context;
+    us->heartbeat_tail = &(priv->heartbeat_next);
+}
+
+/* Take the given context's heartbeat out of the queue, if it has one
+ * there.  The caller must hold the userstate's write lock. */
+void otrl_userstate_heartbeat_forget(OtrlUserState us,
+	ConnContext *context)
+{
+    ConnContextPriv *priv = context->context_priv;
+
+    if (priv->heartbeat_tous == NULL) return;
+
+    *(priv->heartbeat_tous) = priv->heartbeat_next;
+    if (priv->heartbeat_next) {
+	priv->heartbeat_next->context_priv->heartbeat_tous =
+	    priv->heartbeat_tous;
+    } else {
+	us->heartbeat_tail = priv->heartbeat_tous;
+    }
+    priv->heartbeat_next = NULL;
+    priv->heartbeat_tous = NULL;
+}
+
+/* Take the context with the oldest heartbeat out of the queue and
+ * return it, if that heartbeat is due by now; else return NULL.  The
+ * caller must hold the userstate's write lock. */
+ConnContext *otrl_userstate_heartbeat_next(OtrlUserState us, time_t now)
+{
+    ConnContext *context = us->heartbeat_head;
+
+    if (context == NULL || context->context_priv->heartbeat_when > now) {
+	return NULL;
+    }
+    otrl_userstate_heartbeat_forget(us, context);
+    return context;
+}
+
+/* Have the given OtrlUserState hold back the update_context_list and
+ * write_fingerprints calls that adding a context or fingerprint, or a
+ * change of state or trust, would make, and instead have
+ * otrl_message_poll make one call for all the changes, debounce
+ * seconds after the first of them.  If enabled is 0, the default, the
+ * calls are made straight away, as before. */
+void otrl_userstate_set_change_coalescing(OtrlUserState us, int enabled,
+	unsigned int debounce)
+{
+    otrl_userstate_wrlock(us);
+    us->changes_held = enabled;
+    us->changes_debounce = debounce;
+    otrl_userstate_unlock(us);
+}
+
+/* Have otrl_message_poll hand the changes the given OtrlUserState holds
+ * back to coalesced_changes, with the opdata passed to it, instead of
+ * calling update_context_list and write_fingerprints; or go back to
+ * those if coalesced_changes is NULL, the default. */
+void otrl_userstate_set_coalesced_changes(OtrlUserState us,
+	OtrlCoalescedChanges coalesced_changes)
+{
+    otrl_userstate_wrlock(us);
+    us->coalesced_changes = coalesced_changes;
+    otrl_userstate_unlock(us);
+}
+
+/* Note that the given context, if non-NULL, and the given fingerprint,
+ * if non-NULL, have changed, for otrl_message_poll to tell about by
+ * when.  when is ignored if there are already changes waiting.  The
+ * caller must hold the userstate's write lock. */
+void otrl_userstate_changed(OtrlUserState us, ConnContext *context,
+	Fingerprint *fprint, time_t when)
+{
+    if (context && context->context_priv->changed_tous == NULL) {
+	ConnContextPriv *priv = context->context_priv;
+
+	priv->changed_next = us->changed_contexts;
+	if (priv->changed_next) {
+	    priv->changed_next->context_priv->changed_tous =
+		&(priv->changed_next);
+	}
+	us->changed_contexts = context;
+	priv->changed_tous = &(us->changed_contexts);
+    }
+    if (fprint && fprint->changed_tous == NULL) {
+	fprint->changed_next = us->changed_fingerprints;
+	if (fprint->changed_next) {
+	    fprint->changed_next->changed_tous = &(fprint->changed_next);
+	}
+	us->changed_fingerprints = fprint;
+	fprint->changed_tous = &(us->changed_fingerprints);
+    }
+    if (us->changes_due == 0) {
+	us->changes_due = when > 0 ? when : 1;
+    }
+}
+
+/* Take the given context, which is being forgotten, out of the changes
+ * waiting.  The caller must hold the userstate's write lock. */
+void otrl_userstate_changed_context_forget(OtrlUserState us,
+	ConnContext *context)
+{
+    ConnContextPriv *priv = context->context_priv;
+
+    if (priv->changed_tous == NULL) return;
+
+    *(priv->changed_tous) = priv->changed_next;
+    if (priv->changed_next) {
+	priv->changed_next->context_priv->changed_tous = priv->changed_tous;
+    }
+    priv->changed_next = NULL;
+    priv->changed_tous = NULL;
+}
+
+/* Take the given fingerprint, which is being forgotten, out of the
+ * changes waiting.  The caller must hold the userstate's write lock. */
+void otrl_userstate_changed_fingerprint_forget(OtrlUserState us,
+	Fingerprint *fprint)
+{
+    if (fprint->changed_tous == NULL) return;
+
+    *(fprint->changed_tous) = fprint->changed_next;
+    if (fprint->changed_next) {
+	fprint->changed_next->changed_tous = fprint->changed_tous;
+    }
+    fprint->changed_next = NULL;
+    fprint->changed_tous = NULL;
+}
+
+/* If the changes waiting are due by now, take them all out of the
+ * lists, putting the numbers of contexts and fingerprints in
+ * *ncontextsp and *nfingerprintsp, and newly-allocated arrays of them in
+ * *contextsp and *fingerprintsp, or NULL if out of memory, and return
+ * 1.  Otherwise return 0.  The caller must hold the userstate's write
+ * lock. */
+int otrl_userstate_changed_take(OtrlUserState us, time_t now,
+	ConnContext ***contextsp, size_t *ncontextsp,
+	Fingerprint ***fingerprintsp, size_t *nfingerprintsp)
+{
+    ConnContext *context;
+    Fingerprint *fprint;
+    size_t n;
+
+    if (us->changes_due == 0 || us->changes_due > now) return 0;
+    us->changes_due = 0;
+
+    for (n = 0, context = us->changed_contexts; context;
+	    context = context->context_priv->changed_next) {
+	++n;
+    }
+    *ncontextsp = n;
+    *contextsp = n > 0 ? malloc(n * sizeof(ConnContext *)) : NULL;
+    for (n = 0; (context = us->changed_contexts) != NULL; ++n) {
+	if (*contextsp) (*contextsp)[n] = context;
+	otrl_userstate_changed_context_forget(us, context);
+    }
+
+    for (n = 0, fprint = us->changed_fingerprints; fprint;
+	    fprint = fprint->changed_next) {
+	++n;
+    }
+    *nfingerprintsp = n;
+    *fingerprintsp = n > 0 ? malloc(n * sizeof(Fingerprint *)) : NULL;
+    for (n = 0; (fprint = us->changed_fingerprints) != NULL; ++n) {
+	if (*fingerprintsp) (*fingerprintsp)[n] = fprint;
+	otrl_userstate_changed_fingerprint_forget(us, fprint);
+    }
+    return 1;
+}
+
+/* Have otrl_message_poll free the session keys of the contexts in the
+ * given OtrlUserState that aren't encrypted and haven't sent or
+ * received anything for idle seconds.  An idle of 0, the default,
+ * turns it off.  It takes effect from the next otrl_message_poll. */
+void otrl_userstate_set_hibernation(OtrlUserState us, unsigned int idle)
+{
+    otrl_userstate_wrlock(us);
+    us->hibernate_idle = idle;
+    us->hibernate_next = 0;
+    otrl_userstate_unlock(us);
+}
+
+/* Let the given context answer a DH-Commit now, if there is room for
+ * another AKE and no more deserving DH-Commit is being held back, and
+ * count its AKE as in flight from now.  trusted and seen rank it as for
+ * otrl_userstate_ake_defer.  AKEs let in before expire_before no longer
+ * count.  The caller must hold the userstate's write lock.  Return 1
+ * if the context may go ahead, or 0 if it should wait. */
+int otrl_userstate_ake_admit(OtrlUserState us, ConnContext *context,
+	int trusted, time_t seen, time_t now, time_t expire_before)
+{
+    struct s_OtrlAke ake;
+    unsigned int i;
+
+    if (us->ake_max_inflight == 0) return 1;
+    ake_expire(us, expire_before);
+
+    /* A context already answering one keeps its place */
+    for (i = 0; i < us->ake_inflight_used; ++i) {
+	if (us->ake_inflight[i].context == context) {
+	    us->ake_inflight[i].when = now;
+	    return 1;
+	}
+    }
+
+    ake.context = context;
+    ake.when = now;
+    ake.trusted = trusted;
+    ake.seen = seen;
+    ake.msg = NULL;
+    ake.version = 0;
+
+    if (us->ake_inflight_used == us->ake_max_inflight) return 0;
+    for (i = 0; i < us->ake_deferred_used; ++i) {
+	if (us->ake_deferred[i].context != context &&
+		ake_before(&(us->ake_deferred[i]), &ake)) {
+	    return 0;
+	}
+    }
+
+    /* This DH-Commit replaces any earlier one held back for it */
+    otrl_userstate_ake_forget(us, context);
+    us->ake_inflight[us->ake_inflight_used++] = ake;
+    return 1;
+}
+
+/* Hold back the DH-Commit msg of the given protocol version that the
+ * given context received, until otrl_userstate_ake_next lets it in.
+ * trusted says whether the correspondent has a trusted fingerprint,
+ * and seen when we last sent to them.  If the queue is full, the least
+ * deserving DH-Commit in it is dropped, which may be this one.  The
+ * caller must hold the userstate's write lock.  Return 0 if msg was
+ * held back, or -1 if it was dropped. */
+int otrl_userstate_ake_defer(OtrlUserState us, ConnContext *context,
+	const char *msg, unsigned int version, int trusted, time_t seen,
+	time_t now)
+{
+    struct s_OtrlAke ake;
+    unsigned int i;
+
+    ake.context = context;
+    ake.when = now;
+    ake.trusted = trusted;
+    ake.seen = seen;
+    ake.msg = strdup(msg);
+    ake.version = version;
+    if (ake.msg == NULL) {
+	otrl_stats_add(us->stats.akes_shed, 1);
+	return -1;
+    }
+
+    /* A resent DH-Commit keeps the place of the one it replaces */
+    for (i = 0; i < us->ake_deferred_used; ++i) {
+	if (us->ake_deferred[i].context == context) {
+	    ake.when = us->ake_deferred[i].when;
+	    free(us->ake_deferred[i].msg);
+	    us->ake_deferred[i] = ake;
+	    return 0;
+	}
+    }
+
+    if (us->ake_deferred_used == us->ake_max_deferred) {
+	i = us->ake_deferred_used > 0 ? ake_deferred_find(us, 0) : 0;
+	if (us->ake_deferred_used == 0 ||
+		!ake_before(&ake, &(us->ake_deferred[i]))) {
+	    free(ake.msg);
+	    otrl_stats_add(us->stats.akes_shed, 1);
+	    return -1;
+	}
+	ake_deferred_drop(us, i);
+	otrl_stats_add(us->stats.akes_shed, 1);
+    }
+
+    us->ake_deferred[us->ake_deferred_used++] = ake;
+    otrl_stats_add(us->stats.akes_deferred, 1);
+    return 0;
+}
+
+/* If there is room for another AKE, take the most deserving held-back
+ * DH-Commit out of the queue, count its AKE as in flight from now, and
+ * return its context, with the message (which the caller must free())
+ * in *msgp and its version in *versionp.  Otherwise, return NULL.
+ * AKEs let in and DH-Commits held back before expire_before are
+ * forgotten first.  The caller must hold the userstate's write lock. */
+ConnContext *otrl_userstate_ake_next(OtrlUserState us, time_t now,
+	time_t expire_before, char **msgp, unsigned int *versionp)
+{
+    struct s_OtrlAke ake;
+    unsigned int i;
+
+    ake_expire(us, expire_before);
+    if (us->ake_deferred_used == 0 ||
+	    us->ake_inflight_used == us->ake_max_inflight) {
+	return NULL;
+    }
+
+    i = ake_deferred_find(us, 1);
+    ake = us->ake_deferred[i];
+    us->ake_deferred[i] = us->ake_deferred[--us->ake_deferred_used];
+    *msgp = ake.msg;
+    *versionp = ake.version;
+
+    ake.when = now;
+    ake.msg = NULL;
+    us->ake_inflight[us->ake_inflight_used++] = ake;
+    return ake.context;
+}
+
+/* Return the context otrl_userstate_ake_next would return, without
+ * taking its DH-Commit out of the queue, or NULL if it would return
+ * NULL.  AKEs let in and DH-Commits held back before expire_before are
+ * forgotten first.  The caller must hold the userstate's write lock. */
+ConnContext *otrl_userstate_ake_peek(OtrlUserState us,
+	time_t expire_before)
+{
+    ake_expire(us, expire_before);
+    if (us->ake_deferred_used == 0 ||
+	    us->ake_inflight_used == us->ake_max_inflight) {
+	return NULL;
+    }
+    return us->ake_deferred[ake_deferred_find(us, 1)].context;
+}
+
+/* Stop counting the given context's AKE as in flight, if it is.  The
+ * caller must hold the userstate's write lock. */
+void otrl_userstate_ake_release(OtrlUserState us, ConnContext *context)
+{
+    unsigned int i;
+
+    for (i = 0; i < us->ake_inflight_used; ++i) {
+	if (us->ake_inflight[i].context == context) {
+	    us->ake_inflight[i] = us->ake_inflight[--us->ake_inflight_used];
+	    return;
+	}
+    }
+}
+
+/* Forget the given context's AKE in flight and any DH-Commit held back
+ * for it.  The caller must hold the userstate's write lock. */
+void otrl_userstate_ake_forget(OtrlUserState us, ConnContext *context)
+{
+    unsigned int i;
+
+    otrl_userstate_ake_release(us, context);
+    for (i = 0; i < us->ake_deferred_used; ++i) {
+	if (us->ake_deferred[i].context == context) {
+	    ake_deferred_drop(us, i);
+	    return;
+	}
+    }
+}
+
+/* Empty the given OtrlUserState's deadline heap, its AKE admission
+ * lists, its heartbeat queue and its lists of changes waiting all at
+ * once, because all of its contexts are being forgotten together.  The
+ * caller must hold the userstate's write lock. */
+void otrl_userstate_contexts_forgotten(OtrlUserState us)
+{
+    unsigned int i;
+
+    us->deadlines_used = 0;
+    us->ake_inflight_used = 0;
+    for (i = 0; i < us->ake_deferred_used; ++i) {
+	free(us->ake_deferred[i].msg);
+    }
+    us->ake_deferred_used = 0;
+    us->heartbeat_head = NULL;
+    us->heartbeat_tail = &(us->heartbeat_head);
+    us->changed_contexts = NULL;
+    us->changed_fingerprints = NULL;
+}
+
+/* Return the copy of str interned in the given OtrlUserState, creating
+ * it if necessary, and take a reference to it.  Identical strings
+ * interned in the same userstate are returned at the same address, so
+ * they can be compared by pointer.  Return NULL if out of memory.  The
+ * result must be released with otrl_userstate_intern_release, not
+ * free(). */
+char *otrl_userstate_intern(OtrlUserState us, const char *str)
+{
+    unsigned int hash = intern_hash(str);
+    OtrlInternedString *entry = intern_lookup(us, str, hash);
+    OtrlInternedString **bucket;
+    size_t len;
+
+    if (entry) {
+	++entry->refcount;
+	return entry->str;
+    }
+
+    if (intern_grow(us)) return NULL;
+
+    len = strlen(str);
+    entry = malloc(offsetof(OtrlInternedString, str) + len + 1);
+    if (entry == NULL) return NULL;
+    entry->us = us;
+    entry->hash = hash;
+    entry->refcount = 1;
+    memmove(entry->str, str, len + 1);
+
+    bucket = &(us->intern_table[hash & (us->intern_table_size - 1)]);
+    entry->next = *bucket;
+    *bucket = entry;
+    ++us->intern_table_used;
+
+    return entry->str;
+}
+
+/* Return the copy of str interned in the given OtrlUserState, or NULL
+ * if there is none.  No reference is taken. */
+char *otrl_userstate_intern_find(OtrlUserState us, const char *str)
+{
+    OtrlInternedString *entry = intern_lookup(us, str, intern_hash(str));
+
+    return entry ? entry->str : NULL;
+}
+
+/* Drop a reference to a string returned by otrl_userstate_intern.  The
+ * string is freed when its last reference goes away. */
+void otrl_userstate_intern_release(char *str)
+{
+    OtrlInternedString *entry, **entryp;
+    OtrlUserState us;
+
+    if (str == NULL) return;
+
+    entry = (OtrlInternedString *)(str - offsetof(OtrlInternedString, str));
+    if (--entry->refcount > 0) return;
+
+    us = entry->us;
+    for (entryp = &(us->intern_table[entry->hash &
+		(us->intern_table_size - 1)]);
+	    *entryp; entryp = &((*entryp)->next)) {
+	if (*entryp == entry) {
+	    *entryp = entry->next;
+	    break;
+	}
+    }
+    --us->intern_table_used;
+    free(entry);
+}
@@ -23,16 +23,274 @@
 
 typedef struct s_OtrlUserState* OtrlUserState;
 
+/* A string shared by all the contexts of a userstate that use it */
+typedef struct s_OtrlInternedString {
+    struct s_OtrlInternedString *next;  /* The next string in the bucket */
+    OtrlUserState us;                   /* The userstate we belong to */
+    unsigned int hash;                  /* The hash of str */
+    unsigned int refcount;              /* How many users str has */
+    char str[1];                        /* The string itself */
+} OtrlInternedString;
+
 #include "instag.h"
 #include "context.h"
 #include "privkey-t.h"
 
+/* The privkey and instance tag of one accountname/protocol in a
+ * userstate's account table.  Entries stay put until the userstate is
+ * freed, so a pointer to one can be kept. */
+typedef struct s_OtrlAccount {
+    struct s_OtrlAccount *next;    /* The next entry in the bucket */
+    unsigned int hash;             /* The hash of accountname/protocol */
+    char *accountname;
+    char *protocol;
+    OtrlPrivKey *privkey;          /* The first in privkey_root for this
+				      account, or NULL */
+    unsigned int privkey_count;    /* How many are in privkey_root */
+    OtrlPendingPrivKey *pending;   /* The key being generated for this
+				      account, or NULL */
+    OtrlInsTag *instag;            /* The first in instag_root for this
+				      account, or NULL */
+    unsigned int instag_count;     /* How many are in instag_root */
+    char *querymsg;                /* The default OTR Query message for
+				      this account, or NULL */
+    size_t querymsg_len;           /* Its length */
+    unsigned int querymsg_policy;  /* The OtrlPolicy it was made for */
+    char *tag;                     /* The whitespace tag, or NULL */
+    size_t tag_len;                /* Its length */
+    unsigned int tag_policy;       /* The OtrlPolicy it was made for */
+} OtrlAccount;
+
+/* The phases of the protocol otrl_userstate_set_trace can time */
+typedef enum {
+    OTRL_TRACE_CREATE_DATA,        /* Encrypting a Data message */
+    OTRL_TRACE_ACCEPT_DATA,        /* Decrypting a Data message */
+    OTRL_TRACE_DH_SESSION,         /* Deriving a D-H session's keys */
+    OTRL_TRACE_AUTH_COMMIT,        /* Handling each AKE message */
+    OTRL_TRACE_AUTH_KEY,
+    OTRL_TRACE_AUTH_REVEALSIG,
+    OTRL_TRACE_AUTH_SIGNATURE,
+    OTRL_TRACE_AUTH_V1_KEYEXCH,
+    OTRL_TRACE_SM_STEP1,           /* Each step of the SMP */
+    OTRL_TRACE_SM_STEP2A,
+    OTRL_TRACE_SM_STEP2B,
+    OTRL_TRACE_SM_STEP3,
+    OTRL_TRACE_SM_STEP4,
+    OTRL_TRACE_SM_STEP5
+} OtrlTracePhase;
+
+/* Called by otrl_userstate_set_trace's tracing with the phase that has
+ * just ended in the given context, the sizes of its input and output
+ * (0 if it has none), and when it started and ended, in nanoseconds of
+ * the monotonic clock.  For OTRL_TRACE_CREATE_DATA and
+ * OTRL_TRACE_ACCEPT_DATA, the plaintext (with its TLVs) is the input
+ * or output respectively; for the AKE and SMP phases, they're the
+ * message received and the message to send in reply. */
+typedef void (*OtrlTraceCallback)(void *data, OtrlTracePhase phase,
+	struct context *context, size_t insize, size_t outsize,
+	unsigned long long start_ns, unsigned long long end_ns);
+
+typedef enum {
+    OTRL_CONVERT_SENDING,
+    OTRL_CONVERT_RECEIVING
+} OtrlConvertType;
+
+/* What an OtrlConvertInplace returns for a context none of whose
+ * messages need converting */
+#define OTRL_CONVERT_NEVER ((size_t)-1)
+
+/* Converts a message where it is, for
+ * otrl_userstate_set_convert_inplace.  buf holds *lenp bytes followed
+ * by a NUL and has room for bufsize bytes in all.  Return 0 once done,
+ * with the new length (less than bufsize) in *lenp; leave buf and
+ * *lenp alone if there's nothing to convert.  If the converted message
+ * won't fit, return the size of buffer it needs without changing buf,
+ * and you'll be called again with one that big.  Return
+ * OTRL_CONVERT_NEVER if no message of this context will need
+ * converting, and you won't be called for it again until its
+ * conversation has ended. */
+typedef size_t (*OtrlConvertInplace)(void *opdata, struct context *context,
+	OtrlConvertType convert_type, char *buf, size_t *lenp,
+	size_t bufsize);
+
+struct s_fingerprint;              /* Forward declare */
+
+/* Tells the application, for otrl_userstate_set_coalesced_changes,
+ * about the contexts that have been added or have changed state, and
+ * the fingerprints that have been added or given a new trust, since
+ * the last call.  The arrays are only valid during the call.  If out of
+ * memory, it's called with NULL arrays (but the right numbers),
+ * meaning "some of them". */
+typedef void (*OtrlCoalescedChanges)(void *opdata,
+	struct context **contexts, size_t ncontexts,
+	struct s_fingerprint **fingerprints, size_t nfingerprints);
+
+/* Room for each OtrlMessageState and OtrlMessageEvent in
+ * OtrlUserStateStats */
+#define OTRL_STATS_NUM_MSGSTATES 3
+#define OTRL_STATS_NUM_MSGEVENTS 16
+
+/* The operational counters of an OtrlUserState, as returned by
+ * otrl_userstate_stats.  All but contexts, contexts_hibernated and
+ * retransmit_bytes count from the creation of the userstate. */
+typedef struct s_OtrlUserStateStats {
+    unsigned long contexts[OTRL_STATS_NUM_MSGSTATES];  /* Contexts in
+							  each msgstate */
+    unsigned long contexts_hibernated;  /* Contexts holding no session
+					   keys */
+    unsigned long akes_started;    /* AKEs we started or answered */
+    unsigned long akes_completed;  /* AKEs that went secure */
+    unsigned long akes_expired;    /* AKEs otrl_message_poll gave up on */
+    unsigned long akes_deferred;   /* DH-Commits held back by the AKE
+				      admission control */
+    unsigned long akes_shed;       /* Held-back DH-Commits dropped
+				      without an answer */
+    unsigned long fragments_accumulated;  /* Fragments held on to */
+    unsigned long fragments_dropped;  /* Fragments thrown away before
+					 their message was complete */
+    unsigned long receive_errors[OTRL_STATS_NUM_MSGEVENTS];  /* Received
+				      messages that could not be used,
+				      by the OtrlMessageEvent reported */
+    unsigned long long bytes_encrypted;  /* Plaintext bytes sent in Data
+					    messages */
+    unsigned long long bytes_decrypted;  /* Plaintext bytes received in
+					    Data messages */
+    unsigned long dh_keygens;      /* D-H keypairs generated, by the
+				      whole process */
+    unsigned long modexps;         /* Modular exponentiations done, by
+				      the whole process */
+    size_t secure_high_water_bytes;  /* The most secure memory the
+					process has had in use */
+    size_t retransmit_bytes;       /* Bytes of the messages we sent
+				      that are kept now in case they
+				      need retransmitting */
+    unsigned long retransmits_dropped;  /* Such copies not kept, or
+					   thrown away early, because of
+					   the retransmit limits */
+    unsigned long heartbeats_sent; /* Heartbeats sent */
+    unsigned long heartbeats_suppressed;  /* Queued heartbeats that
+					     something else we sent made
+					     unnecessary */
+} OtrlUserStateStats;
+
 struct s_OtrlUserState {
     ConnContext *context_root;
+    ConnContext **context_index;   /* Hash index of the first context in
+				      context_root for each
+				      username/accountname/protocol */
+    size_t context_index_size;     /* Number of buckets (a power of 2) */
+    size_t context_index_used;     /* Number of indexed contexts */
+    struct s_fingerprint **fingerprint_table;  /* Hash table of the
+						  fingerprints of all
+						  the master contexts */
+    size_t fingerprint_table_size; /* Number of buckets (a power of 2) */
+    size_t fingerprint_table_used; /* Number of fingerprints */
+    ConnContext *context_last_added;  /* The master context added most
+					 recently, where the search for
+					 the place of the next one starts
+					 if it sorts after it */
+    OtrlInternedString **intern_table;  /* Hash table of interned
+					   strings */
+    size_t intern_table_size;      /* Number of buckets (a power of 2) */
+    size_t intern_table_used;      /* Number of interned strings */
+    int context_slab;              /* Allocate new contexts from slabs? */
+    struct s_OtrlContextSlab *context_slab_root;  /* The slabs */
+    ConnContext *context_slab_free;  /* Free list of slab blocks */
+    DH_keypool *dh_keypool;        /* Pre-generated D-H keypairs, or
+				      NULL */
+    size_t fragment_max_len;       /* Most bytes of a fragmented message
+				      to hold on to, or 0 for no limit */
+    unsigned int fragment_timeout; /* Seconds to wait for the rest of a
+				      fragmented message, or 0 to wait
+				      forever */
+    size_t retransmit_max_len;     /* Longest message to keep a copy of
+				      for retransmission, or 0 for no
+				      limit */
+    size_t retransmit_max_total;   /* Most bytes of such copies to keep
+				      in all, or 0 for no limit */
+    unsigned int retransmit_timeout;  /* Seconds to keep a copy, or 0 to
+					 keep it until the next message
+					 replaces it */
+    size_t retransmit_bytes;       /* Bytes of copies kept now */
+    OtrlAccount **account_table;   /* Hash table of the accounts in
+				      privkey_root and instag_root */
+    size_t account_table_size;     /* Number of buckets (a power of 2) */
+    size_t account_table_used;     /* Number of entries */
     OtrlPrivKey *privkey_root;
     OtrlInsTag *instag_root;
     OtrlPendingPrivKey *pending_root;
-    int timer_running;
+    OtrlPrivKeyIndex *privkey_index_root;
+    char *privkey_index_file;      /* The file the privkeys in
+				      privkey_index_root are in */
+    unsigned int timer_running;    /* The interval timer_control last
+				      set, or 0 if the timer is off */
+    struct s_OtrlUserStateLock *lock;  /* The locks of the threaded mode,
+					  or NULL if it's off */
+    struct s_OtrlOffload *offload; /* Where otrl_message_receiving_offload
+				      handles expensive messages, or
+				      NULL */
+    struct s_OtrlDeadline *deadlines;  /* Min-heap of the contexts that
+					  otrl_message_poll has to look
+					  at, by when */
+    size_t deadlines_size;         /* Number of entries allocated */
+    size_t deadlines_used;         /* Number of entries in the heap */
+    struct s_OtrlFingerprintStore *fpstore;  /* The binary fingerprint
+						store the master contexts
+						load from, or NULL */
+    struct s_OtrlKeyStore *keystore;  /* The shared privkeys and instance
+					 tags to fall back on, or NULL */
+    unsigned int ake_max_inflight; /* Most DH-Commits to be answering
+				      at once, or 0 for no limit */
+    unsigned int ake_max_deferred; /* Most DH-Commits to hold back while
+				      at that limit */
+    struct s_OtrlAke *ake_inflight;  /* The AKEs being answered */
+    unsigned int ake_inflight_used;  /* Number of them */
+    struct s_OtrlAke *ake_deferred;  /* The DH-Commits held back */
+    unsigned int ake_deferred_used;  /* Number of them */
+    unsigned int heartbeat_delay;  /* Seconds a heartbeat waits in the
+				      queue, for a message of the user's
+				      to make it unnecessary */
+    unsigned int heartbeat_max;    /* Most heartbeats otrl_message_poll
+				      sends each time, or 0 to send them
+				      straight away instead */
+    ConnContext *heartbeat_head;   /* The queue of contexts with a
+				      heartbeat to send, oldest first */
+    ConnContext **heartbeat_tail;  /* Where the next one goes */
+    int changes_held;              /* Hold back update_context_list and
+				      write_fingerprints for
+				      otrl_message_poll? */
+    unsigned int changes_debounce; /* Seconds to hold them back for */
+    time_t changes_due;            /* When otrl_message_poll is to tell
+				      the application about the changes
+				      held back, or 0 if there are
+				      none */
+    OtrlCoalescedChanges coalesced_changes;  /* What it tells, or NULL
+						to call
+						update_context_list and
+						write_fingerprints */
+    ConnContext *changed_contexts; /* The contexts added or changed
+				      since */
+    struct s_fingerprint *changed_fingerprints;  /* The fingerprints
+						    added or given a new
+						    trust since */
+    unsigned int hibernate_idle;   /* Seconds a context that isn't
+				      encrypted may sit idle before
+				      otrl_message_poll frees its session
+				      keys, or 0 to keep them */
+    time_t hibernate_next;         /* When otrl_message_poll next looks
+				      for idle contexts */
+    unsigned int pubkey_cache_max; /* Most public keys to cache, or 0 to
+				      cache none */
+    unsigned int pubkey_cache_used;  /* Number of keys cached */
+    struct s_OtrlPubKey *pubkey_lru_head;  /* The cached key used most
+					      recently */
+    struct s_OtrlPubKey *pubkey_lru_tail;  /*  ...and least recently */
+    OtrlUserStateStats stats;      /* The counters; contexts is unused */
+    OtrlTraceCallback trace;       /* Called after each traced phase,
+				      or NULL */
+    void *trace_data;              /* The data to pass it */
+    OtrlConvertInplace convert_inplace;  /* Used instead of the
+					    convert_msg op, or NULL */
 };
 
 /* Create a new OtrlUserState.  Most clients will only need one of
@@ -48,4 +306,347 @@ OtrlUserState otrl_userstate_create(void);
 stop it before freeing the userstate. */
 void otrl_userstate_free(OtrlUserState us);
 
+/* Choose whether new contexts in the given OtrlUserState are allocated
+ * from slabs, which keep each context, its private part and its SM
+ * state together in one block and recycle the blocks of forgotten
+ * contexts.  This is off by default; contexts that already exist are
+ * not affected. */
+void otrl_userstate_set_context_slab(OtrlUserState us, int enabled);
+
+/* Give the given OtrlUserState a pool of up to size pre-generated D-H
+ * keypairs, which the AKE and key rotation will take from before
+ * generating fresh ones.  A size of 0 removes the pool.  The pool
+ * starts out empty; fill it with otrl_userstate_refill_dh_keypool.
+ * Return 0 on success, or -1 if out of memory. */
+int otrl_userstate_set_dh_keypool(OtrlUserState us, unsigned int size);
+
+/* Generate up to max keypairs into the given OtrlUserState's D-H
+ * keypool, if it has one.  This is expensive, so call it from an idle
+ * callback, or from a thread of your own; it is safe to do the latter
+ * while the userstate is being used for other things, but not to
+ * remove or resize the pool at the same time.  Return the number of
+ * keypairs added. */
+unsigned int otrl_userstate_refill_dh_keypool(OtrlUserState us,
+	unsigned int max);
+
+/* Work out the D-H Commit Message material for up to max of the
+ * contexts in the given OtrlUserState that are likely to start an AKE
+ * again soon (master contexts that aren't encrypted or in an AKE, but
+ * have a trusted fingerprint, so have been encrypted before) and don't
+ * already have some prepared.  An AKE any of them starts in the next
+ * lifetime seconds then sends its first message without doing any
+ * cryptography.  This is expensive, so call it from an idle callback,
+ * or from a thread of your own while the userstate is being used for
+ * other things.  Return the number of contexts prepared. */
+unsigned int otrl_userstate_prepare_akes(OtrlUserState us, unsigned int max,
+	unsigned int lifetime);
+
+/* Keep up to size of the DSA public keys the AKE verifies signatures
+ * with in the given OtrlUserState, already parsed, so that repeat AKEs
+ * with the same contacts don't parse them again.  The least recently
+ * used key is dropped to make room.  A size of 0, the default, turns
+ * the cache off and empties it. */
+void otrl_userstate_set_pubkey_cache(OtrlUserState us, unsigned int size);
+
+/* Limit how the contexts in the given OtrlUserState reassemble
+ * fragmented messages.  A message whose fragments add up to more than
+ * maxlen bytes is thrown away, as is one that isn't complete within
+ * timeout seconds of its first fragment arriving (the check happens
+ * when another fragment arrives, or in otrl_message_poll).  0 means no
+ * limit, which is the default for both. */
+void otrl_userstate_set_fragment_limits(OtrlUserState us, size_t maxlen,
+	unsigned int timeout);
+
+/* Limit the copies the contexts in the given OtrlUserState keep in
+ * secure memory of the last message they sent, in case it has to be
+ * sent again after an error or a new AKE.  A message longer than
+ * maxlen bytes isn't kept, nor is one that would take the copies kept
+ * by all the contexts over maxtotal bytes, and a copy is thrown away
+ * timeout seconds after its message was sent (from otrl_message_poll).
+ * Such a message just won't be retransmitted.  libotr only
+ * retransmits messages sent within the last minute, so a longer
+ * timeout changes nothing.  0 means no limit, which is the default for
+ * all three.  Limits only apply to copies made from then on. */
+void otrl_userstate_set_retransmit_limits(OtrlUserState us, size_t maxlen,
+	size_t maxtotal, unsigned int timeout);
+
+/* Choose whether the given OtrlUserState may be used from several
+ * threads at once.  In the threaded mode, its lists of contexts,
+ * private keys and instance tags are protected by a reader-writer lock,
+ * and each master context and its children (its "family") share a
+ * mutex, which otrl_message_sending, otrl_message_receiving and the
+ * other otrl_message_* routines hold while they work on that family.
+ * Conversations with different correspondents can then be handled in
+ * parallel.
+ *
+ * Only switch the threaded mode on or off while no other thread is
+ * using the userstate.  Return 0 on success, or -1 if out of memory or
+ * if this libotr was built without thread support.
+ *
+ * In the threaded mode:
+ *  - A family's mutex is recursive, so callbacks may call back into
+ *    libotr for the same family.  They must not block waiting for
+ *    another thread that is working on a different family.
+ *  - The application must hold the family lock (otrl_context_lock)
+ *    while it looks at or changes a context itself, and the userstate's
+ *    read lock (otrl_userstate_rdlock) while it walks context_root,
+ *    privkey_root or instag_root.
+ *  - Always take a family lock before the userstate's lock, never the
+ *    other way round.
+ *  - otrl_privkey_forget, otrl_instag_forget and otrl_context_set_trust
+ *    must be called with the write lock held, and nothing may be
+ *    forgotten while another thread is still using it, nor a context
+ *    while this thread holds its family lock.  otrl_context_forget and
+ *    otrl_context_forget_account keep any family whose lock another
+ *    thread holds.
+ *  - The timer_control and app_data_free callbacks are called with the
+ *    userstate's write lock held, and so must not call back into
+ *    libotr. */
+int otrl_userstate_set_threaded(OtrlUserState us, int enabled);
+
+/* Choose where otrl_message_receiving_offload handles the messages
+ * that need expensive public-key operations (the AKE messages, and the
+ * Data Messages of an SMP): on an application's own thread pool, by
+ * passing it to submit(submitdata, run, job), which must arrange for
+ * run(job) to be called on some other thread; or, if submit is NULL,
+ * on a pool of the given number of threads of libotr's own.  Passing
+ * threads = 0 and submit = NULL turns offloading off again, after
+ * waiting for any messages still being handled.  Turning offloading on
+ * also turns on the threaded mode (see otrl_userstate_set_threaded).
+ * Return 0 on success, or -1 if out of memory or if this libotr was
+ * built without thread support. */
+int otrl_userstate_set_offload(OtrlUserState us, unsigned int threads,
+	void (*submit)(void *submitdata, void (*run)(void *job), void *job),
+	void *submitdata);
+
+/* Take the given OtrlUserState's read lock, or its write lock, or
+ * release whichever one this thread holds.  These do nothing unless the
+ * threaded mode is on.  The locks are not recursive. */
+void otrl_userstate_rdlock(OtrlUserState us);
+void otrl_userstate_wrlock(OtrlUserState us);
+void otrl_userstate_unlock(OtrlUserState us);
+
+/* Make sure otrl_message_poll looks at the given context once the time
+ * when has come, because an AKE or a fragmented message may expire
+ * then.  A context already waiting for an earlier time keeps it.  The
+ * caller must hold the userstate's write lock.  Return 0 on success,
+ * or -1 if out of memory. */
+int otrl_userstate_deadline_add(OtrlUserState us, ConnContext *context,
+	time_t when);
+
+/* Stop otrl_message_poll looking at the given context.  The caller
+ * must hold the userstate's write lock. */
+void otrl_userstate_deadline_remove(OtrlUserState us, ConnContext *context);
+
+/* Return the earliest time at which otrl_message_poll has a context to
+ * look at, or 0 if there is none. */
+time_t otrl_userstate_deadline_next(OtrlUserState us);
+
+/* Take the context with the earliest deadline out of the heap and
+ * return it, if that deadline is no later than now; else return NULL.
+ * The caller must hold the userstate's write lock. */
+ConnContext *otrl_userstate_deadline_pop(OtrlUserState us, time_t now);
+
+/* Return the entry for the given accountname/protocol in the given
+ * OtrlUserState's account table.  If there is none, add one if
+ * add_if_missing is set, or else return NULL; NULL is also returned if
+ * out of memory.  The caller must hold the userstate's lock (the write
+ * lock, if add_if_missing is set). */
+/* Limit how many incoming AKEs the given OtrlUserState answers at
+ * once, so that a burst of DH-Commits (everyone reconnecting after a
+ * network outage, say) doesn't hold up everything else behind their
+ * public-key operations.  Once max_inflight AKEs answered with a
+ * DH-Key message haven't finished (or timed out), up to max_deferred
+ * further DH-Commits are held back, and answered from
+ * otrl_message_poll as room comes up: those from correspondents with a
+ * trusted fingerprint first, then those we last sent to most recently,
+ * then the ones that have waited longest.  The least deserving are
+ * dropped when the queue is full, and any still waiting when their
+ * sender would have given up.  While DH-Commits are held back, the
+ * timer_control callback is asked to call otrl_message_poll every
+ * second.  A max_inflight of 0, the default, means no limit, and drops
+ * anything held back.  Return 0 on success, or -1 if out of memory. */
+int otrl_userstate_set_ake_admission(OtrlUserState us,
+	unsigned int max_inflight, unsigned int max_deferred);
+
+/* Have the contexts in the given OtrlUserState queue the heartbeats
+ * they send (to rotate keys when a correspondent who sends to us
+ * hasn't heard from us for a while) for otrl_message_poll to send, at
+ * most max_per_poll each time, instead of sending them while
+ * receiving a message.  A heartbeat waits at least delay seconds, and
+ * isn't sent at all if we send something else in the meantime.  While
+ * heartbeats are queued, the timer_control callback is asked to call
+ * otrl_message_poll when the next one is due.  A max_per_poll of 0, the
+ * default, sends heartbeats straight away, as before; any already
+ * queued are still sent from otrl_message_poll. */
+void otrl_userstate_set_heartbeat_deferral(OtrlUserState us,
+	unsigned int delay, unsigned int max_per_poll);
+
+/* Queue a heartbeat for the given context, due at when, unless it
+ * already has one queued.  The caller must hold the userstate's write
+ * lock. */
+void otrl_userstate_heartbeat_queue(OtrlUserState us, ConnContext *context,
+	time_t when);
+
+/* Take the context with the oldest heartbeat out of the queue and
+ * return it, if that heartbeat is due by now; else return NULL.  The
+ * caller must hold the userstate's write lock. */
+ConnContext *otrl_userstate_heartbeat_next(OtrlUserState us, time_t now);
+
+/* Take the given context's heartbeat out of the queue, if it has one
+ * there.  The caller must hold the userstate's write lock. */
+void otrl_userstate_heartbeat_forget(OtrlUserState us,
+	ConnContext *context);
+
+/* Have the given OtrlUserState hold back the update_context_list and
+ * write_fingerprints calls that adding a context or fingerprint, or a
+ * change of state or trust, would make, and instead have
+ * otrl_message_poll make one call for all the changes, debounce
+ * seconds after the first of them.  That call is to the callback given
+ * to otrl_userstate_set_coalesced_changes, with the contexts and
+ * fingerprints that changed, if there is one; or else to
+ * update_context_list and write_fingerprints, once each.  The timer_control callback is asked to call otrl_message_poll
+ * when that's due.  If enabled is 0, the default, the calls are made
+ * straight away, as before. */
+void otrl_userstate_set_change_coalescing(OtrlUserState us, int enabled,
+	unsigned int debounce);
+
+/* Have otrl_message_poll hand the changes the given OtrlUserState holds
+ * back to coalesced_changes, with the opdata passed to it, instead of
+ * calling update_context_list and write_fingerprints; or go back to
+ * those if coalesced_changes is NULL, the default. */
+void otrl_userstate_set_coalesced_changes(OtrlUserState us,
+	OtrlCoalescedChanges coalesced_changes);
+
+/* Note that the given context, if non-NULL, and the given fingerprint,
+ * if non-NULL, have changed, for otrl_message_poll to tell about by
+ * when.  when is ignored if there are already changes waiting.  The
+ * caller must hold the userstate's write lock. */
+void otrl_userstate_changed(OtrlUserState us, ConnContext *context,
+	struct s_fingerprint *fprint, time_t when);
+
+/* Take the given context, which is being forgotten, out of the changes
+ * waiting.  The caller must hold the userstate's write lock. */
+void otrl_userstate_changed_context_forget(OtrlUserState us,
+	ConnContext *context);
+
+/* Take the given fingerprint, which is being forgotten, out of the
+ * changes waiting.  The caller must hold the userstate's write lock. */
+void otrl_userstate_changed_fingerprint_forget(OtrlUserState us,
+	struct s_fingerprint *fprint);
+
+/* If the changes waiting are due by now, take them all out of the
+ * lists, putting the numbers of contexts and fingerprints in
+ * *ncontextsp and *nfingerprintsp, and newly-allocated arrays of them in
+ * *contextsp and *fingerprintsp, or NULL if out of memory, and return
+ * 1.  Otherwise return 0.  The caller must hold the userstate's write
+ * lock. */
+int otrl_userstate_changed_take(OtrlUserState us, time_t now,
+	ConnContext ***contextsp, size_t *ncontextsp,
+	struct s_fingerprint ***fingerprintsp, size_t *nfingerprintsp);
+
+/* Have otrl_message_poll free the session keys of the contexts in the
+ * given OtrlUserState that aren't encrypted and haven't sent or
+ * received anything for idle seconds, to keep the memory of a
+ * userstate with many mostly-idle conversations down.  Such a context
+ * gets its keys back when it next needs them.  While this is on, the
+ * timer_control callback is asked to call otrl_message_poll at least
+ * every idle/2 seconds.  An idle of 0, the default, turns it off.  It
+ * takes effect from the next otrl_message_poll. */
+void otrl_userstate_set_hibernation(OtrlUserState us, unsigned int idle);
+
+/* Let the given context answer a DH-Commit now, if there is room for
+ * another AKE and no more deserving DH-Commit is being held back, and
+ * count its AKE as in flight from now.  trusted and seen rank it as for
+ * otrl_userstate_ake_defer.  AKEs let in before expire_before no longer
+ * count.  The caller must hold the userstate's write lock.  Return 1
+ * if the context may go ahead, or 0 if it should wait. */
+int otrl_userstate_ake_admit(OtrlUserState us, ConnContext *context,
+	int trusted, time_t seen, time_t now, time_t expire_before);
+
+/* Hold back the DH-Commit msg of the given protocol version that the
+ * given context received, until otrl_userstate_ake_next lets it in.
+ * trusted says whether the correspondent has a trusted fingerprint,
+ * and seen when we last sent to them.  If the queue is full, the least
+ * deserving DH-Commit in it is dropped, which may be this one.  The
+ * caller must hold the userstate's write lock.  Return 0 if msg was
+ * held back, or -1 if it was dropped. */
+int otrl_userstate_ake_defer(OtrlUserState us, ConnContext *context,
+	const char *msg, unsigned int version, int trusted, time_t seen,
+	time_t now);
+
+/* If there is room for another AKE, take the most deserving held-back
+ * DH-Commit out of the queue, count its AKE as in flight from now, and
+ * return its context, with the message (which the caller must free())
+ * in *msgp and its version in *versionp.  Otherwise, return NULL.
+ * AKEs let in and DH-Commits held back before expire_before are
+ * forgotten first.  The caller must hold the userstate's write lock. */
+ConnContext *otrl_userstate_ake_next(OtrlUserState us, time_t now,
+	time_t expire_before, char **msgp, unsigned int *versionp);
+
+/* Return the context otrl_userstate_ake_next would return, without
+ * taking its DH-Commit out of the queue, or NULL if it would return
+ * NULL.  AKEs let in and DH-Commits held back before expire_before are
+ * forgotten first.  The caller must hold the userstate's write lock. */
+ConnContext *otrl_userstate_ake_peek(OtrlUserState us,
+	time_t expire_before);
+
+/* Stop counting the given context's AKE as in flight, if it is.  The
+ * caller must hold the userstate's write lock. */
+void otrl_userstate_ake_release(OtrlUserState us, ConnContext *context);
+
+/* Forget the given context's AKE in flight and any DH-Commit held back
+ * for it.  The caller must hold the userstate's write lock. */
+void otrl_userstate_ake_forget(OtrlUserState us, ConnContext *context);
+
+/* Empty the given OtrlUserState's deadline heap, its AKE admission
+ * lists, its heartbeat queue and its lists of changes waiting all at
+ * once, because all of its contexts are being forgotten together.  The
+ * caller must hold the userstate's write lock. */
+void otrl_userstate_contexts_forgotten(OtrlUserState us);
+
+OtrlAccount *otrl_userstate_account_find(OtrlUserState us,
+	const char *accountname, const char *protocol, int add_if_missing);
+
+/* Fill in stats with a snapshot of the operational counters of the
+ * given OtrlUserState.  The counters are cheap enough to be always on;
+ * they're updated without taking the userstate's lock, so a snapshot
+ * taken while other threads are busy may be a few events out of
+ * date. */
+void otrl_userstate_stats(OtrlUserState us, OtrlUserStateStats *stats);
+
+/* Have the given OtrlUserState call trace with data after each phase
+ * of the protocol listed in OtrlTracePhase, with how long it took, or
+ * stop if trace is NULL.  When it's off, tracing costs nothing but a
+ * test at each phase.  trace may be called from the threads of
+ * otrl_userstate_set_offload as well as from yours.  Don't change it
+ * while other threads are using the userstate. */
+void otrl_userstate_set_trace(OtrlUserState us, OtrlTraceCallback trace,
+	void *data);
+
+/* Have the given OtrlUserState convert messages where they are, with
+ * convert_inplace, instead of with the application's convert_msg and
+ * convert_free ops; or go back to those if convert_inplace is NULL,
+ * the default.  convert_inplace is passed the opdata of the call that
+ * sends or receives the message.  Don't change it while other threads
+ * are using the userstate. */
+void otrl_userstate_set_convert_inplace(OtrlUserState us,
+	OtrlConvertInplace convert_inplace);
+
+/* Return the copy of str interned in the given OtrlUserState, creating
+ * it if necessary, and take a reference to it.  Identical strings
+ * interned in the same userstate are returned at the same address, so
+ * they can be compared by pointer.  Return NULL if out of memory.  The
+ * result must be released with otrl_userstate_intern_release, not
+ * free(). */
+char *otrl_userstate_intern(OtrlUserState us, const char *str);
+
+/* Return the copy of str interned in the given OtrlUserState, or NULL
+ * if there is none.  No reference is taken. */
+char *otrl_userstate_intern_find(OtrlUserState us, const char *str);
+
+/* Drop a reference to a string returned by otrl_userstate_intern.  The
+ * string is freed when its last reference goes away. */
+void otrl_userstate_intern_release(char *str);
+
 #endif
@@ -126,6 +126,8 @@ class im_server(threading.Thread):
 
   def run(self):
     serversocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    #Tests are often run back to back, before the last one's port is released
+    serversocket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
     serversocket.bind(('', self.port))
     serversocket.listen(50)
     
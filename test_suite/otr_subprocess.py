@@ -107,7 +107,9 @@ class otr_subprocess(Popen):
     self.protocol = args[offset+2]
     
     print(args)
-    Popen.__init__(self, args, stdin=PIPE, stdout=PIPE, stderr=PIPE, close_fds=True, universal_newlines=True, bufsize=16384)
+    #The replies on stdout are binary: a length with a 0x0d byte in it must
+    #not be turned into a newline
+    Popen.__init__(self, args, stdin=PIPE, stdout=PIPE, stderr=PIPE, close_fds=True, bufsize=16384)
     
     self.querycount = 16 # Unique IDs for async queries to C
     self.querycount_lock = threading.Semaphore()
@@ -210,7 +212,7 @@ class otr_subprocess(Popen):
     
     return msg_id
   
-  def send_msg(self, dst_acc, dst_proto, msg):
+  def send_msg(self, dst_acc, dst_proto, msg, settle=0.1):
     new_msg = bytearray()
     acc_len = len(dst_acc)
     proto_len = len(dst_proto)
@@ -241,7 +243,9 @@ class otr_subprocess(Popen):
     self.stdin.write(new_msg)
     self.stdin.flush()
     
-    time.sleep(0.1)
+    #Tests that time themselves send many messages at once and pass settle=0
+    if settle > 0:
+      time.sleep(settle)
     self.check_error()
     
     return msg_id
@@ -0,0 +1,212 @@
+#!/usr/bin/python
+
+import sys
+import os
+import re
+import time
+from subprocess import Popen, PIPE, STDOUT
+
+from otr_test import *
+
+scaling_protocol = "prpl-aim"
+scaling_privkey = "scaling.private_key"
+scaling_instag = "scaling_instance_tags.txt"
+
+#The load mode of the regression client runs all of its conversations in one
+#process, on one userstate in the threaded mode.  It reports on stderr.
+regression_client = "../tests/regression/client/client"
+regression_key = "../tests/regression/client/otr.key"
+
+load_report_regex = "# load: (\\d+) conversations, (\\d+) messages in ([0-9.]+) s"
+
+def scaling_accountname(i):
+  return "otrscale" + str(i)
+
+def write_scaling_files(num):
+  #Every account gets the first key of otr.private_key and its own instance tag
+  f = open("otr.private_key")
+  blocks = f.read().split(" (account")
+  f.close()
+  block = blocks[1]
+  name = re.search("\\(name ([^)]*)\\)", block).group(1)
+
+  f = open(scaling_privkey, "w")
+  f.write("(privkeys\n")
+  for i in range(num):
+    f.write(" (account" + block.replace("(name " + name + ")", "(name " + scaling_accountname(i) + ")"))
+  f.write(")\n")
+  f.close()
+
+  f = open(scaling_instag, "w")
+  for i in range(num):
+    f.write(scaling_accountname(i) + "\t" + scaling_protocol + "\t%08x\n" % (0x1000 + i))
+  f.close()
+
+def scaling_pairs(num_clients, num_conversations):
+  #Client i starts conversations with the num_conversations clients after it,
+  #wrapping around, and each pair of clients has at most one conversation
+  pairs = []
+  for i in range(num_clients):
+    for k in range(1, num_conversations + 1):
+      j = (i + k) % num_clients
+      if i != j and (i, j) not in pairs and (j, i) not in pairs:
+        pairs.append((i, j))
+  return pairs
+
+class otr_test_scaling(otr_test):
+  #Many 4.0 clients, each with its own account, all talking through one
+  #dummy_im server
+
+  def __init__(self, clients, pairs):
+    otr_test.__init__(self, clients, [])
+    self.pairs = pairs
+    self.degree = [0] * len(clients)
+    for (i, j) in pairs:
+      self.degree[i] += 1
+      self.degree[j] += 1
+
+  def init_processes(self, options={}):
+    for p in self.subprocesses:
+      p.check_error()
+
+    for p in self.subprocesses:
+      c_id = p.send_read_privkey(scaling_privkey)
+      p.get_query_blocking(c_id)
+
+    for p in self.subprocesses:
+      c_id = p.send_read_instag(scaling_instag)
+      p.get_query_blocking(c_id)
+
+    for p in self.subprocesses:
+      c_id = p.send_init()
+      p.get_query_blocking(c_id)
+
+    for p in self.subprocesses:
+      p.check_error()
+
+  def run_akes(self):
+    start = time.time()
+    for (i, j) in self.pairs:
+      self.alices[i].send_msg(self.alices[j].accountname, scaling_protocol, otr_query, 0)
+
+    for i, p in enumerate(self.alices):
+      for k in range(self.degree[i]):
+        p.get_query_blocking(q_gone_secure)
+
+    return time.time() - start
+
+  def run_messages(self, num_msgs):
+    start = time.time()
+    for n in range(num_msgs):
+      for (i, j) in self.pairs:
+        self.alices[i].send_msg(self.alices[j].accountname, scaling_protocol, "scaling %d from %d" % (n, i), 0)
+        self.alices[j].send_msg(self.alices[i].accountname, scaling_protocol, "scaling %d from %d" % (n, j), 0)
+
+    for i, p in enumerate(self.alices):
+      msgs = get_n_messages_blocking(p.querymap[q_otr_msg], num_msgs * self.degree[i])
+      for msg in msgs:
+        check_message_matches_ex(msg, "scaling \\d+ from \\d+", [p])
+
+    return time.time() - start
+
+  def run_test(self, options={}):
+    result = None
+    try:
+      self.init_processes(options)
+      time.sleep(1)
+
+      ake_secs = self.run_akes()
+      time.sleep(1) #Let the last AKE messages settle before timing data
+      chomp_msgs(self.subprocesses, q_otr_msg)
+      chomp_msgs(self.subprocesses, q_raw_msg)
+
+      num_msgs = options.get('num_msgs', 10)
+      msg_secs = self.run_messages(num_msgs)
+      self.check_error_all(options.get('allowed_msg_events', []))
+
+      result = (len(self.pairs) / ake_secs, 2 * num_msgs * len(self.pairs) / msg_secs)
+      print("Test succeeded")
+
+    except (subprocess_exception, otr_test_failed_exception) as e:
+      print '***Exception: ', e, e.value, sys.exc_info()
+      print("Test failed")
+
+    self.reset_processes()
+    for p in self.subprocesses:
+      if p.poll() is None:
+        p.kill()
+    return result
+
+def test_processes(num_clients, num_conversations, num_msgs):
+  pairs = scaling_pairs(num_clients, num_conversations)
+  clients = []
+  for i in range(num_clients):
+    clients.append(otr_subprocess([client_location_40, scaling_accountname(i), scaling_protocol, im_ip, im_port, "scale"+str(i)+".txt"], 0))
+
+  the_test = otr_test_scaling(clients, pairs)
+  options = {}
+  options['num_msgs'] = num_msgs
+  options['allowed_msg_events'] = ["OTRL_MSGEVENT_LOG_HEARTBEAT_SENT", "OTRL_MSGEVENT_LOG_HEARTBEAT_RCVD"]
+  return (len(pairs), the_test.run_test(options))
+
+def test_threads(num_conversations, num_msgs):
+  #The same number of conversations and messages, all in one process
+  if not os.path.exists(regression_client):
+    return None
+
+  load = Popen([regression_client, "--load-key", regression_key, "--load", str(num_conversations),
+                "--max-msg", str(num_msgs), "--rate", "1000"], stdout=PIPE, stderr=STDOUT, close_fds=True)
+  out = load.communicate()[0]
+  match = re.search(load_report_regex, out)
+  if load.returncode != 0 or match is None:
+    return None
+
+  return int(match.group(2)) / float(match.group(3))
+
+def main(args):
+  max_clients = 16
+  num_conversations = 2
+  num_msgs = 10
+
+  if len(args) > 1:
+    max_clients = int(args[1])
+  if len(args) > 2:
+    num_conversations = int(args[2])
+  if len(args) > 3:
+    num_msgs = int(args[3])
+
+  server = im_server(int(im_port))
+  server.daemon = True
+  server.start()
+
+  write_scaling_files(max_clients)
+
+  rows = []
+  num_clients = 2
+  while num_clients <= max_clients:
+    print('Testing ' + str(num_clients) + ' processes with ' + str(num_conversations) + ' conversations each')
+    (num_pairs, result) = test_processes(num_clients, num_conversations, num_msgs)
+    threads_rate = test_threads(num_pairs, 2 * num_msgs * num_pairs)
+    rows.append((num_clients, num_pairs, result, threads_rate))
+    time.sleep(1)
+    num_clients *= 2
+
+  print('%9s %13s %9s %9s %18s' % ('processes', 'conversations', 'AKEs/s', 'msgs/s', 'one process msgs/s'))
+  for (num_clients, num_pairs, result, threads_rate) in rows:
+    if result is None:
+      procs = ('%9s %9s' % ('failed', 'failed'))
+    else:
+      procs = ('%9.1f %9.1f' % result)
+    if threads_rate is None:
+      threads = '-'
+    else:
+      threads = '%.1f' % threads_rate
+    print('%9d %13d %s %18s' % (num_clients, num_pairs, procs, threads))
+
+  os.remove(scaling_privkey)
+  os.remove(scaling_instag)
+  server.set_finished()
+  print("Shutting down...")
+
+if __name__ == "__main__":
+  main(sys.argv)
@@ -0,0 +1,677 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Micro-benchmarks for libotr.  Each benchmark runs enough iterations to
+ * take at least the minimum time (-t, in milliseconds), and the results
+ * are written to stdout as JSON, so that two runs can be compared.  For
+ * each iteration, they give the time, the number of heap allocations
+ * (malloc, calloc and realloc calls, where they can be counted) and the
+ * number of blocks handed out by libotr's libgcrypt allocation
+ * handlers.
+ *
+ * Usage: otr_bench [-t ms] [-f filter] keyfile
+ *
+ * The keyfile must hold private keys for the accounts "alice" and "bob"
+ * of the protocol "otr-test", as tests/regression/client/otr.key does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <proto.h>
+#include <mem.h>
+#include <b64.h>
+#include <dh.h>
+#include <sm.h>
+#include <context.h>
+#include <instag.h>
+#include <message.h>
+#include <privkey.h>
+#include <userstate.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define PROTOCOL "otr-test"
+
+#ifdef __GLIBC__
+/* Count heap allocations, both ours and those made by libotr and
+ * libgcrypt, by standing in for the allocator that glibc uses. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long alloc_count;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+static unsigned long alloc_count;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+/* The timer of the benchmark being run */
+static double min_time = 0.5;
+static int timer_running;
+static struct timespec timer_start;
+static double timer_elapsed;
+static unsigned long timer_alloc_start;
+static unsigned long timer_allocs;
+static unsigned long timer_gcry_alloc_start;
+static unsigned long timer_gcry_allocs;
+static int bench_count;
+
+static unsigned long gcry_alloc_count(void)
+{
+	OtrlMemStats stats;
+	unsigned long count;
+	int i;
+
+	otrl_mem_get_stats(&stats);
+	count = stats.large_allocs;
+	for (i = 0; i < OTRL_MEM_NUM_CLASSES; i++) {
+		count += stats.class_allocs[i];
+	}
+	return count;
+}
+
+static void bench_start_timer(void)
+{
+	if (!timer_running) {
+		timer_running = 1;
+		timer_alloc_start = alloc_count;
+		timer_gcry_alloc_start = gcry_alloc_count();
+		clock_gettime(CLOCK_MONOTONIC, &timer_start);
+	}
+}
+
+/* Stop timing (and counting allocations) while a benchmark sets up its
+ * next batch of iterations. */
+static void bench_stop_timer(void)
+{
+	struct timespec now;
+
+	if (timer_running) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timer_elapsed += (now.tv_sec - timer_start.tv_sec) +
+			(now.tv_nsec - timer_start.tv_nsec) * 1e-9;
+		timer_allocs += alloc_count - timer_alloc_start;
+		timer_gcry_allocs += gcry_alloc_count() - timer_gcry_alloc_start;
+		timer_running = 0;
+	}
+}
+
+/* Run fn(arg, n) for larger and larger n until it takes min_time, and
+ * report how long each of the n iterations took. */
+static void bench_run(const char *filter, const char *name,
+		void (*fn)(void *arg, long n), void *arg)
+{
+	long n = 1, next;
+
+	if (filter && !strstr(name, filter)) return;
+
+	for (;;) {
+		timer_elapsed = 0;
+		timer_allocs = 0;
+		timer_gcry_allocs = 0;
+		bench_start_timer();
+		fn(arg, n);
+		bench_stop_timer();
+		if (timer_elapsed >= min_time || n >= 1000000000) break;
+
+		/* Aim a little past min_time, but grow by at most 100 times */
+		next = timer_elapsed > 0 ?
+			(long)(n * min_time * 1.2 / timer_elapsed) : n * 100;
+		if (next > n * 100) next = n * 100;
+		if (next <= n) next = n + 1;
+		n = next;
+	}
+
+	fprintf(stderr, "%-32s %12.0f ns/op\n", name, timer_elapsed * 1e9 / n);
+	printf("%s\n    {\"name\": \"%s\", \"iterations\": %ld, "
+			"\"ns_per_op\": %.1f, \"allocs_per_op\": ",
+			bench_count++ ? "," : "", name, n, timer_elapsed * 1e9 / n);
+	if (HAVE_ALLOC_COUNT) {
+		printf("%.2f", (double)timer_allocs / n);
+	} else {
+		printf("null");
+	}
+	printf(", \"gcry_allocs_per_op\": %.2f}", (double)timer_gcry_allocs / n);
+	fflush(stdout);
+}
+
+/* Two userstates, alice's and bob's, talking to each other through a
+ * queue of injected messages. */
+static OtrlUserState us[2];
+static const char *names[2] = { "alice", "bob" };
+static char *queue[64];
+static int queue_to[64];
+static int queue_len;
+static int secure_count;
+
+static OtrlPolicy op_policy(void *opdata, ConnContext *context)
+{
+	return OTRL_POLICY_DEFAULT;
+}
+
+static void op_create_instag(void *opdata, const char *accountname,
+		const char *protocol)
+{
+	int from = (int)(long)opdata;
+
+	otrl_instag_generate(us[from], "/dev/null", accountname, protocol);
+}
+
+static int op_is_logged_in(void *opdata, const char *accountname,
+		const char *protocol, const char *recipient)
+{
+	return 1;
+}
+
+static void op_inject_message(void *opdata, const char *accountname,
+		const char *protocol, const char *recipient, const char *message)
+{
+	int from = (int)(long)opdata;
+
+	if (queue_len == sizeof(queue) / sizeof(queue[0])) {
+		fprintf(stderr, "bench: message queue full\n");
+		exit(1);
+	}
+	queue_to[queue_len] = 1 - from;
+	queue[queue_len++] = strdup(message);
+}
+
+static void op_gone_secure(void *opdata, ConnContext *context)
+{
+	secure_count++;
+}
+
+static void op_nop(void *opdata)
+{
+}
+
+static void op_new_fingerprint(void *opdata, OtrlUserState us,
+		const char *accountname, const char *protocol,
+		const char *username, unsigned char fingerprint[20])
+{
+}
+
+static OtrlMessageAppOps ops;
+
+/* Deliver the queued messages, and any sent in reply, until there are
+ * none left. */
+static void deliver(void)
+{
+	int i;
+
+	while (queue_len > 0) {
+		char *msg = queue[0];
+		char *newmsg = NULL;
+		int to = queue_to[0];
+
+		for (i = 1; i < queue_len; i++) {
+			queue[i - 1] = queue[i];
+			queue_to[i - 1] = queue_to[i];
+		}
+		queue_len--;
+
+		otrl_message_receiving(us[to], &ops, (void *)(long)to, names[to],
+				PROTOCOL, names[1 - to], msg, &newmsg, NULL, NULL, NULL,
+				NULL);
+		otrl_message_free(newmsg);
+		free(msg);
+	}
+}
+
+/* Run the AKE between alice and bob, from plaintext. */
+static int ake(void)
+{
+	ConnContext *context;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		for (context = us[i]->context_root; context;
+				context = context->next) {
+			otrl_context_force_plaintext(context);
+		}
+	}
+
+	secure_count = 0;
+	op_inject_message((void *)0, names[0], PROTOCOL, names[1], "?OTRv3?");
+	deliver();
+	return secure_count == 2 ? 0 : -1;
+}
+
+/* alice's and bob's contexts for each other with the running session */
+static ConnContext *session_context(int who)
+{
+	return otrl_context_find(us[who], names[1 - who], names[who], PROTOCOL,
+			OTRL_INSTAG_BEST, 0, NULL, NULL, NULL);
+}
+
+static int setup_peers(const char *keyfile)
+{
+	int i;
+
+	ops.policy = op_policy;
+	ops.create_instag = op_create_instag;
+	ops.is_logged_in = op_is_logged_in;
+	ops.inject_message = op_inject_message;
+	ops.gone_secure = op_gone_secure;
+	ops.update_context_list = op_nop;
+	ops.write_fingerprints = op_nop;
+	ops.new_fingerprint = op_new_fingerprint;
+
+	for (i = 0; i < 2; i++) {
+		us[i] = otrl_userstate_create();
+		if (otrl_privkey_read(us[i], keyfile) ||
+				!otrl_privkey_find(us[i], names[i], PROTOCOL)) {
+			fprintf(stderr, "bench: no keys for %s in %s\n", names[i],
+					keyfile);
+			return -1;
+		}
+	}
+
+	if (ake()) {
+		fprintf(stderr, "bench: AKE failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void bench_dh_gen_keypair(void *arg, long n)
+{
+	DH_keypair kp;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		otrl_dh_keypair_init(&kp);
+		otrl_dh_gen_keypair(DH1536_GROUP_ID, &kp);
+		otrl_dh_keypair_free(&kp);
+	}
+}
+
+static void bench_dh_session(void *arg, long n)
+{
+	DH_keypair ours, theirs;
+	DH_sesskeys sess;
+	long i;
+
+	bench_stop_timer();
+	otrl_dh_keypair_init(&ours);
+	otrl_dh_keypair_init(&theirs);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &ours);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &theirs);
+	bench_start_timer();
+
+	for (i = 0; i < n; i++) {
+		otrl_dh_session(&sess, &ours, theirs.pub);
+		otrl_dh_session_free(&sess);
+	}
+
+	bench_stop_timer();
+	otrl_dh_keypair_free(&ours);
+	otrl_dh_keypair_free(&theirs);
+}
+
+static char *make_text(size_t len)
+{
+	char *text = malloc(len + 1);
+
+	memset(text, 'a', len);
+	text[len] = '\0';
+	return text;
+}
+
+static void bench_proto_create_data(void *arg, long n)
+{
+	size_t len = *(size_t *)arg;
+	ConnContext *context = session_context(0);
+	char *text, *msg;
+	long i;
+
+	bench_stop_timer();
+	text = make_text(len);
+	bench_start_timer();
+
+	for (i = 0; i < n; i++) {
+		otrl_proto_create_data(&msg, context, text, NULL, 0, NULL);
+		free(msg);
+	}
+
+	bench_stop_timer();
+	free(text);
+}
+
+/* Messages are made by alice a batch at a time, untimed, for bob to
+ * accept. */
+#define ACCEPT_BATCH 64
+
+static void bench_proto_accept_data(void *arg, long n)
+{
+	size_t len = *(size_t *)arg;
+	ConnContext *from = session_context(0);
+	ConnContext *to = session_context(1);
+	char *msgs[ACCEPT_BATCH];
+	char *text, *plaintext;
+	OtrlTLV *tlvs;
+	unsigned char flags;
+	long done;
+	int j, count;
+
+	bench_stop_timer();
+	text = make_text(len);
+
+	for (done = 0; done < n; done += count) {
+		count = n - done < ACCEPT_BATCH ? n - done : ACCEPT_BATCH;
+		for (j = 0; j < count; j++) {
+			otrl_proto_create_data(&msgs[j], from, text, NULL, 0, NULL);
+		}
+		bench_start_timer();
+		for (j = 0; j < count; j++) {
+			plaintext = NULL;
+			tlvs = NULL;
+			if (otrl_proto_accept_data(&plaintext, &tlvs, to, msgs[j],
+						&flags, NULL)) {
+				fprintf(stderr, "bench: message not accepted\n");
+				exit(1);
+			}
+			free(plaintext);
+			otrl_tlv_free(tlvs);
+		}
+		bench_stop_timer();
+		for (j = 0; j < count; j++) {
+			free(msgs[j]);
+		}
+	}
+
+	free(text);
+}
+
+static void bench_base64_encode(void *arg, long n)
+{
+	unsigned char data[1024];
+	long i;
+
+	memset(data, 0x5a, sizeof(data));
+	for (i = 0; i < n; i++) {
+		free(otrl_base64_otr_encode(data, sizeof(data)));
+	}
+}
+
+static void bench_base64_decode(void *arg, long n)
+{
+	unsigned char data[1024];
+	unsigned char *buf;
+	size_t len;
+	char *msg;
+	long i;
+
+	memset(data, 0x5a, sizeof(data));
+	msg = otrl_base64_otr_encode(data, sizeof(data));
+	for (i = 0; i < n; i++) {
+		otrl_base64_otr_decode(msg, &buf, &len);
+		free(buf);
+	}
+	free(msg);
+}
+
+/* Fragments of a 4k data message, to fit 1k messages */
+#define FRAGMENT_MMS 1024
+
+static void bench_fragment_create(void *arg, long n)
+{
+	ConnContext *context = session_context(0);
+	char **fragments;
+	char *text, *msg;
+	int count;
+	long i;
+
+	bench_stop_timer();
+	text = make_text(4096);
+	otrl_proto_create_data(&msg, context, text, NULL, 0, NULL);
+	count = otrl_proto_fragment_count(FRAGMENT_MMS, context, msg);
+	bench_start_timer();
+
+	for (i = 0; i < n; i++) {
+		otrl_proto_fragment_create(FRAGMENT_MMS, count, &fragments, context,
+				msg);
+		otrl_proto_fragment_free(&fragments, count);
+	}
+
+	bench_stop_timer();
+	free(msg);
+	free(text);
+}
+
+static void bench_fragment_accumulate(void *arg, long n)
+{
+	ConnContext *from = session_context(0);
+	ConnContext *to = session_context(1);
+	char **fragments;
+	char *text, *msg, *unfrag;
+	int count, j;
+	long i;
+
+	bench_stop_timer();
+	text = make_text(4096);
+	otrl_proto_create_data(&msg, from, text, NULL, 0, NULL);
+	count = otrl_proto_fragment_count(FRAGMENT_MMS, from, msg);
+	otrl_proto_fragment_create(FRAGMENT_MMS, count, &fragments, from, msg);
+	bench_start_timer();
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < count; j++) {
+			unfrag = NULL;
+			if (otrl_proto_fragment_accumulate(&unfrag, to, fragments[j])
+					== OTRL_FRAGMENT_COMPLETE) {
+				free(unfrag);
+			}
+		}
+	}
+
+	bench_stop_timer();
+	otrl_proto_fragment_free(&fragments, count);
+	free(msg);
+	free(text);
+}
+
+static void bench_ake(void *arg, long n)
+{
+	long i;
+
+	for (i = 0; i < n; i++) {
+		if (ake()) {
+			fprintf(stderr, "bench: AKE failed\n");
+			exit(1);
+		}
+	}
+}
+
+static void bench_smp(void *arg, long n)
+{
+	unsigned char secret[SM_DIGEST_SIZE];
+	OtrlSMState a, b;
+	unsigned char *msg1, *msg2, *msg3, *msg4;
+	int len1, len2, len3, len4;
+	long i;
+
+	memset(secret, 0x42, sizeof(secret));
+	for (i = 0; i < n; i++) {
+		otrl_sm_state_new(&a);
+		otrl_sm_state_init(&a);
+		otrl_sm_state_new(&b);
+		otrl_sm_state_init(&b);
+		otrl_sm_step1(&a, secret, sizeof(secret), &msg1, &len1);
+		otrl_sm_step2a(&b, msg1, len1, 0);
+		otrl_sm_step2b(&b, secret, sizeof(secret), &msg2, &len2);
+		otrl_sm_step3(&a, msg2, len2, &msg3, &len3);
+		otrl_sm_step4(&b, msg3, len3, &msg4, &len4);
+		if (otrl_sm_step5(&a, msg4, len4)) {
+			fprintf(stderr, "bench: SMP failed\n");
+			exit(1);
+		}
+		free(msg1);
+		free(msg2);
+		free(msg3);
+		free(msg4);
+		otrl_sm_state_free(&a);
+		otrl_sm_state_free(&b);
+	}
+}
+
+/* A userstate with the given number of contexts, looked up at random */
+typedef struct {
+	long contexts;
+	OtrlUserState us;
+	char **names;
+} ContextBench;
+
+#define LOOKUPS 4096
+
+static void bench_context_find(void *arg, long n)
+{
+	ContextBench *cb = arg;
+	long i;
+
+	bench_stop_timer();
+	if (!cb->us) {
+		char name[32];
+
+		cb->us = otrl_userstate_create();
+		for (i = 0; i < cb->contexts; i++) {
+			snprintf(name, sizeof(name), "user%ld", i);
+			otrl_context_find(cb->us, name, "account", PROTOCOL,
+					OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+		}
+		cb->names = malloc(LOOKUPS * sizeof(char *));
+		for (i = 0; i < LOOKUPS; i++) {
+			snprintf(name, sizeof(name), "user%ld",
+					(long)(rand() % cb->contexts));
+			cb->names[i] = strdup(name);
+		}
+	}
+	bench_start_timer();
+
+	for (i = 0; i < n; i++) {
+		if (!otrl_context_find(cb->us, cb->names[i % LOOKUPS], "account",
+					PROTOCOL, OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL)) {
+			fprintf(stderr, "bench: context not found\n");
+			exit(1);
+		}
+	}
+}
+
+static void context_bench_free(ContextBench *cb)
+{
+	long i;
+
+	if (cb->us) {
+		otrl_userstate_free(cb->us);
+		for (i = 0; i < LOOKUPS; i++) {
+			free(cb->names[i]);
+		}
+		free(cb->names);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static size_t data_sizes[] = { 16, 1024, 16384 };
+	static long context_counts[] = { 1000, 100000, 1000000 };
+	const char *filter = NULL;
+	char name[64];
+	ContextBench cb;
+	int opt;
+	size_t i;
+
+	while ((opt = getopt(argc, argv, "t:f:")) != -1) {
+		switch (opt) {
+			case 't':
+				min_time = atof(optarg) / 1000;
+				break;
+			case 'f':
+				filter = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-t ms] [-f filter] keyfile\n",
+						argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-t ms] [-f filter] keyfile\n", argv[0]);
+		return 1;
+	}
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+	srand(1);
+
+	if (setup_peers(argv[optind])) return 1;
+
+	printf("{\"libotr\": \"%s\", \"benchmarks\": [", OTRL_VERSION);
+
+	bench_run(filter, "dh_gen_keypair", bench_dh_gen_keypair, NULL);
+	bench_run(filter, "dh_session", bench_dh_session, NULL);
+	for (i = 0; i < sizeof(data_sizes) / sizeof(data_sizes[0]); i++) {
+		snprintf(name, sizeof(name), "proto_create_data/%lu",
+				(unsigned long)data_sizes[i]);
+		bench_run(filter, name, bench_proto_create_data, &data_sizes[i]);
+		snprintf(name, sizeof(name), "proto_accept_data/%lu",
+				(unsigned long)data_sizes[i]);
+		bench_run(filter, name, bench_proto_accept_data, &data_sizes[i]);
+	}
+	bench_run(filter, "base64_encode/1024", bench_base64_encode, NULL);
+	bench_run(filter, "base64_decode/1024", bench_base64_decode, NULL);
+	bench_run(filter, "fragment_create/4096", bench_fragment_create, NULL);
+	bench_run(filter, "fragment_accumulate/4096", bench_fragment_accumulate,
+			NULL);
+	bench_run(filter, "ake_round_trip", bench_ake, NULL);
+	bench_run(filter, "smp_round_trip", bench_smp, NULL);
+	for (i = 0; i < sizeof(context_counts) / sizeof(context_counts[0]); i++) {
+		memset(&cb, 0, sizeof(cb));
+		cb.contexts = context_counts[i];
+		snprintf(name, sizeof(name), "context_find/%ld", cb.contexts);
+		bench_run(filter, name, bench_context_find, &cb);
+		context_bench_free(&cb);
+	}
+
+	printf("\n]}\n");
+
+	otrl_userstate_free(us[0]);
+	otrl_userstate_free(us[1]);
+	return 0;
+}
@@ -0,0 +1,548 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Play back a capture made with otrl_capture_new (see src/capture.h) as
+ * a workload for profiling, for instance under "perf record".  Our
+ * accounts and their correspondents are played by two userstates, ours
+ * and theirs, talking to each other through a queue of injected
+ * messages, with every account of ours using alice's private key and
+ * every correspondent using bob's.  For each message in the capture,
+ * the side that sent it sends one like it:
+ *
+ *  - plain, tagged and error messages are passed on as they are;
+ *  - a query, or a D-H Commit that followed no query, starts an AKE,
+ *    and the rest of the AKE's messages are left to the AKE itself;
+ *  - a Data Message is sent with a text of about the length needed to
+ *    make the captured length;
+ *  - the first fragment of a message makes a Data Message (or the
+ *    AKE, if there's no session yet) go out in as many fragments of
+ *    the captured size as the capture had, and the other fragments
+ *    are left to it.
+ *
+ * Each message is delivered, along with any replies, before the next
+ * is sent.  The texts come from a pseudorandom generator with a fixed
+ * seed (-s), so the same capture always gives the same workload; only
+ * the D-H keys and nonces, which come from libgcrypt, differ from one
+ * run to the next.  By default the messages are sent as fast as they
+ * can be; with -r, at the captured times divided by the given speed.
+ * A summary is written to stdout as JSON.  With -c, the traffic of our
+ * side of the replay is itself captured to the given file, to compare
+ * with the capture played back.
+ *
+ * Usage: otr_replay [-s seed] [-r speed] [-c capture-out] keyfile capture
+ *
+ * The keyfile must hold private keys for the accounts "alice" and "bob"
+ * of the protocol "otr-test", as tests/regression/client/otr.key does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <proto.h>
+#include <capture.h>
+#include <context.h>
+#include <instag.h>
+#include <message.h>
+#include <privkey.h>
+#include <userstate.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define PROTOCOL "otr-test"
+
+/* A message in the capture */
+typedef struct {
+	unsigned long long msec;
+	int from;               /* 0 for us, 1 for the correspondent */
+	unsigned int peer;
+	char kind[16];
+	size_t len;
+	unsigned int frag_k, frag_n;
+} ReplayEvent;
+
+/* What we know of each correspondent */
+typedef struct {
+	unsigned int account;   /* The account of ours talking to it */
+	int query_seen;         /* Has an AKE been asked for? */
+} ReplayPeer;
+
+/* A message on its way from one side to the other */
+typedef struct {
+	int to;
+	char *accountname;      /* The receiving account */
+	char *sender;
+	char *msg;
+} ReplayMessage;
+
+static OtrlUserState us[2];
+static OtrlMessageAppOps ops;
+static ReplayPeer *peers;
+static unsigned int num_peers;
+static unsigned int num_accounts;
+static int current_mms;
+static unsigned int seed = 1;
+static OtrlCapture *recapture;
+
+static ReplayMessage *queue;
+static size_t queue_head, queue_len, queue_size;
+
+static unsigned long delivered, sent, skipped, secure_count;
+
+static OtrlPolicy op_policy(void *opdata, ConnContext *context)
+{
+	return OTRL_POLICY_MANUAL;
+}
+
+static void op_create_instag(void *opdata, const char *accountname,
+		const char *protocol)
+{
+	int side = (int)(long)opdata;
+
+	otrl_instag_generate(us[side], "/dev/null", accountname, protocol);
+}
+
+static int op_is_logged_in(void *opdata, const char *accountname,
+		const char *protocol, const char *recipient)
+{
+	return 1;
+}
+
+static void queue_push(int to, const char *accountname, const char *sender,
+		const char *msg)
+{
+	ReplayMessage *m;
+
+	if (queue_head + queue_len == queue_size) {
+		if (queue_head > 0) {
+			memmove(queue, queue + queue_head,
+					queue_len * sizeof(ReplayMessage));
+			queue_head = 0;
+		} else {
+			queue_size = queue_size ? 2 * queue_size : 64;
+			queue = realloc(queue, queue_size * sizeof(ReplayMessage));
+			if (!queue) {
+				fprintf(stderr, "replay: out of memory\n");
+				exit(1);
+			}
+		}
+	}
+	m = &queue[queue_head + queue_len++];
+	m->to = to;
+	m->accountname = strdup(accountname);
+	m->sender = strdup(sender);
+	m->msg = strdup(msg);
+}
+
+static void op_inject_message(void *opdata, const char *accountname,
+		const char *protocol, const char *recipient, const char *message)
+{
+	int side = (int)(long)opdata;
+
+	if (side == 0) {
+		otrl_capture_sent(recapture, accountname, protocol, recipient,
+				message);
+	}
+	queue_push(1 - side, recipient, accountname, message);
+}
+
+static int op_max_message_size(void *opdata, ConnContext *context)
+{
+	return current_mms;
+}
+
+static void op_gone_secure(void *opdata, ConnContext *context)
+{
+	secure_count++;
+}
+
+static void op_nop(void *opdata)
+{
+}
+
+static void op_new_fingerprint(void *opdata, OtrlUserState us,
+		const char *accountname, const char *protocol,
+		const char *username, unsigned char fingerprint[20])
+{
+}
+
+/* Deliver the queued messages, and any sent in reply, until there are
+ * none left. */
+static void deliver(void)
+{
+	while (queue_len > 0) {
+		ReplayMessage m = queue[queue_head];
+		char *newmsg = NULL;
+
+		queue_head++;
+		queue_len--;
+		if (queue_len == 0) queue_head = 0;
+
+		if (m.to == 0) {
+			otrl_capture_received(recapture, m.accountname, PROTOCOL,
+					m.sender, m.msg);
+		}
+		otrl_message_receiving(us[m.to], &ops, (void *)(long)m.to,
+				m.accountname, PROTOCOL, m.sender, m.msg, &newmsg, NULL,
+				NULL, NULL, NULL);
+		otrl_message_free(newmsg);
+		free(m.accountname);
+		free(m.sender);
+		free(m.msg);
+		delivered++;
+	}
+}
+
+/* The names of a correspondent and of the account talking to it */
+static void peer_names(unsigned int peer, char account[32], char name[32])
+{
+	snprintf(account, 32, "acct%u", peers[peer].account);
+	snprintf(name, 32, "peer%u", peer);
+}
+
+/* Pass text from one side to the other as it is. */
+static void send_raw(int from, unsigned int peer, const char *text)
+{
+	char account[32], name[32];
+
+	peer_names(peer, account, name);
+	if (from == 0) {
+		otrl_capture_sent(recapture, account, PROTOCOL, name, text);
+		queue_push(1, name, account, text);
+	} else {
+		queue_push(0, account, name, text);
+	}
+	sent++;
+}
+
+/* Send text from one side to the other through otrl_message_sending. */
+static void send_text(int from, unsigned int peer, const char *text)
+{
+	char account[32], name[32];
+	char *newmsg = NULL;
+
+	peer_names(peer, account, name);
+	otrl_message_sending(us[from], &ops, (void *)(long)from,
+			from ? name : account, PROTOCOL, from ? account : name,
+			OTRL_INSTAG_BEST, text, NULL, &newmsg, OTRL_FRAGMENT_SEND_ALL,
+			NULL, NULL, NULL);
+	otrl_message_free(newmsg);
+	sent++;
+}
+
+/* Is there a session between us and the given correspondent? */
+static int peer_secure(unsigned int peer)
+{
+	char account[32], name[32];
+	ConnContext *context;
+
+	peer_names(peer, account, name);
+	context = otrl_context_find(us[0], name, account, PROTOCOL,
+			OTRL_INSTAG_BEST, 0, NULL, NULL, NULL);
+	return context && context->msgstate == OTRL_MSGSTATE_ENCRYPTED;
+}
+
+/* A pseudorandom text of len letters */
+static char *random_text(size_t len)
+{
+	char *text = malloc(len + 1);
+	size_t i;
+
+	if (!text) {
+		fprintf(stderr, "replay: out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < len; i++) {
+		text[i] = 'a' + rand_r(&seed) % 26;
+	}
+	text[len] = '\0';
+	return text;
+}
+
+/* A text whose Data Message will be about len bytes long: the Data
+ * Message is a base64 encoding of about 251 bytes of header, keys,
+ * counter and MAC around the text. */
+static char *data_text(size_t len)
+{
+	return random_text(len > 6 + 340 ? (len - 6) / 4 * 3 - 251 : 1);
+}
+
+static void replay_event(const ReplayEvent *ev)
+{
+	ReplayPeer *peer = &peers[ev->peer];
+	char *text;
+
+	current_mms = 0;
+
+	if (!strcmp(ev->kind, "plain")) {
+		text = random_text(ev->len);
+		send_raw(ev->from, ev->peer, text);
+		free(text);
+	} else if (!strcmp(ev->kind, "tagged")) {
+		send_raw(ev->from, ev->peer,
+				"Replay" OTRL_MESSAGE_TAG_BASE OTRL_MESSAGE_TAG_V3);
+	} else if (!strcmp(ev->kind, "error")) {
+		send_raw(ev->from, ev->peer, "?OTR Error: Replayed error");
+	} else if (!strcmp(ev->kind, "query")) {
+		peer->query_seen = 1;
+		send_raw(ev->from, ev->peer, "?OTRv3?");
+	} else if (!strcmp(ev->kind, "commit")) {
+		/* The D-H Commit answers a query from the other side */
+		if (!peer->query_seen) {
+			send_raw(1 - ev->from, ev->peer, "?OTRv3?");
+		}
+		peer->query_seen = 0;
+	} else if (!strcmp(ev->kind, "data")) {
+		if (!peer_secure(ev->peer)) {
+			send_raw(ev->from, ev->peer, "?OTRv3?");
+			deliver();
+		}
+		text = data_text(ev->len);
+		send_text(ev->from, ev->peer, text);
+		free(text);
+	} else if (!strcmp(ev->kind, "frag")) {
+		if (ev->frag_k != 1) {
+			skipped++;
+			return;
+		}
+		current_mms = ev->len;
+		if (!peer_secure(ev->peer)) {
+			send_raw(ev->from, ev->peer, "?OTRv3?");
+		} else {
+			/* Each fragment carries 36 bytes of its own, and the
+			 * Data Message may have up to 30 more than asked for */
+			size_t len = ev->frag_n * (ev->len > 36 ? ev->len - 36 : 1);
+			text = data_text(len > 30 ? len - 30 : 1);
+			send_text(ev->from, ev->peer, text);
+			free(text);
+		}
+	} else {
+		/* The rest of an AKE, or messages we don't make */
+		skipped++;
+		return;
+	}
+
+	deliver();
+	current_mms = 0;
+}
+
+/* Read the capture in f into a newly-allocated array of events, putting
+ * their number in *countp, and work out the correspondents. */
+static ReplayEvent *read_capture(FILE *f, size_t *countp)
+{
+	ReplayEvent *events = NULL;
+	size_t count = 0, size = 0;
+	char line[256];
+
+	while (fgets(line, sizeof(line), f)) {
+		ReplayEvent ev;
+		unsigned int account;
+		unsigned long len;
+		char dir;
+
+		if (line[0] == '#') continue;
+		ev.frag_k = ev.frag_n = 0;
+		if (sscanf(line, "%llu %c %u %u %15s %lu %u/%u", &ev.msec, &dir,
+					&account, &ev.peer, ev.kind, &len, &ev.frag_k,
+					&ev.frag_n) < 6 || account == 0 || ev.peer == 0) {
+			fprintf(stderr, "replay: bad capture line: %s", line);
+			continue;
+		}
+		ev.from = dir == 'S' ? 0 : 1;
+		ev.len = len;
+
+		if (ev.peer >= num_peers) {
+			unsigned int newnum = ev.peer + 1;
+			peers = realloc(peers, newnum * sizeof(ReplayPeer));
+			if (!peers) break;
+			memset(peers + num_peers, 0,
+					(newnum - num_peers) * sizeof(ReplayPeer));
+			num_peers = newnum;
+		}
+		if (peers[ev.peer].account == 0) {
+			peers[ev.peer].account = account;
+		}
+		if (account > num_accounts) num_accounts = account;
+
+		if (count == size) {
+			size = size ? 2 * size : 1024;
+			events = realloc(events, size * sizeof(ReplayEvent));
+			if (!events) break;
+		}
+		events[count++] = ev;
+	}
+
+	if (!peers || !events) {
+		fprintf(stderr, "replay: nothing to replay\n");
+		free(events);
+		return NULL;
+	}
+	*countp = count;
+	return events;
+}
+
+/* Load count private keys into target, for the accounts prefix1 to
+ * prefix<count>, each of them the key keys has for keyname, by way of
+ * a key file made on the fly. */
+static int load_keys(OtrlUserState target, OtrlUserState keys,
+		const char *keyname, const char *prefix, unsigned int count)
+{
+	OtrlPrivKey *key = otrl_privkey_find(keys, keyname, PROTOCOL);
+	size_t keylen;
+	char *keytext;
+	FILE *f;
+	unsigned int i;
+	int res;
+
+	if (!key) return -1;
+	keylen = gcry_sexp_sprint(key->privkey, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+	keytext = malloc(keylen + 1);
+	f = tmpfile();
+	if (!keytext || !f) {
+		free(keytext);
+		if (f) fclose(f);
+		return -1;
+	}
+	gcry_sexp_sprint(key->privkey, GCRYSEXP_FMT_ADVANCED, keytext,
+			keylen + 1);
+	keytext[keylen] = '\0';
+
+	fprintf(f, "(privkeys\n");
+	for (i = 1; i <= count; i++) {
+		fprintf(f, " (account\n(name %s%u)\n(protocol %s)\n%s)\n", prefix,
+				i, PROTOCOL, keytext);
+	}
+	fprintf(f, ")\n");
+	rewind(f);
+	res = otrl_privkey_read_FILEp(target, f) ? -1 : 0;
+	fclose(f);
+	free(keytext);
+	return res;
+}
+
+static double now_seconds(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+	ReplayEvent *events;
+	OtrlUserState keys;
+	double speed = 0, start, elapsed;
+	size_t count, i;
+	FILE *f, *recapturef = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:r:c:")) != -1) {
+		switch (opt) {
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				speed = atof(optarg);
+				break;
+			case 'c':
+				recapturef = fopen(optarg, "w");
+				if (!recapturef) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-s seed] [-r speed] "
+						"[-c capture-out] keyfile capture\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 2) {
+		fprintf(stderr, "usage: %s [-s seed] [-r speed] [-c capture-out] "
+				"keyfile capture\n", argv[0]);
+		return 1;
+	}
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	/* The D-H keys of a workload needn't be strong, and shouldn't
+	 * wait for entropy */
+	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM, 0);
+	OTRL_INIT;
+
+	f = fopen(argv[optind + 1], "r");
+	if (!f) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	events = read_capture(f, &count);
+	fclose(f);
+	if (!events) return 1;
+
+	ops.policy = op_policy;
+	ops.create_instag = op_create_instag;
+	ops.is_logged_in = op_is_logged_in;
+	ops.inject_message = op_inject_message;
+	ops.max_message_size = op_max_message_size;
+	ops.gone_secure = op_gone_secure;
+	ops.update_context_list = op_nop;
+	ops.write_fingerprints = op_nop;
+	ops.new_fingerprint = op_new_fingerprint;
+
+	keys = otrl_userstate_create();
+	us[0] = otrl_userstate_create();
+	us[1] = otrl_userstate_create();
+	if (otrl_privkey_read(keys, argv[optind]) ||
+			load_keys(us[0], keys, "alice", "acct", num_accounts) ||
+			load_keys(us[1], keys, "bob", "peer", num_peers - 1)) {
+		fprintf(stderr, "replay: no keys for alice and bob in %s\n",
+				argv[optind]);
+		return 1;
+	}
+	otrl_userstate_free(keys);
+
+	if (recapturef) recapture = otrl_capture_new(recapturef);
+	start = now_seconds();
+	for (i = 0; i < count; i++) {
+		if (speed > 0) {
+			double due = start + events[i].msec / 1000.0 / speed;
+			double wait = due - now_seconds();
+			if (wait > 0) usleep(wait * 1e6);
+		}
+		replay_event(&events[i]);
+	}
+	elapsed = now_seconds() - start;
+	if (recapturef) {
+		otrl_capture_free(recapture);
+		fclose(recapturef);
+	}
+
+	printf("{\"libotr\": \"%s\", \"events\": %lu, \"sent\": %lu, "
+			"\"skipped\": %lu, \"delivered\": %lu, \"sessions\": %lu, "
+			"\"correspondents\": %u, \"seconds\": %.3f}\n", OTRL_VERSION,
+			(unsigned long)count, sent, skipped, delivered,
+			secure_count / 2, num_peers ? num_peers - 1 : 0, elapsed);
+
+	otrl_userstate_free(us[0]);
+	otrl_userstate_free(us[1]);
+	free(events);
+	free(peers);
+	free(queue);
+	return 0;
+}
@@ -20,14 +20,19 @@
 #include <ctype.h>
 #include <gcrypt.h>
 #include <getopt.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syscall.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <context.h>
@@ -54,6 +59,10 @@ static struct option long_opts[] = {
 	{ "disconnect",  0, NULL, 'd' },
 	{ "auth",        0, NULL, 'a' },
 	{ "fragment",    0, NULL, 'F' },
+	{ "load",        1, NULL, 'l' },
+	{ "rate",        1, NULL, 'r' },
+	{ "poisson",     0, NULL, 'p' },
+	{ "msg-size",    1, NULL, 's' },
 
 	/* Closure. */
 	{ NULL, 0, NULL, 0 }
@@ -66,6 +75,17 @@ static unsigned int opt_max_num_msg;
 static int opt_disconnect;
 static int opt_auth;
 static int opt_fragment;
+static unsigned int opt_load;
+static double opt_rate;
+static int opt_poisson;
+
+/*
+ * Message sizes in load mode: fixed (min == max), uniform between min and
+ * max, or exponential with the given mean.
+ */
+static size_t msg_size_min = 1;
+static size_t msg_size_max = 600;
+static double msg_size_mean;
 
 /* Currently, the message size sent is between 1 and 600 len so 100 is a good
  * middle ground. */
@@ -114,6 +134,9 @@ struct otr_msg {
 	size_t ciphertext_len;
 	char *plaintext;
 	char *ciphertext;
+	/* Load mode: the conversation, and when its plaintext was sent. */
+	unsigned int conv;
+	uint64_t sent_ns;
 };
 
 struct otr_info {
@@ -121,8 +144,31 @@ struct otr_info {
 	int sock;
 	unsigned int gone_secure;
 	unsigned int auth_done;
+	/* Load mode: sessions gone secure, and when the message being sent
+	 * was handed to libotr. */
+	unsigned int num_secure;
+	uint64_t send_ns;
+};
+
+/*
+ * Load mode state. Alice sends to opt_load conversations, named by a ".N"
+ * suffix on the peer's name, and Bob checks that each conversation's
+ * messages arrive whole and in order and records how long they took.
+ */
+struct load_conv {
+	uint64_t next_ns;
+	unsigned int seq;
 };
 
+static struct load_conv *load_convs;
+static unsigned int *load_expect;
+static uint64_t *load_latency;
+static unsigned int load_started;
+static unsigned int load_sent;
+static unsigned int load_bad;
+static uint64_t load_start_ns;
+static uint64_t load_end_ns;
+
 /* Stub */
 static int send_otr_msg(int sock, const char *to, const char *from,
 		struct otr_info *oinfo, const char *message);
@@ -147,6 +193,12 @@ static void ops_inject_msg(void *opdata, const char *accountname,
 
 	msg->ciphertext = strdup(message);
 	msg->ciphertext_len = strlen(message);
+	if (opt_load) {
+		const char *dot = strrchr(recipient, '.');
+
+		msg->conv = dot ? strtoul(dot + 1, NULL, 10) : 0;
+		msg->sent_ns = oinfo->send_ns;
+	}
 
 	ret = send(oinfo->sock, &msg, sizeof(msg), 0);
 	if (ret < 0) {
@@ -160,6 +212,7 @@ static void ops_gone_secure(void *opdata, ConnContext *context)
 
 	session_disconnected = 0;
 	oinfo->gone_secure = 1;
+	oinfo->num_secure++;
 	/* XXX: gone_insecure is never called ref bug #40 so this will always be
 	 * true. */
 	OK(oinfo->gone_secure, "Gone secure for %s",
@@ -590,6 +643,259 @@ error:
 	return -1;
 }
 
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Time until a conversation's next message in load mode: fixed at the
+ * given rate or, with --poisson, exponentially distributed around it.
+ */
+static uint64_t load_interval_ns(void)
+{
+	double interval;
+
+	if (opt_rate <= 0) {
+		return 0;
+	}
+	interval = 1e9 / opt_rate;
+	if (opt_poisson) {
+		interval *= -log(1.0 - rand() / (RAND_MAX + 1.0));
+	}
+	return (uint64_t) interval;
+}
+
+static size_t load_msg_size(void)
+{
+	if (msg_size_mean > 0) {
+		double size = -log(1.0 - rand() / (RAND_MAX + 1.0)) * msg_size_mean;
+
+		return size < 1 ? 1 : (size_t) size;
+	}
+	return msg_size_min + rand() % (msg_size_max - msg_size_min + 1);
+}
+
+/*
+ * Parse a --msg-size argument: "N", "MIN-MAX" or "exp:MEAN".
+ */
+static int parse_msg_size(const char *spec)
+{
+	unsigned long min, max;
+	double mean;
+
+	if (sscanf(spec, "exp:%lf", &mean) == 1 && mean >= 1) {
+		msg_size_mean = mean;
+		return 0;
+	}
+	if (sscanf(spec, "%lu-%lu", &min, &max) == 2 && min >= 1 && min <= max) {
+		msg_size_min = min;
+		msg_size_max = max;
+		return 0;
+	}
+	if (sscanf(spec, "%lu", &min) == 1 && min >= 1) {
+		msg_size_min = msg_size_max = min;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Send the next message of a load mode conversation. It starts with
+ * "conv:seq:" so that Bob can tell it arrived whole and in order.
+ */
+static void load_send(struct otr_info *oinfo, unsigned int conv)
+{
+	static const char alphanum[] =
+		"0123456789"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz";
+	struct load_conv *lc = &load_convs[conv];
+	char peer[64], header[32], *text, *new_msg = NULL;
+	size_t size, i;
+	int len;
+	gcry_error_t err;
+
+	snprintf(peer, sizeof(peer), "%s.%u", bob_name, conv);
+	len = snprintf(header, sizeof(header), "%u:%u:", conv, lc->seq);
+	size = load_msg_size();
+	if (size < (size_t) len) {
+		size = len;
+	}
+	text = zmalloc(size + 1);
+	if (!text) {
+		perror("zmalloc load msg");
+		return;
+	}
+	memcpy(text, header, len);
+	for (i = len; i < size; i++) {
+		text[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
+	}
+
+	/* Every piece goes out through ops_inject_msg, stamped with this. */
+	oinfo->send_ns = now_ns();
+	err = otrl_message_sending(user_state, &ops, oinfo, alice_name, protocol,
+			peer, OTRL_INSTAG_BEST, text, NULL, &new_msg,
+			OTRL_FRAGMENT_SEND_ALL, NULL, NULL, NULL);
+	if (err) {
+		load_bad++;
+	} else {
+		lc->seq++;
+	}
+	load_sent++;
+	otrl_message_free(new_msg);
+	free(text);
+}
+
+/*
+ * In load mode, start a session for each conversation.
+ */
+static void load_start(struct otr_info *oinfo)
+{
+	char peer[64], *query;
+	unsigned int i;
+
+	query = otrl_proto_default_query_msg(alice_name, OTRL_POLICY_DEFAULT);
+	for (i = 0; i < opt_load; i++) {
+		snprintf(peer, sizeof(peer), "%s.%u", bob_name, i);
+		ops_inject_msg(oinfo, alice_name, protocol, peer, query);
+	}
+	free(query);
+}
+
+/*
+ * In load mode, once every session is secure, send each message that is
+ * due. Returns how long to wait, in msec, before calling this again.
+ */
+static int load_send_due(struct otr_info *oinfo)
+{
+	uint64_t now = now_ns(), next = UINT64_MAX;
+	unsigned int i;
+
+	if (!load_started) {
+		if (oinfo->num_secure < opt_load) {
+			return 100;
+		}
+		load_started = 1;
+		load_start_ns = now;
+		for (i = 0; i < opt_load; i++) {
+			load_convs[i].next_ns = now + load_interval_ns();
+		}
+	}
+
+	for (i = 0; i < opt_load && load_sent < opt_max_num_msg; i++) {
+		struct load_conv *lc = &load_convs[i];
+
+		/* Catch up with anything we're behind on. */
+		while (lc->next_ns <= now && load_sent < opt_max_num_msg) {
+			load_send(oinfo, i);
+			if (opt_rate <= 0) {
+				break;
+			}
+			lc->next_ns += load_interval_ns();
+		}
+		if (lc->next_ns < next) {
+			next = lc->next_ns;
+		}
+	}
+
+	if (load_sent >= opt_max_num_msg) {
+		/* All sent, wait for Bob to tell us he got them. */
+		return -1;
+	}
+	now = now_ns();
+	return next > now ? (next - now) / 1000000 : 0;
+}
+
+/*
+ * Receive a message in load mode. For Bob, check and time the messages
+ * of each conversation.
+ */
+static int load_recv_msg(int sock, const char *to, const char *from,
+		struct otr_info *oinfo)
+{
+	int err;
+	ssize_t ret;
+	char peer[64], *new_msg = NULL;
+	struct otr_msg *omsg;
+	OtrlTLV *tlvs = NULL;
+
+	ret = recv(sock, &omsg, sizeof(omsg), 0);
+	if (ret < 0) {
+		return -1;
+	}
+
+	snprintf(peer, sizeof(peer), "%s.%u", from, omsg->conv);
+	err = otrl_message_receiving(user_state, &ops, oinfo, to, protocol, peer,
+			omsg->ciphertext, &new_msg, &tlvs, NULL, NULL, NULL);
+	if (!err && new_msg && to == bob_name) {
+		unsigned int conv, seq;
+
+		if (sscanf(new_msg, "%u:%u:", &conv, &seq) != 2 ||
+				conv != omsg->conv || conv >= opt_load ||
+				seq != load_expect[conv]) {
+			load_bad++;
+		} else {
+			load_expect[conv]++;
+		}
+		if (num_recv_msg < opt_max_num_msg) {
+			load_end_ns = now_ns();
+			load_latency[num_recv_msg] = load_end_ns - omsg->sent_ns;
+		}
+		update_msg_counter();
+	}
+
+	otrl_message_free(new_msg);
+	otrl_tlv_free(tlvs);
+	free(omsg->plaintext);
+	free(omsg->ciphertext);
+	free(omsg);
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t *sorted, unsigned int n, double p)
+{
+	unsigned int i = (unsigned int) ceil(p * n);
+
+	return sorted[i > 0 ? i - 1 : 0] / 1e6;
+}
+
+/*
+ * Report throughput and latency at the end of a load mode run.
+ */
+static void load_report(void)
+{
+	unsigned int n = num_recv_msg;
+	double secs;
+
+	OK(n == opt_max_num_msg && !load_bad,
+			"Load mode messages received whole and in order");
+	if (n == 0) {
+		return;
+	}
+
+	qsort(load_latency, n, sizeof(*load_latency), cmp_u64);
+	secs = (load_end_ns - load_start_ns) / 1e9;
+	diag("load: %u conversations, %u messages in %.3f s, %.1f msg/s",
+			opt_load, n, secs, secs > 0 ? n / secs : 0);
+	diag("latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms",
+			percentile_ms(load_latency, n, 0.50),
+			percentile_ms(load_latency, n, 0.99),
+			percentile_ms(load_latency, n, 0.999),
+			load_latency[n - 1] / 1e6);
+}
+
 static int add_sock_to_pollset(int epfd, int sock, uint32_t req_ev)
 {
 	int ret;
@@ -642,6 +948,10 @@ static void *alice_thread(void *data)
 		goto end;
 	}
 
+	if (opt_load) {
+		load_start(&oinfo);
+	}
+
 	/* Add quit pipe to pollset trigger by a cleanup. */
 	ret = add_sock_to_pollset(epfd, quit_pipe[0], EPOLLIN);
 	if (ret < 0) {
@@ -662,11 +972,16 @@ static void *alice_thread(void *data)
 
 		/*
 		 * Set random timeout and when we do timeout, use that to send message
-		 * to Alice.
+		 * to Alice. In load mode, the timeout is until the next message is
+		 * due.
 		 */
-		timeout = (rand() % (timeout_max - 1));
+		if (opt_load) {
+			timeout = load_send_due(&oinfo);
+		} else {
+			timeout = (rand() % (timeout_max - 1));
+		}
 
-		ret = epoll_wait(epfd, ev, sizeof(ev), timeout);
+		ret = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
 		if (ret < 0) {
 			perror("epoll_wait Alice");
 			goto end;
@@ -699,8 +1014,10 @@ static void *alice_thread(void *data)
 
 		/* No event thus timeout, send message to Alice. */
 		if (nb_fd == 0) {
-			(void) send_otr_msg(sock_to_bob, bob_name, alice_name, &oinfo,
-					NULL);
+			if (!opt_load) {
+				(void) send_otr_msg(sock_to_bob, bob_name, alice_name, &oinfo,
+						NULL);
+			}
 			continue;
 		}
 
@@ -736,8 +1053,13 @@ static void *alice_thread(void *data)
 					/* Stop since Bob's thread just shut us down. */
 					goto end;
 				} else if (event & EPOLLIN) {
-					(void) recv_otr_msg(sock_from_bob, alice_name, bob_name,
-							&oinfo);
+					if (opt_load) {
+						(void) load_recv_msg(sock_from_bob, alice_name, bob_name,
+								&oinfo);
+					} else {
+						(void) recv_otr_msg(sock_from_bob, alice_name, bob_name,
+								&oinfo);
+					}
 				}
 				continue;
 			} else {
@@ -810,9 +1132,9 @@ static void *bob_thread(void *data)
 		 * Set random timeout and when we do timeout, use that to send message
 		 * to Alice.
 		 */
-		timeout = (rand() % (timeout_max - 1));
+		timeout = opt_load ? -1 : (rand() % (timeout_max - 1));
 
-		ret = epoll_wait(epfd, ev, sizeof(ev), timeout);
+		ret = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
 		if (ret < 0) {
 			perror("epoll_wait Bob");
 			goto end;
@@ -857,8 +1179,13 @@ static void *bob_thread(void *data)
 				if (event & (EPOLLERR | EPOLLHUP)) {
 					goto end;
 				} else if (event & EPOLLIN) {
-					(void) recv_otr_msg(sock_from_alice, bob_name,
-							alice_name, &oinfo);
+					if (opt_load) {
+						(void) load_recv_msg(sock_from_alice, bob_name,
+								alice_name, &oinfo);
+					} else {
+						(void) recv_otr_msg(sock_from_alice, bob_name,
+								alice_name, &oinfo);
+					}
 				}
 				continue;
 			} else {
@@ -1047,6 +1374,19 @@ static int init_client(void)
 		fragPolicy = OTRL_FRAGMENT_SEND_ALL;
 	}
 
+	if (opt_load) {
+		/* Alice and Bob share the userstate from their own threads. */
+		otrl_userstate_set_threaded(user_state, 1);
+		load_convs = zmalloc(opt_load * sizeof(*load_convs));
+		load_expect = zmalloc(opt_load * sizeof(*load_expect));
+		load_latency = zmalloc(opt_max_num_msg * sizeof(*load_latency));
+		if (!load_convs || !load_expect || !load_latency) {
+			fail("Out of memory for load mode");
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+
 	return 0;
 
 error:
@@ -1099,7 +1439,7 @@ int main(int argc, char **argv)
 		goto error;
 	}
 
-	while ((opt = getopt_long(argc, argv, "+i:k:f:t:m:daF", long_opts, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "+i:k:f:t:m:daFl:r:ps:", long_opts, NULL)) != -1) {
 		switch (opt) {
 		case 'i':
 			opt_instag_path = strdup(optarg);
@@ -1125,6 +1465,21 @@ int main(int argc, char **argv)
 		case 'F':
 			opt_fragment = 1;
 			break;
+		case 'l':
+			opt_load = atoi(optarg);
+			break;
+		case 'r':
+			opt_rate = atof(optarg);
+			break;
+		case 'p':
+			opt_poisson = 1;
+			break;
+		case 's':
+			if (parse_msg_size(optarg) < 0) {
+				fail("Bad message size %s", optarg);
+				goto error;
+			}
+			break;
 		default:
 			goto error;
 		}
@@ -1135,6 +1490,12 @@ int main(int argc, char **argv)
 		goto error;
 	}
 
+	if (opt_load && (!opt_max_num_msg || opt_disconnect || opt_auth)) {
+		fail("--load needs --max-msg and can't be used with --disconnect "
+				"or --auth");
+		goto error;
+	}
+
 	/* Running OTR tests. */
 	ret = init_client();
 	if (ret < 0) {
@@ -1151,6 +1512,10 @@ int main(int argc, char **argv)
 
 	run();
 
+	if (opt_load) {
+		load_report();
+	}
+
 	return exit_status();
 
 error:
@@ -0,0 +1,14 @@
+#!/bin/bash
+
+CURDIR=$(dirname $0)/
+TESTDIR=$CURDIR/..
+CLIENT=$CURDIR/client/client
+KEYFILE=$CURDIR/client/otr.key
+
+LOAD=8
+MAX_MSG=400
+
+source $TESTDIR/utils/tap/tap.sh
+
+diag "Load mode with $LOAD conversations as fast as possible and fragmentation"
+$CLIENT --load-key $KEYFILE --load $LOAD --max-msg $MAX_MSG --msg-size exp:300 --fragment
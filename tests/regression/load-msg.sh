@@ -0,0 +1,15 @@
+#!/bin/bash
+
+CURDIR=$(dirname $0)/
+TESTDIR=$CURDIR/..
+CLIENT=$CURDIR/client/client
+KEYFILE=$CURDIR/client/otr.key
+
+LOAD=8
+RATE=20 # msg/s
+MAX_MSG=400
+
+source $TESTDIR/utils/tap/tap.sh
+
+diag "Load mode with $LOAD Poisson conversations at $RATE msg/s each"
+$CLIENT --load-key $KEYFILE --load $LOAD --max-msg $MAX_MSG --rate $RATE --poisson --msg-size 1-600
@@ -19,6 +19,8 @@
 #include <context.h>
 #include <gcrypt.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <tap/tap.h>
 #include <utils.h>
@@ -26,7 +28,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 5
+#define NUM_TESTS 10
 
 static void test_auth_new(void)
 {
@@ -119,6 +121,34 @@ static void test_auth_start_v23(void)
 		"OTR auth start v23 is valid");
 }
 
+static void test_auth_start_v23_prepared(void)
+{
+	struct context ctx;
+	OtrlAuthInfo *auth = &ctx.auth;
+	unsigned char hashgx[32];
+
+	otrl_auth_new(&ctx);
+	otrl_auth_prepare_commit(&auth->prepared, NULL, time(NULL) + 60);
+	memmove(hashgx, auth->prepared.hashgx, 32);
+
+	ok(otrl_auth_start_v23(auth, 3) == gcry_error(GPG_ERR_NO_ERROR) &&
+		memcmp(auth->hashgx, hashgx, 32) == 0 &&
+		auth->prepared.encgx == NULL &&
+		auth->lastauthmsg != NULL &&
+		auth->authstate == OTRL_AUTHSTATE_AWAITING_DHKEY,
+		"OTR auth start v23 uses prepared material");
+
+	otrl_auth_prepare_commit(&auth->prepared, NULL, time(NULL) - 1);
+	memmove(hashgx, auth->prepared.hashgx, 32);
+
+	ok(otrl_auth_start_v23(auth, 3) == gcry_error(GPG_ERR_NO_ERROR) &&
+		memcmp(auth->hashgx, hashgx, 32) != 0 &&
+		auth->prepared.encgx == NULL,
+		"OTR auth start v23 ignores expired material");
+
+	otrl_auth_clear(auth);
+}
+
 static void test_otrl_auth_copy_on_key()
 {
 	struct context m_ctx, ctx;
@@ -161,6 +191,58 @@ static void test_otrl_auth_copy_on_key()
 		"Copy OK");
 }
 
+static void test_otrl_auth_message_parse(void)
+{
+	struct context alice, bob;
+	OtrlAuthMessage msg;
+	gcry_error_t err;
+	char *cut;
+
+	memset(&alice, 0, sizeof(alice));
+	memset(&bob, 0, sizeof(bob));
+	alice.m_context = &alice;
+	bob.m_context = &bob;
+	alice.our_instance = bob.their_instance = 0x101;
+	bob.our_instance = alice.their_instance = 0x102;
+	otrl_auth_new(&alice);
+	otrl_auth_new(&bob);
+	otrl_auth_start_v23(&alice.auth, 3);
+
+	err = otrl_auth_message_parse(&msg, alice.auth.lastauthmsg);
+	ok(err == gcry_error(GPG_ERR_NO_ERROR) && msg.buf == msg.space &&
+		msg.version == 3 && msg.msgtype == '\x02' &&
+		msg.instance_from == 0x101 && msg.instance_to == 0x102 &&
+		msg.encgx_len == alice.auth.encgx_len &&
+		memcmp(msg.encgx, alice.auth.encgx, msg.encgx_len) == 0 &&
+		memcmp(msg.hashgx, alice.auth.hashgx, 32) == 0,
+		"D-H Commit parsed into its fields");
+
+	err = otrl_auth_handle_commit_parsed(&bob.auth, &msg);
+	otrl_auth_message_free(&msg);
+	ok(err == gcry_error(GPG_ERR_NO_ERROR) &&
+		bob.auth.authstate == OTRL_AUTHSTATE_AWAITING_REVEALSIG &&
+		bob.auth.encgx_len == alice.auth.encgx_len &&
+		memcmp(bob.auth.encgx, alice.auth.encgx,
+			bob.auth.encgx_len) == 0 &&
+		otrl_auth_message_parse(&msg, bob.auth.lastauthmsg) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+		msg.msgtype == '\x0a' && msg.gy_len > 0 && msg.gy_len <= 192,
+		"Parsed D-H Commit answered with a D-H Key");
+	otrl_auth_message_free(&msg);
+
+	/* Drop the last four base64 characters */
+	cut = strdup(alice.auth.lastauthmsg);
+	strcpy(cut + strlen(cut) - 5, ".");
+	ok(otrl_auth_message_parse(&msg, cut) ==
+		gcry_error(GPG_ERR_INV_VALUE),
+		"Truncated message turned down");
+	otrl_auth_message_free(&msg);
+	free(cut);
+
+	otrl_auth_clear(&alice.auth);
+	otrl_auth_clear(&bob.auth);
+}
+
 int main(int argc, char **argv)
 {
 	/* Libtap call for the number of tests planned. */
@@ -175,7 +257,9 @@ int main(int argc, char **argv)
 	test_auth_new();
 	test_auth_clear();
 	test_auth_start_v23();
+	test_auth_start_v23_prepared();
 	test_otrl_auth_copy_on_key();
+	test_otrl_auth_message_parse();
 
 	return 0;
 }
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <b64.h>
 #include <tap/tap.h>
@@ -26,7 +27,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 10
+#define NUM_TESTS 22
 
 const char *alphanum_encoded =
 	"?OTR:" "YWJjZGVmZ2hpamtsbW5vcHFyc3R1dnd4eXoxMjM0NTY3ODkwCg==" ".";
@@ -100,6 +101,163 @@ static void test_otrl_base64_otr_encode(void)
 	free(encoded);
 }
 
+static void test_otrl_base64_decoder(void)
+{
+	/* Skipped characters and an early '=' */
+	const char *input = "YWJj ZGVm\nZ2hp-amts=bW5v";
+	unsigned char expected[16], got[16];
+	size_t expectedlen, gotlen = 0, n, step;
+	OtrlBase64Decoder dec;
+	int same = 1;
+
+	expectedlen = otrl_base64_decode(expected, input, strlen(input));
+
+	for (step = 1; step <= 4; step++) {
+		otrl_base64_decoder_init(&dec, input, strlen(input));
+		gotlen = 0;
+		do {
+			n = otrl_base64_decoder_read(&dec, got + gotlen, step);
+			gotlen += n;
+		} while (n == step);
+		if (gotlen != expectedlen || memcmp(got, expected, gotlen)) {
+			same = 0;
+		}
+	}
+	ok(same, "Streaming decode matches otrl_base64_decode");
+
+	otrl_base64_decoder_init(&dec, input, strlen(input));
+	n = otrl_base64_decoder_read(&dec, got, 2);
+	ok(n == 2 && otrl_base64_decoder_remaining(&dec) >= expectedlen - 2,
+		"Streaming decode remaining length is an upper bound");
+}
+
+/* The plain one-block-at-a-time encoding the SIMD code must agree with */
+static size_t ref_encode(char *out, const unsigned char *in, size_t inlen)
+{
+	const char *alphabet =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i, len = 0;
+
+	for (i = 0; i < inlen; i += 3) {
+		unsigned int v = in[i] << 16;
+		if (i + 1 < inlen) v |= in[i + 1] << 8;
+		if (i + 2 < inlen) v |= in[i + 2];
+		out[len++] = alphabet[(v >> 18) & 0x3f];
+		out[len++] = alphabet[(v >> 12) & 0x3f];
+		out[len++] = i + 1 < inlen ? alphabet[(v >> 6) & 0x3f] : '=';
+		out[len++] = i + 2 < inlen ? alphabet[v & 0x3f] : '=';
+	}
+	return len;
+}
+
+static void test_otrl_base64_simd(void)
+{
+	unsigned char data[304], decoded[304];
+	char encoded[420], expected[420], spaced[440];
+	size_t len, off, enclen, declen, i, j;
+	OtrlBase64Decoder dec;
+	int level;
+
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = (unsigned char) (i * 167 + 13);
+	}
+
+	for (level = OTRL_B64_SIMD_NONE; level <= OTRL_B64_SIMD_AVX2; level++) {
+		int encsame = 1, decsame = 1;
+		otrl_base64_set_simd_level(level);
+
+		for (len = 0; len <= 300; len++) {
+			for (off = 0; off < 4; off++) {
+				enclen = otrl_base64_encode(encoded, data + off, len);
+				if (enclen != ref_encode(expected, data + off, len) ||
+						memcmp(encoded, expected, enclen)) {
+					encsame = 0;
+				}
+
+				declen = otrl_base64_decode(decoded, encoded, enclen);
+				if (declen != len || memcmp(decoded, data + off, len)) {
+					decsame = 0;
+				}
+
+				/* A newline in the middle of the input */
+				for (i = 0, j = 0; i < enclen; i++) {
+					if (i == enclen / 2 + off) spaced[j++] = '\n';
+					spaced[j++] = encoded[i];
+				}
+				declen = otrl_base64_decode(decoded, spaced, j);
+				if (declen != len || memcmp(decoded, data + off, len)) {
+					decsame = 0;
+				}
+
+				otrl_base64_decoder_init(&dec, spaced, j);
+				declen = 0;
+				do {
+					i = otrl_base64_decoder_read(&dec, decoded + declen, 50);
+					declen += i;
+				} while (i == 50);
+				if (declen != len || memcmp(decoded, data + off, len)) {
+					decsame = 0;
+				}
+			}
+		}
+		ok(encsame, "Encode at SIMD level %d matches the reference", level);
+		ok(decsame, "Decode at SIMD level %d round trips", level);
+	}
+
+	otrl_base64_set_simd_level(OTRL_B64_SIMD_AVX2);
+}
+
+/* Return the MB/s of round trips of len bytes through base64 */
+static double bench_roundtrip(unsigned char *data, char *encoded,
+		unsigned char *decoded, size_t len, int *same)
+{
+	size_t total = 0, enclen = 0, declen = 0;
+	clock_t start = clock(), elapsed;
+
+	do {
+		enclen = otrl_base64_encode(encoded, data, len);
+		declen = otrl_base64_decode(decoded, encoded, enclen);
+		total += len;
+		elapsed = clock() - start;
+	} while (total < 16 * 1024 * 1024 || elapsed < CLOCKS_PER_SEC / 20);
+
+	*same = declen == len && !memcmp(decoded, data, len);
+	return elapsed > 0 ?
+		(double) total / (1024 * 1024) / elapsed * CLOCKS_PER_SEC : 0;
+}
+
+static void test_otrl_base64_benchmark(void)
+{
+	const size_t sizes[] = { 1024, 16 * 1024, 256 * 1024, 1024 * 1024 };
+	size_t maxlen = sizes[3], i;
+	unsigned char *data = malloc(maxlen), *decoded = malloc(maxlen);
+	char *encoded = malloc((maxlen + 2) / 3 * 4);
+	int best = otrl_base64_simd_level();
+
+	for (i = 0; i < maxlen; i++) {
+		data[i] = (unsigned char) (i * 2654435761u >> 13);
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int scalarsame, simdsame;
+		double scalar, simd;
+
+		otrl_base64_set_simd_level(OTRL_B64_SIMD_NONE);
+		scalar = bench_roundtrip(data, encoded, decoded, sizes[i],
+				&scalarsame);
+		otrl_base64_set_simd_level(best);
+		simd = bench_roundtrip(data, encoded, decoded, sizes[i], &simdsame);
+
+		diag("%7zu bytes: scalar %.0f MB/s, SIMD level %d %.0f MB/s",
+				sizes[i], scalar, best, simd);
+		ok(scalarsame && simdsame, "Round trip of %zu bytes", sizes[i]);
+	}
+
+	free(data);
+	free(decoded);
+	free(encoded);
+}
+
 int main(int argc, char** argv)
 {
 	plan_tests(NUM_TESTS);
@@ -109,6 +267,9 @@ int main(int argc, char** argv)
 
 	test_otrl_base64_otr_decode();
 	test_otrl_base64_otr_encode();
+	test_otrl_base64_decoder();
+	test_otrl_base64_simd();
+	test_otrl_base64_benchmark();
 
 	return 0;
 }
@@ -0,0 +1,90 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <capture.h>
+#include <proto.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 4
+
+/* Skip the time at the start of a capture line */
+static const char *after_time(const char *line)
+{
+	const char *space = strchr(line, ' ');
+
+	return space ? space + 1 : "";
+}
+
+static void test_otrl_capture(void)
+{
+	FILE *f = tmpfile();
+	OtrlCapture *cap = otrl_capture_new(f);
+	char lines[6][128];
+	int i, n = 0;
+
+	otrl_capture_received(cap, "me@example.org", "prpl-xmpp",
+			"alice@example.org", "?OTRv3?");
+	otrl_capture_sent(cap, "me@example.org", "prpl-xmpp",
+			"alice@example.org", "?OTR:AAMCAAABAAAAAAA=.");
+	otrl_capture_sent(cap, "me@example.org", "prpl-xmpp",
+			"bob@example.org", "Hello, Bob");
+	otrl_capture_received(cap, "me@example.org", "prpl-irc",
+			"alice@example.org", "?OTR|00000100|00000200,00002,00003,"
+			"QUJD,");
+	otrl_capture_received(cap, "me@example.org", "prpl-xmpp",
+			"bob@example.org", "?OTR:AAMDAAABAAAAAAA=.");
+	otrl_capture_free(cap);
+
+	rewind(f);
+	while (n < 6 && fgets(lines[n], sizeof(lines[n]), f)) n++;
+	fclose(f);
+
+	ok(n == 6 && !strcmp(lines[0], "# libotr capture 1\n"),
+			"One line for each message");
+	ok(!strcmp(after_time(lines[1]), "R 1 1 query 7\n") &&
+			!strcmp(after_time(lines[2]), "S 1 1 commit 22\n") &&
+			!strcmp(after_time(lines[5]), "R 1 2 data 22\n"),
+			"Messages recorded by kind and length");
+	ok(!strcmp(after_time(lines[3]), "S 1 2 plain 10\n") &&
+			!strcmp(after_time(lines[4]), "R 2 3 frag 40 2/3\n"),
+			"Accounts and correspondents numbered as first seen");
+
+	for (i = 0; i < n; i++) {
+		if (strstr(lines[i], "example") || strstr(lines[i], "Bob")) {
+			break;
+		}
+	}
+	ok(i == n, "Nothing of names or texts recorded");
+}
+
+int main(int argc, char **argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_capture();
+
+	return 0;
+}
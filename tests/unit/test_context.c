@@ -16,13 +16,19 @@
  */
 
 #include <limits.h>
+#include <stdio.h>
 #include <pthread.h>
 
 #include <context.h>
+#include <dh.h>
+#include <mem.h>
+#include <proto.h>
 
 #include <tap/tap.h>
 
-#define NUM_TESTS 22
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 45
 
 static void test_otrl_context_find_fingerprint(void)
 {
@@ -199,16 +205,347 @@ static void test_otrl_context_set_trust(void)
 	ok(strcmp(fprint.trust, trust) == 0, "Fingerprint set with success");
 }
 
+static void test_otrl_context_find_index(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *contexts[64], *master, *child, *c;
+	char user[16];
+	int i, added, sorted = 1, found = 1;
+
+	for (i = 0; i < 64; i++) {
+		snprintf(user, sizeof(user), "user%02d", (i * 37) % 64);
+		contexts[i] = otrl_context_find(us, user, "account", "proto",
+				OTRL_INSTAG_MASTER, 1, &added, NULL, NULL);
+		if (!added) found = 0;
+	}
+	ok(found && us->context_index_used == 64,
+			"Contexts added to the index");
+
+	for (i = 0; i < 64; i++) {
+		snprintf(user, sizeof(user), "user%02d", (i * 37) % 64);
+		if (otrl_context_find(us, user, "account", "proto",
+				OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) != contexts[i]) {
+			found = 0;
+		}
+	}
+	ok(found, "Contexts found through the index");
+
+	for (c = us->context_root; c && c->next; c = c->next) {
+		if (strcmp(c->username, c->next->username) >= 0) sorted = 0;
+	}
+	ok(sorted, "Context list still sorted");
+
+	ok(otrl_context_find(us, "nobody", "account", "proto",
+			OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) == NULL,
+			"Missing context not found");
+
+	master = otrl_context_find(us, "user10", "account", "proto",
+			OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+	child = otrl_context_find(us, "user10", "account", "proto",
+			0x1234, 1, NULL, NULL, NULL);
+	ok(child != master && child->m_context == master &&
+			master->next == child &&
+			otrl_context_find(us, "user10", "account", "proto",
+				0x1234, 0, NULL, NULL, NULL) == child,
+			"Child instance found after its master");
+	ok(child->username == master->username &&
+			child->accountname == contexts[0]->accountname &&
+			child->protocol == contexts[0]->protocol,
+			"Context strings are shared");
+
+	otrl_context_forget(master);
+	ok(otrl_context_find(us, "user10", "account", "proto",
+			OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) == NULL &&
+			otrl_context_find(us, "user11", "account", "proto",
+				OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) != NULL &&
+			us->context_index_used == 63,
+			"Forgotten contexts removed from the index");
+
+	otrl_context_find(us, "user64", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_context_find(us, "user10", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_context_find(us, "user10", "account", "proto2",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_context_find(us, "user65", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	for (c = us->context_root; c && c->next; c = c->next) {
+		if (strcmp(c->username, c->next->username) > 0 ||
+				(c->username == c->next->username &&
+				strcmp(c->protocol, c->next->protocol) >= 0)) {
+			sorted = 0;
+		}
+	}
+	ok(sorted && us->context_index_used == 67,
+			"Contexts added after the last one still sorted");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_context_find_unindexed(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *alice, *child, *bob, *c;
+
+	alice = otrl_context_find(us, "alice", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	child = otrl_context_find(us, "alice", "account", "proto",
+			0x1234, 1, NULL, NULL, NULL);
+
+	/* As if the first index couldn't be allocated */
+	free(us->context_index);
+	us->context_index = NULL;
+	us->context_index_size = 0;
+	us->context_index_used = 0;
+	for (c = us->context_root; c; c = c->next) {
+		c->context_priv->index_next = NULL;
+		c->context_priv->index_tous = NULL;
+	}
+	ok(otrl_context_find(us, "alice", "account", "proto",
+			OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) == alice &&
+			otrl_context_find(us, "alice", "account", "proto",
+				0x1234, 0, NULL, NULL, NULL) == child,
+			"Contexts found without an index");
+
+	bob = otrl_context_find(us, "bob", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	ok(us->context_index != NULL && us->context_index_used == 2 &&
+			alice->context_priv->index_tous != NULL &&
+			child->context_priv->index_tous == NULL &&
+			otrl_context_find(us, "alice", "account", "proto",
+				OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) == alice &&
+			otrl_context_find(us, "bob", "account", "proto",
+				OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) == bob,
+			"Index built with every context once it can be");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_context_find_children(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *master, *children[8], *c;
+	otrl_instag_t instag;
+	int i, inorder = 1, found = 1;
+
+	master = otrl_context_find(us, "alice", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	for (i = 0; i < 8; i++) {
+		children[i] = otrl_context_find(us, "alice", "account",
+				"proto", 0x1000 + ((i * 5) % 8) * 0x100, 1, NULL,
+				NULL, NULL);
+	}
+	instag = 0;
+	for (c = master->next; c && c->m_context == master; c = c->next) {
+		if (c->their_instance <= instag) inorder = 0;
+		instag = c->their_instance;
+	}
+	for (i = 0; i < 8; i++) {
+		if (master->context_priv->children[i]->their_instance !=
+				0x1000 + (otrl_instag_t)i * 0x100) {
+			inorder = 0;
+		}
+	}
+	ok(inorder && master->context_priv->children_used == 8,
+			"Children kept in order in the list and the index");
+
+	for (i = 0; i < 8; i++) {
+		if (otrl_context_find(us, "alice", "account", "proto",
+				children[i]->their_instance, 0, NULL, NULL,
+				NULL) != children[i]) {
+			found = 0;
+		}
+	}
+	ok(found && otrl_context_find(us, "alice", "account", "proto",
+				0x1050, 0, NULL, NULL, NULL) == NULL,
+			"Children found through the index");
+
+	c = otrl_context_find(us, "alice", "account", "proto",
+			OTRL_INSTAG_BEST, 0, NULL, NULL, NULL);
+	children[1]->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	otrl_context_best_changed(children[1]);
+	ok(c != children[1] && otrl_context_find(us, "alice", "account",
+				"proto", OTRL_INSTAG_BEST, 0, NULL, NULL,
+				NULL) == children[1],
+			"Best instance worked out again after a change");
+	children[1]->msgstate = OTRL_MSGSTATE_PLAINTEXT;
+
+	otrl_context_forget(children[1]);
+	ok(master->context_priv->children_used == 7 &&
+			otrl_context_find(us, "alice", "account", "proto",
+				0x1500, 0, NULL, NULL, NULL) == NULL &&
+			otrl_context_find(us, "alice", "account", "proto",
+				OTRL_INSTAG_BEST, 0, NULL, NULL, NULL) !=
+				children[1],
+			"Forgotten child removed from the index");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_context_fingerprint_table(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *alice, *bob;
+	Fingerprint *fprints[200], *f, *shared;
+	unsigned char fingerprint[20];
+	int i, added, all_added = 1, found = 1;
+
+	alice = otrl_context_find(us, "alice", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	bob = otrl_context_find(us, "bob", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	memset(fingerprint, 0, sizeof(fingerprint));
+	for (i = 0; i < 200; i++) {
+		fingerprint[0] = i;
+		fingerprint[19] = i;
+		fprints[i] = otrl_context_find_fingerprint(alice, fingerprint,
+				1, &added);
+		if (!added || fprints[i]->fingerprint != (unsigned char *)
+				(fprints[i] + 1)) {
+			all_added = 0;
+		}
+	}
+	for (i = 0; i < 200; i++) {
+		fingerprint[0] = i;
+		fingerprint[19] = i;
+		if (otrl_context_find_fingerprint(alice, fingerprint, 1,
+				&added) != fprints[i] || added) {
+			found = 0;
+		}
+	}
+	ok(all_added && found && us->fingerprint_table_used == 200 &&
+			us->fingerprint_table_size >= 200,
+			"Fingerprints found through the table");
+
+	fingerprint[0] = 7;
+	fingerprint[19] = 7;
+	ok(otrl_context_find_fingerprint(bob, fingerprint, 0, NULL) == NULL,
+			"Another context's fingerprint not found");
+	shared = otrl_context_find_fingerprint(bob, fingerprint, 1, NULL);
+	f = otrl_context_fingerprint_next(us, fingerprint, NULL);
+	ok(f && otrl_context_fingerprint_next(us, fingerprint, f) &&
+			otrl_context_fingerprint_next(us, fingerprint,
+				otrl_context_fingerprint_next(us, fingerprint,
+					f)) == NULL &&
+			(f == shared || f == fprints[7]),
+			"Every context with a fingerprint found");
+
+	otrl_context_forget_fingerprint(shared, 0);
+	ok(otrl_context_fingerprint_next(us, fingerprint, NULL) ==
+			fprints[7] && us->fingerprint_table_used == 200,
+			"Forgotten fingerprint removed from the table");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_context_slab(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *one, *two, *three;
+
+	otrl_userstate_set_context_slab(us, 1);
+	one = otrl_context_find(us, "one", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	two = otrl_context_find(us, "two", "account", "proto",
+			0x1234, 1, NULL, NULL, NULL);
+	ok(one->context_priv->in_slab && two->context_priv->in_slab &&
+			two->m_context->context_priv->in_slab &&
+			(char *)one->context_priv > (char *)one &&
+			(char *)one->smstate > (char *)one->context_priv,
+			"Contexts allocated from the slab");
+
+	otrl_context_forget(one);
+	three = otrl_context_find(us, "three", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	ok(three == one && strcmp(three->username, "three") == 0 &&
+			otrl_context_find(us, "one", "account", "proto",
+				OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) == NULL,
+			"Forgotten context's block reused");
+
+	otrl_userstate_free(us);
+}
+
+static int app_data_freed;
+
+static void count_app_data_free(void *data)
+{
+	app_data_freed++;
+}
+
+static void test_otrl_context_forget_all(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *alice, *child, *bob, *carol;
+	OtrlMemStats before, after;
+	DH_keypair warm;
+	unsigned char fingerprint[20];
+
+	/* libgcrypt keeps some memory of its own from the first keypair */
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &warm);
+	otrl_dh_keypair_free(&warm);
+	otrl_mem_get_stats(&before);
+	otrl_userstate_set_context_slab(us, 1);
+	alice = otrl_context_find(us, "alice", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	child = otrl_context_find(us, "alice", "account", "proto",
+			0x1234, 1, NULL, NULL, NULL);
+	otrl_userstate_set_context_slab(us, 0);
+	bob = otrl_context_find(us, "bob", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+
+	memset(fingerprint, 0x42, sizeof(fingerprint));
+	otrl_context_set_trust(otrl_context_find_fingerprint(alice,
+				fingerprint, 1, NULL), "verified");
+	otrl_context_find_fingerprint(bob, fingerprint, 1, NULL);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &(child->auth.our_dh));
+	otrl_dh_gen_keypair(DH1536_GROUP_ID,
+			&(child->context_priv->our_dh_key));
+	child->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice->app_data = bob->app_data = &app_data_freed;
+	alice->app_data_free = bob->app_data_free = count_app_data_free;
+	otrl_userstate_deadline_add(us, child, 100);
+	otrl_userstate_heartbeat_queue(us, bob, 100);
+
+	app_data_freed = 0;
+	otrl_context_forget_all(us);
+	otrl_mem_get_stats(&after);
+	ok(us->context_root == NULL && us->intern_table_used == 0 &&
+			app_data_freed == 2,
+			"Every context forgotten, encrypted or not");
+	ok(after.live_bytes == before.live_bytes,
+			"Keys and other secrets all freed through the wiping "
+			"allocator");
+	ok(otrl_userstate_deadline_next(us) == 0 &&
+			us->heartbeat_head == NULL &&
+			us->heartbeat_tail == &(us->heartbeat_head) &&
+			(carol = otrl_context_find(us, "carol", "account",
+				"proto", OTRL_INSTAG_MASTER, 1, NULL, NULL,
+				NULL)) != NULL &&
+			us->context_root == carol,
+			"Userstate emptied and still usable");
+
+	otrl_userstate_free(us);
+}
+
 int main(int argc, char **argv)
 {
 	plan_tests(NUM_TESTS);
 
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
 	test_otrl_context_set_trust();
 	test_otrl_context_find_recent_instance();
 	test_otrl_context_find_fingerprint();
 	test_otrl_context_find_recent_secure_instance();
 	test_otrl_context_is_fingerprint_trusted();
 	test_otrl_context_update_recent_child();
+	test_otrl_context_find_index();
+	test_otrl_context_find_unindexed();
+	test_otrl_context_find_children();
+	test_otrl_context_fingerprint_table();
+	test_otrl_context_slab();
+	test_otrl_context_forget_all();
 
 	return 0;
 }
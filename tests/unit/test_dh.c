@@ -17,6 +17,8 @@
 
 #include <gcrypt.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <dh.h>
 #include <proto.h>
@@ -26,7 +28,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 38
+#define NUM_TESTS 48
 
 /*
  * The re-implementation/inclusion of crypto stuff is necessary because libotr
@@ -113,6 +115,50 @@ static void test_otrl_dh_session_free()
 		"Session freed");
 }
 
+static void test_otrl_dh_session_rekey()
+{
+	DH_sesskeys sess, fresh;
+	DH_keypair kp1, kp2, kp3;
+	gcry_cipher_hd_t sendenc, rcvenc;
+	gcry_md_hd_t sendmac, rcvmac;
+	unsigned char buf1[16] = {0}, buf2[16] = {0};
+	unsigned char *mac1, *mac2;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &(kp1));
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &(kp2));
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &(kp3));
+	otrl_dh_session(&sess, &kp1, kp2.pub);
+	sendenc = sess.sendenc;
+	rcvenc = sess.rcvenc;
+	sendmac = sess.sendmac;
+	rcvmac = sess.rcvmac;
+	sess.sendmacused = 1;
+
+	otrl_dh_session_rekey(&sess, &kp1, kp3.pub);
+	otrl_dh_session(&fresh, &kp1, kp3.pub);
+	ok(sess.sendenc == sendenc && sess.rcvenc == rcvenc &&
+		sess.sendmac == sendmac && sess.rcvmac == rcvmac &&
+		sess.sendmacused == 0,
+		"Session rekeyed in the same handles");
+
+	gcry_cipher_encrypt(sess.sendenc, buf1, 16, NULL, 0);
+	gcry_cipher_encrypt(fresh.sendenc, buf2, 16, NULL, 0);
+	gcry_md_write(sess.rcvmac, "rekey", 5);
+	gcry_md_write(fresh.rcvmac, "rekey", 5);
+	mac1 = gcry_md_read(sess.rcvmac, GCRY_MD_SHA1);
+	mac2 = gcry_md_read(fresh.rcvmac, GCRY_MD_SHA1);
+	ok(memcmp(buf1, buf2, 16) == 0 && memcmp(mac1, mac2, 20) == 0 &&
+		memcmp(sess.rcvmackey, fresh.rcvmackey, 20) == 0 &&
+		memcmp(sess.extrakey, fresh.extrakey,
+			OTRL_EXTRAKEY_BYTES) == 0,
+		"Rekeyed session matches a fresh one");
+
+	otrl_dh_session_free(&sess);
+	otrl_dh_session_free(&fresh);
+	otrl_dh_keypair_free(&kp1);
+	otrl_dh_keypair_free(&kp2);
+	otrl_dh_keypair_free(&kp3);
+}
 
 static void test_otrl_dh_session_blank()
 {
@@ -158,6 +204,53 @@ static void test_otrl_dh_gen_keypair(void)
 	gcry_mpi_powm(pubkey, DH1536_GENERATOR, kp.priv, DH1536_MODULUS);
 	ok(gcry_mpi_cmp(pubkey, kp.pub) == 0, "Matching pubkey");
 	otrl_dh_keypair_free(&kp);
+	gcry_mpi_release(pubkey);
+}
+
+static void test_otrl_dh_gen_keypair_many(void)
+{
+	DH_keypair kp;
+	gcry_mpi_t pubkey = gcry_mpi_new(DH1536_MOD_LEN_BITS);
+	int i, matching = 1;
+
+	for (i = 0; i < 32; i++) {
+		otrl_dh_gen_keypair(DH1536_GROUP_ID, &kp);
+		gcry_mpi_powm(pubkey, DH1536_GENERATOR, kp.priv, DH1536_MODULUS);
+		if (gcry_mpi_cmp(pubkey, kp.pub) != 0) matching = 0;
+		otrl_dh_keypair_free(&kp);
+	}
+	ok(matching, "Fixed-base pubkeys match gcry_mpi_powm");
+	gcry_mpi_release(pubkey);
+}
+
+static void test_otrl_dh_keypool(void)
+{
+	DH_keypool *pool = otrl_dh_keypool_new(4);
+	DH_keypair kp;
+	gcry_mpi_t pubkey = gcry_mpi_new(DH1536_MOD_LEN_BITS);
+	unsigned int added;
+
+	ok(pool != NULL && otrl_dh_keypool_count(pool) == 0,
+			"New keypool is empty");
+
+	added = otrl_dh_keypool_refill(pool, 10);
+	ok(added == 4 && otrl_dh_keypool_count(pool) == 4,
+			"Keypool refill stops when the pool is full");
+
+	otrl_dh_gen_keypair_pooled(pool, DH1536_GROUP_ID, &kp);
+	gcry_mpi_powm(pubkey, DH1536_GENERATOR, kp.priv, DH1536_MODULUS);
+	ok(otrl_dh_keypool_count(pool) == 3 && kp.groupid == DH1536_GROUP_ID &&
+			gcry_mpi_cmp(pubkey, kp.pub) == 0,
+			"Pooled keypair taken from the pool is valid");
+	otrl_dh_keypair_free(&kp);
+
+	otrl_dh_gen_keypair_pooled(NULL, DH1536_GROUP_ID, &kp);
+	ok(kp.pub != NULL && kp.priv != NULL,
+			"Pooled keypair generated without a pool");
+	otrl_dh_keypair_free(&kp);
+
+	otrl_dh_keypool_free(pool);
+	gcry_mpi_release(pubkey);
 }
 
 static void test_otrl_dh_keypair_free(void)
@@ -170,6 +263,49 @@ static void test_otrl_dh_keypair_free(void)
 
 }
 
+/* Is the given wire form of a DH public key the length-prefixed
+ * unsigned bytes of pub? */
+static int pubwire_matches(const unsigned char *wire, size_t wirelen,
+		gcry_mpi_t pub)
+{
+	unsigned char buf[4 + 192];
+	size_t npub;
+
+	gcry_mpi_print(GCRYMPI_FMT_USG, buf + 4, 192, &npub, pub);
+	buf[0] = buf[1] = 0;
+	buf[2] = (npub >> 8) & 0xff;
+	buf[3] = npub & 0xff;
+	return wire && wirelen == 4 + npub && memcmp(wire, buf, wirelen) == 0;
+}
+
+static void test_otrl_dh_keypair_pubwire(void)
+{
+	DH_keypair kp, copy;
+	const unsigned char *wire;
+	size_t wirelen;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &kp);
+	ok(pubwire_matches(kp.pubwire, kp.pubwirelen, kp.pub) &&
+			otrl_dh_keypair_pubwire(&kp, &wirelen) == kp.pubwire &&
+			wirelen == kp.pubwirelen,
+			"Public key serialized when generated");
+
+	otrl_dh_keypair_copy(&copy, &kp);
+	ok(copy.pubwire != kp.pubwire &&
+			pubwire_matches(copy.pubwire, copy.pubwirelen, kp.pub),
+			"Serialized public key copied");
+	otrl_dh_keypair_free(&copy);
+
+	free(kp.pubwire);
+	kp.pubwire = NULL;
+	kp.pubwirelen = 0;
+	gcry_mpi_set_ui(kp.pub, 0x1234);
+	wire = otrl_dh_keypair_pubwire(&kp, &wirelen);
+	ok(pubwire_matches(wire, wirelen, kp.pub) && wirelen == 6,
+			"Public key serialized when first asked for");
+	otrl_dh_keypair_free(&kp);
+}
+
 static void invert_DH_keypair(DH_keypair* kp1, DH_keypair* kp2)
 {
 	DH_keypair tmp;
@@ -501,13 +637,17 @@ int main(int argc, char **argv)
 	gcry_mpi_sub_ui(DH1536_MODULUS_MINUS_2, DH1536_MODULUS, 2);
 
 	test_otrl_dh_gen_keypair();
+	test_otrl_dh_gen_keypair_many();
+	test_otrl_dh_keypool();
 	test_otrl_dh_keypair_free();
+	test_otrl_dh_keypair_pubwire();
 	test_otrl_dh_keypair_init();
 	test_otrl_dh_compute_v2_auth_keys();
 	test_otrl_dh_session();
 	test_otrl_dh_keypair_copy();
 	test_otrl_dh_session_blank();
 	test_otrl_dh_session_free();
+	test_otrl_dh_session_rekey();
 	test_otrl_dh_incctr();
 	test_otrl_dh_cmpctr();
 
@@ -0,0 +1,160 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <proto.h>
+#include <context.h>
+#include <fpstore.h>
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 7
+
+#define STORE_FILE "test_fpstore.store"
+
+static unsigned char fp_a[20] = { 0xaa };
+static unsigned char fp_b[20] = { 0xbb };
+static unsigned char fp_c[20] = { 0xcc };
+static unsigned char fp_d[20] = { 0xdd };
+
+static ConnContext *find(OtrlUserState us, const char *user)
+{
+	return otrl_context_find(us, user, "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+}
+
+static Fingerprint *find_fp(OtrlUserState us, const char *user,
+		unsigned char fingerprint[20])
+{
+	return otrl_context_find_fingerprint(find(us, user), fingerprint, 0,
+			NULL);
+}
+
+static int trust_is(Fingerprint *fprint, const char *trust)
+{
+	const char *have = fprint && fprint->trust ? fprint->trust : "";
+	return fprint && !strcmp(have, trust);
+}
+
+static long file_size(void)
+{
+	struct stat st;
+	return stat(STORE_FILE, &st) ? -1 : (long)st.st_size;
+}
+
+static int num_fingerprints(OtrlUserState us)
+{
+	ConnContext *context;
+	Fingerprint *fprint;
+	int n = 0;
+
+	for (context = us->context_root; context; context = context->next) {
+		for (fprint = context->fingerprint_root.next; fprint;
+				fprint = fprint->next) {
+			n++;
+		}
+	}
+	return n;
+}
+
+static void test_otrl_fpstore(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	long size;
+	FILE *f;
+
+	otrl_context_set_trust(otrl_context_find_fingerprint(find(us, "alice"),
+				fp_a, 1, NULL), "verified");
+	otrl_context_find_fingerprint(find(us, "alice"), fp_b, 1, NULL);
+	otrl_context_set_trust(otrl_context_find_fingerprint(find(us, "bob"),
+				fp_c, 1, NULL), "a trust too long for the table");
+	otrl_fpstore_write(us, STORE_FILE);
+	otrl_userstate_free(us);
+
+	us = otrl_userstate_create();
+	ok(otrl_fpstore_open(us, STORE_FILE) == 0 && us->context_root == NULL,
+			"Store opened without loading any contexts");
+	ok(trust_is(find_fp(us, "alice", fp_a), "verified") &&
+			trust_is(find_fp(us, "alice", fp_b), "") &&
+			num_fingerprints(us) == 2,
+			"Fingerprints loaded on first lookup");
+	ok(trust_is(find_fp(us, "bob", fp_c), "a trust too long for the table"),
+			"Long trust kept in the log");
+
+	size = file_size();
+	otrl_context_set_trust(find_fp(us, "alice", fp_b), "smp");
+	ok(otrl_fpstore_sync(us) == 0 && file_size() == size,
+			"Trust change written in place");
+
+	otrl_context_find_fingerprint(find(us, "alice"), fp_d, 1, NULL);
+	otrl_context_forget_fingerprint(find_fp(us, "alice", fp_a), 1);
+	otrl_fpstore_sync(us);
+	otrl_userstate_free(us);
+
+	us = otrl_userstate_create();
+	otrl_fpstore_open(us, STORE_FILE);
+	ok(find_fp(us, "alice", fp_a) == NULL &&
+			trust_is(find_fp(us, "alice", fp_b), "smp") &&
+			find_fp(us, "alice", fp_d) != NULL && file_size() > size,
+			"Logged changes survive reopening");
+
+	size = file_size();
+	otrl_fpstore_compact(us, NULL, NULL);
+	otrl_userstate_free(us);
+	us = otrl_userstate_create();
+	otrl_fpstore_open(us, STORE_FILE);
+	otrl_fpstore_load_all(us, NULL, NULL);
+	ok(file_size() < size && num_fingerprints(us) == 3 &&
+			trust_is(find_fp(us, "bob", fp_c),
+				"a trust too long for the table"),
+			"Compacted store holds the same fingerprints");
+	otrl_userstate_free(us);
+
+	/* A crash while appending to the log leaves part of an entry */
+	f = fopen(STORE_FILE, "ab");
+	fwrite("\0\0\1", 3, 1, f);
+	fclose(f);
+	us = otrl_userstate_create();
+	otrl_fpstore_open(us, STORE_FILE);
+	otrl_context_find_fingerprint(find(us, "carol"), fp_a, 1, NULL);
+	otrl_fpstore_sync(us);
+	otrl_userstate_free(us);
+	us = otrl_userstate_create();
+	ok(otrl_fpstore_open(us, STORE_FILE) == 0 &&
+			find_fp(us, "carol", fp_a) != NULL &&
+			trust_is(find_fp(us, "alice", fp_b), "smp"),
+			"Partly written log entry replaced by the next");
+	otrl_userstate_free(us);
+
+	remove(STORE_FILE);
+}
+
+int main(int argc, char **argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_fpstore();
+
+	return 0;
+}
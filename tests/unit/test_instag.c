@@ -29,7 +29,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 13
+#define NUM_TESTS 18
 
 /* Current directory of this executable. */
 static char curdir[PATH_MAX];
@@ -164,11 +164,94 @@ static void test_otrl_instag_read_FILEp(void)
 			"Instag succesfully read");
 }
 
+static void test_otrl_instag_find_index(void)
+{
+	FILE* instf = fopen(instag_filepath, "rb");
+	OtrlUserState us = otrl_userstate_create();
+	OtrlInsTag *two, *again;
+
+	otrl_instag_read_FILEp(us, instf);
+	fclose(instf);
+
+	two = otrl_instag_find(us, "alice_irc", "IRC");
+	ok(two && two->account &&
+			otrl_userstate_account_find(us, "alice_irc", "IRC",
+				0)->instag == two &&
+			otrl_userstate_account_find(us, "alice_irc", "XMPP",
+				0) == NULL,
+			"Instag found through the account table");
+
+	/* Read the same instags again on top, then forget the newer copy */
+	instf = fopen(instag_filepath, "rb");
+	otrl_instag_read_FILEp(us, instf);
+	fclose(instf);
+	again = otrl_instag_find(us, "alice_irc", "IRC");
+	otrl_instag_forget(again);
+	ok(again != two && otrl_instag_find(us, "alice_irc", "IRC") == two &&
+			two->account->instag_count == 1,
+			"Older instag found once the newer is forgotten");
+
+	otrl_userstate_free(us);
+}
+
 static void test_otrl_instag_get_new(void)
 {
 	ok(otrl_instag_get_new() != 0, "New instag generated");
 }
 
+static void test_otrl_instag_generate_many(void)
+{
+	char instfile[] = "/tmp/libotr-testing-XXXXXX";
+	char tmpname[sizeof(instfile) + 4];
+	const char *accounts[] = { "alice", "bob", "carol" };
+	const char *protocols[] = { "irc", "irc", "xmpp" };
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	otrl_instag_t bob, carol;
+	OtrlInsTag *p;
+	FILE *instf;
+	char line[200];
+	int fd = mkstemp(instfile), lines = 0;
+
+	close(fd);
+	snprintf(tmpname, sizeof(tmpname), "%s.new", instfile);
+
+	ok(otrl_instag_generate_many(us, instfile, accounts, protocols, 3) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_instag_append(us, instfile, "bob", "irc") ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_instag_find(us, "alice", "irc") &&
+			otrl_instag_find(us, "carol", "xmpp") &&
+			otrl_instag_find(us, "bob", "irc")->instag >=
+			OTRL_MIN_VALID_INSTAG,
+			"Instags generated and appended");
+	bob = otrl_instag_find(us, "bob", "irc")->instag;
+	carol = otrl_instag_find(us, "carol", "xmpp")->instag;
+
+	otrl_instag_read(us2, instfile);
+	ok(otrl_instag_find(us2, "bob", "irc")->instag == bob &&
+			otrl_instag_find(us2, "carol", "xmpp")->instag ==
+			carol && us2->account_table_used == 3,
+			"Appended instags read back, the latest first");
+
+	otrl_instag_compact(us, instfile);
+	instf = fopen(instfile, "rb");
+	while (fgets(line, sizeof(line), instf)) {
+		lines++;
+	}
+	fclose(instf);
+	otrl_instag_forget_all(us2);
+	otrl_instag_read(us2, instfile);
+	p = otrl_instag_find(us2, "bob", "irc");
+	ok(lines == 4 && access(tmpname, F_OK) != 0 && p &&
+			p->instag == bob && p->account->instag_count == 1,
+			"Superseded instag compacted away");
+
+	otrl_userstate_free(us);
+	otrl_userstate_free(us2);
+	unlink(instfile);
+}
+
 static ssize_t get_exe_path(char *buf, size_t len)
 {
 	char *path_end;
@@ -216,7 +299,9 @@ int main(int argc, char **argv)
 	test_otrl_instag_find();
 	test_otrl_instag_read();
 	test_otrl_instag_read_FILEp();
+	test_otrl_instag_find_index();
 	test_otrl_instag_get_new();
+	test_otrl_instag_generate_many();
 
 	return 0;
 }
@@ -0,0 +1,121 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <instag.h>
+#include <keystore.h>
+#include <privkey.h>
+#include <proto.h>
+#include <userstate.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 8
+
+static void test_otrl_keystore(void)
+{
+	char keyfile[] = "/tmp/libotr-testing-XXXXXX";
+	char tagfile[] = "/tmp/libotr-testing-XXXXXX";
+	OtrlUserState gen = otrl_userstate_create();
+	OtrlUserState us1 = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	OtrlKeyStore *store = otrl_keystore_create();
+	OtrlPrivKey *shared = NULL, *own;
+	OtrlInsTag *tag;
+	char fp1[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
+	char fp2[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
+
+	close(mkstemp(keyfile));
+	close(mkstemp(tagfile));
+	otrl_privkey_generate(gen, keyfile, "service", "xmpp");
+	otrl_instag_generate(gen, tagfile, "service", "xmpp");
+
+	ok(store && otrl_keystore_read_privkeys(store, keyfile) == 0 &&
+			otrl_keystore_read_instags(store, tagfile) == 0 &&
+			(shared = otrl_keystore_find_privkey(store, "service",
+				"xmpp")) != NULL &&
+			otrl_keystore_find_privkey(store, "other",
+				"xmpp") == NULL,
+			"Keys and tags read into the store");
+
+	otrl_keystore_attach(us1, store);
+	otrl_keystore_attach(us2, store);
+	ok(otrl_privkey_find(us1, "service", "xmpp") == shared &&
+			otrl_privkey_find(us2, "service", "xmpp") == shared &&
+			us1->privkey_root == NULL && us2->privkey_root == NULL,
+			"Userstates share the store's key");
+
+	tag = otrl_instag_find(us1, "service", "xmpp");
+	ok(tag && tag == otrl_instag_find(us2, "service", "xmpp") &&
+			tag->instag == otrl_instag_find(gen, "service",
+				"xmpp")->instag,
+			"Userstates share the store's instance tag");
+
+	ok(otrl_privkey_fingerprint(us1, fp1, "service", "xmpp") &&
+			otrl_privkey_fingerprint(gen, fp2, "service", "xmpp") &&
+			!strcmp(fp1, fp2),
+			"Fingerprint of the shared key");
+
+	ok(otrl_keystore_read_privkeys(store, keyfile) ==
+			gcry_error(GPG_ERR_CONFLICT) &&
+			otrl_keystore_read_instags(store, tagfile) ==
+			gcry_error(GPG_ERR_CONFLICT),
+			"Attached store not changed");
+
+	/* A userstate's own key for the account comes first */
+	otrl_privkey_generate(us2, keyfile, "service", "xmpp");
+	own = otrl_privkey_find(us2, "service", "xmpp");
+	ok(own && own != shared &&
+			otrl_privkey_find(us1, "service", "xmpp") == shared,
+			"Own key found before the store's");
+
+	otrl_keystore_release(store);
+	otrl_userstate_free(us2);
+	ok(otrl_privkey_find(us1, "service", "xmpp") == shared,
+			"Store kept while attached");
+
+	otrl_keystore_attach(us1, NULL);
+	ok(otrl_privkey_find(us1, "service", "xmpp") == NULL &&
+			otrl_instag_find(us1, "service", "xmpp") == NULL,
+			"Detached store not used");
+
+	otrl_userstate_free(us1);
+	otrl_userstate_free(gen);
+	unlink(keyfile);
+	unlink(tagfile);
+}
+
+int main(int argc, char** argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	/* Set to quick random so we don't wait on /dev/random. */
+	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM, 0);
+
+	test_otrl_keystore();
+
+	return 0;
+}
@@ -25,7 +25,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 5
+#define NUM_TESTS 11
 
 static void test_otrl_mem_differ(void)
 {
@@ -45,6 +45,77 @@ static void test_otrl_mem_differ(void)
 			"NULL and NULL are identical");
 }
 
+static void test_otrl_mem_pool(void)
+{
+	OtrlMemStats before, during, after;
+	unsigned char *p, *q;
+	int i, same = 1;
+
+	otrl_mem_get_stats(&before);
+	p = gcry_malloc_secure(100);
+	otrl_mem_get_stats(&during);
+	ok(p != NULL && during.live_bytes == before.live_bytes + 100 &&
+			during.class_allocs[2] == before.class_allocs[2] + 1 &&
+			during.high_water_bytes >= during.live_bytes,
+			"Small allocation counted in its size class");
+
+	gcry_free(p);
+	q = gcry_malloc(100);
+	ok(q == p, "Freed block reused");
+
+	for (i = 0; i < 100; i++) {
+		q[i] = i;
+	}
+	q = gcry_realloc(q, 1000);
+	for (i = 0; i < 100; i++) {
+		if (q[i] != i) same = 0;
+	}
+	ok(q != NULL && same, "Realloc to a bigger size class keeps contents");
+	gcry_free(q);
+
+	p = gcry_malloc(100000);
+	gcry_free(p);
+	otrl_mem_get_stats(&after);
+	ok(after.live_bytes == before.live_bytes &&
+			after.large_allocs == before.large_allocs + 1 &&
+			after.high_water_bytes >= before.live_bytes + 100000,
+			"Large allocation counted and released");
+}
+
+/* Allocate and free a run of small blocks, so they end up in this
+ * thread's cache */
+static void *small_blocks(void *arg)
+{
+	void *p[40];
+	int i;
+
+	for (i = 0; i < 40; i++) {
+		p[i] = gcry_malloc_secure(32);
+	}
+	for (i = 0; i < 40; i++) {
+		gcry_free(p[i]);
+	}
+	return NULL;
+}
+
+static void test_otrl_mem_thread_cache(void)
+{
+	OtrlMemStats before, after;
+	pthread_t thread;
+
+	small_blocks(NULL);
+	otrl_mem_get_stats(&before);
+	ok(before.cached_bytes > 0, "Freed small blocks kept in a cache");
+
+	pthread_create(&thread, NULL, small_blocks, NULL);
+	pthread_join(thread, NULL);
+	otrl_mem_get_stats(&after);
+	ok(after.cached_bytes == before.cached_bytes &&
+			after.live_bytes == before.live_bytes &&
+			after.class_allocs[1] == before.class_allocs[1] + 40,
+			"Thread's cache handed back when it exits");
+}
+
 int main(int argc, char **argv)
 {
 	plan_tests(NUM_TESTS);
@@ -53,6 +124,8 @@ int main(int argc, char **argv)
 	OTRL_INIT;
 
 	test_otrl_mem_differ();
+	test_otrl_mem_pool();
+	test_otrl_mem_thread_cache();
 
 	return 0;
 }
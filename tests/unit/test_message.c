@@ -0,0 +1,874 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <context_priv.h>
+#include <dh.h>
+#include <proto.h>
+#include <message.h>
+#include <userstate.h>
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+/* The tests of a build without version 2, which others skip */
+#ifdef OTRL_NO_PROTOCOL_V2
+#define NUM_UNBUILT_TESTS 1
+#else
+#define NUM_UNBUILT_TESTS 0
+#endif
+
+#define NUM_TESTS (35 + NUM_UNBUILT_TESTS)
+
+static int policy_calls;
+static int results_calls;
+static char *kept_message;
+
+static OtrlPolicy test_policy(void *opdata, ConnContext *context)
+{
+	policy_calls++;
+	return OTRL_POLICY_MANUAL;
+}
+
+static void test_handle_results(void *opdata, OtrlReceivedResult *results,
+		size_t count)
+{
+	results_calls++;
+
+	ok(count == 4 && results[0].ignore == 0 &&
+			results[0].newmessage == NULL && results[1].ignore == 0 &&
+			results[3].ignore == 1,
+			"Batch results are in item order");
+	ok(results[0].context && results[0].context == results[2].context &&
+			results[0].context != results[1].context &&
+			!strcmp(results[1].context->username, "bob"),
+			"Batch results carry each message's context");
+
+	/* Keep the stripped tagged message */
+	kept_message = results[2].newmessage;
+	results[2].newmessage = NULL;
+}
+
+static int mms_calls;
+static int inject_calls;
+static size_t injected_count;
+static int injected_ok;
+
+static int test_max_message_size(void *opdata, ConnContext *context)
+{
+	mms_calls++;
+	return 60;
+}
+
+static void test_inject_messages(void *opdata, const OtrlInjectMessage *msgs,
+		size_t count)
+{
+	size_t i;
+
+	inject_calls++;
+	injected_count = count;
+	injected_ok = 1;
+	/* The fragments have v2 headers, or v3 ones in a build without
+	 * version 2 */
+	for (i = 0; i < count; i++) {
+		if (strlen(msgs[i].message) > 60 ||
+				strncmp(msgs[i].message, "?OTR", 4) ||
+				(msgs[i].message[4] != ',' &&
+				 msgs[i].message[4] != '|') ||
+				strcmp(msgs[i].accountname, "me")) {
+			injected_ok = 0;
+		}
+	}
+	/* alice's fragments come first */
+	if (count < 2 || strcmp(msgs[0].recipient, "alice") ||
+			strcmp(msgs[count - 1].recipient, "bob")) {
+		injected_ok = 0;
+	}
+}
+
+static void test_otrl_message_sending_batch(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	OtrlSendResult results[3];
+	OtrlSendMessage items[] = {
+		{ "me", "proto", "alice", OTRL_INSTAG_BEST, "?OTR?", NULL },
+		{ "me", "proto", "alice", OTRL_INSTAG_BEST, "hello", NULL },
+		{ "me", "proto", "bob", OTRL_INSTAG_BEST, "?OTR?", NULL },
+	};
+
+	memset(&ops, 0, sizeof(ops));
+	ops.policy = test_policy;
+	ops.max_message_size = test_max_message_size;
+
+	ok(otrl_message_sending_batch(us, &ops, NULL, items, 3, results,
+			test_inject_messages, NULL, NULL) == 0 &&
+			inject_calls == 1 && injected_ok,
+			"Batch sent as fragments in one inject call");
+	ok(mms_calls == 1, "Max message size asked once per "
+			"account and protocol");
+	ok(results[0].injected && !results[1].injected &&
+			results[2].injected && results[1].err == 0 &&
+			results[0].context != results[2].context,
+			"Plaintext left for the caller to send");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_message_receiving_batch(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	OtrlReceivedMessage items[] = {
+		{ "me", "proto", "alice", "hello" },
+		{ "me", "proto", "bob", "hi there" },
+		{ "me", "proto", "alice",
+			"tagged" OTRL_MESSAGE_TAG_BASE OTRL_MESSAGE_TAG_V2 },
+		{ "me", "proto", "bob", "?OTR:AAMDWnOl." },
+	};
+
+	memset(&ops, 0, sizeof(ops));
+	ops.policy = test_policy;
+
+	ok(otrl_message_receiving_batch(us, &ops, NULL, items, 4,
+			test_handle_results, NULL, NULL) == 0 &&
+			results_calls == 1, "Batch handled with one results call");
+	ok(policy_calls == 2, "Policy asked once per correspondent");
+	ok(kept_message && !strcmp(kept_message, "tagged"),
+			"Whitespace tag stripped from kept message");
+
+	otrl_message_free(kept_message);
+	otrl_userstate_free(us);
+}
+
+static const char *offload_expected[] = {
+	"hi", "?OTR:AAMCbogus.", "hello"
+};
+static int offload_results;
+static int offload_in_order = 1;
+static void (*queued_run)(void *job);
+static void *queued_job;
+static int queued_calls;
+
+static void test_handle_offload(void *opdata, const OtrlReceivedMessage *item,
+		OtrlReceivedResult *result)
+{
+	if (offload_results >= 3 ||
+			strcmp(item->message, offload_expected[offload_results])) {
+		offload_in_order = 0;
+	}
+	offload_results++;
+}
+
+static void test_queue_submit(void *submitdata, void (*run)(void *job),
+		void *job)
+{
+	queued_calls++;
+	queued_run = run;
+	queued_job = job;
+}
+
+static void test_otrl_message_receiving_offload(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.policy = test_policy;
+
+	otrl_userstate_set_offload(us, 0, test_queue_submit, NULL);
+	otrl_message_receiving_offload(us, &ops, NULL, "me", "proto",
+			"alice", "?OTR:AAMCbogus.", test_handle_offload,
+			NULL, NULL);
+	otrl_message_receiving_offload(us, &ops, NULL, "me", "proto",
+			"alice", "hello", test_handle_offload, NULL, NULL);
+	otrl_message_receiving_offload(us, &ops, NULL, "me", "proto",
+			"bob", "hi", test_handle_offload, NULL, NULL);
+	ok(queued_calls == 1 && offload_results == 1,
+			"AKE message queued with the next one behind it");
+
+	queued_run(queued_job);
+	ok(offload_results == 3 && offload_in_order,
+			"Queued messages handled in order");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_message_resume(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	OtrlReceiveHandle *ake, *hello, *hi;
+	char *newmessage = NULL;
+	int ake_ret, hello_ret, hi_ret;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.policy = test_policy;
+
+	ake_ret = otrl_message_receiving_start(us, &ops, NULL, "me", "proto",
+			"alice", "?OTR:AAMCbogus.", &newmessage, NULL, NULL, &ake,
+			NULL, NULL);
+	hello_ret = otrl_message_receiving_start(us, &ops, NULL, "me",
+			"proto", "alice", "hello", &newmessage, NULL, NULL, &hello,
+			NULL, NULL);
+	hi_ret = otrl_message_receiving_start(us, &ops, NULL, "me", "proto",
+			"bob", "hi", &newmessage, NULL, NULL, &hi, NULL, NULL);
+	ok(ake_ret == OTRL_RECEIVE_IN_PROGRESS && ake &&
+			hello_ret == OTRL_RECEIVE_IN_PROGRESS && hello &&
+			hi_ret == 0 && hi == NULL,
+			"AKE message left in progress with the next one behind it");
+
+	/* Resuming the later message handles the earlier one first */
+	newmessage = (char *)"unset";
+	ok(otrl_message_resume(hello, &newmessage, NULL, NULL) == 0 &&
+			newmessage == NULL,
+			"Resumed message handled as plaintext");
+	ok(otrl_message_resume(ake, &newmessage, NULL, NULL) == 1,
+			"Earlier message already handled when resumed");
+
+	otrl_userstate_free(us);
+}
+
+static unsigned int timer_interval;
+static int timer_calls;
+
+static void test_timer_control(void *opdata, unsigned int interval)
+{
+	timer_calls++;
+	timer_interval = interval;
+}
+
+static void test_otrl_message_poll(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	ConnContext *stale, *fresh;
+	time_t now = time(NULL);
+
+	memset(&ops, 0, sizeof(ops));
+	ops.timer_control = test_timer_control;
+
+	stale = otrl_context_find(us, "alice", "me", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	fresh = otrl_context_find(us, "bob", "me", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	stale->auth.authstate = fresh->auth.authstate =
+		OTRL_AUTHSTATE_AWAITING_DHKEY;
+	stale->auth.protocol_version = fresh->auth.protocol_version = 3;
+	stale->auth.commit_sent_time = now - 100;
+	fresh->auth.commit_sent_time = now - 10;
+	otrl_userstate_deadline_add(us, stale, now - 39);
+	otrl_userstate_deadline_add(us, fresh, now + 51);
+
+	otrl_message_poll(us, &ops, NULL);
+	ok(stale->auth.authstate == OTRL_AUTHSTATE_NONE &&
+			fresh->auth.authstate == OTRL_AUTHSTATE_AWAITING_DHKEY,
+			"Only the stale AKE expired");
+	ok(timer_calls == 1 && timer_interval > 0 && timer_interval <= 51,
+			"Timer set for the next AKE to expire");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_message_poll_hibernation(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserStateStats stats;
+	OtrlMessageAppOps ops;
+	ConnContext *idle, *busy, *secure;
+	time_t now = time(NULL);
+
+	memset(&ops, 0, sizeof(ops));
+	ops.timer_control = test_timer_control;
+	timer_calls = 0;
+
+	idle = otrl_context_find(us, "alice", "me", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	busy = otrl_context_find(us, "bob", "me", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	secure = otrl_context_find(us, "carol", "me", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_userstate_stats(us, &stats);
+	ok(stats.contexts_hibernated == 3 &&
+			otrl_context_priv_wake(idle->context_priv) == 0 &&
+			otrl_context_priv_wake(busy->context_priv) == 0 &&
+			otrl_context_priv_wake(secure->context_priv) == 0 &&
+			idle->context_priv->sesskeys &&
+			!idle->context_priv->sesskeys[1][1].derived,
+			"New contexts hold no session keys until woken");
+
+	idle->context_priv->lastsent = now - 100;
+	busy->context_priv->lastrecv = now - 10;
+	secure->context_priv->lastsent = now - 100;
+	secure->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	otrl_userstate_set_hibernation(us, 60);
+	otrl_message_poll(us, &ops, NULL);
+	otrl_userstate_stats(us, &stats);
+	ok(idle->context_priv->sesskeys == NULL &&
+			busy->context_priv->sesskeys &&
+			secure->context_priv->sesskeys &&
+			stats.contexts_hibernated == 1,
+			"Only the idle plaintext context hibernated");
+	ok(timer_calls == 1 && timer_interval == 30,
+			"Timer set for the next look for idle contexts");
+
+	secure->msgstate = OTRL_MSGSTATE_PLAINTEXT;
+	otrl_userstate_free(us);
+}
+
+static OtrlPolicy test_policy_always(void *opdata, ConnContext *context)
+{
+	return OTRL_POLICY_ALWAYS;
+}
+
+static void test_otrl_message_poll_retransmit(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserStateStats stats;
+	OtrlMessageAppOps ops;
+	ConnContext *alice, *bob, *carol;
+	char *msg;
+	gcry_error_t err;
+
+	memset(&ops, 0, sizeof(ops));
+	alice = otrl_context_find(us, "alice", "me", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	bob = otrl_context_find(us, "bob", "me", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+
+	otrl_userstate_set_retransmit_limits(us, 10, 15, 0);
+	ok(otrl_context_keep_lastmessage(alice, "Far too long a message",
+				22) == -1 &&
+			alice->context_priv->lastmessage == NULL &&
+			otrl_context_keep_lastmessage(alice, "Short one", 9) ==
+				0 && alice->context_priv->lastmessage &&
+			strcmp(alice->context_priv->lastmessage,
+				"Short one") == 0,
+			"Only messages short enough kept");
+
+	ok(otrl_context_keep_lastmessage(bob, "Another", 7) == -1 &&
+			otrl_context_keep_lastmessage(bob, "Fits", 4) == 0,
+			"Total kept for all contexts limited");
+
+	/* alice's copy has been kept long enough, but bob's hasn't */
+	otrl_userstate_set_retransmit_limits(us, 0, 0, 30);
+	otrl_context_keep_lastmessage(alice, "Old news", 8);
+	otrl_context_keep_lastmessage(bob, "Fresh", 5);
+	alice->context_priv->lastsent = time(NULL) - 100;
+	bob->context_priv->lastsent = time(NULL);
+	otrl_userstate_deadline_add(us, alice, time(NULL) - 70);
+	otrl_userstate_deadline_add(us, bob, time(NULL) - 1);
+	otrl_message_poll(us, &ops, NULL);
+	otrl_userstate_stats(us, &stats);
+	ok(alice->context_priv->lastmessage == NULL &&
+			bob->context_priv->lastmessage &&
+			stats.retransmit_bytes == 5 &&
+			stats.retransmits_dropped == 3,
+			"Copies thrown away once kept long enough");
+
+	/* A message too long to keep is still never sent in the clear */
+	ops.policy = test_policy_always;
+	otrl_userstate_set_retransmit_limits(us, 10, 0, 0);
+	msg = NULL;
+	err = otrl_message_sending(us, &ops, NULL, "me", "proto", "carol",
+			OTRL_INSTAG_BEST, "Far too long a message", NULL, &msg,
+			OTRL_FRAGMENT_SEND_SKIP, &carol, NULL, NULL);
+	ok(err == 0 && msg && strncmp(msg, "?OTR", 4) == 0 &&
+			carol->context_priv->lastmessage == NULL,
+			"Query sent in place of a message too long to keep");
+	otrl_message_free(msg);
+
+	otrl_userstate_free(us);
+}
+
+#ifdef OTRL_NO_PROTOCOL_V2
+static int required_events;
+
+static OtrlPolicy test_policy_v2_required(void *opdata, ConnContext *context)
+{
+	return OTRL_POLICY_ALLOW_V2 | OTRL_POLICY_REQUIRE_ENCRYPTION;
+}
+
+static void test_handle_required(void *opdata, OtrlMessageEvent msg_event,
+		ConnContext *context, const char *message, gcry_error_t err)
+{
+	if (msg_event == OTRL_MSGEVENT_ENCRYPTION_REQUIRED) required_events++;
+}
+
+static void test_otrl_message_sending_unbuilt(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	char *msg = NULL;
+	gcry_error_t err;
+
+	/* Encryption is required with only a version that isn't built in */
+	memset(&ops, 0, sizeof(ops));
+	ops.policy = test_policy_v2_required;
+	ops.handle_msg_event = test_handle_required;
+	err = otrl_message_sending(us, &ops, NULL, "me", "proto", "dave",
+			OTRL_INSTAG_BEST, "Secret", NULL, &msg,
+			OTRL_FRAGMENT_SEND_SKIP, NULL, NULL, NULL);
+	ok(gcry_err_code(err) == GPG_ERR_UNSUPPORTED_PROTOCOL && msg &&
+			msg[0] == '\0' && required_events == 1,
+			"Message refused when no required version is built");
+	otrl_message_free(msg);
+
+	otrl_userstate_free(us);
+}
+#endif
+
+static void test_otrl_message_poll_heartbeat(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserStateStats stats;
+	OtrlMessageAppOps ops;
+	ConnContext *alice;
+	time_t now = time(NULL);
+
+	memset(&ops, 0, sizeof(ops));
+	ops.timer_control = test_timer_control;
+	timer_calls = 0;
+
+	/* alice's conversation has ended since her heartbeat was queued */
+	alice = otrl_context_find(us, "alice", "me", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_userstate_set_heartbeat_deferral(us, 5, 10);
+	otrl_userstate_heartbeat_queue(us, alice, now - 1);
+	otrl_message_poll(us, &ops, NULL);
+	otrl_userstate_stats(us, &stats);
+	ok(us->heartbeat_head == NULL && stats.heartbeats_sent == 0 &&
+			stats.heartbeats_suppressed == 1,
+			"Heartbeat no longer needed not sent");
+
+	otrl_userstate_free(us);
+}
+
+static int convert_calls;
+static int convert_never;
+
+/* Shout what we send, and add a "!" to what we receive */
+static size_t test_convert_inplace(void *opdata, ConnContext *context,
+		OtrlConvertType convert_type, char *buf, size_t *lenp,
+		size_t bufsize)
+{
+	size_t i;
+
+	convert_calls++;
+	if (convert_never) {
+		return OTRL_CONVERT_NEVER;
+	}
+	if (convert_type == OTRL_CONVERT_SENDING) {
+		for (i = 0; i < *lenp; i++) {
+			if (buf[i] >= 'a' && buf[i] <= 'z') {
+				buf[i] -= 'a' - 'A';
+			}
+		}
+		return 0;
+	}
+	if (*lenp + 2 > bufsize) {
+		return *lenp + 2;
+	}
+	buf[(*lenp)++] = '!';
+	return 0;
+}
+
+/* Put the alice and bob instances of each other in an encrypted
+ * session, as setup_session in test_session does */
+static void encrypt_pair(ConnContext *alice, ConnContext *bob)
+{
+	DH_keypair a1, a2, b1;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a1);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a2);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &b1);
+
+	otrl_dh_keypair_copy(&(alice->context_priv->our_old_dh_key), &a1);
+	otrl_dh_keypair_copy(&(alice->context_priv->our_dh_key), &a2);
+	alice->context_priv->our_keyid = 2;
+	alice->context_priv->their_y = gcry_mpi_copy(b1.pub);
+	alice->context_priv->their_keyid = 1;
+	alice->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice->protocol_version = 3;
+
+	otrl_dh_keypair_copy(&(bob->context_priv->our_dh_key), &b1);
+	bob->context_priv->our_keyid = 1;
+	bob->context_priv->their_y = gcry_mpi_copy(a1.pub);
+	bob->context_priv->their_keyid = 1;
+	bob->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	bob->protocol_version = 3;
+
+	otrl_dh_keypair_free(&a1);
+	otrl_dh_keypair_free(&a2);
+	otrl_dh_keypair_free(&b1);
+}
+
+static void test_otrl_message_convert_inplace(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	ConnContext *alice_m, *alice, *bob_m, *bob;
+	char *encmsg = NULL, *newmsg = NULL;
+	OtrlTLV *tlvs = NULL;
+	int res;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.policy = test_policy;
+	otrl_userstate_set_convert_inplace(us, test_convert_inplace);
+
+	alice_m = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	alice_m->our_instance = 0x1100;
+	alice = otrl_context_find(us, "bob", "alice", "proto", 0x2200, 1,
+			NULL, NULL, NULL);
+	alice->our_instance = 0x1100;
+	bob_m = otrl_context_find(us, "alice", "bob", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	bob_m->our_instance = 0x2200;
+	bob = otrl_context_find(us, "alice", "bob", "proto", 0x1100, 1,
+			NULL, NULL, NULL);
+	bob->our_instance = 0x2200;
+	encrypt_pair(alice, bob);
+
+	convert_calls = 0;
+	otrl_message_sending(us, &ops, NULL, "alice", "proto", "bob", 0x2200,
+			"hello", NULL, &encmsg, OTRL_FRAGMENT_SEND_SKIP, NULL,
+			NULL, NULL);
+	res = otrl_message_receiving(us, &ops, NULL, "bob", "proto", "alice",
+			encmsg, &newmsg, &tlvs, NULL, NULL, NULL);
+	ok(res == 0 && newmsg && strcmp(newmsg, "HELLO!") == 0 &&
+			convert_calls == 3,
+			"Message converted where it was both ways");
+	ok(alice->context_priv->convert_buf &&
+			alice->context_priv->convert_buf[0] == '\0',
+			"Conversion buffer kept and wiped");
+	otrl_message_free(encmsg);
+	otrl_message_free(newmsg);
+	encmsg = newmsg = NULL;
+
+	convert_never = 1;
+	otrl_message_sending(us, &ops, NULL, "alice", "proto", "bob", 0x2200,
+			"first", NULL, &encmsg, OTRL_FRAGMENT_SEND_SKIP, NULL,
+			NULL, NULL);
+	otrl_message_free(encmsg);
+	encmsg = NULL;
+	otrl_message_sending(us, &ops, NULL, "alice", "proto", "bob", 0x2200,
+			"second", NULL, &encmsg, OTRL_FRAGMENT_SEND_SKIP, NULL,
+			NULL, NULL);
+	res = otrl_message_receiving(us, &ops, NULL, "bob", "proto", "alice",
+			encmsg, &newmsg, &tlvs, NULL, NULL, NULL);
+	ok(res == 0 && newmsg && strcmp(newmsg, "second") == 0 &&
+			convert_calls == 5,
+			"Not called again for a context it declined");
+	convert_never = 0;
+
+	otrl_message_free(encmsg);
+	otrl_message_free(newmsg);
+	otrl_tlv_free(tlvs);
+	otrl_userstate_free(us);
+}
+
+static OtrlReceivedResult batch_results[4];
+
+static void test_handle_encrypted_results(void *opdata,
+		OtrlReceivedResult *results, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count && i < 4; i++) {
+		batch_results[i] = results[i];
+		results[i].newmessage = NULL;
+	}
+}
+
+static void test_otrl_message_receiving_batch_encrypted(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	ConnContext *alice, *bob, *carol, *bob2, *m;
+	OtrlReceivedMessage items[4];
+	char *encmsgs[4] = { NULL, NULL, NULL, NULL };
+	static const char *texts[] = { "one", "two", "three", "four" };
+	int i;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.policy = test_policy;
+
+	m = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	m->our_instance = 0x1100;
+	alice = otrl_context_find(us, "bob", "alice", "proto", 0x2200, 1,
+			NULL, NULL, NULL);
+	alice->our_instance = 0x1100;
+	m = otrl_context_find(us, "bob", "carol", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	m->our_instance = 0x3300;
+	carol = otrl_context_find(us, "bob", "carol", "proto", 0x2200, 1,
+			NULL, NULL, NULL);
+	carol->our_instance = 0x3300;
+	m = otrl_context_find(us, "alice", "bob", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	m->our_instance = 0x2200;
+	bob = otrl_context_find(us, "alice", "bob", "proto", 0x1100, 1,
+			NULL, NULL, NULL);
+	bob->our_instance = 0x2200;
+	m = otrl_context_find(us, "carol", "bob", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	m->our_instance = 0x2200;
+	bob2 = otrl_context_find(us, "carol", "bob", "proto", 0x3300, 1,
+			NULL, NULL, NULL);
+	bob2->our_instance = 0x2200;
+	encrypt_pair(alice, bob);
+	encrypt_pair(carol, bob2);
+
+	/* Two from alice, then one from carol and a forged one from
+	 * alice */
+	for (i = 0; i < 4; i++) {
+		const char *from = i == 2 ? "carol" : "alice";
+
+		otrl_message_sending(us, &ops, NULL, from, "proto", "bob",
+				0x2200, texts[i], NULL, &encmsgs[i],
+				OTRL_FRAGMENT_SEND_SKIP, NULL, NULL, NULL);
+		items[i].accountname = "bob";
+		items[i].protocol = "proto";
+		items[i].sender = from;
+		items[i].message = encmsgs[i];
+	}
+	encmsgs[3][60] = encmsgs[3][60] == 'A' ? 'B' : 'A';
+
+	ok(otrl_message_receiving_batch(us, &ops, NULL, items, 4,
+			test_handle_encrypted_results, NULL, NULL) == 0 &&
+			batch_results[0].newmessage &&
+			!strcmp(batch_results[0].newmessage, "one") &&
+			batch_results[1].newmessage &&
+			!strcmp(batch_results[1].newmessage, "two") &&
+			batch_results[2].newmessage &&
+			!strcmp(batch_results[2].newmessage, "three"),
+			"Batch of Data Messages from two correspondents read");
+	ok(batch_results[3].ignore == 1 &&
+			batch_results[3].newmessage == NULL &&
+			bob->context_priv->their_keyid == 2,
+			"Forged Data Message in a batch rejected");
+
+	for (i = 0; i < 4; i++) {
+		otrl_message_free(encmsgs[i]);
+		otrl_message_free(batch_results[i].newmessage);
+		otrl_tlv_free(batch_results[i].tlvs);
+	}
+	otrl_userstate_free(us);
+}
+
+static int update_calls;
+static int write_calls;
+static int coalesced_calls;
+static size_t coalesced_ncontexts;
+
+static void test_update_context_list(void *opdata)
+{
+	update_calls++;
+}
+
+static void test_write_fingerprints(void *opdata)
+{
+	write_calls++;
+}
+
+static void test_coalesced_changes(void *opdata, ConnContext **contexts,
+		size_t ncontexts, Fingerprint **fingerprints,
+		size_t nfingerprints)
+{
+	coalesced_calls++;
+	coalesced_ncontexts = ncontexts;
+}
+
+static void send_query(OtrlUserState us, OtrlMessageAppOps *ops,
+		const char *recipient)
+{
+	char *msg = NULL;
+
+	otrl_message_sending(us, ops, NULL, "me", "proto", recipient,
+			OTRL_INSTAG_BEST, "?OTR?", NULL, &msg,
+			OTRL_FRAGMENT_SEND_SKIP, NULL, NULL, NULL);
+	otrl_message_free(msg);
+}
+
+static void test_otrl_message_change_coalescing(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	ConnContext *alice, *bob;
+	Fingerprint *fprint;
+	unsigned char fp[20] = "Alice's fingerprint";
+
+	memset(&ops, 0, sizeof(ops));
+	ops.policy = test_policy;
+	ops.timer_control = test_timer_control;
+	ops.update_context_list = test_update_context_list;
+	ops.write_fingerprints = test_write_fingerprints;
+	timer_calls = 0;
+
+	otrl_userstate_set_change_coalescing(us, 1, 0);
+	send_query(us, &ops, "alice");
+	send_query(us, &ops, "bob");
+	send_query(us, &ops, "carol");
+	alice = otrl_context_find(us, "alice", "me", "proto",
+			OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+	bob = otrl_context_find(us, "bob", "me", "proto",
+			OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+	fprint = otrl_context_find_fingerprint(alice, fp, 1, NULL);
+	otrl_userstate_wrlock(us);
+	otrl_userstate_changed(us, NULL, fprint, time(NULL));
+	otrl_userstate_unlock(us);
+	ok(update_calls == 0 && write_calls == 0 && timer_calls == 1 &&
+			timer_interval == 1,
+			"Changes held back for the poll");
+
+	otrl_context_forget(bob);
+	otrl_message_poll(us, &ops, NULL);
+	ok(update_calls == 1 && write_calls == 1 &&
+			us->changed_contexts == NULL &&
+			us->changed_fingerprints == NULL && us->changes_due == 0,
+			"One call for all the changes held back");
+
+	otrl_userstate_set_coalesced_changes(us, test_coalesced_changes);
+	send_query(us, &ops, "dave");
+	send_query(us, &ops, "erin");
+	otrl_message_poll(us, &ops, NULL);
+	ok(coalesced_calls == 1 && coalesced_ncontexts == 2 &&
+			update_calls == 1,
+			"Changed contexts handed over together");
+
+	otrl_userstate_set_change_coalescing(us, 1, 100);
+	send_query(us, &ops, "frank");
+	otrl_message_poll(us, &ops, NULL);
+	ok(coalesced_calls == 1 && us->changed_contexts != NULL &&
+			timer_interval > 1 && timer_interval <= 100,
+			"Changes held back until the debounce is up");
+
+	otrl_userstate_free(us);
+}
+
+static int disconnect_calls;
+static size_t disconnect_count;
+static int disconnect_ok;
+
+static int test_is_logged_in(void *opdata, const char *accountname,
+		const char *protocol, const char *recipient)
+{
+	return 1;
+}
+
+static void test_inject_disconnects(void *opdata,
+		const OtrlInjectMessage *msgs, size_t count)
+{
+	size_t i;
+
+	disconnect_calls++;
+	disconnect_count = count;
+	disconnect_ok = 1;
+	for (i = 0; i < count; i++) {
+		if (strncmp(msgs[i].message, "?OTR:", 5) ||
+				strcmp(msgs[i].accountname, "me") ||
+				strcmp(msgs[i].recipient, "alice")) {
+			disconnect_ok = 0;
+		}
+	}
+}
+
+static void test_otrl_message_disconnect_account(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	ConnContext *alice2, *carol;
+	DH_keypair ours, theirs;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.is_logged_in = test_is_logged_in;
+	ops.update_context_list = test_update_context_list;
+	update_calls = 0;
+
+	otrl_context_find(us, "alice", "me", "proto", OTRL_INSTAG_MASTER, 1,
+			NULL, NULL, NULL);
+	alice2 = otrl_context_find(us, "alice", "me", "proto", 0x1234, 1,
+			NULL, NULL, NULL);
+	otrl_context_find(us, "bob", "me", "proto", OTRL_INSTAG_MASTER, 1,
+			NULL, NULL, NULL);
+	carol = otrl_context_find(us, "carol", "other", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+
+	/* Just enough of a session for alice's instance to encrypt */
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &ours);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &theirs);
+	otrl_dh_keypair_copy(&(alice2->context_priv->our_old_dh_key), &ours);
+	otrl_dh_keypair_copy(&(alice2->context_priv->our_dh_key), &ours);
+	alice2->context_priv->our_keyid = 2;
+	alice2->context_priv->their_y = gcry_mpi_copy(theirs.pub);
+	alice2->context_priv->their_keyid = 1;
+	alice2->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice2->protocol_version = 3;
+	carol->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	otrl_dh_keypair_free(&ours);
+	otrl_dh_keypair_free(&theirs);
+
+	otrl_message_disconnect_account(us, &ops, NULL, "me", "proto",
+			test_inject_disconnects);
+	ok(disconnect_calls == 1 && disconnect_count == 1 && disconnect_ok,
+			"Disconnect notices sent in one inject call");
+	ok(otrl_context_find(us, "alice", "me", "proto", OTRL_INSTAG_MASTER,
+				0, NULL, NULL, NULL) == NULL &&
+			otrl_context_find(us, "bob", "me", "proto",
+				OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) == NULL &&
+			otrl_context_find(us, "carol", "other", "proto",
+				OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL) ==
+				carol && carol->msgstate ==
+				OTRL_MSGSTATE_ENCRYPTED,
+			"Only the account's contexts forgotten");
+	ok(update_calls == 1, "Context list updated once");
+
+	carol->msgstate = OTRL_MSGSTATE_PLAINTEXT;
+	otrl_userstate_free(us);
+}
+
+int main(int argc, char **argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_message_receiving_batch();
+	test_otrl_message_sending_batch();
+	test_otrl_message_receiving_offload();
+	test_otrl_message_resume();
+	test_otrl_message_poll();
+	test_otrl_message_poll_hibernation();
+	test_otrl_message_poll_retransmit();
+#ifdef OTRL_NO_PROTOCOL_V2
+	test_otrl_message_sending_unbuilt();
+#endif
+	test_otrl_message_poll_heartbeat();
+	test_otrl_message_convert_inplace();
+	test_otrl_message_receiving_batch_encrypted();
+	test_otrl_message_change_coalescing();
+	test_otrl_message_disconnect_account();
+
+	return 0;
+}
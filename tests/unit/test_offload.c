@@ -0,0 +1,98 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <offload.h>
+#include <tap/tap.h>
+
+#define NUM_TESTS 5
+
+#define POOL_JOBS 200
+
+static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int count;
+static int off_main_thread = 1;
+static pthread_t main_thread;
+
+static void count_job(void *job)
+{
+	pthread_mutex_lock(&count_mutex);
+	count += *(int *)job;
+	if (pthread_equal(pthread_self(), main_thread)) off_main_thread = 0;
+	pthread_mutex_unlock(&count_mutex);
+}
+
+static void test_otrl_offload_pool(void)
+{
+	OtrlOffload *offload;
+	int one = 1, i;
+
+	ok(otrl_offload_new(0, NULL, NULL) == NULL,
+			"No pool without threads or a submit");
+
+	offload = otrl_offload_new(3, NULL, NULL);
+	count = 0;
+	for (i = 0; i < POOL_JOBS; i++) {
+		otrl_offload_run(offload, count_job, &one);
+	}
+	otrl_offload_free(offload);
+	ok(count == POOL_JOBS && off_main_thread,
+			"Pool ran every job on its own threads before freeing");
+}
+
+static void (*submitted_run)(void *job);
+static void *submitted_job;
+static int submit_calls;
+
+static void test_submit(void *submitdata, void (*run)(void *job), void *job)
+{
+	submit_calls += *(int *)submitdata;
+	submitted_run = run;
+	submitted_job = job;
+}
+
+static void test_otrl_offload_submit(void)
+{
+	OtrlOffload *offload;
+	int one = 1, two = 2;
+
+	offload = otrl_offload_new(0, test_submit, &one);
+	count = 0;
+	ok(otrl_offload_run(offload, count_job, &two) == 0 &&
+			submit_calls == 1 && count == 0,
+			"Job handed to the application's submit");
+
+	submitted_run(submitted_job);
+	ok(count == 2, "Job run when the application says so");
+
+	otrl_offload_lock(offload);
+	otrl_offload_unlock(offload);
+	otrl_offload_free(offload);
+	ok(1, "Offload freed once its jobs are done");
+}
+
+int main(int argc, char **argv)
+{
+	plan_tests(NUM_TESTS);
+
+	main_thread = pthread_self();
+
+	test_otrl_offload_pool();
+	test_otrl_offload_submit();
+
+	return 0;
+}
@@ -26,7 +26,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 13
+#define NUM_TESTS 22
 
 static OtrlUserState us = NULL;
 static char filename[] = "/tmp/libotr-testing-XXXXXX";
@@ -159,6 +159,88 @@ static void test_otrl_privkey_find(void)
 		"Privkey found");
 }
 
+static void test_otrl_privkey_read_indexed(void)
+{
+	char indexfile[] = "/tmp/libotr-testing-XXXXXX";
+	OtrlUserState us1 = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	OtrlPrivKey *p1, *p2;
+	int fd = mkstemp(indexfile);
+
+	close(fd);
+	otrl_privkey_generate(us1, indexfile, "bob", "xmpp");
+	otrl_privkey_generate(us1, indexfile, "alice", "xmpp");
+	p1 = otrl_privkey_find(us1, "bob", "xmpp");
+
+	ok(otrl_privkey_read_indexed(us2, indexfile) == 0 &&
+			us2->privkey_root == NULL &&
+			otrl_privkey_find(us2, "carol", "xmpp") == NULL,
+			"Indexed privkeys not loaded up front");
+	p2 = otrl_privkey_find(us2, "bob", "xmpp");
+	ok(p1 && p2 && us2->privkey_root == p2 && p2->next == NULL &&
+			p1->pubkey_datalen == p2->pubkey_datalen &&
+			!memcmp(p1->pubkey_data, p2->pubkey_data,
+				p1->pubkey_datalen),
+			"Indexed privkey loaded on first find");
+
+	otrl_privkey_generate(us2, indexfile, "carol", "xmpp");
+	ok(otrl_privkey_find(us2, "alice", "xmpp") != NULL &&
+			otrl_privkey_find(us2, "bob", "xmpp") != NULL &&
+			otrl_privkey_find(us2, "carol", "xmpp") != NULL,
+			"Indexed privkeys kept when another is generated");
+
+	otrl_privkey_forget(otrl_privkey_find(us2, "bob", "xmpp"));
+	ok(otrl_privkey_find(us2, "bob", "xmpp") == NULL &&
+			otrl_privkey_find(us2, "alice", "xmpp") != NULL,
+			"Forgotten privkey no longer found");
+
+	otrl_userstate_free(us1);
+	otrl_userstate_free(us2);
+	unlink(indexfile);
+}
+
+static void test_otrl_privkey_generate_batch(void)
+{
+	char batchfile[] = "/tmp/libotr-testing-XXXXXX";
+	char tmpname[sizeof(batchfile) + 4];
+	const char *accounts[] = { "alice", "bob", "carol", "dave" };
+	const char *protocols[] = { "irc", "irc", "irc", "xmpp" };
+	OtrlUserState bus = otrl_userstate_create();
+	OtrlPrivKey *old, *p;
+	unsigned char oldpub[1024];
+	size_t oldlen;
+	int fd = mkstemp(batchfile), i, found = 1;
+
+	close(fd);
+	snprintf(tmpname, sizeof(tmpname), "%s.new", batchfile);
+	otrl_privkey_generate(bus, batchfile, "erin", "irc");
+	otrl_privkey_generate(bus, batchfile, "bob", "irc");
+	old = otrl_privkey_find(bus, "bob", "irc");
+	oldlen = old->pubkey_datalen;
+	memmove(oldpub, old->pubkey_data, oldlen);
+
+	ok(otrl_privkey_generate_batch(bus, batchfile, accounts, protocols,
+				4, 3) == 0 && bus->pending_root == NULL &&
+			access(tmpname, F_OK) != 0,
+			"Batch of keys generated");
+
+	for (i = 0; i < 4; i++) {
+		if (!otrl_privkey_find(bus, accounts[i], protocols[i])) found = 0;
+	}
+	otrl_userstate_free(bus);
+	bus = otrl_userstate_create();
+	otrl_privkey_read(bus, batchfile);
+	p = otrl_privkey_find(bus, "bob", "irc");
+	ok(found && otrl_privkey_find(bus, "erin", "irc") != NULL &&
+			otrl_privkey_find(bus, "dave", "xmpp") != NULL && p &&
+			(p->pubkey_datalen != oldlen ||
+			 memcmp(p->pubkey_data, oldpub, oldlen)),
+			"Batch keys and other keys written to the file");
+
+	otrl_userstate_free(bus);
+	unlink(batchfile);
+}
+
 static void test_otrl_privkey_sign(void)
 {
 	unsigned char *sig = NULL;
@@ -235,6 +317,79 @@ static void test_otrl_privkey_verify(void)
 	free(sigbuf);
 }
 
+static void test_otrl_privkey_verify_mpi(void)
+{
+	OtrlPrivKey *privkey = otrl_privkey_find(us, "alice", "irc");
+	unsigned char data[32], sig[40];
+	gcry_mpi_t p, q, g, y, datampi, r, s;
+	gcry_sexp_t dsas, pubs, datas, sigs, rs, ss;
+	size_t nr, ns;
+	int i, good = 1;
+
+	dsas = gcry_sexp_find_token(privkey->privkey, "dsa", 0);
+	rs = gcry_sexp_find_token(dsas, "p", 0);
+	p = gcry_sexp_nth_mpi(rs, 1, GCRYMPI_FMT_USG);
+	gcry_sexp_release(rs);
+	rs = gcry_sexp_find_token(dsas, "q", 0);
+	q = gcry_sexp_nth_mpi(rs, 1, GCRYMPI_FMT_USG);
+	gcry_sexp_release(rs);
+	rs = gcry_sexp_find_token(dsas, "g", 0);
+	g = gcry_sexp_nth_mpi(rs, 1, GCRYMPI_FMT_USG);
+	gcry_sexp_release(rs);
+	rs = gcry_sexp_find_token(dsas, "y", 0);
+	y = gcry_sexp_nth_mpi(rs, 1, GCRYMPI_FMT_USG);
+	gcry_sexp_release(rs);
+	gcry_sexp_release(dsas);
+	gcry_sexp_build(&pubs, NULL,
+			"(public-key (dsa (p %m)(q %m)(g %m)(y %m)))", p, q, g, y);
+
+	/* A 32-byte MAC, as the AKE signs, is bigger than q */
+	for (i = 0; i < 32; i++) data[i] = 0xff - i;
+
+	for (i = 0; i < 4; i++) {
+		otrl_privkey_sign_into(sig, privkey, data, sizeof(data));
+		if (otrl_privkey_verify(sig, 40, OTRL_PUBKEY_TYPE_DSA, pubs,
+					data, sizeof(data))) {
+			good = 0;
+		}
+	}
+	ok(good, "otrl_privkey_sign_into signature verified by libgcrypt");
+
+	gcry_mpi_scan(&datampi, GCRYMPI_FMT_USG, data, sizeof(data), NULL);
+	gcry_sexp_build(&datas, NULL, "(%m)", datampi);
+	gcry_pk_sign(&sigs, datas, privkey->privkey);
+	rs = gcry_sexp_find_token(sigs, "r", 0);
+	ss = gcry_sexp_find_token(sigs, "s", 0);
+	r = gcry_sexp_nth_mpi(rs, 1, GCRYMPI_FMT_USG);
+	s = gcry_sexp_nth_mpi(ss, 1, GCRYMPI_FMT_USG);
+	gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &nr, r);
+	gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &ns, s);
+	memset(sig, 0, 40);
+	gcry_mpi_print(GCRYMPI_FMT_USG, sig + 20 - nr, nr, NULL, r);
+	gcry_mpi_print(GCRYMPI_FMT_USG, sig + 40 - ns, ns, NULL, s);
+	ok(otrl_privkey_verify_mpi(sig, 40, p, q, g, y, data,
+				sizeof(data)) == 0,
+			"libgcrypt signature verified by otrl_privkey_verify_mpi");
+
+	sig[39] ^= 1;
+	ok(gcry_err_code(otrl_privkey_verify_mpi(sig, 40, p, q, g, y, data,
+					sizeof(data))) == GPG_ERR_BAD_SIGNATURE,
+			"Bad signature detected by otrl_privkey_verify_mpi");
+
+	gcry_sexp_release(rs);
+	gcry_sexp_release(ss);
+	gcry_sexp_release(sigs);
+	gcry_sexp_release(datas);
+	gcry_sexp_release(pubs);
+	gcry_mpi_release(datampi);
+	gcry_mpi_release(r);
+	gcry_mpi_release(s);
+	gcry_mpi_release(p);
+	gcry_mpi_release(q);
+	gcry_mpi_release(g);
+	gcry_mpi_release(y);
+}
+
 int main(int argc, char **argv)
 {
 	OtrlPrivKey *p;
@@ -255,7 +410,10 @@ int main(int argc, char **argv)
 	test_otrl_privkey_fingerprint_raw();
 	test_otrl_privkey_sign();
 	test_otrl_privkey_verify();
+	test_otrl_privkey_verify_mpi();
 	test_otrl_privkey_find();
+	test_otrl_privkey_read_indexed();
+	test_otrl_privkey_generate_batch();
 
 	fclose(f);
 	otrl_userstate_free(us);
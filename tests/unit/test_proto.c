@@ -15,6 +15,8 @@
  * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include "config.h"
+
 #include <limits.h>
 #include <pthread.h>
 
@@ -24,7 +26,14 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 48
+/* The tests of version 2 only, which a build without it skips */
+#ifdef OTRL_NO_PROTOCOL_V2
+#define NUM_V2_TESTS 0
+#else
+#define NUM_V2_TESTS 6
+#endif
+
+#define NUM_TESTS (81 + NUM_V2_TESTS)
 
 static ConnContext *new_context(const char *user, const char *accountname,
 		const char *protocol)
@@ -72,10 +81,13 @@ static void test_otrl_proto_whitespace_bestversion(void)
 {
 	unsigned int ret;
 	const char *start, *end;
+#ifndef OTRL_NO_PROTOCOL_V2
 	const char *test1 = OTRL_MESSAGE_TAG_BASE OTRL_MESSAGE_TAG_V2;
+#endif
 	const char *test2 = OTRL_MESSAGE_TAG_BASE OTRL_MESSAGE_TAG_V3;
 	const char *test3 = OTRL_MESSAGE_TAG_BASE "foobar";
 
+#ifndef OTRL_NO_PROTOCOL_V2
 	ret = otrl_proto_whitespace_bestversion(test1, &start, &end,
 			OTRL_POLICY_ALLOW_V2);
 	ok(ret == 2, "Best version whitespace v2");
@@ -83,6 +95,7 @@ static void test_otrl_proto_whitespace_bestversion(void)
 	ret = otrl_proto_whitespace_bestversion(test1, &start, &end,
 			OTRL_POLICY_ALLOW_V2 | OTRL_POLICY_ALLOW_V3);
 	ok(ret == 2, "Best version whitespace v2 dual policy");
+#endif
 
 	ret = otrl_proto_whitespace_bestversion(test2, &start, &end,
 			OTRL_POLICY_ALLOW_V3);
@@ -99,11 +112,13 @@ static void test_otrl_proto_whitespace_bestversion(void)
 
 static void test_otrl_proto_query_bestversion(void)
 {
+#ifndef OTRL_NO_PROTOCOL_V2
 	const char *query2 = "?OTRv2?\n<b>alice</b> has requested an "
 		"<a href=\"https://otr.cypherpunks.ca/\">Off-the-Record "
 		"private conversation</a>.  However, you do not have a plugin "
 		"to support that.\nSee <a href=\"https://otr.cypherpunks.ca/\">"
 		"https://otr.cypherpunks.ca/</a> for more information.";
+#endif
 
 	const char *query23 = "?OTRv23?\n<b>alice</b> has requested an "
 		"<a href=\"https://otr.cypherpunks.ca/\">Off-the-Record "
@@ -117,18 +132,23 @@ static void test_otrl_proto_query_bestversion(void)
 		"to support that.\nSee <a href=\"https://otr.cypherpunks.ca/\">"
 		"https://otr.cypherpunks.ca/</a> for more information.";
 
+#ifndef OTRL_NO_PROTOCOL_V2
 	ok(otrl_proto_query_bestversion(query2, OTRL_POLICY_ALLOW_V2) == 2,
 			"The best from query2 is 2");
+#endif
 	ok(otrl_proto_query_bestversion(query3, OTRL_POLICY_ALLOW_V3) == 3,
 			"The best from query3 is 3");
+#ifndef OTRL_NO_PROTOCOL_V2
 	ok(otrl_proto_query_bestversion(query23, OTRL_POLICY_ALLOW_V2) == 2,
 			"The best from query23 is 2");
+#endif
 	ok(otrl_proto_query_bestversion(query23, OTRL_POLICY_ALLOW_V3) == 3,
 			"The best from query23 is 3");
 }
 
 static void test_otrl_proto_default_query_msg(void)
 {
+#ifndef OTRL_NO_PROTOCOL_V2
 	const char *expected2 = "?OTRv2?\n<b>alice</b> has requested an "
 		"<a href=\"https://otr.cypherpunks.ca/\">Off-the-Record "
 		"private conversation</a>.  However, you do not have a plugin "
@@ -141,24 +161,79 @@ static void test_otrl_proto_default_query_msg(void)
 		"to support that.\nSee <a href=\"https://otr.cypherpunks.ca/\">"
 		"https://otr.cypherpunks.ca/</a> for more information.";
 
+	const char *msg2 = otrl_proto_default_query_msg("alice",
+			OTRL_POLICY_ALLOW_V2);
+	const char *msg23 = otrl_proto_default_query_msg("alice",
+			OTRL_POLICY_ALLOW_V2 | OTRL_POLICY_ALLOW_V3);
+
+#endif
 	const char *expected3 = "?OTRv3?\n<b>alice</b> has requested an "
 		"<a href=\"https://otr.cypherpunks.ca/\">Off-the-Record "
 		"private conversation</a>.  However, you do not have a plugin "
 		"to support that.\nSee <a href=\"https://otr.cypherpunks.ca/\">"
 		"https://otr.cypherpunks.ca/</a> for more information.";
 
-	const char *msg2 = otrl_proto_default_query_msg("alice",
-			OTRL_POLICY_ALLOW_V2);
-	const char *msg23 = otrl_proto_default_query_msg("alice",
-			OTRL_POLICY_ALLOW_V2 | OTRL_POLICY_ALLOW_V3);
 	const char *msg3 = otrl_proto_default_query_msg("alice",
 			OTRL_POLICY_ALLOW_V3);
+#ifndef OTRL_NO_PROTOCOL_V2
 	ok(strcmp(expected2, msg2) == 0, "OTRv2 default query message is valid");
 	ok(strcmp(expected23, msg23) == 0,
 			"OTRv23 default query message is valid");
+#endif
 	ok(strcmp(expected3, msg3) == 0, "OTRv3 default query message is valid");
 }
 
+static void test_otrl_proto_account_query_msg(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlAccount *account = otrl_userstate_account_find(us, "alice",
+			"proto", 1);
+	char *expected23 = otrl_proto_default_query_msg("alice",
+			OTRL_POLICY_ALLOW_V2 | OTRL_POLICY_ALLOW_V3);
+	char *expected3 = otrl_proto_default_query_msg("alice",
+			OTRL_POLICY_ALLOW_V3);
+	char *first, *second, *third, *tagged, *tagged3;
+
+	first = otrl_proto_account_query_msg(us, account,
+			OTRL_POLICY_OPPORTUNISTIC);
+	second = otrl_proto_account_query_msg(us, account,
+			OTRL_POLICY_ALWAYS);
+	ok(first && second && first != second &&
+			second != account->querymsg &&
+			strcmp(first, expected23) == 0 &&
+			strcmp(second, expected23) == 0,
+			"Kept query message copied for the same versions");
+
+	third = otrl_proto_account_query_msg(us, account,
+			OTRL_POLICY_ALLOW_V3);
+	ok(third && strcmp(third, expected3) == 0,
+			"Query message made again for other versions");
+
+	tagged = otrl_proto_account_tag_msg(us, account,
+			OTRL_POLICY_ALLOW_V2 | OTRL_POLICY_ALLOW_V3, "Hi");
+	free(first);
+	first = otrl_proto_account_tag_msg(us, account,
+			OTRL_POLICY_ALLOW_V2 | OTRL_POLICY_ALLOW_V3, "Hello");
+	tagged3 = otrl_proto_account_tag_msg(us, account,
+			OTRL_POLICY_ALLOW_V3, "Hi");
+	ok(tagged && strcmp(tagged, "Hi" OTRL_MESSAGE_TAG_BASE
+				OTRL_MESSAGE_TAG_V2 OTRL_MESSAGE_TAG_V3) == 0 &&
+			first && strcmp(first, "Hello" OTRL_MESSAGE_TAG_BASE
+				OTRL_MESSAGE_TAG_V2 OTRL_MESSAGE_TAG_V3) == 0 &&
+			tagged3 && strcmp(tagged3, "Hi" OTRL_MESSAGE_TAG_BASE
+				OTRL_MESSAGE_TAG_V3) == 0,
+			"Whitespace tag appended for each policy");
+
+	free(expected23);
+	free(expected3);
+	free(first);
+	free(second);
+	free(third);
+	free(tagged);
+	free(tagged3);
+	otrl_userstate_free(us);
+}
+
 void test_otrl_init(void)
 {
 	extern unsigned int otrl_api_version;
@@ -350,6 +425,642 @@ static void test_otrl_proto_create_data(void)
 			"Conflict detected for msgstate encrypted");
 }
 
+static void test_otrl_proto_create_data_sesskeys(void)
+{
+	char *encmessagep = NULL, *msg = "HELO";
+	unsigned char extrakey[OTRL_EXTRAKEY_BYTES];
+	DH_keypair their_dh;
+	DH_sesskeys expected;
+	ConnContextPriv *priv;
+	ConnContext *context =
+		new_context("Alice", "Alice's account", "Secret protocol");
+
+	priv = context->context_priv;
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &(priv->our_old_dh_key));
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &(priv->our_dh_key));
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &their_dh);
+	priv->our_keyid = 2;
+	priv->their_keyid = 1;
+	priv->their_y = gcry_mpi_copy(their_dh.pub);
+	context->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	context->protocol_version = 3;
+
+	ok(otrl_proto_create_data(&encmessagep, context, msg, NULL, 0,
+			extrakey) == gcry_error(GPG_ERR_NO_ERROR) &&
+			encmessagep != NULL,
+			"Data message created from underived session keys");
+
+	otrl_dh_session(&expected, &(priv->our_old_dh_key), their_dh.pub);
+	ok(priv->sesskeys[1][0].derived && !priv->sesskeys[0][0].derived &&
+			!priv->sesskeys[0][1].derived &&
+			!priv->sesskeys[1][1].derived &&
+			memcmp(extrakey, expected.extrakey,
+				OTRL_EXTRAKEY_BYTES) == 0,
+			"Only the sending session keys were derived");
+
+	otrl_dh_session_free(&expected);
+	otrl_dh_keypair_free(&their_dh);
+	free(encmessagep);
+}
+
+static void test_otrl_proto_create_data_buf(void)
+{
+	char *msg = "A message with TLVs attached";
+	char encmessage[2048];
+	char *plaintext = NULL;
+	size_t len;
+	unsigned char flags = 0;
+	DH_keypair a1, a2, b1;
+	OtrlTLV *tlvs, *rcvtlvs = NULL;
+	ConnContext *alice =
+		new_context("Bob", "Alice's account", "Secret protocol");
+	ConnContext *bob =
+		new_context("Alice", "Bob's account", "Secret protocol");
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a1);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a2);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &b1);
+
+	otrl_dh_keypair_copy(&(alice->context_priv->our_old_dh_key), &a1);
+	otrl_dh_keypair_copy(&(alice->context_priv->our_dh_key), &a2);
+	alice->context_priv->our_keyid = 2;
+	alice->context_priv->their_y = gcry_mpi_copy(b1.pub);
+	alice->context_priv->their_keyid = 1;
+	alice->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice->protocol_version = 3;
+
+	otrl_dh_keypair_copy(&(bob->context_priv->our_dh_key), &b1);
+	bob->context_priv->our_keyid = 1;
+	bob->context_priv->their_y = gcry_mpi_copy(a1.pub);
+	bob->context_priv->their_keyid = 1;
+	bob->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	bob->protocol_version = 3;
+
+	tlvs = otrl_tlv_new(OTRL_TLV_PADDING, 5,
+		(const unsigned char *)"\0\0\0\0\0");
+	tlvs->next = otrl_tlv_new(OTRL_TLV_SMP_ABORT, 0,
+		(const unsigned char *)"");
+
+	len = otrl_proto_create_data_len(alice, msg, tlvs);
+	ok(otrl_proto_create_data_buf(encmessage, len - 1, alice, msg, tlvs,
+			OTRL_MSGFLAGS_IGNORE_UNREADABLE, NULL) ==
+			gcry_error(GPG_ERR_BUFFER_TOO_SHORT),
+			"Data message buffer too short detected");
+
+	ok(otrl_proto_create_data_buf(encmessage, len, alice, msg, tlvs,
+			OTRL_MSGFLAGS_IGNORE_UNREADABLE, NULL) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			strlen(encmessage) + 1 == len,
+			"Data message created in a buffer of the exact size");
+
+	ok(otrl_proto_accept_data(&plaintext, &rcvtlvs, bob, encmessage,
+			&flags, NULL) == gcry_error(GPG_ERR_NO_ERROR) &&
+			plaintext && strcmp(plaintext, msg) == 0 &&
+			flags == OTRL_MSGFLAGS_IGNORE_UNREADABLE &&
+			rcvtlvs && rcvtlvs->type == OTRL_TLV_PADDING &&
+			rcvtlvs->len == 5 && rcvtlvs->next &&
+			rcvtlvs->next->type == OTRL_TLV_SMP_ABORT &&
+			rcvtlvs->next->next == NULL,
+			"Data message from a buffer decrypted with its TLVs");
+
+	free(plaintext);
+	plaintext = NULL;
+
+	/* The same message again is a replay, and the one after it has
+	 * been cut short.  Both use the keys bob has just rotated away
+	 * from, but only the replay should be reported as a conflict. */
+	ok(otrl_proto_accept_data(&plaintext, &rcvtlvs, bob, encmessage,
+			&flags, NULL) == gcry_error(GPG_ERR_CONFLICT) &&
+			plaintext == NULL,
+			"Replayed data message rejected");
+	strcpy(encmessage + len - 12, ".");
+	ok(otrl_proto_accept_data(&plaintext, &rcvtlvs, bob, encmessage,
+			&flags, NULL) == gcry_error(GPG_ERR_INV_VALUE) &&
+			plaintext == NULL,
+			"Truncated data message reported as malformed");
+
+	otrl_tlv_free(tlvs);
+	otrl_tlv_free(rcvtlvs);
+	otrl_dh_keypair_free(&a1);
+	otrl_dh_keypair_free(&a2);
+	otrl_dh_keypair_free(&b1);
+}
+
+static void test_otrl_proto_create_data_padded(void)
+{
+	char msg[1024];
+	char *short1 = NULL, *short2 = NULL;
+	char *padded;
+	char *plaintext = NULL;
+	unsigned char flags = 0;
+	DH_keypair a1, a2, b1;
+	OtrlTLV *rcvtlvs = NULL;
+	ConnContext *alice =
+		new_context("Bob", "Alice's account", "Secret protocol");
+	ConnContext *bob =
+		new_context("Alice", "Bob's account", "Secret protocol");
+	int mms = 500;
+	int fits = 1;
+	size_t i;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a1);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a2);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &b1);
+
+	otrl_dh_keypair_copy(&(alice->context_priv->our_old_dh_key), &a1);
+	otrl_dh_keypair_copy(&(alice->context_priv->our_dh_key), &a2);
+	alice->context_priv->our_keyid = 2;
+	alice->context_priv->their_y = gcry_mpi_copy(b1.pub);
+	alice->context_priv->their_keyid = 1;
+	alice->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice->protocol_version = 3;
+
+	otrl_dh_keypair_copy(&(bob->context_priv->our_dh_key), &b1);
+	bob->context_priv->our_keyid = 1;
+	bob->context_priv->their_y = gcry_mpi_copy(a1.pub);
+	bob->context_priv->their_keyid = 1;
+	bob->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	bob->protocol_version = 3;
+
+	otrl_proto_create_data_padded(&short1, alice, "Hi", NULL, 0, NULL, 0);
+	otrl_proto_create_data_padded(&short2, alice, "Hello there", NULL, 0,
+			NULL, 0);
+	ok(short1 && short2 && strlen(short1) == strlen(short2),
+			"Short messages padded to the same length");
+
+	ok(otrl_proto_accept_data(&plaintext, &rcvtlvs, bob, short1,
+			&flags, NULL) == gcry_error(GPG_ERR_NO_ERROR) &&
+			plaintext && strcmp(plaintext, "Hi") == 0 &&
+			rcvtlvs && rcvtlvs->type == OTRL_TLV_PADDING &&
+			rcvtlvs->next == NULL &&
+			strlen(plaintext) + 1 + otrl_tlv_seriallen(rcvtlvs) == 64,
+			"Padded message decrypted to a power of two");
+	free(plaintext);
+	otrl_tlv_free(rcvtlvs);
+
+	/* Padding must never cost an extra fragment */
+	for (i = 0; i < sizeof(msg) - 1; i += 7) {
+		char *unpadded;
+
+		memset(msg, 'x', i);
+		msg[i] = '\0';
+		otrl_proto_create_data(&unpadded, alice, msg, NULL, 0, NULL);
+		otrl_proto_create_data_padded(&padded, alice, msg, NULL, 0,
+				NULL, mms);
+		if (!padded || strlen(padded) < strlen(unpadded) ||
+				otrl_proto_fragment_count(mms, alice, padded) !=
+				otrl_proto_fragment_count(mms, alice, unpadded)) {
+			fits = 0;
+		}
+		free(unpadded);
+		free(padded);
+	}
+	ok(fits, "Padding stays within the fragments already needed");
+
+	free(short1);
+	free(short2);
+	otrl_dh_keypair_free(&a1);
+	otrl_dh_keypair_free(&a2);
+	otrl_dh_keypair_free(&b1);
+}
+
+/* Send msg from one context to the other, and see that it arrives */
+static int send_receive(ConnContext *from, ConnContext *to, const char *msg)
+{
+	char *encmessage = NULL, *plaintext = NULL;
+	OtrlTLV *tlvs = NULL;
+	unsigned char flags;
+	int res;
+
+	if (otrl_proto_create_data(&encmessage, from, msg, NULL, 0, NULL)) {
+		return 0;
+	}
+	res = otrl_proto_accept_data(&plaintext, &tlvs, to, encmessage,
+			&flags, NULL) == gcry_error(GPG_ERR_NO_ERROR) &&
+		plaintext && strcmp(plaintext, msg) == 0;
+	free(encmessage);
+	free(plaintext);
+	otrl_tlv_free(tlvs);
+	return res;
+}
+
+static void test_otrl_proto_saved_mac_keys(void)
+{
+	DH_keypair a1, a2, b1;
+	ConnContext *alice =
+		new_context("Bob", "Alice's account", "Secret protocol");
+	ConnContext *bob =
+		new_context("Alice", "Bob's account", "Secret protocol");
+	unsigned char *saved;
+	int i, delivered = 1, reused = 1;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a1);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a2);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &b1);
+
+	otrl_dh_keypair_copy(&(alice->context_priv->our_old_dh_key), &a1);
+	otrl_dh_keypair_copy(&(alice->context_priv->our_dh_key), &a2);
+	alice->context_priv->our_keyid = 2;
+	alice->context_priv->their_y = gcry_mpi_copy(b1.pub);
+	alice->context_priv->their_keyid = 1;
+	alice->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice->protocol_version = 3;
+
+	otrl_dh_keypair_copy(&(bob->context_priv->our_dh_key), &b1);
+	bob->context_priv->our_keyid = 1;
+	bob->context_priv->their_y = gcry_mpi_copy(a1.pub);
+	bob->context_priv->their_keyid = 1;
+	bob->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	bob->protocol_version = 3;
+
+	/* A conversation with the keys rotating at every reply */
+	for (i = 0; i < 3; i++) {
+		delivered &= send_receive(alice, bob, "Ping");
+		delivered &= send_receive(bob, alice, "Pong");
+	}
+	saved = bob->context_priv->saved_mac_keys;
+	ok(delivered && saved && bob->context_priv->numsavedkeys == 0 &&
+			bob->context_priv->savedkeys_size > 0,
+			"Saved MAC keys revealed, keeping the buffer");
+
+	for (i = 0; i < 3; i++) {
+		delivered &= send_receive(alice, bob, "Ping");
+		delivered &= send_receive(bob, alice, "Pong");
+		if (bob->context_priv->saved_mac_keys != saved) reused = 0;
+	}
+	ok(delivered && reused && bob->context_priv->numsavedkeys == 0,
+			"Saved MAC key buffer reused from one reveal to the next");
+
+	otrl_dh_keypair_free(&a1);
+	otrl_dh_keypair_free(&a2);
+	otrl_dh_keypair_free(&b1);
+}
+
+static void test_otrl_proto_accept_data_premac(void)
+{
+	DH_keypair a1, a2, b1;
+	ConnContext *alice =
+		new_context("Bob", "Alice's account", "Secret protocol");
+	ConnContext *bob =
+		new_context("Alice", "Bob's account", "Secret protocol");
+	char *encmessage = NULL, *other = NULL, *plaintext = NULL;
+	const unsigned char *tlvdata;
+	size_t tlvlen, macedlen;
+	unsigned char *rawmsg = NULL;
+	OtrlDataMac premac;
+	gcry_md_hd_t md;
+	gcry_error_t forged, err;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a1);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a2);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &b1);
+
+	otrl_dh_keypair_copy(&(alice->context_priv->our_old_dh_key), &a1);
+	otrl_dh_keypair_copy(&(alice->context_priv->our_dh_key), &a2);
+	alice->context_priv->our_keyid = 2;
+	alice->context_priv->their_y = gcry_mpi_copy(b1.pub);
+	alice->context_priv->their_keyid = 1;
+	alice->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice->protocol_version = 3;
+
+	otrl_dh_keypair_copy(&(bob->context_priv->our_dh_key), &b1);
+	bob->context_priv->our_keyid = 1;
+	bob->context_priv->their_y = gcry_mpi_copy(a1.pub);
+	bob->context_priv->their_keyid = 1;
+	bob->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	bob->protocol_version = 3;
+
+	otrl_proto_create_data(&encmessage, alice, "Premac", NULL, 0, NULL);
+	err = otrl_proto_data_mac_prepare(bob, encmessage, &rawmsg,
+			&macedlen, premac.mackey);
+	premac.datamsg = encmessage;
+	gcry_md_open(&md, GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
+	gcry_md_setkey(md, premac.mackey, 20);
+	gcry_md_write(md, rawmsg, macedlen);
+	memmove(premac.mac, gcry_md_read(md, GCRY_MD_SHA1), 20);
+	gcry_md_close(md);
+
+	/* A wrong MAC handed in is believed over the message's own */
+	premac.mac[0] ^= 1;
+	forged = otrl_proto_accept_data_view_premac(&plaintext, &tlvdata,
+			&tlvlen, bob, encmessage, NULL, NULL, &premac);
+	premac.mac[0] ^= 1;
+	ok(err == gcry_error(GPG_ERR_NO_ERROR) &&
+			gpg_err_code(forged) == GPG_ERR_CONFLICT &&
+			otrl_proto_accept_data_view_premac(&plaintext, &tlvdata,
+				&tlvlen, bob, encmessage, NULL, NULL,
+				&premac) == gcry_error(GPG_ERR_NO_ERROR) &&
+			plaintext && strcmp(plaintext, "Premac") == 0,
+			"MAC worked out ahead used for its message");
+	free(plaintext);
+	plaintext = NULL;
+
+	/* ...but not for any other */
+	premac.mac[0] ^= 1;
+	otrl_proto_create_data(&other, alice, "Other", NULL, 0, NULL);
+	ok(otrl_proto_accept_data_view_premac(&plaintext, &tlvdata, &tlvlen,
+				bob, other, NULL, NULL, &premac) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			plaintext && strcmp(plaintext, "Other") == 0,
+			"MAC worked out ahead ignored for another message");
+
+	free(plaintext);
+	free(rawmsg);
+	free(encmessage);
+	free(other);
+	otrl_dh_keypair_free(&a1);
+	otrl_dh_keypair_free(&a2);
+	otrl_dh_keypair_free(&b1);
+}
+
+static OtrlTracePhase traced_phases[8];
+static size_t traced_in[8], traced_out[8];
+static int traced_count, traced_in_order;
+
+static void test_trace(void *data, OtrlTracePhase phase,
+		ConnContext *context, size_t insize, size_t outsize,
+		unsigned long long start_ns, unsigned long long end_ns)
+{
+	if (context != data || end_ns < start_ns) traced_in_order = 0;
+	if (traced_count < 8) {
+		traced_phases[traced_count] = phase;
+		traced_in[traced_count] = insize;
+		traced_out[traced_count] = outsize;
+	}
+	traced_count++;
+}
+
+static void test_otrl_proto_trace(void)
+{
+	char *msg = "A traced message";
+	char *encmessage = NULL, *plaintext = NULL;
+	unsigned char flags = 0;
+	DH_keypair a1, a2, b1;
+	OtrlTLV *rcvtlvs = NULL;
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *alice =
+		new_context("Bob", "Alice's account", "Secret protocol");
+	ConnContext *bob =
+		new_context("Alice", "Bob's account", "Secret protocol");
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a1);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a2);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &b1);
+
+	otrl_dh_keypair_copy(&(alice->context_priv->our_old_dh_key), &a1);
+	otrl_dh_keypair_copy(&(alice->context_priv->our_dh_key), &a2);
+	alice->context_priv->our_keyid = 2;
+	alice->context_priv->their_y = gcry_mpi_copy(b1.pub);
+	alice->context_priv->their_keyid = 1;
+	alice->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice->protocol_version = 3;
+	alice->context_priv->userstate = us;
+
+	otrl_dh_keypair_copy(&(bob->context_priv->our_dh_key), &b1);
+	bob->context_priv->our_keyid = 1;
+	bob->context_priv->their_y = gcry_mpi_copy(a1.pub);
+	bob->context_priv->their_keyid = 1;
+	bob->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	bob->protocol_version = 3;
+	bob->context_priv->userstate = us;
+
+	traced_count = 0;
+	traced_in_order = 1;
+	otrl_proto_create_data(&encmessage, alice, "Untraced", NULL, 0, NULL);
+	ok(traced_count == 0, "Nothing traced without a trace callback");
+	free(encmessage);
+	encmessage = NULL;
+
+	/* The session keys were derived above, so alice won't trace a
+	 * DH_SESSION phase; bob will */
+	otrl_userstate_set_trace(us, test_trace, alice);
+	otrl_proto_create_data(&encmessage, alice, msg, NULL, 0, NULL);
+	ok(traced_count == 1 && traced_in_order &&
+			traced_phases[0] == OTRL_TRACE_CREATE_DATA &&
+			traced_in[0] == strlen(msg) + 1 &&
+			traced_out[0] == strlen(encmessage),
+			"Encryption traced with its sizes");
+
+	traced_count = 0;
+	otrl_userstate_set_trace(us, test_trace, bob);
+	otrl_proto_accept_data(&plaintext, &rcvtlvs, bob, encmessage,
+			&flags, NULL);
+	ok(traced_count == 2 && traced_in_order &&
+			traced_phases[0] == OTRL_TRACE_DH_SESSION &&
+			traced_phases[1] == OTRL_TRACE_ACCEPT_DATA &&
+			traced_in[1] == strlen(encmessage) &&
+			traced_out[1] == strlen(msg) + 1,
+			"Decryption and key derivation traced");
+
+	free(plaintext);
+	free(encmessage);
+	otrl_dh_keypair_free(&a1);
+	otrl_dh_keypair_free(&a2);
+	otrl_dh_keypair_free(&b1);
+	alice->context_priv->userstate = NULL;
+	bob->context_priv->userstate = NULL;
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_proto_message_classify(void)
+{
+	OtrlMessageInfo info;
+	const char *tagged = "Hi" OTRL_MESSAGE_TAG_BASE OTRL_MESSAGE_TAG_V2
+		OTRL_MESSAGE_TAG_V3 "there";
+	const char *data = "?OTR:AAMDWnOlmSfjFZcAAAAA.";
+
+	otrl_proto_message_classify(&info, "Just a ? and a\ttab");
+	ok(info.type == OTRL_MSGTYPE_NOTOTR && info.tag == NULL &&
+			info.version == 0, "Plaintext classified");
+
+	otrl_proto_message_classify(&info, tagged);
+	ok(info.type == OTRL_MSGTYPE_TAGGEDPLAINTEXT &&
+			info.whitespace_start == tagged + 2 &&
+			info.whitespace_end == tagged + 2 + 32 &&
+			info.versions == ((1<<1) | (1<<2)),
+			"Tagged plaintext classified");
+
+	otrl_proto_message_classify(&info, "Hello ?OTRv23? there");
+	ok(info.type == OTRL_MSGTYPE_QUERY && info.versions == ((1<<1) | (1<<2))
+			&& otrl_proto_bestversion(info.versions,
+				OTRL_POLICY_DEFAULT) == 3,
+			"Query message classified");
+
+	otrl_proto_message_classify(&info, data);
+	ok(info.type == OTRL_MSGTYPE_DATA && info.version == 3 &&
+			info.tag == data && info.payload == data + 5 &&
+			info.has_instances && info.instance_from == 0x5a73a599 &&
+			info.instance_to == 0x27e31597 && !info.fragment.is_fragment,
+			"v3 Data Message classified");
+
+	otrl_proto_message_classify(&info, "?OTR:AAMDWnOl.");
+	ok(info.type == OTRL_MSGTYPE_DATA && !info.has_instances,
+			"Short v3 message has no instance tags");
+}
+
+static void test_otrl_proto_fragment_parse(void)
+{
+	OtrlFragmentHeader hdr;
+
+	otrl_proto_fragment_parse(&hdr,
+			"hi ?OTR|5a73a599|27e31597,00001,00003,?OTR:AAM,");
+	ok(hdr.is_fragment && hdr.has_instances && hdr.valid &&
+			hdr.instance_from == 0x5a73a599 &&
+			hdr.instance_to == 0x27e31597 && hdr.k == 1 && hdr.n == 3 &&
+			hdr.datalen == 8 && !strncmp(hdr.data, "?OTR:AAM", 8),
+			"v3 fragment header parsed");
+
+	otrl_proto_fragment_parse(&hdr, "?OTR,2,3,DAAAA,");
+	ok(hdr.is_fragment && !hdr.has_instances && hdr.valid &&
+			hdr.k == 2 && hdr.n == 3 && hdr.datalen == 5,
+			"v2 fragment header parsed");
+
+	otrl_proto_fragment_parse(&hdr, "?OTR|5a73a599|27e3,00001,00003,");
+	ok(hdr.is_fragment && !hdr.valid && hdr.instance_from == 0x5a73a599
+			&& hdr.instance_to == 0x27e3 && hdr.data == NULL,
+			"Fragment header without data is invalid");
+
+	otrl_proto_fragment_parse(&hdr, "?OTR,00001,65536,abc,");
+	ok(hdr.is_fragment && !hdr.valid,
+			"Fragment header with too many fragments is invalid");
+
+	otrl_proto_fragment_parse(&hdr, "?OTR:AAMD.");
+	ok(hdr.tag && !hdr.is_fragment && !hdr.valid,
+			"Data message is not a fragment");
+}
+
+static void test_otrl_proto_fragment_create(void)
+{
+	char whole[101];
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context =
+		new_context("Alice", "Alice's account", "Secret protocol");
+	char **fragments = NULL;
+	char *msg = NULL;
+	int count, i, full = 1;
+	OtrlFragmentResult r = OTRL_FRAGMENT_INCOMPLETE;
+#if defined(OTRL_NO_PROTOCOL_V2) && !defined(OTRL_NO_PROTOCOL_V3)
+	/* A v3 fragment header with its trailing comma is 36 bytes, which
+	 * leaves 12 of each 48 for the message */
+	const int mms = 48;
+	const char *first =
+		"?OTR|00000000|00000000,00001,00009,ABCDEFGHIJKL,";
+
+	context->auth.protocol_version = 3;
+#else
+	/* A v2 fragment header with its trailing comma is 18 bytes, which
+	 * leaves 12 of each 30 for the message */
+	const int mms = 30;
+	const char *first = "?OTR,00001,00009,ABCDEFGHIJKL,";
+#endif
+
+	context->context_priv->userstate = us;
+	for (i = 0; i < 100; i++) whole[i] = 'A' + i % 26;
+	whole[100] = '\0';
+
+	count = otrl_proto_fragment_count(mms, context, whole);
+	if (otrl_proto_fragment_create(mms, count, &fragments, context,
+				whole)) {
+		count = 0;
+	}
+	for (i = 0; i < count - 1; i++) {
+		if (strlen(fragments[i]) != (size_t)mms) full = 0;
+	}
+	ok(count == 9 && full && !strncmp(fragments[0], first, mms),
+			"Fragments filled to the max message size");
+
+	for (i = 0; i < count; i++) {
+		r = otrl_proto_fragment_accumulate(&msg, context, fragments[i]);
+	}
+	ok(r == OTRL_FRAGMENT_COMPLETE && msg && !strcmp(msg, whole),
+			"Created fragments reassembled");
+	free(msg);
+	otrl_proto_fragment_free(&fragments, count);
+
+	context->context_priv->userstate = NULL;
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_proto_fragment_accumulate(void)
+{
+	const char *frags[] = { "?OTR,00001,00003,?OTR:AAM,",
+		"?OTR,00002,00003,DAAAAA,", "?OTR,00003,00003,Bw==.," };
+	const char *whole = "?OTR:AAMDAAAAABw==.";
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context =
+		new_context("Alice", "Alice's account", "Secret protocol");
+	char *msg = NULL;
+	OtrlFragmentResult r1, r2, r3;
+
+	context->context_priv->userstate = us;
+
+	r1 = otrl_proto_fragment_accumulate(&msg, context, frags[0]);
+	r2 = otrl_proto_fragment_accumulate(&msg, context, frags[1]);
+	r3 = otrl_proto_fragment_accumulate(&msg, context, frags[2]);
+	ok(r1 == OTRL_FRAGMENT_INCOMPLETE && r2 == OTRL_FRAGMENT_INCOMPLETE &&
+			r3 == OTRL_FRAGMENT_COMPLETE && msg && !strcmp(msg, whole),
+			"Fragments in order reassembled");
+	free(msg);
+	msg = NULL;
+
+	r1 = otrl_proto_fragment_accumulate(&msg, context, frags[2]);
+	r2 = otrl_proto_fragment_accumulate(&msg, context, frags[0]);
+	r3 = otrl_proto_fragment_accumulate(&msg, context, frags[1]);
+	ok(r1 == OTRL_FRAGMENT_INCOMPLETE && r2 == OTRL_FRAGMENT_INCOMPLETE &&
+			r3 == OTRL_FRAGMENT_COMPLETE && msg && !strcmp(msg, whole),
+			"Fragments out of order reassembled");
+	free(msg);
+	msg = NULL;
+
+	otrl_proto_fragment_accumulate(&msg, context, frags[1]);
+	otrl_proto_fragment_accumulate(&msg, context, frags[1]);
+	otrl_proto_fragment_accumulate(&msg, context, frags[0]);
+	r3 = otrl_proto_fragment_accumulate(&msg, context, frags[2]);
+	ok(r3 == OTRL_FRAGMENT_COMPLETE && msg && !strcmp(msg, whole),
+			"Repeated fragment ignored");
+	free(msg);
+	msg = NULL;
+
+	otrl_proto_fragment_accumulate(&msg, context, frags[0]);
+	r1 = otrl_proto_fragment_accumulate(&msg, context, "?OTR:AAMD.");
+	ok(r1 == OTRL_FRAGMENT_UNFRAGMENTED &&
+			context->context_priv->fragment == NULL,
+			"Unfragmented message discards fragments");
+
+	otrl_proto_fragment_accumulate(&msg, context, frags[0]);
+	otrl_proto_fragment_accumulate(&msg, context, frags[1]);
+	r1 = otrl_proto_fragment_accumulate(&msg, context,
+			"?OTR,00001,00002,?OTR:AAM,");
+	r2 = otrl_proto_fragment_accumulate(&msg, context,
+			"?OTR,00002,00002,DAAAAABw==.,");
+	ok(r1 == OTRL_FRAGMENT_INCOMPLETE && r2 == OTRL_FRAGMENT_COMPLETE &&
+			msg && !strcmp(msg, whole),
+			"Fragment of a new message restarts reassembly");
+	free(msg);
+	msg = NULL;
+
+	otrl_userstate_set_fragment_limits(us, strlen(whole) - 1, 0);
+	otrl_proto_fragment_accumulate(&msg, context, frags[0]);
+	otrl_proto_fragment_accumulate(&msg, context, frags[1]);
+	r3 = otrl_proto_fragment_accumulate(&msg, context, frags[2]);
+	ok(r3 == OTRL_FRAGMENT_INCOMPLETE && msg == NULL &&
+			context->context_priv->fragment_n == 0,
+			"Fragmented message over the limit discarded");
+
+	otrl_userstate_set_fragment_limits(us, 0, 60);
+	otrl_proto_fragment_accumulate(&msg, context, frags[0]);
+	otrl_proto_fragment_accumulate(&msg, context, frags[1]);
+	context->context_priv->fragment_time -= 61;
+	r3 = otrl_proto_fragment_accumulate(&msg, context, frags[2]);
+	ok(r3 == OTRL_FRAGMENT_INCOMPLETE && msg == NULL &&
+			context->context_priv->fragment_k == 1,
+			"Fragmented message past the timeout discarded");
+
+	otrl_context_priv_fragment_clear(context->context_priv);
+	context->context_priv->userstate = NULL;
+	otrl_userstate_free(us);
+}
+
 int main(int argc, char **argv)
 {
 	plan_tests(NUM_TESTS);
@@ -358,6 +1069,7 @@ int main(int argc, char **argv)
 	OTRL_INIT;
 
 	test_otrl_proto_default_query_msg();
+	test_otrl_proto_account_query_msg();
 	test_otrl_proto_query_bestversion();
 	test_otrl_init();
 	test_otrl_proto_whitespace_bestversion();
@@ -366,6 +1078,16 @@ int main(int argc, char **argv)
 	test_otrl_proto_instance();
 	test_otrl_version();
 	test_otrl_proto_create_data();
+	test_otrl_proto_create_data_sesskeys();
+	test_otrl_proto_create_data_buf();
+	test_otrl_proto_create_data_padded();
+	test_otrl_proto_saved_mac_keys();
+	test_otrl_proto_accept_data_premac();
+	test_otrl_proto_trace();
+	test_otrl_proto_message_classify();
+	test_otrl_proto_fragment_parse();
+	test_otrl_proto_fragment_create();
+	test_otrl_proto_fragment_accumulate();
 
 	return 0;
 }
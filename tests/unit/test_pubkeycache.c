@@ -0,0 +1,126 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <context.h>
+#include <proto.h>
+#include <pubkeycache.h>
+#include <userstate.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 6
+
+/* Cache a made-up key whose serialized form is data, and whose y is
+ * n, for the given context */
+static void add_key(ConnContext *context, unsigned char fingerprint[20],
+		const char *data, unsigned int n)
+{
+	otrl_pubkey_cache_add(context, fingerprint,
+			(const unsigned char *)data, strlen(data),
+			gcry_mpi_set_ui(NULL, 1), gcry_mpi_set_ui(NULL, 2),
+			gcry_mpi_set_ui(NULL, 3), gcry_mpi_set_ui(NULL, n));
+}
+
+/* Is the key with the given serialized form, whose y is n, cached
+ * for the given context? */
+static int cached(ConnContext *context, unsigned char fingerprint[20],
+		const char *data, unsigned int n)
+{
+	OtrlPubKey *key = otrl_pubkey_cache_find(context, fingerprint,
+			(const unsigned char *)data, strlen(data));
+	int res = key && gcry_mpi_cmp_ui(key->y, n) == 0;
+
+	otrl_pubkey_release(key);
+	return res;
+}
+
+static void test_otrl_pubkey_cache(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *alice = otrl_context_find(us, "Alice", "account",
+			"proto", OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	unsigned char fp[3][20];
+	Fingerprint *fprint[3];
+	OtrlPubKey *held;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		memset(fp[i], 'a' + i, 20);
+		fprint[i] = otrl_context_find_fingerprint(alice, fp[i], 1,
+				NULL);
+	}
+
+	add_key(alice, fp[0], "key zero", 100);
+	ok(!cached(alice, fp[0], "key zero", 100) &&
+			fprint[0]->pubkey == NULL,
+			"Nothing cached while the cache is off");
+
+	otrl_userstate_set_pubkey_cache(us, 2);
+	add_key(alice, fp[0], "key zero", 100);
+	ok(cached(alice, fp[0], "key zero", 100) &&
+			fprint[0]->pubkey != NULL,
+			"Key cached on its fingerprint");
+
+	ok(!cached(alice, fp[0], "another key", 100) &&
+			!cached(alice, fp[1], "key zero", 100),
+			"Key only found with its own fingerprint and data");
+
+	add_key(alice, fp[1], "key one", 101);
+	cached(alice, fp[0], "key zero", 100);
+	held = otrl_pubkey_cache_find(alice, fp[0], (const unsigned char *)
+			"key zero", 8);
+	add_key(alice, fp[2], "key two", 102);
+	ok(cached(alice, fp[0], "key zero", 100) &&
+			!cached(alice, fp[1], "key one", 101) &&
+			cached(alice, fp[2], "key two", 102) &&
+			us->pubkey_cache_used == 2,
+			"Least recently used key dropped");
+
+	otrl_context_forget_fingerprint(fprint[0], 0);
+	ok(!cached(alice, fp[0], "key zero", 100) &&
+			us->pubkey_cache_used == 1 &&
+			gcry_mpi_cmp_ui(held->y, 100) == 0,
+			"Forgotten fingerprint's key dropped, but kept "
+			"while held");
+	otrl_pubkey_release(held);
+
+	otrl_userstate_set_pubkey_cache(us, 0);
+	ok(!cached(alice, fp[2], "key two", 102) &&
+			us->pubkey_cache_used == 0 &&
+			us->pubkey_lru_head == NULL &&
+			us->pubkey_lru_tail == NULL,
+			"Turning the cache off empties it");
+
+	otrl_userstate_free(us);
+}
+
+int main(int argc, char** argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_pubkey_cache();
+
+	return 0;
+}
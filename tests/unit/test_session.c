@@ -0,0 +1,191 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <context.h>
+#include <dh.h>
+#include <proto.h>
+#include <session.h>
+#include <userstate.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 11
+
+static const unsigned char key[OTRL_SESSION_KEY_BYTES] =
+	"0123456789abcdef0123456789abcde";
+static const unsigned char fingerprint[20] = "Alice's fingerprint";
+
+static ConnContext *find_context(OtrlUserState us, const char *user,
+		const char *accountname)
+{
+	return otrl_context_find(us, user, accountname, "Secret protocol",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+}
+
+/* Put alice and bob in an encrypted session with each other, as the
+ * create_data_buf test in test_proto does */
+static void setup_session(ConnContext *alice, ConnContext *bob)
+{
+	DH_keypair a1, a2, b1;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a1);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a2);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &b1);
+
+	otrl_dh_keypair_copy(&(alice->context_priv->our_old_dh_key), &a1);
+	otrl_dh_keypair_copy(&(alice->context_priv->our_dh_key), &a2);
+	alice->context_priv->our_keyid = 2;
+	alice->context_priv->their_y = gcry_mpi_copy(b1.pub);
+	alice->context_priv->their_keyid = 1;
+	alice->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	alice->protocol_version = 3;
+
+	otrl_dh_keypair_copy(&(bob->context_priv->our_dh_key), &b1);
+	bob->context_priv->our_keyid = 1;
+	bob->context_priv->their_y = gcry_mpi_copy(a1.pub);
+	bob->context_priv->their_keyid = 1;
+	bob->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	bob->protocol_version = 3;
+	bob->active_fingerprint = otrl_context_find_fingerprint(bob,
+		(unsigned char *)fingerprint, 1, NULL);
+
+	otrl_dh_keypair_free(&a1);
+	otrl_dh_keypair_free(&a2);
+	otrl_dh_keypair_free(&b1);
+}
+
+static int send_receive(ConnContext *from, ConnContext *to, const char *msg,
+		char **encmessagep)
+{
+	char *plaintext = NULL;
+	OtrlTLV *tlvs = NULL;
+	unsigned char flags;
+	int res;
+
+	if (otrl_proto_create_data(encmessagep, from, msg, NULL, 0, NULL)) {
+		return 0;
+	}
+	res = otrl_proto_accept_data(&plaintext, &tlvs, to, *encmessagep,
+			&flags, NULL) == gcry_error(GPG_ERR_NO_ERROR) &&
+		plaintext && strcmp(plaintext, msg) == 0;
+	free(plaintext);
+	otrl_tlv_free(tlvs);
+	return res;
+}
+
+static void test_otrl_session_export_import(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	ConnContext *alice = find_context(us, "Bob", "Alice's account");
+	ConnContext *bob = find_context(us, "Alice", "Bob's account");
+	ConnContext *alice2 = find_context(us2, "Bob", "Alice's account");
+	ConnContext *bob2 = find_context(us2, "Alice", "Bob's account");
+	unsigned char *ablob = NULL, *bblob = NULL;
+	size_t ablen = 0, bblen = 0;
+	char *first = NULL, *second = NULL, *plaintext = NULL;
+	OtrlTLV *tlvs = NULL;
+	unsigned char flags;
+
+	ok(otrl_session_export(alice, key, &ablob, &ablen) ==
+			gcry_error(GPG_ERR_CONFLICT) && ablob == NULL,
+			"Plaintext context not exported");
+
+	setup_session(alice, bob);
+	ok(send_receive(alice, bob, "Before the restart", &first),
+			"Message sent before the export");
+
+	ok(otrl_session_export(alice, key, &ablob, &ablen) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_session_export(bob, key, &bblob, &bblen) ==
+			gcry_error(GPG_ERR_NO_ERROR) && ablob && bblob,
+			"Encrypted contexts exported");
+
+	ok(otrl_session_import(alice2, key, ablob, ablen) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_session_import(bob2, key, bblob, bblen) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			alice2->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
+			alice2->protocol_version == 3 &&
+			bob2->active_fingerprint &&
+			memcmp(bob2->active_fingerprint->fingerprint,
+				fingerprint, 20) == 0,
+			"Sessions imported into new contexts");
+
+	ok(send_receive(alice2, bob2, "After the restart", &second),
+			"Message sent after the import");
+
+	ok(otrl_proto_accept_data(&plaintext, &tlvs, bob2, first, &flags,
+			NULL) != gcry_error(GPG_ERR_NO_ERROR),
+			"Message from before the export not accepted again");
+	free(plaintext);
+	otrl_tlv_free(tlvs);
+
+	ok(otrl_session_import(bob2, key, bblob, bblen) ==
+			gcry_error(GPG_ERR_CONFLICT),
+			"Import into an encrypted context detected");
+
+	otrl_context_force_plaintext(bob2);
+	ok(otrl_session_import(bob2, (const unsigned char *)
+			"Not the key that sealed the blob", bblob, bblen) ==
+			gcry_error(GPG_ERR_BAD_SIGNATURE) &&
+			bob2->msgstate == OTRL_MSGSTATE_PLAINTEXT,
+			"Blob not opened with the wrong key");
+
+	bblob[bblen / 2] ^= 0x01;
+	ok(otrl_session_import(bob2, key, bblob, bblen) ==
+			gcry_error(GPG_ERR_BAD_SIGNATURE),
+			"Altered blob detected");
+	bblob[bblen / 2] ^= 0x01;
+
+	ok(otrl_session_import(bob2, key, bblob, 20) ==
+			gcry_error(GPG_ERR_INV_VALUE) &&
+			otrl_session_import(bob2, key, (const unsigned char *)
+				first, strlen(first)) ==
+			gcry_error(GPG_ERR_INV_VALUE),
+			"Non-blobs rejected");
+
+	ok(otrl_session_import(otrl_context_find(us2, "Alice",
+			"Bob's account", "Secret protocol", 0x1234, 1, NULL,
+			NULL, NULL), key, bblob, bblen) ==
+			gcry_error(GPG_ERR_CONFLICT),
+			"Blob for another instance detected");
+
+	free(ablob);
+	free(bblob);
+	free(first);
+	free(second);
+	otrl_userstate_free(us);
+	otrl_userstate_free(us2);
+}
+
+int main(int argc, char** argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_session_export_import();
+
+	return 0;
+}
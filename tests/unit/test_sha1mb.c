@@ -0,0 +1,121 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <proto.h>
+#include <sha1mb.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 3
+
+/* Do the n HMACs in macs match what libgcrypt makes of them? */
+static int hmacs_match(unsigned char macs[][20], unsigned char keys[][20],
+		const unsigned char *const msgs[], const size_t lens[], int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		gcry_md_hd_t md;
+		int differ;
+
+		gcry_md_open(&md, GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
+		gcry_md_setkey(md, keys[i], 20);
+		gcry_md_write(md, msgs[i], lens[i]);
+		differ = memcmp(macs[i], gcry_md_read(md, GCRY_MD_SHA1), 20);
+		gcry_md_close(md);
+		if (differ) return 0;
+	}
+	return 1;
+}
+
+static void test_otrl_sha1mb_hmac(void)
+{
+	/* Lengths either side of where the padding spills into another
+	 * block */
+	static const size_t sizes[] = {
+		0, 1, 55, 56, 63, 64, 65, 119, 120, 230, 1240, 5000
+	};
+	unsigned char *buf = malloc(5000 * OTRL_SHA1MB_LANES);
+	unsigned char macs[OTRL_SHA1MB_LANES][20];
+	unsigned char keys[OTRL_SHA1MB_LANES][20];
+	const unsigned char *msgs[OTRL_SHA1MB_LANES];
+	size_t lens[OTRL_SHA1MB_LANES];
+	int i, n, all_sizes = 1, all_counts = 1;
+
+	gcry_randomize(buf, 5000 * OTRL_SHA1MB_LANES, GCRY_WEAK_RANDOM);
+	gcry_randomize(keys, sizeof(keys), GCRY_WEAK_RANDOM);
+	for (i = 0; i < OTRL_SHA1MB_LANES; i++) {
+		msgs[i] = buf + 5000 * i;
+	}
+
+	/* Every lane the same length */
+	for (n = 0; n < (int)(sizeof(sizes) / sizeof(sizes[0])); n++) {
+		for (i = 0; i < OTRL_SHA1MB_LANES; i++) lens[i] = sizes[n];
+		otrl_sha1mb_hmac(macs, (const unsigned char (*)[20])keys,
+				msgs, lens, OTRL_SHA1MB_LANES);
+		if (!hmacs_match(macs, keys, msgs, lens, OTRL_SHA1MB_LANES)) {
+			all_sizes = 0;
+		}
+	}
+	ok(all_sizes, "HMACs of equal lengths match libgcrypt's");
+
+	/* Every lane a different length, and fewer than all the lanes */
+	for (n = 1; n <= OTRL_SHA1MB_LANES; n++) {
+		for (i = 0; i < n; i++) {
+			lens[i] = sizes[(i * 5 + n) %
+				(sizeof(sizes) / sizeof(sizes[0]))];
+		}
+		otrl_sha1mb_hmac(macs, (const unsigned char (*)[20])keys,
+				msgs, lens, n);
+		if (!hmacs_match(macs, keys, msgs, lens, n)) {
+			all_counts = 0;
+		}
+	}
+	ok(all_counts, "HMACs of mixed lengths match libgcrypt's");
+
+	/* The same message under two keys */
+	msgs[1] = msgs[0];
+	lens[0] = lens[1] = 230;
+	keys[1][0] ^= 1;
+	otrl_sha1mb_hmac(macs, (const unsigned char (*)[20])keys, msgs,
+			lens, 2);
+	ok(memcmp(macs[0], macs[1], 20) &&
+			hmacs_match(macs, keys, msgs, lens, 2),
+			"Each lane uses its own key");
+
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	skip_start(!otrl_sha1mb_available(), NUM_TESTS,
+			"No AVX2 on this machine");
+	test_otrl_sha1mb_hmac();
+	skip_end();
+
+	return 0;
+}
@@ -26,7 +26,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 23
+#define NUM_TESTS 26
 
 /* Copied from sm.c */
 static const int SM_MOD_LEN_BITS = 1536;
@@ -309,6 +309,67 @@ static void test_sm_step5(void)
 			"SMP step5 validate");
 }
 
+static void test_sm_check_proofs(void)
+{
+	OtrlSMState a, b;
+	unsigned char hash_secret[SM_DIGEST_SIZE];
+	unsigned char other_secret[SM_DIGEST_SIZE];
+	unsigned char *out1, *out2, *out3, *out4, *forged;
+	int len1, len2, len3, len4;
+	gcry_error_t err;
+	/* Six MPIs, all 1, which is not a group element */
+	unsigned char ones[4 + 6 * 5] = { 0, 0, 0, 6 };
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		ones[4 + i * 5 + 3] = 1;
+		ones[4 + i * 5 + 4] = 1;
+	}
+
+	gcry_md_hash_buffer(SM_HASH_ALGORITHM, hash_secret, secret,
+			strlen(secret));
+	memcpy(other_secret, hash_secret, sizeof(other_secret));
+	other_secret[0] ^= 1;
+
+	otrl_sm_state_new(&a);
+	otrl_sm_state_init(&a);
+	otrl_sm_state_new(&b);
+	otrl_sm_state_init(&b);
+	otrl_sm_step1(&a, hash_secret, sizeof(hash_secret), &out1, &len1);
+
+	err = otrl_sm_step2a(&b, ones, sizeof(ones), 0);
+	ok(err == gcry_error(GPG_ERR_INV_VALUE) &&
+			b.sm_prog_state == OTRL_SMP_PROG_CHEATED,
+			"SMP step2a rejects an out of range value");
+
+	/* The last byte of the message is in the d of the second proof */
+	forged = malloc(len1);
+	memcpy(forged, out1, len1);
+	forged[len1 - 1] ^= 1;
+	otrl_sm_state_init(&b);
+	err = otrl_sm_step2a(&b, forged, len1, 0);
+	ok(err == gcry_error(GPG_ERR_INV_VALUE), "SMP step2a rejects a forged proof");
+	free(forged);
+
+	otrl_sm_state_init(&b);
+	otrl_sm_step2a(&b, out1, len1, 0);
+	otrl_sm_step2b(&b, other_secret, sizeof(other_secret), &out2, &len2);
+	otrl_sm_step3(&a, out2, len2, &out3, &len3);
+	otrl_sm_step4(&b, out3, len3, &out4, &len4);
+	err = otrl_sm_step5(&a, out4, len4);
+	ok(err == gcry_error(GPG_ERR_INV_VALUE) &&
+			a.sm_prog_state == OTRL_SMP_PROG_FAILED &&
+			b.sm_prog_state == OTRL_SMP_PROG_FAILED,
+			"SMP with different secrets fails");
+
+	free(out1);
+	free(out2);
+	free(out3);
+	free(out4);
+	otrl_sm_state_free(&a);
+	otrl_sm_state_free(&b);
+}
+
 int main(int argc, char **argv)
 {
 	/* Libtap call for the number of tests planned. */
@@ -339,5 +400,7 @@ int main(int argc, char **argv)
 	test_sm_step4();
 	test_sm_step5();
 
+	test_sm_check_proofs();
+
 	return 0;
 }
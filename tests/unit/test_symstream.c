@@ -0,0 +1,144 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <proto.h>
+#include <symstream.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 7
+
+#define CHUNK 64
+
+static const unsigned char symkey[OTRL_EXTRAKEY_BYTES] =
+	"The extra key for file transfer";
+static const unsigned char usedata[] = "report.pdf";
+
+static void fill(unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = i * 7 + 3;
+	}
+}
+
+static void test_otrl_symstream_round_trip(void)
+{
+	OtrlSymStream enc, dec;
+	unsigned char header[OTRL_SYMSTREAM_HEADER_BYTES];
+	unsigned char data[3 * CHUNK + 10], plain[3 * CHUNK + 10];
+	unsigned char cipher[CHUNK];
+	unsigned char tags[4][OTRL_SYMSTREAM_TAG_BYTES];
+	int i, good = 1;
+
+	fill(plain, sizeof(plain));
+	memmove(data, plain, sizeof(data));
+
+	ok(otrl_symstream_encrypt_init(&enc, symkey, usedata,
+			sizeof(usedata), CHUNK, header) ==
+			gcry_error(GPG_ERR_NO_ERROR),
+			"Encrypting stream started");
+	for (i = 0; i < 4; i++) {
+		if (otrl_symstream_encrypt(&enc, data + i * CHUNK,
+				i < 3 ? CHUNK : 10, i == 3, tags[i])) {
+			good = 0;
+		}
+	}
+	ok(good && memcmp(data, plain, CHUNK) &&
+			otrl_symstream_encrypt(&enc, data, 0, 1, tags[0]) ==
+			gcry_error(GPG_ERR_CONFLICT),
+			"Chunks encrypted in place up to the last");
+	otrl_symstream_free(&enc);
+
+	otrl_symstream_decrypt_init(&dec, symkey, usedata, sizeof(usedata),
+			header);
+	ok(otrl_symstream_decrypt(&dec, data + CHUNK, CHUNK, 0, tags[1]) ==
+			gcry_error(GPG_ERR_BAD_SIGNATURE) &&
+			otrl_symstream_decrypt(&dec, data, CHUNK - 1, 0,
+				tags[0]) == gcry_error(GPG_ERR_INV_LENGTH),
+			"Chunk out of order or of the wrong size turned down");
+
+	data[5] ^= 0x01;
+	memmove(cipher, data, CHUNK);
+	ok(otrl_symstream_decrypt(&dec, data, CHUNK, 0, tags[0]) ==
+			gcry_error(GPG_ERR_BAD_SIGNATURE) &&
+			memcmp(data, cipher, CHUNK) == 0,
+			"Altered chunk turned down and left alone");
+	data[5] ^= 0x01;
+
+	good = 1;
+	for (i = 0; i < 2; i++) {
+		if (otrl_symstream_decrypt(&dec, data + i * CHUNK, CHUNK, 0,
+				tags[i])) {
+			good = 0;
+		}
+	}
+	/* A stream cut off after its third chunk doesn't pass for whole */
+	ok(good && otrl_symstream_decrypt(&dec, data + 2 * CHUNK, CHUNK, 1,
+				tags[2]) == gcry_error(GPG_ERR_BAD_SIGNATURE) &&
+			otrl_symstream_decrypt(&dec, data + 2 * CHUNK, CHUNK, 0,
+				tags[2]) == gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_symstream_decrypt(&dec, data + 3 * CHUNK, 10, 1,
+				tags[3]) == gcry_error(GPG_ERR_NO_ERROR) &&
+			memcmp(data, plain, sizeof(plain)) == 0,
+			"Chunks decrypted in place, the last marked as such");
+	otrl_symstream_free(&dec);
+}
+
+static void test_otrl_symstream_keys(void)
+{
+	OtrlSymStream enc, dec;
+	unsigned char header[OTRL_SYMSTREAM_HEADER_BYTES];
+	unsigned char data[CHUNK], tag[OTRL_SYMSTREAM_TAG_BYTES];
+
+	fill(data, sizeof(data));
+	otrl_symstream_encrypt_init(&enc, symkey, usedata, sizeof(usedata),
+			CHUNK, header);
+	otrl_symstream_encrypt(&enc, data, CHUNK, 1, tag);
+	otrl_symstream_free(&enc);
+
+	otrl_symstream_decrypt_init(&dec, symkey, (const unsigned char *)
+			"other.pdf", 10, header);
+	ok(otrl_symstream_decrypt(&dec, data, CHUNK, 1, tag) ==
+			gcry_error(GPG_ERR_BAD_SIGNATURE),
+			"Stream for another use turned down");
+	otrl_symstream_free(&dec);
+
+	header[0] = 'X';
+	ok(otrl_symstream_decrypt_init(&dec, symkey, usedata,
+			sizeof(usedata), header) ==
+			gcry_error(GPG_ERR_INV_VALUE),
+			"Non-header detected");
+}
+
+int main(int argc, char **argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_symstream_round_trip();
+	test_otrl_symstream_keys();
+
+	return 0;
+}
@@ -25,7 +25,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 11
+#define NUM_TESTS 16
 
 static void test_otrl_tlv_new()
 {
@@ -146,6 +146,55 @@ static void test_otrl_tlv_find()
 	otrl_tlv_free(tlv);
 }
 
+static void test_otrl_tlv_view()
+{
+	const unsigned char serialized[] =
+		{'\x04', '\x02', '\x00', '\x03', '1', '2', '3',
+		'\x01', '\x03', '\x0', '\x01', 'A',
+		'\x01', '\x03', '\x0', '\x01', 'B',
+		'\x02', '\x02', '\xff', '\xff', '1', '3', '3', '7'};
+	const unsigned char *p = serialized;
+	size_t len = sizeof(serialized);
+	OtrlTLVView view;
+	int n = 0;
+
+	while (otrl_tlv_view_next(&view, &p, &len)) n++;
+	ok(n == 3 && p == serialized + 17 && len == 8,
+			"Views stop before a truncated TLV");
+
+	ok(otrl_tlv_view_find(&view, serialized, sizeof(serialized),
+				(1<<8) + 3) &&
+			view.len == 1 && view.data == serialized + 11,
+			"First TLV of a type found in place");
+
+	ok(!otrl_tlv_view_find(&view, serialized, sizeof(serialized), 514),
+			"Truncated TLV not found");
+}
+
+static void test_otrl_tlvbuf()
+{
+	const unsigned char serialized[] =
+		{'\x04', '\x02', '\x00', '\x03', '1', '2', '3',
+		'\x02', '\x02', '\x00', '\x04', '1', '3', '3', '7',
+		'\x00', '\x01', '\x00', '\x00'};
+	OtrlTLVBuf tlvbuf;
+	unsigned char *data;
+
+	otrl_tlvbuf_init(&tlvbuf);
+	otrl_tlvbuf_append(&tlvbuf, 1026, 3, (const unsigned char *)"123");
+	data = otrl_tlvbuf_reserve(&tlvbuf, 514, 4);
+	memmove(data, "1337", 4);
+	otrl_tlvbuf_append(&tlvbuf, OTRL_TLV_DISCONNECTED, 0, NULL);
+	ok(tlvbuf.len == sizeof(serialized) &&
+			memcmp(tlvbuf.data, serialized, tlvbuf.len) == 0,
+			"TLVs built serialized in place");
+
+	ok(otrl_tlvbuf_reserve(&tlvbuf, 1, 0x10000) == NULL &&
+			tlvbuf.len == sizeof(serialized),
+			"TLV too long for its length field refused");
+	otrl_tlvbuf_free(&tlvbuf);
+}
+
 int main(int argc, char **argv)
 {
 	plan_tests(NUM_TESTS);
@@ -158,6 +207,8 @@ int main(int argc, char **argv)
 	test_otrl_tlv_seriallen();
 	test_otrl_tlv_serialize();
 	test_otrl_tlv_find();
+	test_otrl_tlv_view();
+	test_otrl_tlvbuf();
 
 	return 0;
 }
@@ -18,14 +18,20 @@
 #include <gcrypt.h>
 #include <pthread.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <userstate.h>
+#include <context.h>
 #include <proto.h>
+#include <dh.h>
 
 #include <tap/tap.h>
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 1
+#define NUM_TESTS 26
 
 static void test_otrl_userstate_create()
 {
@@ -39,6 +45,378 @@ static void test_otrl_userstate_create()
 	otrl_userstate_free(us);
 }
 
+static void test_otrl_userstate_intern()
+{
+	OtrlUserState us = otrl_userstate_create();
+	char buf[] = "account";
+	char *one, *two;
+
+	one = otrl_userstate_intern(us, "account");
+	two = otrl_userstate_intern(us, buf);
+	ok(one != NULL && one == two && one != buf &&
+			strcmp(one, "account") == 0,
+			"Identical strings interned once");
+
+	otrl_userstate_intern_release(two);
+	ok(otrl_userstate_intern_find(us, "account") == one,
+			"Interned string kept while referenced");
+
+	otrl_userstate_intern_release(one);
+	ok(otrl_userstate_intern_find(us, "account") == NULL &&
+			us->intern_table_used == 0,
+			"Interned string freed with its last reference");
+
+	otrl_userstate_free(us);
+}
+
+#define THREADED_THREADS 4
+#define THREADED_USERS 50
+
+static OtrlUserState threaded_us;
+
+/* Each thread adds the same users' master contexts (so that they race
+ * to add them), and a child context of its own for each */
+static void *threaded_add(void *arg)
+{
+	long id = (long)arg;
+	char user[16];
+	int i;
+
+	for (i = 0; i < THREADED_USERS; i++) {
+		ConnContext *context;
+
+		snprintf(user, sizeof(user), "user%d", i);
+		otrl_context_find(threaded_us, user, "account", "proto",
+				OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+		context = otrl_context_find(threaded_us, user, "account",
+				"proto", 0x100 + id, 1, NULL, NULL, NULL);
+		otrl_context_lock(context);
+		context->app_data = context;
+		otrl_context_unlock(context);
+	}
+	return NULL;
+}
+
+static pthread_barrier_t threaded_barrier;
+
+/* Hold the given context's family lock between two waits at
+ * threaded_barrier */
+static void *threaded_hold(void *arg)
+{
+	ConnContext *context = arg;
+
+	otrl_context_lock(context);
+	pthread_barrier_wait(&threaded_barrier);
+	pthread_barrier_wait(&threaded_barrier);
+	otrl_context_unlock(context);
+	return NULL;
+}
+
+static void test_otrl_userstate_threaded()
+{
+	pthread_t threads[THREADED_THREADS];
+	ConnContext *context;
+	int i, ncontexts = 0, nmasters = 0, locked = 1;
+
+	threaded_us = otrl_userstate_create();
+	ok(otrl_userstate_set_threaded(threaded_us, 1) == 0,
+			"Threaded mode switched on");
+
+	for (i = 0; i < THREADED_THREADS; i++) {
+		pthread_create(&threads[i], NULL, threaded_add, (void *)(long)i);
+	}
+	for (i = 0; i < THREADED_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (context = threaded_us->context_root; context;
+			context = context->next) {
+		++ncontexts;
+		if (context->m_context == context) {
+			++nmasters;
+			if (!context->context_priv->family_lock) locked = 0;
+		} else if (context->app_data != context) {
+			locked = 0;
+		}
+	}
+	ok(ncontexts == THREADED_USERS * (THREADED_THREADS + 1) &&
+			nmasters == THREADED_USERS && locked,
+			"Contexts added from several threads at once");
+
+	context = otrl_context_find(threaded_us, "user0", "account", "proto",
+			OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+	pthread_barrier_init(&threaded_barrier, NULL, 2);
+	pthread_create(&threads[0], NULL, threaded_hold, context);
+	pthread_barrier_wait(&threaded_barrier);
+	ok(otrl_context_forget(context) == 1 &&
+			otrl_context_find(threaded_us, "user0", "account",
+				"proto", OTRL_INSTAG_MASTER, 0, NULL, NULL,
+				NULL) == context,
+			"Family kept while another thread holds its lock");
+	pthread_barrier_wait(&threaded_barrier);
+	pthread_join(threads[0], NULL);
+	pthread_barrier_destroy(&threaded_barrier);
+	ok(otrl_context_forget(context) == 0 &&
+			otrl_context_find(threaded_us, "user0", "account",
+				"proto", OTRL_INSTAG_MASTER, 0, NULL, NULL,
+				NULL) == NULL,
+			"Family forgotten once the lock is let go of");
+
+	otrl_userstate_set_threaded(threaded_us, 0);
+	ok(threaded_us->lock == NULL &&
+			threaded_us->context_root->context_priv->family_lock
+			== NULL, "Threaded mode switched off");
+
+	otrl_userstate_free(threaded_us);
+}
+
+#define DEADLINE_USERS 20
+
+/* The deadline test_otrl_userstate_deadline gives a context */
+static time_t deadline_of(ConnContext **contexts, ConnContext *context)
+{
+	int i;
+
+	for (i = 0; contexts[i] != context; i++);
+	return i == 5 ? 10 : 1000 + (i * 7) % DEADLINE_USERS;
+}
+
+static void test_otrl_userstate_deadline()
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *contexts[DEADLINE_USERS], *context;
+	time_t last = 0;
+	int i, popped = 0, in_order = 1;
+
+	for (i = 0; i < DEADLINE_USERS; i++) {
+		char user[16];
+
+		snprintf(user, sizeof(user), "user%d", i);
+		contexts[i] = otrl_context_find(us, user, "account", "proto",
+				OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+		otrl_userstate_deadline_add(us, contexts[i],
+				1000 + (i * 7) % DEADLINE_USERS);
+	}
+
+	/* A later deadline doesn't replace an earlier one */
+	otrl_userstate_deadline_add(us, contexts[3], 5000);
+	otrl_userstate_deadline_add(us, contexts[5], 10);
+	otrl_userstate_deadline_remove(us, contexts[8]);
+	ok(otrl_userstate_deadline_next(us) == 10 &&
+			otrl_userstate_deadline_pop(us, 9) == NULL,
+			"Earliest deadline found");
+
+	while ((context = otrl_userstate_deadline_pop(us, 1010)) != NULL) {
+		time_t when = deadline_of(contexts, context);
+
+		if (when < last || when > 1010 || context == contexts[8]) {
+			in_order = 0;
+		}
+		last = when;
+		popped++;
+	}
+	ok(in_order && popped == 12, "Expired deadlines popped in order");
+
+	/* Forgetting a context takes it out of the heap */
+	otrl_context_forget(contexts[19]);
+	popped = 0;
+	while (otrl_userstate_deadline_pop(us, 2000) != NULL) popped++;
+	ok(popped == 6 && otrl_userstate_deadline_next(us) == 0,
+			"Forgotten context no longer has a deadline");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_userstate_stats()
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserStateStats stats;
+	ConnContext *alice, *bob;
+	DH_keypair kp;
+	char *unfrag = NULL;
+	unsigned long keygens, modexps;
+
+	alice = otrl_context_find(us, "alice", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	bob = otrl_context_find(us, "bob", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_context_force_finished(bob);
+	otrl_userstate_stats(us, &stats);
+	ok(stats.contexts[OTRL_MSGSTATE_PLAINTEXT] == 1 &&
+			stats.contexts[OTRL_MSGSTATE_ENCRYPTED] == 0 &&
+			stats.contexts[OTRL_MSGSTATE_FINISHED] == 1 &&
+			stats.akes_started == 0 && stats.bytes_decrypted == 0,
+			"Contexts counted by msgstate");
+	keygens = stats.dh_keygens;
+	modexps = stats.modexps;
+
+	/* Two fragments of three, then an unfragmented message */
+	otrl_proto_fragment_accumulate(&unfrag, alice, "?OTR,1,3,one,");
+	otrl_proto_fragment_accumulate(&unfrag, alice, "?OTR,2,3,two,");
+	otrl_proto_fragment_accumulate(&unfrag, alice, "?OTR,2,3,two,");
+	otrl_proto_fragment_accumulate(&unfrag, alice, "hello");
+	otrl_userstate_stats(us, &stats);
+	ok(stats.fragments_accumulated == 2 &&
+			stats.fragments_dropped == 2 && unfrag == NULL,
+			"Fragments accumulated and dropped counted");
+
+	otrl_dh_keypair_init(&kp);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &kp);
+	otrl_dh_keypair_free(&kp);
+	otrl_userstate_stats(us, &stats);
+	ok(stats.dh_keygens == keygens + 1 && stats.modexps == modexps + 1,
+			"D-H keypair generation counted");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_userstate_ake_admission()
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserStateStats stats;
+	ConnContext *contexts[5], *context;
+	char *msg = NULL;
+	unsigned int version = 0;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		char user[16];
+
+		snprintf(user, sizeof(user), "user%d", i);
+		contexts[i] = otrl_context_find(us, user, "account", "proto",
+				OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	}
+
+	ok(otrl_userstate_ake_admit(us, contexts[0], 0, 0, 100, 0) == 1 &&
+			otrl_userstate_set_ake_admission(us, 2, 2) == 0 &&
+			otrl_userstate_ake_admit(us, contexts[0], 0, 0, 100,
+				0) == 1 &&
+			otrl_userstate_ake_admit(us, contexts[1], 0, 0, 100,
+				0) == 1 &&
+			otrl_userstate_ake_admit(us, contexts[2], 0, 0, 100,
+				0) == 0,
+			"AKEs let in up to the limit");
+
+	/* A trusted correspondent goes ahead of an earlier cold one, and
+	 * the coldest is dropped once the queue is full */
+	ok(otrl_userstate_ake_defer(us, contexts[2], "commit 2", 3, 0, 50,
+				101) == 0 &&
+			otrl_userstate_ake_defer(us, contexts[3], "commit 3", 2,
+				1, 0, 102) == 0 &&
+			otrl_userstate_ake_defer(us, contexts[4], "commit 4", 3,
+				0, 10, 103) == -1 &&
+			otrl_userstate_ake_next(us, 104, 0, &msg,
+				&version) == NULL,
+			"DH-Commits held back while at the limit");
+
+	otrl_userstate_ake_release(us, contexts[0]);
+	context = otrl_userstate_ake_next(us, 105, 0, &msg, &version);
+	ok(context == contexts[3] && msg && strcmp(msg, "commit 3") == 0 &&
+			version == 2 &&
+			otrl_userstate_ake_next(us, 105, 0, &msg,
+				&version) == NULL,
+			"Trusted correspondent answered first");
+	free(msg);
+
+	/* Letting in a DH-Commit that isn't held back waits for the
+	 * queued one */
+	otrl_userstate_ake_release(us, contexts[1]);
+	ok(otrl_userstate_ake_admit(us, contexts[4], 0, 10, 106, 0) == 0 &&
+			otrl_userstate_ake_next(us, 106, 0, &msg,
+				&version) == contexts[2] &&
+			strcmp(msg, "commit 2") == 0,
+			"New DH-Commit waits behind a more deserving one");
+	free(msg);
+
+	/* AKEs that have gone on too long stop counting, and forgetting a
+	 * context drops its DH-Commit */
+	otrl_userstate_ake_defer(us, contexts[4], "commit 4", 3, 0, 10, 200);
+	otrl_context_forget(contexts[4]);
+	otrl_userstate_stats(us, &stats);
+	ok(otrl_userstate_ake_admit(us, contexts[0], 0, 0, 300, 200) == 1 &&
+			otrl_userstate_ake_admit(us, contexts[1], 0, 0, 300,
+				200) == 1 &&
+			us->ake_deferred_used == 0 &&
+			stats.akes_deferred == 3 && stats.akes_shed == 1,
+			"Expired AKEs and forgotten contexts no longer count");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_userstate_heartbeat()
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *one, *two, *three;
+
+	one = otrl_context_find(us, "one", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	two = otrl_context_find(us, "two", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	three = otrl_context_find(us, "three", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+
+	otrl_userstate_heartbeat_queue(us, one, 100);
+	otrl_userstate_heartbeat_queue(us, two, 105);
+	otrl_userstate_heartbeat_queue(us, one, 110);
+	otrl_userstate_heartbeat_queue(us, three, 110);
+	ok(otrl_userstate_heartbeat_next(us, 99) == NULL &&
+			otrl_userstate_heartbeat_next(us, 100) == one &&
+			otrl_userstate_heartbeat_next(us, 100) == NULL,
+			"Heartbeats come out once due, queued once each");
+
+	otrl_userstate_heartbeat_forget(us, two);
+	ok(otrl_userstate_heartbeat_next(us, 200) == three &&
+			otrl_userstate_heartbeat_next(us, 200) == NULL,
+			"Forgotten heartbeat taken out of the queue");
+
+	otrl_userstate_heartbeat_queue(us, two, 300);
+	otrl_userstate_heartbeat_queue(us, three, 300);
+	otrl_context_forget(two);
+	ok(otrl_userstate_heartbeat_next(us, 300) == three &&
+			us->heartbeat_head == NULL &&
+			us->heartbeat_tail == &(us->heartbeat_head),
+			"Forgotten context's heartbeat dropped");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_userstate_prepare_akes()
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *trusted, *untrusted;
+	unsigned char fingerprint[20] = "Some fingerprint...";
+	unsigned char hashgx[32];
+
+	trusted = otrl_context_find(us, "trusted", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	untrusted = otrl_context_find(us, "untrusted", "account", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_context_set_trust(otrl_context_find_fingerprint(trusted,
+			fingerprint, 1, NULL), "verified");
+	otrl_context_find_fingerprint(untrusted, fingerprint, 1, NULL);
+
+	ok(otrl_userstate_prepare_akes(us, 10, 60) == 1 &&
+			trusted->auth.prepared.encgx != NULL &&
+			untrusted->auth.prepared.encgx == NULL &&
+			otrl_userstate_prepare_akes(us, 10, 60) == 0,
+			"Only the context with a trusted fingerprint prepared");
+
+	memmove(hashgx, trusted->auth.prepared.hashgx, 32);
+	ok(otrl_auth_start_v23(&(trusted->auth), 3) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			memcmp(trusted->auth.hashgx, hashgx, 32) == 0 &&
+			trusted->auth.prepared.encgx == NULL &&
+			otrl_userstate_prepare_akes(us, 10, 60) == 0,
+			"Prepared material used by the next AKE, just once");
+
+	otrl_context_force_finished(trusted);
+	ok(otrl_userstate_prepare_akes(us, 10, 60) == 1 &&
+			trusted->auth.prepared.encgx != NULL,
+			"Context prepared again once its AKE is over");
+
+	otrl_userstate_free(us);
+}
+
 int main(int argc, char** argv)
 {
 	plan_tests(NUM_TESTS);
@@ -47,6 +425,13 @@ int main(int argc, char** argv)
 	OTRL_INIT;
 
 	test_otrl_userstate_create();
+	test_otrl_userstate_intern();
+	test_otrl_userstate_threaded();
+	test_otrl_userstate_deadline();
+	test_otrl_userstate_stats();
+	test_otrl_userstate_ake_admission();
+	test_otrl_userstate_heartbeat();
+	test_otrl_userstate_prepare_akes();
 
 	return 0;
 }
@@ -21,40 +21,76 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* libgcrypt headers */
+#include <gcrypt.h>
+
 /* toolkit headers */
 #include "aes.h"
 
+/* How many counter blocks to encrypt at a time */
+#define CTR_BATCH_BLOCKS 16
+
 /* Encrypt or decrypt data in AES-CTR mode.  (The operations are the
- * same.)  We roll our own here just to double-check that the calls
- * libotr makes to libgcrypt are doing the right thing. */
+ * same.)  We roll our own CTR mode here just to double-check that the
+ * calls libotr makes to libgcrypt are doing the right thing, but use
+ * libgcrypt's AES for the blocks, as sha1hmac uses its SHA1, so that
+ * it can use the CPU's AES instructions.  The counter blocks are laid
+ * out and encrypted CTR_BATCH_BLOCKS at a time, so that those can
+ * work on several at once.  If libgcrypt won't give us AES, we fall
+ * back to the software one in aes.c. */
 void aes_ctr_crypt(unsigned char *out, const unsigned char *in, size_t len,
 	unsigned char key[16], unsigned char ctrtop[8])
 {
-    unsigned char ctr[16], encctr[16];
+    unsigned char ctr[16];
+    unsigned char ctrs[16 * CTR_BATCH_BLOCKS], encctr[16 * CTR_BATCH_BLOCKS];
+    gcry_cipher_hd_t aes = NULL;
     aes_context aesc;
 
-    aes_set_key(&aesc, key, 128);
+    if (gcry_cipher_open(&aes, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_ECB,
+		0) || gcry_cipher_setkey(aes, key, 16)) {
+	gcry_cipher_close(aes);
+	aes = NULL;
+	aes_set_key(&aesc, key, 128);
+    }
 
     memmove(ctr, ctrtop, 8);
     memset(ctr+8, 0, 8);
 
     while(len > 0) {
 	/* How much to do at a time? */
-	size_t i;
+	size_t i, b;
+	size_t blocks = (len + 15) / 16;
 	size_t amt = len;
-	if (amt > 16) amt = 16;
-	aes_encrypt(&aesc, ctr, encctr);
-	for(i=0;i<amt;++i) {
-	    out[i] = in[i] ^ encctr[i];
+	if (blocks > CTR_BATCH_BLOCKS) blocks = CTR_BATCH_BLOCKS;
+	if (amt > 16 * blocks) amt = 16 * blocks;
+
+	/* Lay out the counter blocks, incrementing the counter after
+	 * each */
+	for (b=0;b<blocks;++b) {
+	    memmove(ctrs + 16*b, ctr, 16);
+	    for (i=16;i>0;--i) {
+		if (++ctr[i-1] != 0) break;
+	    }
 	}
 
-	/* Increment the counter */
-	for (i=16;i>0;--i) {
-	    if (++ctr[i-1] != 0) break;
+	if (aes) {
+	    gcry_cipher_encrypt(aes, encctr, 16*blocks, ctrs, 16*blocks);
+	} else {
+	    for (b=0;b<blocks;++b) {
+		aes_encrypt(&aesc, ctrs + 16*b, encctr + 16*b);
+	    }
+	}
+	for(i=0;i<amt;++i) {
+	    out[i] = in[i] ^ encctr[i];
 	}
 
 	out += amt;
 	in += amt;
 	len -= amt;
     }
+
+    if (aes) {
+	gcry_cipher_close(aes);
+    }
+    memset(encctr, 0, sizeof(encctr));
 }
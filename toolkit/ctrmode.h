@@ -21,8 +21,10 @@
 #define __CTRMODE_H__
 
 /* Encrypt or decrypt data in AES-CTR mode.  (The operations are the
- * same.)  We roll our own here just to double-check that the calls
- * libotr makes to libgcrypt are doing the right thing. */
+ * same.)  We roll our own CTR mode here just to double-check that the
+ * calls libotr makes to libgcrypt are doing the right thing, but use
+ * libgcrypt's AES for the blocks, as sha1hmac uses its SHA1, so that
+ * it can use the CPU's AES instructions. */
 void aes_ctr_crypt(unsigned char *out, const unsigned char *in, size_t len,
 	unsigned char key[16], unsigned char ctrtop[8]);
 
@@ -20,6 +20,7 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* toolkit headers */
 #include "parse.h"
@@ -28,17 +29,79 @@
 static void usage(const char *progname)
 {
     fprintf(stderr, "Usage: %s aeskey\n"
-"Calculate and display the MAC key derived from a given AES key.\n",
-	progname);
+"       %s -b [file]\n"
+"Calculate and display the MAC key derived from a given AES key.\n"
+"With -b, read one AES key per line from the file (or stdin), and for\n"
+"each print one line with the AES key and its MAC key.\n",
+	progname, progname);
     exit(1);
 }
 
+/* Read AES keys from stream, one per line, and print each with the MAC
+ * key derived from it.  Return the number of invalid lines. */
+static unsigned long batch_mode(FILE *stream)
+{
+    unsigned long lineno = 0, invalid = 0;
+    char *line = NULL;
+    size_t linesize = 0;
+
+    while (getline(&line, &linesize, stream) != -1) {
+	const char *sep = " \t\r\n";
+	unsigned char *argbuf;
+	size_t argbuflen;
+	unsigned char mackey[20];
+	char *hex;
+
+	++lineno;
+	hex = strtok(line, sep);
+	if (!hex) continue;
+
+	argv_to_buf(&argbuf, &argbuflen, hex);
+	if (!argbuf || argbuflen != 16 || strtok(NULL, sep)) {
+	    fprintf(stderr, "Line %lu: invalid AES key.\n", lineno);
+	    puts("invalid");
+	    free(argbuf);
+	    ++invalid;
+	    continue;
+	}
+
+	sesskeys_make_mac(mackey, argbuf);
+	dump_hex(stdout, argbuf, 16);
+	putchar(' ');
+	dump_hex(stdout, mackey, 20);
+	putchar('\n');
+	free(argbuf);
+    }
+
+    free(line);
+    return invalid;
+}
+
 int main(int argc, char **argv)
 {
     unsigned char *argbuf;
     size_t argbuflen;
     unsigned char mackey[20];
 
+    if (argc >= 2 && !strcmp(argv[1], "-b")) {
+	FILE *stream = stdin;
+	unsigned long invalid;
+
+	if (argc > 3) usage(argv[0]);
+	if (argc == 3) {
+	    stream = fopen(argv[2], "r");
+	    if (!stream) {
+		perror(argv[2]);
+		exit(1);
+	    }
+	}
+	gcry_check_version(NULL);
+	invalid = batch_mode(stream);
+	if (stream != stdin) fclose(stream);
+	fflush(stdout);
+	return invalid ? 1 : 0;
+    }
+
     if (argc != 2) {
 	usage(argv[0]);
     }
@@ -21,15 +21,19 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 /* libotr headers */
 #include "proto.h"
+#include "b64.h"
 
 /* toolkit headers */
 #include "readotr.h"
 #include "parse.h"
+#include "parallel.h"
 
-static void parse(const char *msg)
+static void parse(FILE *out, const char *msg)
 {
     OtrlMessageType mtype = otrl_proto_message_type(msg);
     CommitMsg cmsg;
@@ -41,184 +45,465 @@ static void parse(const char *msg)
 
     switch(mtype) {
 	case OTRL_MSGTYPE_QUERY:
-	    printf("OTR Query:\n\t%s\n\n", msg);
+	    fprintf(out, "OTR Query:\n\t%s\n\n", msg);
 	    break;
 	case OTRL_MSGTYPE_DH_COMMIT:
 	    cmsg = parse_commit(msg);
 	    if (!cmsg) {
-		printf("Invalid D-H Commit Message\n\n");
+		fprintf(out, "Invalid D-H Commit Message\n\n");
 		break;
 	    }
 
-	    printf("D-H Commit Message:\n");
+	    fprintf(out, "D-H Commit Message:\n");
 
-	    dump_data(stdout, "\tVersion", &(cmsg->version), 1);
+	    dump_data(out, "\tVersion", &(cmsg->version), 1);
 	    if (cmsg->version == 3) {
-		dump_int(stdout, "\tSender instance", cmsg->sender_instance);
-		dump_int(stdout, "\tReceiver instance",
+		dump_int(out, "\tSender instance", cmsg->sender_instance);
+		dump_int(out, "\tReceiver instance",
 			cmsg->receiver_instance);
 	    }
-	    dump_data(stdout, "\tEncrypted Key", cmsg->enckey,
+	    dump_data(out, "\tEncrypted Key", cmsg->enckey,
 		    cmsg->enckeylen);
-	    dump_data(stdout, "\tHashed Key", cmsg->hashkey,
+	    dump_data(out, "\tHashed Key", cmsg->hashkey,
 		    cmsg->hashkeylen);
-	    printf("\n");
+	    fprintf(out, "\n");
 	    free_commit(cmsg);
 	    break;
 	case OTRL_MSGTYPE_DH_KEY:
 	    kmsg = parse_key(msg);
 	    if (!kmsg) {
-		printf("Invalid D-H Key Message\n\n");
+		fprintf(out, "Invalid D-H Key Message\n\n");
 		break;
 	    }
-	    printf("D-H Key Message:\n");
-	    dump_data(stdout, "\tVersion", &(kmsg->version), 1);
+	    fprintf(out, "D-H Key Message:\n");
+	    dump_data(out, "\tVersion", &(kmsg->version), 1);
 	    if (kmsg->version == 3) {
-		dump_int(stdout, "\tSender instance", kmsg->sender_instance);
-		dump_int(stdout, "\tReceiver instance",
+		dump_int(out, "\tSender instance", kmsg->sender_instance);
+		dump_int(out, "\tReceiver instance",
 			kmsg->receiver_instance);
 	    }
-	    dump_mpi(stdout, "\tD-H Key", kmsg->y);
-	    printf("\n");
+	    dump_mpi(out, "\tD-H Key", kmsg->y);
+	    fprintf(out, "\n");
 	    free_key(kmsg);
 	    break;
 	case OTRL_MSGTYPE_REVEALSIG:
 	    rmsg = parse_revealsig(msg);
 	    if (!rmsg) {
-		printf("Invalid Reveal Signature Message\n\n");
+		fprintf(out, "Invalid Reveal Signature Message\n\n");
 		break;
 	    }
-	    printf("Reveal Signature Message:\n");
-	    dump_data(stdout, "\tVersion", &(rmsg->version), 1);
+	    fprintf(out, "Reveal Signature Message:\n");
+	    dump_data(out, "\tVersion", &(rmsg->version), 1);
 	    if (rmsg->version == 3) {
-		dump_int(stdout, "\tSender instance", rmsg->sender_instance);
-		dump_int(stdout, "\tReceiver instance",
+		dump_int(out, "\tSender instance", rmsg->sender_instance);
+		dump_int(out, "\tReceiver instance",
 			rmsg->receiver_instance);
 	    }
-	    dump_data(stdout, "\tKey", rmsg->key, rmsg->keylen);
-	    dump_data(stdout, "\tEncrypted Signature",
+	    dump_data(out, "\tKey", rmsg->key, rmsg->keylen);
+	    dump_data(out, "\tEncrypted Signature",
 		    rmsg->encsig, rmsg->encsiglen);
-	    dump_data(stdout, "\tMAC", rmsg->mac, 20);
-	    printf("\n");
+	    dump_data(out, "\tMAC", rmsg->mac, 20);
+	    fprintf(out, "\n");
 	    free_revealsig(rmsg);
 	    break;
 	case OTRL_MSGTYPE_SIGNATURE:
 	    smsg = parse_signature(msg);
 	    if (!smsg) {
-		printf("Invalid Signature Message\n\n");
+		fprintf(out, "Invalid Signature Message\n\n");
 		break;
 	    }
-	    printf("Signature Message:\n");
-	    dump_data(stdout, "\tVersion", &(smsg->version), 1);
+	    fprintf(out, "Signature Message:\n");
+	    dump_data(out, "\tVersion", &(smsg->version), 1);
 	    if (smsg->version == 3) {
-		dump_int(stdout, "\tSender instance", smsg->sender_instance);
-		dump_int(stdout, "\tReceiver instance",
+		dump_int(out, "\tSender instance", smsg->sender_instance);
+		dump_int(out, "\tReceiver instance",
 			smsg->receiver_instance);
 	    }
-	    dump_data(stdout, "\tEncrypted Signature",
+	    dump_data(out, "\tEncrypted Signature",
 		    smsg->encsig, smsg->encsiglen);
-	    dump_data(stdout, "\tMAC", smsg->mac, 20);
-	    printf("\n");
+	    dump_data(out, "\tMAC", smsg->mac, 20);
+	    fprintf(out, "\n");
 	    free_signature(smsg);
 	    break;
 	case OTRL_MSGTYPE_V1_KEYEXCH:
 	    keyexch = parse_keyexch(msg);
 	    if (!keyexch) {
-		printf("Invalid Key Exchange Message\n\n");
+		fprintf(out, "Invalid Key Exchange Message\n\n");
 		break;
 	    }
-	    printf("Key Exchange Message:\n");
-	    dump_int(stdout, "\tReply", keyexch->reply);
-	    dump_mpi(stdout, "\tDSA p", keyexch->p);
-	    dump_mpi(stdout, "\tDSA q", keyexch->q);
-	    dump_mpi(stdout, "\tDSA g", keyexch->g);
-	    dump_mpi(stdout, "\tDSA e", keyexch->e);
-	    dump_int(stdout, "\tKeyID", keyexch->keyid);
-	    dump_mpi(stdout, "\tDH y", keyexch->y);
-	    dump_mpi(stdout, "\tSIG r", keyexch->r);
-	    dump_mpi(stdout, "\tSIG s", keyexch->s);
-	    printf("\n");
+	    fprintf(out, "Key Exchange Message:\n");
+	    dump_int(out, "\tReply", keyexch->reply);
+	    dump_mpi(out, "\tDSA p", keyexch->p);
+	    dump_mpi(out, "\tDSA q", keyexch->q);
+	    dump_mpi(out, "\tDSA g", keyexch->g);
+	    dump_mpi(out, "\tDSA e", keyexch->e);
+	    dump_int(out, "\tKeyID", keyexch->keyid);
+	    dump_mpi(out, "\tDH y", keyexch->y);
+	    dump_mpi(out, "\tSIG r", keyexch->r);
+	    dump_mpi(out, "\tSIG s", keyexch->s);
+	    fprintf(out, "\n");
 	    free_keyexch(keyexch);
 	    break;
 	case OTRL_MSGTYPE_DATA:
 	    datamsg = parse_datamsg(msg);
 	    if (!datamsg) {
-		printf("Invalid Data Message\n\n");
+		fprintf(out, "Invalid Data Message\n\n");
 		break;
 	    }
-	    printf("Data Message:\n");
+	    fprintf(out, "Data Message:\n");
 
-	    dump_data(stdout, "\tVersion", &(datamsg->version), 1);
+	    dump_data(out, "\tVersion", &(datamsg->version), 1);
 	    if (datamsg->flags >= 0) {
-		dump_int(stdout, "\tFlags", datamsg->flags);
+		dump_int(out, "\tFlags", datamsg->flags);
 	    }
 
 	    if (datamsg->version == 3) {
-		dump_int(stdout, "\tSender instance", datamsg->sender_instance);
-		dump_int(stdout, "\tReceiver instance",
+		dump_int(out, "\tSender instance", datamsg->sender_instance);
+		dump_int(out, "\tReceiver instance",
 			datamsg->receiver_instance);
 	    }
 
-	    dump_int(stdout, "\tSender keyid", datamsg->sender_keyid);
-	    dump_int(stdout, "\tRcpt keyid", datamsg->rcpt_keyid);
-	    dump_mpi(stdout, "\tDH y", datamsg->y);
-	    dump_data(stdout, "\tCounter", datamsg->ctr, 8);
-	    dump_data(stdout, "\tEncrypted message", datamsg->encmsg,
+	    dump_int(out, "\tSender keyid", datamsg->sender_keyid);
+	    dump_int(out, "\tRcpt keyid", datamsg->rcpt_keyid);
+	    dump_mpi(out, "\tDH y", datamsg->y);
+	    dump_data(out, "\tCounter", datamsg->ctr, 8);
+	    dump_data(out, "\tEncrypted message", datamsg->encmsg,
 		    datamsg->encmsglen);
-	    dump_data(stdout, "\tMAC", datamsg->mac, 20);
+	    dump_data(out, "\tMAC", datamsg->mac, 20);
 	    if (datamsg->mackeyslen > 0) {
 		size_t len = datamsg->mackeyslen;
 		unsigned char *mks = datamsg->mackeys;
 		unsigned int i = 0;
-		printf("\tRevealed MAC keys:\n");
+		fprintf(out, "\tRevealed MAC keys:\n");
 
 		while(len > 19) {
 		    char title[20];
 		    sprintf(title, "\t\tKey %u", ++i);
-		    dump_data(stdout, title, mks, 20);
+		    dump_data(out, title, mks, 20);
 		    mks += 20; len -= 20;
 		}
 	    }
 
-	    printf("\n");
+	    fprintf(out, "\n");
 	    free_datamsg(datamsg);
 	    break;
 	case OTRL_MSGTYPE_ERROR:
-	    printf("OTR Error:\n\t%s\n\n", msg);
+	    fprintf(out, "OTR Error:\n\t%s\n\n", msg);
 	    break;
 	case OTRL_MSGTYPE_TAGGEDPLAINTEXT:
-	    printf("Tagged plaintext message:\n\t%s\n\n", msg);
+	    fprintf(out, "Tagged plaintext message:\n\t%s\n\n", msg);
 	    break;
 	case OTRL_MSGTYPE_NOTOTR:
-	    printf("Not an OTR message:\n\t%s\n\n", msg);
+	    fprintf(out, "Not an OTR message:\n\t%s\n\n", msg);
 	    break;
 	case OTRL_MSGTYPE_UNKNOWN:
-	    printf("Unrecognized OTR message:\n\t%s\n\n", msg);
+	    fprintf(out, "Unrecognized OTR message:\n\t%s\n\n", msg);
 	    break;
     }
-    fflush(stdout);
+}
+
+/* Write the contents of msg to out as a single line holding a JSON
+ * object, for tools that want to process the results */
+static void parse_json(FILE *out, const char *msg)
+{
+    OtrlMessageType mtype = otrl_proto_message_type(msg);
+    CommitMsg cmsg;
+    KeyMsg kmsg;
+    RevealSigMsg rmsg;
+    SignatureMsg smsg;
+    KeyExchMsg keyexch;
+    DataMsg datamsg;
+
+    switch(mtype) {
+	case OTRL_MSGTYPE_QUERY:
+	    fprintf(out, "{\"type\":\"query\"");
+	    json_string(out, "text", msg);
+	    break;
+	case OTRL_MSGTYPE_DH_COMMIT:
+	    fprintf(out, "{\"type\":\"dh_commit\"");
+	    cmsg = parse_commit(msg);
+	    if (!cmsg) {
+		fprintf(out, ",\"valid\":false");
+		break;
+	    }
+	    json_int(out, "version", cmsg->version);
+	    if (cmsg->version == 3) {
+		json_int(out, "sender_instance", cmsg->sender_instance);
+		json_int(out, "receiver_instance", cmsg->receiver_instance);
+	    }
+	    json_data(out, "encrypted_key", cmsg->enckey, cmsg->enckeylen);
+	    json_data(out, "hashed_key", cmsg->hashkey, cmsg->hashkeylen);
+	    free_commit(cmsg);
+	    break;
+	case OTRL_MSGTYPE_DH_KEY:
+	    fprintf(out, "{\"type\":\"dh_key\"");
+	    kmsg = parse_key(msg);
+	    if (!kmsg) {
+		fprintf(out, ",\"valid\":false");
+		break;
+	    }
+	    json_int(out, "version", kmsg->version);
+	    if (kmsg->version == 3) {
+		json_int(out, "sender_instance", kmsg->sender_instance);
+		json_int(out, "receiver_instance", kmsg->receiver_instance);
+	    }
+	    json_mpi(out, "dh_key", kmsg->y);
+	    free_key(kmsg);
+	    break;
+	case OTRL_MSGTYPE_REVEALSIG:
+	    fprintf(out, "{\"type\":\"reveal_signature\"");
+	    rmsg = parse_revealsig(msg);
+	    if (!rmsg) {
+		fprintf(out, ",\"valid\":false");
+		break;
+	    }
+	    json_int(out, "version", rmsg->version);
+	    if (rmsg->version == 3) {
+		json_int(out, "sender_instance", rmsg->sender_instance);
+		json_int(out, "receiver_instance", rmsg->receiver_instance);
+	    }
+	    json_data(out, "key", rmsg->key, rmsg->keylen);
+	    json_data(out, "encrypted_signature", rmsg->encsig,
+		    rmsg->encsiglen);
+	    json_data(out, "mac", rmsg->mac, 20);
+	    free_revealsig(rmsg);
+	    break;
+	case OTRL_MSGTYPE_SIGNATURE:
+	    fprintf(out, "{\"type\":\"signature\"");
+	    smsg = parse_signature(msg);
+	    if (!smsg) {
+		fprintf(out, ",\"valid\":false");
+		break;
+	    }
+	    json_int(out, "version", smsg->version);
+	    if (smsg->version == 3) {
+		json_int(out, "sender_instance", smsg->sender_instance);
+		json_int(out, "receiver_instance", smsg->receiver_instance);
+	    }
+	    json_data(out, "encrypted_signature", smsg->encsig,
+		    smsg->encsiglen);
+	    json_data(out, "mac", smsg->mac, 20);
+	    free_signature(smsg);
+	    break;
+	case OTRL_MSGTYPE_V1_KEYEXCH:
+	    fprintf(out, "{\"type\":\"key_exchange\"");
+	    keyexch = parse_keyexch(msg);
+	    if (!keyexch) {
+		fprintf(out, ",\"valid\":false");
+		break;
+	    }
+	    json_int(out, "reply", keyexch->reply);
+	    json_mpi(out, "dsa_p", keyexch->p);
+	    json_mpi(out, "dsa_q", keyexch->q);
+	    json_mpi(out, "dsa_g", keyexch->g);
+	    json_mpi(out, "dsa_e", keyexch->e);
+	    json_int(out, "keyid", keyexch->keyid);
+	    json_mpi(out, "dh_y", keyexch->y);
+	    json_mpi(out, "sig_r", keyexch->r);
+	    json_mpi(out, "sig_s", keyexch->s);
+	    free_keyexch(keyexch);
+	    break;
+	case OTRL_MSGTYPE_DATA:
+	    fprintf(out, "{\"type\":\"data\"");
+	    datamsg = parse_datamsg(msg);
+	    if (!datamsg) {
+		fprintf(out, ",\"valid\":false");
+		break;
+	    }
+	    json_int(out, "version", datamsg->version);
+	    if (datamsg->flags >= 0) {
+		json_int(out, "flags", datamsg->flags);
+	    }
+	    if (datamsg->version == 3) {
+		json_int(out, "sender_instance", datamsg->sender_instance);
+		json_int(out, "receiver_instance",
+			datamsg->receiver_instance);
+	    }
+	    json_int(out, "sender_keyid", datamsg->sender_keyid);
+	    json_int(out, "rcpt_keyid", datamsg->rcpt_keyid);
+	    json_mpi(out, "dh_y", datamsg->y);
+	    json_data(out, "counter", datamsg->ctr, 8);
+	    json_data(out, "encrypted_message", datamsg->encmsg,
+		    datamsg->encmsglen);
+	    json_data(out, "mac", datamsg->mac, 20);
+	    json_data(out, "revealed_mac_keys", datamsg->mackeys,
+		    datamsg->mackeyslen);
+	    free_datamsg(datamsg);
+	    break;
+	case OTRL_MSGTYPE_ERROR:
+	    fprintf(out, "{\"type\":\"error\"");
+	    json_string(out, "text", msg);
+	    break;
+	case OTRL_MSGTYPE_TAGGEDPLAINTEXT:
+	    fprintf(out, "{\"type\":\"tagged_plaintext\"");
+	    json_string(out, "text", msg);
+	    break;
+	case OTRL_MSGTYPE_NOTOTR:
+	    fprintf(out, "{\"type\":\"not_otr\"");
+	    json_string(out, "text", msg);
+	    break;
+	case OTRL_MSGTYPE_UNKNOWN:
+	    fprintf(out, "{\"type\":\"unknown\"");
+	    json_string(out, "text", msg);
+	    break;
+    }
+    fprintf(out, "}\n");
+}
+
+/* How many messages are handed to the worker threads at a time */
+#define PARSE_BATCH 4096
+
+typedef void (*ParseFunc)(FILE *out, const char *msg);
+
+/* A message waiting to be parsed by a worker, and what it printed */
+typedef struct {
+    char *msg;
+    ParseFunc func;
+    char *out;
+    size_t outlen;
+} ParseJob;
+
+typedef struct {
+    ParseJob *jobs;
+    size_t njobs;
+    ParseFunc func;
+} ParseBatch;
+
+/* Parse the message in a job into memory */
+static void parse_job(void *item)
+{
+    ParseJob *job = item;
+    FILE *out = open_memstream(&job->out, &job->outlen);
+
+    if (!out) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    job->func(out, job->msg);
+    fclose(out);
+}
+
+/* Parse every message in the batch, using nthreads threads, and print
+ * the results to stdout in the original order */
+static void parse_batch(ParseBatch *batch, unsigned int nthreads)
+{
+    size_t i;
+
+    if (nthreads > 1) {
+	parallel_for(batch->jobs, batch->njobs, sizeof(ParseJob), parse_job,
+		nthreads);
+	for (i = 0; i < batch->njobs; ++i) {
+	    fwrite(batch->jobs[i].out, 1, batch->jobs[i].outlen, stdout);
+	    free(batch->jobs[i].out);
+	    free(batch->jobs[i].msg);
+	}
+    } else {
+	for (i = 0; i < batch->njobs; ++i) {
+	    batch->func(stdout, batch->jobs[i].msg);
+	    free(batch->jobs[i].msg);
+	}
+    }
+    batch->njobs = 0;
+}
+
+/* Add a copy of the len bytes at msg to the batch, parsing the batch if
+ * it is full */
+static void parse_add(ParseBatch *batch, const char *msg, size_t len,
+	unsigned int nthreads)
+{
+    char *copy = malloc(len + 1);
+
+    if (!copy) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    memmove(copy, msg, len);
+    copy[len] = '\0';
+    batch->jobs[batch->njobs].msg = copy;
+    batch->jobs[batch->njobs++].func = batch->func;
+    if (batch->njobs == PARSE_BATCH) {
+	parse_batch(batch, nthreads);
+    }
 }
 
 static void usage(const char *progname)
 {
-    fprintf(stderr, "Usage: %s\n"
-"Read Off-the-Record (OTR) Key Exchange and/or Data messages from stdin\n"
-"and display their contents in a more readable format.\n", progname);
+    fprintf(stderr, "Usage: %s [-j] [-t threads] [file ...]\n"
+"Read Off-the-Record (OTR) Key Exchange and/or Data messages from the\n"
+"given files, or stdin, and display their contents in a more readable\n"
+"format.\n"
+"  -j          Print each message as one line of JSON\n"
+"  -t threads  Parse the messages in the given files with this many\n"
+"              threads\n", progname);
     exit(1);
 }
 
 int main(int argc, char **argv)
 {
     char *otrmsg = NULL;
+    ParseFunc func = parse;
+    unsigned int nthreads = 1;
+    ParseBatch batch;
+    int c, i, ret = 0;
 
-    if (argc != 1) {
-	usage(argv[0]);
+    while ((c = getopt(argc, argv, "jt:")) != -1) {
+	switch(c) {
+	    case 'j':
+		func = parse_json;
+		break;
+	    case 't':
+		nthreads = strtoul(optarg, NULL, 10);
+		if (nthreads < 1 || nthreads > PARALLEL_MAX_THREADS) {
+		    usage(argv[0]);
+		}
+		break;
+	    default:
+		usage(argv[0]);
+	}
     }
 
-    while ((otrmsg = readotr(stdin)) != NULL) {
-	parse(otrmsg);
-	free(otrmsg);
+    gcry_check_version(NULL);
+
+    if (optind == argc) {
+	/* Read from stdin as the messages arrive, so don't hold them
+	 * back for the worker threads */
+	while ((otrmsg = readotr(stdin)) != NULL) {
+	    func(stdout, otrmsg);
+	    fflush(stdout);
+	    free(otrmsg);
+	}
+	return 0;
+    }
+
+    batch.jobs = malloc(PARSE_BATCH * sizeof(ParseJob));
+    if (!batch.jobs) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    batch.njobs = 0;
+    batch.func = func;
+    /* Pick the base64 decoder before the threads race to */
+    otrl_base64_simd_level();
+
+    for (i = optind; i < argc; ++i) {
+	OtrMappedFile map;
+	size_t off = 0, msglen;
+	const char *msg;
+
+	if (readotr_map(argv[i], &map)) {
+	    perror(argv[i]);
+	    ret = 1;
+	    continue;
+	}
+	while ((msg = readotr_next(map.data, map.len, &off, &msglen))
+		!= NULL) {
+	    parse_add(&batch, msg, msglen, nthreads);
+	}
+	/* The batch holds copies, so the file can go */
+	readotr_unmap(&map);
     }
+    parse_batch(&batch, nthreads);
 
-    return 0;
+    free(batch.jobs);
+    return ret;
 }
@@ -20,45 +20,244 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 /* toolkit headers */
 #include "parse.h"
 #include "sesskeys.h"
+#include "parallel.h"
+
+/* How many pairs are handed to the worker threads at a time */
+#define SESSKEYS_BATCH 1024
+
+/* A key pair read in batch mode, and the keys derived from it */
+typedef struct {
+    unsigned long lineno;
+    gcry_mpi_t our_x, their_y;  /* NULL if the line was invalid */
+    gcry_mpi_t our_y;
+    unsigned char sessionid[20], sendenc[16], rcvenc[16];
+    unsigned char sendmac[20], rcvmac[20];
+    int is_high;
+} SesskeysJob;
 
 static void usage(const char *progname)
 {
     fprintf(stderr, "Usage: %s our_privkey their_pubkey\n"
+"       %s -b [-t threads] [file]\n"
 "Calculate and display our public key, the session id, two AES keys,\n"
-"and two MAC keys generated by the given DH private key and public key.\n",
-	progname);
+"and two MAC keys generated by the given DH private key and public key.\n"
+"With -b, read one \"our_privkey their_pubkey\" pair per line from the\n"
+"file (or stdin), and for each print one line with \"high\" or \"low\",\n"
+"our public key, the session id, and the sending AES and MAC keys and\n"
+"receiving AES and MAC keys, using the given number of threads.\n",
+	progname, progname);
     exit(1);
 }
 
-int main(int argc, char **argv)
+/* Read a private key into *our_xp and a public key into *their_yp from
+ * the given hex strings, returning 0 on success.  Private keys are only
+ * 320 bits long, so check for that to make sure they didn't get them
+ * the wrong way around. */
+static int read_pair(gcry_mpi_t *our_xp, gcry_mpi_t *their_yp,
+	char *privhex, char *pubhex)
 {
     unsigned char *argbuf;
     size_t argbuflen;
+
+    *our_xp = NULL;
+    *their_yp = NULL;
+
+    argv_to_buf(&argbuf, &argbuflen, privhex);
+    if (!argbuf || argbuflen > 40) {
+	free(argbuf);
+	return -1;
+    }
+    gcry_mpi_scan(our_xp, GCRYMPI_FMT_USG, argbuf, argbuflen, NULL);
+    free(argbuf);
+    argv_to_buf(&argbuf, &argbuflen, pubhex);
+    if (!argbuf) {
+	gcry_mpi_release(*our_xp);
+	*our_xp = NULL;
+	return -1;
+    }
+    gcry_mpi_scan(their_yp, GCRYMPI_FMT_USG, argbuf, argbuflen, NULL);
+    free(argbuf);
+    return 0;
+}
+
+/* Derive the keys for one pair */
+static void sesskeys_job(void *item)
+{
+    SesskeysJob *job = item;
+
+    if (!job->our_x) return;
+    sesskeys_gen(job->sessionid, job->sendenc, job->rcvenc, &job->is_high,
+	    &job->our_y, job->our_x, job->their_y);
+    sesskeys_make_mac(job->sendmac, job->sendenc);
+    sesskeys_make_mac(job->rcvmac, job->rcvenc);
+}
+
+/* Derive the keys for every pair in the batch and print them in order.
+ * Return the number of invalid lines. */
+static unsigned long sesskeys_batch(SesskeysJob *jobs, size_t njobs,
+	unsigned int nthreads)
+{
+    unsigned long invalid = 0;
+    size_t i;
+
+    parallel_for(jobs, njobs, sizeof(SesskeysJob), sesskeys_job, nthreads);
+
+    for (i = 0; i < njobs; ++i) {
+	SesskeysJob *job = &jobs[i];
+	unsigned char *pubbuf;
+	size_t publen;
+
+	if (!job->our_x) {
+	    fprintf(stderr, "Line %lu: invalid key pair.\n", job->lineno);
+	    puts("invalid");
+	    ++invalid;
+	    continue;
+	}
+
+	gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &publen, job->our_y);
+	pubbuf = malloc(publen);
+	if (!pubbuf) {
+	    fprintf(stderr, "Out of memory!\n");
+	    exit(1);
+	}
+	gcry_mpi_print(GCRYMPI_FMT_USG, pubbuf, publen, NULL, job->our_y);
+
+	fputs(job->is_high ? "high " : "low ", stdout);
+	dump_hex(stdout, pubbuf, publen);
+	putchar(' ');
+	dump_hex(stdout, job->sessionid, 20);
+	putchar(' ');
+	dump_hex(stdout, job->sendenc, 16);
+	putchar(' ');
+	dump_hex(stdout, job->sendmac, 20);
+	putchar(' ');
+	dump_hex(stdout, job->rcvenc, 16);
+	putchar(' ');
+	dump_hex(stdout, job->rcvmac, 20);
+	putchar('\n');
+
+	free(pubbuf);
+	gcry_mpi_release(job->our_x);
+	gcry_mpi_release(job->their_y);
+	gcry_mpi_release(job->our_y);
+    }
+    return invalid;
+}
+
+/* Read key pairs from stream, one per line, and print the keys derived
+ * from each.  Return the number of invalid lines. */
+static unsigned long batch_mode(FILE *stream, unsigned int nthreads)
+{
+    SesskeysJob *jobs = malloc(SESSKEYS_BATCH * sizeof(SesskeysJob));
+    size_t njobs = 0;
+    unsigned long lineno = 0, invalid = 0;
+    char *line = NULL;
+    size_t linesize = 0;
+
+    if (!jobs) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+
+    /* Set the group up before the threads need it */
+    sesskeys_init();
+
+    while (getline(&line, &linesize, stream) != -1) {
+	const char *sep = " \t\r\n";
+	char *privhex, *pubhex;
+	SesskeysJob *job;
+
+	++lineno;
+	privhex = strtok(line, sep);
+	if (!privhex) continue;
+	pubhex = strtok(NULL, sep);
+
+	job = &jobs[njobs++];
+	job->lineno = lineno;
+	if (!pubhex || strtok(NULL, sep) ||
+		read_pair(&job->our_x, &job->their_y, privhex, pubhex)) {
+	    job->our_x = NULL;
+	    job->their_y = NULL;
+	}
+
+	if (njobs == SESSKEYS_BATCH) {
+	    invalid += sesskeys_batch(jobs, njobs, nthreads);
+	    njobs = 0;
+	}
+    }
+    invalid += sesskeys_batch(jobs, njobs, nthreads);
+
+    free(line);
+    free(jobs);
+    return invalid;
+}
+
+int main(int argc, char **argv)
+{
     gcry_mpi_t our_x, our_y, their_y;
     unsigned char *pubbuf;
     size_t publen;
     unsigned char sessionid[20], sendenc[16], rcvenc[16];
     unsigned char sendmac[20], rcvmac[20];
     int is_high;
+    int batch = 0, c;
+    unsigned int nthreads = 1;
+
+    while ((c = getopt(argc, argv, "bt:")) != -1) {
+	switch(c) {
+	    case 'b':
+		batch = 1;
+		break;
+	    case 't':
+		nthreads = strtoul(optarg, NULL, 10);
+		if (nthreads < 1 || nthreads > PARALLEL_MAX_THREADS) {
+		    usage(argv[0]);
+		}
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+
+    gcry_check_version(NULL);
+
+    if (batch) {
+	FILE *stream = stdin;
+	unsigned long invalid;
 
-    if (argc != 3) {
+	/* Captured keys don't need locking in memory, and libgcrypt's
+	 * fallback when it can't lock any isn't safe to use from more
+	 * than one thread, so do without secure memory */
+	gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+	if (argc - optind > 1) usage(argv[0]);
+	if (optind < argc) {
+	    stream = fopen(argv[optind], "r");
+	    if (!stream) {
+		perror(argv[optind]);
+		exit(1);
+	    }
+	}
+	invalid = batch_mode(stream, nthreads);
+	if (stream != stdin) fclose(stream);
+	fflush(stdout);
+	return invalid ? 1 : 0;
+    }
+
+    if (argc - optind != 2) {
 	usage(argv[0]);
     }
 
-    argv_to_buf(&argbuf, &argbuflen, argv[1]);
-    /* Private keys are only 320 bits long, so check for that to make
-     * sure they didn't get the args the wrong way around */
-    if (!argbuf || argbuflen > 40) usage(argv[0]);
-    gcry_mpi_scan(&our_x, GCRYMPI_FMT_USG, argbuf, argbuflen, NULL);
-    free(argbuf);
-    argv_to_buf(&argbuf, &argbuflen, argv[2]);
-    if (!argbuf) usage(argv[0]);
-    gcry_mpi_scan(&their_y, GCRYMPI_FMT_USG, argbuf, argbuflen, NULL);
-    free(argbuf);
+    if (read_pair(&our_x, &their_y, argv[optind], argv[optind+1])) {
+	usage(argv[0]);
+    }
 
     sesskeys_gen(sessionid, sendenc, rcvenc, &is_high, &our_y, our_x, their_y);
     sesskeys_make_mac(sendmac, sendenc);
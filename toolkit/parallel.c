@@ -0,0 +1,111 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2012  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* system headers */
+#include <stdlib.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* toolkit headers */
+#include "parallel.h"
+
+#ifdef HAVE_PTHREAD_H
+/* How many items a thread takes at a time */
+#define PARALLEL_CHUNK 64
+
+typedef struct {
+    char *items;
+    size_t n;
+    size_t itemsize;
+    void (*func)(void *item);
+    size_t next;		/* The next item no thread has taken */
+    pthread_mutex_t mutex;
+} ParallelWork;
+
+/* Take chunks of items and call func on them until there are none
+ * left */
+static void *parallel_worker(void *arg)
+{
+    ParallelWork *work = arg;
+
+    while(1) {
+	size_t i, end;
+	pthread_mutex_lock(&work->mutex);
+	i = work->next;
+	end = work->n - i < PARALLEL_CHUNK ? work->n : i + PARALLEL_CHUNK;
+	work->next = end;
+	pthread_mutex_unlock(&work->mutex);
+	if (i == end) break;
+
+	for (; i < end; ++i) {
+	    work->func(work->items + i * work->itemsize);
+	}
+    }
+    return NULL;
+}
+#endif
+
+/* Call func on each of the n items of itemsize bytes starting at items,
+ * using up to nthreads threads, this one included.  Without thread support, or if there
+ * is only one thread or item, the calls are all made from this thread.
+ * Returns when every call has finished. */
+void parallel_for(void *items, size_t n, size_t itemsize,
+	void (*func)(void *item), unsigned int nthreads)
+{
+    size_t i;
+
+#ifdef HAVE_PTHREAD_H
+    if (nthreads > 1 && n > 1) {
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	ParallelWork work;
+	unsigned int t, started = 0;
+
+	work.items = items;
+	work.n = n;
+	work.itemsize = itemsize;
+	work.func = func;
+	work.next = 0;
+	pthread_mutex_init(&work.mutex, NULL);
+
+	if (nthreads > PARALLEL_MAX_THREADS) nthreads = PARALLEL_MAX_THREADS;
+	for (t = 0; t + 1 < nthreads; ++t) {
+	    if (pthread_create(&threads[t], NULL, parallel_worker, &work)) {
+		break;
+	    }
+	    ++started;
+	}
+	/* Whatever the threads haven't done, do ourselves */
+	parallel_worker(&work);
+	for (t = 0; t < started; ++t) {
+	    pthread_join(threads[t], NULL);
+	}
+	pthread_mutex_destroy(&work.mutex);
+	return;
+    }
+#endif
+
+    for (i = 0; i < n; ++i) {
+	func((char *)items + i * itemsize);
+    }
+}
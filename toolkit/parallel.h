@@ -0,0 +1,33 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2012  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+/* The most threads parallel_for will start */
+#define PARALLEL_MAX_THREADS 256
+
+/* Call func on each of the n items of itemsize bytes starting at items,
+ * using up to nthreads threads, this one included.  Without thread support, or if there
+ * is only one thread or item, the calls are all made from this thread.
+ * Returns when every call has finished. */
+void parallel_for(void *items, size_t n, size_t itemsize,
+	void (*func)(void *item), unsigned int nthreads);
+
+#endif
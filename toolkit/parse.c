@@ -48,18 +48,85 @@ void dump_mpi(FILE *stream, const char *title, gcry_mpi_t val)
     free(d);
 }
 
+/* Write data to a FILE * in hex, with no title or newline */
+void dump_hex(FILE *stream, const unsigned char *data, size_t datalen)
+{
+    static const char hex[] = "0123456789abcdef";
+    char chunk[256];
+    size_t i, n = 0;
+
+    for(i=0;i<datalen;++i) {
+	chunk[n++] = hex[data[i] >> 4];
+	chunk[n++] = hex[data[i] & 0x0f];
+	if (n == sizeof(chunk)) {
+	    fwrite(chunk, 1, n, stream);
+	    n = 0;
+	}
+    }
+    fwrite(chunk, 1, n, stream);
+}
+
 /* Dump data to a FILE * */
 void dump_data(FILE *stream, const char *title, const unsigned char *data,
 	size_t datalen)
 {
-    size_t i;
     fprintf(stream, "%s: ", title);
-    for(i=0;i<datalen;++i) {
-	fprintf(stream, "%02x", data[i]);
-    }
+    dump_hex(stream, data, datalen);
     fprintf(stream, "\n");
 }
 
+/* Write an unsigned int to a FILE * as a JSON member, preceded by a
+ * comma */
+void json_int(FILE *stream, const char *name, unsigned int val)
+{
+    fprintf(stream, ",\"%s\":%u", name, val);
+}
+
+/* Write an mpi to a FILE * as a JSON member holding its hex value,
+ * preceded by a comma */
+void json_mpi(FILE *stream, const char *name, gcry_mpi_t val)
+{
+    size_t plen;
+    unsigned char *d;
+
+    gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &plen, val);
+    d = malloc(plen);
+    gcry_mpi_print(GCRYMPI_FMT_USG, d, plen, NULL, val);
+    json_data(stream, name, d, plen);
+    free(d);
+}
+
+/* Write data to a FILE * as a JSON member holding its hex value,
+ * preceded by a comma */
+void json_data(FILE *stream, const char *name, const unsigned char *data,
+	size_t datalen)
+{
+    fprintf(stream, ",\"%s\":\"", name);
+    dump_hex(stream, data, datalen);
+    putc('"', stream);
+}
+
+/* Write a string to a FILE * as a JSON member, preceded by a comma.
+ * Bytes that aren't printable ASCII are escaped as \u00XX, so the
+ * output is valid whatever the encoding of the input. */
+void json_string(FILE *stream, const char *name, const char *str)
+{
+    const unsigned char *p;
+
+    fprintf(stream, ",\"%s\":\"", name);
+    for (p = (const unsigned char *)str; *p; ++p) {
+	if (*p == '"' || *p == '\\') {
+	    putc('\\', stream);
+	    putc(*p, stream);
+	} else if (*p < 0x20 || *p >= 0x7f) {
+	    fprintf(stream, "\\u%04x", *p);
+	} else {
+	    putc(*p, stream);
+	}
+    }
+    putc('"', stream);
+}
+
 /* base64 decode the message, and put the resulting size into *lenp */
 static unsigned char *decode(const char *msg, size_t *lenp)
 {
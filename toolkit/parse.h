@@ -101,10 +101,31 @@ void dump_int(FILE *stream, const char *title, unsigned int val);
 /* Dump an mpi to a FILE * */
 void dump_mpi(FILE *stream, const char *title, gcry_mpi_t val);
 
+/* Write data to a FILE * in hex, with no title or newline */
+void dump_hex(FILE *stream, const unsigned char *data, size_t datalen);
+
 /* Dump data to a FILE * */
 void dump_data(FILE *stream, const char *title, const unsigned char *data,
 	size_t datalen);
 
+/* Write an unsigned int to a FILE * as a JSON member, preceded by a
+ * comma */
+void json_int(FILE *stream, const char *name, unsigned int val);
+
+/* Write an mpi to a FILE * as a JSON member holding its hex value,
+ * preceded by a comma */
+void json_mpi(FILE *stream, const char *name, gcry_mpi_t val);
+
+/* Write data to a FILE * as a JSON member holding its hex value,
+ * preceded by a comma */
+void json_data(FILE *stream, const char *name, const unsigned char *data,
+	size_t datalen);
+
+/* Write a string to a FILE * as a JSON member, preceded by a comma.
+ * Bytes that aren't printable ASCII are escaped as \u00XX, so the
+ * output is valid whatever the encoding of the input. */
+void json_string(FILE *stream, const char *name, const char *str);
+
 /* Parse a Key Exchange Message into a newly-allocated KeyExchMsg structure */
 KeyExchMsg parse_keyexch(const char *msg);
 
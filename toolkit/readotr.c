@@ -17,10 +17,23 @@
  *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* toolkit headers */
+#include "readotr.h"
 
 typedef struct {
     char *data;
@@ -35,25 +48,30 @@ static void buf_new(Buffer *bufp)
     bufp->alloclen = 0;
 }
 
-static void buf_put(Buffer *bufp, const char *str, size_t len)
+/* Make room for at least len more bytes and a trailing NUL, doubling
+ * the allocation so that long messages don't cost a realloc per KB */
+static void buf_reserve(Buffer *bufp, size_t len)
 {
-    while (bufp->len + len + 1 > bufp->alloclen) {
-	char *newdata = realloc(bufp->data, bufp->alloclen + 1024);
-	if (!newdata) {
-	    fprintf(stderr, "Out of memory!\n");
-	    exit(1);
-	}
-	bufp->data = newdata;
-	bufp->alloclen += 1024;
+    size_t newlen = bufp->alloclen ? bufp->alloclen : 1024;
+    char *newdata;
+
+    if (bufp->len + len + 1 <= bufp->alloclen) return;
+    while (bufp->len + len + 1 > newlen) newlen *= 2;
+    newdata = realloc(bufp->data, newlen);
+    if (!newdata) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
     }
-    memmove(bufp->data + bufp->len, str, len);
-    bufp->len += len;
-    bufp->data[bufp->len] = '\0';
+    bufp->data = newdata;
+    bufp->alloclen = newlen;
 }
 
-static void buf_putc(Buffer *bufp, char c)
+static void buf_put(Buffer *bufp, const char *str, size_t len)
 {
-    buf_put(bufp, &c, 1);
+    buf_reserve(bufp, len);
+    memmove(bufp->data + bufp->len, str, len);
+    bufp->len += len;
+    bufp->data[bufp->len] = '\0';
 }
 
 /* Read from the given stream until we see a complete OTR Key Exchange
@@ -69,7 +87,7 @@ char *readotr(FILE *stream)
     Buffer buf;
 
     while(seen < headerlen) {
-	int c = fgetc(stream);
+	int c = getc(stream);
 	if (c == EOF) return NULL;
 	else if (c == header[seen]) seen++;
 	else if (c == header[0]) seen = 1;
@@ -81,11 +99,115 @@ char *readotr(FILE *stream)
 
     /* Look for the trailing '.' */
     while(1) {
-	int c = fgetc(stream);
+	int c = getc(stream);
 	if (c == EOF) break;
-	buf_putc(&buf, c);
+	if (buf.len + 1 >= buf.alloclen) buf_reserve(&buf, 1);
+	buf.data[buf.len++] = c;
 	if (c == '.') break;
     }
+    buf.data[buf.len] = '\0';
 
     return buf.data;
 }
+
+/* Find the next complete OTR Key Exchange or OTR Data message in the
+ * len bytes at data, starting *offp bytes in.  Return a pointer to the
+ * start of the message (which is not NUL-terminated), and put its
+ * length, including the trailing '.' if there is one, into *msglenp.
+ * *offp is moved past the message.  Returns NULL if there are no more
+ * such messages. */
+const char *readotr_next(const char *data, size_t len, size_t *offp,
+	size_t *msglenp)
+{
+    const char header[] = "?OTR:";
+    size_t headerlen = strlen(header);
+    const char *p = data + *offp;
+    const char *end = data + len;
+
+    /* memchr is vectorized in any libc we care about, so let it skip
+     * over the plaintext between the messages */
+    while (p < end && (p = memchr(p, header[0], end - p)) != NULL) {
+	const char *footer;
+
+	if ((size_t)(end - p) < headerlen) break;
+	if (memcmp(p, header, headerlen)) {
+	    ++p;
+	    continue;
+	}
+	footer = memchr(p + headerlen, '.', end - p - headerlen);
+	footer = footer ? footer + 1 : end;
+	*msglenp = footer - p;
+	*offp = footer - data;
+	return p;
+    }
+    *offp = len;
+    return NULL;
+}
+
+/* Map the whole of the named file into memory, filling in *mapp.  If
+ * the file can't be mapped, it is read into a newly-allocated buffer
+ * instead.  Return 0 on success, or -1 (with errno set) on failure.
+ * Release the contents with readotr_unmap. */
+int readotr_map(const char *filename, OtrMappedFile *mapp)
+{
+    struct stat st;
+    char *data;
+    size_t got = 0;
+    int fd = open(filename, O_RDONLY);
+
+    mapp->data = NULL;
+    mapp->len = 0;
+    mapp->mapped = 0;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+    if (st.st_size == 0) {
+	close(fd);
+	return 0;
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+#endif
+	close(fd);
+	mapp->data = data;
+	mapp->len = st.st_size;
+	mapp->mapped = 1;
+	return 0;
+    }
+#endif
+
+    data = malloc(st.st_size);
+    if (!data) {
+	close(fd);
+	return -1;
+    }
+    while (got < (size_t)st.st_size) {
+	ssize_t res = read(fd, data + got, st.st_size - got);
+	if (res <= 0) break;
+	got += res;
+    }
+    close(fd);
+    mapp->data = data;
+    mapp->len = got;
+    return 0;
+}
+
+/* Release the contents of a file mapped with readotr_map. */
+void readotr_unmap(OtrMappedFile *mapp)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (mapp->mapped) {
+	munmap((void *)mapp->data, mapp->len);
+    } else
+#endif
+    free((void *)mapp->data);
+    mapp->data = NULL;
+    mapp->len = 0;
+    mapp->mapped = 0;
+}
@@ -26,4 +26,29 @@
  * such message could be found. */
 char *readotr(FILE *stream);
 
+/* The contents of a file read with readotr_map */
+typedef struct {
+    const char *data;
+    size_t len;
+    int mapped;		/* Whether data was mmap()ed or malloc()ed */
+} OtrMappedFile;
+
+/* Find the next complete OTR Key Exchange or OTR Data message in the
+ * len bytes at data, starting *offp bytes in.  Return a pointer to the
+ * start of the message (which is not NUL-terminated), and put its
+ * length, including the trailing '.' if there is one, into *msglenp.
+ * *offp is moved past the message.  Returns NULL if there are no more
+ * such messages. */
+const char *readotr_next(const char *data, size_t len, size_t *offp,
+	size_t *msglenp);
+
+/* Map the whole of the named file into memory, filling in *mapp.  If
+ * the file can't be mapped, it is read into a newly-allocated buffer
+ * instead.  Return 0 on success, or -1 (with errno set) on failure.
+ * Release the contents with readotr_unmap. */
+int readotr_map(const char *filename, OtrMappedFile *mapp);
+
+/* Release the contents of a file mapped with readotr_map. */
+void readotr_unmap(OtrMappedFile *mapp);
+
 #endif
@@ -36,6 +36,21 @@ static const char* DH1536_MODULUS_S = "0x"
 static const int DH1536_MOD_LEN_BITS = 1536;
 static const char *DH1536_GENERATOR_S = "0x02";
 
+static gcry_mpi_t DH1536_MODULUS = NULL;
+static gcry_mpi_t DH1536_GENERATOR = NULL;
+
+/* Set up the D-H group once, rather than for every key exchange.  This
+ * is done by sesskeys_gen if need be, but call it before calling
+ * sesskeys_gen from more than one thread. */
+void sesskeys_init(void)
+{
+    if (DH1536_MODULUS) return;
+    gcry_mpi_scan(&DH1536_GENERATOR, GCRYMPI_FMT_HEX,
+	(const unsigned char *)DH1536_GENERATOR_S, 0, NULL);
+    gcry_mpi_scan(&DH1536_MODULUS, GCRYMPI_FMT_HEX,
+	(const unsigned char *)DH1536_MODULUS_S, 0, NULL);
+}
+
 /* Generate the session id and the two encryption keys from our private
  * DH key and their public DH key.  Also indicate in *high_endp if we
  * are the "high" end of the key exchange (set to 1) or the "low" end
@@ -44,22 +59,17 @@ void sesskeys_gen(unsigned char sessionid[20], unsigned char sendenc[16],
 	unsigned char rcvenc[16], int *high_endp, gcry_mpi_t *our_yp,
 	gcry_mpi_t our_x, gcry_mpi_t their_y)
 {
-    gcry_mpi_t modulus, generator, secretv;
+    gcry_mpi_t secretv;
     unsigned char *secret;
     size_t secretlen;
     unsigned char hash[20];
     int is_high;
 
-    gcry_mpi_scan(&modulus, GCRYMPI_FMT_HEX,
-	(const unsigned char *)DH1536_MODULUS_S, 0, NULL);
-    gcry_mpi_scan(&generator, GCRYMPI_FMT_HEX,
-	(const unsigned char *)DH1536_GENERATOR_S, 0, NULL);
+    sesskeys_init();
     *our_yp = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
-    gcry_mpi_powm(*our_yp, generator, our_x, modulus);
+    gcry_mpi_powm(*our_yp, DH1536_GENERATOR, our_x, DH1536_MODULUS);
     secretv = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
-    gcry_mpi_powm(secretv, their_y, our_x, modulus);
-    gcry_mpi_release(generator);
-    gcry_mpi_release(modulus);
+    gcry_mpi_powm(secretv, their_y, our_x, DH1536_MODULUS);
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &secretlen, secretv);
     secret = malloc(secretlen + 5);
 
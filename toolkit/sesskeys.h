@@ -20,6 +20,11 @@
 #ifndef __SESSKEYS_H__
 #define __SESSKEYS_H__
 
+/* Set up the D-H group once, rather than for every key exchange.  This
+ * is done by sesskeys_gen if need be, but call it before calling
+ * sesskeys_gen from more than one thread. */
+void sesskeys_init(void);
+
 /* Generate the session id and the two encryption keys from our private
  * DH key and their public DH key.  Also indicate in *high_endp if we
  * are the "high" end of the key exchange (set to 1) or the "low" end